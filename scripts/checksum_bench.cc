@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Host-side check and benchmark for the network stack's Checksum class.
+ * Compares it against the old 16-bit-at-a-time loop, for correctness on odd
+ * lengths, odd alignments and split buffers, and for speed.
+ *
+ * Build (from the root of the tree) with:
+ *   g++ -O2 -DX64 -DX86_COMMON -DBITS_64 -DLITTLE_ENDIAN -DTHREADS \
+ *       -Isrc/system/include scripts/checksum_bench.cc \
+ *       src/system/kernel/network/Checksum.cc -o checksum_bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <network/Checksum.h>
+
+static uint16_t referenceChecksum(const uint8_t *pData, size_t nBytes)
+{
+    uint32_t sum = 0;
+    for(size_t i = 0; i + 1 < nBytes; i += 2)
+        sum += pData[i] | (pData[i + 1] << 8);
+    if(nBytes & 1)
+        sum += pData[nBytes - 1];
+    while(sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return static_cast<uint16_t>(~sum);
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+int main()
+{
+    const size_t maxSize = 9000;
+    uint8_t *pData = new uint8_t[maxSize + 8];
+    uint8_t *pCopy = new uint8_t[maxSize + 8];
+    for(size_t i = 0; i < maxSize + 8; ++i)
+        pData[i] = rand();
+
+    size_t nFailed = 0;
+    for(int iteration = 0; iteration < 200000; ++iteration)
+    {
+        size_t align = rand() % 8;
+        size_t nBytes = rand() % (maxSize + 1);
+        const uint8_t *p = pData + align;
+        uint16_t expected = referenceChecksum(p, nBytes);
+
+        // In one piece.
+        if(Checksum::calculate(p, nBytes) != expected)
+            ++nFailed;
+
+        // In up to three pieces, the middle one copied as it's summed.
+        size_t a = nBytes ? rand() % (nBytes + 1) : 0;
+        size_t b = a + (nBytes - a ? rand() % (nBytes - a + 1) : 0);
+        size_t copyAlign = rand() % 8;
+        Checksum first, middle;
+        first.add(p, a);
+        middle.copyAndAdd(pCopy + copyAlign, p + a, b - a);
+        first.add(middle);
+        first.add(p + b, nBytes - b);
+        if(first.finish() != expected || memcmp(pCopy + copyAlign, p + a, b - a))
+            ++nFailed;
+    }
+    printf("verification: %s (%lu failures)\n", nFailed ? "FAILED" : "ok", nFailed);
+
+    const size_t sizes[] = {64, 576, 1500, 9000};
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        size_t nBytes = sizes[s];
+        size_t nIterations = (1UL << 30) / nBytes;
+        volatile uint16_t sink = 0;
+
+        double start = now();
+        for(size_t i = 0; i < nIterations; ++i)
+            sink += referenceChecksum(pData, nBytes);
+        double reference = now() - start;
+
+        start = now();
+        for(size_t i = 0; i < nIterations; ++i)
+            sink += Checksum::calculate(pData, nBytes);
+        double fast = now() - start;
+
+        printf("%5lu bytes: 16-bit loop %7.2f MB/s, Checksum %7.2f MB/s (%.1fx)\n",
+               nBytes, (1 << 30) / reference / 1e6, (1 << 30) / fast / 1e6, reference / fast);
+    }
+
+    delete [] pData;
+    delete [] pCopy;
+    return nFailed ? 1 : 0;
+}
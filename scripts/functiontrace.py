@@ -0,0 +1,191 @@
+'''
+Copyright (c) 2008-2014, Pedigree Developers
+
+Please see the CONTRIB file in the root of the source tree for a full
+list of contributors.
+
+Permission to use, copy, modify, and distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+'''
+
+# Converts a function trace, dumped to the second serial line by the kernel
+# debugger's "ftrace dump" command, into folded stacks (for flamegraph.pl) or
+# Chrome trace JSON (for chrome://tracing).
+#
+# Usage: functiontrace.py <serial capture> flame|chrome [output file]
+#
+# The format of the dump is described in src/system/include/utilities/FunctionTracer.h.
+
+from __future__ import print_function
+
+import json
+import struct
+import sys
+
+FTRACE_MAGIC = 0x50465452
+
+class EarlyEof(Exception):
+    pass
+
+class Trace(object):
+    def __init__(self):
+        self.symbols = {}
+        self.events = []
+        self.cycles_per_us = 1.0
+
+    def name(self, addr):
+        return self.symbols.get(addr, '0x%x' % (addr,))
+
+def find_header(data):
+    # The capture may have other output before the dump.
+    for order in ('<', '>'):
+        marker = b'H' + struct.pack(order + 'L', FTRACE_MAGIC)
+        offset = data.find(marker)
+        if offset != -1:
+            return offset, order
+
+    print('No function trace found in the capture.', file=sys.stderr)
+    sys.exit(1)
+
+def load(filename):
+    with open(filename, 'rb') as f:
+        data = f.read()
+
+    offset, order = find_header(data)
+    trace = Trace()
+    state = {'offset': offset}
+
+    def read(fmt):
+        fmt = order + fmt
+        size = struct.calcsize(fmt)
+        if state['offset'] + size > len(data):
+            raise EarlyEof('early EOF hit (probably truncated file)')
+        values = struct.unpack_from(fmt, data, state['offset'])
+        state['offset'] += size
+        return values
+
+    def read_bytes(n):
+        if state['offset'] + n > len(data):
+            raise EarlyEof('early EOF hit (probably truncated file)')
+        b = data[state['offset']:state['offset'] + n]
+        state['offset'] += n
+        return b
+
+    ptr = 'L'
+    try:
+        while True:
+            fieldtype = read_bytes(1)
+            if fieldtype == b'H':
+                magic, version, ptrsize = read('LLL')
+                ptr = 'Q' if ptrsize == 8 else 'L'
+                start_ts, start_ms, end_ts, end_ms = read('QQQQ')
+                if end_ms > start_ms and end_ts > start_ts:
+                    trace.cycles_per_us = (end_ts - start_ts) / ((end_ms - start_ms) * 1000.0)
+            elif fieldtype == b'S':
+                addr, length = read(ptr + 'H')
+                trace.symbols[addr] = read_bytes(length).decode('ascii', 'replace')
+            elif fieldtype == b'C':
+                cpu, count = read('LL')
+                for _ in range(count):
+                    ts, func, site, thread, evcpu, evtype, _pad = read('Q' + ptr + ptr + 'LHBB')
+                    trace.events.append((ts, evcpu, thread, chr(evtype), func, site))
+            elif fieldtype == b'Z':
+                break
+            else:
+                print('Invalid field type %r encountered at offset %d!' % (fieldtype, state['offset'] - 1), file=sys.stderr)
+                sys.exit(1)
+    except EarlyEof as e:
+        print('Warning: %s' % (e,), file=sys.stderr)
+
+    # Processors each dump their own ring; put everything back in time order.
+    trace.events.sort(key=lambda e: e[0])
+    print('Loaded %d events and %d symbols' % (len(trace.events), len(trace.symbols)), file=sys.stderr)
+    return trace
+
+def walk(trace, on_exit):
+    """Rebuilds each thread's call stack, calling on_exit(thread, stack, frame,
+    end) as each frame finishes. Frames are [function, start, child time].
+    Exits from before the trace started are ignored, and frames still open at
+    the end are closed at the last event."""
+    stacks = {}
+    for ts, cpu, thread, evtype, func, site in trace.events:
+        stack = stacks.setdefault(thread, [])
+        if evtype == 'E':
+            stack.append([func, ts, 0])
+            continue
+
+        # Frames missed (dropped events) are closed along with their caller.
+        if not any(frame[0] == func for frame in stack):
+            continue
+        while stack:
+            frame = stack.pop()
+            on_exit(thread, stack, frame, ts)
+            if stack:
+                stack[-1][2] += ts - frame[1]
+            if frame[0] == func:
+                break
+
+    if trace.events:
+        last = trace.events[-1][0]
+        for thread, stack in stacks.items():
+            while stack:
+                frame = stack.pop()
+                on_exit(thread, stack, frame, last)
+                if stack:
+                    stack[-1][2] += last - frame[1]
+
+def flame(trace, out):
+    folded = {}
+
+    def on_exit(thread, stack, frame, end):
+        # Weighted by self time, in nanoseconds.
+        self_time = (end - frame[1] - frame[2]) * 1000.0 / trace.cycles_per_us
+        names = ['thread %d' % (thread,)] + [trace.name(f[0]) for f in stack] + [trace.name(frame[0])]
+        key = ';'.join(n.replace(';', ':') for n in names)
+        folded[key] = folded.get(key, 0) + self_time
+
+    walk(trace, on_exit)
+    for key in sorted(folded):
+        out.write('%s %d\n' % (key, max(1, int(folded[key]))))
+
+def chrome(trace, out):
+    events = []
+    base = trace.events[0][0] if trace.events else 0
+
+    def on_exit(thread, stack, frame, end):
+        events.append({
+            'name': trace.name(frame[0]),
+            'cat': 'function',
+            'ph': 'X',
+            'ts': (frame[1] - base) / trace.cycles_per_us,
+            'dur': (end - frame[1]) / trace.cycles_per_us,
+            'pid': 0,
+            'tid': thread,
+        })
+
+    walk(trace, on_exit)
+    json.dump({'traceEvents': events, 'displayTimeUnit': 'ns'}, out)
+
+def main():
+    if len(sys.argv) < 3 or sys.argv[2] not in ('flame', 'chrome'):
+        print('Usage: %s <serial capture> flame|chrome [output file]' % (sys.argv[0],), file=sys.stderr)
+        sys.exit(1)
+
+    trace = load(sys.argv[1])
+    out = open(sys.argv[3], 'w') if len(sys.argv) > 3 else sys.stdout
+    if sys.argv[2] == 'flame':
+        flame(trace, out)
+    else:
+        chrome(trace, out)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,172 @@
+'''
+Copyright (c) 2008-2014, Pedigree Developers
+
+Please see the CONTRIB file in the root of the source tree for a full
+list of contributors.
+
+Permission to use, copy, modify, and distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+'''
+
+# Minimal LZ4 frame compressor, so compressed initrds don't need the lz4 tool
+# or Python bindings on the build host. Greedy single-probe matching: the
+# output is a little bigger than `lz4 -9` but decodes with any LZ4 decoder.
+
+import struct
+
+
+FRAME_MAGIC = 0x184D2204
+
+MIN_MATCH = 4
+MAX_OFFSET = 0xFFFF
+
+# The last match must start at least 12 bytes before the end of the block,
+# and the last 5 bytes are always literals (LZ4 block format rules).
+MF_LIMIT = 12
+LAST_LITERALS = 5
+
+HASH_BITS = 16
+
+# 4 MiB blocks (BD = 7).
+BLOCK_SIZE = 4 * 1024 * 1024
+BLOCK_SIZE_ID = 7
+
+PRIME32_1 = 2654435761
+PRIME32_2 = 2246822519
+PRIME32_3 = 3266489917
+PRIME32_4 = 668265263
+PRIME32_5 = 374761393
+
+
+def _rotl32(x, r):
+    return ((x << r) | (x >> (32 - r))) & 0xFFFFFFFF
+
+
+def xxh32(data, seed=0):
+    '''xxHash32, needed for the frame header checksum.'''
+    data = bytearray(data)
+    n = len(data)
+    i = 0
+    if n >= 16:
+        v1 = (seed + PRIME32_1 + PRIME32_2) & 0xFFFFFFFF
+        v2 = (seed + PRIME32_2) & 0xFFFFFFFF
+        v3 = seed & 0xFFFFFFFF
+        v4 = (seed - PRIME32_1) & 0xFFFFFFFF
+        while i + 16 <= n:
+            lanes = struct.unpack_from('<4I', data, i)
+            v1 = (_rotl32((v1 + lanes[0] * PRIME32_2) & 0xFFFFFFFF, 13) * PRIME32_1) & 0xFFFFFFFF
+            v2 = (_rotl32((v2 + lanes[1] * PRIME32_2) & 0xFFFFFFFF, 13) * PRIME32_1) & 0xFFFFFFFF
+            v3 = (_rotl32((v3 + lanes[2] * PRIME32_2) & 0xFFFFFFFF, 13) * PRIME32_1) & 0xFFFFFFFF
+            v4 = (_rotl32((v4 + lanes[3] * PRIME32_2) & 0xFFFFFFFF, 13) * PRIME32_1) & 0xFFFFFFFF
+            i += 16
+        h = (_rotl32(v1, 1) + _rotl32(v2, 7) + _rotl32(v3, 12) + _rotl32(v4, 18)) & 0xFFFFFFFF
+    else:
+        h = (seed + PRIME32_5) & 0xFFFFFFFF
+
+    h = (h + n) & 0xFFFFFFFF
+
+    while i + 4 <= n:
+        (lane,) = struct.unpack_from('<I', data, i)
+        h = (_rotl32((h + lane * PRIME32_3) & 0xFFFFFFFF, 17) * PRIME32_4) & 0xFFFFFFFF
+        i += 4
+
+    while i < n:
+        h = (_rotl32((h + data[i] * PRIME32_5) & 0xFFFFFFFF, 11) * PRIME32_1) & 0xFFFFFFFF
+        i += 1
+
+    h ^= h >> 15
+    h = (h * PRIME32_2) & 0xFFFFFFFF
+    h ^= h >> 13
+    h = (h * PRIME32_3) & 0xFFFFFFFF
+    h ^= h >> 16
+    return h
+
+
+def _length(out, n):
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+
+def _sequence(out, data, anchor, litlen, offset, matchlen):
+    token = min(litlen, 15) << 4
+    if matchlen is not None:
+        token |= min(matchlen - MIN_MATCH, 15)
+    out.append(token)
+    if litlen >= 15:
+        _length(out, litlen - 15)
+    out.extend(data[anchor:anchor + litlen])
+    if matchlen is not None:
+        out.extend(struct.pack('<H', offset))
+        if matchlen - MIN_MATCH >= 15:
+            _length(out, matchlen - MIN_MATCH - 15)
+
+
+def compress_block(data):
+    '''Compresses one block (independent of any other).'''
+    data = bytearray(data)
+    n = len(data)
+    out = bytearray()
+    table = {}
+
+    anchor = 0
+    i = 0
+    limit = n - MF_LIMIT
+    while i < limit:
+        seq = bytes(data[i:i + MIN_MATCH])
+        candidate = table.get(seq)
+        table[seq] = i
+        if candidate is None or i - candidate > MAX_OFFSET:
+            i += 1
+            continue
+
+        # Extend the match forwards, stopping short of the final literals.
+        matchlen = MIN_MATCH
+        end = n - LAST_LITERALS
+        while i + matchlen < end and data[candidate + matchlen] == data[i + matchlen]:
+            matchlen += 1
+
+        _sequence(out, data, anchor, i - anchor, i - candidate, matchlen)
+        i += matchlen
+        anchor = i
+
+    _sequence(out, data, anchor, n - anchor, None, None)
+    return out
+
+
+def compress_frame(data):
+    '''Compresses data into a complete LZ4 frame, with its content size.'''
+    data = bytearray(data)
+
+    # Version 1, independent blocks, content size present.
+    flg = (1 << 6) | (1 << 5) | (1 << 3)
+    bd = BLOCK_SIZE_ID << 4
+    descriptor = struct.pack('<BBQ', flg, bd, len(data))
+
+    out = bytearray(struct.pack('<I', FRAME_MAGIC))
+    out.extend(descriptor)
+    out.append((xxh32(descriptor) >> 8) & 0xFF)
+
+    for start in range(0, len(data), BLOCK_SIZE):
+        raw = data[start:start + BLOCK_SIZE]
+        block = compress_block(raw)
+        if len(block) >= len(raw):
+            out.extend(struct.pack('<I', len(raw) | 0x80000000))
+            out.extend(raw)
+        else:
+            out.extend(struct.pack('<I', len(block)))
+            out.extend(block)
+
+    # EndMark.
+    out.extend(struct.pack('<I', 0))
+    return bytes(out)
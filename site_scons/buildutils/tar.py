@@ -22,10 +22,12 @@ import os
 import shutil
 import subprocess
 import tarfile
+import tempfile
 
 import SCons
 
 from buildutils.patcher import Patcher
+from buildutils import lz4
 
 
 def Extract(target, source, env):
@@ -48,15 +50,44 @@ def Create(target, source, env):
     subprocess.check_call(args)
     return None
 
+def CreateLz4(target, source, env):
+    # Each member is its own LZ4 frame so the kernel can index the tar headers
+    # and decompress members one at a time as they're needed.
+    tmpdir = tempfile.mkdtemp()
+    try:
+        members = []
+        for x in source:
+            with open(x.abspath, 'rb') as f:
+                data = f.read()
+
+            member = os.path.join(tmpdir, os.path.basename(x.abspath))
+            with open(member, 'wb') as f:
+                f.write(lz4.compress_frame(data))
+            members.append(member)
+
+        # No outer gzip: the members are already compressed.
+        args = [env['TAR'], '--transform', 's,.*/,,g', '-cPf', target[0].abspath]
+        args.extend(members)
+
+        subprocess.check_call(args)
+    finally:
+        shutil.rmtree(tmpdir)
+
+    return None
+
 def generate(env):
     untar_action = SCons.Action.Action(Extract, env.get('TARXCOMSTR'))
     tar_action = SCons.Action.Action(Create, env.get('TARCOMSTR'))
+    lz4tar_action = SCons.Action.Action(CreateLz4, env.get('TARCOMSTR'))
 
     untar_builder = env.Builder(action=untar_action, target_factory=env.Dir,
         source_factory=env.File)
     tar_builder = env.Builder(action=tar_action, target_factory=env.Dir,
         source_factory=env.File)
+    lz4tar_builder = env.Builder(action=lz4tar_action, target_factory=env.Dir,
+        source_factory=env.File)
 
     env.Append(BUILDERS={
         'ExtractAndPatchTar': untar_builder,
-        'CreateTar': tar_builder})
+        'CreateTar': tar_builder,
+        'CreateLz4Tar': lz4tar_builder})
@@ -68,6 +68,7 @@
 #include <machine/Network.h>
 #include <network-stack/NetworkStack.h>
 #include <processor/Processor.h>
+#include <LockGuard.h>
 #include <process/Scheduler.h>
 #include <machine/IrqManager.h>
 
@@ -260,9 +261,12 @@ bool Nic3C90x::send(size_t nBytes, uintptr_t buffer)
         m_pBase->read16(regCommandIntStatus_w);
         while (m_pBase->read16(regCommandIntStatus_w) & INT_CMDINPROGRESS);
 
+        // DMA straight out of the caller's buffer if it's all in one page,
+        // otherwise it has to be copied to somewhere physically contiguous.
         physical_uintptr_t destPtr = m_pTxBuffPhys;
         size_t dud = 0;
-        if (Processor::information().getVirtualAddressSpace().isMapped(reinterpret_cast<void*>(buffer)))
+        if (((buffer & 0xFFF) + nBytes) <= 0x1000 &&
+            Processor::information().getVirtualAddressSpace().isMapped(reinterpret_cast<void*>(buffer)))
         {
             Processor::information().getVirtualAddressSpace().getMapping(reinterpret_cast<void*>(buffer), destPtr, dud);
             destPtr += buffer & 0xFFF;
@@ -297,12 +301,22 @@ bool Nic3C90x::send(size_t nBytes, uintptr_t buffer)
     return false;
 }
 
+bool Nic3C90x::sendBuffer(NetworkBuffer *pBuffer)
+{
+    // A linear buffer can be handed to the card as it is (see send()), which
+    // is the usual case as the stack prepends its headers in place.
+    if (!pBuffer->linearise())
+        return false;
+
+    return send(pBuffer->getLength(), pBuffer->getBuffer());
+}
+
 Nic3C90x::Nic3C90x(Network* pDev) :
         Network(pDev), m_pBase(0), m_isBrev(0), m_CurrentWindow(0),
         m_pRxBuffVirt(0), m_pTxBuffVirt(0), m_pRxBuffPhys(0), m_pTxBuffPhys(0),
         m_RxBuffMR("3c90x-rxbuffer"), m_TxBuffMR("3c90x-txbuffer"),
         m_pDPD(0), m_DPDMR("3c90x-dpd"), m_pUPD(0), m_UPDMR("3c90x-upd"),
-        m_TransmitDPD(0), m_ReceiveUPD(0), m_RxMutex(0), m_TxMutex(0), m_PendingPackets()
+        m_TransmitDPD(0), m_ReceiveUPD(0), m_NextUpd(0), m_IntMask(ENABLED_INTS), m_IntLock(), m_TxMutex(0)
 {
     setSpecificType(String("3c90x-card"));
 
@@ -349,7 +363,7 @@ Nic3C90x::Nic3C90x(Network* pDev) :
     for (size_t iUpd = 0; iUpd < NUM_UPDS; iUpd++)
     {
         if ((iUpd + 1) == NUM_UPDS)
-            m_ReceiveUPD[iUpd].UpNextPtr = 0;
+            m_ReceiveUPD[iUpd].UpNextPtr = m_pUPD;
         else
             m_ReceiveUPD[iUpd].UpNextPtr = m_pUPD + ((iUpd + 1) * sizeof(RXD));
         m_ReceiveUPD[iUpd].UpPktStatus = 0;
@@ -564,13 +578,8 @@ Nic3C90x::Nic3C90x(Network* pDev) :
     // Set the location for the UPD
     m_pBase->write32(m_pUPD, regUpListPtr_l);
 
-    // register the packet queue handler
-#ifdef THREADS
-    Thread *pThread = new Thread(Processor::information().getCurrentThread()->getParent(),
-                                 reinterpret_cast<Thread::ThreadStartFunc> (&trampoline),
-                                 reinterpret_cast<void*> (this));
-    pThread->detach();
-#endif
+    // received packets are picked up by polling the UPD ring
+    enablePolling();
 
     // install the IRQ
     Machine::instance().getIrqManager()->registerIsaIrqHandler(getInterruptNumber(), static_cast<IrqHandler*>(this));
@@ -581,58 +590,65 @@ Nic3C90x::~Nic3C90x()
 {
 }
 
-int Nic3C90x::trampoline(void *p)
+size_t Nic3C90x::poll(size_t budget)
 {
-    Nic3C90x *pNic = reinterpret_cast<Nic3C90x*> (p);
-    pNic->receiveThread();
-    return 0;
-}
-
-void Nic3C90x::receiveThread()
-{
-    while (true)
+    size_t nPackets = 0;
+    while (nPackets < budget)
     {
-        m_RxMutex.acquire();
-
-        // When we come here, the UpListPtr register will hold the *next* UPD...
-        // What we want is the one that it used! That's ok, it's not difficult
-        // to find that out...
-        // However, if the next is zero, the IRQ notified us of the *last* UPD in
-        // the list. That needs to be handled properly too.
-        uintptr_t currUpdPhys = reinterpret_cast<uintptr_t>(m_PendingPackets.popFront());
-        uintptr_t myNum;
-        if (currUpdPhys != 0)
+        RXD *pUpd = &m_ReceiveUPD[m_NextUpd];
+        uint32_t status = *reinterpret_cast<volatile uint32_t*>(&pUpd->UpPktStatus);
+        if (!(status & UP_COMPLETE))
+            break;
+
+        if (status & UP_ERROR)
         {
-            uintptr_t myOffset = (currUpdPhys - m_pUPD);
-            myNum = (myOffset / sizeof(RXD)) - 1;
+            ERROR("3C90x: error, UpPktStatus = " << status << ".");
+            badPacket();
         }
         else
-            myNum = NUM_UPDS - 1;
-        RXD *usedUpd = &m_ReceiveUPD[myNum];
-
-        if (usedUpd->UpPktStatus & (1 << 14))
         {
-            // an error occurred
-            ERROR("3C90x: error, UpPktStatus = " << usedUpd->UpPktStatus << ".");
-            return;
-        }
+            size_t packLen = status & UP_PKTLENGTH;
 
-        size_t packLen = usedUpd->UpPktStatus & 0x1FFF;
-
-        NetworkStack::instance().receive(packLen, reinterpret_cast<uintptr_t>(m_pRxBuffVirt + (myNum * 1536)), this, 0);
+            // Copy out of the UPD's buffer so it can go straight back to the card;
+            // the stack then passes this buffer up without copying it again.
+            NetworkBuffer *pBuffer = NetworkStack::instance().allocateBuffer(packLen, NETWORK_BUFFER_HEADROOM, false);
+            if (pBuffer)
+            {
+                memcpy(pBuffer->put(packLen), m_pRxBuffVirt + (m_NextUpd * 1536), packLen);
+                NetworkStack::instance().receive(pBuffer, this);
+            }
+            else
+            {
+                gotPacket();
+                droppedPacket();
+            }
+        }
 
         // reset the UPD's status so it can be used again
-        usedUpd->UpPktStatus = 0;
-
-        // Reset the location for the UPD, if we're stalling
-        if (currUpdPhys == 0)
-            m_pBase->write32(m_pUPD, regUpListPtr_l);
+        pUpd->UpPktStatus = 0;
+        m_NextUpd = (m_NextUpd + 1) % NUM_UPDS;
+        ++nPackets;
     }
+
+    // The card stalls if it runs into a UPD we haven't given back yet, so
+    // nudge it now there's room again.
+    if (nPackets)
+        issueCommand(cmdStallCtl, STALL_UPUNSTALL);
+
+    return nPackets;
 }
 
+void Nic3C90x::enableRxInterrupts()
+{
+    LockGuard<Spinlock> guard(m_IntLock);
+    m_IntMask |= INT_UPCOMPLETE;
+    issueCommand(cmdSetInterruptEnable, m_IntMask);
+}
 
 bool Nic3C90x::irq(irq_id_t number, InterruptState &state)
 {
+    gotInterrupt();
+
     // disable interrupts
     issueCommand(cmdSetInterruptEnable, 0);
 
@@ -650,9 +666,11 @@ bool Nic3C90x::irq(irq_id_t number, InterruptState &state)
         // handle...
         if (status & INT_UPCOMPLETE)
         {
-            void *currPhys = reinterpret_cast<void*>(m_pBase->read32(regUpListPtr_l));
-            m_PendingPackets.pushBack(currPhys);
-            m_RxMutex.release();
+            // no more receive interrupts until the poll has emptied the ring
+            m_IntLock.acquire();
+            m_IntMask &= ~INT_UPCOMPLETE;
+            m_IntLock.release();
+            schedulePoll();
         }
 
         if (status & INT_TXCOMPLETE)
@@ -712,7 +730,9 @@ bool Nic3C90x::irq(irq_id_t number, InterruptState &state)
     }
 
     // Re-enable interrupts
-    issueCommand(cmdSetInterruptEnable, ENABLED_INTS);
+    m_IntLock.acquire();
+    issueCommand(cmdSetInterruptEnable, m_IntMask);
+    m_IntLock.release();
 
     /*
     XL_SEL_WIN(7);
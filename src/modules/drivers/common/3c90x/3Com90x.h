@@ -29,9 +29,8 @@
 #include <processor/MemoryRegion.h>
 #include <processor/PhysicalMemoryManager.h>
 #include <machine/IrqHandler.h>
-#include <process/Thread.h>
 #include <process/Semaphore.h>
-#include <utilities/List.h>
+#include <Spinlock.h>
 
 /** Device driver for the Nic3C90x class of network device */
 class Nic3C90x : public Network, public IrqHandler
@@ -47,6 +46,8 @@ class Nic3C90x : public Network, public IrqHandler
 
         virtual bool send(size_t nBytes, uintptr_t buffer);
 
+        virtual bool sendBuffer(NetworkBuffer *pBuffer);
+
         virtual bool setStationInfo(StationInfo info);
 
         virtual StationInfo getStationInfo();
@@ -56,6 +57,12 @@ class Nic3C90x : public Network, public IrqHandler
 
         IoBase *m_pBase;
 
+    protected:
+
+        virtual size_t poll(size_t budget);
+
+        virtual void enableRxInterrupts();
+
     private:
 
         int issueCommand(int cmd, int param);
@@ -67,10 +74,6 @@ class Nic3C90x : public Network, public IrqHandler
         int writeEepromWord(int address, uint16_t value);
         int writeEeprom(int address, uint16_t value);
 
-        static int trampoline(void* p);
-
-        void receiveThread();
-
         void reset();
 
         /** Local NIC information */
@@ -116,10 +119,15 @@ class Nic3C90x : public Network, public IrqHandler
         Nic3C90x(const Nic3C90x&);
         void operator =(const Nic3C90x&);
 
-        Semaphore m_RxMutex;
-        Semaphore m_TxMutex;
+        /** The next UPD the card will fill. The UPDs form a ring. */
+        size_t m_NextUpd;
 
-        List<void*> m_PendingPackets;
+        /** Interrupts to enable when the IRQ handler is done - UpComplete is
+          * left out while the receive ring is being polled. */
+        uint16_t m_IntMask;
+        Spinlock m_IntLock;
+
+        Semaphore m_TxMutex;
 };
 
 #endif
@@ -203,4 +203,15 @@ enum Commands
 
 #define ENABLED_INTS (INT_UPCOMPLETE | INT_UPDATESTATS | INT_HOSTERROR | INT_DNCOMPLETE | INT_TXCOMPLETE | INT_INTERRUPTLATCH)
 
+/*** Parameters for cmdStallCtl ***/
+#define STALL_UPSTALL       0
+#define STALL_UPUNSTALL     1
+#define STALL_DNSTALL       2
+#define STALL_DNUNSTALL     3
+
+/*** UpPktStatus bits ***/
+#define UP_PKTLENGTH        0x1FFF
+#define UP_ERROR            (1<<14)
+#define UP_COMPLETE         (1<<15)
+
 #endif
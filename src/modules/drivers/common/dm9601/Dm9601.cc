@@ -154,14 +154,11 @@ void Dm9601::receiveThread()
         m_IncomingPackets.acquire();
 
         m_RxPacketQueueLock.acquire();
-        Packet *pPacket = m_RxPacketQueue.popFront();
+        NetworkBuffer *pBuffer = m_RxPacketQueue.popFront();
         m_RxPacketQueueLock.release();
 
-        NetworkStack::instance().receive(pPacket->len, pPacket->buffer + pPacket->offset, this, 0);
-
-        delete pPacket;
-
-        NetworkStack::instance().getMemPool().free(pPacket->buffer);
+        // The stack takes over the buffer
+        NetworkStack::instance().receive(pBuffer, this);
     }
 }
 
@@ -172,6 +169,17 @@ void Dm9601::receiveLoop()
 }
 
 bool Dm9601::send(size_t nBytes, uintptr_t buffer)
+{
+    NetworkBuffer *pBuffer = NetworkStack::instance().allocateBuffer(nBytes);
+    memcpy(pBuffer->put(nBytes), reinterpret_cast<void*>(buffer), nBytes);
+
+    bool bResult = sendBuffer(pBuffer);
+
+    pBuffer->release();
+    return bResult;
+}
+
+bool Dm9601::sendBuffer(NetworkBuffer *pBuffer)
 {
     // Don't let anything else get in our way here
     LockGuard<Mutex> guard(m_TxLock);
@@ -184,28 +192,42 @@ bool Dm9601::send(size_t nBytes, uintptr_t buffer)
         readRegister(NetworkStatus, reinterpret_cast<uintptr_t>(p), 1);
     }
 
+    if(!pBuffer->linearise())
+    {
+        delete p;
+        return false;
+    }
+
     // Avoid runt packets
-    size_t padBytes = 0;
+    size_t nBytes = pBuffer->getLength();
     if(nBytes < 64)
     {
-        padBytes = nBytes % 64;
-        memset(reinterpret_cast<void*>(buffer + nBytes), 0, padBytes);
+        uint8_t *pPad = pBuffer->put(64 - nBytes);
+        if(pPad)
+            memset(pPad, 0, 64 - nBytes);
 
         nBytes = 64;
     }
 
     size_t txSize = nBytes + 2;
 
+    // The length goes in front of the packet, in the buffer's headroom
+    uint8_t *pHeader = pBuffer->push(2);
+    if(!pHeader)
+    {
+        delete p;
+        return false;
+    }
+    *reinterpret_cast<uint16_t*>(pHeader) = HOST_TO_LITTLE16(static_cast<uint16_t>(nBytes));
+
     if(!(txSize % 64))
+    {
+        pBuffer->put(1);
         txSize++;
+    }
 
     // Transmit endpoint
-    uint8_t *pBuffer = new uint8_t[txSize];
-    *reinterpret_cast<uint16_t*>(pBuffer) = HOST_TO_LITTLE16(static_cast<uint16_t>(nBytes));
-    memcpy(&pBuffer[2], reinterpret_cast<void*>(buffer), nBytes);
-
-    ssize_t ret = syncOut(m_pOutEndpoint, reinterpret_cast<uintptr_t>(pBuffer), txSize);
-    delete [] pBuffer;
+    ssize_t ret = syncOut(m_pOutEndpoint, pBuffer->getBuffer(), txSize);
 
     // Grab the TX status register so we can find errors
     readRegister(TxStatus1 + m_TxPacket, reinterpret_cast<uintptr_t>(p), 1);
@@ -215,6 +237,8 @@ bool Dm9601::send(size_t nBytes, uintptr_t buffer)
     // Read and clear the network status (which will contain the "packet complete" indicator)
     readRegister(NetworkStatus, reinterpret_cast<uintptr_t>(p), 1);
 
+    delete p;
+
     return ret >= 0;
 }
 
@@ -222,35 +246,35 @@ bool Dm9601::send(size_t nBytes, uintptr_t buffer)
 
 void Dm9601::doReceive()
 {
-    uintptr_t buff = NetworkStack::instance().getMemPool().allocate();
-    ssize_t ret = syncIn(m_pInEndpoint, buff, MAX_MTU, 0); // Never time out.
+    // The card's 3-byte header and the frame are read straight into the
+    // buffer, which then goes up the stack without being copied.
+    NetworkBuffer *pBuffer = NetworkStack::instance().allocateBuffer(MAX_MTU);
+    uint8_t *pData = pBuffer->put(MAX_MTU);
+    ssize_t ret = syncIn(m_pInEndpoint, reinterpret_cast<uintptr_t>(pData), MAX_MTU, 0); // Never time out.
 
     if(ret < 0)
     {
         WARNING("dm9601: rx failure due to USB error: " << ret);
-        NetworkStack::instance().getMemPool().free(buff);
+        pBuffer->release();
         return;
     }
 
-    uint8_t *pBuffer = reinterpret_cast<uint8_t*>(buff);
-    uint8_t rxstatus = pBuffer[0];
-    uint16_t len = LITTLE_TO_HOST16(*reinterpret_cast<uint16_t*>(&pBuffer[1])) - 4;
+    uint8_t rxstatus = pData[0];
+    uint16_t len = LITTLE_TO_HOST16(*reinterpret_cast<uint16_t*>(&pData[1])) - 4;
 
-    if(rxstatus & 0x3F)
+    if((rxstatus & 0x3F) || (len > (MAX_MTU - 3)))
     {
         WARNING("dm9601: rx failure: " << rxstatus << ", length was " << len);
-        NetworkStack::instance().getMemPool().free(buff);
+        pBuffer->release();
         badPacket();
         return;
     }
 
-    Packet *pPacket = new Packet;
-    pPacket->buffer = buff;
-    pPacket->len = len;
-    pPacket->offset = 3;
+    pBuffer->pull(3);
+    pBuffer->trim(len);
 
     m_RxPacketQueueLock.acquire();
-    m_RxPacketQueue.pushBack(pPacket);
+    m_RxPacketQueue.pushBack(pBuffer);
     m_RxPacketQueueLock.release();
 
     m_IncomingPackets.release();
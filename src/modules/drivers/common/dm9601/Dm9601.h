@@ -50,6 +50,8 @@ class Dm9601 : public UsbDevice, public Network
 
         virtual bool send(size_t nBytes, uintptr_t buffer);
 
+        virtual bool sendBuffer(NetworkBuffer *pBuffer);
+
         virtual bool setStationInfo(StationInfo info);
 
         virtual StationInfo getStationInfo();
@@ -172,13 +174,7 @@ class Dm9601 : public UsbDevice, public Network
         Semaphore m_IncomingPackets;
 
         /** Packet queue */
-        struct Packet
-        {
-            uintptr_t buffer;
-            size_t len;
-            uint32_t offset;
-        };
-        List<Packet*> m_RxPacketQueue;
+        List<NetworkBuffer*> m_RxPacketQueue;
         Spinlock m_RxPacketQueueLock;
 
         /** Internal state: which TX packet are we on at the moment */
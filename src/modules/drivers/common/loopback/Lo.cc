@@ -76,6 +76,20 @@ bool Loopback::send(size_t nBytes, uintptr_t buffer)
     return true;
 }
 
+bool Loopback::sendBuffer(NetworkBuffer *pBuffer)
+{
+    if(pBuffer->getTotalLength() > 0xffff)
+    {
+        ERROR("Loopback: Attempt to send a packet with size > 64 KB");
+        return false;
+    }
+
+    // The packet goes straight back up the stack: a clone shares the data
+    // with the sender rather than copying it.
+    NetworkStack::instance().receive(pBuffer->clone(), this);
+    return true;
+}
+
 bool Loopback::setStationInfo(StationInfo info)
 {
     // Nothing here is modifiable
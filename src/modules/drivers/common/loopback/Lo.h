@@ -51,6 +51,8 @@ public:
 
   virtual bool send(size_t nBytes, uintptr_t buffer);
 
+  virtual bool sendBuffer(NetworkBuffer *pBuffer);
+
   virtual bool setStationInfo(StationInfo info);
 
   virtual StationInfo getStationInfo();
@@ -29,7 +29,7 @@
 
 
 Rtl8139::Rtl8139(Network* pDev) :
-    Network(pDev), m_pBase(0), m_StationInfo(), m_RxCurr(0), m_TxCurr(0), m_RxLock(false), m_TxLock(), m_pRxBuffVirt(0), m_pTxBuffVirt(0),
+    Network(pDev), m_pBase(0), m_RxCurr(0), m_TxCurr(0), m_RxLock(), m_TxLock(), m_pRxBuffVirt(0), m_pTxBuffVirt(0),
     m_pRxBuffPhys(0), m_pTxBuffPhys(0), m_RxBuffMR("rtl8139-rxbuffer"), m_TxBuffMR("rtl8139-txbuffer")
 {
     setSpecificType(String("rtl8139-card"));
@@ -70,6 +70,7 @@ Rtl8139::Rtl8139(Network* pDev) :
     m_StationInfo.mac[5] << ".");
 
     // install the IRQ and register the NIC in the stack
+    enablePolling();
     Machine::instance().getIrqManager()->registerIsaIrqHandler(getInterruptNumber(), static_cast<IrqHandler *>(this));
     NetworkStack::instance().registerDevice(this);
 }
@@ -130,7 +131,6 @@ void Rtl8139::reset()
     // enable all good irqs
     m_pBase->write16(RTL_IMR_RXOK | RTL_IMR_RXERR, RTL_IMR);
     m_pBase->write16(0xffff, RTL_ISR);
-    m_RxLock = false;
     NOTICE("RTL8139: Reset");
 }
 
@@ -144,8 +144,32 @@ bool Rtl8139::send(size_t nBytes, uintptr_t buffer)
         return false;
     }
 
-    // copy to the buffer and pad the packet
+    // copy to the buffer
     memcpy(m_pTxBuffVirt, reinterpret_cast<void *>(buffer), nBytes);
+    transmit(nBytes);
+    return true;
+}
+
+bool Rtl8139::sendBuffer(NetworkBuffer *pBuffer)
+{
+    LockGuard<Spinlock> guard(m_TxLock);
+
+    size_t nBytes = pBuffer->getTotalLength();
+    if(nBytes > RTL_PACK_MAX)
+    {
+        ERROR("RTL8139: Attempt to send a packet with size > 64 KB");
+        return false;
+    }
+
+    // gather the packet straight into the buffer
+    pBuffer->copyOut(0, m_pTxBuffVirt, nBytes);
+    transmit(nBytes);
+    return true;
+}
+
+void Rtl8139::transmit(size_t nBytes)
+{
+    // pad the packet
     for(int i = nBytes;i < RTL_BUFF_SIZE;i++)
         m_pTxBuffVirt[i] = 0;
 
@@ -156,13 +180,11 @@ bool Rtl8139::send(size_t nBytes, uintptr_t buffer)
     // next descriptor, or go to 0 if 4 or more
     m_TxCurr++;
     m_TxCurr %= 4;
-    return true;
 }
 
-void Rtl8139::recv()
+bool Rtl8139::recv(NetworkBuffer *&pBuffer)
 {
-    while(m_RxLock);
-    m_RxLock = true;
+    pBuffer = 0;
 
     // get the address of the start of the packet;
     uintptr_t rxPacket = reinterpret_cast<uintptr_t>(m_pRxBuffVirt + m_RxCurr);
@@ -175,18 +197,22 @@ void Rtl8139::recv()
     {
         WARNING("RTL8139: Bad packet: len: " << length << ", status: " << status << "!");
         reset();
-        return;
+        return false;
     }
-    // create packet buffer, needed later
-    uint8_t *packBuff = new uint8_t[length - 4];
+    // grab a buffer for the packet, the only copy it gets on its way up
+    pBuffer = NetworkStack::instance().allocateBuffer(length - 4, NETWORK_BUFFER_HEADROOM, false);
+    uint8_t *packBuff = pBuffer ? pBuffer->put(length - 4) : 0;
 
     // check if passing over the end of the buffer
     if(m_RxCurr + length > RTL_BUFF_SIZE)
     {
         // copy first the part of the packet until the end of the buffer and then the rest of it, at the beginning of the buffer
         uint32_t left = RTL_BUFF_SIZE - (m_RxCurr + 4);
-        memcpy(packBuff, reinterpret_cast<void *>(rxPacket + 4), left);
-        memcpy(&packBuff[left], m_pRxBuffVirt, length - 4 - left);
+        if(packBuff)
+        {
+            memcpy(packBuff, reinterpret_cast<void *>(rxPacket + 4), left);
+            memcpy(&packBuff[left], m_pRxBuffVirt, length - 4 - left);
+        }
 
         // adjust current offset
         m_RxCurr = (length - left + 3) & ~3;
@@ -194,7 +220,8 @@ void Rtl8139::recv()
     else
     {
         // copy the packet
-        memcpy(packBuff, reinterpret_cast<void *>(rxPacket + 4), length-4);
+        if(packBuff)
+            memcpy(packBuff, reinterpret_cast<void *>(rxPacket + 4), length-4);
 
         // adjust current offset
         m_RxCurr = (m_RxCurr + length + 4 + 3) & ~3;
@@ -202,10 +229,51 @@ void Rtl8139::recv()
     // adjust current offset (it never should be over the buffer's size)
     m_RxCurr %= RTL_BUFF_SIZE;
 
-    // send the packet to the stack
-    NetworkStack::instance().receive(length-4, reinterpret_cast<uintptr_t>(packBuff), this, 0);
+    // tell the card how far we've read (it expects this 16 bytes behind)
+    m_pBase->write16(static_cast<uint16_t>(m_RxCurr - 16), RTL_RXCURR);
+
+    return true;
+}
+
+size_t Rtl8139::poll(size_t budget)
+{
+    size_t nFrames = 0;
+    while(nFrames < budget)
+    {
+        // the lock is only held per frame, so the IRQ handler's resets don't
+        // have to wait for the whole batch
+        m_RxLock.acquire();
+        if(m_pBase->read8(RTL_CMD) & RTL_CMD_BUFE)
+        {
+            m_RxLock.release();
+            break;
+        }
+
+        NetworkBuffer *pBuffer = 0;
+        bool bOk = recv(pBuffer);
+        m_RxLock.release();
+
+        if(!bOk)
+            break;
 
-    m_RxLock = false;
+        // the stack can allocate, filter and wake threads, so the frame goes
+        // up once it's out of the ring and the lock is dropped
+        if(pBuffer)
+            NetworkStack::instance().receive(pBuffer, this);
+        else
+        {
+            gotPacket();
+            droppedPacket();
+        }
+        ++nFrames;
+    }
+
+    return nFrames;
+}
+
+void Rtl8139::enableRxInterrupts()
+{
+    m_pBase->write16(RTL_IMR_RXOK | RTL_IMR_RXERR, RTL_IMR);
 }
 
 bool Rtl8139::setStationInfo(StationInfo info)
@@ -244,6 +312,8 @@ bool Rtl8139::isConnected()
 
 bool Rtl8139::irq(irq_id_t number, InterruptState &state)
 {
+    gotInterrupt();
+
     while(true)
     {
         // grab the interrupt status and acknowledge it ASAP
@@ -254,20 +324,25 @@ bool Rtl8139::irq(irq_id_t number, InterruptState &state)
         if((irqStatus & (RTL_ISR_RXOK|RTL_ISR_TXOK|RTL_ISR_RXERR|RTL_ISR_TXERR)) == 0)
             break;
 
-        // RxOK, receive the packet
+        // RxOK - no more of those until the poll has emptied the buffer
         if(irqStatus & RTL_ISR_RXOK)
-            recv();
+        {
+            m_pBase->write16(RTL_IMR_RXERR, RTL_IMR);
+            schedulePoll();
+        }
 
         // if rx error, reset
         if(irqStatus & RTL_ISR_RXERR)
         {
             WARNING("RTL8139: Rx error!");
+            LockGuard<Spinlock> guard(m_RxLock);
             reset();
         }
         // if tx error, reset
         if(irqStatus & RTL_ISR_TXERR)
         {
             WARNING("RTL8139: Tx error!");
+            LockGuard<Spinlock> guard(m_RxLock);
             reset();
         }
     }
@@ -49,6 +49,8 @@ class Rtl8139 : public Network, public IrqHandler
 
         virtual bool send(size_t nBytes, uintptr_t buffer);
 
+        virtual bool sendBuffer(NetworkBuffer *pBuffer);
+
         virtual bool setStationInfo(StationInfo info);
 
         virtual StationInfo getStationInfo();
@@ -60,9 +62,21 @@ class Rtl8139 : public Network, public IrqHandler
 
         IoBase *m_pBase;
 
+    protected:
+
+        virtual size_t poll(size_t budget);
+
+        virtual void enableRxInterrupts();
+
     private:
 
-        void recv();
+        /** Takes the next frame out of the Rx buffer (m_RxLock must be held).
+         *  pBuffer is left null if there was no buffer to copy it into.
+         *  Returns false if the frame was bad (and the card has been reset). */
+        bool recv(NetworkBuffer *&pBuffer);
+
+        /** Pads and transmits the nBytes already in the Tx buffer. */
+        void transmit(size_t nBytes);
 
         void reset();
 
@@ -72,12 +86,10 @@ class Rtl8139 : public Network, public IrqHandler
             size_t len;
         };
 
-        StationInfo m_StationInfo;
-
         uint32_t m_RxCurr;
         uint8_t m_TxCurr;
 
-        volatile bool m_RxLock;
+        Spinlock m_RxLock;
         Spinlock m_TxLock;
 
         uint8_t *m_pRxBuffVirt;
@@ -25,13 +25,16 @@
 #include <network-stack/NetworkStack.h>
 #include <processor/Processor.h>
 #include <machine/IrqManager.h>
-#include <process/Scheduler.h>
+#include <LockGuard.h>
 
-// #define NE2K_NO_THREADS
+/// Interrupts we take: everything except "packet transmitted".
+#define NE_IMR_ALL  0x3D
+
+/// Receive interrupts: packet received, and receive error.
+#define NE_IMR_RX   0x05
 
 Ne2k::Ne2k(Network* pDev) :
-  Network(pDev), m_pBase(0), m_NextPacket(0),
-  m_PacketQueueSize(0),m_PacketQueue(), m_PacketQueueLock()
+  Network(pDev), m_pBase(0), m_NextPacket(0), m_DmaLock()
 {
   setSpecificType(String("ne2k-card"));
 
@@ -112,13 +115,8 @@ Ne2k::Ne2k(Network* pDev) :
     m_pBase->write8(0xFF, NE_MAR + i);
   m_pBase->write8(tmp, NE_CMD);
 
-  // register the packet queue handler before we install the IRQ
-#ifdef THREADS
-  Thread *pThread = new Thread(Processor::information().getCurrentThread()->getParent(),
-                               reinterpret_cast<Thread::ThreadStartFunc> (&trampoline),
-                               reinterpret_cast<void*> (this));
-  pThread->detach();
-#endif
+  // received packets are passed up by polling
+  enablePolling();
 
   // install the IRQ
   NOTICE("NE2K: IRQ is " << getInterruptNumber());
@@ -126,7 +124,7 @@ Ne2k::Ne2k(Network* pDev) :
 
   // clear interrupts and enable the ones we want
   m_pBase->write8(0xff, NE_ISR);
-  m_pBase->write8(0x3D, NE_IMR); // No IRQ for "packet transmitted"
+  m_pBase->write8(NE_IMR_ALL, NE_IMR);
 
   // start the card working properly
   m_pBase->write8(0x22, NE_CMD);
@@ -146,6 +144,8 @@ bool Ne2k::send(size_t nBytes, uintptr_t buffer)
     return false;
   }
 
+  LockGuard<Spinlock> guard(m_DmaLock);
+
   // length & address for the write
   m_pBase->write8(0, NE_RSAR0);
   m_pBase->write8(PAGE_TX, NE_RSAR1);
@@ -194,126 +194,117 @@ bool Ne2k::send(size_t nBytes, uintptr_t buffer)
   return true;
 }
 
-void Ne2k::recv()
+bool Ne2k::sendBuffer(NetworkBuffer *pBuffer)
+{
+  // The card is fed by PIO from one contiguous buffer, which is usually the
+  // NetworkBuffer's own memory.
+  if(!pBuffer->linearise())
+    return false;
+
+  return send(pBuffer->getLength(), pBuffer->getBuffer());
+}
+
+bool Ne2k::recv()
 {
   // Grab the current buffer in the ring
   m_pBase->write8(0x61, NE_CMD);
   uint8_t current = m_pBase->read8(NE_CURR);
   m_pBase->write8(0x21, NE_CMD);
 
-  // Read packets until the current packet
-  while(m_NextPacket != current)
-  {
-    // Want status and length
-    m_pBase->write8(0, NE_RSAR0);
-    m_pBase->write8(m_NextPacket, NE_RSAR1);
-    m_pBase->write8(4, NE_RBCR0);
-    m_pBase->write8(0, NE_RBCR1);
-    m_pBase->write8(0x0a, NE_CMD); // Read, Start
-
-    // Grab the information we want
-    uint16_t status = m_pBase->read16(NE_DATA);
-    uint16_t length = m_pBase->read16(NE_DATA);
-
-    if(!length)
-    {
-      ERROR("NE2K: length of packet is invalid!");
-      continue;
-    }
-
-    // Remove the status and length bytes
-    length -= 3;
-
-    // packet buffer
-    uint8_t* tmp = reinterpret_cast<uint8_t*>(NetworkStack::instance().getMemPool().allocate());
-    uint16_t* packBuffer = reinterpret_cast<uint16_t*>(tmp);
-    memset(tmp, 0, length);
-
-    // check status, new read for the rest of the packet
-    while(!(m_pBase->read8(NE_ISR) & 0x40));
-    m_pBase->write8(0x40, NE_ISR);
-
-    m_pBase->write8(4, NE_RSAR0);
-    m_pBase->write8(m_NextPacket, NE_RSAR1);
-    m_pBase->write8((length) & 0xff, NE_RBCR0);
-    m_pBase->write8((length) >> 8, NE_RBCR1);
-    m_pBase->write8(0x0a, NE_CMD);
-
-    // read the packet
-    int i, words = length / 2, oddbytes = length % 2;
-    for(i = 0; i < words; ++i)
-      packBuffer[i] = m_pBase->read16(NE_DATA);
-    if(oddbytes)
-    {
-      for(i = 0; i < oddbytes; ++i)
-          tmp[(length - oddbytes) + i] = m_pBase->read16(NE_DATA) & 0xFF; // odd packet length handler
-    }
+  // Nothing between us and the card's write pointer?
+  if(m_NextPacket == current)
+    return false;
 
-    // check status once again
-    while(!(m_pBase->read8(NE_ISR) & 0x40)); // no interrupts at all, this wastes time...
-    m_pBase->write8(0x40, NE_ISR);
+  // Want status and length
+  m_pBase->write8(0, NE_RSAR0);
+  m_pBase->write8(m_NextPacket, NE_RSAR1);
+  m_pBase->write8(4, NE_RBCR0);
+  m_pBase->write8(0, NE_RBCR1);
+  m_pBase->write8(0x0a, NE_CMD); // Read, Start
 
-    // set the next packet, inform the card of the new boundary
-    m_NextPacket = status >> 8;
-    m_pBase->write8((m_NextPacket == PAGE_RX) ? (PAGE_STOP - 1) : (m_NextPacket - 1), NE_BNDRY);
+  // Grab the information we want
+  uint16_t status = m_pBase->read16(NE_DATA);
+  uint16_t length = m_pBase->read16(NE_DATA);
 
-    // push onto the queue
-    packet* p = new packet;
-    p->ptr = reinterpret_cast<uintptr_t>(packBuffer);
-    p->len = length;
+  if(!length)
+  {
+    ERROR("NE2K: length of packet is invalid!");
+    badPacket();
+    return false;
+  }
 
-#ifdef NE2K_NO_THREADS
+  // Remove the status and length bytes
+  length -= 3;
 
-    NetworkStack::instance().receive(p->len, p->ptr, this, 0);
+  // packet buffer - read straight out of the card into this
+  NetworkBuffer *pBuffer = NetworkStack::instance().allocateBuffer(length, NETWORK_BUFFER_HEADROOM, false);
+  uint8_t *tmp = pBuffer ? pBuffer->put(length) : 0;
+  uint16_t *packBuffer = reinterpret_cast<uint16_t*>(tmp);
 
-    NetworkStack::instance().getMemPool().free(p->ptr);
-    delete p;
+  // check status, new read for the rest of the packet
+  while(!(m_pBase->read8(NE_ISR) & 0x40));
+  m_pBase->write8(0x40, NE_ISR);
 
-#else
+  m_pBase->write8(4, NE_RSAR0);
+  m_pBase->write8(m_NextPacket, NE_RSAR1);
+  m_pBase->write8((length) & 0xff, NE_RBCR0);
+  m_pBase->write8((length) >> 8, NE_RBCR1);
+  m_pBase->write8(0x0a, NE_CMD);
 
+  // read the packet (the card still has to be drained if we've nowhere to put it)
+  int i, words = length / 2, oddbytes = length % 2;
+  for(i = 0; i < words; ++i)
+  {
+    uint16_t word = m_pBase->read16(NE_DATA);
+    if(packBuffer)
+      packBuffer[i] = word;
+  }
+  if(oddbytes)
+  {
+    for(i = 0; i < oddbytes; ++i)
     {
-        LockGuard<Spinlock> guard(m_PacketQueueLock);
-        m_PacketQueue.pushBack(p);
-        m_PacketQueueSize.release();
+        uint8_t byte = m_pBase->read16(NE_DATA) & 0xFF; // odd packet length handler
+        if(tmp)
+          tmp[(length - oddbytes) + i] = byte;
     }
+  }
+
+  // check status once again
+  while(!(m_pBase->read8(NE_ISR) & 0x40)); // no interrupts at all, this wastes time...
+  m_pBase->write8(0x40, NE_ISR);
 
-#endif
+  // set the next packet, inform the card of the new boundary
+  m_NextPacket = status >> 8;
+  m_pBase->write8((m_NextPacket == PAGE_RX) ? (PAGE_STOP - 1) : (m_NextPacket - 1), NE_BNDRY);
+
+  if(!pBuffer)
+  {
+    gotPacket();
+    droppedPacket();
+    return true;
   }
-}
 
-int Ne2k::trampoline(void *p)
-{
-  Ne2k *pNe = reinterpret_cast<Ne2k*> (p);
-  pNe->receiveThread();
-  return 0;
+  NetworkStack::instance().receive(pBuffer, this);
+  return true;
 }
 
-void Ne2k::receiveThread()
+size_t Ne2k::poll(size_t budget)
 {
-  while(true)
+  size_t nFrames = 0;
+  while(nFrames < budget)
   {
-    // handle the incoming packet
-    m_PacketQueueSize.acquire();
-
-    // grab from the front
-    packet* p = 0;
-    {
-        LockGuard<Spinlock> guard(m_PacketQueueLock);
-        p = m_PacketQueue.popFront();
-    }
-
-    if(!p)
-        continue;
-    else if(!p->ptr || !p->len)
-        continue;
+    LockGuard<Spinlock> guard(m_DmaLock);
+    if(!recv())
+      break;
+    ++nFrames;
+  }
 
-    // pass to the network stack
-    NetworkStack::instance().receive(p->len, p->ptr, this, 0);
+  return nFrames;
+}
 
-    // destroy the buffer now that it's handled
-    NetworkStack::instance().getMemPool().free(p->ptr);
-    delete p;
-  }
+void Ne2k::enableRxInterrupts()
+{
+  m_pBase->write8(NE_IMR_ALL, NE_IMR);
 }
 
 bool Ne2k::setStationInfo(StationInfo info)
@@ -350,16 +341,17 @@ StationInfo Ne2k::getStationInfo()
 
 bool Ne2k::irq(irq_id_t number, InterruptState &state)
 {
+  gotInterrupt();
+
   // Grab the interrupt status
   uint8_t irqStatus = m_pBase->read8(NE_ISR);
 
-  // Handle packet received - recv will handle all interim packets as well
-  // as the one which triggered the IRQ
-  if(irqStatus & 0x05)
+  // Packet received - the poll will pick up this one and any that follow
+  // it, and turn these interrupts back on once it's caught up
+  if(irqStatus & NE_IMR_RX)
   {
-    m_pBase->write8(0x3D, NE_IMR); // RECV
-    recv();
-    m_pBase->write8(0x3D, NE_IMR); // Enable recv interrupts again
+    m_pBase->write8(NE_IMR_ALL & ~NE_IMR_RX, NE_IMR);
+    schedulePoll();
   }
 
   // Handle packet transmitted
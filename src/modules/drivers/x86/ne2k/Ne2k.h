@@ -26,11 +26,8 @@
 #include <machine/Network.h>
 #include <processor/IoBase.h>
 #include <processor/IoPort.h>
-#include <utilities/List.h>
 #include <machine/IrqHandler.h>
-#include <process/Thread.h>
-#include <process/Semaphore.h>
-#include <utilities/RequestQueue.h>
+#include <Spinlock.h>
 
 #define NE2K_VENDOR_ID 0x10ec
 #define NE2K_DEVICE_ID 0x8029
@@ -49,6 +46,8 @@ public:
 
   virtual bool send(size_t nBytes, uintptr_t buffer);
 
+  virtual bool sendBuffer(NetworkBuffer *pBuffer);
+
   virtual bool setStationInfo(StationInfo info);
 
   virtual StationInfo getStationInfo();
@@ -60,26 +59,23 @@ public:
 
   bool isConnected();
 
-private:
+protected:
 
-  void recv();
+  virtual size_t poll(size_t budget);
 
-  static int trampoline(void* p);
+  virtual void enableRxInterrupts();
 
-  void receiveThread();
+private:
+
+  /** Reads the next packet out of the card's ring and passes it up. Returns
+   *  false if there wasn't one. */
+  bool recv();
 
-  struct packet
-  {
-    uintptr_t ptr;
-    size_t len;
-  };
   uint8_t m_NextPacket;
 
-  Semaphore m_PacketQueueSize;
-  List<packet*> m_PacketQueue;
+  /** The card has one remote DMA channel, for both sending and receiving. */
+  Spinlock m_DmaLock;
 
-  Spinlock m_PacketQueueLock;
-  
   Ne2k(const Ne2k&);
   void operator =(const Ne2k&);
 };
@@ -98,6 +98,20 @@ uintptr_t Ext2File::readBlock(uint64_t location)
     return buffer;
 }
 
+uint64_t Ext2File::getDiskOffset(uint64_t location)
+{
+    size_t blockSize = m_pExt2Fs->m_BlockSize;
+    uint32_t nBlock = location / blockSize;
+    if ((nBlock >= m_nBlocks) || !ensureBlockLoaded(nBlock))
+        return ~0ULL;
+
+    // Block zero means a hole in a sparse file.
+    if (!m_pBlocks[nBlock])
+        return ~0ULL;
+
+    return (static_cast<uint64_t>(m_pBlocks[nBlock]) * blockSize) + (location % blockSize);
+}
+
 void Ext2File::writeBlock(uint64_t location, uintptr_t addr)
 {
     // Don't accidentally extend the file when writing the block.
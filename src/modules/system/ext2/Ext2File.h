@@ -52,6 +52,8 @@ public:
 
     virtual void sync(size_t offset, bool async);
 
+    virtual uint64_t getDiskOffset(uint64_t location);
+
 protected:
     /** Performs a read-to-cache. */
     uintptr_t readBlock(uint64_t location);
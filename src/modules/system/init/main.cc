@@ -365,9 +365,9 @@ void init_stage2()
         }
 
         // Using the interpreter - don't worry about dynamic linking.
+        pProcess->setLinker(0);
         delete pLinker;
         pLinker = 0;
-        pProcess->setLinker(pLinker);
     }
 
     if (pLinker && !pLinker->loadProgram(initProg))
@@ -42,7 +42,8 @@ uintptr_t DynamicLinker::resolvePlt(SyscallState &state)
 }
 
 DynamicLinker::DynamicLinker() :
-    m_pProgramElf(0), m_ProgramStart(0), m_ProgramSize(0), m_ProgramBuffer(0), m_LoadedObjects(), m_Objects()
+    m_pProgramElf(0), m_ProgramStart(0), m_ProgramSize(0), m_ProgramBuffer(0), m_LoadedObjects(), m_Objects(),
+    m_Lock(false)
 {
 
 }
@@ -50,7 +51,7 @@ DynamicLinker::DynamicLinker() :
 DynamicLinker::DynamicLinker(DynamicLinker &other) :
     m_pProgramElf(other.m_pProgramElf), m_ProgramStart(other.m_ProgramStart),
     m_ProgramSize(other.m_ProgramSize), m_ProgramBuffer(other.m_ProgramBuffer),
-    m_LoadedObjects(other.m_LoadedObjects), m_Objects()
+    m_LoadedObjects(other.m_LoadedObjects), m_Objects(), m_Lock(false)
 {
     m_pProgramElf = new Elf(*other.m_pProgramElf);
     for (Tree<uintptr_t,SharedObject*>::Iterator it = other.m_Objects.begin();
@@ -97,15 +98,17 @@ bool DynamicLinker::loadProgram(File *pFile, bool bDryRun, bool bInterpreter, St
 
     if(!bDryRun)
     {
-        delete m_pProgramElf;
-        m_pProgramElf = programElf;
+        dropProgram();
+        {
+            LockGuard<Spinlock> guard(m_Lock);
+            m_pProgramElf = programElf;
+        }
         if (!m_pProgramElf->create(reinterpret_cast<uint8_t*>(buffer), pFile->getSize()))
         {
             ERROR("DynamicLinker: Main program ELF failed to create: `" << fileName << "' at " << buffer);
             MemoryMapManager::instance().unmap(pMmFile);
 
-            delete m_pProgramElf;
-            m_pProgramElf = 0;
+            dropProgram();
             return false;
         }
 
@@ -114,8 +117,7 @@ bool DynamicLinker::loadProgram(File *pFile, bool bDryRun, bool bInterpreter, St
             ERROR("DynamicLinker: Main program ELF failed to load: `" << fileName << "'");
             MemoryMapManager::instance().unmap(pMmFile);
 
-            delete m_pProgramElf;
-            m_pProgramElf = 0;
+            dropProgram();
             return false;
         }
 
@@ -130,8 +132,7 @@ bool DynamicLinker::loadProgram(File *pFile, bool bDryRun, bool bInterpreter, St
 
             if(!bDryRun)
             {
-                delete m_pProgramElf;
-                m_pProgramElf = 0;
+                dropProgram();
             }
             else
                 delete programElf;
@@ -182,8 +183,7 @@ bool DynamicLinker::loadProgram(File *pFile, bool bDryRun, bool bInterpreter, St
             ERROR("DynamicLinker: Dependency `" << filename << "' not found!");
             if(!bDryRun)
             {
-                delete m_pProgramElf;
-                m_pProgramElf = 0;
+                dropProgram();
             }
             else
                 delete programElf;
@@ -196,8 +196,7 @@ bool DynamicLinker::loadProgram(File *pFile, bool bDryRun, bool bInterpreter, St
             ERROR("DynamicLinker: Dependency `" << filename << "' failed to load!");
             if(!bDryRun)
             {
-                delete m_pProgramElf;
-                m_pProgramElf = 0;
+                dropProgram();
             }
             else
                 delete programElf;
@@ -250,6 +249,7 @@ bool DynamicLinker::loadObject(File *pFile, bool bDryRun)
 
         pSo = new SharedObject(pElf, pMmFile, buffer, loadBase, size);
 
+        LockGuard<Spinlock> guard(m_Lock);
         m_Objects.insert(loadBase, pSo);
     }
     else
@@ -287,7 +287,7 @@ bool DynamicLinker::loadObject(File *pFile, bool bDryRun)
             ERROR("DynamicLinker: Dependency `" << filename << "' not found!");
             if(!bDryRun)
             {
-                m_Objects.remove(loadBase);
+                removeObject(loadBase);
                 delete pSo;
             }
             delete pElf;
@@ -300,7 +300,7 @@ bool DynamicLinker::loadObject(File *pFile, bool bDryRun)
             ERROR("DynamicLinker: Dependency `" << filename << "' failed to load!");
             if(!bDryRun)
             {
-                m_Objects.remove(loadBase);
+                removeObject(loadBase);
                 delete pSo;
             }
             delete pElf;
@@ -395,6 +395,62 @@ uintptr_t DynamicLinker::resolve(String name)
     return m_pProgramElf->getSymbolTable()->lookup(name, m_pProgramElf);
 }
 
+void DynamicLinker::dropProgram()
+{
+    Elf *pElf = 0;
+    {
+        LockGuard<Spinlock> guard(m_Lock);
+        pElf = m_pProgramElf;
+        m_pProgramElf = 0;
+        m_ProgramStart = m_ProgramSize = 0;
+    }
+
+    delete pElf;
+}
+
+void DynamicLinker::removeObject(uintptr_t loadBase)
+{
+    LockGuard<Spinlock> guard(m_Lock);
+    m_Objects.remove(loadBase);
+}
+
+bool DynamicLinker::lookupSymbol(uintptr_t address, LargeStaticString &name, uintptr_t *startAddr)
+{
+    // Called from other processes, so the name is copied out before the
+    // object it's in can be unloaded.
+    LockGuard<Spinlock> guard(m_Lock);
+
+    const char *pName = 0;
+    if (m_pProgramElf && address >= m_ProgramStart && address < m_ProgramStart+m_ProgramSize)
+    {
+        pName = m_pProgramElf->lookupSymbol(address, startAddr);
+        if (pName)
+            name = pName;
+        return pName != 0;
+    }
+
+    for (Tree<uintptr_t, SharedObject*>::Iterator it = m_Objects.begin();
+         it != m_Objects.end();
+         it++)
+    {
+        SharedObject *pSo = reinterpret_cast<SharedObject*>(it.value());
+        if (!pSo || address < pSo->address || address >= pSo->address+pSo->size)
+            continue;
+
+        // Shared objects' symbols are relative to where they're loaded.
+        pName = pSo->elf->lookupSymbol(address - pSo->address, startAddr);
+        if (!pName)
+            return false;
+
+        if (startAddr)
+            *startAddr += pSo->address;
+        name = pName;
+        return true;
+    }
+
+    return false;
+}
+
 DLTrapHandler::DLTrapHandler()
 {
     PageFaultHandler::instance().registerHandler(this);
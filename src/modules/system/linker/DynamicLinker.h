@@ -27,6 +27,8 @@
 #include <utilities/Tree.h>
 #include <utilities/List.h>
 #include <utilities/RadixTree.h>
+#include <utilities/StaticString.h>
+#include <Spinlock.h>
 #include <processor/state.h>
 #include <vfs/File.h>
 #include <vfs/MemoryMappedFile.h>
@@ -85,6 +87,16 @@ public:
     /** Manually resolves a given symbol name. */
     uintptr_t resolve(String name);
 
+    /** Finds the function containing an address in the program or one of
+        its shared objects. Safe to call from another process, as long as
+        the Scheduler's process lock is held (so the linker stays put).
+        \param address The address, in this linker's address space.
+        \param name Receives the function's name.
+        \param startAddr If not null, receives the address the function
+                         starts at.
+        \return Whether the function was found. */
+    bool lookupSymbol(uintptr_t address, LargeStaticString &name, uintptr_t *startAddr = 0);
+
 private:
     /** Operator= is unused and is therefore private. */
     DynamicLinker &operator=(const DynamicLinker&);
@@ -106,6 +118,12 @@ private:
 
     void initPlt(Elf *pElf, uintptr_t value);
 
+    /** Deletes the program ELF, out of sight of lookupSymbol. */
+    void dropProgram();
+
+    /** Takes a shared object out of m_Objects, out of sight of lookupSymbol. */
+    void removeObject(uintptr_t loadBase);
+
     Elf *m_pProgramElf;
     uintptr_t m_ProgramStart;
     size_t m_ProgramSize;
@@ -113,6 +131,9 @@ private:
     RadixTree<void*> m_LoadedObjects;
 
     Tree<uintptr_t, SharedObject*> m_Objects;
+
+    /** Guards m_pProgramElf and m_Objects against lookupSymbol. */
+    Spinlock m_Lock;
 };
 
 /** Tiny class for dispatching MemoryTrap events to DynamicLinkers.
@@ -28,19 +28,15 @@
 
 Arp Arp::arpInstance;
 
-Arp::Arp() :
-  RequestQueue(), m_ArpCache(), m_ArpRequests()
+Arp::Arp()
 {
-    // By now threading should be active, as we're a module.
-    initialise();
 }
 
 Arp::~Arp()
 {
-    destroy();
 }
 
-bool Arp::getFromCache(IpAddress ip, bool resolve, MacAddress* ent, Network* pCard)
+bool Arp::getFromCache(IpAddress ip, bool resolve, MacAddress* ent, Network* pCard, NetworkBuffer *pBuffer)
 {
   // ensure the IP given is valid
   if(ip.getType() == IpAddress::IPv6)
@@ -48,36 +44,17 @@ bool Arp::getFromCache(IpAddress ip, bool resolve, MacAddress* ent, Network* pCa
   if(!pCard->isConnected())
     return false; // NIC isn't active
 
-  // do we have an entry for it yet?
-  arpEntry* arpEnt;
-  if((arpEnt = m_ArpCache.lookup(static_cast<uintptr_t>(ip.getIp()))) != 0)
-  {
-    *ent = arpEnt->mac;
-    return true;
-  }
-
-  // not found, do we resolve?
   if(!resolve)
-    return false;
-  ArpRequest* req = new ArpRequest;
-  req->destIp = ip;
-
-  // push this onto the list
-  m_ArpRequests.pushBack(req);
-
-  bool success = addRequest(0, reinterpret_cast<uint64_t>(req), reinterpret_cast<uint64_t>(pCard));
-
-  // if sucessful, load into the passed MacAddress
-  // callers should check the return value to ensure this is valid
-  if(success)
-    *ent = req->mac;
+    return NeighbourDiscovery::instance().lookup(ip, pCard, ent);
+  return NeighbourDiscovery::instance().resolve(ip, pCard, ent, this, pBuffer);
+}
 
-  // clean up
-  delete req;
-  return success;
+void Arp::solicit(IpAddress ip, Network *pCard, MacAddress *pTarget)
+{
+  send(ip, pCard, pTarget);
 }
 
-void Arp::send(IpAddress req, Network* pCard)
+void Arp::send(IpAddress req, Network* pCard, MacAddress *pTarget)
 {
   StationInfo cardInfo = pCard->getStationInfo();
   if(cardInfo.ipv4.getIp() == 0)
@@ -102,54 +79,33 @@ void Arp::send(IpAddress req, Network* pCard)
   NOTICE("arp who-has " << req.toString() << " tell " << cardInfo.ipv4.toString());
 
   memcpy(request->hwSrc, cardInfo.mac, 6);
-  memset(request->hwDest, 0xff, 6); // broadcast
+  memset(request->hwDest, 0, 6);
 
+  // Probes of a neighbour we already know go straight to it.
   MacAddress destMac;
-  destMac = request->hwDest;
-
-  memset(request->hwDest, 0, 6);
+  if(pTarget)
+    destMac = *pTarget;
+  else
+    destMac.setMac(0xff); // broadcast
 
   Ethernet::send(sizeof(arpHeader), packet, pCard, destMac, ETH_ARP);
 
   NetworkStack::instance().getMemPool().free(packet);
 }
 
-uint64_t Arp::executeRequest(uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, uint64_t p5,
-                             uint64_t p6, uint64_t p7, uint64_t p8)
+bool Arp::isInCache(IpAddress ip, Network *pCard)
 {
-  ArpRequest* req = reinterpret_cast<ArpRequest*>(p1);
-  Network *pCard = reinterpret_cast<Network*>(p2);
-
-  // Send the request
-  req->success = false;
-  send(req->destIp, pCard);
-
-  // Wait for the reply
-  req->waitSem.acquire(1, 15);
-  return req->success ? 1 : 0;
+    return NeighbourDiscovery::instance().lookup(ip, pCard);
 }
 
-bool Arp::isInCache(IpAddress ip)
+void Arp::insertToCache(IpAddress ip, MacAddress mac, Network *pCard)
 {
-    return m_ArpCache.lookup(ip.getIp()) != 0;
+    NeighbourDiscovery::instance().update(ip, pCard, mac, false, true);
 }
 
-void Arp::insertToCache(IpAddress ip, MacAddress mac)
+void Arp::removeFromCache(IpAddress ip, Network *pCard)
 {
-    if(isInCache(ip))
-        return;
-
-    arpEntry* ent = new arpEntry;
-    ent->valid = true;
-    ent->mac = mac;
-    ent->ip = ip;
-    m_ArpCache.insert(ip.getIp(), ent);
-}
-
-void Arp::removeFromCache(IpAddress ip)
-{
-    /// \todo Implement
-    WARNING("ARP: implement removeFromCache");
+    NeighbourDiscovery::instance().remove(ip, pCard);
 }
 
 void Arp::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset)
@@ -183,9 +139,10 @@ void Arp::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offs
     // request?
     if(BIG_TO_HOST16(header->opcode) == ARP_OP_REQUEST)
     {
-      // Add to local cache even if the request isn't for us
-      MacAddress myMac = cardInfo.mac;
-      insertToCache(IpAddress(header->ipSrc), sourceMac);
+      // Add to local cache even if the request isn't for us (unless it's a
+      // probe, which has no sender address yet)
+      if(header->ipSrc)
+        insertToCache(IpAddress(header->ipSrc), sourceMac, pCard);
 
       // We can glean information from ARP requests, but unless they're for us
       // we can't really respond.
@@ -213,24 +170,9 @@ void Arp::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offs
     {
       NOTICE("arp " << IpAddress(header->ipSrc).toString() << " is at " << sourceMac.toString());
 
-      // add to our local cache, if needed
-      insertToCache(IpAddress(header->ipSrc), sourceMac);
-
-      // search all the requests we've made, trigger the first we find
-      for(Vector<ArpRequest*>::Iterator it = m_ArpRequests.begin();
-          it != m_ArpRequests.end();
-          it++)
-      {
-        ArpRequest* p = *it;
-        if(p->destIp.getIp() == header->ipSrc)
-        {
-          p->mac = header->hwSrc;
-          p->waitSem.release();
-          p->success = true;
-          m_ArpRequests.erase(it);
-          break;
-        }
-      }
+      // A reply confirms the neighbour is reachable, and sends anything that
+      // was waiting for it.
+      NeighbourDiscovery::instance().update(IpAddress(header->ipSrc), pCard, sourceMac, true, true);
     }
     else
     {
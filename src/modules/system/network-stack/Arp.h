@@ -29,18 +29,21 @@
 #include <process/Semaphore.h>
 #include <machine/Network.h>
 #include <machine/Machine.h>
-#include <utilities/RequestQueue.h>
 
 #include "NetworkStack.h"
 #include "Ethernet.h"
+#include "NeighbourDiscovery.h"
 
 #define ARP_OP_REQUEST  0x0001
 #define ARP_OP_REPLY    0x0002
 
 /**
  * The Pedigree network stack - ARP layer
+ *
+ * Addresses are kept in the NeighbourDiscovery cache; ARP just does the
+ * asking and answering for IPv4.
  */
-class Arp : public RequestQueue
+class Arp : public NeighbourProtocol
 {
 public:
   Arp();
@@ -55,22 +58,23 @@ public:
   /** Packet arrival callback */
   void receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset);
 
-  /** Sends an ARP request */
-  void send(IpAddress req, Network* pCard = 0);
+  /** Sends an ARP request - to pTarget if given, otherwise broadcast. */
+  void send(IpAddress req, Network* pCard = 0, MacAddress *pTarget = 0);
+
+  /** Gets an entry from the ARP cache, and optionally resolves it if needed.
+   *  Never blocks: if the address has to be resolved, this returns false and
+   *  a clone of pBuffer (if given) is sent as soon as it is. */
+  bool getFromCache(IpAddress ip, bool resolve, MacAddress* ent, Network* pCard, NetworkBuffer *pBuffer = 0);
 
-  /** Gets an entry from the ARP cache, and optionally resolves it if needed. */
-  bool getFromCache(IpAddress ip, bool resolve, MacAddress* ent, Network* pCard);
-  
   /** Direct cache manipulation */
-  bool isInCache(IpAddress ip);
-  void insertToCache(IpAddress ip, MacAddress mac);
-  void removeFromCache(IpAddress ip);
+  bool isInCache(IpAddress ip, Network *pCard);
+  void insertToCache(IpAddress ip, MacAddress mac, Network *pCard);
+  void removeFromCache(IpAddress ip, Network *pCard);
 
-private:
+  /** NeighbourProtocol interface */
+  virtual void solicit(IpAddress ip, Network *pCard, MacAddress *pTarget);
 
-  /** ARP request doer */
-  virtual uint64_t executeRequest(uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, uint64_t p5,
-                                  uint64_t p6, uint64_t p7, uint64_t p8);
+private:
 
   static Arp arpInstance;
 
@@ -87,41 +91,6 @@ private:
     uint32_t  ipDest;
   } __attribute__ ((packed));
 
-  // an entry in the arp cache
-  /// \todo Will need to store *time* and *type* - time for removing from cache
-  ///       and type for static entries
-  struct arpEntry
-  {
-    arpEntry() :
-      valid(false), ip(), mac()
-    {};
-
-    bool valid;
-    IpAddress ip;
-    MacAddress mac;
-  };
-
-  // an ARP request we've sent
-  class ArpRequest // : public TimerHandler
-  {
-    public:
-      ArpRequest() :
-        destIp(), mac(), waitSem(0), success(false)
-      {};
-
-      IpAddress destIp;
-      MacAddress mac;
-      Semaphore waitSem;
-
-      bool success;
-  };
-
-  // ARP Cache
-  Tree<size_t, arpEntry*> m_ArpCache;
-
-  // ARP request list
-  Vector<ArpRequest*> m_ArpRequests;
-
 };
 
 #endif
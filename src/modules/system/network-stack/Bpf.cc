@@ -0,0 +1,380 @@
+/*
+ * 
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "Bpf.h"
+#include <utilities/utility.h>
+
+// Instruction classes.
+#define BPF_CLASS(code) ((code) & 0x07)
+#define BPF_LD          0x00
+#define BPF_LDX         0x01
+#define BPF_ST          0x02
+#define BPF_STX         0x03
+#define BPF_ALU         0x04
+#define BPF_JMP         0x05
+#define BPF_RET         0x06
+#define BPF_MISC        0x07
+
+// Load sizes and addressing modes.
+#define BPF_SIZE(code)  ((code) & 0x18)
+#define BPF_W           0x00
+#define BPF_H           0x08
+#define BPF_B           0x10
+#define BPF_MODE(code)  ((code) & 0xe0)
+#define BPF_IMM         0x00
+#define BPF_ABS         0x20
+#define BPF_IND         0x40
+#define BPF_MEM         0x60
+#define BPF_LEN         0x80
+#define BPF_MSH         0xa0
+
+// ALU and jump operations.
+#define BPF_OP(code)    ((code) & 0xf0)
+#define BPF_ADD         0x00
+#define BPF_SUB         0x10
+#define BPF_MUL         0x20
+#define BPF_DIV         0x30
+#define BPF_OR          0x40
+#define BPF_AND         0x50
+#define BPF_LSH         0x60
+#define BPF_RSH         0x70
+#define BPF_NEG         0x80
+#define BPF_MOD         0x90
+#define BPF_XOR         0xa0
+#define BPF_JA          0x00
+#define BPF_JEQ         0x10
+#define BPF_JGT         0x20
+#define BPF_JGE         0x30
+#define BPF_JSET        0x40
+
+// Operand source: the constant k, or the index register.
+#define BPF_SRC(code)   ((code) & 0x08)
+#define BPF_K           0x00
+#define BPF_X           0x08
+
+// Return value source.
+#define BPF_RVAL(code)  ((code) & 0x18)
+#define BPF_A           0x10
+
+// Miscellaneous register moves.
+#define BPF_MISCOP(code) ((code) & 0xf8)
+#define BPF_TAX         0x00
+#define BPF_TXA         0x80
+
+BpfProgram::BpfProgram(Instruction *pCode, size_t nInstructions) :
+  m_pCode(pCode), m_nInstructions(nInstructions), m_nRefs(1)
+{
+}
+
+BpfProgram::~BpfProgram()
+{
+  delete [] m_pCode;
+}
+
+BpfProgram *BpfProgram::create(const Instruction *pCode, size_t nInstructions)
+{
+  if(!pCode || !verify(pCode, nInstructions))
+    return 0;
+
+  Instruction *pCopy = new Instruction[nInstructions];
+  memcpy(pCopy, pCode, nInstructions * sizeof(Instruction));
+
+  return new BpfProgram(pCopy, nInstructions);
+}
+
+void BpfProgram::release()
+{
+  if((m_nRefs -= 1) == 0)
+    delete this;
+}
+
+bool BpfProgram::verify(const Instruction *pCode, size_t nInstructions)
+{
+  if(!nInstructions || (nInstructions > BPF_MAXINSNS))
+    return false;
+
+  for(size_t pc = 0; pc < nInstructions; ++pc)
+  {
+    const Instruction &insn = pCode[pc];
+    size_t nRemaining = nInstructions - pc - 1;
+
+    if(insn.code & 0xff00)
+      return false;
+
+    switch(BPF_CLASS(insn.code))
+    {
+      case BPF_LD:
+        switch(insn.code)
+        {
+          case BPF_LD | BPF_W | BPF_ABS:
+          case BPF_LD | BPF_H | BPF_ABS:
+          case BPF_LD | BPF_B | BPF_ABS:
+          case BPF_LD | BPF_W | BPF_IND:
+          case BPF_LD | BPF_H | BPF_IND:
+          case BPF_LD | BPF_B | BPF_IND:
+          case BPF_LD | BPF_W | BPF_LEN:
+          case BPF_LD | BPF_IMM:
+            break;
+          case BPF_LD | BPF_MEM:
+            if(insn.k >= BPF_MEMWORDS)
+              return false;
+            break;
+          default:
+            return false;
+        }
+        break;
+
+      case BPF_LDX:
+        switch(insn.code)
+        {
+          case BPF_LDX | BPF_W | BPF_IMM:
+          case BPF_LDX | BPF_W | BPF_LEN:
+          case BPF_LDX | BPF_B | BPF_MSH:
+            break;
+          case BPF_LDX | BPF_W | BPF_MEM:
+            if(insn.k >= BPF_MEMWORDS)
+              return false;
+            break;
+          default:
+            return false;
+        }
+        break;
+
+      case BPF_ST:
+      case BPF_STX:
+        if((insn.code & ~0x07) || (insn.k >= BPF_MEMWORDS))
+          return false;
+        break;
+
+      case BPF_ALU:
+        switch(BPF_OP(insn.code))
+        {
+          case BPF_ADD:
+          case BPF_SUB:
+          case BPF_MUL:
+          case BPF_OR:
+          case BPF_AND:
+          case BPF_LSH:
+          case BPF_RSH:
+          case BPF_XOR:
+            break;
+          case BPF_DIV:
+          case BPF_MOD:
+            // Division by X is checked as the program runs.
+            if((BPF_SRC(insn.code) == BPF_K) && !insn.k)
+              return false;
+            break;
+          case BPF_NEG:
+            if(BPF_SRC(insn.code) != BPF_K)
+              return false;
+            break;
+          default:
+            return false;
+        }
+        break;
+
+      case BPF_JMP:
+        // Jumps are relative to the next instruction, and can only go
+        // forward, so every program finishes.
+        switch(BPF_OP(insn.code))
+        {
+          case BPF_JA:
+            if((BPF_SRC(insn.code) != BPF_K) || (insn.k >= nRemaining))
+              return false;
+            break;
+          case BPF_JEQ:
+          case BPF_JGT:
+          case BPF_JGE:
+          case BPF_JSET:
+            if((insn.jt >= nRemaining) || (insn.jf >= nRemaining))
+              return false;
+            break;
+          default:
+            return false;
+        }
+        break;
+
+      case BPF_RET:
+        if((insn.code != (BPF_RET | BPF_K)) && (insn.code != (BPF_RET | BPF_A)))
+          return false;
+        break;
+
+      case BPF_MISC:
+        if((insn.code != (BPF_MISC | BPF_TAX)) && (insn.code != (BPF_MISC | BPF_TXA)))
+          return false;
+        break;
+    }
+  }
+
+  // Every path has to end in a return: jumps can't leave the program, so
+  // this only leaves falling off the end.
+  return BPF_CLASS(pCode[nInstructions - 1].code) == BPF_RET;
+}
+
+/** Reads a big-endian value out of a packet, if it's all in there. */
+static inline bool load(const uint8_t *pPacket, size_t nBytes, uint32_t offset,
+                        size_t size, uint32_t &value)
+{
+  if((offset >= nBytes) || (size > (nBytes - offset)))
+    return false;
+
+  const uint8_t *p = pPacket + offset;
+  if(size == 4)
+    value = (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+            (static_cast<uint32_t>(p[2]) << 8) | p[3];
+  else if(size == 2)
+    value = (static_cast<uint32_t>(p[0]) << 8) | p[1];
+  else
+    value = p[0];
+  return true;
+}
+
+uint32_t BpfProgram::run(const uint8_t *pPacket, size_t nBytes) const
+{
+  uint32_t A = 0, X = 0;
+  uint32_t mem[BPF_MEMWORDS];
+  memset(mem, 0, sizeof(mem));
+
+  const Instruction *pc = m_pCode;
+  while(true)
+  {
+    const Instruction &insn = *pc++;
+    uint32_t k = insn.k;
+
+    switch(insn.code)
+    {
+      case BPF_LD | BPF_W | BPF_ABS:
+        if(!load(pPacket, nBytes, k, 4, A))
+          return 0;
+        break;
+      case BPF_LD | BPF_H | BPF_ABS:
+        if(!load(pPacket, nBytes, k, 2, A))
+          return 0;
+        break;
+      case BPF_LD | BPF_B | BPF_ABS:
+        if(!load(pPacket, nBytes, k, 1, A))
+          return 0;
+        break;
+      case BPF_LD | BPF_W | BPF_IND:
+        if((k + X < k) || !load(pPacket, nBytes, k + X, 4, A))
+          return 0;
+        break;
+      case BPF_LD | BPF_H | BPF_IND:
+        if((k + X < k) || !load(pPacket, nBytes, k + X, 2, A))
+          return 0;
+        break;
+      case BPF_LD | BPF_B | BPF_IND:
+        if((k + X < k) || !load(pPacket, nBytes, k + X, 1, A))
+          return 0;
+        break;
+      case BPF_LD | BPF_W | BPF_LEN:
+        A = nBytes;
+        break;
+      case BPF_LD | BPF_IMM:
+        A = k;
+        break;
+      case BPF_LD | BPF_MEM:
+        A = mem[k];
+        break;
+
+      case BPF_LDX | BPF_W | BPF_IMM:
+        X = k;
+        break;
+      case BPF_LDX | BPF_W | BPF_LEN:
+        X = nBytes;
+        break;
+      case BPF_LDX | BPF_W | BPF_MEM:
+        X = mem[k];
+        break;
+      case BPF_LDX | BPF_B | BPF_MSH:
+        // Length of the IPv4 header at k.
+        if(!load(pPacket, nBytes, k, 1, X))
+          return 0;
+        X = (X & 0xf) << 2;
+        break;
+
+      case BPF_ST:
+        mem[k] = A;
+        break;
+      case BPF_STX:
+        mem[k] = X;
+        break;
+
+      case BPF_ALU | BPF_ADD | BPF_K: A += k; break;
+      case BPF_ALU | BPF_ADD | BPF_X: A += X; break;
+      case BPF_ALU | BPF_SUB | BPF_K: A -= k; break;
+      case BPF_ALU | BPF_SUB | BPF_X: A -= X; break;
+      case BPF_ALU | BPF_MUL | BPF_K: A *= k; break;
+      case BPF_ALU | BPF_MUL | BPF_X: A *= X; break;
+      case BPF_ALU | BPF_DIV | BPF_K: A /= k; break;
+      case BPF_ALU | BPF_DIV | BPF_X:
+        if(!X)
+          return 0;
+        A /= X;
+        break;
+      case BPF_ALU | BPF_MOD | BPF_K: A %= k; break;
+      case BPF_ALU | BPF_MOD | BPF_X:
+        if(!X)
+          return 0;
+        A %= X;
+        break;
+      case BPF_ALU | BPF_OR | BPF_K: A |= k; break;
+      case BPF_ALU | BPF_OR | BPF_X: A |= X; break;
+      case BPF_ALU | BPF_AND | BPF_K: A &= k; break;
+      case BPF_ALU | BPF_AND | BPF_X: A &= X; break;
+      case BPF_ALU | BPF_XOR | BPF_K: A ^= k; break;
+      case BPF_ALU | BPF_XOR | BPF_X: A ^= X; break;
+      // Shifts of 32 or more are undefined in C; BPF says they give zero.
+      case BPF_ALU | BPF_LSH | BPF_K: A = (k < 32) ? (A << k) : 0; break;
+      case BPF_ALU | BPF_LSH | BPF_X: A = (X < 32) ? (A << X) : 0; break;
+      case BPF_ALU | BPF_RSH | BPF_K: A = (k < 32) ? (A >> k) : 0; break;
+      case BPF_ALU | BPF_RSH | BPF_X: A = (X < 32) ? (A >> X) : 0; break;
+      case BPF_ALU | BPF_NEG: A = -A; break;
+
+      case BPF_JMP | BPF_JA:
+        pc += k;
+        break;
+      case BPF_JMP | BPF_JEQ | BPF_K: pc += (A == k) ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JEQ | BPF_X: pc += (A == X) ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JGT | BPF_K: pc += (A > k) ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JGT | BPF_X: pc += (A > X) ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JGE | BPF_K: pc += (A >= k) ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JGE | BPF_X: pc += (A >= X) ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JSET | BPF_K: pc += (A & k) ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JSET | BPF_X: pc += (A & X) ? insn.jt : insn.jf; break;
+
+      case BPF_RET | BPF_K:
+        return k;
+      case BPF_RET | BPF_A:
+        return A;
+
+      case BPF_MISC | BPF_TAX:
+        X = A;
+        break;
+      case BPF_MISC | BPF_TXA:
+        A = X;
+        break;
+
+      default:
+        // Can't happen - verify() has seen every instruction.
+        return 0;
+    }
+  }
+}
@@ -0,0 +1,97 @@
+/*
+ * 
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MACHINE_BPF_H
+#define MACHINE_BPF_H
+
+#include <processor/types.h>
+#include <Atomic.h>
+
+/// Longest program BpfProgram::create will accept.
+#define BPF_MAXINSNS    4096
+
+/// Scratch memory words available to a program.
+#define BPF_MEMWORDS    16
+
+/**
+ * A classic BPF (Berkeley Packet Filter) program.
+ *
+ * Programs come from userspace (SO_ATTACH_FILTER, or a hook installed into
+ * NetworkFilter), so create() verifies them before they're ever run: every
+ * opcode must be known, jumps may only go forward and must stay within the
+ * program, scratch memory accesses must be in range, division by a constant
+ * zero is rejected and the last instruction must return. A verified program
+ * always terminates, and run() bounds-checks every packet access (anything
+ * out of range drops the packet), so running one is safe anywhere - even in
+ * a driver's interrupt handler.
+ *
+ * Programs are reference counted, as a packet may still be running through
+ * one when it's detached.
+ */
+class BpfProgram
+{
+  public:
+    /** One instruction, in the same layout as struct bpf_insn. */
+    struct Instruction
+    {
+      uint16_t code;
+      uint8_t jt;
+      uint8_t jf;
+      uint32_t k;
+    };
+
+    /** Verifies and copies a program, returning it with one reference, or
+     *  null if it isn't valid. */
+    static BpfProgram *create(const Instruction *pCode, size_t nInstructions);
+
+    /** Runs the program over a packet.
+     *  \return How many bytes of the packet to accept - zero drops it. */
+    uint32_t run(const uint8_t *pPacket, size_t nBytes) const;
+
+    void addRef()
+    {
+      m_nRefs += 1;
+    }
+
+    /** Drops a reference, freeing the program with the last one. */
+    void release();
+
+    size_t getLength() const
+    {
+      return m_nInstructions;
+    }
+
+  private:
+    BpfProgram(Instruction *pCode, size_t nInstructions);
+    ~BpfProgram();
+
+    BpfProgram(const BpfProgram &);
+    BpfProgram &operator = (const BpfProgram &);
+
+    /** Checks a program is safe to run. */
+    static bool verify(const Instruction *pCode, size_t nInstructions);
+
+    Instruction *m_pCode;
+    size_t m_nInstructions;
+
+    Atomic<size_t> m_nRefs;
+};
+
+#endif
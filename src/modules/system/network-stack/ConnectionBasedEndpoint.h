@@ -69,8 +69,10 @@ public:
     /**
      * Puts the connection into the listening state, waiting for incoming
      * connections.
+     * \param backlog How many connections may wait to be accepted; zero
+     *                asks for the protocol's default.
      */
-    virtual void listen()
+    virtual void listen(size_t backlog = 0)
     {
     }
 
@@ -23,90 +23,122 @@
 #include <Log.h>
 
 #include "UdpManager.h"
+#include "NetworkStack.h"
 #include <processor/Processor.h>
+#include <process/Scheduler.h>
 
 Dns Dns::dnsInstance;
-uint16_t Dns::m_NextId = 0;
 
-String qnameLabelHelper(char *buff, size_t *len, uintptr_t buffLoc)
+/** Reads a (possibly compressed) name from a DNS message, leaving offset just
+ *  past it in the message. Returns false if the name is malformed or runs off
+ *  the end of the message. */
+static bool readName(const uint8_t *pMessage, size_t nBytes, size_t &offset, String *pName)
 {
-    String ret;
-    size_t retLen = 0;
-    char *locbuff = buff;
+    char name[256];
+    size_t nameLength = 0;
 
-    // Current offset within this section
-    size_t currOffset = 0;
-
-    // Current size of this section
-    size_t sectionSize = *locbuff++;
-    if(!sectionSize)
-    {
-      // Empty name.
-      *len = 1;
-      ret = ".";
-      return ret;
-    }
-
-    // Keep reading until we hit a zero-sized section
+    size_t pos = offset;
+    size_t nJumps = 0;
+    bool bJumped = false;
     while(true)
     {
-        retLen++;
+        if(pos >= nBytes)
+            return false;
 
-        // Read in the character at this specific position
-        char c = *locbuff++;
+        uint8_t len = pMessage[pos];
 
-        // If it's null, then this is the beginning of a zero-sized section, so
-        // break from the loop: we're done.
-        if(!c)
-            break;
-        // If the top two bits are set, then it's an inline pointer (FUN)
-        else if((c & 0xC0) == 0xC0)
+        // Top two bits set: the rest of the name is somewhere else.
+        if((len & 0xC0) == 0xC0)
         {
-            // The rest of this read comes from *that* location!
-            char offset = *locbuff++;
-            locbuff = reinterpret_cast<char*>(buffLoc + offset);
-            ret += ".";
-
-            // Prepare to read the next part of the hostname
-            currOffset = 0;
-            sectionSize = *locbuff++;
+            // Pointers can point at each other, so stop an endless loop.
+            if((pos + 1 >= nBytes) || (++nJumps > 16))
+                return false;
+
+            if(!bJumped)
+                offset = pos + 2;
+            bJumped = true;
+
+            pos = ((len & 0x3F) << 8) | pMessage[pos + 1];
             continue;
         }
+        else if(len & 0xC0)
+            return false;
 
-        // Otherwise, check to see if we're at the end of the section
-        if(currOffset++ == sectionSize)
-        {
-            ret += ".";
-            sectionSize = c;
-            currOffset = 0;
-        }
-        else
+        pos++;
+        if(!len)
+            break;
+
+        if((pos + len > nBytes) || (nameLength + len + 2 > sizeof(name)))
+            return false;
+
+        if(nameLength)
+            name[nameLength++] = '.';
+        memcpy(&name[nameLength], &pMessage[pos], len);
+        nameLength += len;
+        pos += len;
+    }
+
+    if(!bJumped)
+        offset = pos;
+
+    if(pName)
+    {
+        name[nameLength] = 0;
+        *pName = String(name);
+    }
+    return true;
+}
+
+/** Writes a name into a message as a series of labels. Returns the number of
+ *  bytes written, or zero if the name isn't valid. */
+static size_t writeName(uint8_t *pBuffer, size_t nBytes, const String &name)
+{
+    const char *pName = static_cast<const char*>(name);
+    size_t nameLength = name.length();
+    if(!nameLength || (nameLength + 2 > nBytes))
+        return 0;
+
+    size_t offset = 0;
+    size_t labelStart = 0;
+    for(size_t i = 0; i <= nameLength; i++)
+    {
+        if((i == nameLength) || (pName[i] == '.'))
         {
-            char s[2] = {c, 0};
-            ret += s;
+            size_t len = i - labelStart;
+            if(!len || (len > 63))
+                return 0;
+
+            pBuffer[offset++] = len;
+            memcpy(&pBuffer[offset], &pName[labelStart], len);
+            offset += len;
+            labelStart = i + 1;
         }
-      }
+    }
+    pBuffer[offset++] = 0;
 
-      // Count the last section size byte
-      retLen++;
+    return offset;
+}
 
-      // All done!
-      *len = retLen;
-      return ret;
+Dns::DnsEntry::~DnsEntry()
+{
+    for(List<String*>::Iterator it = aliases.begin(); it != aliases.end(); it++)
+        delete *it;
+    for(List<IpAddress*>::Iterator it = addresses.begin(); it != addresses.end(); it++)
+        delete *it;
 }
 
-Dns::Dns() :
-  m_DnsCache(), m_DnsRequests(), m_Endpoint(0)
+Dns::DnsQuery::~DnsQuery()
 {
+    for(List<String*>::Iterator it = aliases.begin(); it != aliases.end(); it++)
+        delete *it;
+    for(List<IpAddress*>::Iterator it = addresses.begin(); it != addresses.end(); it++)
+        delete *it;
 }
 
-Dns::Dns(const Dns& ent) :
-  m_DnsCache(ent.m_DnsCache), m_DnsRequests(ent.m_DnsRequests), m_Endpoint(ent.m_Endpoint)
+Dns::Dns() :
+  m_DnsCache(), m_DnsQueries(), m_DnsRequests(), m_NextId(0), m_Stats(),
+  m_nServers(0), m_Lock(false), m_Endpoint(0)
 {
-  Thread *pThread = new Thread(Processor::information().getCurrentThread()->getParent(),
-                               reinterpret_cast<Thread::ThreadStartFunc>(&trampoline),
-                               reinterpret_cast<void*>(this));
-  pThread->detach();
 }
 
 Dns::~Dns()
@@ -115,6 +147,9 @@ Dns::~Dns()
 
 void Dns::initialise()
 {
+    // Don't start every boot at the same ID.
+    m_NextId = NetworkStack::getTickCount();
+
     Endpoint *p = UdpManager::instance().getEndpoint(IpAddress(), 0, 53);
     m_Endpoint = static_cast<ConnectionlessEndpoint *>(p);
     m_Endpoint->acceptAnyAddress(true);
@@ -133,311 +168,498 @@ int Dns::trampoline(void* p)
 
 void Dns::mainThread()
 {
-  uint8_t* buff = new uint8_t[1024];
+  uint8_t* buff = new uint8_t[DNS_MAX_MESSAGE];
   uintptr_t buffLoc = reinterpret_cast<uintptr_t>(buff);
-  memset(buff, 0, 1024);
 
-  IpAddress addr(Network::convertToIpv4(0, 0, 0, 0));
   ConnectionlessEndpoint* e = m_Endpoint;
 
   Endpoint::RemoteEndpoint remoteHost;
 
   while(true)
   {
-    if(e->dataReady(true))
+    if(!e->dataReady(true))
+      continue;
+
+    // Read the packet (Safe to block because we've already run dataReady)
+    int n = e->recv(buffLoc, DNS_MAX_MESSAGE, true, &remoteHost);
+    if((n <= 0) || (static_cast<size_t>(n) < sizeof(DnsHeader)))
+      continue;
+
+    DnsHeader* head = reinterpret_cast<DnsHeader*>(buffLoc);
+    if(!(BIG_TO_HOST16(head->opAndParam) & DNS_QUESREQ))
+      continue;
+
+    LockGuard<Mutex> guard(m_Lock);
+
+    // Look for the ID in our request list. The reply has to come from the
+    // server we asked, or anyone could answer for it.
+    for(Vector<DnsRequest*>::Iterator it = m_DnsRequests.begin(); it != m_DnsRequests.end(); it++)
     {
-      // Read the packet (Safe to block because we've already run dataReady)
-      int n = e->recv(buffLoc, 1024, true, &remoteHost);
-      if(n <= 0)
+      DnsRequest *req = *it;
+      if((req->id != head->id) || (req->server != remoteHost.ip))
         continue;
 
-      // grab the header
-      DnsHeader* head = reinterpret_cast<DnsHeader*>(buffLoc);
+      m_DnsRequests.erase(it);
+      handleResponse(req, buff, n);
+      req->pQuery->reply.release();
+      delete req;
+      break;
+    }
+  }
+}
 
-      // look for the ID in our request list
-      bool bFound = false;
-      DnsRequest* req = 0;
-      for(Vector<DnsRequest*>::Iterator it = m_DnsRequests.begin(); it != m_DnsRequests.end(); it++)
+void Dns::handleResponse(DnsRequest *pRequest, const uint8_t *pMessage, size_t nBytes)
+{
+  DnsQuery *pQuery = pRequest->pQuery;
+  const DnsHeader *head = reinterpret_cast<const DnsHeader*>(pMessage);
+
+  // Any other error (SERVFAIL, REFUSED...) leaves the type unanswered, so
+  // the next server gets a go at it.
+  uint16_t rcode = BIG_TO_HOST16(head->opAndParam) & DNS_RESPONSE;
+  if((rcode != DNS_NOERROR) && (rcode != DNS_NXDOMAIN))
+    return;
+
+  uint16_t qCount = BIG_TO_HOST16(head->qCount);
+  uint16_t ansCount = BIG_TO_HOST16(head->aCount);
+  uint16_t nameCount = BIG_TO_HOST16(head->nCount);
+
+  // Skip over the question section.
+  size_t offset = sizeof(DnsHeader);
+  for(uint16_t question = 0; question < qCount; question++)
+  {
+    if(!readName(pMessage, nBytes, offset, 0))
+      return;
+    offset += sizeof(QuestionSecNameSuffix);
+  }
+
+  // Addresses only come from the answer section; the authority section is
+  // only read for the SOA record that says how long a negative answer lasts.
+  // http://www.zytrax.com/books/dns/ch15/ for future reference
+  uint16_t wantType = (pRequest->type == QueryA) ? DNSQUERY_HOSTADDR : DNSQUERY_HOSTADDR6;
+  for(uint16_t answer = 0; answer < (ansCount + nameCount); answer++)
+  {
+    String name;
+    if(!readName(pMessage, nBytes, offset, &name))
+      break;
+    if(offset + sizeof(DnsAnswer) > nBytes)
+      break;
+
+    const DnsAnswer *ans = reinterpret_cast<const DnsAnswer*>(&pMessage[offset]);
+    size_t dataOffset = offset + sizeof(DnsAnswer);
+    uint16_t type = BIG_TO_HOST16(ans->type);
+    uint16_t length = BIG_TO_HOST16(ans->length);
+    uint32_t ttl = BIG_TO_HOST32(ans->ttl);
+    if(dataOffset + length > nBytes)
+      break;
+    offset = dataOffset + length;
+
+    if(answer >= ansCount)
+    {
+      if(type == DNSQUERY_SOA)
       {
-        if((*it)->id == head->id)
-        {
-          req = (*it);
-          bFound = true;
+        if(ttl < pQuery->negativeTtl)
+          pQuery->negativeTtl = ttl;
+      }
+      continue;
+    }
 
-          m_DnsRequests.erase(it);
+    if(type == DNSQUERY_CNAME)
+    {
+      // The name is an alias of whatever it points at. The same alias comes
+      // back in both the A and AAAA answers, so only keep it once.
+      bool bHave = false;
+      for(List<String*>::Iterator it = pQuery->aliases.begin(); it != pQuery->aliases.end(); it++)
+      {
+        if(**it == name)
+        {
+          bHave = true;
           break;
         }
       }
-
-      if(!bFound)
+      if(!bHave)
+        pQuery->aliases.pushBack(new String(name));
+    }
+    else if(type == wantType)
+    {
+      IpAddress *ip = 0;
+      if((type == DNSQUERY_HOSTADDR) && (length == 4))
+      {
+        uint32_t newIp;
+        memcpy(&newIp, &pMessage[dataOffset], 4);
+        ip = new IpAddress(newIp);
+      }
+      else if((type == DNSQUERY_HOSTADDR6) && (length == 16))
+      {
+        uint8_t newIp[16];
+        memcpy(newIp, &pMessage[dataOffset], 16);
+        ip = new IpAddress(newIp);
+      }
+      else
         continue;
 
-      uint16_t qCount = BIG_TO_HOST16(head->qCount);
-      uint16_t ansCount = BIG_TO_HOST16(head->aCount);
-      uint16_t nameCount = BIG_TO_HOST16(head->nCount);
-      uint16_t addCount = BIG_TO_HOST16(head->dCount);
+      pQuery->addresses.pushBack(ip);
 
-      // If there were no answers, this is a "name not found" error.
-      if(!ansCount)
-      {
-          req->success = false;
-          req->waitSem.release();
-          continue;
-      }
+      // The address records belong to the canonical name.
+      if(!pQuery->hostname.length())
+        pQuery->hostname = name;
+    }
+    else
+      continue;
+
+    if(ttl < pQuery->ttl)
+      pQuery->ttl = ttl;
+  }
+
+  if(rcode == DNS_NXDOMAIN)
+    pQuery->bNxDomain = true;
+  pQuery->bAnswered[pRequest->type] = true;
+}
+
+bool Dns::setServers(const Endpoint::RemoteEndpoint *pServers, size_t nServers)
+{
+  if(nServers > DNS_MAX_SERVERS)
+    return false;
+
+  LockGuard<Mutex> guard(m_Lock);
+  for(size_t i = 0; i < nServers; i++)
+    m_Servers[i] = pServers[i];
+  m_nServers = nServers;
+  return true;
+}
 
-      // Read in each question section
-      size_t ansOffset = sizeof(DnsHeader);
-      for(uint16_t question = 0; question < qCount; question++)
+void Dns::runQuery(DnsQuery *pQuery, Network *pCard)
+{
+  // Servers given to setServers() take the place of the card's.
+  Endpoint::RemoteEndpoint servers[DNS_MAX_SERVERS];
+  size_t nServers = 0;
+  {
+    LockGuard<Mutex> guard(m_Lock);
+    for(nServers = 0; nServers < m_nServers; nServers++)
+      servers[nServers] = m_Servers[nServers];
+  }
+
+  StationInfo info = pCard->getStationInfo();
+  if(!nServers && !info.nDnsServers)
+    return;
+
+  static const uint16_t types[QueryTypes] = {DNSQUERY_HOSTADDR, DNSQUERY_HOSTADDR6};
+
+  uint8_t buff[DNS_MAX_MESSAGE];
+  uintptr_t buffLoc = reinterpret_cast<uintptr_t>(buff);
+
+  // Both questions share the name, so it only needs building once.
+  size_t nameLength = writeName(&buff[sizeof(DnsHeader)], DNS_MAX_MESSAGE - sizeof(DnsHeader) - sizeof(QuestionSecNameSuffix), pQuery->name);
+  if(!nameLength)
+    return;
+  size_t len = sizeof(DnsHeader) + nameLength + sizeof(QuestionSecNameSuffix);
+
+  DnsHeader* head = reinterpret_cast<DnsHeader*>(buffLoc);
+  QuestionSecNameSuffix* q = reinterpret_cast<QuestionSecNameSuffix*>(buffLoc + sizeof(DnsHeader) + nameLength);
+
+  for(size_t attempt = 0; attempt < DNS_ATTEMPTS; attempt++)
+  {
+    for(size_t dnsServer = 0; dnsServer < (nServers ? nServers : info.nDnsServers); dnsServer++)
+    {
+      Endpoint::RemoteEndpoint remoteHost;
+      if(nServers)
+        remoteHost = servers[dnsServer];
+      else
       {
-          // Read in the string (have to do this to get the size... bah). Note
-          // that the NAME field for a QUESTION section will never be a pointer,
-          // unlike the ANSWER section below.
-          size_t nameLength = 0;
-          String tmp = qnameLabelHelper(reinterpret_cast<char*>(buffLoc + ansOffset), &nameLength, buffLoc);
-
-          // Add to the offset. We don't really care about the suffix at the
-          // moment as we're mainly doing this to get to the answer section.
-          ansOffset += nameLength + sizeof(QuestionSecNameSuffix);
+        remoteHost.remotePort = 53;
+        remoteHost.ip = info.dnsServers[dnsServer];
       }
 
-      uintptr_t ansStart = buffLoc + ansOffset;
-
-      // http://www.zytrax.com/books/dns/ch15/ for future reference
-      bool hostnameFilled = false;
-      for(uint16_t answer = 0; answer < (ansCount + nameCount + addCount); answer++)
+      // Ask (again) for whichever types haven't been answered yet; the A and
+      // AAAA questions go out together and are waited on together.
+      for(size_t type = 0; type < QueryTypes; type++)
       {
-        DnsAnswer* ans = reinterpret_cast<DnsAnswer*>(ansStart);
-        String *qname = new String;
-        if(BIG_TO_HOST16(ans->name) & 0xC000)
+        DnsRequest *req = 0;
         {
-          // This is an offset within the DNS packet to the string
-          size_t len = 0;
-          size_t offset = BIG_TO_HOST16(ans->name) - 0xC000;
-          *qname = qnameLabelHelper(reinterpret_cast<char*>(buffLoc + offset), &len, buffLoc);
-          NOTICE("Got: " << *qname << ", len " << len << ".");
-        }
-        else
-        {
-          // This is a name component within the answer section
-          /// \todo this code is pretty broken - needs to be rewritten.
-          size_t len = 0;
-          *qname = qnameLabelHelper(reinterpret_cast<char*>(ansStart), &len, buffLoc);
-          NOTICE("Got: " << *qname << ", len " << len << ".");
-
-          // Update the answer pointer so the rest of the structure comes across properly
-          ans = reinterpret_cast<DnsAnswer*>((ansStart + len) - sizeof(ans->name));
+          LockGuard<Mutex> guard(m_Lock);
+          if(pQuery->bAnswered[type])
+            continue;
+
+          req = new DnsRequest;
+          req->id = m_NextId++;
+          req->server = remoteHost.ip;
+          req->type = static_cast<QueryType>(type);
+          req->pQuery = pQuery;
+          m_DnsRequests.pushBack(req);
+          m_Stats.requests++;
         }
 
-        switch(BIG_TO_HOST16(ans->type))
+        memset(head, 0, sizeof(DnsHeader));
+        head->id = req->id;
+        head->opAndParam = HOST_TO_BIG16(DNS_RECURSION);
+        head->qCount = HOST_TO_BIG16(1);
+        q->type = HOST_TO_BIG16(types[type]);
+        q->cls = HOST_TO_BIG16(1);
+
+        m_Endpoint->send(len, buffLoc, remoteHost, false);
+      }
+
+      bool bTimedOut = false;
+      while(true)
+      {
         {
-          /** A Record */
-          case 0x0001:
-            {
-              // Add the IP address for this entry to the list
-              if(BIG_TO_HOST16(ans->length) == 4)
-              {
-                uint32_t newIp = *reinterpret_cast<uint32_t*>(ansStart + sizeof(DnsAnswer));
-                IpAddress *ip = new IpAddress(newIp);
-                req->addresses.pushBack(ip);
-              }
-
-              // Add the name to the aliases list
-              req->aliases.pushBack(qname);
-              qname = 0;
-            }
-            break;
-            /** NS */
-            case 0x0002:
-            {
-                WARNING("TODO: NS Records");
-            }
-            break;
-            /** CNAME */
-            case 0x0005:
-            {
-                // Set the CNAME
-                if(!hostnameFilled)
-                {
-                    req->hostname = *qname;
-                    hostnameFilled = true;
-                }
-            }
-            break;
-            /** SOA */
-            case 0x0006:
-            {
-                WARNING("TODO: SOA Records");
-            }
-            break;
-            /* WKS */
-            case 0x000B:
-            {
-                WARNING("TODO: WKS Records");
-            }
-            break;
-            /* PTR */
-            case 0x000C:
-            {
-                WARNING("TODO: PTR Records");
-            }
-            break;
-            /* MX */
-            case 0x000F:
-            {
-                WARNING("TODO: MX Records");
-            }
-            break;
-            /* SRV */
-            case 0x0021:
-            {
-                WARNING("TODO: SRV Records");
-            }
-            break;
-            /* A6 */
-            case 0x0026:
-            {
-                WARNING("TODO: A6 Records");
-            }
+          LockGuard<Mutex> guard(m_Lock);
+          if(pQuery->bAnswered[QueryA] && pQuery->bAnswered[QueryAAAA])
             break;
-            default:
-            {
-                WARNING("Unknown record type '" << (BIG_TO_HOST16(ans->type)) << "' returned from DNS server");
-            }
+          if(bTimedOut)
+          {
+            m_Stats.timeouts++;
             break;
+          }
         }
 
-        // If the qname string wasn't used, delete it
-        if(qname)
-            delete qname;
-
-        ansStart += sizeof(DnsAnswer) + BIG_TO_HOST16(ans->length);
+        // Each answer (useful or not) wakes us up to check.
+        bTimedOut = !pQuery->reply.acquire(1, DNS_TIMEOUT);
+        if(Processor::information().getCurrentThread()->wasInterrupted())
+          break;
       }
 
-      // If no hostname was filled, take one from the aliases (if possible)
-      if(!hostnameFilled)
+      // Forget the requests to this server; anything it says now is too late.
+      bool bDone = false;
       {
-          if(req->aliases.count())
-              req->hostname = *(*(req->aliases.begin()));
-      }
+        LockGuard<Mutex> guard(m_Lock);
+        for(Vector<DnsRequest*>::Iterator it = m_DnsRequests.begin(); it != m_DnsRequests.end();)
+        {
+          if((*it)->pQuery == pQuery)
+          {
+            delete *it;
+            it = m_DnsRequests.erase(it);
+          }
+          else
+            it++;
+        }
 
-      if(req->callerLeft)
-          delete req;
-      else
-      {
-          /// \todo Rewrite the DNS cache mechanism. For now, we'll just avoid
-          ///       caching. A proper DNS cache mechanism needs to handle the
-          ///       CNAMEs as well as the aliases
-          // m_DnsCache.pushBack(req->entry);
-          req->success = true;
-          req->waitSem.release();
+        bDone = pQuery->bAnswered[QueryA] && pQuery->bAnswered[QueryAAAA];
       }
+
+      if(bDone || Processor::information().getCurrentThread()->wasInterrupted())
+        return;
     }
   }
 }
 
-int Dns::hostToIp(String hostname, HostInfo& ret, Network* pCard)
+void Dns::cacheResult(DnsQuery *pQuery)
 {
-    if(!pCard || !pCard->isConnected())
-        return -1;
+  // A query that didn't get both answers may just have been unlucky with
+  // the network, and a TTL of zero means the answer mustn't be reused.
+  if(!(pQuery->bAnswered[QueryA] && pQuery->bAnswered[QueryAAAA]))
+    return;
+
+  uint32_t ttl = 0;
+  if(pQuery->addresses.count())
+    ttl = (pQuery->ttl > DNS_MAX_TTL) ? DNS_MAX_TTL : pQuery->ttl;
+  else
+    ttl = (pQuery->negativeTtl > DNS_MAX_NEGATIVE_TTL) ? DNS_MAX_NEGATIVE_TTL : pQuery->negativeTtl;
+  if(!ttl)
+    return;
+
+  uint64_t now = NetworkStack::getTickCount();
+
+  if(m_DnsCache.count() >= DNS_CACHE_SIZE)
+  {
+    // Make room by throwing out whatever has expired, or failing that
+    // whatever is closest to expiring.
+    List<DnsEntry*> expired;
+    DnsEntry *pOldest = 0;
+    for(RadixTree<DnsEntry*>::Iterator it = m_DnsCache.begin(); it != m_DnsCache.end(); it++)
+    {
+      DnsEntry *pEntry = *it;
+      if(pEntry->expires <= now)
+        expired.pushBack(pEntry);
+      else if(!pOldest || (pEntry->expires < pOldest->expires))
+        pOldest = pEntry;
+    }
+
+    if(!expired.count() && pOldest)
+      expired.pushBack(pOldest);
 
-    /// \todo Rewrite DNS cache mechanism
-    /*for(List<DnsEntry*>::Iterator it = m_DnsCache.begin(); it!= m_DnsCache.end(); it++)
+    for(List<DnsEntry*>::Iterator it = expired.begin(); it != expired.end(); it++)
     {
-        if(!strcmp(static_cast<const char*>((*it)->hostname), static_cast<const char*>(hostname)))
-        {
-            nIps = (*it)->numIps;
-            return (*it)->ip;
-        }
-    }*/
+      m_DnsCache.remove((*it)->name);
+      delete *it;
+    }
+  }
+
+  DnsEntry *pEntry = m_DnsCache.lookup(pQuery->name);
+  if(pEntry)
+  {
+    m_DnsCache.remove(pQuery->name);
+    delete pEntry;
+  }
+
+  pEntry = new DnsEntry;
+  pEntry->name = pQuery->name;
+  pEntry->expires = now + (static_cast<uint64_t>(ttl) * 1000);
+  if(pQuery->addresses.count())
+  {
+    copyResult(pQuery->hostname, pQuery->aliases, pQuery->addresses, pEntry->hostname,
+               pEntry->aliases, pEntry->addresses);
+  }
+  m_DnsCache.insert(pEntry->name, pEntry);
+}
+
+void Dns::copyResult(const String &hostname, const List<String*> &aliases, const List<IpAddress*> &addresses,
+                     String &retHostname, List<String*> &retAliases, List<IpAddress*> &retAddresses)
+{
+  retHostname = hostname;
+  for(List<String*>::ConstIterator it = aliases.begin(); it != aliases.end(); it++)
+    retAliases.pushBack(new String(**it));
+  for(List<IpAddress*>::ConstIterator it = addresses.begin(); it != addresses.end(); it++)
+    retAddresses.pushBack(new IpAddress(**it));
+}
+
+void Dns::releaseQuery(DnsQuery *pQuery)
+{
+  if(!--pQuery->refs)
+    delete pQuery;
+}
 
-    // Grab the DNS server to use
-    StationInfo info = pCard->getStationInfo();
-    if(info.nDnsServers == 0)
+void Dns::flushCache()
+{
+  LockGuard<Mutex> guard(m_Lock);
+
+  for(RadixTree<DnsEntry*>::Iterator it = m_DnsCache.begin(); it != m_DnsCache.end(); it++)
+    delete *it;
+  m_DnsCache.clear();
+}
+
+int Dns::hostToIp(String hostname, HostInfo& ret, Network* pCard)
+{
+    // Names are case insensitive, and "host." is the same as "host", so the
+    // cache and the lookups in progress all use a lowercase name without the
+    // trailing dot.
+    size_t nameLength = hostname.length();
+    if(nameLength && (hostname[nameLength - 1] == '.'))
+        nameLength--;
+    if(!nameLength)
         return -1;
 
-    // Setup for our request
-    ConnectionlessEndpoint* e = m_Endpoint;
+    char *name = new char[nameLength + 1];
+    for(size_t i = 0; i < nameLength; i++)
+    {
+        char c = hostname[i];
+        name[i] = ((c >= 'A') && (c <= 'Z')) ? (c - 'A' + 'a') : c;
+    }
+    name[nameLength] = 0;
+    hostname = String(name);
+    delete [] name;
 
-    uint8_t* buff = new uint8_t[1024];
-    uintptr_t buffLoc = reinterpret_cast<uintptr_t>(buff);
-    memset(buff, 0, 1024);
+    m_Lock.acquire();
 
-    // Setup the DNS message header
-    DnsHeader* head = reinterpret_cast<DnsHeader*>(buffLoc);
-    head->id = m_NextId++;
-    head->opAndParam = HOST_TO_BIG16(DNS_RECURSION);
-    head->qCount = HOST_TO_BIG16(1);
-
-    // Build the modified hostname
-    size_t len = hostname.length() + 1;
-    char* host = new char[len];
-    memset(host, 0, len);
-
-    size_t top = hostname.length();
-    size_t prevSize = 0;
-    for(ssize_t i = top - 1; i >= 0; i--)
+    DnsEntry *pEntry = m_DnsCache.lookup(hostname);
+    if(pEntry && (pEntry->expires <= NetworkStack::getTickCount()))
+    {
+        m_DnsCache.remove(hostname);
+        delete pEntry;
+        pEntry = 0;
+    }
+
+    if(pEntry)
     {
-        if(hostname[i] == '.')
+        int result = -1;
+        if(pEntry->addresses.count())
         {
-            host[i+1] = prevSize;
-            prevSize = 0;
+            m_Stats.hits++;
+            copyResult(pEntry->hostname, pEntry->aliases, pEntry->addresses,
+                       ret.hostname, ret.aliases, ret.addresses);
+            result = 0;
         }
         else
+            m_Stats.negativeHits++;
+
+        m_Lock.release();
+        return result;
+    }
+
+    m_Stats.misses++;
+
+    // If someone's already looking this name up, wait for their answer.
+    DnsQuery *pQuery = 0;
+    for(List<DnsQuery*>::Iterator it = m_DnsQueries.begin(); it != m_DnsQueries.end(); it++)
+    {
+        if((*it)->name == hostname)
         {
-            host[i+1] = hostname[i];
-            prevSize++;
+            pQuery = *it;
+            break;
         }
     }
-    host[0] = prevSize;
 
-    memcpy(reinterpret_cast<char*>(buffLoc + sizeof(DnsHeader)), host, len);
+    if(pQuery)
+    {
+        m_Stats.coalesced++;
+        pQuery->refs++;
+        m_Lock.release();
 
-    delete [] host;
+        while(!pQuery->bFinished)
+        {
+            pQuery->done.acquire();
+            if(Processor::information().getCurrentThread()->wasInterrupted())
+                break;
+        }
 
-    // Request the host address
-    QuestionSecNameSuffix* q = reinterpret_cast<QuestionSecNameSuffix*>(buffLoc + sizeof(DnsHeader) + len + 1);
-    q->type = HOST_TO_BIG16(1);
-    q->cls = HOST_TO_BIG16(1);
+        LockGuard<Mutex> guard(m_Lock);
 
-    // Shove all this into a DnsRequest ready for replies
-    DnsRequest* req = new DnsRequest;
-    req->id = head->id;
+        int result = -1;
+        if(pQuery->bFinished && pQuery->bSuccess)
+        {
+            copyResult(pQuery->hostname, pQuery->aliases, pQuery->addresses,
+                       ret.hostname, ret.aliases, ret.addresses);
+            result = 0;
+        }
 
-    m_DnsRequests.pushBack(req);
+        releaseQuery(pQuery);
+        return result;
+    }
 
-    // Try each DNS server until we actually get a successful query on one
-    for(size_t dnsServer = 0; dnsServer < info.nDnsServers; dnsServer++)
+    // Can't ask anyone without a connected card.
+    if(!pCard || !pCard->isConnected())
     {
-        Endpoint::RemoteEndpoint remoteHost;
-        remoteHost.remotePort = 53;
-        remoteHost.ip = info.dnsServers[dnsServer];
+        m_Lock.release();
+        return -1;
+    }
 
-        req->success = false;
-        if(e->send(sizeof(DnsHeader) + sizeof(QuestionSecNameSuffix) + len + 1, buffLoc, remoteHost, false) < 0)
-            continue;
+    pQuery = new DnsQuery;
+    pQuery->name = hostname;
+    m_DnsQueries.pushBack(pQuery);
 
-        req->waitSem.acquire(1, 15);
-        if(Processor::information().getCurrentThread()->wasInterrupted())
-        {
-            req->callerLeft = true;
-            return -1;
-        }
+    m_Lock.release();
 
-        if(!req->success)
+    runQuery(pQuery, pCard);
+
+    LockGuard<Mutex> guard(m_Lock);
+
+    for(List<DnsQuery*>::Iterator it = m_DnsQueries.begin(); it != m_DnsQueries.end(); it++)
+    {
+        if(*it == pQuery)
         {
-            delete req;
+            m_DnsQueries.erase(it);
+            break;
         }
-        else
-        {
+    }
 
-            ret.addresses = req->addresses;
-            ret.aliases = req->aliases;
-            ret.hostname = req->hostname;
+    if(!pQuery->hostname.length())
+        pQuery->hostname = hostname;
 
-            delete req;
-            return 0;
-        }
+    cacheResult(pQuery);
+
+    // Wake up everyone who was waiting on us, even if we were interrupted,
+    // or they'd be left waiting forever.
+    pQuery->bSuccess = pQuery->addresses.count() != 0;
+    pQuery->bFinished = true;
+    pQuery->done.release(pQuery->refs - 1);
+
+    int result = -1;
+    if(pQuery->bSuccess)
+    {
+        copyResult(pQuery->hostname, pQuery->aliases, pQuery->addresses,
+                   ret.hostname, ret.aliases, ret.addresses);
+        result = 0;
     }
 
-    return -1;
+    releaseQuery(pQuery);
+    return result;
 }
@@ -23,10 +23,13 @@
 
 #include <utilities/String.h>
 #include <utilities/Vector.h>
-#include <utilities/Tree.h>
+#include <utilities/List.h>
+#include <utilities/RadixTree.h>
 #include <processor/state.h>
 #include <processor/types.h>
 #include <process/Semaphore.h>
+#include <process/Mutex.h>
+#include <LockGuard.h>
 #include <machine/Network.h>
 #include <machine/Machine.h>
 
@@ -44,31 +47,87 @@
 #define DNS_RSVD       0x70
 #define DNS_RESPONSE   0xF // response code - 0 means no errors
 
+/** Response codes */
+#define DNS_NOERROR    0
+#define DNS_NXDOMAIN   3
+
 /** Query types */
 #define DNSQUERY_HOSTADDR     1
+#define DNSQUERY_CNAME        5
+#define DNSQUERY_SOA          6
+#define DNSQUERY_HOSTADDR6    28
+
+/// Largest message we send or accept (we don't do EDNS or TCP).
+#define DNS_MAX_MESSAGE       512
+
+/// Most names kept in the cache.
+#define DNS_CACHE_SIZE        256
+
+/// Seconds to wait for a server to answer before trying the next one.
+#define DNS_TIMEOUT           3
+
+/// Times each server is tried before a lookup fails.
+#define DNS_ATTEMPTS          2
+
+/// Seconds to cache a name that doesn't exist, if the server doesn't say.
+#define DNS_NEGATIVE_TTL      60
+
+/// Most servers setServers() takes.
+#define DNS_MAX_SERVERS       4
+
+/// Upper bounds on how long (in seconds) answers are cached.
+#define DNS_MAX_TTL           86400
+#define DNS_MAX_NEGATIVE_TTL  3600
 
 /**
  * The Pedigree network stack - DNS implementation
+ *
+ * Lookups ask for A and AAAA records at the same time, trying each of the
+ * card's DNS servers in turn. Answers (including "no such name") are cached
+ * for as long as the server says they're good for, and callers looking up a
+ * name that's already being looked up wait for that query instead of sending
+ * their own.
  */
 class Dns
 {
 public:
   Dns();
-  Dns(const Dns& ent);
   virtual ~Dns();
   
   /** Information about a host (based on a specific hostname) */
   struct HostInfo
   {
-      /// Hostname for this host, based on our request (probably a CNAME)
+      /// Canonical name for this host (the target of any CNAMEs)
       String hostname;
 
-      /// Aliases for this host (A records)
+      /// Aliases for this host (names that were CNAMEs)
       List<String*> aliases;
 
-      /// IP addresses for this host
+      /// IP addresses for this host, IPv4 and IPv6
       List<IpAddress*> addresses;
   };
+
+  /** Resolver statistics */
+  struct Statistics
+  {
+      /// Lookups answered from the cache with addresses
+      size_t hits;
+
+      /// Lookups answered from the cache with "no such name"
+      size_t negativeHits;
+
+      /// Lookups that weren't in the cache
+      size_t misses;
+
+      /// Misses that waited on another caller's query rather than sending
+      size_t coalesced;
+
+      /// Requests sent to servers (each A or AAAA question counts)
+      size_t requests;
+
+      /// Times a server didn't answer in time
+      size_t timeouts;
+  };
   
   /** For access to the stack without declaring an instance of it */
   static Dns& instance()
@@ -85,20 +144,36 @@ public:
   /** Initialises the Endpoint and begins running the worker thread */
   void initialise();
   
-  /** Requests a lookup for a hostname */
+  /** Requests a lookup for a hostname. The caller owns the aliases and
+   *  addresses added to ret. Returns 0 on success, -1 on failure. */
   int hostToIp(String hostname, HostInfo& ret, Network* pCard = 0);
-  
-  /** Operator = is invalid */
-  Dns& operator = (const Dns& ent)
+
+  /** Returns a snapshot of the resolver statistics. */
+  Statistics getStatistics()
+  {
+    LockGuard<Mutex> guard(m_Lock);
+    return m_Stats;
+  }
+
+  /** Number of names in the cache. */
+  size_t getCacheSize()
   {
-    NOTICE("Dns::operator = called!");
-    return *this;
+    LockGuard<Mutex> guard(m_Lock);
+    return m_DnsCache.count();
   }
 
+  /** Forgets everything in the cache. */
+  void flushCache();
+
+  /** Asks the given servers (address and port) instead of each card's own,
+   *  or goes back to the cards' servers if nServers is zero. */
+  bool setServers(const Endpoint::RemoteEndpoint *pServers, size_t nServers);
+
 private:
+  Dns(const Dns&);
+  Dns& operator = (const Dns&);
 
   static Dns dnsInstance;
-  static uint16_t m_NextId;
 
   struct DnsHeader
   {
@@ -116,94 +191,158 @@ private:
     uint16_t  cls;
   } __attribute__ ((packed));
   
+  /** A resource record, after its name */
   struct DnsAnswer
   {
-    uint16_t  name;
     uint16_t  type;
     uint16_t  cls;
     uint32_t  ttl;
     uint16_t  length;
   } __attribute__ ((packed));
+
+  /// Record types asked for by each lookup
+  enum QueryType
+  {
+    QueryA = 0,
+    QueryAAAA,
+    QueryTypes
+  };
   
-  /** An entry in the DNS cache */
+  /** A cached answer, positive or negative */
   class DnsEntry
   {
     public:
-      DnsEntry() : ip(0), numIps(0), hostname()
-      {};
-      DnsEntry(const DnsEntry& ent) : ip(ent.ip), numIps(ent.numIps), hostname(ent.hostname)
+      DnsEntry() : name(), hostname(), aliases(), addresses(), expires(0)
       {};
+      ~DnsEntry();
+
+      /// Name looked up (the cache key)
+      String name;
       
-      /// Multiple IP addresses are possible
-      IpAddress* ip;
-      size_t numIps;
-      
-      /// Hostname
+      /// Canonical name
       String hostname;
-      
-      DnsEntry& operator = (const DnsEntry& ent)
-      {
-        ip = ent.ip;
-        numIps = ent.numIps;
-        hostname = ent.hostname;
-        return *this;
-      }
+
+      /// Aliases
+      List<String*> aliases;
+
+      /// Addresses - none if the name doesn't exist
+      List<IpAddress*> addresses;
+
+      /// When the entry stops being valid, in milliseconds since boot
+      uint64_t expires;
+
+    private:
+      DnsEntry(const DnsEntry&);
+      DnsEntry& operator = (const DnsEntry&);
   };
   
-  /// a DNS request we've sent
-  class DnsRequest
+  /** A lookup in progress, shared by every caller asking for the name */
+  class DnsQuery
   {
     public:
-      DnsRequest() :
-        hostname(), aliases(), addresses(), id(0), waitSem(0),
-        success(false), callerLeft(false)
-      {};
-      DnsRequest(const DnsRequest& ent) :
-        hostname(ent.hostname), aliases(ent.aliases), addresses(ent.addresses), id(ent.id),
-        waitSem(0), success(ent.success), callerLeft(ent.callerLeft)
-      {};
-      
-      /// Hostname for this host, based on our request (probably a CNAME)
-      String hostname;
+      DnsQuery() :
+        name(), hostname(), aliases(), addresses(), refs(1), reply(0), done(0),
+        ttl(DNS_MAX_TTL), negativeTtl(DNS_NEGATIVE_TTL), bNxDomain(false),
+        bFinished(false), bSuccess(false)
+      {
+        for(size_t i = 0; i < QueryTypes; i++)
+          bAnswered[i] = false;
+      };
+      ~DnsQuery();
 
-      /// Aliases for this host (A records)
-      List<String*> aliases;
+      /// Name being looked up
+      String name;
 
-      /// IP addresses for this host
+      /// Answer so far
+      String hostname;
+      List<String*> aliases;
       List<IpAddress*> addresses;
 
+      /// Callers using this query: the one running it, plus waiters
+      size_t refs;
+
+      /// Released by the receive thread each time an answer comes in
+      Semaphore reply;
+
+      /// Released (once per waiter) when the query finishes
+      Semaphore done;
+
+      /// Lowest TTL of the records used, in seconds
+      uint32_t ttl;
+
+      /// How long to cache "no such name" for, in seconds
+      uint32_t negativeTtl;
+
+      /// Whether each record type has been answered (even if with nothing)
+      bool bAnswered[QueryTypes];
+
+      /// The server said the name doesn't exist
+      bool bNxDomain;
+
+      /// Set once the query is over and the result can be read
+      bool bFinished;
+      bool bSuccess;
+
+    private:
+      DnsQuery(const DnsQuery&);
+      DnsQuery& operator = (const DnsQuery&);
+  };
+
+  /// a DNS request we've sent
+  struct DnsRequest
+  {
       /// DNS request ID
       uint16_t id;
-      
-      /// Semaphore used to wake up the caller thread when this request completes
-      Semaphore waitSem;
-      
-      /// Whether or not the request succeeded (possibly redundant now)
-      bool success;
 
-      // Whether or not the caller left. If true, the request handler needs to
-      // free the request rather than waking up the calling thread.
-      bool callerLeft;
-      
-      DnsRequest& operator = (const DnsRequest& ent)
-      {
-        hostname = ent.hostname;
-        aliases = ent.aliases;
-        addresses = ent.addresses;
-        id = ent.id;
-        success = ent.success;
-        callerLeft = ent.callerLeft;
-        return *this;
-      }
-      
-    private:
+      /// Server the request went to
+      IpAddress server;
+
+      /// Record type asked for
+      QueryType type;
+
+      /// Query the request belongs to
+      DnsQuery *pQuery;
   };
+
+  /** Sends the query to each server in turn until it's answered. Called
+   *  without the lock held. */
+  void runQuery(DnsQuery *pQuery, Network *pCard);
+
+  /** Adds the records in a response to its query. Lock must be held. */
+  void handleResponse(DnsRequest *pRequest, const uint8_t *pMessage, size_t nBytes);
+
+  /** Caches the result of a finished query. Lock must be held. */
+  void cacheResult(DnsQuery *pQuery);
+
+  /** Copies an answer, making new aliases and addresses. Lock must be held. */
+  static void copyResult(const String &hostname, const List<String*> &aliases,
+                         const List<IpAddress*> &addresses, String &retHostname,
+                         List<String*> &retAliases, List<IpAddress*> &retAddresses);
+
+  /** Drops a reference to a query, freeing it with the last. Lock must be held. */
+  static void releaseQuery(DnsQuery *pQuery);
   
-  /// DNS cache (not a Tree because we can't look up an IpAddress object)
-  List<DnsEntry*> m_DnsCache;
+  /// DNS cache, keyed by name
+  RadixTree<DnsEntry*> m_DnsCache;
+
+  /// Lookups in progress
+  List<DnsQuery*> m_DnsQueries;
   
   /// DNS request list
   Vector<DnsRequest*> m_DnsRequests;
+
+  /// Next request ID
+  uint16_t m_NextId;
+
+  /// Statistics
+  Statistics m_Stats;
+
+  /// Servers from setServers(), if any
+  Endpoint::RemoteEndpoint m_Servers[DNS_MAX_SERVERS];
+  size_t m_nServers;
+
+  /// Protects the cache, the lookups and the requests
+  Mutex m_Lock;
   
   /// DNS communication endpoint
   ConnectionlessEndpoint* m_Endpoint;
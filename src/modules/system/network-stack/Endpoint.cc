@@ -21,3 +21,61 @@
 #include "Endpoint.h"
 #include "ConnectionlessEndpoint.h"
 #include "ConnectionBasedEndpoint.h"
+#include "Bpf.h"
+#include "Filter.h"
+
+Endpoint::~Endpoint()
+{
+    if(m_pFilter)
+        m_pFilter->release();
+
+    // Hooks a raw socket installed for every packet go with it.
+    NetworkFilter::instance().removeOwner(this);
+}
+
+void Endpoint::setFilter(BpfProgram *pProgram)
+{
+    if(pProgram)
+        pProgram->addRef();
+
+    m_FilterLock.acquire();
+    BpfProgram *pOld = m_pFilter;
+    m_pFilter = pProgram;
+    m_FilterLock.release();
+
+    if(pOld)
+        pOld->release();
+}
+
+void Endpoint::inheritFilter(Endpoint *pOther)
+{
+    pOther->m_FilterLock.acquire();
+    BpfProgram *pProgram = pOther->m_pFilter;
+    if(pProgram)
+        pProgram->addRef();
+    pOther->m_FilterLock.release();
+
+    setFilter(pProgram);
+    if(pProgram)
+        pProgram->release();
+}
+
+size_t Endpoint::filterPacket(uintptr_t packet, size_t nBytes)
+{
+    if(!m_pFilter)
+        return nBytes;
+
+    m_FilterLock.acquire();
+    BpfProgram *pProgram = m_pFilter;
+    if(pProgram)
+        pProgram->addRef();
+    m_FilterLock.release();
+
+    if(!pProgram)
+        return nBytes;
+
+    size_t nAccept = pProgram->run(reinterpret_cast<const uint8_t*>(packet), nBytes);
+    pProgram->release();
+
+    return (nAccept < nBytes) ? nAccept : nBytes;
+}
@@ -25,7 +25,9 @@
 #include <utilities/Vector.h>
 #include <processor/types.h>
 #include <machine/Network.h>
+#include <Spinlock.h>
 class Socket;
+class BpfProgram;
 
 // Forward declaration, because Endpoint is used by ProtocolManager
 class ProtocolManager;
@@ -70,17 +72,17 @@ public:
     /** Constructors and destructors */
     Endpoint() :
             m_Sockets(), m_LocalPort(0), m_RemotePort(0), m_LocalIp(), m_RemoteIp(),
-            m_Manager(0), m_bConnection(false)
+            m_Manager(0), m_pFilter(0), m_FilterLock(), m_bConnection(false)
     {};
     Endpoint(uint16_t local, uint16_t remote) :
             m_Sockets(), m_LocalPort(local), m_RemotePort(remote), m_LocalIp(), m_RemoteIp(),
-            m_Manager(0), m_bConnection(false)
+            m_Manager(0), m_pFilter(0), m_FilterLock(), m_bConnection(false)
     {};
     Endpoint(IpAddress remoteIp, uint16_t local = 0, uint16_t remote = 0) :
             m_Sockets(), m_LocalPort(local), m_RemotePort(remote), m_LocalIp(), m_RemoteIp(remoteIp),
-            m_Manager(0), m_bConnection(false)
+            m_Manager(0), m_pFilter(0), m_FilterLock(), m_bConnection(false)
     {};
-    virtual ~Endpoint() {};
+    virtual ~Endpoint();
 
     /** Endpoint type (implemented by the concrete child classes) */
     virtual EndpointType getType() = 0;
@@ -143,8 +145,9 @@ public:
         return false;
     };
 
-    /** <Protocol>Manager functionality */
-    virtual size_t depositPayload(size_t nBytes, uintptr_t payload, RemoteEndpoint remoteHost)
+    /** <Protocol>Manager functionality. If pBuffer is given, payload lies
+     *  within it and the endpoint may keep a clone rather than a copy. */
+    virtual size_t depositPayload(size_t nBytes, uintptr_t payload, RemoteEndpoint remoteHost, NetworkBuffer *pBuffer = 0)
     {
         return 0;
     }
@@ -196,6 +199,18 @@ public:
         }
     }
 
+    /** Attaches a socket filter (SO_ATTACH_FILTER) in place of any already
+     *  attached, taking a reference to it. Null detaches the filter. */
+    void setFilter(BpfProgram *pProgram);
+
+    /** Attaches the same filter as pOther has, as an accepted connection
+     *  takes its listener's. */
+    void inheritFilter(Endpoint *pOther);
+
+    /** Runs a packet through the socket filter, returning how many bytes of
+     *  it to accept: all of them if there's no filter, none to drop it. */
+    size_t filterPacket(uintptr_t packet, size_t nBytes);
+
 protected:
 
     /** List of sockets linked to this Endpoint */
@@ -218,6 +233,12 @@ private:
     /** Protocol manager */
     ProtocolManager *m_Manager;
 
+    /** Socket filter, if one's attached */
+    BpfProgram *m_pFilter;
+
+    /** Held while taking or swapping a reference to the filter */
+    Spinlock m_FilterLock;
+
 protected:
 
     /** Connection-based?
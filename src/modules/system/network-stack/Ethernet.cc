@@ -23,11 +23,12 @@
 #include "Ipv4.h"
 #include "Ipv6.h"
 #include "RawManager.h"
+#include "PacketCapture.h"
+#include "TcpOffload.h"
 #include <Module.h>
 #include <Log.h>
 
 
-#include "Filter.h"
 
 Ethernet Ethernet::ethernetInstance;
 
@@ -41,18 +42,11 @@ Ethernet::~Ethernet()
   //
 }
 
-void Ethernet::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset)
+void Ethernet::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset, NetworkBuffer *pBuffer)
 {
   if(!packet || !nBytes || !pCard)
       return;
 
-  // Check for filtering
-  if(!NetworkFilter::instance().filter(1, packet, nBytes))
-  {
-    pCard->droppedPacket();
-    return; // Drop the packet.
-  }
-
   // grab the header
   ethernetHeader* ethHeader = reinterpret_cast<ethernetHeader*>(packet + offset);
 
@@ -76,14 +70,14 @@ void Ethernet::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t
     case ETH_IPV4:
       // NOTICE("IPv4 packet!");
 
-      Ipv4::instance().receive(nBytes, packet, pCard, sizeof(ethernetHeader));
+      Ipv4::instance().receive(nBytes, packet, pCard, sizeof(ethernetHeader), pBuffer);
 
       break;
 
     case ETH_IPV6:
       // NOTICE("IPv6 packet!");
 
-      Ipv6::instance().receive(nBytes, packet, pCard, sizeof(ethernetHeader));
+      Ipv6::instance().receive(nBytes, packet, pCard, sizeof(ethernetHeader), pBuffer);
 
       break;
 
@@ -129,11 +123,23 @@ void Ethernet::send(size_t nBytes, uintptr_t packet, Network* pCard, MacAddress
   if(!pCard || !pCard->isConnected())
     return; // NIC isn't active
 
-  // Move the payload for the ethernet header to go in
-  memmove(reinterpret_cast<void*>(packet + sizeof(ethernetHeader)), reinterpret_cast<void*>(packet), nBytes);
+  NetworkBuffer *pBuffer = NetworkStack::instance().allocateBuffer(nBytes);
+  memcpy(pBuffer->put(nBytes), reinterpret_cast<void*>(packet), nBytes);
+
+  send(pBuffer, pCard, dest, type);
+
+  pBuffer->release();
+}
+
+bool Ethernet::send(NetworkBuffer *pBuffer, Network* pCard, MacAddress dest, uint16_t type)
+{
+  if(!pCard || !pCard->isConnected())
+    return false; // NIC isn't active
 
-  // get the ethernet header pointer
-  ethernetHeader* ethHeader = reinterpret_cast<ethernetHeader*>(packet);
+  // Prepend the ethernet header
+  ethernetHeader* ethHeader = reinterpret_cast<ethernetHeader*>(pBuffer->push(sizeof(ethernetHeader)));
+  if(!ethHeader)
+    return false;
 
   // copy in the data
   StationInfo me = pCard->getStationInfo();
@@ -141,9 +147,37 @@ void Ethernet::send(size_t nBytes, uintptr_t packet, Network* pCard, MacAddress
   memcpy(ethHeader->sourceMac, me.mac, 6);
   ethHeader->type = HOST_TO_BIG16(type);
 
+  // A packet too big for the link is split up here, at the last moment,
+  // unless the card will do it.
+  if(pBuffer->getSegmentSize() && !pCard->canSegment())
+  {
+    NetworkBuffer *pSegments[TCP_GSO_MAX_SEGMENTS];
+    size_t nSegments = TcpOffload::segment(pBuffer, sizeof(ethernetHeader), pSegments, TCP_GSO_MAX_SEGMENTS);
+    if(!nSegments)
+      return false;
+
+    bool bResult = true;
+    for(size_t i = 0; i < nSegments; ++i)
+    {
+      if(PacketCapture::instance().isActive())
+        PacketCapture::instance().capture(pSegments[i]);
+
+      if(!pCard->sendBuffer(pSegments[i]))
+        bResult = false;
+      pSegments[i]->release();
+    }
+
+    return bResult;
+  }
+
+  if(PacketCapture::instance().isActive())
+    PacketCapture::instance().capture(pBuffer);
+
   // send it over the network
-  pCard->send(nBytes + sizeof(ethernetHeader), packet);
+  bool bResult = pCard->sendBuffer(pBuffer);
 
   // and dump it into any raw sockets (note the -1 for protocol - this means WIRE level endpoints)
   // RawManager::instance().receive(packAddr, newSize, 0, -1, pCard);
+
+  return bResult;
 }
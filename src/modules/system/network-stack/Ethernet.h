@@ -47,12 +47,18 @@ public:
     return ethernetInstance;
   }
 
-  /** Packet arrival callback */
-  void receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset);
+  /** Packet arrival callback. pBuffer, if given, holds the packet and may be
+    * cloned by the upper layers to keep the data without copying it. */
+  void receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset, NetworkBuffer *pBuffer = 0);
 
   /** Sends an ethernet packet */
   static void send(size_t nBytes, uintptr_t packet, Network* pCard, MacAddress dest, uint16_t type);
 
+  /** Sends an ethernet packet, prepending the header into pBuffer's headroom.
+    * The caller keeps its reference to pBuffer, which holds the frame as it
+    * was handed to the card afterwards. */
+  static bool send(NetworkBuffer *pBuffer, Network* pCard, MacAddress dest, uint16_t type);
+
   /** Injects an Ethernet header into a given buffer and returns the size
     * of the header. */ 
   size_t injectHeader(uintptr_t packet, MacAddress destMac, MacAddress sourceMac, uint16_t type);
@@ -19,85 +19,199 @@
  */
 
 #include "Filter.h"
+#include "Bpf.h"
+#include <process/Scheduler.h>
+#include <LockGuard.h>
 #include <Log.h>
 
 NetworkFilter NetworkFilter::m_Instance;
 
-NetworkFilter::NetworkFilter() : m_Callbacks()
+NetworkFilter::Chain::Chain(size_t n) :
+    pEntries(n ? new Entry[n] : 0), nEntries(0), nReaders(0)
 {
 }
 
+NetworkFilter::Chain::~Chain()
+{
+    for(size_t i = 0; i < nEntries; ++i)
+    {
+        if(pEntries[i].pProgram)
+            pEntries[i].pProgram->release();
+    }
+    delete [] pEntries;
+}
+
+NetworkFilter::NetworkFilter() : m_Lock(), m_WriteLock(false), m_NextId(0)
+{
+    for(size_t i = 0; i < NETWORK_FILTER_LEVELS; ++i)
+        m_pChains[i] = 0;
+}
+
 NetworkFilter::~NetworkFilter()
 {
+    for(size_t i = 0; i < NETWORK_FILTER_LEVELS; ++i)
+        delete m_pChains[i];
 }
 
 bool NetworkFilter::filter(size_t level, uintptr_t packet, size_t sz)
 {
     // Check for a valid level
-    if(level <= 4 && level > 0)
+    if(level > NETWORK_FILTER_LEVELS || level == 0)
+        return true;
+
+    // Nothing installed at this level, the usual case.
+    if(!m_pChains[level - 1])
+        return true;
+
+    m_Lock.acquire();
+    Chain *pChain = m_pChains[level - 1];
+    if(pChain)
+        pChain->nReaders += 1;
+    m_Lock.release();
+
+    if(!pChain)
+        return true;
+
+    // Call each filter until one says to drop. This way we avoid executing
+    // extra filters once the packet's been rejected.
+    bool result = true;
+    for(size_t i = 0; (i < pChain->nEntries) && result; ++i)
     {
-        // Grab the callback list
-        typedef List<void*>::Iterator callbackIterator;
-        List<void*> *list = m_Callbacks.lookup(level);
-        if(list)
-        {
-            // Iterate, call each callback until one returns false
-            for(callbackIterator it = list->begin(); it != list->end(); ++it)
-            {
-                bool (*callback)(uintptr_t, size_t) = reinterpret_cast<bool (*)(uintptr_t, size_t)>(*it);
-                bool result = callback(packet, sz);
-                if(!result)
-                    return result; // Short-circuit. This way we avoid executing
-                                   // extra filters if one says to drop.
-            }
-        }
+        Entry &entry = pChain->pEntries[i];
+        if(entry.pProgram)
+            result = entry.pProgram->run(reinterpret_cast<const uint8_t*>(packet), sz) != 0;
+        else
+            result = entry.callback(packet, sz);
     }
-    
-    // Default response: allow packet
-    return true;
+
+    pChain->nReaders -= 1;
+    return result;
 }
 
 size_t NetworkFilter::installCallback(size_t level, bool (*callback)(uintptr_t, size_t))
 {
-    /// \todo UnlikelyLock here
+    if(!callback)
+        return (size_t) -1;
+
+    Entry entry;
+    entry.callback = callback;
+    entry.pProgram = 0;
+    entry.pOwner = 0;
+    return install(level, entry);
+}
+
+size_t NetworkFilter::installProgram(size_t level, BpfProgram *pProgram, void *pOwner)
+{
+    if(!pProgram)
+        return (size_t) -1;
+
+    Entry entry;
+    entry.callback = 0;
+    entry.pProgram = pProgram;
+    entry.pOwner = pOwner;
+    return install(level, entry);
+}
 
+size_t NetworkFilter::install(size_t level, Entry &entry)
+{
     // Check for a valid level
-    if(level <= 4 && level > 0)
+    if(level > NETWORK_FILTER_LEVELS || level == 0)
+        return (size_t) -1;
+
+    LockGuard<Mutex> guard(m_WriteLock);
+
+    Chain *pChain = 0;
+    if(!copyChain(level, (size_t) -1, 0, 1, pChain))
     {
-        // Grab the callback list
-        List<void*> *list = m_Callbacks.lookup(level);
-        
-        // If it already exists, add the callback
-        if(list)
-        {
-            // We return the index into the list of this callback
-            size_t index = list->count();
-            list->pushBack(reinterpret_cast<void*>(callback));
-            return index;
-        }
-        // Otherwise, allocate
-        else
-        {
-            list = new List<void*>;
-            if(!list)
-            {
-                ERROR("Ran out of memory creating list for level " << Dec << level << Hex << " callbacks!");
-                return (size_t) -1;
-            }
-            
-            list->pushBack(reinterpret_cast<void*>(callback));
-            m_Callbacks.insert(level, list);
-            
-            // First item
-            return 0;
-        }
+        ERROR("Ran out of memory creating list for level " << Dec << level << Hex << " callbacks!");
+        return (size_t) -1;
     }
-    
-    // Invalid input
-    return (size_t) -1;
+
+    entry.id = m_NextId++;
+    if(entry.pProgram)
+        entry.pProgram->addRef();
+    pChain->pEntries[pChain->nEntries++] = entry;
+
+    replaceChain(level, pChain);
+    return entry.id;
 }
 
 void NetworkFilter::removeCallback(size_t level, size_t id)
 {
-    /// \todo Implement me!
+    if(level > NETWORK_FILTER_LEVELS || level == 0 || id == (size_t) -1)
+        return;
+
+    LockGuard<Mutex> guard(m_WriteLock);
+    Chain *pChain = 0;
+    if(copyChain(level, id, 0, 0, pChain))
+        replaceChain(level, pChain);
+}
+
+void NetworkFilter::removeOwner(void *pOwner)
+{
+    if(!pOwner)
+        return;
+
+    LockGuard<Mutex> guard(m_WriteLock);
+    for(size_t level = 1; level <= NETWORK_FILTER_LEVELS; ++level)
+    {
+        Chain *pChain = 0;
+        if(m_pChains[level - 1] && copyChain(level, (size_t) -1, pOwner, 0, pChain))
+            replaceChain(level, pChain);
+    }
+}
+
+bool NetworkFilter::copyChain(size_t level, size_t id, void *pOwner, size_t nExtra, Chain *&pChain)
+{
+    Chain *pOld = m_pChains[level - 1];
+    size_t nOld = pOld ? pOld->nEntries : 0;
+    pChain = 0;
+    if(!nOld && !nExtra)
+        return true;
+
+    pChain = new Chain(nOld + nExtra);
+    if(!pChain || !pChain->pEntries)
+    {
+        delete pChain;
+        pChain = 0;
+        return false;
+    }
+
+    for(size_t i = 0; i < nOld; ++i)
+    {
+        Entry &entry = pOld->pEntries[i];
+        if((entry.id == id) || (pOwner && (entry.pOwner == pOwner)))
+            continue;
+
+        if(entry.pProgram)
+            entry.pProgram->addRef();
+        pChain->pEntries[pChain->nEntries++] = entry;
+    }
+
+    // An empty chain is left out altogether, so filter() can skip the level.
+    if(!pChain->nEntries && !nExtra)
+    {
+        delete pChain;
+        pChain = 0;
+    }
+
+    return true;
+}
+
+void NetworkFilter::replaceChain(size_t level, Chain *pChain)
+{
+    m_Lock.acquire();
+    Chain *pOld = m_pChains[level - 1];
+    m_pChains[level - 1] = pChain;
+    m_Lock.release();
+
+    if(!pOld)
+        return;
+
+    // Packets that took the old chain just before the swap finish with it
+    // first. No new ones can pick it up now.
+    while(pOld->nReaders)
+        Scheduler::instance().yield();
+
+    delete pOld;
 }
@@ -18,12 +18,28 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifndef MACHINE_FILTER_H
+#define MACHINE_FILTER_H
+
 #include <processor/types.h>
-#include <utilities/List.h>
-#include <utilities/Tree.h>
+#include <process/Mutex.h>
+#include <Spinlock.h>
+#include <Atomic.h>
+
+class BpfProgram;
+
+/// Number of levels packets can be filtered at.
+#define NETWORK_FILTER_LEVELS   4
 
 /** Provides an interface for filtering network packets as they come in to
-  * the system. */
+  * the system.
+  *
+  * Each level has a chain of filters - kernel callbacks or BPF programs -
+  * that's replaced rather than modified when a filter is added or removed,
+  * so packets never wait on a change. A level with no filters costs a single
+  * read. Level 1 filters run as the driver hands a packet over, before
+  * anything is allocated for it, so they may be called from interrupt
+  * handlers. */
 class NetworkFilter
 {
     public:
@@ -61,15 +77,68 @@ class NetworkFilter
           *         uninstall the callback, or ((size_t) -1) if unable to install.
           */
         size_t installCallback(size_t level, bool (*callback)(uintptr_t, size_t));
+
+        /** Installs a BPF program for a specific level, taking a reference
+          * to it. The packet is dropped if the program returns zero.
+          * \param pOwner Identifies the filter for removeOwner, if not null.
+          * \return As for installCallback. */
+        size_t installProgram(size_t level, BpfProgram *pProgram, void *pOwner = 0);
         
-        /** Removes a callback for a specific level. */
+        /** Removes a callback (or program) for a specific level. */
         void removeCallback(size_t level, size_t id);
+
+        /** Removes every filter installed with the given owner. */
+        void removeOwner(void *pOwner);
         
     private:
     
         static NetworkFilter m_Instance;
-        
-        /// Level -> Callback list mapping
-        Tree<size_t, List<void*>* > m_Callbacks;
+
+        struct Entry
+        {
+            size_t id;
+            bool (*callback)(uintptr_t, size_t);
+            BpfProgram *pProgram;
+            void *pOwner;
+        };
+
+        /** An immutable list of filters. Each holds a reference to its
+          * programs. */
+        struct Chain
+        {
+            Chain(size_t n);
+            ~Chain();
+
+            Entry *pEntries;
+            size_t nEntries;
+
+            /** Packets currently being run through the chain. */
+            Atomic<size_t> nReaders;
+        };
+
+        /** Copies a level's chain into pChain, leaving out entries with the
+          * given id or owner and making room for nExtra more at the end.
+          * pChain is null if the copy would be empty. Returns false if
+          * there's no memory for the copy. */
+        bool copyChain(size_t level, size_t id, void *pOwner, size_t nExtra, Chain *&pChain);
+
+        /** Puts pChain in place for a level and frees the old chain once
+          * nothing's using it. m_WriteLock must be held. */
+        void replaceChain(size_t level, Chain *pChain);
+
+        /** Adds an entry to the end of a level's chain. */
+        size_t install(size_t level, Entry &entry);
+
+        /// Current chain for each level, null if there are no filters.
+        Chain * volatile m_pChains[NETWORK_FILTER_LEVELS];
+
+        /// Held while taking or swapping a reference to a chain.
+        Spinlock m_Lock;
+
+        /// Serialises changes to the chains.
+        Mutex m_WriteLock;
+
+        size_t m_NextId;
 };
 
+#endif
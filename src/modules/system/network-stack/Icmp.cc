@@ -26,6 +26,7 @@
 #include "Ipv4.h"
 
 #include "Filter.h"
+#include "NetworkStatistics.h"
 
 // #define DEBUG_ICMP
 
@@ -59,6 +60,10 @@ void Icmp::send(IpAddress dest, uint8_t type, uint8_t code, uint16_t id, uint16_
   header->checksum = 0;
   header->checksum = Network::calculateChecksum(packet, nBytes + sizeof(icmpHeader));
 
+  NETSTAT_INC(IcmpOutMsgs);
+  if(type == ICMP_ECHO_REPLY)
+    NETSTAT_INC(IcmpOutEchoReps);
+
   /// \note Assume IPv4, as ICMPv6 exists for IPv6.
   Ipv4::instance().send(dest, Network::convertToIpv4(0, 0, 0, 0), IP_ICMP, nBytes + sizeof(icmpHeader), packet, pCard);
   
@@ -70,6 +75,8 @@ void Icmp::receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes
   if(!packet || !nBytes)
       return;
 
+  NETSTAT_INC(IcmpInMsgs);
+
   // Check for filtering
   if(!NetworkFilter::instance().filter(3, packet, nBytes))
   {
@@ -102,6 +109,7 @@ void Icmp::receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes
     {
       case ICMP_ECHO_REQUEST:
         {
+        NETSTAT_INC(IcmpInEchos);
 
 #ifdef DEBUG_ICMP
         NOTICE("ICMP: Echo request from " << from.toString() << ".");
@@ -122,6 +130,14 @@ void Icmp::receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes
         }
         break;
 
+      case ICMP_ECHO_REPLY:
+        NETSTAT_INC(IcmpInEchoReps);
+        break;
+
+      case ICMP_DEST_UNREACH:
+        NETSTAT_INC(IcmpInDestUnreachs);
+        break;
+
       default:
 
         // Now that things can be moved out to user applications thanks to SOCK_RAW,
@@ -134,6 +150,7 @@ void Icmp::receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes
   else
   {
     WARNING("ICMP: invalid checksum on incoming packet.");
+    NETSTAT_INC(IcmpInErrors);
     pCard->badPacket();
   }
 }
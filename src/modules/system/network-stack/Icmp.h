@@ -31,6 +31,7 @@ class IpBase;
 
 /// \todo Implement more!
 #define ICMP_ECHO_REPLY   0x00
+#define ICMP_DEST_UNREACH 0x03
 #define ICMP_ECHO_REQUEST 0x08
 
 /**
@@ -24,6 +24,7 @@
 #include "Ndp.h"
 
 #include "RoutingTable.h"
+#include "NetworkStatistics.h"
 
 #include <network/IpAddress.h>
 
@@ -49,10 +50,13 @@ void Icmpv6::receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nByt
 {
     icmpv6Header *pHeader = reinterpret_cast<icmpv6Header*>(packet);
 
+    NETSTAT_INC(Icmp6InMsgs);
+
     uint16_t checksum = Ipv6::instance().ipChecksum(from, to, IP_ICMPV6, packet, nBytes);
     if(checksum)
     {
         WARNING("ICMPv6: checksum incorrect on incoming packet from " << from.toString());
+        NETSTAT_INC(Icmp6InErrors);
         pCard->badPacket();
         return;
     }
@@ -62,6 +66,7 @@ void Icmpv6::receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nByt
         case ICMPV6_ECHOREQ:
             // Echo request. Turn it around and send it right back!
             /// \todo Verify 'to' is unicast.
+            NETSTAT_INC(Icmp6InEchos);
             send(from, to, ICMPV6_ECHORESP, pHeader->code, packet + sizeof(icmpv6Header), nBytes - sizeof(icmpv6Header), pCard);
             break;
 
@@ -115,6 +120,7 @@ void Icmpv6::send(IpAddress dest, IpAddress from, uint8_t type, uint8_t code, ui
     header->checksum = 0;
     header->checksum = Ipv6::instance().ipChecksum(from, dest, IP_ICMPV6, packet, sizeof(icmpv6Header) + nBytes);
 
+    NETSTAT_INC(Icmp6OutMsgs);
     Ipv6::instance().send(dest, from, IP_ICMPV6, nBytes + sizeof(icmpv6Header), packet, pCard);
 
     NetworkStack::instance().getMemPool().free(packet);
@@ -25,6 +25,8 @@
 
 class IpAddress;
 class Network;
+class NetworkBuffer;
+class Checksum;
 
 // This file contains definitions common to IPv4 and IPv6
 
@@ -49,7 +51,16 @@ class IpBase
 
         virtual bool send(IpAddress dest, IpAddress from, uint8_t type, size_t nBytes, uintptr_t packet, Network *pCard = 0) = 0;
 
+        /** Sends pBuffer's contents as the payload of an IP packet, with the
+          * headers prepended in place. The caller keeps its reference. */
+        virtual bool send(IpAddress dest, IpAddress from, uint8_t type, NetworkBuffer *pBuffer, Network *pCard = 0) = 0;
+
         virtual uint16_t ipChecksum(IpAddress &from, IpAddress &to, uint8_t proto, uintptr_t data, uint16_t length) = 0;
+
+        /** Adds the pseudo-header for an upper-layer checksum to sum, so the
+          * rest of the packet can be added from wherever it lies.
+          * \param length Length of the upper-layer packet, in HOST byte order. */
+        virtual void addPseudoHeader(Checksum &sum, IpAddress &from, IpAddress &to, uint8_t proto, uint16_t length) = 0;
 };
 
 #endif
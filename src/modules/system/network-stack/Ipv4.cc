@@ -38,11 +38,12 @@
 #include "RoutingTable.h"
 
 #include "Filter.h"
+#include "NetworkStatistics.h"
 
 Ipv4 Ipv4::ipInstance;
 
 Ipv4::Ipv4() :
-  m_NextIdLock(), m_IpId(0), m_Fragments()
+  m_NextIdLock(), m_IpId(0), m_Fragments(), m_FragmentLock(false)
 {
 }
 
@@ -97,38 +98,44 @@ void Ipv4::injectChecksumAndDataFields(uintptr_t ipv4HeaderStart, size_t payload
     pHeader->checksum = Network::calculateChecksum(ipv4HeaderStart, pHeader->header_len * 4);
 }
 
+void Ipv4::addPseudoHeader(Checksum &sum, IpAddress &from, IpAddress &to, uint8_t proto, uint16_t length)
+{
+  PsuedoHeader header;
+  header.src_addr = from.getIp();
+  header.dest_addr = to.getIp();
+  header.zero = 0;
+  header.proto = proto;
+  header.datalen = HOST_TO_BIG16(length);
+
+  sum.add(&header, sizeof(header));
+}
+
 uint16_t Ipv4::ipChecksum(IpAddress &from, IpAddress &to, uint8_t proto, uintptr_t data, uint16_t length)
 {
-  // Allocate space for the psuedo-header + packet data
-  size_t tmpSize = length + sizeof(PsuedoHeader);
-  uint8_t* tmpPack = new uint8_t[tmpSize];
-  uintptr_t tmpPackAddr = reinterpret_cast<uintptr_t>(tmpPack);
-
-  // Set up the psuedo-header
-  PsuedoHeader *pHeader = reinterpret_cast<PsuedoHeader*>(tmpPackAddr);
-  pHeader->src_addr = from.getIp();
-  pHeader->dest_addr = to.getIp();
-  pHeader->proto = proto;
-  pHeader->datalen = HOST_TO_BIG16(length);
-  pHeader->zero = 0;
-
-  // Throw in the packet data
-  memcpy(reinterpret_cast<void*>(tmpPackAddr + sizeof(PsuedoHeader)),
-         reinterpret_cast<void*>(data),
-         length);
-
-  // Perform the checksum
-  uint16_t checksum = Network::calculateChecksum(tmpPackAddr, tmpSize);
-
-  // Done.
-  delete [] tmpPack;
-  return checksum;
+  Checksum sum;
+  addPseudoHeader(sum, from, to, proto, length);
+  sum.add(reinterpret_cast<const void*>(data), length);
+  return sum.finish();
 }
 
 bool Ipv4::send(IpAddress dest, IpAddress from, uint8_t type, size_t nBytes, uintptr_t packet, Network *pCard)
+{
+  NetworkBuffer *pBuffer = NetworkStack::instance().allocateBuffer(nBytes);
+  if(nBytes)
+    memcpy(pBuffer->put(nBytes), reinterpret_cast<void*>(packet), nBytes);
+
+  bool bResult = send(dest, from, type, pBuffer, pCard);
+
+  pBuffer->release();
+  return bResult;
+}
+
+bool Ipv4::send(IpAddress dest, IpAddress from, uint8_t type, NetworkBuffer *pBuffer, Network *pCard)
 {
   IpAddress realDest = dest;
 
+  NETSTAT_INC(Ipv4OutRequests);
+
   // Grab the address to send to (as well as the NIC to send with)
   Network *pSubCard = RoutingTable::instance().DetermineRoute(&realDest);
   if(!pCard)
@@ -136,6 +143,7 @@ bool Ipv4::send(IpAddress dest, IpAddress from, uint8_t type, size_t nBytes, uin
     pCard = pSubCard;
     if(!pSubCard)
     {
+      NETSTAT_INC(Ipv4OutNoRoutes);
       WARNING("IPv4: Couldn't find a route for destination '" << dest.toString() << "'.");
       return false;
     }
@@ -149,11 +157,12 @@ bool Ipv4::send(IpAddress dest, IpAddress from, uint8_t type, size_t nBytes, uin
   if(from == Network::convertToIpv4(0, 0, 0, 0))
     from = me.ipv4;
 
-  // Move the payload past the IP header we will now inject
-  memmove(reinterpret_cast<void*>(packet + sizeof(ipHeader)), reinterpret_cast<void*>(packet), nBytes);
+  size_t nBytes = pBuffer->getTotalLength();
 
-  // Grab a pointer for the ip header
-  ipHeader* header = reinterpret_cast<ipHeader*>(packet);
+  // Prepend the IP header to the payload
+  ipHeader* header = reinterpret_cast<ipHeader*>(pBuffer->push(sizeof(ipHeader)));
+  if(!header)
+    return false;
   memset(header, 0, sizeof(ipHeader));
 
   // Compose the IPv4 packet header
@@ -172,35 +181,45 @@ bool Ipv4::send(IpAddress dest, IpAddress from, uint8_t type, size_t nBytes, uin
   header->header_len = 5;
 
   header->checksum = 0;
-  header->checksum = Network::calculateChecksum(packet, sizeof(ipHeader));
 
-  // Get the address to send to
-  /// \todo Perhaps flag this so if we don't want to automatically resolve the MAC
-  ///       it doesn't happen?
+  // Loopback packets go straight back up to IP - there's no link to frame
+  // them for, and no need to checksum a packet that never leaves memory.
+  if(NetworkStack::instance().isLoopback(pCard))
+  {
+    NetworkStack::instance().loopback(pBuffer->clone());
+    return true;
+  }
+
+  header->checksum = Network::calculateChecksum(reinterpret_cast<uintptr_t>(header), sizeof(ipHeader));
+
+  // Get the address to send to. If it has to be resolved first, the packet
+  // waits in the neighbour cache and goes out once it is.
   MacAddress destMac;
   bool macValid = true;
   if(dest == me.broadcast)
     destMac.setMac(0xff);
   else
-    macValid = Arp::instance().getFromCache(realDest, true, &destMac, pCard);
+    macValid = Arp::instance().getFromCache(realDest, true, &destMac, pCard, pBuffer);
 
   if(macValid)
-    Ethernet::send(nBytes + sizeof(ipHeader), packet, pCard, destMac, dest.getType());
+    Ethernet::send(pBuffer, pCard, destMac, dest.getType());
 
-  return macValid;
+  return true;
 }
 
-void Ipv4::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset)
+void Ipv4::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset, NetworkBuffer *pBuffer)
 {
   // Verify the inputs. Drivers may directly dump this information on us so
   // we cannot ever be too sure.
   if(!packet || !nBytes || !pCard)
       return;
 
+  NETSTAT_INC(Ipv4InReceives);
+
   // Check for filtering
-  /// \todo Add statistics to NICs
   if(!NetworkFilter::instance().filter(2, packet + offset, nBytes - offset))
   {
+    NETSTAT_INC(Ipv4InDiscards);
     pCard->droppedPacket();
     return;
   }
@@ -213,12 +232,10 @@ void Ipv4::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t off
   size_t packetSize = nBytes - offset;
   bool wasFragment = false;
 
-  // Verify the checksum
-  uint16_t checksum = header->checksum;
-  header->checksum = 0;
-  uint16_t calcChecksum = Network::calculateChecksum(reinterpret_cast<uintptr_t>(header), sizeof(ipHeader));
-  header->checksum = checksum;
-  if(checksum == calcChecksum)
+  // Verify the checksum - summed with its checksum field, a good header
+  // comes out as zero. Loopback packets don't have one.
+  if(NetworkStack::instance().isLoopback(pCard) ||
+     (Network::calculateChecksum(reinterpret_cast<uintptr_t>(header), header->header_len * 4) == 0))
   {
     IpAddress from(header->ipSrc);
     IpAddress to(header->ipDest);
@@ -226,13 +243,13 @@ void Ipv4::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t off
     remoteHost.ip = from;
 
     StationInfo me = pCard->getStationInfo();
-    if((!me.ipv4.getIp()) && (!Arp::instance().isInCache(from))) // Not configured yet?
+    if((!me.ipv4.getIp()) && (!Arp::instance().isInCache(from, pCard))) // Not configured yet?
     {
         // Poison the ARP cache with this packet, as we won't be able to do
         // ARP for link-layer address determination yet.
         MacAddress e;
         Ethernet::instance().getMacFromPacket(packet, &e);
-        Arp::instance().insertToCache(from, e);
+        Arp::instance().insertToCache(from, e, pCard);
     }
 
 #ifdef IPV4_FORWARDING
@@ -242,6 +259,7 @@ void Ipv4::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t off
         // Not for us!
         MacAddress e;
         DEBUG_LOG("IPv4: forwarding packet from " << from.toString() << " to " << to.toString());
+        NETSTAT_INC(Ipv4ForwDatagrams);
 
         IpAddress realDest;
         pCard = RoutingTable::instance().DetermineRoute(&realDest);
@@ -276,6 +294,8 @@ void Ipv4::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t off
         WARNING("message shows up repeatedly you may have a network link");
         WARNING("with an inappropriate MTU.");
 
+        NETSTAT_INC(Ipv4ReasmReqds);
+
         // Find the size of the data section of this packet
         size_t dataLength = BIG_TO_HOST16(header->len);
         dataLength -= header->header_len * 4;
@@ -286,6 +306,7 @@ void Ipv4::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t off
 
         // Grab the fragment block for this combination of IP and ID
         Ipv4Identifier id(BIG_TO_HOST16(header->id), from);
+        LockGuard<Mutex> guard(m_FragmentLock);
         fragmentWrapper *p = m_Fragments.lookup(id);
 
         // Do we need to create a new wrapper?
@@ -353,10 +374,15 @@ void Ipv4::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t off
             delete p;
             m_Fragments.remove(id);
 
+            NETSTAT_INC(Ipv4ReasmOKs);
+
             // Fall through to the handling of a conventional packet
             packetAddress = reinterpret_cast<uintptr_t>(buff);
             packetSize = fullLength;
             wasFragment = true;
+
+            // The reassembled packet isn't in the NIC's buffer any more.
+            pBuffer = 0;
         }
         else
         {
@@ -381,6 +407,7 @@ void Ipv4::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t off
         RawManager::instance().receive(packetAddress, nBytes - offset, &remoteHost, IPPROTO_ICMP, pCard);
 
         // icmp needs the ip header as well
+        NETSTAT_INC(Ipv4InDelivers);
         Icmp::instance().receive(from, to, dataAddress, payloadSize, this, pCard);
         break;
 
@@ -390,7 +417,8 @@ void Ipv4::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t off
         RawManager::instance().receive(packetAddress, nBytes - offset, &remoteHost, IPPROTO_UDP, pCard);
 
         // udp needs the ip header as well
-        Udp::instance().receive(from, to, dataAddress, payloadSize, this, pCard);
+        NETSTAT_INC(Ipv4InDelivers);
+        Udp::instance().receive(from, to, dataAddress, payloadSize, this, pCard, pBuffer);
         break;
 
       case IP_TCP:
@@ -399,11 +427,13 @@ void Ipv4::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t off
         RawManager::instance().receive(packetAddress, nBytes - offset, &remoteHost, IPPROTO_TCP, pCard);
 
         // tcp needs the ip header as well
-        Tcp::instance().receive(from, to, dataAddress, payloadSize, this, pCard);
+        NETSTAT_INC(Ipv4InDelivers);
+        Tcp::instance().receive(from, to, dataAddress, payloadSize, this, pCard, pBuffer);
         break;
 
       default:
         NOTICE("IP: Unknown packet type");
+        NETSTAT_INC(Ipv4InUnknownProtos);
         pCard->badPacket();
         break;
     }
@@ -417,6 +447,7 @@ void Ipv4::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t off
   else
   {
     NOTICE("IP: Checksum invalid!");
+    NETSTAT_INC(Ipv4InHdrErrors);
     pCard->badPacket();
   }
 }
@@ -23,9 +23,11 @@
 
 #include <utilities/String.h>
 #include <utilities/Vector.h>
+#include <utilities/Tree.h>
 #include <processor/types.h>
 #include <process/Semaphore.h>
 #include <machine/Network.h>
+#include <process/Mutex.h>
 #include <LockGuard.h>
 #include <Spinlock.h>
 
@@ -64,10 +66,11 @@ public:
   }
 
   /** Packet arrival callback */
-  void receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset);
+  void receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset, NetworkBuffer *pBuffer = 0);
 
   /** Sends an IP packet */
   virtual bool send(IpAddress dest, IpAddress from, uint8_t type, size_t nBytes, uintptr_t packet, Network *pCard = 0);
+  virtual bool send(IpAddress dest, IpAddress from, uint8_t type, NetworkBuffer *pBuffer, Network *pCard = 0);
 
   /** Injects an IPv4 header into a given buffer and returns the size
     * of the header. */
@@ -83,6 +86,8 @@ public:
    */
   virtual uint16_t ipChecksum(IpAddress &from, IpAddress &to, uint8_t proto, uintptr_t data, uint16_t length);
 
+  virtual void addPseudoHeader(Checksum &sum, IpAddress &from, IpAddress &to, uint8_t proto, uint16_t length);
+
   struct ipHeader
   {
 #ifdef LITTLE_ENDIAN
@@ -199,6 +204,9 @@ private:
   /// Maps IP packet IDs to fragment blocks
   Tree<Ipv4Identifier, fragmentWrapper *> m_Fragments;
 
+  /// Lock for m_Fragments - packets are received on several threads
+  Mutex m_FragmentLock;
+
 };
 
 #endif
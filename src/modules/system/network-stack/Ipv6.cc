@@ -38,6 +38,7 @@
 #include "RoutingTable.h"
 
 #include "Filter.h"
+#include "NetworkStatistics.h"
 
 Ipv6 Ipv6::ipInstance;
 
@@ -136,38 +137,44 @@ Ipv6::~Ipv6()
 {
 }
 
+void Ipv6::addPseudoHeader(Checksum &sum, IpAddress &from, IpAddress &to, uint8_t proto, uint16_t length)
+{
+  PsuedoHeader header;
+  from.getIp(header.src_addr);
+  to.getIp(header.dest_addr);
+  header.length = HOST_TO_BIG32(length);
+  header.zero1 = header.zero2 = 0;
+  header.nextHeader = proto;
+
+  sum.add(&header, sizeof(header));
+}
+
 uint16_t Ipv6::ipChecksum(IpAddress &from, IpAddress &to, uint8_t proto, uintptr_t data, uint16_t length)
 {
-  // Allocate space for the psuedo-header + packet data
-  size_t tmpSize = length + sizeof(PsuedoHeader);
-  uint8_t* tmpPack = new uint8_t[tmpSize];
-  uintptr_t tmpPackAddr = reinterpret_cast<uintptr_t>(tmpPack);
-
-  // Set up the psuedo-header
-  PsuedoHeader *pHeader = reinterpret_cast<PsuedoHeader*>(tmpPackAddr);
-  from.getIp(pHeader->src_addr);
-  to.getIp(pHeader->dest_addr);
-  pHeader->nextHeader = proto;
-  pHeader->length = HOST_TO_BIG16(length);
-  pHeader->zero1 = pHeader->zero2 = 0;
-
-  // Throw in the packet data
-  memcpy(reinterpret_cast<void*>(tmpPackAddr + sizeof(PsuedoHeader)),
-         reinterpret_cast<void*>(data),
-         length);
-
-  // Perform the checksum
-  uint16_t checksum = Network::calculateChecksum(tmpPackAddr, tmpSize);
-
-  // Done.
-  delete [] tmpPack;
-  return checksum;
+  Checksum sum;
+  addPseudoHeader(sum, from, to, proto, length);
+  sum.add(reinterpret_cast<const void*>(data), length);
+  return sum.finish();
 }
 
 bool Ipv6::send(IpAddress dest, IpAddress from, uint8_t type, size_t nBytes, uintptr_t packet, Network *pCard)
+{
+    NetworkBuffer *pBuffer = NetworkStack::instance().allocateBuffer(nBytes);
+    if(nBytes)
+        memcpy(pBuffer->put(nBytes), reinterpret_cast<void*>(packet), nBytes);
+
+    bool bResult = send(dest, from, type, pBuffer, pCard);
+
+    pBuffer->release();
+    return bResult;
+}
+
+bool Ipv6::send(IpAddress dest, IpAddress from, uint8_t type, NetworkBuffer *pBuffer, Network *pCard)
 {
     IpAddress realDest = dest;
 
+    NETSTAT_INC(Ipv6OutRequests);
+
     if((from.getType() == IpAddress::IPv4) || (dest.getType() == IpAddress::IPv4))
     {
         WARNING("IPv6: IPv4 addresses given to send");
@@ -181,6 +188,7 @@ bool Ipv6::send(IpAddress dest, IpAddress from, uint8_t type, size_t nBytes, uin
       pCard = RoutingTable::instance().DetermineRoute(&realDest);
       if(!pCard)
       {
+        NETSTAT_INC(Ipv6OutNoRoutes);
         WARNING("IPv6: Couldn't find a route for destination '" << dest.toString() << "'.");
         return false;
       }
@@ -194,11 +202,12 @@ bool Ipv6::send(IpAddress dest, IpAddress from, uint8_t type, size_t nBytes, uin
 
     /// \todo Assumption: given "from" address is accurate.
 
-    // Load the payload.
-    memmove(reinterpret_cast<void*>(packet + sizeof(ip6Header)), reinterpret_cast<void*>(packet), nBytes);
+    size_t nBytes = pBuffer->getTotalLength();
 
-    // Fill in the IPv6 header.
-    ip6Header *pHeader = reinterpret_cast<ip6Header*>(packet);
+    // Prepend the IPv6 header.
+    ip6Header *pHeader = reinterpret_cast<ip6Header*>(pBuffer->push(sizeof(ip6Header)));
+    if(!pHeader)
+        return false;
     memset(pHeader, 0, sizeof(ip6Header));
 
     pHeader->verClassFlow = 6 << 4;
@@ -208,6 +217,14 @@ bool Ipv6::send(IpAddress dest, IpAddress from, uint8_t type, size_t nBytes, uin
     from.getIp(pHeader->sourceAddress);
     dest.getIp(pHeader->destAddress);
 
+    // Loopback packets go straight back up to IP, with no link to frame them
+    // for or neighbour to discover.
+    if(NetworkStack::instance().isLoopback(pCard))
+    {
+        NetworkStack::instance().loopback(pBuffer->clone());
+        return true;
+    }
+
     // Get the address to send this packet to.
     MacAddress destMac;
     bool macValid = true;
@@ -225,15 +242,17 @@ bool Ipv6::send(IpAddress dest, IpAddress from, uint8_t type, size_t nBytes, uin
         macValid = true;
     }
     else
-        macValid = Ndp::instance().neighbourSolicit(realDest, &destMac, pCard);
+        macValid = Ndp::instance().neighbourSolicit(realDest, &destMac, pCard, pBuffer);
 
+    // If the neighbour has to be resolved first, the packet waits in the
+    // neighbour cache and goes out once it is.
     if(macValid)
-        Ethernet::send(nBytes + sizeof(ip6Header), packet, pCard, destMac, dest.getType());
+        Ethernet::send(pBuffer, pCard, destMac, dest.getType());
 
-    return macValid;
+    return true;
 }
 
-void Ipv6::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset)
+void Ipv6::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset, NetworkBuffer *pBuffer)
 {
     // Verify the inputs. Drivers may directly dump this information on us so
     // we cannot ever be too sure.
@@ -242,10 +261,15 @@ void Ipv6::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t off
 
     uintptr_t packetAddress = packet + offset;
 
+    NETSTAT_INC(Ipv6InReceives);
+
     // Check for filtering
-    /// \todo Add statistics to NICs
     if(!NetworkFilter::instance().filter(2, packetAddress, nBytes - offset))
+    {
+        NETSTAT_INC(Ipv6InDiscards);
+        pCard->droppedPacket();
         return;
+    }
 
     // Grab the header
     ip6Header* header = reinterpret_cast<ip6Header*>(packetAddress);
@@ -273,6 +297,7 @@ void Ipv6::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t off
         // Not for us, ignore it.
         if(!bMatch)
         {
+            NETSTAT_INC(Ipv6InAddrErrors);
             return;
         }
     }
@@ -291,17 +316,23 @@ void Ipv6::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t off
         {
             case IP_TCP:
                 // NOTICE("IPv6: TCP");
-                Tcp::instance().receive(src, dest, packetAddress + sizeof(ip6Header), payloadSize, this, pCard);
+                NETSTAT_INC(Ipv6InDelivers);
+                Tcp::instance().receive(src, dest, packetAddress + sizeof(ip6Header), payloadSize, this, pCard, pBuffer);
                 break;
             case IP_UDP:
                 // NOTICE("IPv6: UDP");
                 /// \todo Assumes no extension headers.
-                Udp::instance().receive(src, dest, packetAddress + sizeof(ip6Header), payloadSize, this, pCard);
+                NETSTAT_INC(Ipv6InDelivers);
+                Udp::instance().receive(src, dest, packetAddress + sizeof(ip6Header), payloadSize, this, pCard, pBuffer);
                 break;
             case IP_ICMPV6:
                 // NOTICE("IPv6: ICMPv6");
+                NETSTAT_INC(Ipv6InDelivers);
                 Icmpv6::instance().receive(src, dest, packetAddress + sizeof(ip6Header), payloadSize, this, pCard);
                 break;
+            default:
+                NETSTAT_INC(Ipv6InUnknownProtos);
+                break;
         }
     }
 
@@ -67,13 +67,16 @@ public:
     }
 
     /** Packet arrival callback */
-    void receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset);
+    void receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset, NetworkBuffer *pBuffer = 0);
 
     /** Sends an IP packet */
     virtual bool send(IpAddress dest, IpAddress from, uint8_t type, size_t nBytes, uintptr_t packet, Network *pCard = 0);
+    virtual bool send(IpAddress dest, IpAddress from, uint8_t type, NetworkBuffer *pBuffer, Network *pCard = 0);
 
     virtual uint16_t ipChecksum(IpAddress &from, IpAddress &to, uint8_t proto, uintptr_t data, uint16_t length);
 
+    virtual void addPseudoHeader(Checksum &sum, IpAddress &from, IpAddress &to, uint8_t proto, uint16_t length);
+
     /// Calculates an IPv6-modified EUI-64 for the given MAC address.
     static void getIpv6Eui64(MacAddress mac, uint8_t *eui);
 
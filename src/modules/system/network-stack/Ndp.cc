@@ -33,7 +33,7 @@ Ndp Ndp::ndpInstance;
 #define NDP_SOLICIT     135
 #define NDP_ADVERT      136
 
-Ndp::Ndp() : m_LookupCache()
+Ndp::Ndp()
 {
 }
 
@@ -41,15 +41,6 @@ Ndp::~Ndp()
 {
 }
 
-void Ndp::addEntry(IpAddress addr, MacAddress mac)
-{
-    if(m_LookupCache.lookup(addr.toString()))
-        return;
-
-    MacAddress *pNew = new MacAddress(mac);
-    m_LookupCache.insert(addr.toString(), pNew);
-}
-
 void Ndp::receive(IpAddress from, IpAddress to, uint8_t icmpType, uint8_t icmpCode, uintptr_t payload, size_t nBytes, Network *pCard)
 {
     StationInfo me = pCard->getStationInfo();
@@ -202,7 +193,7 @@ void Ndp::receive(IpAddress from, IpAddress to, uint8_t icmpType, uint8_t icmpCo
                             if(p->type == 1)
                             {
                                 // Add to our cache.
-                                addEntry(from, mac);
+                                NeighbourDiscovery::instance().update(from, pCard, mac, false, true);
                             }
                         }
 
@@ -230,7 +221,37 @@ void Ndp::receive(IpAddress from, IpAddress to, uint8_t icmpType, uint8_t icmpCo
             break;
         case NDP_ADVERT:
             {
+                NeighbourAdvertisement *pMessage = reinterpret_cast<NeighbourAdvertisement*>(payload);
+                if(nBytes < sizeof(NeighbourAdvertisement))
+                    return;
+
                 NOTICE("NDP Advertisement from " << from.toString() << ".");
+
+                IpAddress target = pMessage->target;
+                uint8_t flags = reinterpret_cast<uint8_t*>(&pMessage->flags)[0] >> 5;
+
+                // Find the target's link-layer address. Without one there's
+                // nothing to learn.
+                Option *pOption = reinterpret_cast<Option*>(payload + sizeof(NeighbourAdvertisement));
+                while((reinterpret_cast<uintptr_t>(pOption) + sizeof(Option)) <= (payload + nBytes))
+                {
+                    if(!pOption->length)
+                        break;
+
+                    if(pOption->type == 2)
+                    {
+                        LinkLayerAddressOption *p = reinterpret_cast<LinkLayerAddressOption*>(pOption);
+                        MacAddress mac;
+                        mac.setMac(p->address);
+
+                        NeighbourDiscovery::instance().update(target, pCard, mac,
+                                                              (flags & NADVERT_FLAGS_SOLICIT) != 0,
+                                                              (flags & NADVERT_FLAGS_OVERRIDE) != 0);
+                        break;
+                    }
+
+                    pOption = reinterpret_cast<Option*>(reinterpret_cast<uintptr_t>(pOption) + (pOption->length * 8));
+                }
             }
             break;
     };
@@ -274,16 +295,13 @@ bool Ndp::routerSolicit(Network *pCard)
     return true;
 }
 
-bool Ndp::neighbourSolicit(IpAddress addr, MacAddress *pMac, Network *pCard)
+bool Ndp::neighbourSolicit(IpAddress addr, MacAddress *pMac, Network *pCard, NetworkBuffer *pBuffer)
 {
-    // Easy lookup?
-    MacAddress *p;
-    if((p = m_LookupCache.lookup(addr.toString())))
-    {
-        *pMac = *p;
-        return true;
-    }
+    return NeighbourDiscovery::instance().resolve(addr, pCard, pMac, this, pBuffer);
+}
 
+void Ndp::solicit(IpAddress addr, Network *pCard, MacAddress *pTarget)
+{
     StationInfo me = pCard->getStationInfo();
 
     /// \todo Find an address with the same PREFIX as the NEIGHBOUR we want to
@@ -300,7 +318,7 @@ bool Ndp::neighbourSolicit(IpAddress addr, MacAddress *pMac, Network *pCard)
         }
     }
     if(i == me.nIpv6Addresses)
-        return false;
+        return;
 
     // Okay, we'll have to send a Neighbour Solicit.
     uintptr_t packet = NetworkStack::instance().getMemPool().allocate();
@@ -314,17 +332,21 @@ bool Ndp::neighbourSolicit(IpAddress addr, MacAddress *pMac, Network *pCard)
     pAddrOption->length = sizeof(LinkLayerAddressOption) / 8;
     memcpy(pAddrOption->address, me.mac.getMac(), 6);
 
-    // Broadcast over the local network segment.
-    /// \todo Implement some way of creating "special" IPv6 addresses... neatly.
-    uint8_t dest[] = {0xFF, 0x02, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
-                       0x0,  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x1};
-    IpAddress to(dest);
+    // Probes of a neighbour we already know go straight to it; otherwise
+    // ask its solicited-node multicast group.
+    IpAddress to = addr;
+    if(!pTarget)
+    {
+        uint8_t target[16];
+        addr.getIp(target);
+
+        /// \todo Implement some way of creating "special" IPv6 addresses... neatly.
+        uint8_t dest[] = {0xFF, 0x02, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+                           0x0,  0x0, 0x0, 0x1, 0xFF, target[13], target[14], target[15]};
+        to = IpAddress(dest);
+    }
 
     // Send the solicit packet.
     Icmpv6::instance().send(to, from, NDP_SOLICIT, 0, packet, sizeof(NeighbourSolicitation) + sizeof(LinkLayerAddressOption), pCard);
     NetworkStack::instance().getMemPool().free(packet);
-
-    // Not yet implemented & working properly.
-    /// \todo Needs to wait until a response comes in or a timeout occurs.
-    return false;
 }
@@ -24,15 +24,18 @@
 #include <processor/types.h>
 #include <machine/Network.h>
 
-#include <utilities/RadixTree.h>
+#include <network/NetworkBuffer.h>
 
 #include "IpCommon.h"
+#include "NeighbourDiscovery.h"
 
 #define NADVERT_FLAGS_ROUTER        1
 #define NADVERT_FLAGS_SOLICIT       2
 #define NADVERT_FLAGS_OVERRIDE      4
 
-class Ndp
+/** IPv6 neighbour discovery (RFC 4861). Addresses are kept in the
+ *  NeighbourDiscovery cache, shared with ARP. */
+class Ndp : public NeighbourProtocol
 {
     public:
         Ndp();
@@ -46,7 +49,12 @@ class Ndp
         void receive(IpAddress from, IpAddress to, uint8_t icmpType, uint8_t icmpCode, uintptr_t payload, size_t nBytes, Network *pCard);
 
         /// Solicit a neighbour for an address. Uses cache where possible.
-        bool neighbourSolicit(IpAddress addr, MacAddress *pMac, Network *pCard);
+        /// Never blocks: if the address has to be resolved, this returns
+        /// false and a clone of pBuffer (if given) is sent as soon as it is.
+        bool neighbourSolicit(IpAddress addr, MacAddress *pMac, Network *pCard, NetworkBuffer *pBuffer = 0);
+
+        /// NeighbourProtocol interface: sends a Neighbour Solicitation.
+        virtual void solicit(IpAddress ip, Network *pCard, MacAddress *pTarget);
 
         /// Solicit a router for routing information. Should be called if
         /// DHCPv6 is not used, in order to obtain a routable address for full
@@ -54,14 +62,9 @@ class Ndp
         /// Will automatically modify the StationInfo of pCard.
         bool routerSolicit(Network *pCard);
 
-        /// Adds a given IP->LinkLayer association to the cache.
-        void addEntry(IpAddress addr, MacAddress mac);
-
     private:
         static Ndp ndpInstance;
 
-        RadixTree<MacAddress*> m_LookupCache;
-
         struct RouterSolicitation
         {
             uint32_t reserved;
@@ -19,6 +19,445 @@
  */
 
 #include "NeighbourDiscovery.h"
+#include "Ethernet.h"
+#include "NetworkStack.h"
+#include <process/Thread.h>
+#include <process/Scheduler.h>
+#include <Log.h>
+
+/// Most probes sent each time the cache is aged; the rest wait a tick.
+#define NEIGHBOUR_PROBE_BATCH   32
 
 NeighbourDiscovery NeighbourDiscovery::m_Instance;
 
+NeighbourDiscovery::NeighbourDiscovery() :
+    m_nEntries(0), m_Lock(), m_Wakeup(0), m_bStop(false), m_pThread(0)
+{
+    for (size_t i = 0; i < NEIGHBOUR_BUCKETS; ++i)
+        m_pBuckets[i] = 0;
+}
+
+NeighbourDiscovery::~NeighbourDiscovery()
+{
+    if (m_pThread)
+    {
+        m_bStop = true;
+        m_Wakeup.release();
+        m_pThread->join();
+    }
+
+    for (size_t i = 0; i < NEIGHBOUR_BUCKETS; ++i)
+    {
+        while (m_pBuckets[i])
+        {
+            Entry *pEntry = m_pBuckets[i];
+            unlink(pEntry);
+            sendPending(pEntry->pPending, pEntry->nPending, pEntry->ip, pEntry->pCard, 0);
+            delete pEntry;
+        }
+    }
+}
+
+void NeighbourDiscovery::initialise()
+{
+    if (m_pThread)
+        return;
+
+    m_pThread = new Thread(Scheduler::instance().getKernelProcess(),
+                           reinterpret_cast<Thread::ThreadStartFunc>(&trampoline),
+                           reinterpret_cast<void*>(this));
+}
+
+size_t NeighbourDiscovery::hash(IpAddress &ip)
+{
+    uint32_t h = 0;
+    if (ip.getType() == IpAddress::IPv6)
+    {
+        uint8_t addr[16];
+        ip.getIp(addr);
+        for (size_t i = 0; i < 16; i += 4)
+            h ^= (addr[i] << 24) | (addr[i + 1] << 16) | (addr[i + 2] << 8) | addr[i + 3];
+    }
+    else
+        h = ip.getIp();
+
+    // Fibonacci hashing: the top bits of the product are well mixed.
+    h *= 2654435761U;
+    return (h >> 16) & (NEIGHBOUR_BUCKETS - 1);
+}
+
+NeighbourDiscovery::Entry *NeighbourDiscovery::find(IpAddress &ip, Network *pCard)
+{
+    for (Entry *pEntry = m_pBuckets[hash(ip)]; pEntry; pEntry = pEntry->pNext)
+    {
+        if ((pEntry->pCard == pCard) && (pEntry->ip.getType() == ip.getType()) && (pEntry->ip == ip))
+            return pEntry;
+    }
+    return 0;
+}
+
+void NeighbourDiscovery::link(Entry *pEntry)
+{
+    size_t bucket = hash(pEntry->ip);
+    pEntry->pNext = m_pBuckets[bucket];
+    m_pBuckets[bucket] = pEntry;
+    ++m_nEntries;
+}
+
+void NeighbourDiscovery::unlink(Entry *pEntry)
+{
+    Entry **pp = &m_pBuckets[hash(pEntry->ip)];
+    while (*pp && (*pp != pEntry))
+        pp = &(*pp)->pNext;
+    if (*pp)
+    {
+        *pp = pEntry->pNext;
+        --m_nEntries;
+    }
+    pEntry->pNext = 0;
+}
+
+void NeighbourDiscovery::sendPending(NetworkBuffer **pPending, size_t nPending,
+                                     IpAddress &ip, Network *pCard, MacAddress *pMac)
+{
+    for (size_t i = 0; i < nPending; ++i)
+    {
+        if (pMac)
+            Ethernet::send(pPending[i], pCard, *pMac, ip.getType());
+        else
+            pCard->droppedPacket();
+        pPending[i]->release();
+    }
+}
+
+bool NeighbourDiscovery::resolve(IpAddress ip, Network *pCard, MacAddress *pMac,
+                                 NeighbourProtocol *pProtocol, NetworkBuffer *pBuffer)
+{
+    uint64_t now = NetworkStack::getTickCount();
+
+    // The common case: the neighbour is known.
+    m_Lock.acquire();
+    Entry *pEntry = find(ip, pCard);
+    if (pEntry && (pEntry->state != INCOMPLETE))
+    {
+        if (pMac)
+            *pMac = pEntry->mac;
+        pEntry->used = now;
+        if (!pEntry->pProtocol)
+            pEntry->pProtocol = pProtocol;
+
+        // Sending to a STALE neighbour starts the clock on reconfirming it.
+        if (pEntry->state == STALE)
+        {
+            pEntry->state = DELAY;
+            pEntry->updated = now;
+        }
+
+        m_Lock.release();
+        return true;
+    }
+    bool bKnown = (pEntry != 0);
+    m_Lock.release();
+
+    // This can be called from timer handlers, so anything that needs memory
+    // is done before taking the lock again. A neighbour already being
+    // resolved only needs somewhere to hold the packet.
+    Entry *pNew = bKnown ? 0 : new Entry;
+    NetworkBuffer *pClone = pBuffer ? pBuffer->clone() : 0;
+    NetworkBuffer *pDropped = 0;
+    bool bSolicit = false;
+    bool bResolved = false;
+
+    m_Lock.acquire();
+    pEntry = find(ip, pCard);
+    if (!pEntry && pNew && (m_nEntries < NEIGHBOUR_MAX_ENTRIES))
+    {
+        pEntry = pNew;
+        pNew = 0;
+
+        pEntry->ip = ip;
+        pEntry->pCard = pCard;
+        pEntry->state = INCOMPLETE;
+        pEntry->updated = pEntry->used = now;
+        pEntry->nProbes = 1;
+        pEntry->pProtocol = pProtocol;
+        pEntry->nPending = 0;
+        link(pEntry);
+
+        bSolicit = true;
+    }
+
+    if (!pEntry)
+    {
+        // The cache is full (or the neighbour was removed while the lock
+        // was dropped) - the packet has nowhere to wait.
+        pDropped = pClone;
+    }
+    else if (pEntry->state != INCOMPLETE)
+    {
+        // Resolved while the lock was dropped.
+        if (pMac)
+            *pMac = pEntry->mac;
+        pEntry->used = now;
+        pDropped = pClone;
+        bResolved = true;
+    }
+    else if (pClone)
+    {
+        if (pEntry->nPending == NEIGHBOUR_MAX_PENDING)
+        {
+            pDropped = pEntry->pPending[0];
+            for (size_t i = 1; i < NEIGHBOUR_MAX_PENDING; ++i)
+                pEntry->pPending[i - 1] = pEntry->pPending[i];
+            --pEntry->nPending;
+        }
+        pEntry->pPending[pEntry->nPending++] = pClone;
+    }
+    m_Lock.release();
+
+    delete pNew;
+    if (pDropped)
+    {
+        if (!bResolved)
+            pCard->droppedPacket();
+        pDropped->release();
+    }
+
+    if (bSolicit)
+        pProtocol->solicit(ip, pCard, 0);
+
+    return bResolved;
+}
+
+bool NeighbourDiscovery::lookup(IpAddress ip, Network *pCard, MacAddress *pMac)
+{
+    LockGuard<Spinlock> guard(m_Lock);
+
+    Entry *pEntry = find(ip, pCard);
+    if (!pEntry || (pEntry->state == INCOMPLETE))
+        return false;
+
+    if (pMac)
+        *pMac = pEntry->mac;
+    return true;
+}
+
+void NeighbourDiscovery::update(IpAddress ip, Network *pCard, MacAddress mac, bool bSolicited, bool bOverride)
+{
+    uint64_t now = NetworkStack::getTickCount();
+    NetworkBuffer *pPending[NEIGHBOUR_MAX_PENDING];
+    size_t nPending = 0;
+
+    // Most updates are for neighbours we already have.
+    m_Lock.acquire();
+    bool bKnown = (find(ip, pCard) != 0);
+    m_Lock.release();
+    Entry *pNew = bKnown ? 0 : new Entry;
+
+    m_Lock.acquire();
+    Entry *pEntry = find(ip, pCard);
+    if (!pEntry)
+    {
+        // Something we didn't ask about: worth keeping, but it isn't known
+        // to be reachable until we've talked to it.
+        if (pNew && (m_nEntries < NEIGHBOUR_MAX_ENTRIES))
+        {
+            pEntry = pNew;
+            pNew = 0;
+
+            pEntry->ip = ip;
+            pEntry->pCard = pCard;
+            pEntry->mac = mac;
+            pEntry->state = bSolicited ? REACHABLE : STALE;
+            pEntry->updated = pEntry->used = now;
+            pEntry->nProbes = 0;
+            pEntry->pProtocol = 0;
+            pEntry->nPending = 0;
+            link(pEntry);
+        }
+    }
+    else if (pEntry->state == INCOMPLETE)
+    {
+        pEntry->mac = mac;
+        pEntry->state = bSolicited ? REACHABLE : STALE;
+        pEntry->updated = now;
+        pEntry->nProbes = 0;
+
+        nPending = pEntry->nPending;
+        for (size_t i = 0; i < nPending; ++i)
+            pPending[i] = pEntry->pPending[i];
+        pEntry->nPending = 0;
+    }
+    else
+    {
+        bool bSame = !memcmp(pEntry->mac.getMac(), mac.getMac(), 6);
+        if (bSame || bOverride)
+        {
+            pEntry->mac = mac;
+            if (bSolicited)
+            {
+                pEntry->state = REACHABLE;
+                pEntry->updated = now;
+                pEntry->nProbes = 0;
+            }
+            else if (!bSame)
+            {
+                pEntry->state = STALE;
+                pEntry->updated = now;
+            }
+        }
+    }
+    m_Lock.release();
+
+    delete pNew;
+    sendPending(pPending, nPending, ip, pCard, &mac);
+}
+
+void NeighbourDiscovery::remove(IpAddress ip, Network *pCard)
+{
+    m_Lock.acquire();
+    Entry *pEntry = find(ip, pCard);
+    if (pEntry)
+        unlink(pEntry);
+    m_Lock.release();
+
+    if (pEntry)
+    {
+        sendPending(pEntry->pPending, pEntry->nPending, pEntry->ip, pEntry->pCard, 0);
+        delete pEntry;
+    }
+}
+
+int NeighbourDiscovery::trampoline(void *p)
+{
+    NeighbourDiscovery *pNd = reinterpret_cast<NeighbourDiscovery*>(p);
+    return pNd->work();
+}
+
+int NeighbourDiscovery::work()
+{
+    while (!m_bStop)
+    {
+        m_Wakeup.acquire(1, 0, NEIGHBOUR_TICK * 1000);
+        if (!m_bStop)
+            age();
+    }
+
+    return 0;
+}
+
+void NeighbourDiscovery::age()
+{
+    struct Probe
+    {
+        IpAddress ip;
+        Network *pCard;
+        MacAddress mac;
+        bool bUnicast;
+        NeighbourProtocol *pProtocol;
+    };
+
+    Probe probes[NEIGHBOUR_PROBE_BATCH];
+    size_t nProbes = 0;
+    Entry *pDead = 0;
+
+    uint64_t now = NetworkStack::getTickCount();
+
+    m_Lock.acquire();
+    for (size_t i = 0; i < NEIGHBOUR_BUCKETS; ++i)
+    {
+        Entry *pEntry = m_pBuckets[i];
+        while (pEntry)
+        {
+            Entry *pNext = pEntry->pNext;
+            uint64_t age = now - pEntry->updated;
+
+            bool bRemove = false;
+            bool bProbe = false;
+            switch (pEntry->state)
+            {
+                case INCOMPLETE:
+                    if (age < NEIGHBOUR_RETRANS_TIME)
+                        break;
+                    if (pEntry->nProbes >= NEIGHBOUR_MAX_MULTICAST)
+                        bRemove = true;
+                    else
+                        bProbe = true;
+                    break;
+
+                case REACHABLE:
+                    if (age >= NEIGHBOUR_REACHABLE_TIME)
+                    {
+                        pEntry->state = STALE;
+                        pEntry->updated = now;
+                    }
+                    break;
+
+                case STALE:
+                    if ((now - pEntry->used) >= NEIGHBOUR_GC_TIME)
+                        bRemove = true;
+                    break;
+
+                case DELAY:
+                    if (age >= NEIGHBOUR_DELAY_TIME)
+                    {
+                        pEntry->state = PROBE;
+                        pEntry->nProbes = 0;
+                        bProbe = true;
+                    }
+                    break;
+
+                case PROBE:
+                    if (age < NEIGHBOUR_RETRANS_TIME)
+                        break;
+                    if (pEntry->nProbes >= NEIGHBOUR_MAX_UNICAST)
+                        bRemove = true;
+                    else
+                        bProbe = true;
+                    break;
+            }
+
+            // Neighbours we only heard about have no protocol to probe them
+            // with; they're just forgotten.
+            if (bProbe && !pEntry->pProtocol)
+            {
+                bProbe = false;
+                bRemove = true;
+            }
+
+            if (bRemove)
+            {
+                unlink(pEntry);
+                pEntry->pNext = pDead;
+                pDead = pEntry;
+            }
+            else if (bProbe && (nProbes < NEIGHBOUR_PROBE_BATCH))
+            {
+                Probe &probe = probes[nProbes++];
+                probe.ip = pEntry->ip;
+                probe.pCard = pEntry->pCard;
+                probe.mac = pEntry->mac;
+                probe.bUnicast = pEntry->state != INCOMPLETE;
+                probe.pProtocol = pEntry->pProtocol;
+
+                ++pEntry->nProbes;
+                pEntry->updated = now;
+            }
+
+            pEntry = pNext;
+        }
+    }
+    m_Lock.release();
+
+    while (pDead)
+    {
+        Entry *pEntry = pDead;
+        pDead = pEntry->pNext;
+
+        sendPending(pEntry->pPending, pEntry->nPending, pEntry->ip, pEntry->pCard, 0);
+        delete pEntry;
+    }
+
+    for (size_t i = 0; i < nProbes; ++i)
+        probes[i].pProtocol->solicit(probes[i].ip, probes[i].pCard, probes[i].bUnicast ? &probes[i].mac : 0);
+}
@@ -21,23 +21,184 @@
 #ifndef NEIGHBOUR_DISCOVERY_H
 #define NEIGHBOUR_DISCOVERY_H
 
-/** NDP for IPv6 */
+#include <processor/types.h>
+#include <machine/Network.h>
+#include <network/NetworkBuffer.h>
+#include <process/Semaphore.h>
+#include <Spinlock.h>
+
+class Thread;
+
+/// Buckets in the neighbour cache's hash table (a power of two).
+#define NEIGHBOUR_BUCKETS           64
+
+/// Most neighbours the cache holds at once.
+#define NEIGHBOUR_MAX_ENTRIES       512
+
+/// Packets held for a neighbour while it's being resolved. Once full, the
+/// oldest is dropped to make room.
+#define NEIGHBOUR_MAX_PENDING       8
+
+/// How often the cache is aged, in milliseconds.
+#define NEIGHBOUR_TICK              1000
+
+/// Time a neighbour stays REACHABLE after it was last confirmed (ms).
+#define NEIGHBOUR_REACHABLE_TIME    30000
+
+/// Time spent in DELAY before probing (ms).
+#define NEIGHBOUR_DELAY_TIME        5000
+
+/// Time between solicitations (ms).
+#define NEIGHBOUR_RETRANS_TIME      1000
+
+/// Broadcast (or multicast) solicitations before resolution fails.
+#define NEIGHBOUR_MAX_MULTICAST     3
+
+/// Unicast probes of a known neighbour before it's forgotten.
+#define NEIGHBOUR_MAX_UNICAST       3
+
+/// Time a STALE neighbour is kept without being used (ms).
+#define NEIGHBOUR_GC_TIME           60000
+
+/** A protocol that resolves addresses for the neighbour cache. */
+class NeighbourProtocol
+{
+    public:
+        virtual ~NeighbourProtocol()
+        {}
+
+        /** Asks for the link-layer address of ip on pCard. pTarget is the
+         *  neighbour's last known address, to probe it directly, or null to
+         *  ask the whole link. */
+        virtual void solicit(IpAddress ip, Network *pCard, MacAddress *pTarget) = 0;
+};
+
+/**
+ * The neighbour cache, shared by ARP (IPv4) and NDP (IPv6).
+ *
+ * Neighbours are kept in a hash table keyed by address and card, and move
+ * through the states of RFC 4861 section 7.3.2: INCOMPLETE while being
+ * resolved, REACHABLE once confirmed, STALE when that confirmation is old,
+ * then DELAY and PROBE as they're used again and reconfirmed. Neighbours that
+ * don't answer are removed, as are STALE ones that haven't been used for a
+ * while.
+ *
+ * Nothing here blocks. Packets for a neighbour being resolved are held (a
+ * few per neighbour) and sent when the answer comes in, or dropped if it
+ * never does. A thread of its own ages the cache and sends the probes.
+ */
 class NeighbourDiscovery
 {
     public:
-        NeighbourDiscovery()
-        {};
-        virtual ~NeighbourDiscovery()
-        {};
-        
+        NeighbourDiscovery();
+        virtual ~NeighbourDiscovery();
+
         static NeighbourDiscovery &instance()
         {
             return m_Instance;
         }
-        
+
+        /** Starts the thread that ages the cache. Called from module init,
+         *  as threads can't be created during static initialisation. */
+        void initialise();
+
+        /**
+         * Finds the link-layer address of ip on pCard. Returns true with
+         * *pMac filled in if it's known. Otherwise starts resolving it with
+         * pProtocol, holds on to a clone of pBuffer (if given) to be sent
+         * once it's resolved, and returns false.
+         */
+        bool resolve(IpAddress ip, Network *pCard, MacAddress *pMac,
+                     NeighbourProtocol *pProtocol, NetworkBuffer *pBuffer = 0);
+
+        /** Looks up ip without resolving it or changing its state. */
+        bool lookup(IpAddress ip, Network *pCard, MacAddress *pMac = 0);
+
+        /**
+         * Learns a neighbour's link-layer address from a received message.
+         * \param bSolicited The message answered one of our solicitations,
+         *                   so the neighbour is known to be reachable.
+         * \param bOverride  mac replaces an address we already have.
+         */
+        void update(IpAddress ip, Network *pCard, MacAddress mac, bool bSolicited, bool bOverride);
+
+        /** Forgets a neighbour, dropping anything waiting for it. */
+        void remove(IpAddress ip, Network *pCard);
+
+        /** Number of neighbours in the cache. */
+        size_t count() const
+        {
+            return m_nEntries;
+        }
+
     private:
+        NeighbourDiscovery(const NeighbourDiscovery &);
+        NeighbourDiscovery &operator = (const NeighbourDiscovery &);
+
+        enum State
+        {
+            INCOMPLETE,
+            REACHABLE,
+            STALE,
+            DELAY,
+            PROBE
+        };
+
+        struct Entry
+        {
+            IpAddress ip;
+            Network *pCard;
+            MacAddress mac;
+            State state;
+
+            /// When the entry last changed state, or was last probed (ms).
+            uint64_t updated;
+
+            /// When a packet was last sent to the neighbour (ms).
+            uint64_t used;
+
+            size_t nProbes;
+            NeighbourProtocol *pProtocol;
+
+            /// Packets waiting for the neighbour to be resolved.
+            NetworkBuffer *pPending[NEIGHBOUR_MAX_PENDING];
+            size_t nPending;
+
+            Entry *pNext;
+        };
+
+        static size_t hash(IpAddress &ip);
+
+        /** Finds an entry. m_Lock must be held. */
+        Entry *find(IpAddress &ip, Network *pCard);
+
+        /** Adds a new entry. m_Lock must be held. */
+        void link(Entry *pEntry);
+
+        /** Takes an entry out of the table. m_Lock must be held. */
+        void unlink(Entry *pEntry);
+
+        /** Sends (or with no mac, drops) and releases packets that were
+         *  waiting for a neighbour. Called without m_Lock held. */
+        static void sendPending(NetworkBuffer **pPending, size_t nPending,
+                                IpAddress &ip, Network *pCard, MacAddress *pMac);
+
+        static int trampoline(void *p);
+        int work();
+
+        /** Moves neighbours along the state machine, and sends probes. */
+        void age();
+
         static NeighbourDiscovery m_Instance;
+
+        Entry *m_pBuckets[NEIGHBOUR_BUCKETS];
+        size_t m_nEntries;
+
+        Spinlock m_Lock;
+
+        Semaphore m_Wakeup;
+        volatile bool m_bStop;
+        Thread *m_pThread;
 };
 
 #endif
-
@@ -59,6 +59,8 @@ void Socket::decreaseRefCount(bool bIsWriter)
     else
         m_nReaders --;
 
+    checkWatchers();
+
     if (m_nReaders == 0 && m_nWriters == 0)
     {
         if (m_Endpoint)
@@ -20,31 +20,36 @@
 #include "NetworkStack.h"
 #include "Ethernet.h"
 #include "Ipv6.h"
+#include "Filter.h"
+#include "PacketCapture.h"
 #include <Module.h>
 #include <Log.h>
 #include <processor/Processor.h>
+#include <machine/Machine.h>
 
 #include "Dns.h"
+#include "NeighbourDiscovery.h"
 
 NetworkStack NetworkStack::stack;
 
 NetworkStack::NetworkStack() :
-  RequestQueue(), m_pLoopback(0), m_Children(), m_MemPool("network-pool")
+  m_pLoopback(0), m_Children(), m_RxDevices(), m_pDefaultRx(0), m_RxLock(),
+  m_MemPool("network-pool")
 {
-  initialise();
+  m_pDefaultRx = createRxDevice(0);
 
 #if defined(X86_COMMON)
   // Lots of RAM to burn! Try 16 MB, then 8 MB, then 4 MB, then give up
-  if(!m_MemPool.initialise(4096, 1600))
-      if(!m_MemPool.initialise(2048, 1600))
-        if(!m_MemPool.initialise(1024, 1600))
+  if(!m_MemPool.initialise(4096, NETWORK_POOL_BUFFER_SIZE))
+      if(!m_MemPool.initialise(2048, NETWORK_POOL_BUFFER_SIZE))
+        if(!m_MemPool.initialise(1024, NETWORK_POOL_BUFFER_SIZE))
             ERROR("Couldn't get a valid buffer pool for networking use");
 #elif defined(ARM_COMMON)
   // Probably very little RAM to burn - 4 MB then 2 MB, then 512 KB
   NOTICE_NOLOCK("allocating memory pool");
-  if(!m_MemPool.initialise(1024, 1600))
-      if(!m_MemPool.initialise(512, 1600))
-        if(!m_MemPool.initialise(128, 1600))
+  if(!m_MemPool.initialise(1024, NETWORK_POOL_BUFFER_SIZE))
+      if(!m_MemPool.initialise(512, NETWORK_POOL_BUFFER_SIZE))
+        if(!m_MemPool.initialise(128, NETWORK_POOL_BUFFER_SIZE))
             ERROR("Couldn't get a valid buffer pool for networking use");
 #else
 #warning Unhandled architecture for the NetworkStack buffer pool
@@ -53,68 +58,174 @@ NetworkStack::NetworkStack() :
 
 NetworkStack::~NetworkStack()
 {
-  destroy();
+  for(size_t i = 0; i < m_RxDevices.count(); ++i)
+    destroyRxDevice(m_RxDevices[i]);
+  destroyRxDevice(m_pDefaultRx);
 }
 
-uint64_t NetworkStack::executeRequest(uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, uint64_t p5,
-                                uint64_t p6, uint64_t p7, uint64_t p8)
+NetworkStack::RxDevice *NetworkStack::createRxDevice(Network *pCard)
 {
-    Packet *pack = reinterpret_cast<Packet*>(p1);
-    if(!pack)
-        return 0;
+  RxDevice *pDevice = new RxDevice;
+  pDevice->pCard = pCard;
+  for(size_t i = 0; i < NETWORK_RX_QUEUES; ++i)
+    pDevice->pQueues[i] = new RxQueue();
+  return pDevice;
+}
 
-    uintptr_t packet = pack->buffer;
-    size_t packetSize = pack->packetLength;
-    Network *pCard = pack->pCard;
-    uint32_t offset = pack->offset;
+void NetworkStack::destroyRxDevice(RxDevice *pDevice)
+{
+  for(size_t i = 0; i < NETWORK_RX_QUEUES; ++i)
+    delete pDevice->pQueues[i];
+  delete pDevice;
+}
 
-    if(!packet || !packetSize)
-    {
-        delete pack;
-        return 0;
-    }
+NetworkStack::RxDevice *NetworkStack::findRxDevice(Network *pCard)
+{
+  for(size_t i = 0; i < m_RxDevices.count(); ++i)
+  {
+    if(m_RxDevices[i]->pCard == pCard)
+      return m_RxDevices[i];
+  }
+  return m_pDefaultRx;
+}
 
-    // Pass onto the ethernet layer
-    /// \todo We should accept a parameter here that specifies the type of packet
-    ///       so we can pass it on to the correct handler, rather than assuming
-    ///       Ethernet.
-    Ethernet::instance().receive(packetSize, packet, pCard, offset);
+size_t NetworkStack::getRxDropped(Network *pCard)
+{
+  m_RxLock.acquire();
 
-    m_MemPool.free(packet);
+  RxDevice *pDevice = findRxDevice(pCard);
+  size_t nDropped = 0;
+  for(size_t i = 0; i < NETWORK_RX_QUEUES; ++i)
+    nDropped += pDevice->pQueues[i]->getDropped();
 
-    delete pack;
-    return 0;
+  m_RxLock.release();
+  return nDropped;
 }
 
 void NetworkStack::receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset)
 {
-  if(!packet || !nBytes)
+  if(!packet || !nBytes || (offset >= nBytes))
       return;
 
-  pCard->gotPacket();
+  if(PacketCapture::instance().isActive())
+    PacketCapture::instance().capture(packet + offset, nBytes - offset);
+
+  // Link-level filters get the first look, so anything they drop never
+  // costs a buffer.
+  if(!NetworkFilter::instance().filter(1, packet + offset, nBytes - offset))
+  {
+    pCard->gotPacket();
+    pCard->droppedPacket();
+    return;
+  }
 
   // Some cards might be giving us a DMA address or something, so we copy
   // before passing on to the worker thread...
-  uint8_t *safePacket = reinterpret_cast<uint8_t*>(m_MemPool.allocateNow());
-  if(!safePacket)
+  NetworkBuffer *pBuffer = allocateBuffer(nBytes - offset, NETWORK_BUFFER_HEADROOM, false);
+  if(!pBuffer)
   {
     ERROR("Network Stack: Out of memory pool space, dropping incoming packet");
+    pCard->gotPacket();
+    pCard->droppedPacket();
+    return;
+  }
+  memcpy(pBuffer->put(nBytes - offset), reinterpret_cast<void*>(packet + offset), nBytes - offset);
+
+  enqueue(pBuffer, pCard);
+}
+
+void NetworkStack::receive(NetworkBuffer *pBuffer, Network *pCard)
+{
+  if(!pBuffer)
+      return;
+
+  if(!pBuffer->getTotalLength() || !pBuffer->linearise())
+  {
+      pBuffer->release();
+      return;
+  }
+
+  if(PacketCapture::instance().isActive())
+    PacketCapture::instance().capture(pBuffer);
+
+  if(!NetworkFilter::instance().filter(1, pBuffer->getBuffer(), pBuffer->getLength()))
+  {
+    pCard->gotPacket();
     pCard->droppedPacket();
+    pBuffer->release();
     return;
   }
-  memcpy(safePacket, reinterpret_cast<void*>(packet), nBytes);
-  Packet *p = new Packet;
-  p->buffer = reinterpret_cast<uintptr_t>(safePacket);
-  p->packetLength = nBytes;
-  p->pCard = pCard;
-  p->offset = offset;
 
-  addAsyncRequest(0, reinterpret_cast<uint64_t>(p));
+  enqueue(pBuffer, pCard);
+}
+
+void NetworkStack::enqueue(NetworkBuffer *pBuffer, Network *pCard)
+{
+  pCard->gotPacket();
+
+  size_t queue = RxQueue::choose(pBuffer, NETWORK_RX_QUEUES);
+
+  m_RxLock.acquire();
+  RxQueue *pQueue = findRxDevice(pCard)->pQueues[queue];
+  m_RxLock.release();
+
+  // Queues are only freed when their device is deregistered, after which
+  // the driver mustn't be passing us packets.
+  if(!pQueue->push(pBuffer, pCard))
+    pCard->droppedPacket();
+}
+
+void NetworkStack::loopback(NetworkBuffer *pBuffer)
+{
+  Network *pCard = m_pLoopback;
+  if(!pBuffer->getTotalLength() || !pCard || !pBuffer->linearise())
+  {
+      pBuffer->release();
+      return;
+  }
+
+  pCard->gotPacket();
+
+  // Still queued rather than handled here: the receiving end often sends
+  // something straight back (an ACK, say), and that mustn't re-enter the
+  // sender's protocol code while it's part-way through a send.
+  size_t queue = RxQueue::choose(pBuffer, NETWORK_RX_QUEUES, true);
+
+  m_RxLock.acquire();
+  RxQueue *pQueue = findRxDevice(pCard)->pQueues[queue];
+  m_RxLock.release();
+
+  if(!pQueue->push(pBuffer, pCard, true))
+    pCard->droppedPacket();
+}
+
+NetworkBuffer *NetworkStack::allocateBuffer(size_t nBytes, size_t headroom, bool bBlock)
+{
+  if((headroom + nBytes) > NETWORK_POOL_BUFFER_SIZE)
+      return NetworkBuffer::allocate(nBytes, headroom);
+
+  uintptr_t buffer = bBlock ? m_MemPool.allocate() : m_MemPool.allocateNow();
+  if(!buffer)
+      return 0;
+
+  return NetworkBuffer::wrap(reinterpret_cast<uint8_t*>(buffer), NETWORK_POOL_BUFFER_SIZE, headroom,
+                             releasePoolBuffer, &m_MemPool);
+}
+
+void NetworkStack::releasePoolBuffer(uint8_t *pBase, void *pParam)
+{
+  MemoryPool *pPool = reinterpret_cast<MemoryPool*>(pParam);
+  pPool->free(reinterpret_cast<uintptr_t>(pBase));
 }
 
 void NetworkStack::registerDevice(Network *pDevice)
 {
+  RxDevice *pRx = createRxDevice(pDevice);
+
+  m_RxLock.acquire();
   m_Children.pushBack(pDevice);
+  m_RxDevices.pushBack(pRx);
+  m_RxLock.release();
 }
 
 Network *NetworkStack::getDevice(size_t n)
@@ -127,8 +238,17 @@ size_t NetworkStack::getNumDevices()
   return m_Children.count();
 }
 
+uint64_t NetworkStack::getTickCount()
+{
+  Timer *t = Machine::instance().getTimer();
+  return t ? t->getTickCount() : 0;
+}
+
 void NetworkStack::deRegisterDevice(Network *pDevice)
 {
+  RxDevice *pRx = 0;
+
+  m_RxLock.acquire();
   int i = 0;
   for(Vector<Network*>::Iterator it = m_Children.begin();
       it != m_Children.end();
@@ -138,6 +258,20 @@ void NetworkStack::deRegisterDevice(Network *pDevice)
     m_Children.erase(it);
     break;
   }
+  for(Vector<RxDevice*>::Iterator it = m_RxDevices.begin();
+      it != m_RxDevices.end();
+      it++)
+  if ((*it)->pCard == pDevice)
+  {
+    pRx = *it;
+    m_RxDevices.erase(it);
+    break;
+  }
+  m_RxLock.release();
+
+  // Waits for the workers to finish what they're doing.
+  if(pRx)
+    destroyRxDevice(pRx);
 }
 
 extern Ipv6Service *g_pIpv6Service;
@@ -148,6 +282,9 @@ static bool entry()
     // Initialise the DNS implementation
     Dns::instance().initialise();
 
+    // Start ageing the neighbour cache (ARP and NDP)
+    NeighbourDiscovery::instance().initialise();
+
     // Install the IPv6 Service
     g_pIpv6Service = new Ipv6Service;
     g_pIpv6Features = new ServiceFeatures;
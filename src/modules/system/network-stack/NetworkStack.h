@@ -25,15 +25,27 @@
 #include <utilities/Vector.h>
 #include <processor/types.h>
 #include <machine/Network.h>
-#include <utilities/RequestQueue.h>
 #include <utilities/MemoryPool.h>
+#include <network/NetworkBuffer.h>
+#include <Spinlock.h>
+
+#include "RxQueue.h"
+
+/** Size of each buffer in the networking memory pool. Big enough for a full
+    Ethernet frame plus NETWORK_BUFFER_HEADROOM. */
+#define NETWORK_POOL_BUFFER_SIZE    2048
 
 /**
  * The Pedigree network stack
  * This function is the base for receiving packets, and provides functionality
  * for keeping track of network devices in the system.
+ *
+ * Each device gets NETWORK_RX_QUEUES receive queues, each with a thread of its
+ * own, and incoming packets are spread over them by flow. So one busy card
+ * doesn't hold up the others, and protocol processing isn't limited to one
+ * CPU, but each connection's packets are still handled in order.
  */
-class NetworkStack : public RequestQueue
+class NetworkStack
 {
 public:
   NetworkStack();
@@ -45,9 +57,30 @@ public:
     return stack;
   }
   
-  /** Called when a packet arrives */
+  /** Called when a packet arrives. The packet is copied, so drivers which
+   *  can should use the NetworkBuffer version instead. */
   void receive(size_t nBytes, uintptr_t packet, Network* pCard, uint32_t offset);
 
+  /** Called when a packet arrives. The stack takes over the reference to
+   *  pBuffer, and the frame is passed up without being copied. */
+  void receive(NetworkBuffer *pBuffer, Network *pCard);
+
+  /** Delivers an IP packet sent to the loopback device. It goes straight
+   *  back to the IP layer, with no link-layer header or address resolution.
+   *  The stack takes over the reference to pBuffer. */
+  void loopback(NetworkBuffer *pBuffer);
+
+  /** Number of packets dropped for a device because its receive queues
+   *  were full. */
+  size_t getRxDropped(Network *pCard);
+
+  /**
+   * Gets an empty buffer with room for nBytes of packet after the given
+   * headroom. Buffers come from the memory pool if they fit, else the heap.
+   * \param bBlock If false, return null rather than waiting for the pool.
+   */
+  NetworkBuffer *allocateBuffer(size_t nBytes, size_t headroom = NETWORK_BUFFER_HEADROOM, bool bBlock = true);
+
   /** Registers a given network device with the stack */
   void registerDevice(Network *pDevice);
 
@@ -56,6 +89,10 @@ public:
 
   /** Returns the number of devices registered with the stack */
   size_t getNumDevices();
+
+  /** Milliseconds since boot, for the stack's timeouts and timestamps. Zero
+   *  until there's a timer. */
+  static uint64_t getTickCount();
   
   /** Unregisters a given network device from the stack */
   void deRegisterDevice(Network *pDevice);
@@ -72,6 +109,13 @@ public:
     return m_pLoopback;
   }
 
+  /** Is pCard the loopback device? What's sent through it never leaves the
+   *  machine, so it needs no checksums. */
+  inline bool isLoopback(Network *pCard)
+  {
+    return pCard && (pCard == m_pLoopback);
+  }
+
   /** Grabs the memory pool for networking use */
   inline MemoryPool &getMemPool()
   {
@@ -81,17 +125,29 @@ public:
 private:
 
   static NetworkStack stack;
-  
-  struct Packet
+
+  /** A device's receive queues. */
+  struct RxDevice
   {
-      uintptr_t buffer;
-      size_t packetLength;
       Network *pCard;
-      uint32_t offset;
+      RxQueue *pQueues[NETWORK_RX_QUEUES];
   };
-  
-  virtual uint64_t executeRequest(uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, uint64_t p5,
-                                  uint64_t p6, uint64_t p7, uint64_t p8);
+
+  /** Gives a pool buffer back once the last NetworkBuffer using it is gone. */
+  static void releasePoolBuffer(uint8_t *pBase, void *pParam);
+
+  /** Creates a device's receive queues. */
+  static RxDevice *createRxDevice(Network *pCard);
+
+  /** Stops and frees a device's receive queues. */
+  static void destroyRxDevice(RxDevice *pDevice);
+
+  /** Passes a received frame, which got through the link-level filters,
+   *  to one of its device's receive queues. */
+  void enqueue(NetworkBuffer *pBuffer, Network *pCard);
+
+  /** Finds the receive queues for a device. m_RxLock must be held. */
+  RxDevice *findRxDevice(Network *pCard);
 
   /** Loopback device */
   Network *m_pLoopback;
@@ -99,6 +155,15 @@ private:
   /** Network devices registered with the stack. */
   Vector<Network*> m_Children;
 
+  /** Receive queues of registered devices. */
+  Vector<RxDevice*> m_RxDevices;
+
+  /** Receive queues for packets from devices that haven't registered (yet). */
+  RxDevice *m_pDefaultRx;
+
+  /** Protects m_RxDevices - packets arrive in interrupt handlers. */
+  Spinlock m_RxLock;
+
   /** Networking memory pool */
   MemoryPool m_MemPool;
 };
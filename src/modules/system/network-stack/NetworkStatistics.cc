@@ -0,0 +1,119 @@
+/*
+ * 
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "NetworkStatistics.h"
+#include <utilities/StaticString.h>
+#include <utilities/utility.h>
+
+NetworkStatistics NetworkStatistics::m_Instance;
+
+/** Group and name of each counter, in the order of the Counter enum. */
+static const char *g_CounterNames[NetworkStatistics::CounterCount][2] =
+{
+  {"Ip", "InReceives"},
+  {"Ip", "InHdrErrors"},
+  {"Ip", "InUnknownProtos"},
+  {"Ip", "InDiscards"},
+  {"Ip", "InDelivers"},
+  {"Ip", "OutRequests"},
+  {"Ip", "OutNoRoutes"},
+  {"Ip", "ReasmReqds"},
+  {"Ip", "ReasmOKs"},
+  {"Ip", "ForwDatagrams"},
+
+  {"Ip6", "InReceives"},
+  {"Ip6", "InAddrErrors"},
+  {"Ip6", "InUnknownProtos"},
+  {"Ip6", "InDiscards"},
+  {"Ip6", "InDelivers"},
+  {"Ip6", "OutRequests"},
+  {"Ip6", "OutNoRoutes"},
+
+  {"Icmp", "InMsgs"},
+  {"Icmp", "InErrors"},
+  {"Icmp", "InEchos"},
+  {"Icmp", "InEchoReps"},
+  {"Icmp", "InDestUnreachs"},
+  {"Icmp", "OutMsgs"},
+  {"Icmp", "OutEchoReps"},
+
+  {"Icmp6", "InMsgs"},
+  {"Icmp6", "InErrors"},
+  {"Icmp6", "InEchos"},
+  {"Icmp6", "OutMsgs"},
+
+  {"Tcp", "ActiveOpens"},
+  {"Tcp", "PassiveOpens"},
+  {"Tcp", "AttemptFails"},
+  {"Tcp", "EstabResets"},
+  {"Tcp", "InSegs"},
+  {"Tcp", "OutSegs"},
+  {"Tcp", "RetransSegs"},
+  {"Tcp", "InErrs"},
+  {"Tcp", "InCsumErrors"},
+  {"Tcp", "OutRsts"},
+
+  {"Udp", "InDatagrams"},
+  {"Udp", "NoPorts"},
+  {"Udp", "InErrors"},
+  {"Udp", "InCsumErrors"},
+  {"Udp", "RcvbufErrors"},
+  {"Udp", "OutDatagrams"},
+};
+
+NetworkStatistics::NetworkStatistics()
+{
+  memset(m_Counters, 0, sizeof(m_Counters));
+}
+
+uint64_t NetworkStatistics::get(Counter counter) const
+{
+  uint64_t total = 0;
+  for(size_t i = 0; i < NETSTAT_CPUS; ++i)
+    total += m_Counters[i].values[counter];
+  return total;
+}
+
+const char *NetworkStatistics::getGroup(Counter counter)
+{
+  return (counter < CounterCount) ? g_CounterNames[counter][0] : "";
+}
+
+const char *NetworkStatistics::getName(Counter counter)
+{
+  return (counter < CounterCount) ? g_CounterNames[counter][1] : "";
+}
+
+void NetworkStatistics::dump(String &str) const
+{
+  for(size_t i = 0; i < CounterCount; ++i)
+  {
+    Counter counter = static_cast<Counter>(i);
+
+    LargeStaticString line;
+    line += getGroup(counter);
+    line += " ";
+    line += getName(counter);
+    line += " ";
+    line.append(get(counter));
+    line += "\n";
+    str += static_cast<const char*>(line);
+  }
+}
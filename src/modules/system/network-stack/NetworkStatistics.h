@@ -0,0 +1,136 @@
+/*
+ * 
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MACHINE_NETWORKSTATISTICS_H
+#define MACHINE_NETWORKSTATISTICS_H
+
+#include <processor/types.h>
+#include <processor/Processor.h>
+#include <utilities/String.h>
+
+/// Processors with their own set of counters. Any others share them.
+#define NETSTAT_CPUS    MAX_PROCESSORS
+
+/** Bumps one of the stack's counters, eg. NETSTAT_INC(TcpRetransSegs). */
+#define NETSTAT_INC(counter)        NetworkStatistics::instance().add(NetworkStatistics::counter)
+#define NETSTAT_ADD(counter, n)     NetworkStatistics::instance().add(NetworkStatistics::counter, n)
+
+/**
+ * Protocol counters for the stack, after the SNMP MIBs (RFC 4293 for IP,
+ * RFC 4022 for TCP and RFC 4113 for UDP).
+ *
+ * Each processor counts into its own cache line, so counting doesn't
+ * bounce lines between processors; reading sums them all.
+ */
+class NetworkStatistics
+{
+  public:
+    enum Counter
+    {
+      Ipv4InReceives = 0,
+      Ipv4InHdrErrors,
+      Ipv4InUnknownProtos,
+      Ipv4InDiscards,
+      Ipv4InDelivers,
+      Ipv4OutRequests,
+      Ipv4OutNoRoutes,
+      Ipv4ReasmReqds,
+      Ipv4ReasmOKs,
+      Ipv4ForwDatagrams,
+
+      Ipv6InReceives,
+      Ipv6InAddrErrors,
+      Ipv6InUnknownProtos,
+      Ipv6InDiscards,
+      Ipv6InDelivers,
+      Ipv6OutRequests,
+      Ipv6OutNoRoutes,
+
+      IcmpInMsgs,
+      IcmpInErrors,
+      IcmpInEchos,
+      IcmpInEchoReps,
+      IcmpInDestUnreachs,
+      IcmpOutMsgs,
+      IcmpOutEchoReps,
+
+      Icmp6InMsgs,
+      Icmp6InErrors,
+      Icmp6InEchos,
+      Icmp6OutMsgs,
+
+      TcpActiveOpens,
+      TcpPassiveOpens,
+      TcpAttemptFails,
+      TcpEstabResets,
+      TcpInSegs,
+      TcpOutSegs,
+      TcpRetransSegs,
+      TcpInErrs,
+      TcpInCsumErrors,
+      TcpOutRsts,
+
+      UdpInDatagrams,
+      UdpNoPorts,
+      UdpInErrors,
+      UdpInCsumErrors,
+      UdpRcvbufErrors,
+      UdpOutDatagrams,
+
+      CounterCount
+    };
+
+    NetworkStatistics();
+
+    static NetworkStatistics &instance()
+    {
+      return m_Instance;
+    }
+
+    inline void add(Counter counter, uint64_t n = 1)
+    {
+      __sync_fetch_and_add(&m_Counters[Processor::id() % NETSTAT_CPUS].values[counter], n);
+    }
+
+    /** Sums a counter over every processor. */
+    uint64_t get(Counter counter) const;
+
+    /** Group ("Tcp") and name ("RetransSegs") of a counter. */
+    static const char *getGroup(Counter counter);
+    static const char *getName(Counter counter);
+
+    /** Appends every counter to str, one "Group Name Value" per line. */
+    void dump(String &str) const;
+
+  private:
+    NetworkStatistics(const NetworkStatistics &);
+    NetworkStatistics &operator = (const NetworkStatistics &);
+
+    static NetworkStatistics m_Instance;
+
+    struct PerCpu
+    {
+      uint64_t values[CounterCount];
+    } __attribute__((aligned(64)));
+
+    PerCpu m_Counters[NETSTAT_CPUS];
+};
+
+#endif
@@ -0,0 +1,342 @@
+/*
+ * 
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "PacketCapture.h"
+#include "Bpf.h"
+#include "NetworkStack.h"
+#include <machine/Machine.h>
+#include <processor/Processor.h>
+#include <process/Scheduler.h>
+#include <LockGuard.h>
+#include <utilities/utility.h>
+
+/// pcap file header fields.
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_VERSION_MAJOR  2
+#define PCAP_VERSION_MINOR  4
+#define PCAP_LINKTYPE_ETHERNET 1
+
+/// Bytes in a pcap record header.
+#define PCAP_RECORD_HEADER  16
+
+PacketCapture PacketCapture::m_Instance;
+
+static inline void put32(uint8_t *p, uint32_t value)
+{
+  memcpy(p, &value, sizeof(value));
+}
+
+static inline void put16(uint8_t *p, uint16_t value)
+{
+  memcpy(p, &value, sizeof(value));
+}
+
+PacketCapture::PacketCapture() :
+  m_nRings(0), m_bActive(false), m_pFilter(0), m_BootTime(0), m_nStaged(0),
+  m_nStagingOffset(0), m_bHeaderSent(false), m_ReadLock(false), m_Wakeup(0),
+  m_bReaderWaiting(false)
+{
+  for(size_t i = 0; i < CAPTURE_MAX_CPUS; ++i)
+  {
+    m_Rings[i].pRecords = 0;
+    m_Rings[i].head = m_Rings[i].tail = 0;
+    m_Rings[i].nCaptured = m_Rings[i].nDropped = 0;
+    m_Rings[i].bWriting = false;
+  }
+}
+
+PacketCapture::~PacketCapture()
+{
+  stop();
+  if(m_pFilter)
+    m_pFilter->release();
+}
+
+bool PacketCapture::start()
+{
+  LockGuard<Mutex> guard(m_ReadLock);
+
+  if(m_bActive)
+    return true;
+
+  m_nRings = Processor::getCount();
+  if(m_nRings > CAPTURE_MAX_CPUS)
+    m_nRings = CAPTURE_MAX_CPUS;
+
+  for(size_t i = 0; i < m_nRings; ++i)
+  {
+    Ring &ring = m_Rings[i];
+    ring.pRecords = new Record[CAPTURE_RING_SLOTS];
+    ring.head = ring.tail = 0;
+    ring.nCaptured = ring.nDropped = 0;
+  }
+
+  Timer *t = Machine::instance().getTimer();
+  m_BootTime = t ? t->getUnixTimestamp() - (t->getTickCount() / 1000) : 0;
+
+  m_nStaged = m_nStagingOffset = 0;
+  m_bHeaderSent = false;
+
+  __sync_synchronize();
+  m_bActive = true;
+  return true;
+}
+
+void PacketCapture::stop()
+{
+  if(!m_bActive)
+    return;
+
+  m_bActive = false;
+  __sync_synchronize();
+
+  // Let a blocked reader see the capture's over.
+  m_Wakeup.release();
+
+  LockGuard<Mutex> guard(m_ReadLock);
+
+  for(size_t i = 0; i < m_nRings; ++i)
+  {
+    Ring &ring = m_Rings[i];
+
+    // A frame that saw the capture running may still be going in.
+    while(ring.bWriting)
+      Scheduler::instance().yield();
+
+    delete [] ring.pRecords;
+    ring.pRecords = 0;
+  }
+  m_nRings = 0;
+}
+
+void PacketCapture::setFilter(BpfProgram *pProgram)
+{
+  if(pProgram)
+    pProgram->addRef();
+
+  BpfProgram *pOld = __sync_lock_test_and_set(&m_pFilter, pProgram);
+  if(!pOld)
+    return;
+
+  // Frames being captured may still be running through the old filter.
+  __sync_synchronize();
+  for(size_t i = 0; i < CAPTURE_MAX_CPUS; ++i)
+  {
+    while(m_Rings[i].bWriting)
+      Scheduler::instance().yield();
+  }
+
+  pOld->release();
+}
+
+void PacketCapture::capture(const NetworkBuffer *pBuffer, uintptr_t packet, size_t nBytes)
+{
+  if(!m_bActive || !nBytes)
+    return;
+
+  // With interrupts off, nothing else can touch this processor's ring.
+  bool bInterrupts = Processor::getInterrupts();
+  Processor::setInterrupts(false);
+
+  size_t cpu = Processor::id();
+  Ring *pRing = (cpu < CAPTURE_MAX_CPUS) ? &m_Rings[cpu] : 0;
+  if(pRing)
+  {
+    pRing->bWriting = true;
+    __sync_synchronize();
+
+    // Checked again now stop() can see us.
+    if(m_bActive && pRing->pRecords)
+    {
+      size_t tail = pRing->tail;
+      if((tail - pRing->head) >= CAPTURE_RING_SLOTS)
+        ++pRing->nDropped;
+      else
+      {
+        Record &record = pRing->pRecords[tail % CAPTURE_RING_SLOTS];
+
+        size_t length = (nBytes < CAPTURE_SNAPLEN) ? nBytes : CAPTURE_SNAPLEN;
+        if(pBuffer)
+          length = pBuffer->copyOut(0, record.data, length);
+        else
+          memcpy(record.data, reinterpret_cast<void*>(packet), length);
+
+        // The filter runs on the copy, which covers fragmented buffers and
+        // means a rejected frame costs nothing but the slot it didn't use.
+        BpfProgram *pFilter = m_pFilter;
+        if(pFilter)
+        {
+          size_t nAccept = pFilter->run(record.data, length);
+          if(nAccept < length)
+            length = nAccept;
+        }
+
+        if(length)
+        {
+          record.timestamp = NetworkStack::getTickCount();
+          record.length = length;
+          record.origLength = nBytes;
+
+          __sync_synchronize();
+          pRing->tail = tail + 1;
+          ++pRing->nCaptured;
+
+          if(m_bReaderWaiting)
+          {
+            m_bReaderWaiting = false;
+            m_Wakeup.release();
+          }
+        }
+      }
+    }
+
+    __sync_synchronize();
+    pRing->bWriting = false;
+  }
+
+  Processor::setInterrupts(bInterrupts);
+}
+
+bool PacketCapture::pending()
+{
+  for(size_t i = 0; i < m_nRings; ++i)
+  {
+    if(m_Rings[i].head != m_Rings[i].tail)
+      return true;
+  }
+  return false;
+}
+
+bool PacketCapture::stageNext()
+{
+  // The rings are each in order, so the oldest frame is at one of the heads.
+  Ring *pOldest = 0;
+  for(size_t i = 0; i < m_nRings; ++i)
+  {
+    Ring &ring = m_Rings[i];
+    if(ring.head == ring.tail)
+      continue;
+
+    Record &record = ring.pRecords[ring.head % CAPTURE_RING_SLOTS];
+    if(!pOldest || (record.timestamp < pOldest->pRecords[pOldest->head % CAPTURE_RING_SLOTS].timestamp))
+      pOldest = &ring;
+  }
+
+  if(!pOldest)
+    return false;
+
+  __sync_synchronize();
+  Record &record = pOldest->pRecords[pOldest->head % CAPTURE_RING_SLOTS];
+
+  uint64_t ms = record.timestamp;
+  put32(&m_Staging[0], m_BootTime + (ms / 1000));
+  put32(&m_Staging[4], (ms % 1000) * 1000);
+  put32(&m_Staging[8], record.length);
+  put32(&m_Staging[12], record.origLength);
+  memcpy(&m_Staging[PCAP_RECORD_HEADER], record.data, record.length);
+  m_nStaged = PCAP_RECORD_HEADER + record.length;
+  m_nStagingOffset = 0;
+
+  // Only now can the slot be reused.
+  __sync_synchronize();
+  pOldest->head = pOldest->head + 1;
+  return true;
+}
+
+size_t PacketCapture::read(uint8_t *pBuffer, size_t nBytes, bool bBlock)
+{
+  LockGuard<Mutex> guard(m_ReadLock);
+
+  size_t nRead = 0;
+  while(nRead < nBytes)
+  {
+    // Finish whatever's left of the last record first.
+    if(m_nStagingOffset < m_nStaged)
+    {
+      size_t n = m_nStaged - m_nStagingOffset;
+      if(n > (nBytes - nRead))
+        n = nBytes - nRead;
+      memcpy(pBuffer + nRead, &m_Staging[m_nStagingOffset], n);
+      m_nStagingOffset += n;
+      nRead += n;
+      continue;
+    }
+
+    if(!m_bActive)
+      break;
+
+    if(!m_bHeaderSent)
+    {
+      put32(&m_Staging[0], PCAP_MAGIC);
+      put16(&m_Staging[4], PCAP_VERSION_MAJOR);
+      put16(&m_Staging[6], PCAP_VERSION_MINOR);
+      put32(&m_Staging[8], 0);  // GMT offset
+      put32(&m_Staging[12], 0); // Timestamp accuracy
+      put32(&m_Staging[16], CAPTURE_SNAPLEN);
+      put32(&m_Staging[20], PCAP_LINKTYPE_ETHERNET);
+      m_nStaged = 24;
+      m_nStagingOffset = 0;
+      m_bHeaderSent = true;
+      continue;
+    }
+
+    if(stageNext())
+      continue;
+
+    // Return what we have rather than wait for a full buffer.
+    if(nRead || !bBlock)
+      break;
+
+    m_bReaderWaiting = true;
+    __sync_synchronize();
+    if(!pending())
+      m_Wakeup.acquire(1, 1);
+    m_bReaderWaiting = false;
+  }
+
+  return nRead;
+}
+
+bool PacketCapture::poll(bool bBlock)
+{
+  while(true)
+  {
+    if(!m_bActive || pending() || !m_bHeaderSent || (m_nStagingOffset < m_nStaged))
+      return true;
+    if(!bBlock)
+      return false;
+
+    m_bReaderWaiting = true;
+    __sync_synchronize();
+    if(!pending())
+      m_Wakeup.acquire(1, 1);
+    m_bReaderWaiting = false;
+  }
+}
+
+void PacketCapture::getStatistics(size_t &nCaptured, size_t &nDropped)
+{
+  nCaptured = nDropped = 0;
+  for(size_t i = 0; i < CAPTURE_MAX_CPUS; ++i)
+  {
+    nCaptured += m_Rings[i].nCaptured;
+    nDropped += m_Rings[i].nDropped;
+  }
+}
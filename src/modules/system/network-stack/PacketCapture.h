@@ -0,0 +1,162 @@
+/*
+ * 
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MACHINE_PACKETCAPTURE_H
+#define MACHINE_PACKETCAPTURE_H
+
+#include <processor/types.h>
+#include <process/Mutex.h>
+#include <process/Semaphore.h>
+#include <network/NetworkBuffer.h>
+
+class BpfProgram;
+
+/// Most bytes of each frame kept.
+#define CAPTURE_SNAPLEN     1520
+
+/// Frames each processor's ring holds before new ones are dropped.
+#define CAPTURE_RING_SLOTS  128
+
+/// Processors that get a ring. Frames seen on any others aren't captured.
+#define CAPTURE_MAX_CPUS    MAX_PROCESSORS
+
+/**
+ * Captures the Ethernet frames the stack sends and receives, for reading
+ * out as a pcap stream (/dev/pcap).
+ *
+ * Each processor writes into its own ring with interrupts briefly off, so
+ * capturing takes no locks and never waits: if the reader falls behind and
+ * a ring fills, frames are counted and dropped. While nothing is capturing
+ * the stack only reads isActive() - the rings don't even exist.
+ */
+class PacketCapture
+{
+  public:
+    PacketCapture();
+    ~PacketCapture();
+
+    static PacketCapture &instance()
+    {
+      return m_Instance;
+    }
+
+    /** Is a capture running? Callers check this before capture(). */
+    inline bool isActive() const
+    {
+      return m_bActive;
+    }
+
+    /** Captures a frame. Safe to call from interrupt handlers. */
+    void capture(uintptr_t packet, size_t nBytes)
+    {
+      capture(0, packet, nBytes);
+    }
+    void capture(const NetworkBuffer *pBuffer)
+    {
+      capture(pBuffer, 0, pBuffer->getTotalLength());
+    }
+
+    /** Starts capturing, unless a capture is already running. */
+    bool start();
+
+    /** Stops capturing and throws away anything not yet read. */
+    void stop();
+
+    /** Only captures frames pProgram accepts (taking a reference to it),
+     *  truncated to the length it returns. Null captures everything. */
+    void setFilter(BpfProgram *pProgram);
+
+    /** Reads the capture as a pcap stream: the file header first, then a
+     *  record for each frame, oldest first. Records can be split across
+     *  reads. Returns zero when the capture has stopped, or if there's
+     *  nothing to read and bBlock is false. */
+    size_t read(uint8_t *pBuffer, size_t nBytes, bool bBlock);
+
+    /** Is there anything to read? If bBlock, waits until there is (or the
+     *  capture stops). */
+    bool poll(bool bBlock);
+
+    /** Frames captured and dropped since the capture started. */
+    void getStatistics(size_t &nCaptured, size_t &nDropped);
+
+  private:
+    PacketCapture(const PacketCapture &);
+    PacketCapture &operator = (const PacketCapture &);
+
+    static PacketCapture m_Instance;
+
+    /** Copies a frame (from pBuffer if given, otherwise from packet) into
+     *  the current processor's ring. */
+    void capture(const NetworkBuffer *pBuffer, uintptr_t packet, size_t nBytes);
+
+    /** Copies the oldest waiting frame into m_Staging as a pcap record.
+     *  m_ReadLock must be held. */
+    bool stageNext();
+
+    /** Is any ring non-empty? */
+    bool pending();
+
+    struct Record
+    {
+      uint64_t timestamp;
+      uint32_t length;
+      uint32_t origLength;
+      uint8_t data[CAPTURE_SNAPLEN];
+    };
+
+    /** One processor's frames. Only that processor moves the tail and only
+     *  the reader moves the head. */
+    struct Ring
+    {
+      Record *pRecords;
+      volatile size_t head;
+      volatile size_t tail;
+      size_t nCaptured;
+      size_t nDropped;
+
+      /** The processor is part-way through writing a record. */
+      volatile bool bWriting;
+    } __attribute__((aligned(64)));
+
+    Ring m_Rings[CAPTURE_MAX_CPUS];
+    size_t m_nRings;
+
+    volatile bool m_bActive;
+
+    BpfProgram * volatile m_pFilter;
+
+    /** Unix time the tick count started from, for timestamps. */
+    uint64_t m_BootTime;
+
+    /** The pcap record (or file header) being read out. */
+    uint8_t m_Staging[16 + CAPTURE_SNAPLEN];
+    size_t m_nStaged;
+    size_t m_nStagingOffset;
+    bool m_bHeaderSent;
+
+    /** Serialises readers and starting and stopping. */
+    Mutex m_ReadLock;
+
+    /** Released when a frame arrives while the reader waits. */
+    Semaphore m_Wakeup;
+    volatile bool m_bReaderWaiting;
+};
+
+#endif
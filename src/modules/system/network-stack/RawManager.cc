@@ -194,8 +194,10 @@ void RawManager::receive(uintptr_t payload, size_t payloadSize, Endpoint::Remote
 
     if(e->getRawType() == endType)
     {
-        NOTICE("Depositing payload");
-      e->depositPacket(payloadSize, payload, remoteHost);
+      // Filtered before depositPacket makes its copy.
+      size_t nAccept = e->filterPacket(payload, payloadSize);
+      if(nAccept)
+        e->depositPacket(nAccept, payload, remoteHost);
     }
   }
 }
@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "RxQueue.h"
+#include "Ethernet.h"
+#include "Ipv4.h"
+#include "Ipv6.h"
+#include <process/Thread.h>
+#include <process/Scheduler.h>
+#include <processor/Processor.h>
+
+#define IP_PROTO_TCP  6
+#define IP_PROTO_UDP  17
+
+RxQueue::RxQueue() :
+  m_nHeld(0), m_Head(0), m_Count(0), m_Lock(), m_Wakeup(0), m_bSleeping(false),
+  m_bStop(false), m_pThread(0), m_nDropped(0)
+{
+  m_pThread = new Thread(Scheduler::instance().getKernelProcess(),
+                         reinterpret_cast<Thread::ThreadStartFunc>(&trampoline),
+                         reinterpret_cast<void*>(this));
+}
+
+RxQueue::~RxQueue()
+{
+  m_bStop = true;
+  m_Wakeup.release();
+  m_pThread->join();
+
+  while(m_Count)
+  {
+    m_Ring[m_Head].pBuffer->release();
+    m_Head = (m_Head + 1) % NETWORK_RX_QUEUE_SIZE;
+    --m_Count;
+  }
+}
+
+bool RxQueue::push(NetworkBuffer *pBuffer, Network *pCard, bool bIp)
+{
+  m_Lock.acquire();
+
+  if(m_Count == NETWORK_RX_QUEUE_SIZE)
+  {
+    ++m_nDropped;
+    m_Lock.release();
+    pBuffer->release();
+    return false;
+  }
+
+  Packet &p = m_Ring[(m_Head + m_Count) % NETWORK_RX_QUEUE_SIZE];
+  p.pBuffer = pBuffer;
+  p.pCard = pCard;
+  p.bIp = bIp;
+  ++m_Count;
+
+  // Only the first packet after the worker runs dry needs to wake it.
+  bool bWake = m_bSleeping;
+  m_bSleeping = false;
+
+  m_Lock.release();
+
+  if(bWake)
+    m_Wakeup.release();
+  return true;
+}
+
+int RxQueue::trampoline(void *p)
+{
+  RxQueue *pQueue = reinterpret_cast<RxQueue*>(p);
+  return pQueue->work();
+}
+
+int RxQueue::work()
+{
+  Packet batch[NETWORK_RX_BATCH];
+
+  while(!m_bStop)
+  {
+    m_Lock.acquire();
+
+    if(!m_Count)
+    {
+      m_bSleeping = true;
+      m_Lock.release();
+      m_Wakeup.acquire();
+      continue;
+    }
+
+    size_t nPackets = m_Count;
+    if(nPackets > NETWORK_RX_BATCH)
+      nPackets = NETWORK_RX_BATCH;
+    for(size_t i = 0; i < nPackets; ++i)
+    {
+      batch[i] = m_Ring[m_Head];
+      m_Head = (m_Head + 1) % NETWORK_RX_QUEUE_SIZE;
+    }
+    m_Count -= nPackets;
+
+    m_Lock.release();
+
+    for(size_t i = 0; i < nPackets; ++i)
+      coalesce(batch[i]);
+
+    // Nothing is held past the end of a batch, so a segment is never kept
+    // waiting for others that might not come.
+    flushAll();
+  }
+
+  return 0;
+}
+
+void RxQueue::coalesce(Packet &p)
+{
+  // Frames (Ethernet, for now) need to be carrying IP.
+  size_t linkLength = 0;
+  bool bCandidate = true;
+  if(!p.bIp)
+  {
+    const uint8_t *pData = p.pBuffer->getData();
+    linkLength = 14;
+    if(p.pBuffer->getLength() < linkLength)
+      bCandidate = false;
+    else
+    {
+      uint16_t type = (pData[12] << 8) | pData[13];
+      bCandidate = (type == ETH_IPV4) || (type == ETH_IPV6);
+    }
+  }
+
+  TcpOffload::Segment segment;
+  if(!bCandidate || !TcpOffload::parse(p.pBuffer, linkLength, segment))
+  {
+    // It mustn't overtake anything of its own flow that's being held.
+    flushAll();
+    deliver(p);
+    return;
+  }
+
+  for(size_t i = 0; i < m_nHeld; ++i)
+  {
+    Held &held = m_Held[i];
+    if((held.packet.pCard != p.pCard) || (held.packet.bIp != p.bIp))
+      continue;
+    if(!TcpOffload::sameFlow(held.packet.pBuffer, held.segment, p.pBuffer, segment))
+      continue;
+
+    if(TcpOffload::merge(held.packet.pBuffer, held.segment, p.pBuffer, segment))
+      return;
+
+    // It doesn't follow on, so what's held goes up first and this takes
+    // its place.
+    flush(held);
+    held.packet = p;
+    held.segment = segment;
+    return;
+  }
+
+  if(m_nHeld == NETWORK_GRO_FLOWS)
+    flushAll();
+
+  m_Held[m_nHeld].packet = p;
+  m_Held[m_nHeld].segment = segment;
+  ++m_nHeld;
+}
+
+void RxQueue::flush(Held &held)
+{
+  if(!TcpOffload::finish(held.packet.pBuffer, held.segment))
+  {
+    held.packet.pCard->droppedPacket();
+    held.packet.pBuffer->release();
+    return;
+  }
+
+  deliver(held.packet);
+}
+
+void RxQueue::flushAll()
+{
+  for(size_t i = 0; i < m_nHeld; ++i)
+    flush(m_Held[i]);
+  m_nHeld = 0;
+}
+
+void RxQueue::deliver(Packet &p)
+{
+  NetworkBuffer *pBuffer = p.pBuffer;
+
+  if(p.bIp)
+  {
+    uintptr_t packet = pBuffer->getBuffer();
+    if((pBuffer->getData()[0] >> 4) == 6)
+      Ipv6::instance().receive(pBuffer->getLength(), packet, p.pCard, 0, pBuffer);
+    else
+      Ipv4::instance().receive(pBuffer->getLength(), packet, p.pCard, 0, pBuffer);
+
+    pBuffer->release();
+    return;
+  }
+
+  /// \todo We should accept a parameter here that specifies the type of packet
+  ///       so we can pass it on to the correct handler, rather than assuming
+  ///       Ethernet.
+  Ethernet::instance().receive(pBuffer->getLength(), pBuffer->getBuffer(), p.pCard, 0, pBuffer);
+
+  pBuffer->release();
+}
+
+/** Folds another word into a flow hash (the Jenkins one-at-a-time hash). */
+static inline uint32_t hashWord(uint32_t hash, uint32_t word)
+{
+  for(size_t i = 0; i < 4; ++i)
+  {
+    hash += (word >> (i * 8)) & 0xFF;
+    hash += hash << 10;
+    hash ^= hash >> 6;
+  }
+  return hash;
+}
+
+static inline uint32_t readWord(const uint8_t *p)
+{
+  return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+size_t RxQueue::choose(NetworkBuffer *pBuffer, size_t nQueues, bool bIp)
+{
+  if(nQueues < 2)
+    return 0;
+
+  const uint8_t *p = pBuffer->getData();
+  size_t nBytes = pBuffer->getLength();
+
+  uint16_t type = 0;
+  if(bIp)
+  {
+    if(!nBytes)
+      return 0;
+    type = ((p[0] >> 4) == 6) ? ETH_IPV6 : ETH_IPV4;
+  }
+  else
+  {
+    if(nBytes < 14)
+      return 0;
+    type = (p[12] << 8) | p[13];
+    p += 14;
+    nBytes -= 14;
+  }
+
+  uint32_t hash = 0;
+  uint8_t protocol = 0;
+  if((type == ETH_IPV4) && (nBytes >= 20))
+  {
+    size_t headerLen = (p[0] & 0xF) * 4;
+    hash = hashWord(hashWord(hash, readWord(p + 12)), readWord(p + 16));
+
+    // Fragments after the first have no ports, so fragments only hash
+    // their addresses to keep the whole datagram together.
+    bool bFragment = ((p[6] & 0x3F) | p[7]) != 0;
+    if(!bFragment && (headerLen >= 20) && (nBytes >= headerLen + 4))
+    {
+      protocol = p[9];
+      p += headerLen;
+    }
+  }
+  else if((type == ETH_IPV6) && (nBytes >= 40))
+  {
+    for(size_t i = 8; i < 40; i += 4)
+      hash = hashWord(hash, readWord(p + i));
+
+    if(nBytes >= 44)
+    {
+      protocol = p[6];
+      p += 40;
+    }
+  }
+  else
+    return 0;
+
+  if((protocol == IP_PROTO_TCP) || (protocol == IP_PROTO_UDP))
+    hash = hashWord(hash, (protocol << 24) ^ readWord(p));
+
+  hash += hash << 3;
+  hash ^= hash >> 11;
+  hash += hash << 15;
+
+  return hash % nQueues;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MACHINE_RXQUEUE_H
+#define MACHINE_RXQUEUE_H
+
+#include <processor/types.h>
+#include <process/Semaphore.h>
+#include <machine/Network.h>
+#include <network/NetworkBuffer.h>
+#include <Spinlock.h>
+
+#include "TcpOffload.h"
+
+class Thread;
+
+/// Receive queues (each with its own worker thread) per network device.
+#ifdef MULTIPROCESSOR
+#define NETWORK_RX_QUEUES     4
+#else
+#define NETWORK_RX_QUEUES     1
+#endif
+
+/// Packets a receive queue holds before it starts dropping them.
+#define NETWORK_RX_QUEUE_SIZE 512
+
+/// Most packets a worker takes off its queue each time it wakes.
+#define NETWORK_RX_BATCH      32
+
+/// Most TCP flows a worker coalesces segments for at once, within a batch.
+#define NETWORK_GRO_FLOWS     8
+
+/**
+ * A queue of received packets and the thread that passes them up the stack.
+ *
+ * Drivers add packets from their interrupt handlers; the worker sleeps until
+ * there's something to do and then takes packets off in batches, so a burst
+ * of packets costs one wakeup rather than one per packet. Back-to-back TCP
+ * segments of a flow in the same batch are coalesced into one packet before
+ * they go up the stack (see TcpOffload).
+ */
+class RxQueue
+{
+  public:
+    RxQueue();
+    ~RxQueue();
+
+    /** Adds a packet, taking over the reference to pBuffer. Returns false
+     *  (and releases pBuffer) if the queue is full. Safe to call from
+     *  interrupt handlers.
+     *  \param bIp The packet is a bare IP packet, without a link header. */
+    bool push(NetworkBuffer *pBuffer, Network *pCard, bool bIp = false);
+
+    /** Number of packets dropped because the queue was full. */
+    size_t getDropped() const
+    {
+      return m_nDropped;
+    }
+
+    /** Chooses a queue for a frame, by hashing the addresses and ports of
+     *  the IPv4 or IPv6 packet inside it. Packets of the same flow (and
+     *  fragments of the same datagram) always get the same queue, so they
+     *  stay in order. Anything else goes to the first queue.
+     *  \param bIp The packet is a bare IP packet, without a link header. */
+    static size_t choose(NetworkBuffer *pBuffer, size_t nQueues, bool bIp = false);
+
+  private:
+    RxQueue(const RxQueue &);
+    RxQueue &operator = (const RxQueue &);
+
+    static int trampoline(void *p);
+    int work();
+
+    struct Packet
+    {
+      NetworkBuffer *pBuffer;
+      Network *pCard;
+      bool bIp;
+    };
+
+    /** A TCP segment held back for those after it to be merged in. */
+    struct Held
+    {
+      Packet packet;
+      TcpOffload::Segment segment;
+    };
+
+    /** Merges p into a held segment of its flow, holds it, or (if it can't
+     *  be coalesced) passes it up straight away. */
+    void coalesce(Packet &p);
+
+    /** Passes a held segment up the stack. */
+    void flush(Held &held);
+
+    /** Passes every held segment up the stack. */
+    void flushAll();
+
+    /** Passes a packet up the stack, and releases it. */
+    void deliver(Packet &p);
+
+    /** Segments being coalesced, for the worker alone. */
+    Held m_Held[NETWORK_GRO_FLOWS];
+    size_t m_nHeld;
+
+    /** Ring of packets waiting to be processed. */
+    Packet m_Ring[NETWORK_RX_QUEUE_SIZE];
+    size_t m_Head;
+    size_t m_Count;
+
+    /** Protects the ring. */
+    Spinlock m_Lock;
+
+    /** Released to wake the worker, if it's asleep. */
+    Semaphore m_Wakeup;
+    bool m_bSleeping;
+
+    /** Tells the worker to exit. */
+    volatile bool m_bStop;
+
+    Thread *m_pThread;
+
+    size_t m_nDropped;
+};
+
+#endif
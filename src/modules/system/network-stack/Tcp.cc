@@ -33,6 +33,7 @@
 
 #include "Arp.h"
 #include "IpCommon.h"
+#include "NetworkStatistics.h"
 
 Tcp Tcp::tcpInstance;
 
@@ -44,8 +45,26 @@ Tcp::~Tcp()
 {
 }
 
-bool Tcp::send(IpAddress dest, uint16_t srcPort, uint16_t destPort, uint32_t seqNumber, uint32_t ackNumber, uint8_t flags, uint16_t window, size_t nBytes, uintptr_t payload)
+bool Tcp::send(IpAddress dest, uint16_t srcPort, uint16_t destPort, uint32_t seqNumber, uint32_t ackNumber, uint8_t flags, uint16_t window, size_t nBytes, uintptr_t payload, const uint8_t *pOptions, size_t nOptionBytes)
 {
+  PayloadPiece piece;
+  piece.payload = payload;
+  piece.nBytes = payload ? nBytes : 0;
+  return send(dest, srcPort, destPort, seqNumber, ackNumber, flags, window, &piece, 1, 0, pOptions, nOptionBytes);
+}
+
+bool Tcp::send(IpAddress dest, uint16_t srcPort, uint16_t destPort, uint32_t seqNumber, uint32_t ackNumber, uint8_t flags, uint16_t window, const PayloadPiece *pPieces, size_t nPieces, size_t segmentSize, const uint8_t *pOptions, size_t nOptionBytes)
+{
+  // 1460 byte MSS, for a SYN without options of its own
+  static const uint8_t defaultSynOptions[4] = {OPT_MSS, 4, 0x05, 0xb4};
+  if(!pOptions && (flags & Tcp::SYN))
+  {
+    pOptions = defaultSynOptions;
+    nOptionBytes = sizeof defaultSynOptions;
+  }
+  if(!pOptions || (nOptionBytes > TCP_MAX_OPTIONS_LENGTH) || (nOptionBytes % 4))
+    nOptionBytes = 0;
+
   // IP base for all operations here.
   IpBase *pIp = &Ipv4::instance();
   if(dest.getType() == IpAddress::IPv6)
@@ -95,52 +114,177 @@ bool Tcp::send(IpAddress dest, uint16_t srcPort, uint16_t destPort, uint32_t seq
     }
   }
 
-  // Allocate a packet to send
-  uintptr_t packet = NetworkStack::instance().getMemPool().allocate();
+  size_t nBytes = 0;
+  for(size_t i = 0; i < nPieces; ++i)
+    nBytes += pPieces[i].nBytes;
+  if(nBytes <= segmentSize)
+    segmentSize = 0;
+
+  // Allocate a packet to send, with room in front for all the headers
+  NetworkBuffer *pBuffer = NetworkStack::instance().allocateBuffer(nBytes);
+
+  // Loopback segments never leave memory, so aren't worth checksumming.
+  // Nor are those to be segmented, as each segment gets its own checksum.
+  bool bLoopback = NetworkStack::instance().isLoopback(pCard);
+  bool bChecksum = !bLoopback && !segmentSize;
+
+  // Inject the payload, summing it for the checksum as it goes
+  Checksum payloadSum;
+  for(size_t i = 0; i < nPieces; ++i)
+  {
+    if(!pPieces[i].nBytes)
+      continue;
+
+    void *pDest = pBuffer->put(pPieces[i].nBytes);
+    if(bChecksum)
+      payloadSum.copyAndAdd(pDest, reinterpret_cast<void*>(pPieces[i].payload), pPieces[i].nBytes);
+    else
+      memcpy(pDest, reinterpret_cast<void*>(pPieces[i].payload), pPieces[i].nBytes);
+  }
+
+  size_t payloadOffset = sizeof(tcpHeader) + nOptionBytes;
 
   // Create TCP header
-  uintptr_t tcpPacket = packet;
-  tcpHeader* header = reinterpret_cast<tcpHeader*>(tcpPacket);
+  tcpHeader* header = reinterpret_cast<tcpHeader*>(pBuffer->push(payloadOffset));
+  uintptr_t tcpPacket = reinterpret_cast<uintptr_t>(header);
   header->src_port = HOST_TO_BIG16(srcPort);
   header->dest_port = HOST_TO_BIG16(destPort);
   header->seqnum = HOST_TO_BIG32(seqNumber);
   header->acknum = HOST_TO_BIG32(ackNumber);
-  header->offset = sizeof(tcpHeader) / 4;
-  if(flags & Tcp::SYN)
-    header->offset += 1;
+  header->offset = payloadOffset / 4;
 
   header->rsvd = 0;
   header->flags = flags;
   header->winsize = HOST_TO_BIG16(window);
   header->urgptr = 0;
 
-  size_t payloadOffset = sizeof(tcpHeader);
-  if(flags & Tcp::SYN)
+  if(nOptionBytes)
+    memcpy(reinterpret_cast<void*>(tcpPacket + sizeof(tcpHeader)), pOptions, nOptionBytes);
+
+  header->checksum = 0;
+
+  if(bChecksum)
   {
-    // 1460 byte MSS
-    unsigned char mss[4] = {0x02, 0x04, 0x05, 0xb4};
-    memcpy(reinterpret_cast<void*>(tcpPacket + payloadOffset), mss, sizeof mss);
-    payloadOffset += 4;
+    Checksum sum;
+    pIp->addPseudoHeader(sum, src, dest, IP_TCP, nBytes + payloadOffset);
+    sum.add(header, payloadOffset);
+    sum.add(payloadSum);
+    header->checksum = sum.finish();
+  }
+  else if(segmentSize && !bLoopback)
+  {
+    // Cards that segment for themselves start from the pseudo-header
+    // without its length, which differs for each segment.
+    Checksum sum;
+    pIp->addPseudoHeader(sum, src, dest, IP_TCP, 0);
+    header->checksum = sum.fold();
   }
 
-  // Inject the payload
-  if(payload && nBytes)
-    memcpy(reinterpret_cast<void*>(tcpPacket + payloadOffset), reinterpret_cast<void*>(payload), nBytes);
-
-  header->checksum = 0;
-  header->checksum = pIp->ipChecksum(src, dest, IP_TCP, tcpPacket, nBytes + payloadOffset);
+  if(segmentSize)
+  {
+    pBuffer->setSegmentSize(segmentSize);
+    NETSTAT_ADD(TcpOutSegs, (nBytes + segmentSize - 1) / segmentSize);
+  }
+  else
+    NETSTAT_INC(TcpOutSegs);
+  if(flags & RST)
+    NETSTAT_INC(TcpOutRsts);
 
   // Transmit
-  bool success = pIp->send(dest, src, IP_TCP, nBytes + payloadOffset, packet, pCard);
+  bool success = pIp->send(dest, src, IP_TCP, pBuffer, pCard);
 
   // Free the created packet
-  NetworkStack::instance().getMemPool().free(packet);
+  pBuffer->release();
 
   // All done.
   return success;
 }
 
-void Tcp::receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes, IpBase *pIp, Network* pCard)
+/// Reads a big-endian 32-bit option field, which needn't be aligned.
+static inline uint32_t optionWord(const uint8_t *p)
+{
+  uint32_t x;
+  memcpy(&x, p, sizeof x);
+  return BIG_TO_HOST32(x);
+}
+
+void Tcp::parseOptions(const tcpHeader *header, TcpOptions &options)
+{
+  const uint8_t *opts = reinterpret_cast<const uint8_t *>(header) + sizeof(tcpHeader);
+  size_t nBytes = (header->offset * 4);
+  if(nBytes <= sizeof(tcpHeader))
+    return;
+  nBytes -= sizeof(tcpHeader);
+
+  size_t offset = 0;
+  while(offset < nBytes)
+  {
+    uint8_t code = opts[offset];
+    if(code == OPT_END)
+      break;
+    if(code == OPT_NOP)
+    {
+      ++offset;
+      continue;
+    }
+
+    // Everything else has a length, which includes the code and itself.
+    if((offset + 1) >= nBytes)
+      break;
+    uint8_t len = opts[offset + 1];
+    if((len < 2) || ((offset + len) > nBytes))
+      break;
+
+    const uint8_t *data = &opts[offset + 2];
+    switch(code)
+    {
+      case OPT_MSS:
+        if(len == 4)
+          options.mss = (data[0] << 8) | data[1];
+        break;
+
+      case OPT_WSS:
+        if(len == 3)
+        {
+          // RFC 7323 section 2.3: anything over 14 is treated as 14.
+          options.windowScale = data[0] > 14 ? 14 : data[0];
+          options.bWindowScale = true;
+        }
+        break;
+
+      case OPT_SACK_PERMITTED:
+        if(len == 2)
+          options.bSackPermitted = true;
+        break;
+
+      case OPT_SACK:
+        for(size_t i = 2; ((i + 8) <= len) && (options.nSackBlocks < TCP_MAX_SACK_BLOCKS); i += 8)
+        {
+          const uint8_t *block = &opts[offset + i];
+          options.sackLeft[options.nSackBlocks] = optionWord(block);
+          options.sackRight[options.nSackBlocks] = optionWord(block + 4);
+          ++options.nSackBlocks;
+        }
+        break;
+
+      case OPT_TMSTAMP:
+        if(len == 10)
+        {
+          options.tsVal = optionWord(data);
+          options.tsEcr = optionWord(data + 4);
+          options.bTimestamp = true;
+        }
+        break;
+
+      default:
+        break;
+    }
+
+    offset += len;
+  }
+}
+
+void Tcp::receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes, IpBase *pIp, Network* pCard, NetworkBuffer *pBuffer)
 {
   if(!packet || !nBytes)
       return;
@@ -152,10 +296,16 @@ void Tcp::receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes,
     return;
   }
 
+  NETSTAT_INC(TcpInSegs);
+
+  // Everything on loopback was sent by us, to one of our own addresses.
+  bool bLoopback = NetworkStack::instance().isLoopback(pCard);
+
   // check if this packet is for us, or if it's a broadcast
   /// \todo IPv6
   StationInfo cardInfo = pCard->getStationInfo();
-  if(from.getType() == IpAddress::IPv4 &&
+  if(!bLoopback &&
+     from.getType() == IpAddress::IPv4 &&
      cardInfo.ipv4 != to &&
      to.getIp() != 0xffffffff &&
      cardInfo.broadcast != to)
@@ -177,20 +327,29 @@ void Tcp::receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes,
   uintptr_t payload = reinterpret_cast<uintptr_t>(header) + headerSize; // offset is in DWORDs
   size_t payloadSize = nBytes - headerSize;
 
-  // check the checksum, if it's not zero
-  if(header->checksum != 0)
+  // Segments coalesced on the way in count as those they were made from.
+  if(pBuffer && pBuffer->getSegmentSize() && payloadSize)
+    NETSTAT_ADD(TcpInSegs, (payloadSize - 1) / pBuffer->getSegmentSize());
+
+  // check the checksum, if it's not zero - segments over loopback don't have
+  // one, and coalesced segments were checked before they were put together
+  bool bChecked = bLoopback || (pBuffer && pBuffer->isChecksumValid());
+  if(!bChecked && (header->checksum != 0))
   {
     uint16_t checksum = pIp->ipChecksum(from, to, IP_TCP, reinterpret_cast<uintptr_t>(header), nBytes);
     if(checksum)
     {
       WARNING("TCP Checksum failed on incoming packet [dp=" << Dec << BIG_TO_HOST16(header->dest_port) << Hex << "]. Header checksum is " << header->checksum << ", calculated should be zero but is " << checksum << "!");
+      NETSTAT_INC(TcpInErrs);
+      NETSTAT_INC(TcpInCsumErrors);
       pCard->badPacket();
       return;
     }
   }
-  else
+  else if(!bChecked)
   {
       WARNING("TCP Packet arrived on port " << Dec << BIG_TO_HOST16(header->dest_port) << Hex << " without a checksum.");
+      NETSTAT_INC(TcpInErrs);
       pCard->badPacket();
       return; // must have a checksum
   }
@@ -29,6 +29,12 @@
 
 #include "IpCommon.h"
 
+/// Most bytes of options a TCP header can carry.
+#define TCP_MAX_OPTIONS_LENGTH  40
+
+/// Most SACK blocks a segment can carry (fewer fit with timestamps).
+#define TCP_MAX_SACK_BLOCKS     4
+
 /**
  * The Pedigree network stack - TCP layer
  */
@@ -79,10 +85,42 @@ public:
     uint16_t  urgptr;
   } __attribute__ ((packed));
 
-  /** Packet arrival callback */
-  void receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes, IpBase *pIp, Network* pCard);
+  /** Packet arrival callback
+   * \param pBuffer The buffer holding the packet, if there is one. */
+  void receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes, IpBase *pIp, Network* pCard, NetworkBuffer *pBuffer = 0);
+
+  /** Options found in a segment's header. */
+  struct TcpOptions
+  {
+    TcpOptions() :
+      mss(0), windowScale(0), bWindowScale(false), bSackPermitted(false),
+      bTimestamp(false), tsVal(0), tsEcr(0), nSackBlocks(0)
+    {};
+
+    /// Maximum segment size, or zero if none was given.
+    uint16_t mss;
+
+    /// Window scale shift (RFC 7323), if bWindowScale is set.
+    uint8_t windowScale;
+    bool bWindowScale;
+
+    /// SACK may be used on this connection (RFC 2018).
+    bool bSackPermitted;
+
+    /// Timestamps (RFC 7323), if bTimestamp is set.
+    bool bTimestamp;
+    uint32_t tsVal;
+    uint32_t tsEcr;
 
-  /** Sends a TCP packet */
+    /// SACK blocks - each covers [sackLeft, sackRight).
+    size_t nSackBlocks;
+    uint32_t sackLeft[TCP_MAX_SACK_BLOCKS];
+    uint32_t sackRight[TCP_MAX_SACK_BLOCKS];
+  };
+
+  /** Sends a TCP packet
+   * \param pOptions Options for the header, padded to a multiple of four
+   *                 bytes. If null, a SYN gets a default MSS option. */
   static bool send(IpAddress dest,
                    uint16_t srcPort,
                    uint16_t destPort,
@@ -91,7 +129,57 @@ public:
                    uint8_t flags,
                    uint16_t window,
                    size_t nBytes,
-                   uintptr_t payload);
+                   uintptr_t payload,
+                   const uint8_t *pOptions = 0,
+                   size_t nOptionBytes = 0);
+
+  /** Part of a payload gathered from several places. */
+  struct PayloadPiece
+  {
+    uintptr_t payload;
+    size_t nBytes;
+  };
+
+  /** Sends a TCP packet whose payload is gathered from several pieces.
+   * \param segmentSize If non-zero, and the payload is bigger than this, the
+   *                    packet goes through the stack whole and is split into
+   *                    segments of this much payload on the way out. Each
+   *                    one has the same header but for its sequence number,
+   *                    and only the last keeps PSH and FIN. */
+  static bool send(IpAddress dest,
+                   uint16_t srcPort,
+                   uint16_t destPort,
+                   uint32_t seqNumber,
+                   uint32_t ackNumber,
+                   uint8_t flags,
+                   uint16_t window,
+                   const PayloadPiece *pPieces,
+                   size_t nPieces,
+                   size_t segmentSize,
+                   const uint8_t *pOptions = 0,
+                   size_t nOptionBytes = 0);
+
+  /** Parses the options in a received header. Malformed options end the
+   *  parse; whatever was found up to that point is kept. */
+  static void parseOptions(const tcpHeader *header, TcpOptions &options);
+
+  /** Sequence number comparisons, modulo 2^32 (RFC 793 section 3.3). */
+  static inline bool seqLess(uint32_t a, uint32_t b)
+  {
+    return static_cast<int32_t>(a - b) < 0;
+  }
+  static inline bool seqLessEqual(uint32_t a, uint32_t b)
+  {
+    return static_cast<int32_t>(a - b) <= 0;
+  }
+  static inline bool seqGreater(uint32_t a, uint32_t b)
+  {
+    return static_cast<int32_t>(a - b) > 0;
+  }
+  static inline bool seqGreaterEqual(uint32_t a, uint32_t b)
+  {
+    return static_cast<int32_t>(a - b) >= 0;
+  }
 
   /** Calculates a TCP checksum */
   uint16_t tcpChecksum(IpAddress srcip, IpAddress destip, tcpHeader* data, uint16_t len);
@@ -112,11 +200,12 @@ public:
   enum TcpOption
   {
     OPT_END = 0,
-    OPT_NOP,
-    OPT_MSS,
-    OPT_WSS,
-    OPT_SACK,
-    OPT_TMSTAMP
+    OPT_NOP = 1,
+    OPT_MSS = 2,
+    OPT_WSS = 3,
+    OPT_SACK_PERMITTED = 4,
+    OPT_SACK = 5,
+    OPT_TMSTAMP = 8
   };
 
   enum TcpState
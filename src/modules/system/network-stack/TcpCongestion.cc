@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "TcpCongestion.h"
+
+/// Keeps window arithmetic well away from overflowing 32 bits.
+#define MAX_CWND            0x3FFFFFFFU
+
+/// "Arbitrarily high" initial slow start threshold.
+#define INITIAL_SSTHRESH    0x7FFFFFFFU
+
+TcpCongestionControl::Algorithm TcpCongestionControl::m_DefaultAlgorithm = TcpCongestionControl::Cubic;
+
+TcpCongestionControl *TcpCongestionControl::create(uint32_t mss)
+{
+  if(m_DefaultAlgorithm == NewReno)
+    return new NewRenoCongestionControl(mss);
+  return new CubicCongestionControl(mss);
+}
+
+TcpCongestionControl::TcpCongestionControl(uint32_t mss) :
+  m_Cwnd(initialWindow(mss)), m_Ssthresh(INITIAL_SSTHRESH), m_Mss(mss),
+  m_BytesAcked(0), m_bStarted(false)
+{
+}
+
+uint32_t TcpCongestionControl::initialWindow(uint32_t mss)
+{
+  // min(10 * MSS, max(2 * MSS, 14600))
+  uint32_t window = 14600;
+  if(window < (2 * mss))
+    window = 2 * mss;
+  if(window > (10 * mss))
+    window = 10 * mss;
+  return window;
+}
+
+void TcpCongestionControl::setMss(uint32_t mss)
+{
+  if(!mss)
+    return;
+
+  m_Mss = mss;
+  if(!m_bStarted)
+    m_Cwnd = initialWindow(mss);
+}
+
+void TcpCongestionControl::acked(uint32_t nBytes, uint32_t rtt, uint64_t now)
+{
+  if(!nBytes)
+    return;
+  m_bStarted = true;
+
+  if(inSlowStart())
+  {
+    // Appropriate byte counting with L = 2 (RFC 3465), so a receiver that
+    // delays its ACKs doesn't halve our growth.
+    uint32_t increase = nBytes;
+    if(increase > (2 * m_Mss))
+      increase = 2 * m_Mss;
+    m_Cwnd += increase;
+  }
+  else
+    congestionAvoidance(nBytes, rtt, now);
+
+  if(m_Cwnd > MAX_CWND)
+    m_Cwnd = MAX_CWND;
+}
+
+void TcpCongestionControl::enterRecovery(uint32_t flightSize, uint64_t now)
+{
+  m_Ssthresh = lossThreshold(flightSize, now);
+  m_Cwnd = m_Ssthresh + (3 * m_Mss);
+  m_BytesAcked = 0;
+}
+
+void TcpCongestionControl::recoveryDupAck()
+{
+  if(m_Cwnd < MAX_CWND)
+    m_Cwnd += m_Mss;
+}
+
+void TcpCongestionControl::partialAck(uint32_t nBytes)
+{
+  // Deflate by the amount acked, then add back one segment for the
+  // retransmission that's about to go out (RFC 6582 section 3.2 step 5).
+  if(nBytes < m_Cwnd)
+    m_Cwnd -= nBytes;
+  else
+    m_Cwnd = 0;
+  if(nBytes >= m_Mss)
+    m_Cwnd += m_Mss;
+  if(m_Cwnd < m_Mss)
+    m_Cwnd = m_Mss;
+}
+
+void TcpCongestionControl::exitRecovery(uint32_t flightSize)
+{
+  // min(ssthresh, max(FlightSize, SMSS) + SMSS)
+  if(flightSize < m_Mss)
+    flightSize = m_Mss;
+  m_Cwnd = flightSize + m_Mss;
+  if(m_Cwnd > m_Ssthresh)
+    m_Cwnd = m_Ssthresh;
+  m_BytesAcked = 0;
+}
+
+void TcpCongestionControl::timeout(uint32_t flightSize, bool bFirst, uint64_t now)
+{
+  if(bFirst)
+    m_Ssthresh = lossThreshold(flightSize, now);
+
+  // Loss window of one segment.
+  m_Cwnd = m_Mss;
+  m_BytesAcked = 0;
+}
+
+void NewRenoCongestionControl::congestionAvoidance(uint32_t nBytes, uint32_t rtt, uint64_t now)
+{
+  // One segment per window's worth of data acked (RFC 5681 section 3.1).
+  m_BytesAcked += nBytes;
+  if(m_BytesAcked >= m_Cwnd)
+  {
+    m_BytesAcked -= m_Cwnd;
+    m_Cwnd += m_Mss;
+  }
+}
+
+uint32_t NewRenoCongestionControl::lossThreshold(uint32_t flightSize, uint64_t now)
+{
+  uint32_t threshold = flightSize / 2;
+  if(threshold < (2 * m_Mss))
+    threshold = 2 * m_Mss;
+  return threshold;
+}
+
+/** Integer cube root, rounded down. */
+static uint64_t cubeRoot(uint64_t x)
+{
+  uint64_t y = 0;
+  for(int s = 63; s >= 0; s -= 3)
+  {
+    y <<= 1;
+    uint64_t b = (3 * y * (y + 1)) + 1;
+    if((x >> s) >= b)
+    {
+      x -= b << s;
+      ++y;
+    }
+  }
+  return y;
+}
+
+void CubicCongestionControl::congestionAvoidance(uint32_t nBytes, uint32_t rtt, uint64_t now)
+{
+  if(!m_EpochStart)
+  {
+    // First ACK since a loss (or since leaving slow start): start the curve.
+    m_EpochStart = now ? now : 1;
+    m_BytesAcked = 0;
+    m_WEst = m_Cwnd;
+    if(m_Cwnd < m_WMax)
+    {
+      // K = cbrt((W_max - cwnd) / C) seconds, with the difference in
+      // segments and C = 0.4; here in milliseconds.
+      uint64_t diff = m_WMax - m_Cwnd;
+      m_K = cubeRoot((diff * 2500000000ULL) / m_Mss);
+      m_Origin = m_WMax;
+    }
+    else
+    {
+      m_K = 0;
+      m_Origin = m_Cwnd;
+    }
+  }
+
+  // Where the curve will be one round trip from now.
+  int64_t t = static_cast<int64_t>(now - m_EpochStart) + rtt;
+  int64_t dt = t - static_cast<int64_t>(m_K);
+  if(dt > 1000000)
+    dt = 1000000;
+  else if(dt < -1000000)
+    dt = -1000000;
+
+  // C * (dt / 1000)^3 segments, in bytes.
+  int64_t offset = ((dt * dt * dt) / 1000000) * 4 * static_cast<int64_t>(m_Mss) / 10000;
+  int64_t target = static_cast<int64_t>(m_Origin) + offset;
+  if(target < 0)
+    target = 0;
+
+  // Reno's window, growing by 3(1 - beta)/(1 + beta) = 9/17 of a segment
+  // per window acked.
+  m_WEst += (static_cast<uint64_t>(nBytes) * 9 * m_Mss) / (17 * static_cast<uint64_t>(m_Cwnd));
+  if(static_cast<int64_t>(m_WEst) > target)
+    target = m_WEst;
+
+  // Don't grow by more than half a window per round trip.
+  int64_t limit = static_cast<int64_t>(m_Cwnd) + (m_Cwnd / 2);
+  if(target > limit)
+    target = limit;
+
+  if(target > static_cast<int64_t>(m_Cwnd))
+  {
+    uint64_t increase = ((target - m_Cwnd) * static_cast<uint64_t>(nBytes)) / m_Cwnd;
+    m_Cwnd += increase ? increase : 1;
+  }
+  else
+  {
+    // At (or above) the plateau - creep up by a segment every hundred
+    // windows, to probe for more bandwidth.
+    m_BytesAcked += nBytes;
+    if(m_BytesAcked >= (100 * static_cast<uint64_t>(m_Cwnd)))
+    {
+      m_BytesAcked = 0;
+      m_Cwnd += m_Mss;
+    }
+  }
+}
+
+uint32_t CubicCongestionControl::lossThreshold(uint32_t flightSize, uint64_t now)
+{
+  m_EpochStart = 0;
+
+  // Fast convergence: if we're losing below the last plateau, another flow
+  // probably wants the bandwidth, so give some up.
+  if(m_Cwnd < m_WLastMax)
+  {
+    m_WLastMax = m_Cwnd;
+    m_WMax = (static_cast<uint64_t>(m_Cwnd) * 17) / 20;
+  }
+  else
+  {
+    m_WLastMax = m_Cwnd;
+    m_WMax = m_Cwnd;
+  }
+
+  // beta = 0.7
+  uint32_t threshold = (static_cast<uint64_t>(m_Cwnd) * 7) / 10;
+  if(threshold < (2 * m_Mss))
+    threshold = 2 * m_Mss;
+  return threshold;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MACHINE_TCPCONGESTION_H
+#define MACHINE_TCPCONGESTION_H
+
+#include <processor/types.h>
+
+/**
+ * Congestion window management for one TCP connection.
+ *
+ * The parts every algorithm shares - slow start (RFC 5681), and the window
+ * changes around fast retransmit and NewReno fast recovery (RFC 6582) - live
+ * here. Subclasses decide how the window grows in congestion avoidance, and
+ * what the slow start threshold drops to after a loss.
+ *
+ * All windows are in bytes, and times in milliseconds.
+ */
+class TcpCongestionControl
+{
+  public:
+    enum Algorithm
+    {
+      NewReno = 0,
+      Cubic
+    };
+
+    /** Creates the chosen algorithm's controller for a new connection. */
+    static TcpCongestionControl *create(uint32_t mss);
+
+    /** Chooses the algorithm for connections created from now on. */
+    static void setDefault(Algorithm algorithm)
+    {
+      m_DefaultAlgorithm = algorithm;
+    }
+
+    static Algorithm getDefault()
+    {
+      return m_DefaultAlgorithm;
+    }
+
+    virtual ~TcpCongestionControl()
+    {};
+
+    virtual const char *getName() const = 0;
+
+    /** The congestion window. */
+    inline uint32_t getWindow() const
+    {
+      return m_Cwnd;
+    }
+
+    /** The slow start threshold. */
+    inline uint32_t getSlowStartThreshold() const
+    {
+      return m_Ssthresh;
+    }
+
+    inline bool inSlowStart() const
+    {
+      return m_Cwnd < m_Ssthresh;
+    }
+
+    /** Sets the segment size once it's been negotiated. Before any data has
+     *  been acked this also resets the initial window to match. */
+    void setMss(uint32_t mss);
+
+    /** New data was acked, outside of fast recovery.
+     *  \param rtt Smoothed round trip time, or zero if not known yet. */
+    void acked(uint32_t nBytes, uint32_t rtt, uint64_t now);
+
+    /** The third duplicate ACK arrived: fast retransmit, into fast recovery. */
+    void enterRecovery(uint32_t flightSize, uint64_t now);
+
+    /** A further duplicate ACK during fast recovery. */
+    void recoveryDupAck();
+
+    /** An ACK during fast recovery that didn't cover everything outstanding
+     *  when recovery started. */
+    void partialAck(uint32_t nBytes);
+
+    /** Everything outstanding when recovery started has been acked. */
+    void exitRecovery(uint32_t flightSize);
+
+    /** The retransmission timer expired.
+     *  \param bFirst Was this the first expiry for this segment? The
+     *                threshold is only lowered once (RFC 5681 section 3.1). */
+    void timeout(uint32_t flightSize, bool bFirst, uint64_t now);
+
+  protected:
+    TcpCongestionControl(uint32_t mss);
+
+    /** Grows m_Cwnd on an ACK of nBytes in congestion avoidance. */
+    virtual void congestionAvoidance(uint32_t nBytes, uint32_t rtt, uint64_t now) = 0;
+
+    /** Returns the new slow start threshold after a loss. */
+    virtual uint32_t lossThreshold(uint32_t flightSize, uint64_t now) = 0;
+
+    /** RFC 6928 initial window. */
+    static uint32_t initialWindow(uint32_t mss);
+
+    uint32_t m_Cwnd;
+    uint32_t m_Ssthresh;
+    uint32_t m_Mss;
+
+    /** Bytes acked since the window last grew in congestion avoidance. */
+    uint32_t m_BytesAcked;
+
+    /** Has any data been acked yet? */
+    bool m_bStarted;
+
+  private:
+    TcpCongestionControl(const TcpCongestionControl &);
+    TcpCongestionControl &operator = (const TcpCongestionControl &);
+
+    static Algorithm m_DefaultAlgorithm;
+};
+
+/** RFC 5681 congestion avoidance: one segment per window of data acked, and
+ *  half the flight size after a loss. */
+class NewRenoCongestionControl : public TcpCongestionControl
+{
+  public:
+    NewRenoCongestionControl(uint32_t mss) : TcpCongestionControl(mss)
+    {};
+    virtual ~NewRenoCongestionControl()
+    {};
+
+    virtual const char *getName() const
+    {
+      return "newreno";
+    }
+
+  protected:
+    virtual void congestionAvoidance(uint32_t nBytes, uint32_t rtt, uint64_t now);
+    virtual uint32_t lossThreshold(uint32_t flightSize, uint64_t now);
+};
+
+/**
+ * CUBIC (RFC 8312). After a loss the window follows a cubic curve in time
+ * since the loss, centred on the window at which it happened, so it grows
+ * back quickly on long fat paths regardless of the round trip time. It never
+ * grows slower than Reno would (the "TCP-friendly" region).
+ *
+ * The kernel has no floating point, so everything is done in integers:
+ * C = 0.4 and beta = 0.7 appear as fractions.
+ */
+class CubicCongestionControl : public TcpCongestionControl
+{
+  public:
+    CubicCongestionControl(uint32_t mss) :
+      TcpCongestionControl(mss), m_WMax(0), m_WLastMax(0), m_Origin(0),
+      m_K(0), m_EpochStart(0), m_WEst(0)
+    {};
+    virtual ~CubicCongestionControl()
+    {};
+
+    virtual const char *getName() const
+    {
+      return "cubic";
+    }
+
+  protected:
+    virtual void congestionAvoidance(uint32_t nBytes, uint32_t rtt, uint64_t now);
+    virtual uint32_t lossThreshold(uint32_t flightSize, uint64_t now);
+
+  private:
+    /** Window (bytes) when the last loss happened. */
+    uint32_t m_WMax;
+    /** m_WMax before the last loss, for fast convergence. */
+    uint32_t m_WLastMax;
+    /** Window the current curve plateaus at. */
+    uint32_t m_Origin;
+    /** Time from the start of the epoch to the plateau, in ms. */
+    uint64_t m_K;
+    /** When the current congestion avoidance epoch began, or zero. */
+    uint64_t m_EpochStart;
+    /** What Reno's window would be by now, in bytes. */
+    uint64_t m_WEst;
+};
+
+#endif
@@ -50,11 +50,11 @@ Endpoint* TcpEndpoint::accept()
     return e;
 }
 
-void TcpEndpoint::listen()
+void TcpEndpoint::listen(size_t backlog)
 {
     /// \todo Interface-specific connections
     m_IncomingConnections.clear();
-    m_ConnId = TcpManager::instance().Listen(this, getLocalPort());
+    m_ConnId = TcpManager::instance().Listen(this, getLocalPort(), 0, backlog);
 }
 
 bool TcpEndpoint::connect(Endpoint::RemoteEndpoint remoteHost, bool bBlock)
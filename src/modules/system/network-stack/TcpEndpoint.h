@@ -91,7 +91,7 @@ class TcpEndpoint : public ConnectionBasedEndpoint
     virtual void close();
 
     virtual Endpoint* accept();
-    virtual void listen();
+    virtual void listen(size_t backlog = 0);
 
     virtual void setRemoteHost(Endpoint::RemoteEndpoint host)
     {
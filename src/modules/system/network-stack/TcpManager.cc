@@ -19,12 +19,22 @@
 
 #include "TcpManager.h"
 #include "RoutingTable.h"
+#include "NetworkStatistics.h"
 #include <Log.h>
 #include <processor/Processor.h>
+#include "NetworkStack.h"
+#include <utilities/utility.h>
 
 TcpManager TcpManager::manager;
 
-size_t TcpManager::Listen(Endpoint* e, uint16_t port, Network* pCard)
+/// SYN cookies carry the MSS as an index into this table.
+static const uint16_t g_SynCookieMss[] = {216, 536, 1024, 1200, 1280, 1400, 1440, 1460};
+
+/// The counter in a SYN cookie ticks every 2^16 ms (about a minute), and a
+/// cookie is good for the tick it was sent in and the one after.
+#define SYN_COOKIE_PERIOD_SHIFT 16
+
+size_t TcpManager::Listen(Endpoint* e, uint16_t port, Network* pCard, size_t backlog)
 {
   // all callers should have chosen a card based on their bound address
   if(!pCard)
@@ -43,7 +53,7 @@ size_t TcpManager::Listen(Endpoint* e, uint16_t port, Network* pCard)
   StateBlock* stateBlock;
   {
     LockGuard<Mutex> guard(m_TcpMutex);
-    if((stateBlock = m_StateBlocks.lookup(*handle)) != 0)
+    if((stateBlock = m_ListeningStateBlocks.lookup(*handle)) != 0)
     {
       delete handle;
       return 0;
@@ -60,6 +70,12 @@ size_t TcpManager::Listen(Endpoint* e, uint16_t port, Network* pCard)
     return 0;
   }
 
+  if(!backlog)
+    backlog = TCP_DEFAULT_BACKLOG;
+  else if(backlog > TCP_MAX_BACKLOG)
+    backlog = TCP_MAX_BACKLOG;
+  stateBlock->backlog = backlog;
+
   stateBlock->localPort = port;
   stateBlock->remoteHost = handle->remoteHost;
 
@@ -141,19 +157,20 @@ size_t TcpManager::Connect(Endpoint::RemoteEndpoint remoteHost, uint16_t localPo
   stateBlock->connId = connId;
 
   stateBlock->iss = getNextSequenceNumber();
-  stateBlock->snd_nxt = stateBlock->iss + 1;
-  stateBlock->snd_una = stateBlock->iss;
-  stateBlock->snd_wnd = endpoint->m_ShadowDataStream.getSize();
+  stateBlock->rcv_wnd = endpoint->m_ShadowDataStream.getSize();
   stateBlock->snd_up = 0;
   stateBlock->snd_wl1 = stateBlock->snd_wl2 = 0;
 
   stateBlock->currentState = Tcp::SYN_SENT;
+  NETSTAT_INC(TcpActiveOpens);
 
   stateBlock->endpoint = endpoint;
 
   stateBlock->numEndpointPackets = 0;
 
-  stateBlock->tcp_mss = 1460; /// \todo Base this on the MTU of the link, or PMTU Discovery.
+  stateBlock->offerOptions();
+  stateBlock->tcp_mss = stateBlock->local_mss; /// \todo PMTU Discovery.
+  stateBlock->congestion->setMss(stateBlock->tcp_mss);
 
   {
     LockGuard<Mutex> guard(m_TcpMutex);
@@ -161,7 +178,7 @@ size_t TcpManager::Connect(Endpoint::RemoteEndpoint remoteHost, uint16_t localPo
     m_CurrentConnections.insert(connId, handle);
   }
 
-  Tcp::send(stateBlock->remoteHost.ip, stateBlock->localPort, stateBlock->remoteHost.remotePort, stateBlock->iss, 0, Tcp::SYN, stateBlock->snd_wnd, 0, 0);
+  stateBlock->sendSyn(false);
 
   if(!bBlock)
     return connId; // connection in progress - assume it works
@@ -202,22 +219,16 @@ void TcpManager::Shutdown(size_t connectionId, bool bOnlyStopReceive)
   /** ESTABLISHED: No FIN received - send our own **/
   if(stateBlock->currentState == Tcp::ESTABLISHED)
   {
-    stateBlock->fin_seq = stateBlock->snd_nxt;
-
     stateBlock->currentState = Tcp::FIN_WAIT_1;
     stateBlock->seg_wnd = 0;
-    stateBlock->sendSegment(Tcp::FIN | Tcp::ACK, 0, 0, true);
-    stateBlock->snd_nxt++;
+    stateBlock->sendFin();
   }
   /** CLOSE_WAIT: FIN received - reply **/
   else if(stateBlock->currentState == Tcp::CLOSE_WAIT)
   {
-    stateBlock->fin_seq = stateBlock->snd_nxt;
-
     stateBlock->currentState = Tcp::LAST_ACK;
     stateBlock->seg_wnd = 0;
-    stateBlock->sendSegment(Tcp::FIN | Tcp::ACK, 0, 0, true);
-    stateBlock->snd_nxt++;
+    stateBlock->sendFin();
   }
 }
 
@@ -239,22 +250,16 @@ void TcpManager::Disconnect(size_t connectionId)
   // no FIN received yet
   if(stateBlock->currentState == Tcp::ESTABLISHED)
   {
-    stateBlock->fin_seq = stateBlock->snd_nxt;
-
     stateBlock->currentState = Tcp::FIN_WAIT_1;
     stateBlock->seg_wnd = 0;
-    stateBlock->sendSegment(Tcp::FIN | Tcp::ACK, 0, 0, true);
-    stateBlock->snd_nxt++;
+    stateBlock->sendFin();
   }
   // received a FIN already
   else if(stateBlock->currentState == Tcp::CLOSE_WAIT)
   {
-    stateBlock->fin_seq = stateBlock->snd_nxt;
-
     stateBlock->currentState = Tcp::LAST_ACK;
     stateBlock->seg_wnd = 0;
-    stateBlock->sendSegment(Tcp::FIN | Tcp::ACK, 0, 0, true);
-    stateBlock->snd_nxt++;
+    stateBlock->sendFin();
   }
   // LISTEN socket closing
   else if(stateBlock->currentState == Tcp::LISTEN)
@@ -271,7 +276,7 @@ void TcpManager::Disconnect(size_t connectionId)
   {
     // Sent SYN but need to close now. Possible on non-blocking sockets.
     // Send an RST to ensure we don't get a late SYN/ACK and close.
-    stateBlock->sendSegment(Tcp::RST, 0, 0, true);
+    stateBlock->sendControl(Tcp::RST, stateBlock->snd_nxt);
     stateBlock->currentState = Tcp::CLOSED;
     removeConn(stateBlock->connId);
   }
@@ -311,6 +316,21 @@ int TcpManager::send(size_t connId, uintptr_t payload, bool push, size_t nBytes,
   return nBytes;
 }
 
+void TcpManager::setKeepalive(size_t connId, bool bEnable)
+{
+  LockGuard<Mutex> guard(m_TcpMutex);
+
+  StateBlockHandle* handle;
+  if((handle = m_CurrentConnections.lookup(connId)) == 0)
+    return;
+
+  StateBlock* stateBlock;
+  if((stateBlock = m_StateBlocks.lookup(*handle)) == 0)
+    return;
+
+  stateBlock->setKeepalive(bEnable);
+}
+
 void TcpManager::removeConn(size_t connId)
 {
   LockGuard<Mutex> guard(m_TcpMutex);
@@ -341,6 +361,8 @@ void TcpManager::removeConn(size_t connId)
     m_StateBlocks.remove(*handle);
   m_CurrentConnections.remove(connId);
 
+  leaveSynQueue(stateBlock);
+
   // destroy the state block (and its internals)
   stateBlock->waitState.release();
   delete stateBlock;
@@ -397,3 +419,182 @@ Endpoint* TcpManager::getEndpoint(uint16_t localPort, Network* pCard)
 
     return e;
 }
+
+StateBlock *TcpManager::findListener(uint16_t localPort)
+{
+  StateBlockHandle handle;
+  handle.localPort = localPort;
+  handle.listen = true;
+  return m_ListeningStateBlocks.lookup(handle);
+}
+
+bool TcpManager::acceptQueueFull(StateBlock *listener)
+{
+  TcpEndpoint *endpoint = listener->endpoint;
+  if(!endpoint)
+    return false;
+
+  LockGuard<Mutex> guard(endpoint->m_IncomingConnectionLock);
+  return endpoint->m_IncomingConnections.count() >= listener->backlog;
+}
+
+void TcpManager::leaveSynQueue(StateBlock *stateBlock)
+{
+  if(!stateBlock->inSynQueue)
+    return;
+  stateBlock->inSynQueue = false;
+
+  StateBlock *listener = findListener(stateBlock->localPort);
+  if(listener && listener->synQueueLength)
+    --listener->synQueueLength;
+}
+
+uint32_t TcpManager::synCookieHash(IpAddress &from, uint16_t localPort, uint16_t remotePort, uint32_t seq, uint32_t count)
+{
+  if(!m_CookieSecret)
+    m_CookieSecret = static_cast<uint32_t>(random_next()) | 1;
+
+  StateBlockHandle handle;
+  handle.localPort = localPort;
+  handle.remotePort = remotePort;
+  handle.remoteHost.ip = from;
+
+  uint32_t hash = handle.hash(m_CookieSecret);
+  hash = handle.hash(hash ^ seq);
+  hash = handle.hash(hash ^ count);
+  return hash & 0xFFFFFF;
+}
+
+void TcpManager::sendSynCookie(IpAddress &from, uint16_t localPort, uint16_t remotePort, uint32_t seq, uint32_t mss)
+{
+  // The largest MSS in the table that's no bigger than what was asked for.
+  uint32_t mssIndex = 0;
+  for(uint32_t i = 1; i < (sizeof(g_SynCookieMss) / sizeof(g_SynCookieMss[0])); ++i)
+  {
+    if(g_SynCookieMss[i] <= mss)
+      mssIndex = i;
+  }
+
+  // 5 bits of time, 3 of MSS, and 24 of hash.
+  uint64_t now = NetworkStack::getTickCount();
+  uint32_t count = (now >> SYN_COOKIE_PERIOD_SHIFT) & 0x1F;
+  uint32_t cookie = (count << 27) | (mssIndex << 24) | synCookieHash(from, localPort, remotePort, seq, count);
+
+  m_LastCookieSent = now ? now : 1;
+  ++m_nCookiesSent;
+
+  // No window scaling, SACK or timestamps: there's nowhere to remember them.
+  if(!Tcp::send(from, localPort, remotePort, cookie, seq + 1, Tcp::SYN | Tcp::ACK, TCP_BUFFER_SIZE > 0xFFFF ? 0xFFFF : TCP_BUFFER_SIZE, 0, 0))
+    WARNING("TCP: Sending SYN cookie failed");
+}
+
+StateBlock *TcpManager::acceptSynCookie(IpAddress &from, uint16_t localPort, uint16_t remotePort, StateBlock *listener)
+{
+  // Only worth checking if we've sent any cookies lately.
+  uint64_t now = NetworkStack::getTickCount();
+  if(!m_LastCookieSent || ((now - m_LastCookieSent) >> SYN_COOKIE_PERIOD_SHIFT) > 1)
+    return 0;
+
+  uint32_t cookie = listener->seg_ack - 1;
+  uint32_t seq = listener->seg_seq - 1;
+
+  uint32_t count = cookie >> 27;
+  uint32_t age = ((now >> SYN_COOKIE_PERIOD_SHIFT) - count) & 0x1F;
+  if(age > 1)
+    return 0;
+  if(synCookieHash(from, localPort, remotePort, seq, count) != (cookie & 0xFFFFFF))
+    return 0;
+
+  uint32_t mss = g_SynCookieMss[(cookie >> 24) & 0x7];
+
+  // Good cookie - the connection is established, build it from scratch.
+  size_t connId = getConnId();
+
+  StateBlock *stateBlock = new StateBlock;
+  stateBlock->connId = connId;
+
+  stateBlock->localPort = localPort;
+  stateBlock->remoteHost.remotePort = remotePort;
+  stateBlock->remoteHost.ip = from;
+
+  stateBlock->iss = cookie;
+  stateBlock->snd_una = stateBlock->snd_nxt = stateBlock->snd_max = stateBlock->snd_queued = cookie + 1;
+  stateBlock->recover = cookie + 1;
+  stateBlock->snd_wnd = listener->seg_wnd;
+  stateBlock->snd_wl1 = listener->seg_seq;
+  stateBlock->snd_wl2 = listener->seg_ack;
+
+  stateBlock->irs = seq;
+  stateBlock->rcv_nxt = listener->seg_seq;
+  stateBlock->rcv_wnd = TCP_BUFFER_SIZE;
+
+  stateBlock->tcp_mss = mss;
+  stateBlock->congestion->setMss(mss);
+
+  stateBlock->currentState = Tcp::ESTABLISHED;
+  NETSTAT_INC(TcpPassiveOpens);
+
+  stateBlock->endpoint = new TcpEndpoint(connId, from, localPort, remotePort);
+
+  StateBlockHandle* handle = new StateBlockHandle;
+  handle->localPort = localPort;
+  handle->remotePort = remotePort;
+  handle->remoteHost.ip = from;
+  handle->listen = false;
+
+  if(!m_StateBlocks.insert(*handle, stateBlock))
+  {
+    delete handle;
+    delete stateBlock->endpoint;
+    delete stateBlock;
+    return 0;
+  }
+  m_CurrentConnections.insert(connId, handle);
+
+  listener->endpoint->addIncomingConnection(stateBlock->endpoint);
+
+  return stateBlock;
+}
+
+void TcpManager::dumpConnections(String &str)
+{
+  LockGuard<Mutex> guard(m_TcpMutex);
+
+  str += "Local Remote State Send-Q Retrans-Q Cwnd Ssthresh Rtt Rttvar Rto Retrans\n";
+  for(Tree<size_t, StateBlockHandle*>::Iterator it = m_CurrentConnections.begin();
+      it != m_CurrentConnections.end();
+      it++)
+  {
+    StateBlockHandle *handle = reinterpret_cast<StateBlockHandle*>(it.value());
+    StateBlock *stateBlock = m_StateBlocks.lookup(*handle);
+    if(!stateBlock)
+      continue;
+
+    LargeStaticString line;
+    line.append(static_cast<size_t>(handle->localPort));
+    line += " ";
+    line += static_cast<const char*>(handle->remoteHost.ip.toString());
+    line += ":";
+    line.append(static_cast<size_t>(handle->remotePort));
+    line += " ";
+    line += Tcp::stateString(stateBlock->currentState);
+    line += " ";
+    line.append(stateBlock->sendQueue.count());
+    line += " ";
+    line.append(stateBlock->retransmitQueue.count());
+    line += " ";
+    line.append(stateBlock->congestion->getWindow());
+    line += " ";
+    line.append(stateBlock->congestion->getSlowStartThreshold());
+    line += " ";
+    line.append(stateBlock->srtt / 8);
+    line += " ";
+    line.append(stateBlock->rttvar / 4);
+    line += " ";
+    line.append(stateBlock->rto);
+    line += " ";
+    line.append(stateBlock->retransmits);
+    line += "\n";
+    str += static_cast<const char*>(line);
+  }
+}
@@ -28,6 +28,7 @@
 #include <machine/Network.h>
 #include <process/Mutex.h>
 #include <machine/TimerHandler.h>
+#include <utilities/TimerWheel.h>
 #include <LockGuard.h>
 
 #include <Log.h>
@@ -43,6 +44,12 @@
 
 #define BASE_EPHEMERAL_PORT 32768
 
+/// Backlog for listen sockets that don't ask for one.
+#define TCP_DEFAULT_BACKLOG 128
+
+/// Largest backlog a listen socket can ask for.
+#define TCP_MAX_BACKLOG     4096
+
 /**
  * The Pedigree network stack - TCP Protocol Manager
  */
@@ -50,9 +57,10 @@ class TcpManager : public ProtocolManager, public TimerHandler
 {
 public:
   TcpManager() :
-    m_NextTcpSequence(1), m_NextConnId(1), m_StateBlocks(), m_ListeningStateBlocks(),
-    m_CurrentConnections(), m_Endpoints(), m_ListenPorts(), m_EphemeralPorts(),
-    m_TcpMutex(false), m_SequenceMutex(false), m_Nanoseconds(0)
+    m_NextTcpSequence(1), m_NextConnId(1), m_StateBlocks(TCP_CONNECTION_BUCKETS),
+    m_ListeningStateBlocks(TCP_LISTENER_BUCKETS), m_CurrentConnections(), m_Endpoints(),
+    m_ListenPorts(), m_EphemeralPorts(), m_TcpMutex(false), m_SequenceMutex(false),
+    m_Nanoseconds(0), m_TimerWheel(), m_CookieSecret(0), m_LastCookieSent(0), m_nCookiesSent(0)
   {
     // Ports 32768 -> 65535 are ephemeral ports for client->server connections.
     for(size_t n = 0; n < BASE_EPHEMERAL_PORT; ++n)
@@ -75,15 +83,15 @@ public:
     return manager;
   }
 
-  /** Every half a second, increments sequence number by 64,000. */
+  /** Drives the connection timers, and every half a second increments
+   *  the sequence number by 64,000. */
   virtual void timer(uint64_t delta, InterruptState &state)
   {
-    m_Nanoseconds += delta;
-    if(UNLIKELY(m_Nanoseconds > 200000000ULL))
-    {
-      // 200 ms tick - check for segments that we need to ack.
-    }
+    // Every connection's timers hang off the one wheel, so the work done
+    // here doesn't grow with the number of connections.
+    m_TimerWheel.tick(delta);
 
+    m_Nanoseconds += delta;
     if(UNLIKELY(m_Nanoseconds > 500000000ULL))
     {
       // 500 ms tick - increment sequence number and reset tick counter.
@@ -94,11 +102,20 @@ public:
     }
   }
 
+  /** The wheel connection timers are scheduled on. */
+  TimerWheel &getTimerWheel()
+  {
+    return m_TimerWheel;
+  }
+
   /** Connects to a remote host (blocks until connected) */
   size_t Connect(Endpoint::RemoteEndpoint remoteHost, uint16_t localPort, TcpEndpoint* endpoint, bool bBlock = true);
 
-  /** Starts listening for connections */
-  size_t Listen(Endpoint* e, uint16_t port, Network* pCard = 0);
+  /** Starts listening for connections
+   *  \param backlog Connections waiting to be accepted (and, separately,
+   *                 half-open connections) allowed before new ones are
+   *                 refused. Zero gives TCP_DEFAULT_BACKLOG. */
+  size_t Listen(Endpoint* e, uint16_t port, Network* pCard = 0, size_t backlog = 0);
 
   /** In TCP terms - sends FIN. */
   void Shutdown(size_t connectionId, bool bOnlyStopReceive = false);
@@ -120,9 +137,17 @@ public:
   /** Sends a TCP packet over the given connection ID */
   int send(size_t connId, uintptr_t payload, bool push, size_t nBytes, bool addToRetransmitQueue = true);
 
+  /** Turns keepalive probes on or off for a connection. */
+  void setKeepalive(size_t connId, bool bEnable);
+
   /** Removes a given (closed) connection from the system */
   void removeConn(size_t connId);
 
+  /** Appends a line per connection to str, after "ss -ti": the addresses,
+   *  state, queue lengths, congestion window, RTT estimate (ms) and
+   *  retransmissions. */
+  void dumpConnections(String &str);
+
   /** Grabs the current state of a given connection */
   Tcp::TcpState getState(size_t connId)
   {
@@ -231,10 +256,10 @@ private:
   size_t m_NextConnId;
 
   // standard state blocks
-  Tree<StateBlockHandle, StateBlock*> m_StateBlocks;
+  TcpConnectionTable m_StateBlocks;
 
   // server state blocks (separated from standard blocks in the list)
-  Tree<StateBlockHandle, StateBlock*> m_ListeningStateBlocks;
+  TcpConnectionTable m_ListeningStateBlocks;
 
   /** Current connections - basically a map between connection IDs and handles */
   Tree<size_t, StateBlockHandle*> m_CurrentConnections;
@@ -258,6 +283,40 @@ private:
 
   /** Count of milliseconds, used for timer handler. */
   uint64_t m_Nanoseconds;
+
+  /** Retransmission, delayed ACK, keepalive and TIME_WAIT timers. */
+  TimerWheel m_TimerWheel;
+
+  /** Finds the listen socket for a local port. */
+  StateBlock *findListener(uint16_t localPort);
+
+  /** Is a listen socket's queue of connections waiting for accept() full? */
+  bool acceptQueueFull(StateBlock *listener);
+
+  /** Takes a connection that has finished its handshake off its listen
+   *  socket's count of half-open connections. */
+  void leaveSynQueue(StateBlock *stateBlock);
+
+  /** Sends a SYN/ACK whose sequence number encodes the connection, rather
+   *  than keeping any state for it (used when the SYN queue is full). */
+  void sendSynCookie(IpAddress &from, uint16_t localPort, uint16_t remotePort, uint32_t seq, uint32_t mss);
+
+  /** Checks the ACK finishing a SYN cookie handshake, and if it's good
+   *  creates the connection. Returns the new state block or null. */
+  StateBlock *acceptSynCookie(IpAddress &from, uint16_t localPort, uint16_t remotePort, StateBlock *listener);
+
+  /** The hash part of a SYN cookie. */
+  uint32_t synCookieHash(IpAddress &from, uint16_t localPort, uint16_t remotePort, uint32_t seq, uint32_t count);
+
+  /** Secret for SYN cookies, chosen on first use. */
+  uint32_t m_CookieSecret;
+
+  /** When (tick count, ms) the last SYN cookie was sent. ACKs to listen
+   *  sockets are only checked for cookies for a little while after that. */
+  uint64_t m_LastCookieSent;
+
+  /** Number of SYN cookies sent. */
+  size_t m_nCookiesSent;
 };
 
 #endif
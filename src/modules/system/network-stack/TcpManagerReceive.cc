@@ -19,12 +19,13 @@
  */
 
 #include "TcpManager.h"
+#include "NetworkStatistics.h"
 #include <Log.h>
 
 #include <process/Mutex.h>
 #include <LockGuard.h>
 
-#define TCP_DEBUG 1
+#define TCP_DEBUG 0
 
 void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort, Tcp::tcpHeader* header, uintptr_t payload, size_t payloadSize, Network* pCard)
 {
@@ -61,6 +62,17 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
     }
   }
 
+  // Socket filters see the segment as it arrived, header and all. As for
+  // UDP, anything they cut off the end is dropped (and will be sent again).
+  if(!bDidAllocateStateBlock && stateBlock->endpoint)
+  {
+    size_t headerSize = payload - reinterpret_cast<uintptr_t>(header);
+    size_t nAccept = stateBlock->endpoint->filterPacket(reinterpret_cast<uintptr_t>(header), headerSize + payloadSize);
+    if(nAccept < headerSize)
+      return;
+    payloadSize = nAccept - headerSize;
+  }
+
   // fill current segment information
   stateBlock->seg_seq = BIG_TO_HOST32(header->seqnum);
   stateBlock->seg_ack = BIG_TO_HOST32(header->acknum);
@@ -68,37 +80,23 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
   stateBlock->seg_wnd = BIG_TO_HOST16(header->winsize);
   stateBlock->seg_up = BIG_TO_HOST16(header->urgptr);
   stateBlock->seg_prc = 0; // IP header contains precedence information
-  stateBlock->rcv_wnd = stateBlock->seg_wnd;
 
-  if(stateBlock->endpoint)
-  {
-    stateBlock->snd_wnd = stateBlock->endpoint->m_ShadowDataStream.getRemainingSize();
-  }
+  stateBlock->segmentArrived();
+
+  // Where a FIN on this segment sits in sequence space.
+  uint32_t segEnd = stateBlock->seg_seq + stateBlock->seg_len;
 
   // Parse options.
-  uint32_t tcp_mss = stateBlock->tcp_mss;
-  uint32_t headerLength = (header->offset * 4);
-  if(((header->flags & Tcp::SYN) != 0) && (headerLength > 20))
-  {
-    size_t offset = 20;
-    uint8_t *opts = &reinterpret_cast<uint8_t *>(header)[offset];
-    while((*opts) && (offset < headerLength))
-    {
-      uint8_t code = opts[0];
-      uint8_t len = opts[1];
+  Tcp::TcpOptions options;
+  Tcp::parseOptions(header, options);
 
-      if(code == 1) // NOP
-      {
-        len = 1;
-      }
-      if(code == 2) // MSS
-      {
-        tcp_mss = BIG_TO_HOST16(*reinterpret_cast<uint16_t *>(&opts[2]));
-      }
+  // Windows in anything but a SYN are scaled, once that's been agreed.
+  if(!(header->flags & Tcp::SYN) && stateBlock->wscale_ok)
+    stateBlock->seg_wnd <<= stateBlock->snd_wscale;
 
-      offset += len;
-      opts = &reinterpret_cast<uint8_t *>(header)[offset];
-    }
+  if(stateBlock->endpoint)
+  {
+    stateBlock->rcv_wnd = stateBlock->endpoint->m_ShadowDataStream.getRemainingSize();
   }
 
   stateBlock->fin_ack = false;
@@ -170,12 +168,34 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
       }
       else if(header->flags & Tcp::ACK)
       {
-        // An ACK on a listen state is invalid
+        // Unless it finishes a handshake we answered with a SYN cookie, an
+        // ACK on a listen state is invalid
+        if(!(header->flags & Tcp::SYN))
+        {
+          if(acceptQueueFull(stateBlock))
+            break;
+          if(acceptSynCookie(from, destPort, sourcePort, stateBlock))
+            break;
+        }
+
         if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->seg_ack, 0, Tcp::RST, 0, 0, 0))
           WARNING("TCP: Sending RST due to ACK while in LISTEN state failed.");
       }
       else if(header->flags & Tcp::SYN)
       {
+        // If the application isn't accepting connections as fast as they
+        // arrive, drop the SYN - it'll be resent, and may get in then.
+        if(acceptQueueFull(stateBlock))
+          break;
+
+        // Too many half-open connections (probably a SYN flood): answer
+        // without keeping any state.
+        if(stateBlock->synQueueLength >= stateBlock->backlog)
+        {
+          sendSynCookie(from, destPort, sourcePort, stateBlock->seg_seq, options.mss ? options.mss : 536);
+          break;
+        }
+
         // Create a new server state block for this incoming connection, and register the new client
         // connection ID with the listening endpoint
 
@@ -197,22 +217,23 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
         newStateBlock->remoteHost.ip = from;
 
         newStateBlock->iss = getNextSequenceNumber();
-        newStateBlock->snd_nxt = newStateBlock->iss + 1;
-        newStateBlock->snd_una = newStateBlock->iss;
-        newStateBlock->snd_wnd = 16384;
+        newStateBlock->snd_wnd = stateBlock->seg_wnd;
         newStateBlock->snd_up = 0;
-        newStateBlock->snd_wl1 = newStateBlock->snd_wl2 = 0;
+        newStateBlock->snd_wl1 = stateBlock->seg_seq;
+        newStateBlock->snd_wl2 = 0;
 
         newStateBlock->irs = stateBlock->seg_seq;
         newStateBlock->rcv_nxt = stateBlock->seg_seq + 1;
-        newStateBlock->rcv_wnd = stateBlock->seg_wnd;
+        newStateBlock->rcv_wnd = TCP_BUFFER_SIZE;
         newStateBlock->rcv_up = 0;
 
-        newStateBlock->tcp_mss = tcp_mss;
+        newStateBlock->offerOptions();
+        newStateBlock->acceptOptions(options);
 
         newStateBlock->seg_seq = newStateBlock->rcv_nxt;
 
         newStateBlock->currentState = Tcp::SYN_RECEIVED;
+        NETSTAT_INC(TcpPassiveOpens);
 
         newStateBlock->endpoint = stateBlock->endpoint;
 
@@ -234,14 +255,20 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
 
         *tmp = handle;
 
-        m_StateBlocks.insert(handle, newStateBlock);
+        if(!m_StateBlocks.insert(handle, newStateBlock))
+        {
+          // Already have this connection (a duplicate SYN).
+          delete tmp;
+          delete newStateBlock;
+          break;
+        }
         m_CurrentConnections.insert(connId, tmp);
 
-        // ACK the SYN
-        IpAddress dest;
-        dest = newStateBlock->remoteHost.ip;
-        if(!Tcp::send(dest, newStateBlock->localPort, newStateBlock->remoteHost.remotePort, newStateBlock->iss, newStateBlock->rcv_nxt, Tcp::SYN | Tcp::ACK, newStateBlock->snd_wnd, 0, 0))
-          WARNING("TCP: Sending SYN/ACK failed");
+        newStateBlock->inSynQueue = true;
+        ++stateBlock->synQueueLength;
+
+        // ACK the SYN (retransmitted until the handshake completes)
+        newStateBlock->sendSyn(true);
       }
       else
       {
@@ -256,7 +283,7 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
       // ACK verification
       if(header->flags & Tcp::ACK)
       {
-        if((stateBlock->seg_ack <= stateBlock->iss) || (stateBlock->seg_ack > stateBlock->snd_nxt))
+        if(Tcp::seqLessEqual(stateBlock->seg_ack, stateBlock->iss) || Tcp::seqGreater(stateBlock->seg_ack, stateBlock->snd_max))
         {
           NOTICE("TCP Packet arriving on port " << Dec << handle.localPort << Hex << " during SYN-SENT has unacceptable ACK 1.");
 
@@ -269,7 +296,7 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
           }
         }
 
-        if(!((stateBlock->snd_una <= stateBlock->seg_ack) && (stateBlock->seg_ack <= stateBlock->snd_nxt)))
+        if(!(Tcp::seqLessEqual(stateBlock->snd_una, stateBlock->seg_ack) && Tcp::seqLessEqual(stateBlock->seg_ack, stateBlock->snd_max)))
         {
           // ACK unacceptable
           NOTICE("TCP Packet arriving on port " << Dec << handle.localPort << Hex << " during SYN-SENT has unacceptable ACK 2.");
@@ -282,6 +309,7 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
         if(header->flags & Tcp::ACK)
         {
           // Drop segment, we're closing NOW!
+          NETSTAT_INC(TcpAttemptFails);
           stateBlock->currentState = Tcp::CLOSED;
           break;
         }
@@ -293,14 +321,18 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
         {
           stateBlock->rcv_nxt = stateBlock->seg_seq + 1;
           stateBlock->irs = stateBlock->seg_seq;
-          stateBlock->snd_una = stateBlock->seg_ack;
+          stateBlock->acceptOptions(options);
+          stateBlock->updateTimestamp(options);
+
+          // Takes our SYN off the retransmit queue, and picks up the window.
+          stateBlock->snd_wl1 = stateBlock->seg_seq - 1;
+          stateBlock->processAck(options, header->flags);
 
-          if(stateBlock->snd_una > stateBlock->iss)
+          if(Tcp::seqGreater(stateBlock->snd_una, stateBlock->iss))
           {
             stateBlock->currentState = Tcp::ESTABLISHED;
-            stateBlock->tcp_mss = tcp_mss;
 
-            if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->snd_nxt, stateBlock->rcv_nxt, Tcp::ACK, stateBlock->snd_wnd, 0, 0))
+            if(!stateBlock->sendAck())
               WARNING("TCP: Sending ACK due to SYN/ACK while in SYN_SENT state failed.");
 
             break;
@@ -309,7 +341,7 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
           {
             stateBlock->currentState = Tcp::SYN_RECEIVED;
 
-            if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->iss, stateBlock->rcv_nxt, Tcp::SYN | Tcp::ACK, stateBlock->snd_wnd, 0, 0))
+            if(!stateBlock->sendControl(Tcp::SYN | Tcp::ACK, stateBlock->iss))
               WARNING("TCP: Sending SYN/ACK due to incorrect SYN/ACK while in SYN_SENT state failed.");
 
             break;
@@ -332,7 +364,7 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
       if(header->flags & Tcp::SYN)
       {
         NOTICE("TCP: unexpected SYN!");
-        if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->snd_nxt, stateBlock->rcv_nxt, Tcp::ACK | Tcp::RST, stateBlock->snd_wnd, 0, 0))
+        if(!stateBlock->sendControl(Tcp::ACK | Tcp::RST, stateBlock->snd_nxt))
           WARNING("TCP: Sending RST due to SYN during non-SYN phase failed.");
         break;
       }
@@ -343,7 +375,7 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
         if(!(stateBlock->seg_seq == stateBlock->rcv_nxt))
         {
           NOTICE("TCP Packet arriving on port " << Dec << handle.localPort << Hex << " during " << Tcp::stateString(stateBlock->currentState) << " is unacceptable 1.");
-          if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->snd_nxt, stateBlock->rcv_nxt, Tcp::ACK, stateBlock->snd_wnd, 0, 0))
+          if(!stateBlock->sendAck())
             WARNING("TCP: Sending ACK due to unacceptable ACK (1) while in post-SYN_SENT state failed.");
           break;
         }
@@ -359,13 +391,13 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
       if((stateBlock->seg_len == 0) && (stateBlock->rcv_wnd > 0))
       {
         // Unacceptable
-        if(!((stateBlock->rcv_nxt <= stateBlock->seg_seq) && (stateBlock->seg_seq < (stateBlock->rcv_nxt + stateBlock->rcv_wnd))))
+        if(!(Tcp::seqLessEqual(stateBlock->rcv_nxt, stateBlock->seg_seq) && Tcp::seqLess(stateBlock->seg_seq, stateBlock->rcv_nxt + stateBlock->rcv_wnd)))
         {
           NOTICE("TCP Packet arriving on port " << Dec << handle.localPort << Hex << " during " << Tcp::stateString(stateBlock->currentState) << " is unacceptable 2.");
           NOTICE("    >> RCV_NXT = " << stateBlock->rcv_nxt);
           NOTICE("    >> SEG_SEQ = " << stateBlock->seg_seq);
           NOTICE("    >> RCV_NXT + RCV_WND = " << (stateBlock->rcv_nxt + stateBlock->rcv_wnd));
-          if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->snd_nxt, stateBlock->rcv_nxt, Tcp::ACK, stateBlock->snd_wnd, 0, 0))
+          if(!stateBlock->sendAck())
             WARNING("TCP: Sending ACK due to unacceptable ACK (2) while in post-SYN_SENT state failed.");
           break;
         }
@@ -375,7 +407,7 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
       if((stateBlock->seg_len > 0) && (stateBlock->rcv_wnd == 0))
       {
         NOTICE("TCP Packet arriving on port " << Dec << handle.localPort << Hex << " during " << Tcp::stateString(stateBlock->currentState) << " is unacceptable 3.");
-        if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->snd_nxt, stateBlock->rcv_nxt, Tcp::ACK, stateBlock->snd_wnd, 0, 0))
+        if(!stateBlock->sendAck())
           WARNING("TCP: Sending ACK due to unacceptable ACK (3) while in post-SYN_SENT state failed.");
         break;
       }
@@ -383,12 +415,12 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
       if((stateBlock->seg_len > 0) && (stateBlock->rcv_wnd > 0))
       {
         if(!(
-          ((stateBlock->rcv_nxt <= stateBlock->seg_seq) && (stateBlock->seg_seq < (stateBlock->rcv_nxt + stateBlock->rcv_wnd)))
+          (Tcp::seqLessEqual(stateBlock->rcv_nxt, stateBlock->seg_seq) && Tcp::seqLess(stateBlock->seg_seq, stateBlock->rcv_nxt + stateBlock->rcv_wnd))
           ||
-          ((stateBlock->rcv_nxt <= (stateBlock->seg_seq + stateBlock->seg_len - 1)) && ((stateBlock->seg_seq + stateBlock->seg_len - 1) < (stateBlock->rcv_nxt + stateBlock->rcv_wnd)))))
+          (Tcp::seqLessEqual(stateBlock->rcv_nxt, stateBlock->seg_seq + stateBlock->seg_len - 1) && Tcp::seqLess(stateBlock->seg_seq + stateBlock->seg_len - 1, stateBlock->rcv_nxt + stateBlock->rcv_wnd))))
         {
           NOTICE("TCP Packet arriving on port " << Dec << handle.localPort << Hex << " during " << Tcp::stateString(stateBlock->currentState) << " is unacceptable 4.");
-          if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->snd_nxt, stateBlock->rcv_nxt, Tcp::ACK, stateBlock->snd_wnd, 0, 0))
+          if(!stateBlock->sendAck())
             WARNING("TCP: Sending ACK due to unacceptable ACK (4) while in post-SYN_SENT state failed.");
           break;
         }
@@ -401,12 +433,15 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
           case Tcp::SYN_RECEIVED:
             /// \note LISTEN sockets never go into SYN_RECEIVED, so
             ///       we don't handle a passive open case here
+            NETSTAT_INC(TcpAttemptFails);
             break;
 
           case Tcp::ESTABLISHED:
           case Tcp::FIN_WAIT_1:
           case Tcp::FIN_WAIT_2:
           case Tcp::CLOSE_WAIT:
+            if((stateBlock->currentState == Tcp::ESTABLISHED) || (stateBlock->currentState == Tcp::CLOSE_WAIT))
+              NETSTAT_INC(TcpEstabResets);
 
             /// \todo recv/send need to handle the connection being reset
 
@@ -431,16 +466,16 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
 
       /// \todo Check security and precedence (IP header)...
 
+      // Timestamp to echo back, from segments that aren't old duplicates.
+      stateBlock->updateTimestamp(options);
+
       if(header->flags & Tcp::ACK)
       {
-        // Remove all acked segments from the transmit queue
-        stateBlock->ackSegment();
-
         switch(stateBlock->currentState)
         {
           case Tcp::SYN_RECEIVED:
           {
-            if(!(stateBlock->snd_una <= stateBlock->seg_ack && stateBlock->seg_ack <= stateBlock->snd_nxt))
+            if(!(Tcp::seqLessEqual(stateBlock->snd_una, stateBlock->seg_ack) && Tcp::seqLessEqual(stateBlock->seg_ack, stateBlock->snd_max)))
             {
               NOTICE("TCP Packet arriving on port " << Dec << handle.localPort << Hex << " during " << Tcp::stateString(stateBlock->currentState) << " is an unacceptable segment ACK.");
               if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->seg_ack, 0, Tcp::RST, 0, 0, 0))
@@ -456,6 +491,12 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
               return;
             }
 
+            // No room to queue it for accept() - ignore the ACK, and let
+            // the SYN/ACK be resent.
+            StateBlock *listener = findListener(stateBlock->localPort);
+            if(listener && acceptQueueFull(listener))
+              break;
+
             stateBlock->endpoint = new TcpEndpoint(connId, from, stateBlock->localPort, stateBlock->remoteHost.remotePort);
             if(!stateBlock->endpoint)
             {
@@ -466,7 +507,9 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
             }
 
             // Fall through otherwise
+            stateBlock->endpoint->inheritFilter(parent);
             stateBlock->currentState = Tcp::ESTABLISHED;
+            leaveSynQueue(stateBlock);
 
             // Ensure that the parent endpoint handles this properly
             parent->addIncomingConnection(stateBlock->endpoint);
@@ -478,57 +521,32 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
           case Tcp::CLOSE_WAIT:
           case Tcp::CLOSING:
 
-            if(stateBlock->seg_ack < stateBlock->snd_una)
+            if(Tcp::seqLess(stateBlock->seg_ack, stateBlock->snd_una))
               break; // Dupe ack, just skip it and continue
 
-            if((stateBlock->currentState == Tcp::ESTABLISHED) && (header->flags & Tcp::FIN))
-            {
-              // Passive close.
-              stateBlock->currentState = Tcp::CLOSE_WAIT;
-            }
-            if((stateBlock->currentState == Tcp::FIN_WAIT_1) && (((header->flags & (Tcp::FIN|Tcp::ACK)) == Tcp::FIN)))
-            {
-              // Simultaneous close.
-              stateBlock->currentState = Tcp::CLOSING;
-            }
-
-            // Remove from retransmission queue any acknowledged packets...
-            //stateBlock->retransmitQueue.remove(stateBlock->snd_una - stateBlock->nRemovedFromRetransmit, stateBlock->seg_len);
-            //stateBlock->nRemovedFromRetransmit += (stateBlock->seg_ack - stateBlock->snd_una);
-
-            // update the unack'd data information
-            if(stateBlock->snd_una < stateBlock->seg_ack && stateBlock->seg_ack <= stateBlock->snd_nxt)
-              stateBlock->snd_una = stateBlock->seg_ack;
-
-            // Reset the retransmit timer
-            stateBlock->resetTimer();
-
-            if(stateBlock->snd_una >= stateBlock->snd_nxt)
-              stateBlock->waitingForTimeout = false;
-
-            if(stateBlock->seg_ack > stateBlock->snd_nxt)
+            if(Tcp::seqGreater(stateBlock->seg_ack, stateBlock->snd_max))
             {
               // Ack the ack with the proper sequence number, because the remote TCP has ack'd data that hasn't been sent
-              if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->snd_nxt, stateBlock->seg_seq, Tcp::ACK, stateBlock->snd_wnd, 0, 0))
+              if(!stateBlock->sendAck())
                 WARNING("TCP: Sending ACK with proper sequence number (remote TCP ack'd data that we didn't send) failed.");
               else
                 alreadyAck = true;
               break;
             }
 
-            if(stateBlock->snd_una < stateBlock->seg_ack && stateBlock->seg_ack <= stateBlock->snd_nxt)
+            if((stateBlock->currentState == Tcp::FIN_WAIT_1) && (((header->flags & (Tcp::FIN|Tcp::ACK)) == Tcp::FIN)))
             {
-              if((stateBlock->snd_wl1 < stateBlock->seg_seq) || (stateBlock->snd_wl1 == stateBlock->seg_seq && stateBlock->snd_wl2 <= stateBlock->seg_ack))
-              {
-                stateBlock->snd_wnd = stateBlock->seg_wnd;
-                stateBlock->snd_wl1 = stateBlock->seg_seq;
-                stateBlock->snd_wl2 = stateBlock->seg_ack;
-              }
+              // Simultaneous close.
+              stateBlock->currentState = Tcp::CLOSING;
             }
 
+            // Clear acked segments off the retransmit queue, update the
+            // send window, and send anything that's now allowed.
+            stateBlock->processAck(options, header->flags);
+
             if(stateBlock->currentState == Tcp::FIN_WAIT_1)
             {
-              if(stateBlock->fin_seq <= stateBlock->seg_ack)
+              if(Tcp::seqLess(stateBlock->fin_seq, stateBlock->seg_ack))
               {
                 stateBlock->currentState = Tcp::FIN_WAIT_2;
                 stateBlock->fin_ack = true; // FIN has been acked
@@ -538,7 +556,7 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
             {
               // user's close can return now, but no deletion of the state block yet
 
-              if(stateBlock->fin_seq <= stateBlock->seg_ack)
+              if(Tcp::seqLess(stateBlock->fin_seq, stateBlock->seg_ack))
               {
                 stateBlock->currentState = Tcp::FIN_WAIT_2;
                 stateBlock->fin_ack = true; // FIN has been acked
@@ -546,7 +564,7 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
             }
             else if(stateBlock->currentState == Tcp::CLOSING || stateBlock->currentState == Tcp::LAST_ACK)
             {
-              if(stateBlock->fin_seq <= stateBlock->seg_ack)
+              if(Tcp::seqLess(stateBlock->fin_seq, stateBlock->seg_ack))
               {
                 //stateBlock->currentState = Tcp::TIME_WAIT;
                 stateBlock->currentState = Tcp::CLOSED;
@@ -558,6 +576,8 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
 
           case Tcp::LAST_ACK:
 
+            stateBlock->processAck(options, header->flags);
+
             // only our FIN ack can come now, so close
             if((stateBlock->fin_seq + 1) == stateBlock->seg_ack)
             {
@@ -570,7 +590,6 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
 
             // only a FIN can come in during this state, ACK will be performed later on
             stateBlock->resetTimer(120); // 2 minute timeout for TIME_WAIT
-            stateBlock->waitingForTimeout = true;
 
             break;
 
@@ -593,28 +612,46 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
       /* Finally, process the actual segment payload */
       if(stateBlock->currentState == Tcp::ESTABLISHED || stateBlock->currentState == Tcp::FIN_WAIT_1 || stateBlock->currentState == Tcp::FIN_WAIT_2)
       {
+        // Trim off the front of a segment that overlaps what we already have.
+        if(stateBlock->seg_len && Tcp::seqLess(stateBlock->seg_seq, stateBlock->rcv_nxt) && Tcp::seqGreater(segEnd, stateBlock->rcv_nxt))
+        {
+          uint32_t nDuplicate = stateBlock->rcv_nxt - stateBlock->seg_seq;
+          payload += nDuplicate;
+          stateBlock->seg_len -= nDuplicate;
+          stateBlock->seg_seq = stateBlock->rcv_nxt;
+        }
+
         // Is this a valid data segment?
-        if(stateBlock->seg_seq < stateBlock->rcv_nxt)
+        if(Tcp::seqLess(stateBlock->seg_seq, stateBlock->rcv_nxt))
         {
           // Transmission of already-acked data. Resend an ACK.
-          WARNING(" + (sequence is already partially acked)");
-          if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->snd_nxt, stateBlock->rcv_nxt, Tcp::ACK, stateBlock->snd_wnd, 0, 0))
+#if TCP_DEBUG
+          WARNING(" + (sequence is already acked)");
+#endif
+          if(!stateBlock->sendAck())
             WARNING("TCP: Sending ACK for incoming data failed!");
           else
             alreadyAck = true;
         }
-        else if(stateBlock->seg_seq > stateBlock->rcv_nxt)
+        else if(Tcp::seqGreater(stateBlock->seg_seq, stateBlock->rcv_nxt))
         {
-          // Packet has come in out-of-order - send dup ACK with the expected sequence number.
+          // Packet has come in out-of-order - hold on to it, and send a dup
+          // ACK with the expected sequence number (and SACK blocks, if the
+          // remote host understands them) so the hole is filled quickly.
+#if TCP_DEBUG
           WARNING(" + (sequence out of order)");
-          if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->snd_nxt, stateBlock->rcv_nxt, Tcp::ACK, stateBlock->snd_wnd, 0, 0))
+#endif
+          stateBlock->queueOutOfOrder(stateBlock->seg_seq, payload, stateBlock->seg_len);
+          if(!stateBlock->sendAck())
             WARNING("TCP: Sending ACK for out-of-order data failed!");
           else
             alreadyAck = true;
         }
         else if(stateBlock->seg_len)
         {
+#if TCP_DEBUG
           NOTICE(" + Payload: " << String(reinterpret_cast<const char*>(payload)));
+#endif
           if(stateBlock->endpoint)
           {
             // Limit the amount of data to the window we have available.
@@ -623,20 +660,22 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
               stateBlock->seg_len = stateBlock->endpoint->m_ShadowDataStream.getRemainingSize();
             }
 
-            /// \todo We should queue this ACK and transmit it when the timer fires (200ms max wait)
-            size_t winChange = stateBlock->endpoint->depositPayload(stateBlock->seg_len, payload, stateBlock->seg_seq - stateBlock->irs - 1, (header->flags & Tcp::PSH) == Tcp::PSH);
-            stateBlock->rcv_nxt += winChange;
-            if(winChange > stateBlock->rcv_wnd)
+            size_t nDeposited = stateBlock->endpoint->depositPayload(stateBlock->seg_len, payload, stateBlock->seg_seq - stateBlock->irs - 1, (header->flags & Tcp::PSH) == Tcp::PSH);
+            stateBlock->rcv_nxt += nDeposited;
+
+            // This may have filled a hole in front of data we're holding.
+            // Either way, this brings rcv_wnd up to date. Filling a hole is
+            // acked straight away, as is anything while there's still a hole,
+            // so the sender can get on with recovery.
+            if(stateBlock->deliverOutOfOrder() || stateBlock->outOfOrderQueue.count())
             {
-                WARNING("TCP: incoming data was larger than rcv_wind");
-                winChange = stateBlock->rcv_wnd;
+              if(!stateBlock->sendAck())
+                WARNING("TCP: Sending ACK for incoming data failed!");
+              else
+                alreadyAck = true;
             }
-            stateBlock->snd_wnd -= winChange;
-
-            if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->snd_nxt, stateBlock->rcv_nxt, Tcp::ACK, stateBlock->snd_wnd, 0, 0))
-              WARNING("TCP: Sending ACK for incoming data failed!");
             else
-              alreadyAck = true;
+              stateBlock->ackLater(nDeposited);
           }
 
           stateBlock->numEndpointPackets++;
@@ -648,15 +687,20 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
         if(stateBlock->currentState == Tcp::CLOSED || stateBlock->currentState == Tcp::LISTEN || stateBlock->currentState == Tcp::SYN_SENT || stateBlock->currentState == Tcp::TIME_WAIT)
           break;
 
+        // A FIN ahead of data we haven't got yet has to wait to be resent.
+        if(Tcp::seqGreater(segEnd, stateBlock->rcv_nxt))
+          break;
+
         // FIN means the remote host has nothing more to send, so push any remaining data to the application
         if(stateBlock->endpoint)
           stateBlock->endpoint->depositPayload(0, 0, 0, true);
 
-        stateBlock->rcv_nxt = stateBlock->seg_seq + 1;
+        if(segEnd == stateBlock->rcv_nxt)
+          stateBlock->rcv_nxt = segEnd + 1;
 
         if(!alreadyAck)
         {
-          if(!Tcp::send(from, handle.localPort, handle.remotePort, stateBlock->snd_nxt, stateBlock->rcv_nxt, Tcp::ACK, stateBlock->snd_wnd, 0, 0))
+          if(!stateBlock->sendAck())
             WARNING("TCP: Sending ACK to FIN failed.");
           else
             alreadyAck = true;
@@ -681,7 +725,6 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
               //stateBlock->currentState = Tcp::CLOSED;
 
               stateBlock->resetTimer(120); // 2 minute timeout for TIME_WAIT
-              stateBlock->waitingForTimeout = true;
             }
             else
               stateBlock->currentState = Tcp::CLOSING;
@@ -694,7 +737,6 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
             //stateBlock->currentState = Tcp::CLOSED;
 
             stateBlock->resetTimer(120); // 2 minute timeout for TIME_WAIT
-            stateBlock->waitingForTimeout = true;
 
             break;
 
@@ -710,7 +752,6 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
 
             // reset the timer
             stateBlock->resetTimer(120); // 2 minute timeout for TIME_WAIT
-            stateBlock->waitingForTimeout = true;
 
           default:
             break;
@@ -725,7 +766,6 @@ void TcpManager::receive(IpAddress from, uint16_t sourcePort, uint16_t destPort,
       // However, don't do anything else at all. Connection has cleanly
       // gone down.
       stateBlock->resetTimer(120);
-      stateBlock->waitingForTimeout = true;
       break;
 
     default:
@@ -23,6 +23,8 @@
 #include "TcpStateBlock.h"
 #include <LockGuard.h>
 #include <Log.h>
+#include <processor/Processor.h>
+#include <utilities/utility.h>
 
 int stateBlockFree(void* p)
 {
@@ -193,328 +195,254 @@ void TcpBuffer::setSize(size_t newBufferSize)
     }
 }
 
-//
-// Tree<StateBlockHandle,void*> implementation.
-//
-
-Tree<StateBlockHandle,void*>::Tree() :
-  root(0), nItems(0), m_Begin(0)
+/** Bob Jenkins' lookup3 final mix. */
+static inline uint32_t rotateLeft32(uint32_t x, int k)
 {
+  return (x << k) | (x >> (32 - k));
 }
 
-Tree<StateBlockHandle,void*>::~Tree()
+static uint32_t mix(uint32_t a, uint32_t b, uint32_t c)
 {
-  delete m_Begin;
+  c ^= b; c -= rotateLeft32(b, 14);
+  a ^= c; a -= rotateLeft32(c, 11);
+  b ^= a; b -= rotateLeft32(a, 25);
+  c ^= b; c -= rotateLeft32(b, 16);
+  a ^= c; a -= rotateLeft32(c, 4);
+  b ^= a; b -= rotateLeft32(a, 14);
+  c ^= b; c -= rotateLeft32(b, 24);
+  return c;
 }
 
-void Tree<StateBlockHandle,void*>::traverseNode_Insert(Node *n)
+uint32_t StateBlockHandle::hash(uint32_t seed)
 {
-  if (!n) return;
-  insert(n->key, n->element);
-  traverseNode_Insert(n->leftChild);
-  traverseNode_Insert(n->rightChild);
+  // Listen sockets are found by local port alone.
+  if(listen)
+    return mix(localPort, 0, seed);
+
+  uint32_t address;
+  if(remoteHost.ip.getType() == IpAddress::IPv6)
+  {
+    uint32_t words[4];
+    remoteHost.ip.getIp(reinterpret_cast<uint8_t*>(words));
+    address = mix(words[0], words[1], words[2] ^ seed) ^ words[3];
+  }
+  else
+    address = remoteHost.ip.getIp();
+
+  return mix(address, (static_cast<uint32_t>(localPort) << 16) | remotePort, seed);
 }
 
-void Tree<StateBlockHandle,void*>::traverseNode_Remove(Node *n)
+//
+// TcpConnectionTable implementation.
+//
+
+/// A lookup that walks further than this is probably chasing nodes that are
+/// being moved around under it, so it gives up and takes the bucket's lock.
+#define MAX_LOCKLESS_HOPS   256
+
+TcpConnectionTable::TcpConnectionTable(size_t nBuckets) :
+  m_Buckets(0), m_nBuckets(1), m_Seed(0), m_nItems(0), m_FreeNodes(0), m_Lock(false)
 {
-  if (!n) return;
-  traverseNode_Remove(n->leftChild);
-  traverseNode_Remove(n->rightChild);
-  delete n;
+  while(m_nBuckets < nBuckets)
+    m_nBuckets <<= 1;
 }
 
-Tree<StateBlockHandle,void*>::Tree(const Tree &x) :
-  root(0), nItems(0), m_Begin(0)
+TcpConnectionTable::~TcpConnectionTable()
 {
-  // Traverse the tree, adding everything encountered.
-  traverseNode_Insert(x.root);
+  if(m_Buckets)
+  {
+    for(size_t i = 0; i < m_nBuckets; ++i)
+    {
+      Node *n = m_Buckets[i].head;
+      while(n)
+      {
+        Node *next = n->next;
+        delete n;
+        n = next;
+      }
+    }
+    delete [] m_Buckets;
+  }
 
-  m_Begin = new IteratorNode(root, 0);
+  while(m_FreeNodes)
+  {
+    Node *next = m_FreeNodes->next;
+    delete m_FreeNodes;
+    m_FreeNodes = next;
+  }
 }
 
-Tree<StateBlockHandle,void*> &Tree<StateBlockHandle,void*>::operator =(const Tree &x)
+TcpConnectionTable::Bucket *TcpConnectionTable::getBucket(StateBlockHandle &key)
 {
-  clear();
-  // Traverse the tree, adding everything encountered.
-  traverseNode_Insert(x.root);
-
-  m_Begin = new IteratorNode(root, 0);
-
-  return *this;
+  Bucket *pBuckets = m_Buckets;
+  if(!pBuckets)
+    return 0;
+  return &pBuckets[key.hash(m_Seed) & (m_nBuckets - 1)];
 }
 
-size_t Tree<StateBlockHandle,void*>::count() const
+TcpConnectionTable::Node *TcpConnectionTable::allocateNode()
 {
-  return nItems;
+  m_Lock.acquire();
+  Node *pNode = m_FreeNodes;
+  if(pNode)
+    m_FreeNodes = pNode->next;
+  m_Lock.release();
+
+  if(!pNode)
+    pNode = new Node;
+  return pNode;
 }
 
-void Tree<StateBlockHandle,void*>::insert(StateBlockHandle key, void *value)
+void TcpConnectionTable::freeNode(Node *pNode)
 {
-  Node *n = new Node;
-  n->key = key;
-  n->element = value;
-  n->height = 0;
-  n->parent = 0;
-  n->leftChild = 0;
-  n->rightChild = 0;
-
-  bool inserted = false;
-
-  if (lookup(key))
-  {
-      delete n;
-      return; // Key already in tree.
-  }
+  m_Lock.acquire();
+  pNode->next = m_FreeNodes;
+  m_FreeNodes = pNode;
+  m_Lock.release();
+}
 
-  if (root == 0)
-  {
-    root = n; // We are the root node.
+StateBlock *TcpConnectionTable::lookup(StateBlockHandle key)
+{
+  Bucket *b = getBucket(key);
+  if(!b)
+    return 0;
 
-    m_Begin = new IteratorNode(root, 0);
-  }
-  else
+  while(true)
   {
-    // Traverse the tree.
-    Node *currentNode = root;
+    uint32_t sequence = b->sequence;
+    __sync_synchronize();
+    if(sequence & 1)
+    {
+      // Being changed right now.
+      Processor::pause();
+      continue;
+    }
 
-    while (!inserted)
+    StateBlock *pResult = 0;
+    size_t nHops = 0;
+    Node *n;
+    for(n = b->head; n && (nHops < MAX_LOCKLESS_HOPS); n = n->next, ++nHops)
     {
-      if (key > currentNode->key)
+      if(n->key == key)
       {
-        if (currentNode->rightChild == 0) // We have found our insert point.
-        {
-          currentNode->rightChild = n;
-          n->parent = currentNode;
-          inserted = true;
-        }
-        else
-          currentNode = currentNode->rightChild;
+        pResult = n->value;
+        break;
       }
-      else
+    }
+
+    if(n && !pResult)
+    {
+      // Too far - do it the slow way.
+      b->lock.acquire();
+      for(n = b->head; n; n = n->next)
       {
-        if (currentNode->leftChild == 0) // We have found our insert point.
+        if(n->key == key)
         {
-          currentNode->leftChild = n;
-          n->parent = currentNode;
-          inserted = true;
+          pResult = n->value;
+          break;
         }
-        else
-          currentNode = currentNode->leftChild;
       }
+      b->lock.release();
+      return pResult;
     }
 
-    // The value has been inserted, but has that messed up the balance of the tree?
-    while (currentNode)
-    {
-      int b = balanceFactor(currentNode);
-      if ( (b<-1) || (b>1) )
-        rebalanceNode(currentNode);
-      currentNode = currentNode->parent;
-    }
+    __sync_synchronize();
+    if(b->sequence == sequence)
+      return pResult;
   }
-
-  nItems++;
 }
 
-void *Tree<StateBlockHandle,void*>::lookup(StateBlockHandle key)
+bool TcpConnectionTable::insert(StateBlockHandle key, StateBlock *value)
 {
-  Node *n = root;
-  while (n != 0)
+  if(!m_Buckets)
   {
-    if (n->key == key)
+    m_Lock.acquire();
+    if(!m_Buckets)
     {
-      return n->element;
-    }
-    else if (key > n->key)
-    {
-      n = n->rightChild;
-    }
-    else
-    {
-      n = n->leftChild;
+      m_Seed = static_cast<uint32_t>(random_next());
+      Bucket *pBuckets = new Bucket[m_nBuckets];
+      __sync_synchronize();
+      m_Buckets = pBuckets;
     }
+    m_Lock.release();
   }
-  return 0;
-}
 
-void Tree<StateBlockHandle,void*>::remove(StateBlockHandle key)
-{
-  Node *n = root;
-  while (n != 0)
-  {
-    if (n->key == key)
-      break;
-    else if (n->key > key)
-      n = n->leftChild;
-    else
-      n = n->rightChild;
-  }
+  Node *pNode = allocateNode();
+  if(!pNode)
+    return false;
+  pNode->key = key;
+  pNode->value = value;
 
-  Node *orign = n;
-  if (n == 0) return;
+  Bucket *b = getBucket(key);
+  b->lock.acquire();
 
-  while (n->leftChild || n->rightChild) // While n is not a leaf.
+  for(Node *n = b->head; n; n = n->next)
   {
-    size_t hl = height(n->leftChild);
-    size_t hr = height(n->rightChild);
-    if (hl == 0)
-      rotateLeft(n); // N is now a leaf.
-    else if (hr == 0)
-      rotateRight(n); // N is now a leaf.
-    else if (hl <= hr)
+    if(n->key == key)
     {
-      rotateRight(n);
-      rotateLeft(n); // These are NOT inverse operations - rotateRight changes n's position.
-    }
-    else
-    {
-      rotateLeft(n);
-      rotateRight(n);
+      b->lock.release();
+      freeNode(pNode);
+      return false;
     }
   }
 
-  // N is now a leaf, so can be easily pruned.
-  if (n->parent == 0)
-    root = 0;
-  else
-    if (n->parent->leftChild == n)
-      n->parent->leftChild = 0;
-    else
-      n->parent->rightChild = 0;
-
-  // Work our way up the path, balancing.
-  while (n)
-  {
-    int b = balanceFactor(n);
-    if ( (b < -1) || (b > 1) )
-      rebalanceNode(n);
-    n = n->parent;
-  }
+  // Readers can walk the new node as soon as it's the head, so it has to
+  // be complete first.
+  pNode->next = b->head;
+  ++b->sequence;
+  __sync_synchronize();
+  b->head = pNode;
+  __sync_synchronize();
+  ++b->sequence;
 
-  delete orign;
-  nItems--;
-}
+  b->lock.release();
 
-void Tree<StateBlockHandle,void*>::clear()
-{
-  traverseNode_Remove(root);
-  root = 0;
-  nItems = 0;
+  m_Lock.acquire();
+  ++m_nItems;
+  m_Lock.release();
 
-  delete m_Begin;
-  m_Begin = 0;
+  return true;
 }
 
-Tree<StateBlockHandle,void*>::Iterator Tree<StateBlockHandle,void*>::erase(Iterator iter)
+StateBlock *TcpConnectionTable::remove(StateBlockHandle key)
 {
-  return iter; // to avoid "control reaches end of non-void function" warning
-}
+  Bucket *b = getBucket(key);
+  if(!b)
+    return 0;
 
-void Tree<StateBlockHandle,void*>::rotateLeft(Node *n)
-{
-  // See Cormen,Lieserson,Rivest&Stein  pp-> 278 for pseudocode.
-  Node *y = n->rightChild;            // Set Y.
-
-  n->rightChild = y->leftChild;       // Turn Y's left subtree into N's right subtree.
-  if (y->leftChild != 0)
-    y->leftChild->parent = n;
-
-  y->parent = n->parent;              // Link Y's parent to N's parent.
-  if (n->parent == 0)
-    root = y;
-  else if (n == n->parent->leftChild)
-    n->parent->leftChild = y;
-  else
-    n->parent->rightChild = y;
-  y->leftChild = n;
-  n->parent = y;
-}
+  b->lock.acquire();
 
-void Tree<StateBlockHandle,void*>::rotateRight(Node *n)
-{
-  Node *y = n->leftChild;
+  Node *pPrevious = 0;
+  Node *n;
+  for(n = b->head; n; pPrevious = n, n = n->next)
+  {
+    if(n->key == key)
+      break;
+  }
 
-  n->leftChild = y->rightChild;
-  if (y->rightChild != 0)
-    y->rightChild->parent = n;
+  if(!n)
+  {
+    b->lock.release();
+    return 0;
+  }
 
-  y->parent = n->parent;
-  if (n->parent == 0)
-    root = y;
-  else if (n == n->parent->leftChild)
-    n->parent->leftChild = y;
+  ++b->sequence;
+  __sync_synchronize();
+  if(pPrevious)
+    pPrevious->next = n->next;
   else
-    n->parent->rightChild = y;
-
-  y->rightChild = n;
-  n->parent = y;
-}
-
-size_t Tree<StateBlockHandle,void*>::height(Node *n)
-{
-  // Assumes: n's children's heights are up to date. Will always be true if balanceFactor
-  //          is called in a bottom-up fashion.
-  if (n == 0) return 0;
+    b->head = n->next;
+  __sync_synchronize();
+  ++b->sequence;
 
-  size_t tempL = 0;
-  size_t tempR = 0;
+  b->lock.release();
 
-  if (n->leftChild != 0)
-    tempL = n->leftChild->height;
-  if (n->rightChild != 0)
-    tempR = n->rightChild->height;
+  StateBlock *pResult = n->value;
+  freeNode(n);
 
-  tempL++; // Account for the height increase stepping up to us, its parent.
-  tempR++;
+  m_Lock.acquire();
+  --m_nItems;
+  m_Lock.release();
 
-  if (tempL > tempR) // If one is actually bigger than the other, return that, else return the other.
-  {
-    n->height = tempL;
-    return tempL;
-  }
-  else
-  {
-    n->height = tempR;
-    return tempR;
-  }
-}
-
-int Tree<StateBlockHandle,void*>::balanceFactor(Node *n)
-{
-  return static_cast<int>(height(n->rightChild)) - static_cast<int>(height(n->leftChild));
-}
-
-void Tree<StateBlockHandle,void*>::rebalanceNode(Node *n)
-{
-  // This way of choosing which rotation to do took me AGES to find...
-  // See http://www.cmcrossroads.com/bradapp/ftp/src/libs/C++/AvlTrees.html
-  int balance = balanceFactor(n);
-  if (balance < -1) // If it's left imbalanced, we need a right rotation.
-  {
-    if (balanceFactor(n->leftChild) > 0) // If its left child is right heavy...
-    {
-      // We need a RL rotation - left rotate n's left child, then right rotate N.
-      rotateLeft(n->leftChild);
-      rotateRight(n);
-    }
-    else
-    {
-      // RR rotation will do.
-      rotateRight(n);
-    }
-  }
-  else if (balance > 1)
-  {
-    if (balanceFactor(n->rightChild) < 0) // If its right child is left heavy...
-    {
-      // We need a LR rotation; Right rotate N's right child, then left rotate N.
-      rotateRight(n->rightChild);
-      rotateLeft(n);
-    }
-    else
-    {
-      // LL rotation.
-      rotateLeft(n);
-    }
-  }
+  return pResult;
 }
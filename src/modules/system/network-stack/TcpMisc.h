@@ -21,14 +21,20 @@
 #ifndef MACHINE_TCPMISC_H
 #define MACHINE_TCPMISC_H
 
-#include <utilities/Tree.h>
-#include <utilities/Iterator.h>
 #include <process/Mutex.h>
+#include <Spinlock.h>
 #include <LockGuard.h>
 #include "Endpoint.h"
 
 #include <Log.h>
 
+/// Default size of each TCP stream buffer, which bounds the receive window.
+#define TCP_BUFFER_SIZE   32768
+
+/// Hash buckets for established connections, and for listen sockets.
+#define TCP_CONNECTION_BUCKETS  4096
+#define TCP_LISTENER_BUCKETS    64
+
 /** A TCP "Buffer" (also known as a stream) */
 class TcpBuffer
 {
@@ -37,7 +43,7 @@ class TcpBuffer
     TcpBuffer() :
       m_Buffer(0), m_BufferSize(0), m_DataSize(0), m_Reader(0), m_Writer(0), m_Lock(false)
     {
-      setSize(32768);
+      setSize(TCP_BUFFER_SIZE);
     };
     virtual ~TcpBuffer()
     {
@@ -114,268 +120,88 @@ struct StateBlockHandle
     }
     else
     {
-      // NOTICE_NOLOCK("Operator == [" << localPort << ", " << a.localPort << "] [" << remotePort << ", " << a.remotePort << "]" << " [" << remoteHost.ip.toString() << ", " << a.remoteHost.ip.toString() << "]");
       return ((localPort == a.localPort) && (remoteHost.ip == a.remoteHost.ip) && (remotePort == a.remotePort));
     }
     return false;
   }
 
-  bool operator > (StateBlockHandle a)
-  {
-    return true;
-    if(listen && a.listen)
-      return (localPort > a.localPort);
-    else
-    {
-      //NOTICE("Operator > : [" << localPort << ", " << a.localPort << "] [" << remotePort << ", " << a.remotePort << "]");
-      if(localPort)
-        return ((localPort > a.localPort) && (remotePort > a.remotePort));
-      else
-        return (remotePort > a.remotePort);
-    }
-  }
+  /** Hashes the parts of the handle that operator == looks at, mixed with
+   *  seed so remote hosts can't choose connections that all collide. */
+  uint32_t hash(uint32_t seed);
 };
 
-/** Special case for Tree with a state block handle as the key */
-template <>
-class Tree<StateBlockHandle,void*>
-{
-  private:
+class StateBlock;
 
-    /** Tree node. */
-    struct Node
-    {
-      Node() :
-        key(), element(0), leftChild(0), rightChild(0), parent(0), height(0)
-      {};
+/**
+ * Finds state blocks by their handle: the 4-tuple for connections, or just
+ * the local port for listen sockets.
+ *
+ * This is a fixed-size, chained hash table. Changes are serialised per
+ * bucket, and lookups take no locks at all - each bucket has a sequence
+ * count that is odd while it is being changed, and a lookup that overlaps a
+ * change just tries again. Nodes are never given back to the heap (they
+ * are reused), so a lookup that runs into one as it's being removed only
+ * ever reads stale memory, and the sequence count catches that.
+ */
+class TcpConnectionTable
+{
+  public:
+    /** nBuckets is rounded up to a power of two. Buckets are only allocated
+     *  when the first entry is inserted. */
+    TcpConnectionTable(size_t nBuckets);
+    ~TcpConnectionTable();
 
-      StateBlockHandle key;
-      void *element;
-      struct Node *leftChild;
-      struct Node *rightChild;
-      struct Node *parent;
-      size_t height;
-    };
+    /** Finds the state block for a handle, or returns null. */
+    StateBlock *lookup(StateBlockHandle key);
 
-  public:
+    /** Adds a state block. Fails if the handle is already present. */
+    bool insert(StateBlockHandle key, StateBlock *value);
 
-    class IteratorNode
-    {
-      public:
-        IteratorNode() : value(0), pNode(0), pPreviousNode(0)
-        {};
-        IteratorNode(Node* node, Node* prev) : value(node), pNode(node), pPreviousNode(prev)
-        {};
-
-        IteratorNode *next()
-        {
-          traverseNext();
-
-          value = pNode;
-
-          return this;
-        }
-        IteratorNode *previous()
-        {
-          return 0;
-        }
-
-        Node* value;
-
-      private:
-
-        Node* pNode;
-        Node* pPreviousNode;
-
-        void traverseNext()
-        {
-          if(pNode == 0)
-            return;
-
-          if((pPreviousNode == pNode->parent) && pNode->leftChild)
-          {
-            pPreviousNode = pNode;
-            pNode = pNode->leftChild;
-            traverseNext();
-          }
-          else if((pPreviousNode == pNode->leftChild) && !pNode->leftChild)
-          {
-            pPreviousNode = pNode;
-            return;
-          }
-          else if((pPreviousNode == pNode) && pNode->rightChild)
-          {
-            pPreviousNode = pNode;
-            pNode = pNode->rightChild;
-            traverseNext();
-          }
-          else
-          {
-            pPreviousNode = pNode;
-            pNode = pNode->parent;
-            traverseNext();
-          }
-        }
-    };
+    /** Removes the entry for a handle, returning its state block. */
+    StateBlock *remove(StateBlockHandle key);
 
-    typedef ::Iterator<void*, IteratorNode> Iterator;
-    //typedef void**           Iterator;
-    /** Contant random-access iterator for the Vector */
-    typedef void** const*     ConstIterator;
-
-    /** The default constructor, does nothing */
-    Tree();
-    /** The copy-constructor
-     *\param[in] x the reference object to copy */
-    Tree(const Tree &x);
-    /** The destructor, deallocates memory */
-    ~Tree();
-
-    /** The assignment operator
-     *\param[in] x the object that should be copied */
-    Tree &operator = (const Tree &x);
-
-    /** Get the number of elements in the Tree
-     *\return the number of elements in the Tree */
-    size_t count() const;
-    /** Add an element to the Tree
-     *\param[in] value the element */
-    void insert(StateBlockHandle key, void *value);
-    /** Attempts to find an element with the given key.
-     *\return the removed element */
-    void *lookup(StateBlockHandle key);
-    /** Attempts to find an element with the given key, then remove it. */
-    void remove(StateBlockHandle key);
-
-    /** Clear the Tree */
-    void clear();
-    /** Erase one Element */
-    Iterator erase(Iterator iter);
-
-    /** Get an iterator pointing to the beginning of the Vector
-     *\return iterator pointing to the beginning of the Vector */
-    Iterator begin()
+    /** Number of entries in the table. */
+    size_t count() const
     {
-      return Iterator(m_Begin);
-    }
-    /** Get a constant iterator pointing to the beginning of the Vector
-     *\return constant iterator pointing to the beginning of the Vector */
-    ConstIterator begin() const
-    {
-      return 0;
-    }
-    /** Get an iterator pointing to the last element + 1
-     *\return iterator pointing to the last element + 1 */
-    Iterator end()
-    {
-      return Iterator(0);
-    }
-    /** Get a constant iterator pointing to the last element + 1
-     *\return constant iterator pointing to the last element + 1 */
-    ConstIterator end() const
-    {
-      return 0;
+      return m_nItems;
     }
 
   private:
+    TcpConnectionTable(const TcpConnectionTable &);
+    TcpConnectionTable &operator = (const TcpConnectionTable &);
 
-    void rotateLeft(Node *n);
-    void rotateRight(Node *n);
-    size_t height(Node *n);
-    int balanceFactor(Node *n);
-    void rebalanceNode(Node *n);
+    struct Node
+    {
+      StateBlockHandle key;
+      StateBlock *value;
+      Node * volatile next;
+    };
 
-    void traverseNode_Insert(Node *n);
-    void traverseNode_Remove(Node *n);
+    struct Bucket
+    {
+      Bucket() : head(0), sequence(0), lock(false)
+      {};
 
-    // root node
-    Node *root;
-    size_t nItems;
+      Node * volatile head;
+      volatile uint32_t sequence;
+      Spinlock lock;
+    };
 
-    IteratorNode* m_Begin;
+    Bucket *getBucket(StateBlockHandle &key);
 
-    /** The actual container */
-    //Tree<void*,void*> m_VoidTree;
-};
+    Node *allocateNode();
+    void freeNode(Node *pNode);
 
-/** Tree template specialisation for integer keys and element pointers. Just forwards to the
- * void* template specialisation of Tree. */
-template<class V>
-class Tree<StateBlockHandle,V*>
-{
-  public:
-    /** Random-access iterator for the Vector */
-    typedef Tree<StateBlockHandle,void*>::Iterator      Iterator;
-    /** Contant random-access iterator for the Vector */
-    typedef Tree<StateBlockHandle,void*>::ConstIterator ConstIterator;
-
-    /** The default constructor, does nothing */
-    inline Tree()
-      : m_VoidTree(){};
-    /** The copy-constructor
-     *\param[in] x the reference object */
-    inline Tree(const Tree &x)
-      : m_VoidTree(x.m_VoidTree){}
-    /** The destructor, deallocates memory */
-    inline ~Tree()
-    {}
-
-    /** The assignment operator
-     *\param[in] x the object that should be copied */
-    inline Tree &operator = (const Tree &x)
-      {m_VoidTree = x.m_VoidTree;return *this;}
-
-    /** Get the number of elements in the Tree
-     *\return the number of elements in the Tree */
-    inline size_t count() const
-      {return m_VoidTree.count();}
-    /** Add an element to the Tree
-     *\param[in] value the element */
-    inline void insert(StateBlockHandle key, V *value)
-      {m_VoidTree.insert(key,reinterpret_cast<void*>(value));}
-    /** Attempts to find an element with the given key.
-     *\return the removed element */
-    inline V *lookup(StateBlockHandle key)
-      {return reinterpret_cast<V*>(m_VoidTree.lookup(key));}
-    /** Attempts to find an element with the given key, then remove it. */
-    inline void remove(StateBlockHandle key)
-      {return m_VoidTree.remove(key);}
-
-    /** Clear the Tree */
-    inline void clear()
-      {m_VoidTree.clear();}
-    /** Erase one Element */
-    Iterator erase(Iterator iter)
-      {return m_VoidTree.erase(iter);} //reinterpret_cast<Iterator>(m_VoidTree.erase(reinterpret_cast<typename Tree<void*,void*>::Iterator>(iter)));}
-
-    /** Get an iterator pointing to the beginning of the Vector
-     *\return iterator pointing to the beginning of the Vector */
-    inline Iterator begin()
-    {
-      return reinterpret_cast<Iterator>(m_VoidTree.begin());
-    }
-    /** Get a constant iterator pointing to the beginning of the Vector
-     *\return constant iterator pointing to the beginning of the Vector */
-    inline ConstIterator begin() const
-    {
-      return reinterpret_cast<ConstIterator>(m_VoidTree.begin());
-    }
-    /** Get an iterator pointing to the last element + 1
-     *\return iterator pointing to the last element + 1 */
-    inline Iterator end()
-    {
-      return reinterpret_cast<Iterator>(m_VoidTree.end());
-    }
-    /** Get a constant iterator pointing to the last element + 1
-     *\return constant iterator pointing to the last element + 1 */
-    inline ConstIterator end() const
-    {
-      return reinterpret_cast<ConstIterator>(m_VoidTree.end());
-    }
+    Bucket * volatile m_Buckets;
+    size_t m_nBuckets;
+    uint32_t m_Seed;
+    size_t m_nItems;
 
-  private:
-    /** The actual container */
-    Tree<StateBlockHandle,void*> m_VoidTree;
+    /** Removed nodes, waiting to be reused. */
+    Node *m_FreeNodes;
+
+    /** Protects m_FreeNodes, m_nItems and allocating the buckets. */
+    Spinlock m_Lock;
 };
 
 #endif
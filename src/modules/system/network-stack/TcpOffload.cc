@@ -0,0 +1,350 @@
+/*
+ * 
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "TcpOffload.h"
+#include "NetworkStack.h"
+#include "Ipv4.h"
+#include "Ipv6.h"
+#include "Tcp.h"
+#include <network/Checksum.h>
+#include <utilities/utility.h>
+
+/// IPv4 "more fragments" flag and fragment offset, in frag_offset.
+#define IPV4_FRAGMENT_MASK  0x3FFF
+
+/** Adds the pseudo-header for a TCP segment of nTcp bytes to sum, with the
+ *  addresses taken from the IP header in front of it. */
+static void addPseudoHeader(Checksum &sum, const uint8_t *pIp, size_t nTcp)
+{
+  uint8_t trailer[8];
+  memset(trailer, 0, sizeof(trailer));
+
+  if((pIp[0] >> 4) == 4)
+  {
+    // Source and destination, zero, protocol, length.
+    sum.add(&reinterpret_cast<const Ipv4::ipHeader*>(pIp)->ipSrc, 8);
+    trailer[1] = IP_TCP;
+    trailer[2] = (nTcp >> 8) & 0xFF;
+    trailer[3] = nTcp & 0xFF;
+    sum.add(trailer, 4);
+  }
+  else
+  {
+    // Source and destination, 32-bit length, zeroes, next header.
+    sum.add(reinterpret_cast<const Ipv6::ip6Header*>(pIp)->sourceAddress, 32);
+    trailer[2] = (nTcp >> 8) & 0xFF;
+    trailer[3] = nTcp & 0xFF;
+    trailer[7] = IP_TCP;
+    sum.add(trailer, 8);
+  }
+}
+
+size_t TcpOffload::segment(NetworkBuffer *pFrame, size_t linkLength, NetworkBuffer **pSegments, size_t maxSegments)
+{
+  size_t mss = pFrame->getSegmentSize();
+  if(!mss || !pFrame->linearise())
+    return 0;
+
+  const uint8_t *pData = pFrame->getData();
+  size_t nBytes = pFrame->getLength();
+  if(nBytes < (linkLength + sizeof(Ipv4::ipHeader)))
+    return 0;
+
+  const uint8_t *pIp = pData + linkLength;
+  uint8_t ipVersion = pIp[0] >> 4;
+  size_t ipLength = 0;
+  if(ipVersion == 4)
+    ipLength = reinterpret_cast<const Ipv4::ipHeader*>(pIp)->header_len * 4;
+  else if(ipVersion == 6)
+    ipLength = sizeof(Ipv6::ip6Header);
+  else
+    return 0;
+
+  if(nBytes < (linkLength + ipLength + sizeof(Tcp::tcpHeader)))
+    return 0;
+  const Tcp::tcpHeader *pTcp = reinterpret_cast<const Tcp::tcpHeader*>(pIp + ipLength);
+  size_t tcpLength = pTcp->offset * 4;
+  size_t headerLength = linkLength + ipLength + tcpLength;
+  if((tcpLength < sizeof(Tcp::tcpHeader)) || (nBytes <= headerLength))
+    return 0;
+
+  size_t nPayload = nBytes - headerLength;
+  size_t nSegments = (nPayload + mss - 1) / mss;
+  if(nSegments > maxSegments)
+    return 0;
+
+  uint32_t seq = BIG_TO_HOST32(pTcp->seqnum);
+  uint16_t id = (ipVersion == 4) ? BIG_TO_HOST16(reinterpret_cast<const Ipv4::ipHeader*>(pIp)->id) : 0;
+
+  size_t offset = 0;
+  for(size_t i = 0; i < nSegments; ++i)
+  {
+    size_t nSegment = nPayload - offset;
+    if(nSegment > mss)
+      nSegment = mss;
+
+    NetworkBuffer *pSegment = NetworkStack::instance().allocateBuffer(headerLength + nSegment);
+    if(!pSegment)
+    {
+      while(i--)
+        pSegments[i]->release();
+      return 0;
+    }
+    uint8_t *pOut = pSegment->put(headerLength + nSegment);
+
+    // The headers are the same for each segment but for a few fields, so
+    // they're copied whole and patched.
+    memcpy(pOut, pData, headerLength);
+    Checksum payloadSum;
+    payloadSum.copyAndAdd(pOut + headerLength, pData + headerLength + offset, nSegment);
+
+    uint8_t *pOutIp = pOut + linkLength;
+    if(ipVersion == 4)
+    {
+      Ipv4::ipHeader *pHeader = reinterpret_cast<Ipv4::ipHeader*>(pOutIp);
+      pHeader->len = HOST_TO_BIG16(ipLength + tcpLength + nSegment);
+      pHeader->id = HOST_TO_BIG16(static_cast<uint16_t>(id + i));
+      pHeader->checksum = 0;
+      pHeader->checksum = Network::calculateChecksum(reinterpret_cast<uintptr_t>(pHeader), ipLength);
+    }
+    else
+    {
+      Ipv6::ip6Header *pHeader = reinterpret_cast<Ipv6::ip6Header*>(pOutIp);
+      pHeader->payloadLength = HOST_TO_BIG16(tcpLength + nSegment);
+    }
+
+    // Only the last segment finishes a push (or the connection), and only
+    // the first carries CWR.
+    Tcp::tcpHeader *pHeader = reinterpret_cast<Tcp::tcpHeader*>(pOutIp + ipLength);
+    pHeader->seqnum = HOST_TO_BIG32(seq + offset);
+    if(i != (nSegments - 1))
+      pHeader->flags &= ~(Tcp::PSH | Tcp::FIN);
+    if(i)
+      pHeader->flags &= ~Tcp::CWR;
+
+    Checksum sum;
+    addPseudoHeader(sum, pOutIp, tcpLength + nSegment);
+    pHeader->checksum = 0;
+    sum.add(pHeader, tcpLength);
+    sum.add(payloadSum);
+    pHeader->checksum = sum.finish();
+
+    pSegments[i] = pSegment;
+    offset += nSegment;
+  }
+
+  return nSegments;
+}
+
+bool TcpOffload::parse(NetworkBuffer *pFrame, size_t linkLength, Segment &segment)
+{
+  if(!pFrame->isLinear())
+    return false;
+
+  const uint8_t *pData = pFrame->getData();
+  size_t nBytes = pFrame->getLength();
+  if(nBytes < (linkLength + sizeof(Ipv4::ipHeader)))
+    return false;
+
+  const uint8_t *pIp = pData + linkLength;
+  size_t nIp = nBytes - linkLength;
+  size_t ipLength = 0;
+  size_t nTcp = 0;
+
+  segment.ipVersion = pIp[0] >> 4;
+  if(segment.ipVersion == 4)
+  {
+    // No options, and not a fragment. The header checksum is checked here
+    // as the header is about to be rewritten.
+    const Ipv4::ipHeader *pHeader = reinterpret_cast<const Ipv4::ipHeader*>(pIp);
+    if((pHeader->header_len != 5) || (pHeader->type != IP_TCP))
+      return false;
+    if(BIG_TO_HOST16(pHeader->frag_offset) & IPV4_FRAGMENT_MASK)
+      return false;
+    if(BIG_TO_HOST16(pHeader->len) != nIp)
+      return false;
+    if(Network::calculateChecksum(reinterpret_cast<uintptr_t>(pHeader), sizeof(Ipv4::ipHeader)))
+      return false;
+
+    ipLength = sizeof(Ipv4::ipHeader);
+  }
+  else if(segment.ipVersion == 6)
+  {
+    // No extension headers.
+    if(nIp < sizeof(Ipv6::ip6Header))
+      return false;
+    const Ipv6::ip6Header *pHeader = reinterpret_cast<const Ipv6::ip6Header*>(pIp);
+    if(pHeader->nextHeader != IP_TCP)
+      return false;
+    if(BIG_TO_HOST16(pHeader->payloadLength) != (nIp - sizeof(Ipv6::ip6Header)))
+      return false;
+
+    ipLength = sizeof(Ipv6::ip6Header);
+  }
+  else
+    return false;
+
+  nTcp = nIp - ipLength;
+  if(nTcp < sizeof(Tcp::tcpHeader))
+    return false;
+
+  const Tcp::tcpHeader *pTcp = reinterpret_cast<const Tcp::tcpHeader*>(pIp + ipLength);
+  size_t tcpLength = pTcp->offset * 4;
+  if((tcpLength < sizeof(Tcp::tcpHeader)) || (tcpLength >= nTcp))
+    return false;
+
+  // Anything other than plain data (SYN, FIN, RST, URG, ECN signals) goes
+  // up on its own.
+  if((pTcp->flags & ~Tcp::PSH) != Tcp::ACK)
+    return false;
+
+  if(!pTcp->checksum)
+    return false;
+  Checksum sum;
+  addPseudoHeader(sum, pIp, nTcp);
+  sum.add(pTcp, nTcp);
+  if(sum.finish())
+    return false;
+
+  segment.ipOffset = linkLength;
+  segment.tcpOffset = linkLength + ipLength;
+  segment.payloadOffset = segment.tcpOffset + tcpLength;
+  segment.seq = BIG_TO_HOST32(pTcp->seqnum);
+  segment.ack = BIG_TO_HOST32(pTcp->acknum);
+  segment.flags = pTcp->flags;
+  segment.nPayload = nTcp - tcpLength;
+  segment.nSegments = 1;
+  segment.segmentSize = segment.nPayload;
+
+  pFrame->setChecksumValid(true);
+  return true;
+}
+
+bool TcpOffload::sameFlow(const NetworkBuffer *pA, const Segment &a, const NetworkBuffer *pB, const Segment &b)
+{
+  if((a.ipVersion != b.ipVersion) || (a.ipOffset != b.ipOffset))
+    return false;
+
+  const uint8_t *pDataA = pA->getData();
+  const uint8_t *pDataB = pB->getData();
+  if(memcmp(pDataA, pDataB, a.ipOffset))
+    return false;
+
+  const uint8_t *pIpA = pDataA + a.ipOffset;
+  const uint8_t *pIpB = pDataB + b.ipOffset;
+  if(a.ipVersion == 4)
+  {
+    if(memcmp(&reinterpret_cast<const Ipv4::ipHeader*>(pIpA)->ipSrc,
+              &reinterpret_cast<const Ipv4::ipHeader*>(pIpB)->ipSrc, 8))
+      return false;
+  }
+  else if(memcmp(reinterpret_cast<const Ipv6::ip6Header*>(pIpA)->sourceAddress,
+                 reinterpret_cast<const Ipv6::ip6Header*>(pIpB)->sourceAddress, 32))
+    return false;
+
+  // Source and destination ports.
+  return !memcmp(pDataA + a.tcpOffset, pDataB + b.tcpOffset, 4);
+}
+
+bool TcpOffload::merge(NetworkBuffer *pHeld, Segment &held, NetworkBuffer *pNext, const Segment &next)
+{
+  // A push ends a run, as does a short segment.
+  if(held.flags & Tcp::PSH)
+    return false;
+  if(held.nPayload != (held.nSegments * held.segmentSize))
+    return false;
+  if(next.nPayload > held.segmentSize)
+    return false;
+  if((held.nSegments >= TCP_GSO_MAX_SEGMENTS) || ((held.nPayload + next.nPayload) > TCP_GSO_MAX_SIZE))
+    return false;
+
+  if(held.payloadOffset != next.payloadOffset)
+    return false;
+  if((next.seq != (held.seq + held.nPayload)) || (next.ack != held.ack))
+    return false;
+  if(!sameFlow(pHeld, held, pNext, next))
+    return false;
+
+  // The headers are rewritten in place.
+  if(pHeld->isShared())
+    return false;
+
+  // The same ECN marking, and the same options (which have to match exactly
+  // - timestamps included - or the merged segment would misrepresent some).
+  uint8_t *pHeldData = pHeld->getData();
+  const uint8_t *pNextData = pNext->getData();
+  if(held.ipVersion == 4)
+  {
+    const Ipv4::ipHeader *pA = reinterpret_cast<const Ipv4::ipHeader*>(pHeldData + held.ipOffset);
+    const Ipv4::ipHeader *pB = reinterpret_cast<const Ipv4::ipHeader*>(pNextData + next.ipOffset);
+    if(pA->tos != pB->tos)
+      return false;
+  }
+  else if(memcmp(pHeldData + held.ipOffset, pNextData + next.ipOffset, 4))
+    return false;
+
+  Tcp::tcpHeader *pHeldTcp = reinterpret_cast<Tcp::tcpHeader*>(pHeldData + held.tcpOffset);
+  const Tcp::tcpHeader *pNextTcp = reinterpret_cast<const Tcp::tcpHeader*>(pNextData + next.tcpOffset);
+  size_t nOptions = held.payloadOffset - held.tcpOffset - sizeof(Tcp::tcpHeader);
+  if(nOptions && memcmp(pHeldTcp + 1, pNextTcp + 1, nOptions))
+    return false;
+
+  // The merged segment advertises the latest window, and any push.
+  pHeldTcp->winsize = pNextTcp->winsize;
+  pHeldTcp->flags |= next.flags;
+
+  pNext->pull(next.payloadOffset);
+  pHeld->append(pNext);
+
+  held.flags |= next.flags;
+  held.nPayload += next.nPayload;
+  ++held.nSegments;
+  return true;
+}
+
+bool TcpOffload::finish(NetworkBuffer *pHeld, const Segment &held)
+{
+  if(held.nSegments == 1)
+    return true;
+
+  if(!pHeld->linearise())
+    return false;
+
+  size_t nTcp = held.payloadOffset - held.tcpOffset + held.nPayload;
+  uint8_t *pIp = pHeld->getData() + held.ipOffset;
+  if(held.ipVersion == 4)
+  {
+    Ipv4::ipHeader *pHeader = reinterpret_cast<Ipv4::ipHeader*>(pIp);
+    pHeader->len = HOST_TO_BIG16(sizeof(Ipv4::ipHeader) + nTcp);
+    pHeader->checksum = 0;
+    pHeader->checksum = Network::calculateChecksum(reinterpret_cast<uintptr_t>(pHeader), sizeof(Ipv4::ipHeader));
+  }
+  else
+  {
+    Ipv6::ip6Header *pHeader = reinterpret_cast<Ipv6::ip6Header*>(pIp);
+    pHeader->payloadLength = HOST_TO_BIG16(nTcp);
+  }
+
+  // Each segment's checksum was checked as it came in; the one in the
+  // header now covers only the first.
+  pHeld->setSegmentSize(held.segmentSize);
+  pHeld->setChecksumValid(true);
+  return true;
+}
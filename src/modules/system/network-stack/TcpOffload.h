@@ -0,0 +1,104 @@
+/*
+ * 
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MACHINE_TCPOFFLOAD_H
+#define MACHINE_TCPOFFLOAD_H
+
+#include <processor/types.h>
+#include <network/NetworkBuffer.h>
+
+/// Most payload one TCP packet carries through the stack when it's going to
+/// be segmented (or has been coalesced) - it still has to fit in one IP
+/// packet, headers and all.
+#define TCP_GSO_MAX_SIZE        64000
+
+/// Most segments such a packet is made up of.
+#define TCP_GSO_MAX_SEGMENTS    64
+
+/**
+ * Software TCP segmentation and receive offload.
+ *
+ * On the way out, TCP hands a run of full-sized segments to IP as one large
+ * packet, so that they go through the stack (and get their headers built)
+ * once. Just before the packet reaches the driver, segment() splits it back
+ * into segments the link can carry - unless the card can do that itself
+ * (see Network::canSegment).
+ *
+ * On the way in, the receive workers use parse() and merge() to coalesce
+ * back-to-back segments of a flow found in the same batch, so that TCP
+ * handles the burst as one segment rather than one at a time.
+ */
+class TcpOffload
+{
+  public:
+    /** A received segment that can be coalesced with others. */
+    struct Segment
+    {
+      /// Offsets of the headers and payload in the frame.
+      size_t ipOffset;
+      size_t tcpOffset;
+      size_t payloadOffset;
+
+      /// IP version (4 or 6).
+      uint8_t ipVersion;
+
+      uint32_t seq;
+      uint32_t ack;
+      uint8_t flags;
+
+      /// Payload, and the segments it came in, once others are merged.
+      size_t nPayload;
+      size_t nSegments;
+
+      /// Payload of the first segment. All but the last of those merged
+      /// carry exactly this much.
+      size_t segmentSize;
+    };
+
+    /** Splits pFrame, a packet with getSegmentSize() set, into frames the
+     *  link can carry, each with its own copy of the headers (and its own
+     *  IP and TCP checksums). The caller keeps its reference to pFrame.
+     *  \param linkLength Bytes of link header in front of the IP header.
+     *  \return the number of frames written to pSegments, or zero if it
+     *          couldn't be split (or needs more than maxSegments). */
+    static size_t segment(NetworkBuffer *pFrame, size_t linkLength, NetworkBuffer **pSegments, size_t maxSegments);
+
+    /** Is pFrame a TCP segment that can be coalesced - one carrying data,
+     *  with only ACK and PSH set, and not an IP fragment? If so its
+     *  checksums are checked and segment is filled in.
+     *  \param linkLength Bytes of link header in front of the IP header. */
+    static bool parse(NetworkBuffer *pFrame, size_t linkLength, Segment &segment);
+
+    /** Are two segments parse() accepted from the same flow (and, for
+     *  frames, between the same link addresses)? */
+    static bool sameFlow(const NetworkBuffer *pA, const Segment &a, const NetworkBuffer *pB, const Segment &b);
+
+    /** Appends next's payload to pHeld if next carries on exactly where it
+     *  leaves off, in the same flow, with the same ACK and options. Returns
+     *  true if so, having taken over the reference to pNext. */
+    static bool merge(NetworkBuffer *pHeld, Segment &held, NetworkBuffer *pNext, const Segment &next);
+
+    /** Gathers a packet built up by merge() into one piece, and fixes up
+     *  its headers to cover everything merged into it. Returns false if
+     *  memory couldn't be found, in which case the packet is unusable. */
+    static bool finish(NetworkBuffer *pHeld, const Segment &held);
+};
+
+#endif
@@ -0,0 +1,976 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "TcpManager.h"
+#include "TcpStateBlock.h"
+#include "RoutingTable.h"
+#include "NetworkStatistics.h"
+#include "TcpOffload.h"
+#include "NetworkStack.h"
+#include <Log.h>
+
+/** Writes a 32-bit option field in network byte order. */
+static inline void putOptionWord(uint8_t *p, uint32_t x)
+{
+  p[0] = (x >> 24) & 0xFF;
+  p[1] = (x >> 16) & 0xFF;
+  p[2] = (x >> 8) & 0xFF;
+  p[3] = x & 0xFF;
+}
+
+StateBlock::StateBlock() :
+  currentState(Tcp::CLOSED), localPort(0), remoteHost(),
+  iss(0), snd_nxt(0), snd_una(0), snd_wnd(0), snd_up(0), snd_wl1(0), snd_wl2(0),
+  snd_max(0), snd_queued(0),
+  rcv_nxt(0), rcv_wnd(0), rcv_up(0), irs(0),
+  seg_seq(0), seg_ack(0), seg_len(0), seg_wnd(0), seg_up(0), seg_prc(0),
+  fin_ack(false), fin_seq(0), tcp_mss(536), // (standard default for MSS)
+  local_mss(TCP_DEFAULT_MSS),
+  wscale_ok(false), snd_wscale(0), rcv_wscale(0), ts_ok(false), ts_recent(0),
+  sack_ok(false), srtt(0), rttvar(0), rto(TCP_RTO_INITIAL), rto_backoff(0),
+  dup_acks(0), in_recovery(false), recover(0), retransmits(0),
+  congestion(TcpCongestionControl::create(536)),
+  numEndpointPackets(0), /// \todo Remove, obsolete
+  waitState(0), endpoint(0), connId(0),
+  sendQueue(), retransmitQueue(), outOfOrderQueue(), nRemovedFromRetransmit(0),
+  backlog(0), synQueueLength(0), inSynQueue(false), keepalive(false),
+  m_HighestSacked(0), m_LastOutOfOrder(0), m_Timer(this, &StateBlock::timeout),
+  m_DelayedAckTimer(this, &StateBlock::delayedAckTimeout), m_nUnacked(0),
+  m_KeepaliveTimer(this, &StateBlock::keepaliveTimeout), m_nKeepaliveProbes(0),
+  m_LastReceived(0)
+{
+}
+
+StateBlock::~StateBlock()
+{
+  // A callback may be running on another CPU (possibly the one that
+  // decided to free us).
+  TimerWheel &wheel = TcpManager::instance().getTimerWheel();
+  wheel.cancelAndWait(&m_Timer);
+  wheel.cancelAndWait(&m_DelayedAckTimer);
+  wheel.cancelAndWait(&m_KeepaliveTimer);
+
+  while(sendQueue.count())
+    freeSegment(sendQueue.popFront());
+  while(retransmitQueue.count())
+    freeSegment(retransmitQueue.popFront());
+  while(outOfOrderQueue.count())
+    freeSegment(outOfOrderQueue.popFront());
+
+  delete congestion;
+}
+
+void StateBlock::freeSegment(Segment *seg)
+{
+  if(seg->pAllocation)
+    delete [] seg->pAllocation;
+  delete seg;
+}
+
+void StateBlock::offerOptions()
+{
+  wscale_ok = ts_ok = sack_ok = true;
+
+  // Connections over loopback can use much bigger segments.
+  IpAddress dest = remoteHost.ip;
+  Network *pCard = RoutingTable::instance().DetermineRoute(&dest);
+  local_mss = NetworkStack::instance().isLoopback(pCard) ? TCP_LOOPBACK_MSS : TCP_DEFAULT_MSS;
+
+  // Scale our window so the whole receive buffer can be advertised.
+  rcv_wscale = 0;
+  while((rcv_wscale < 14) && ((TCP_BUFFER_SIZE >> rcv_wscale) > 0xFFFF))
+    ++rcv_wscale;
+}
+
+void StateBlock::acceptOptions(const Tcp::TcpOptions &options)
+{
+  if(options.mss)
+    tcp_mss = options.mss < local_mss ? options.mss : local_mss;
+  else
+    tcp_mss = 536;
+  congestion->setMss(tcp_mss);
+
+  // Window scaling only happens if both sides asked for it.
+  wscale_ok = wscale_ok && options.bWindowScale;
+  if(wscale_ok)
+    snd_wscale = options.windowScale;
+  else
+    snd_wscale = rcv_wscale = 0;
+
+  sack_ok = sack_ok && options.bSackPermitted;
+
+  ts_ok = ts_ok && options.bTimestamp;
+  if(ts_ok)
+    ts_recent = options.tsVal;
+}
+
+size_t StateBlock::buildOptions(uint8_t flags, uint8_t *pOptions)
+{
+  size_t n = 0;
+
+  if(flags & Tcp::SYN)
+  {
+    pOptions[n++] = Tcp::OPT_MSS;
+    pOptions[n++] = 4;
+    pOptions[n++] = (local_mss >> 8) & 0xFF;
+    pOptions[n++] = local_mss & 0xFF;
+
+    if(sack_ok)
+    {
+      pOptions[n++] = Tcp::OPT_NOP;
+      pOptions[n++] = Tcp::OPT_NOP;
+      pOptions[n++] = Tcp::OPT_SACK_PERMITTED;
+      pOptions[n++] = 2;
+    }
+
+    if(wscale_ok)
+    {
+      pOptions[n++] = Tcp::OPT_NOP;
+      pOptions[n++] = Tcp::OPT_WSS;
+      pOptions[n++] = 3;
+      pOptions[n++] = rcv_wscale;
+    }
+  }
+
+  if(ts_ok)
+  {
+    pOptions[n++] = Tcp::OPT_NOP;
+    pOptions[n++] = Tcp::OPT_NOP;
+    pOptions[n++] = Tcp::OPT_TMSTAMP;
+    pOptions[n++] = 10;
+    putOptionWord(&pOptions[n], static_cast<uint32_t>(NetworkStack::getTickCount()));
+    putOptionWord(&pOptions[n + 4], ts_recent);
+    n += 8;
+  }
+
+  if(!(flags & Tcp::SYN) && sack_ok && outOfOrderQueue.count())
+  {
+    // Merge what we're holding into contiguous ranges.
+    const size_t maxRanges = 16;
+    uint32_t left[maxRanges], right[maxRanges];
+    size_t nRanges = 0;
+    for(size_t i = 0; i < outOfOrderQueue.count(); ++i)
+    {
+      Segment *seg = outOfOrderQueue[i];
+      uint32_t end = seg->seg_seq + seg->seg_len;
+      if(nRanges && Tcp::seqLessEqual(seg->seg_seq, right[nRanges - 1]))
+      {
+        if(Tcp::seqGreater(end, right[nRanges - 1]))
+          right[nRanges - 1] = end;
+      }
+      else if(nRanges < maxRanges)
+      {
+        left[nRanges] = seg->seg_seq;
+        right[nRanges] = end;
+        ++nRanges;
+      }
+    }
+
+    size_t maxBlocks = (TCP_MAX_OPTIONS_LENGTH - n - 4) / 8;
+    if(maxBlocks > TCP_MAX_SACK_BLOCKS)
+      maxBlocks = TCP_MAX_SACK_BLOCKS;
+
+    // The block holding the most recent arrival goes first (RFC 2018
+    // section 4), then the rest in sequence order.
+    size_t first = 0;
+    for(size_t i = 0; i < nRanges; ++i)
+    {
+      if(Tcp::seqLessEqual(left[i], m_LastOutOfOrder) && Tcp::seqLess(m_LastOutOfOrder, right[i]))
+      {
+        first = i;
+        break;
+      }
+    }
+
+    size_t nBlocks = nRanges < maxBlocks ? nRanges : maxBlocks;
+    pOptions[n++] = Tcp::OPT_NOP;
+    pOptions[n++] = Tcp::OPT_NOP;
+    pOptions[n++] = Tcp::OPT_SACK;
+    pOptions[n++] = 2 + (8 * nBlocks);
+
+    putOptionWord(&pOptions[n], left[first]);
+    putOptionWord(&pOptions[n + 4], right[first]);
+    n += 8;
+    for(size_t i = 0, added = 1; (i < nRanges) && (added < nBlocks); ++i)
+    {
+      if(i == first)
+        continue;
+      putOptionWord(&pOptions[n], left[i]);
+      putOptionWord(&pOptions[n + 4], right[i]);
+      n += 8;
+      ++added;
+    }
+  }
+
+  return n;
+}
+
+uint16_t StateBlock::advertisedWindow(bool bSyn)
+{
+  // Windows in SYNs are never scaled.
+  uint32_t window = rcv_wnd;
+  if(!bSyn && wscale_ok)
+    window >>= rcv_wscale;
+  if(window > 0xFFFF)
+    window = 0xFFFF;
+  return window;
+}
+
+bool StateBlock::sendControl(uint8_t flags, uint32_t seq)
+{
+  uint8_t options[TCP_MAX_OPTIONS_LENGTH];
+  size_t nOptionBytes = buildOptions(flags, options);
+  uint32_t ack = 0;
+  if(flags & Tcp::ACK)
+  {
+    ack = rcv_nxt;
+    ackSent();
+  }
+  return Tcp::send(remoteHost.ip, localPort, remoteHost.remotePort, seq, ack, flags, advertisedWindow(flags & Tcp::SYN), 0, 0, options, nOptionBytes);
+}
+
+bool StateBlock::sendSegment(Segment* seg)
+{
+  if(!seg)
+    return false;
+
+  return sendSegments(&seg, 1);
+}
+
+bool StateBlock::sendSegments(Segment **pSegments, size_t nSegments)
+{
+  Segment *first = pSegments[0];
+  Segment *last = pSegments[nSegments - 1];
+
+  // Always acknowledge (and advertise) the latest, even on a retransmission.
+  uint32_t ack = (first->flags & Tcp::ACK) ? rcv_nxt : 0;
+  if(first->flags & Tcp::ACK)
+    ackSent();
+  uint32_t wnd = advertisedWindow(first->flags & Tcp::SYN);
+  uint64_t now = NetworkStack::getTickCount();
+
+  Tcp::PayloadPiece pieces[TCP_GSO_MAX_SEGMENTS];
+  for(size_t i = 0; i < nSegments; ++i)
+  {
+    Segment *seg = pSegments[i];
+    seg->seg_ack = ack;
+    seg->seg_wnd = wnd;
+    seg->sentAt = now;
+
+    if(seg->bRetransmitted)
+    {
+      ++retransmits;
+      NETSTAT_INC(TcpRetransSegs);
+    }
+
+    pieces[i].payload = seg->payload;
+    pieces[i].nBytes = seg->payload ? seg->nBytes : 0;
+  }
+
+  uint8_t options[TCP_MAX_OPTIONS_LENGTH];
+  size_t nOptionBytes = buildOptions(first->flags, options);
+  return Tcp::send(remoteHost.ip, localPort, remoteHost.remotePort, first->seg_seq, ack, last->flags, wnd, pieces, nSegments, (nSegments > 1) ? tcp_mss : 0, options, nOptionBytes);
+}
+
+bool StateBlock::canFollow(const Segment *prev, const Segment *next)
+{
+  // Everything but the last segment of the run is full-sized, and only the
+  // last may push or finish.
+  if((prev->seg_len != tcp_mss) || (prev->nBytes != prev->seg_len) || !prev->payload)
+    return false;
+  if(prev->flags & (Tcp::PSH | Tcp::FIN | Tcp::SYN | Tcp::RST | Tcp::URG))
+    return false;
+  if((next->flags & ~(Tcp::PSH | Tcp::FIN)) != prev->flags)
+    return false;
+  if(!next->seg_len || !next->payload || (next->nBytes != next->seg_len))
+    return false;
+
+  return next->seg_seq == (prev->seg_seq + prev->seg_len);
+}
+
+void StateBlock::queueSegment(uint8_t flags, size_t nBytes, uintptr_t payload)
+{
+  // split the passed buffer up into segments based on the MSS
+  size_t offset = 0;
+  do
+  {
+    Segment* seg = new Segment;
+
+    size_t segmentSize = nBytes - offset;
+    if(segmentSize > tcp_mss)
+      segmentSize = tcp_mss;
+
+    seg->flags = flags;
+    if(nBytes && ((offset + segmentSize) >= nBytes))
+      seg->flags |= Tcp::PSH;
+
+    seg->seg_seq = snd_queued;
+    seg->seg_ack = 0;
+    seg->seg_len = segmentSize;
+    seg->seg_wnd = 0;
+    seg->seg_up = 0;
+    seg->nBytes = segmentSize;
+    seg->sentAt = 0;
+    seg->bRetransmitted = false;
+    seg->bSacked = false;
+
+    if(segmentSize && payload)
+    {
+      seg->pAllocation = new uint8_t[segmentSize];
+      memcpy(seg->pAllocation, reinterpret_cast<void*>(payload + offset), segmentSize);
+      seg->payload = reinterpret_cast<uintptr_t>(seg->pAllocation);
+    }
+    else
+    {
+      seg->pAllocation = 0;
+      seg->payload = 0;
+    }
+
+    snd_queued += seg->seqLength();
+    sendQueue.pushBack(seg);
+
+    offset += segmentSize;
+  } while(offset < nBytes);
+}
+
+bool StateBlock::sendSegment(uint8_t flags, size_t nBytes, uintptr_t payload, bool addToRetransmitQueue)
+{
+  if(addToRetransmitQueue || sendQueue.count())
+  {
+    queueSegment(flags, nBytes, payload);
+    transmitPending();
+    return true;
+  }
+
+  // Fire and forget (eg, RST). Nothing's queued, so snd_nxt is snd_queued.
+  size_t offset = 0;
+  do
+  {
+    size_t segmentSize = nBytes - offset;
+    if(segmentSize > tcp_mss)
+      segmentSize = tcp_mss;
+
+    Segment seg;
+    seg.seg_seq = snd_nxt;
+    seg.seg_ack = 0;
+    seg.seg_len = segmentSize;
+    seg.seg_wnd = 0;
+    seg.seg_up = 0;
+    seg.flags = flags;
+    if(nBytes && ((offset + segmentSize) >= nBytes))
+      seg.flags |= Tcp::PSH;
+    seg.payload = payload ? payload + offset : 0;
+    seg.nBytes = payload ? segmentSize : 0;
+    seg.pAllocation = 0;
+    seg.bRetransmitted = seg.bSacked = false;
+
+    sendSegment(&seg);
+
+    snd_nxt += seg.seqLength();
+    offset += segmentSize;
+  } while(offset < nBytes);
+
+  snd_queued = snd_nxt;
+  if(Tcp::seqGreater(snd_nxt, snd_max))
+    snd_max = snd_nxt;
+
+  return true;
+}
+
+void StateBlock::sendSyn(bool bAck)
+{
+  snd_una = snd_nxt = snd_max = snd_queued = iss;
+  recover = m_HighestSacked = iss;
+
+  queueSegment(Tcp::SYN | (bAck ? Tcp::ACK : 0), 0, 0);
+  transmitPending();
+}
+
+void StateBlock::sendFin()
+{
+  fin_seq = snd_queued;
+
+  queueSegment(Tcp::FIN | Tcp::ACK, 0, 0);
+  transmitPending();
+}
+
+void StateBlock::transmitPending(bool bForce)
+{
+  bool bSent = false;
+  while(sendQueue.count())
+  {
+    Segment *seg = *sendQueue.begin();
+
+    // Data is limited by both the receiver's window and the congestion
+    // window. SYN and FIN on their own always go.
+    uint32_t flight = snd_nxt - snd_una;
+    uint32_t window = congestion->getWindow();
+    if(snd_wnd < window)
+      window = snd_wnd;
+    if(seg->seg_len && !bForce)
+    {
+      if((flight + seg->seg_len) > window)
+      {
+        // With nothing in flight, no ACK is coming to open the window, so
+        // the timer has to (the persist timer, RFC 1122 4.2.2.17).
+        if(!flight && !timerPending())
+          startRetransmitTimer();
+        break;
+      }
+    }
+
+    // Full-sized segments that the windows also allow go out along with
+    // this one, as a single packet that's split up on its way out.
+    Segment *run[TCP_GSO_MAX_SEGMENTS];
+    size_t nRun = 0;
+    size_t nBytes = seg->seg_len;
+    run[nRun++] = sendQueue.popFront();
+    while(!bForce && sendQueue.count() && (nRun < TCP_GSO_MAX_SEGMENTS))
+    {
+      Segment *next = *sendQueue.begin();
+      if(!canFollow(run[nRun - 1], next))
+        break;
+      if(((nBytes + next->seg_len) > TCP_GSO_MAX_SIZE) || ((flight + nBytes + next->seg_len) > window))
+        break;
+
+      nBytes += next->seg_len;
+      run[nRun++] = sendQueue.popFront();
+    }
+    bForce = false;
+
+    sendSegments(run, nRun);
+
+    for(size_t i = 0; i < nRun; ++i)
+    {
+      seg = run[i];
+      retransmitQueue.pushBack(seg);
+
+      uint32_t end = seg->seg_seq + seg->seqLength();
+      if(Tcp::seqGreater(end, snd_nxt))
+        snd_nxt = end;
+    }
+    if(Tcp::seqGreater(snd_nxt, snd_max))
+      snd_max = snd_nxt;
+
+    bSent = true;
+  }
+
+  if(bSent && !timerPending())
+    startRetransmitTimer();
+}
+
+void StateBlock::startRetransmitTimer()
+{
+  uint64_t timeout = static_cast<uint64_t>(rto) << rto_backoff;
+  if(timeout > TCP_RTO_MAX)
+    timeout = TCP_RTO_MAX;
+
+  TcpManager::instance().getTimerWheel().schedule(&m_Timer, timeout);
+}
+
+void StateBlock::resetTimer(uint32_t timeout)
+{
+  TcpManager::instance().getTimerWheel().schedule(&m_Timer, timeout * 1000ULL);
+}
+
+void StateBlock::stopTimer()
+{
+  TcpManager::instance().getTimerWheel().cancel(&m_Timer);
+}
+
+void StateBlock::ackLater(size_t nBytes)
+{
+  // Every second full-sized segment is acked straight away, so the sender's
+  // window keeps growing (RFC 5681 section 4.2). A segment coalesced from
+  // several counts as all of them.
+  m_nUnacked += (nBytes > tcp_mss) ? ((nBytes + tcp_mss - 1) / tcp_mss) : 1;
+  if(m_nUnacked >= 2)
+  {
+    if(!sendAck())
+      WARNING("TCP: Sending ACK for incoming data failed!");
+    return;
+  }
+
+  if(!m_DelayedAckTimer.isPending())
+    TcpManager::instance().getTimerWheel().schedule(&m_DelayedAckTimer, TCP_DELAYED_ACK);
+}
+
+void StateBlock::ackSent()
+{
+  if(!m_nUnacked)
+    return;
+
+  m_nUnacked = 0;
+  TcpManager::instance().getTimerWheel().cancel(&m_DelayedAckTimer);
+}
+
+void StateBlock::segmentArrived()
+{
+  // Keepalive only looks at this when its timer runs out.
+  if(keepalive)
+    m_LastReceived = NetworkStack::getTickCount();
+}
+
+void StateBlock::setKeepalive(bool bEnable)
+{
+  keepalive = bEnable;
+  m_nKeepaliveProbes = 0;
+
+  TimerWheel &wheel = TcpManager::instance().getTimerWheel();
+  if(bEnable)
+  {
+    m_LastReceived = NetworkStack::getTickCount();
+    wheel.schedule(&m_KeepaliveTimer, TCP_KEEPALIVE_IDLE * 1000ULL);
+  }
+  else
+    wheel.cancel(&m_KeepaliveTimer);
+}
+
+void StateBlock::updateRtt(uint32_t rtt)
+{
+  if(!srtt)
+  {
+    // First measurement: SRTT = R, RTTVAR = R/2
+    srtt = rtt << 3;
+    rttvar = rtt << 1;
+  }
+  else
+  {
+    // SRTT = 7/8 SRTT + 1/8 R, RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|
+    int32_t delta = static_cast<int32_t>(rtt) - static_cast<int32_t>(srtt >> 3);
+    srtt = static_cast<uint32_t>(static_cast<int32_t>(srtt) + delta);
+    if(delta < 0)
+      delta = -delta;
+    rttvar = rttvar + delta - (rttvar >> 2);
+  }
+
+  // RTO = SRTT + max(G, 4 * RTTVAR), with a clock granularity of 1ms.
+  rto = (srtt >> 3) + (rttvar ? rttvar : 1);
+  if(rto < TCP_RTO_MIN)
+    rto = TCP_RTO_MIN;
+  else if(rto > TCP_RTO_MAX)
+    rto = TCP_RTO_MAX;
+}
+
+size_t StateBlock::removeAcked(List<Segment*> &queue, uint32_t ack, int64_t &rtt, uint64_t now)
+{
+  size_t nBytes = 0;
+  while(queue.count())
+  {
+    Segment *seg = *queue.begin();
+    if(Tcp::seqLessEqual(seg->seg_seq + seg->seqLength(), ack))
+    {
+      queue.popFront();
+      nBytes += seg->seg_len;
+
+      // Karn's algorithm: a retransmitted segment's ACK is ambiguous.
+      if(!seg->bRetransmitted && seg->sentAt)
+        rtt = now - seg->sentAt;
+
+      freeSegment(seg);
+      continue;
+    }
+
+    if(Tcp::seqLess(seg->seg_seq, ack))
+    {
+      // Partially acked: drop what the receiver has from the front.
+      uint32_t n = ack - seg->seg_seq;
+      if(seg->flags & Tcp::SYN)
+      {
+        seg->flags &= ~Tcp::SYN;
+        ++seg->seg_seq;
+        --n;
+      }
+      if(n > seg->seg_len)
+        n = seg->seg_len;
+
+      seg->seg_seq += n;
+      seg->seg_len -= n;
+      if(seg->payload)
+      {
+        seg->payload += n;
+        seg->nBytes -= n;
+      }
+      nBytes += n;
+    }
+    break;
+  }
+
+  return nBytes;
+}
+
+void StateBlock::markSacked(const Tcp::TcpOptions &options)
+{
+  for(size_t i = 0; i < options.nSackBlocks; ++i)
+  {
+    uint32_t left = options.sackLeft[i];
+    uint32_t right = options.sackRight[i];
+    if(!Tcp::seqLess(left, right) || Tcp::seqLessEqual(right, snd_una) || Tcp::seqGreater(right, snd_max))
+      continue;
+
+    if(Tcp::seqGreater(right, m_HighestSacked))
+      m_HighestSacked = right;
+
+    for(List<Segment*>::Iterator it = retransmitQueue.begin(); it != retransmitQueue.end(); ++it)
+    {
+      Segment *seg = *it;
+      if(Tcp::seqGreaterEqual(seg->seg_seq, right))
+        break;
+      if(Tcp::seqGreaterEqual(seg->seg_seq, left) && Tcp::seqLessEqual(seg->seg_seq + seg->seqLength(), right))
+        seg->bSacked = true;
+    }
+  }
+}
+
+void StateBlock::retransmitFirst()
+{
+  for(List<Segment*>::Iterator it = retransmitQueue.begin(); it != retransmitQueue.end(); ++it)
+  {
+    Segment *seg = *it;
+    if(seg->bSacked)
+      continue;
+
+    seg->bRetransmitted = true;
+    sendSegment(seg);
+    return;
+  }
+}
+
+void StateBlock::retransmitNextHole()
+{
+  for(List<Segment*>::Iterator it = retransmitQueue.begin(); it != retransmitQueue.end(); ++it)
+  {
+    Segment *seg = *it;
+    if(Tcp::seqGreaterEqual(seg->seg_seq, m_HighestSacked))
+      return;
+    if(seg->bSacked || seg->bRetransmitted)
+      continue;
+
+    seg->bRetransmitted = true;
+    sendSegment(seg);
+    return;
+  }
+}
+
+void StateBlock::updateTimestamp(const Tcp::TcpOptions &options)
+{
+  // RFC 7323 section 4.3: only from segments at or before the left edge of
+  // the window, so the echoed value reflects the oldest unacked data.
+  if(ts_ok && options.bTimestamp && Tcp::seqLessEqual(seg_seq, rcv_nxt))
+    ts_recent = options.tsVal;
+}
+
+void StateBlock::processAck(const Tcp::TcpOptions &options, uint8_t flags)
+{
+  uint64_t now = NetworkStack::getTickCount();
+
+  // Window update (RFC 793 page 72), only from segments newer than the one
+  // that last updated it.
+  bool bWindowChanged = false;
+  if(Tcp::seqLessEqual(snd_una, seg_ack) && Tcp::seqLessEqual(seg_ack, snd_max))
+  {
+    if(Tcp::seqLess(snd_wl1, seg_seq) || ((snd_wl1 == seg_seq) && Tcp::seqLessEqual(snd_wl2, seg_ack)))
+    {
+      bWindowChanged = (snd_wnd != seg_wnd);
+      snd_wnd = seg_wnd;
+      snd_wl1 = seg_seq;
+      snd_wl2 = seg_ack;
+    }
+  }
+
+  if(sack_ok && options.nSackBlocks)
+    markSacked(options);
+
+  if(Tcp::seqGreater(seg_ack, snd_una) && Tcp::seqLessEqual(seg_ack, snd_max))
+  {
+    // New data acked.
+    int64_t rtt = -1;
+    size_t nAcked = removeAcked(retransmitQueue, seg_ack, rtt, now);
+
+    // Anything sent before a timeout but since pulled back for resending.
+    nAcked += removeAcked(sendQueue, seg_ack, rtt, now);
+
+    // Timestamps give a sample for every ACK, retransmission or not.
+    if(ts_ok && options.bTimestamp && options.tsEcr)
+      rtt = static_cast<uint32_t>(now) - options.tsEcr;
+    if(rtt >= 0)
+      updateRtt(static_cast<uint32_t>(rtt));
+
+    snd_una = seg_ack;
+    if(Tcp::seqLess(snd_nxt, snd_una))
+      snd_nxt = snd_una;
+    rto_backoff = 0;
+    dup_acks = 0;
+
+    if(in_recovery)
+    {
+      if(Tcp::seqGreaterEqual(seg_ack, recover))
+      {
+        in_recovery = false;
+        congestion->exitRecovery(snd_nxt - snd_una);
+      }
+      else
+      {
+        // Partial ACK: the next hole is lost too.
+        congestion->partialAck(nAcked);
+        retransmitFirst();
+      }
+    }
+    else
+      congestion->acked(nAcked, srtt >> 3, now);
+
+    if(retransmitQueue.count())
+      startRetransmitTimer();
+    else
+      stopTimer();
+  }
+  else if((seg_ack == snd_una) && !seg_len && !(flags & (Tcp::SYN | Tcp::FIN)) &&
+          !bWindowChanged && retransmitQueue.count())
+  {
+    // Duplicate ACK (RFC 5681 section 2).
+    ++dup_acks;
+    if(in_recovery)
+    {
+      congestion->recoveryDupAck();
+      if(sack_ok)
+        retransmitNextHole();
+    }
+    else if((dup_acks == 3) && Tcp::seqGreater(seg_ack, recover))
+    {
+      // Fast retransmit, and into fast recovery until everything that's
+      // outstanding now is acked (RFC 6582).
+      in_recovery = true;
+      recover = snd_max;
+      congestion->enterRecovery(snd_nxt - snd_una, now);
+      retransmitFirst();
+    }
+  }
+
+  transmitPending();
+}
+
+void StateBlock::retransmitTimeout()
+{
+  uint64_t now = NetworkStack::getTickCount();
+
+  // A handshake that never completes is given up on, so that (spoofed) SYNs
+  // can't hold a listen socket's SYN queue full for good.
+  if((currentState == Tcp::SYN_RECEIVED) && (rto_backoff >= TCP_SYNACK_RETRIES))
+  {
+    NETSTAT_INC(TcpAttemptFails);
+    currentState = Tcp::CLOSED;
+    freeLater();
+    return;
+  }
+
+  // A probe into a closed window going unanswered isn't congestion.
+  if(snd_wnd)
+    congestion->timeout(snd_nxt - snd_una, rto_backoff == 0, now);
+  if(rto_backoff < TCP_MAX_BACKOFF)
+    ++rto_backoff;
+
+  in_recovery = false;
+  dup_acks = 0;
+  recover = snd_max;
+
+  // Go back N: everything outstanding is sent again as the (now one
+  // segment) window opens. The receiver may have dropped what it SACKed, so
+  // that's forgotten too (RFC 2018 section 8).
+  while(retransmitQueue.count())
+  {
+    Segment *seg = retransmitQueue.popBack();
+    seg->bSacked = false;
+    seg->bRetransmitted = true;
+    sendQueue.pushFront(seg);
+  }
+  m_HighestSacked = snd_una;
+  snd_nxt = snd_una;
+
+  transmitPending(true);
+}
+
+void StateBlock::timeout()
+{
+  // check to see if there's data on the retransmission queue to send
+  if(retransmitQueue.count())
+  {
+    NOTICE("Remote TCP did not ack all the data!");
+    retransmitTimeout();
+  }
+  else if(sendQueue.count())
+  {
+    // The remote window has been closed for a while - probe it.
+    transmitPending(true);
+  }
+  else if(currentState == Tcp::TIME_WAIT)
+  {
+    // timer has fired, we need to close the connection
+    NOTICE("TIME_WAIT timeout complete");
+    currentState = Tcp::CLOSED;
+    freeLater();
+  }
+}
+
+void StateBlock::delayedAckTimeout()
+{
+  if(!m_nUnacked)
+    return;
+
+  if(!sendAck())
+    WARNING("TCP: Sending delayed ACK failed!");
+}
+
+void StateBlock::keepaliveTimeout()
+{
+  if(!keepalive)
+    return;
+
+  TimerWheel &wheel = TcpManager::instance().getTimerWheel();
+
+  // Only connections that are up get probed. Before then the handshake has
+  // its own timer, and after a close it's the application's business.
+  if((currentState != Tcp::ESTABLISHED) && (currentState != Tcp::CLOSE_WAIT))
+  {
+    if(currentState == Tcp::SYN_SENT || currentState == Tcp::SYN_RECEIVED)
+      wheel.schedule(&m_KeepaliveTimer, TCP_KEEPALIVE_IDLE * 1000ULL);
+    return;
+  }
+
+  // Rather than move the timer on every incoming segment, it's left to run
+  // out and pushed back here if anything has arrived since.
+  uint64_t idle = NetworkStack::getTickCount() - m_LastReceived;
+  if(idle < (TCP_KEEPALIVE_IDLE * 1000ULL))
+  {
+    m_nKeepaliveProbes = 0;
+    wheel.schedule(&m_KeepaliveTimer, (TCP_KEEPALIVE_IDLE * 1000ULL) - idle);
+    return;
+  }
+
+  // Data waiting to be acked is already being retried.
+  if(retransmitQueue.count())
+  {
+    wheel.schedule(&m_KeepaliveTimer, TCP_KEEPALIVE_INTERVAL * 1000ULL);
+    return;
+  }
+
+  if(m_nKeepaliveProbes >= TCP_KEEPALIVE_PROBES)
+  {
+    WARNING("TCP: keepalive probes unanswered, dropping connection");
+    sendControl(Tcp::RST, snd_nxt);
+    currentState = Tcp::CLOSED;
+    if(endpoint)
+      endpoint->stateChanged(currentState);
+    waitState.release();
+    return;
+  }
+
+  // A probe is an old sequence number, which the remote host can't help
+  // but ACK (RFC 1122 4.2.3.6).
+  ++m_nKeepaliveProbes;
+  if(!sendControl(Tcp::ACK, snd_una - 1))
+    WARNING("TCP: Sending keepalive probe failed!");
+  wheel.schedule(&m_KeepaliveTimer, TCP_KEEPALIVE_INTERVAL * 1000ULL);
+}
+
+void StateBlock::freeLater()
+{
+  // create the cleanup thread
+  Thread *pThread = new Thread(Processor::information().getCurrentThread()->getParent(),
+                               reinterpret_cast<Thread::ThreadStartFunc> (&stateBlockFree),
+                               reinterpret_cast<void*> (this));
+  pThread->detach();
+}
+
+void StateBlock::queueOutOfOrder(uint32_t seq, uintptr_t payload, size_t nBytes)
+{
+  if(!nBytes || !payload)
+    return;
+
+  // Only hold on to what's inside our window.
+  uint32_t windowEnd = rcv_nxt + rcv_wnd;
+  if(Tcp::seqGreaterEqual(seq, windowEnd))
+    return;
+  if(Tcp::seqGreater(seq + nBytes, windowEnd))
+    nBytes = windowEnd - seq;
+
+  // Find where it goes, dropping it if we already have it all.
+  size_t index = 0;
+  for(; index < outOfOrderQueue.count(); ++index)
+  {
+    Segment *other = outOfOrderQueue[index];
+    if((other->seg_seq == seq) && (other->seg_len >= nBytes))
+      return;
+    if(Tcp::seqGreater(other->seg_seq, seq))
+      break;
+  }
+
+  Segment *seg = new Segment;
+  seg->seg_seq = seq;
+  seg->seg_ack = seg->seg_wnd = seg->seg_up = 0;
+  seg->seg_len = nBytes;
+  seg->flags = 0;
+  seg->nBytes = nBytes;
+  seg->pAllocation = new uint8_t[nBytes];
+  memcpy(seg->pAllocation, reinterpret_cast<void*>(payload), nBytes);
+  seg->payload = reinterpret_cast<uintptr_t>(seg->pAllocation);
+  seg->sentAt = 0;
+  seg->bRetransmitted = seg->bSacked = false;
+
+  // Insert at index, shuffling the rest up.
+  outOfOrderQueue.pushBack(seg);
+  for(size_t i = outOfOrderQueue.count() - 1; i > index; --i)
+    outOfOrderQueue.setAt(i, outOfOrderQueue[i - 1]);
+  outOfOrderQueue.setAt(index, seg);
+
+  m_LastOutOfOrder = seq;
+}
+
+size_t StateBlock::deliverOutOfOrder()
+{
+  size_t nDelivered = 0;
+  while(outOfOrderQueue.count() && endpoint)
+  {
+    Segment *seg = outOfOrderQueue[0];
+    if(Tcp::seqGreater(seg->seg_seq, rcv_nxt))
+      break;
+
+    outOfOrderQueue.popFront();
+
+    uint32_t end = seg->seg_seq + seg->seg_len;
+    if(Tcp::seqGreater(end, rcv_nxt))
+    {
+      size_t skip = rcv_nxt - seg->seg_seq;
+      size_t n = end - rcv_nxt;
+      size_t room = endpoint->m_ShadowDataStream.getRemainingSize();
+      if(n > room)
+        n = room;
+
+      n = endpoint->depositPayload(n, seg->payload + skip, rcv_nxt - irs - 1, true);
+      rcv_nxt += n;
+      nDelivered += n;
+    }
+
+    freeSegment(seg);
+  }
+
+  if(endpoint)
+    rcv_wnd = endpoint->m_ShadowDataStream.getRemainingSize();
+
+  return nDelivered;
+}
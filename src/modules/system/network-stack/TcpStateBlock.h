@@ -24,11 +24,15 @@
 #include <machine/Network.h>
 #include <process/Semaphore.h>
 #include <processor/Processor.h>
+#include <utilities/List.h>
+#include <utilities/Vector.h>
+#include <utilities/TimerWheel.h>
 
 #include "NetworkStack.h"
 #include "Endpoint.h"
 #include "TcpMisc.h"
 #include "Tcp.h"
+#include "TcpCongestion.h"
 
 /// \todo Eventify.
 
@@ -37,10 +41,69 @@
 /// to enable the block to be freed without requiring intervention.
 int stateBlockFree(void* p);
 
+/// Lower bound on the retransmission timeout, in milliseconds. RFC 6298 asks
+/// for a second, but every widely deployed stack uses something like this.
+#define TCP_RTO_MIN       200
+
+/// Upper bound on the retransmission timeout, in milliseconds.
+#define TCP_RTO_MAX       60000
+
+/// Retransmission timeout before any round trip has been measured.
+#define TCP_RTO_INITIAL   1000
+
+/// Most times the retransmission timeout is doubled.
+#define TCP_MAX_BACKOFF   12
+
+/// Times a SYN/ACK is resent before a half-open connection is dropped.
+#define TCP_SYNACK_RETRIES  5
+
+/// Longest we hold back an ACK for incoming data, in milliseconds.
+#define TCP_DELAYED_ACK   40
+
+/// Keepalive: idle time before the first probe, in seconds.
+#define TCP_KEEPALIVE_IDLE      7200
+
+/// Keepalive: time between unanswered probes, in seconds.
+#define TCP_KEEPALIVE_INTERVAL  75
+
+/// Keepalive: unanswered probes before the connection is dropped.
+#define TCP_KEEPALIVE_PROBES    9
+
+/// The segment size we advertise. \todo Base this on the MTU of the link.
+#define TCP_DEFAULT_MSS   1460
+
+/// The segment size we advertise over loopback, which has no link MTU: fewer,
+/// larger segments mean less per-segment work for local connections.
+#define TCP_LOOPBACK_MSS  16344
+
+class StateBlock;
+
+/// One of a StateBlock's timers, on the TcpManager's timer wheel.
+class TcpTimer : public TimerWheel::Entry
+{
+  public:
+    typedef void (StateBlock::*Callback)();
+
+    TcpTimer(StateBlock *pBlock, Callback callback) :
+      TimerWheel::Entry(), m_pBlock(pBlock), m_Callback(callback)
+    {};
+    virtual ~TcpTimer()
+    {};
+
+    virtual void expired()
+    {
+      (m_pBlock->*m_Callback)();
+    }
+
+  private:
+    StateBlock *m_pBlock;
+    Callback m_Callback;
+};
+
 // TCP is based on connections, so we need to keep track of them
 // before we even think about depositing into Endpoints. These state blocks
 // keep track of important information relating to the connection state.
-class StateBlock : public TimerHandler
+class StateBlock
 {
   private:
 
@@ -55,31 +118,30 @@ class StateBlock : public TimerHandler
 
       uintptr_t payload;
       size_t    nBytes;
+
+      /// Start of the memory holding the payload (payload moves forward
+      /// through it as a segment is partially acked).
+      uint8_t  *pAllocation;
+
+      /// When the segment was last transmitted (ms), for RTT measurement.
+      uint64_t  sentAt;
+
+      /// Has this segment been sent more than once? (Karn's algorithm)
+      bool      bRetransmitted;
+
+      /// Has the receiver told us (with SACK) that it has this segment?
+      bool      bSacked;
+
+      /// Sequence space used: the data, plus one each for SYN and FIN.
+      inline uint32_t seqLength() const
+      {
+        return seg_len + ((flags & Tcp::SYN) ? 1 : 0) + ((flags & Tcp::FIN) ? 1 : 0);
+      }
     };
 
   public:
-    StateBlock() :
-      currentState(Tcp::CLOSED), localPort(0), remoteHost(),
-      iss(0), snd_nxt(0), snd_una(0), snd_wnd(0), snd_up(0), snd_wl1(0), snd_wl2(0),
-      rcv_nxt(0), rcv_wnd(0), rcv_up(0), irs(0),
-      seg_seq(0), seg_ack(0), seg_len(0), seg_wnd(0), seg_up(0), seg_prc(0),
-      fin_ack(false), fin_seq(0), tcp_mss(536), // (standard default for MSS)
-      numEndpointPackets(0), /// \todo Remove, obsolete
-      waitState(0), endpoint(0), connId(0),
-      retransmitQueue(), nRemovedFromRetransmit(0),
-      waitingForTimeout(false), didTimeout(false), timeoutWait(0), useWaitSem(true),
-      m_Nanoseconds(0), m_Seconds(0), m_Timeout(10)
-    {
-      Timer* t = Machine::instance().getTimer();
-      if(t)
-        t->registerHandler(this);
-    };
-    ~StateBlock()
-    {
-      Timer* t = Machine::instance().getTimer();
-      if(t)
-        t->unregisterHandler(this);
-    };
+    StateBlock();
+    ~StateBlock();
 
     Tcp::TcpState currentState;
 
@@ -91,14 +153,16 @@ class StateBlock : public TimerHandler
     uint32_t iss; // initial sender sequence number (CLIENT)
     uint32_t snd_nxt; // next send sequence number
     uint32_t snd_una; // send unack
-    uint32_t snd_wnd; // send window ----> How much they can receive max
+    uint32_t snd_wnd; // send window - how much the remote host can take (already scaled)
     uint32_t snd_up; // urgent pointer?
     uint32_t snd_wl1; // segment sequence number for last WND update
     uint32_t snd_wl2; // segment ack number for last WND update
+    uint32_t snd_max; // highest sequence number sent (snd_nxt goes back after a timeout)
+    uint32_t snd_queued; // sequence number after the last one queued to send
 
     // Receive sequence variables
     uint32_t rcv_nxt; // receive next - what we're expecting perhaps?
-    uint32_t rcv_wnd; // receive window ----> How much we want to receive methinks...
+    uint32_t rcv_wnd; // receive window - how much we can take
     uint32_t rcv_up; // receive urgent pointer
     uint32_t irs; // initial receiver sequence number (SERVER)
 
@@ -116,6 +180,34 @@ class StateBlock : public TimerHandler
 
     // Connection information
     uint32_t tcp_mss; // maximum segment size
+    uint32_t local_mss; // segment size we advertise
+
+    // Window scaling (RFC 7323)
+    bool     wscale_ok; // offered (before the handshake completes) or agreed
+    uint8_t  snd_wscale; // shift for windows the remote host sends us
+    uint8_t  rcv_wscale; // shift for windows we send
+
+    // Timestamps (RFC 7323)
+    bool     ts_ok; // offered or agreed, as for wscale_ok
+    uint32_t ts_recent; // timestamp to echo
+
+    // Selective acknowledgements (RFC 2018)
+    bool     sack_ok; // offered or agreed, as for wscale_ok
+
+    // Round trip time estimation (RFC 6298), in milliseconds
+    uint32_t srtt; // smoothed round trip time, scaled by 8 (zero: no samples)
+    uint32_t rttvar; // round trip time variation, scaled by 4
+    uint32_t rto; // retransmission timeout
+    uint32_t rto_backoff; // number of times rto has been doubled
+
+    // Loss recovery (RFC 5681, RFC 6582)
+    uint32_t dup_acks; // duplicate ACKs in a row
+    bool     in_recovery; // in fast recovery?
+    uint32_t recover; // snd_max when recovery last started
+    uint32_t retransmits; // segments sent again over the connection's life
+
+    // Congestion window
+    TcpCongestionControl *congestion;
 
     // Number of packets we've deposited into our Endpoint
     // (decremented when a packet is picked up by the receiver)
@@ -130,242 +222,187 @@ class StateBlock : public TimerHandler
     // the id of this specific connection
     size_t connId;
 
-    // Retransmission queue
-    //TcpBuffer retransmitQueue;
-    List<void*> retransmitQueue;
+    // Segments queued by the application that haven't been sent yet
+    List<Segment*> sendQueue;
+
+    // Retransmission queue - segments sent but not yet acked, in order
+    List<Segment*> retransmitQueue;
+
+    // Segments received ahead of rcv_nxt, in order
+    Vector<Segment*> outOfOrderQueue;
 
     // Number of bytes removed from the retransmit queue
     size_t nRemovedFromRetransmit;
 
-    /// Handles a segment ack
-    /// \note This will remove acked segments, however if there is only a partial ack on a segment
-    ///       it will split it into two, remove the first, and leave a partial segment on the queue.
-    ///       This behaviour does not affect anything internally as long as this function is always
-    ///       used to acknowledge segments.
-    void ackSegment()
+    // Listen sockets: most connections allowed to be half-open (SYN_RECEIVED)
+    // and waiting to be accepted, and the number now half-open
+    size_t backlog;
+    size_t synQueueLength;
+
+    // Connections from a listen socket: counted in its synQueueLength?
+    bool inSynQueue;
+
+    /// Sets up the options to offer in our SYN, from our receive buffer size
+    /// and the route to remoteHost.
+    void offerOptions();
+
+    /// Takes on the options the remote host sent with its SYN (or SYN/ACK):
+    /// anything it didn't offer isn't used.
+    void acceptOptions(const Tcp::TcpOptions &options);
+
+    /// Queues a SYN (or with bAck, SYN/ACK) for iss, and sends it.
+    void sendSyn(bool bAck);
+
+    /// Queues a FIN after any data still waiting to go, and sends what it can.
+    void sendFin();
+
+    /// Sends a segment that doesn't go on any queue, with our options.
+    bool sendControl(uint8_t flags, uint32_t seq);
+
+    /// Sends an ACK for everything received so far.
+    bool sendAck()
     {
-      // we assume the seg_* variables have been set by the caller (always done in TcpManager::receive)
-      uint32_t segAck = seg_ack;
-      while(retransmitQueue.count())
-      {
-        // grab the first segment from the queue
-        Segment* seg = reinterpret_cast<Segment*>(retransmitQueue.popFront());
-        if((seg->seg_seq + seg->seg_len) <= segAck)
-        {
-          // this segment is acked, leave it off the queue and free the memory used
-          if(seg->payload)
-            delete [] (reinterpret_cast<uint8_t*>(seg->payload));
-
-          delete seg;
-          continue;
-        }
-        else
-        {
-          // check if the ack is within this segment
-          if(segAck >= seg->seg_seq)
-          {
-            // it is, so we need to split the segment payload
-            Segment* splitSeg = new Segment;
-            *splitSeg = *seg;
-
-            // how many bytes are acked?
-            /// \bug This calculation *may* have an off-by-one error
-            size_t nBytesAcked = segAck - seg->seg_seq;
-
-            // update the sequence number
-            splitSeg->seg_seq = seg->seg_seq + nBytesAcked;
-            splitSeg->seg_len -= nBytesAcked;
-
-            // and most importantly, recopy the payload
-            if(seg->nBytes && seg->payload)
-            {
-              uint8_t* newPayload = new uint8_t[splitSeg->seg_len];
-              memcpy(newPayload, reinterpret_cast<void*>(seg->payload), seg->nBytes);
-
-              splitSeg->payload = reinterpret_cast<uintptr_t>(newPayload);
-            }
-
-            // push on the front, and don't continue (we know there's no potential for further ACKs)
-            retransmitQueue.pushFront(reinterpret_cast<void*>(splitSeg));
-            if(seg->payload)
-              delete [] (reinterpret_cast<uint8_t*>(seg->payload));
-            delete seg;
-            return;
-          }
-        }
-      }
+      return sendControl(Tcp::ACK, snd_nxt);
     }
 
+    /// The window to put in an outgoing header.
+    uint16_t advertisedWindow(bool bSyn = false);
+
+    /// Handles the ACK field of an incoming segment: window updates, RTT
+    /// measurement, clearing the retransmit queue, congestion control and
+    /// fast retransmit. Sends whatever the windows then allow.
+    /// We assume the seg_* variables have been set by the caller (always
+    /// done in TcpManager::receive).
+    void processAck(const Tcp::TcpOptions &options, uint8_t flags);
+
+    /// Notes the remote host's timestamp on an incoming segment.
+    void updateTimestamp(const Tcp::TcpOptions &options);
+
+    /// Holds on to a segment that arrived ahead of rcv_nxt.
+    void queueOutOfOrder(uint32_t seq, uintptr_t payload, size_t nBytes);
+
+    /// Passes any held segments that now follow on from rcv_nxt up to the
+    /// endpoint. Returns the number of bytes delivered.
+    size_t deliverOutOfOrder();
+
     /// Sends a segment over the network
-    bool sendSegment(Segment* seg)
-    {
-      if(seg)
-      {
-        if((seg->flags & Tcp::ACK) == 0)
-        {
-          // If no ACK flag, don't transmit an ACK number.
-          seg->seg_ack = 0;
-        }
-        return Tcp::send(remoteHost.ip, localPort, remoteHost.remotePort, seg->seg_seq, seg->seg_ack, seg->flags, seg->seg_wnd, seg->nBytes, seg->payload);
-      }
-      return false;
-    }
+    bool sendSegment(Segment* seg);
+
+    /// Sends a run of segments, each following on from the one before, as
+    /// one packet that's split back into segments on the way out.
+    bool sendSegments(Segment **pSegments, size_t nSegments);
+
+    /// Can next go out in the same packet as a run ending with prev?
+    bool canFollow(const Segment *prev, const Segment *next);
 
     /// Sends a segment over the network
-    bool sendSegment(uint8_t flags, size_t nBytes, uintptr_t payload, bool addToRetransmitQueue)
-    {
-      // split the passed buffer up into segments based on the MSS and send each
-      size_t offset;
-      for(offset = 0; offset < (nBytes == 0 ? 1 : nBytes); offset += tcp_mss)
-      {
-        Segment* seg = new Segment;
-
-        size_t segmentSize = tcp_mss;
-        if((offset + segmentSize) >= nBytes)
-        {
-          segmentSize = nBytes - offset;
-          if(nBytes)
-          {
-             flags |= Tcp::PSH;
-          }
-        }
-
-        seg_seq = snd_nxt;
-        snd_nxt += segmentSize;
-        snd_wnd = endpoint->m_ShadowDataStream.getRemainingSize();
-
-        seg->seg_seq = seg_seq;
-        seg->seg_ack = rcv_nxt;
-        seg->seg_len = segmentSize;
-        seg->seg_wnd = snd_wnd;
-        seg->seg_up = 0;
-        seg->flags = flags;
-
-        if(nBytes && payload)
-        {
-          uint8_t* newPayload = new uint8_t[segmentSize];
-          memcpy(newPayload, reinterpret_cast<void*>(payload + offset), segmentSize);
-
-          seg->payload = reinterpret_cast<uintptr_t>(newPayload);
-        }
-        else
-          seg->payload = 0;
-        seg->nBytes = seg->seg_len;
-
-        sendSegment(seg);
-
-        if(addToRetransmitQueue)
-          retransmitQueue.pushBack(reinterpret_cast<void*>(seg));
-        else
-          delete seg;
-      }
+    /// \note Unless addToRetransmitQueue is false, the data is queued and
+    ///       goes out as the congestion and send windows allow.
+    bool sendSegment(uint8_t flags, size_t nBytes, uintptr_t payload, bool addToRetransmitQueue);
 
-      return true;
-    }
+    /// Transmits queued segments while the windows allow.
+    /// \param bForce Send the first queued segment regardless (window probe).
+    void transmitPending(bool bForce = false);
 
-    // timer for all retransmissions (and state changes such as TIME_WAIT)
-    virtual void timer(uint64_t delta, InterruptState& state)
-    {
-      if(!waitingForTimeout)
-        return;
+    /// Runs the connection timer (retransmission, persist or TIME_WAIT,
+    /// depending on the state) for the given number of seconds.
+    void resetTimer(uint32_t timeout = 10);
 
-      if(UNLIKELY(m_Seconds < m_Timeout))
-      {
-        m_Nanoseconds += delta;
-        if(UNLIKELY(m_Nanoseconds >= 1000000000ULL))
-        {
-          ++m_Seconds;
-          m_Nanoseconds -= 1000000000ULL;
-        }
-
-        if(UNLIKELY(m_Seconds >= m_Timeout))
-        {
-          // timeout is hit!
-          waitingForTimeout = false;
-          didTimeout = true;
-          if(useWaitSem)
-            timeoutWait.release();
-
-          // check to see if there's data on the retransmission queue to send
-          if(retransmitQueue.count())
-          {
-            NOTICE("Remote TCP did not ack all the data!");
-
-            // still more data unacked - grab the first segment and transmit it
-            // note that we don't pop it off the queue permanently, as we are still
-            // waiting for an ack for the segment
-            Segment* seg = reinterpret_cast<Segment*>(retransmitQueue.popFront());
-            sendSegment(seg);
-            retransmitQueue.pushFront(reinterpret_cast<void*>(seg));
-
-            // reset the timeout
-            resetTimer();
-          }
-          else if(currentState == Tcp::TIME_WAIT)
-          {
-            // timer has fired, we need to close the connection
-            NOTICE("TIME_WAIT timeout complete");
-            currentState = Tcp::CLOSED;
-
-            // create the cleanup thread
-            Thread *pThread = new Thread(Processor::information().getCurrentThread()->getParent(),
-                                         reinterpret_cast<Thread::ThreadStartFunc> (&stateBlockFree),
-                                         reinterpret_cast<void*> (this));
-            pThread->detach();
-          }
-        }
-      }
-    }
+    /// Stops the connection timer.
+    void stopTimer();
 
-    // resets the timer (to restart a timeout)
-    void resetTimer(uint32_t timeout = 10)
+    /// Is the connection timer running?
+    bool timerPending() const
     {
-      m_Seconds = m_Nanoseconds = 0;
-      m_Timeout = timeout;
-      didTimeout = false;
+      return m_Timer.isPending();
     }
 
-    // are we waiting on a timeout?
-    bool waitingForTimeout;
+    // starts the retransmission timer for the current RTO
+    void startRetransmitTimer();
 
-    // did the action time out or not?
-    /// \note This ensures that, if we end up releasing the timeout wait semaphore
-    ///       via a non-timeout source (such as a data ack) we know where the release
-    ///       actually came from.
-    bool didTimeout;
+    /// Acknowledges incoming data, either now or (for every other full
+    /// segment) within TCP_DELAYED_ACK milliseconds (RFC 1122 4.2.3.2).
+    /// \param nBytes Data received, which may be several segments' worth
+    ///               if they were coalesced on the way in.
+    void ackLater(size_t nBytes = 0);
 
-    // timeout wait semaphore (in case)
-    Semaphore timeoutWait;
-    bool useWaitSem;
+    /// Turns keepalive probes on or off.
+    void setKeepalive(bool bEnable);
+
+    /// Notes that a segment has arrived from the remote host.
+    void segmentArrived();
+
+    // Is keepalive on?
+    bool keepalive;
 
   private:
 
-    // number of nanoseconds & seconds for the timer
-    uint64_t m_Nanoseconds;
-    uint64_t m_Seconds;
-    uint32_t m_Timeout;
-
-    StateBlock(const StateBlock& s) :
-      currentState(Tcp::CLOSED), localPort(0), remoteHost(),
-      iss(0), snd_nxt(0), snd_una(0), snd_wnd(0), snd_up(0), snd_wl1(0), snd_wl2(0),
-      rcv_nxt(0), rcv_wnd(0), rcv_up(0), irs(0),
-      seg_seq(0), seg_ack(0), seg_len(0), seg_wnd(0), seg_up(0), seg_prc(0),
-      fin_ack(false), fin_seq(0),
-      numEndpointPackets(0), /// \todo Remove, obsolete
-      waitState(0), endpoint(0), connId(0),
-      retransmitQueue(), nRemovedFromRetransmit(0),
-      waitingForTimeout(false), didTimeout(false), timeoutWait(0), useWaitSem(true),
-      m_Nanoseconds(0), m_Seconds(0), m_Timeout(10)
-    {
-      // same as TcpEndpoint - the copy constructor should not be called
-      ERROR("Tcp: StateBlock copy constructor called");
-    }
-    StateBlock& operator = (const StateBlock& s)
-    {
-      // this isn't actually correct EITHER
-      ERROR("Tcp: StateBlock copy constructor has been called.");
-      return *this;
-    }
+    /// Builds the options for an outgoing segment. Returns their length.
+    size_t buildOptions(uint8_t flags, uint8_t *pOptions);
+
+    /// Queues a segment at the end of the send queue.
+    void queueSegment(uint8_t flags, size_t nBytes, uintptr_t payload);
+
+    /// Removes everything up to ack from the front of a queue. Returns the
+    /// number of data bytes removed, and sets rtt from the newest
+    /// segment that was only sent once.
+    size_t removeAcked(List<Segment*> &queue, uint32_t ack, int64_t &rtt, uint64_t now);
+
+    /// Marks segments covered by incoming SACK blocks.
+    void markSacked(const Tcp::TcpOptions &options);
+
+    /// Resends the first segment the receiver doesn't have.
+    void retransmitFirst();
+
+    /// Resends the first hole below the highest SACKed data that hasn't
+    /// already been resent.
+    void retransmitNextHole();
+
+    /// Adds a round trip time sample (ms).
+    void updateRtt(uint32_t rtt);
+
+    /// The retransmission timer expired.
+    void retransmitTimeout();
+
+    /// The connection timer expired.
+    void timeout();
+
+    /// The delayed ACK timer expired.
+    void delayedAckTimeout();
+
+    /// The keepalive timer expired.
+    void keepaliveTimeout();
+
+    /// An ACK went out, so none is owed any more.
+    void ackSent();
+
+    static void freeSegment(Segment *seg);
+
+    /// Removes this (closed) block from the system, from a new thread.
+    void freeLater();
+
+    // highest sequence number covered by a SACK block
+    uint32_t m_HighestSacked;
+
+    // start of the most recent out-of-order segment (reported first in SACKs)
+    uint32_t m_LastOutOfOrder;
+
+    // retransmission, persist and TIME_WAIT timer
+    TcpTimer m_Timer;
+
+    // delayed ACK timer, and segments received since we last sent an ACK
+    TcpTimer m_DelayedAckTimer;
+    uint32_t m_nUnacked;
+
+    // keepalive timer, and probes sent without an answer
+    TcpTimer m_KeepaliveTimer;
+    uint32_t m_nKeepaliveProbes;
+
+    // when a segment last arrived from the remote host (ms), for keepalive
+    uint64_t m_LastReceived;
+
+    StateBlock(const StateBlock& s);
+    StateBlock& operator = (const StateBlock& s);
 };
 
 #endif
@@ -31,6 +31,7 @@
 #include "RoutingTable.h"
 
 #include "Filter.h"
+#include "NetworkStatistics.h"
 
 #include "Arp.h"
 #include "IpCommon.h"
@@ -114,35 +115,53 @@ bool Udp::send(IpAddress dest, uint16_t srcPort, uint16_t destPort, size_t nByte
     }
   }
 
-  // Allocate a packet to send
-  uintptr_t packet = NetworkStack::instance().getMemPool().allocate();
+  // Allocate a packet to send, with room in front for all the headers
+  NetworkBuffer *pBuffer = NetworkStack::instance().allocateBuffer(nBytes);
+
+  // Loopback packets never leave memory, so aren't worth checksumming.
+  bool bLoopback = NetworkStack::instance().isLoopback(pCard);
+
+  // Copy in the payload, summing it for the checksum as it goes
+  Checksum payloadSum;
+  if(nBytes && bLoopback)
+    memcpy(pBuffer->put(nBytes), reinterpret_cast<void*>(payload), nBytes);
+  else if(nBytes)
+    payloadSum.copyAndAdd(pBuffer->put(nBytes), reinterpret_cast<void*>(payload), nBytes);
 
   // Add the UDP header to the packet.
-  udpHeader* header = reinterpret_cast<udpHeader*>(packet);
+  udpHeader* header = reinterpret_cast<udpHeader*>(pBuffer->push(sizeof(udpHeader)));
   memset(header, 0, sizeof(udpHeader));
   header->src_port = HOST_TO_BIG16(srcPort);
   header->dest_port = HOST_TO_BIG16(destPort);
   header->len = HOST_TO_BIG16(sizeof(udpHeader) + nBytes);
   header->checksum = 0;
 
-  // Copy in the payload
-  if(nBytes)
-    memcpy(reinterpret_cast<void*>(packet + sizeof(udpHeader)), reinterpret_cast<void*>(payload), nBytes);
+  // Calculate the checksum. Zero means "no checksum" for UDP, so a real
+  // zero goes out as its other representation, 0xFFFF.
+  if(!bLoopback)
+  {
+    Checksum sum;
+    pIp->addPseudoHeader(sum, src, dest, IP_UDP, sizeof(udpHeader) + nBytes);
+    sum.add(header, sizeof(udpHeader));
+    sum.add(payloadSum);
+    header->checksum = sum.finish();
+    if(!header->checksum)
+      header->checksum = 0xFFFF;
+  }
 
-  // Calculate the checksum
-  header->checksum = pIp->ipChecksum(src, dest, IP_UDP, reinterpret_cast<uintptr_t>(header), sizeof(udpHeader) + nBytes);
+  NETSTAT_INC(UdpOutDatagrams);
 
   // Transmit
-  bool success = pIp->send(dest, src, IP_UDP, nBytes + sizeof(udpHeader), packet, pCard);
+  bool success = pIp->send(dest, src, IP_UDP, pBuffer, pCard);
 
   // Free the created packet
-  NetworkStack::instance().getMemPool().free(packet);
+  pBuffer->release();
 
   // All done.
   return success;
 }
 
-void Udp::receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes, IpBase *pIp, Network* pCard)
+void Udp::receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes, IpBase *pIp, Network* pCard, NetworkBuffer *pBuffer)
 {
     if(!packet || !nBytes)
         return;
@@ -172,19 +191,21 @@ void Udp::receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes,
     uintptr_t payload = reinterpret_cast<uintptr_t>(header) + sizeof(udpHeader);
     size_t payloadSize = BIG_TO_HOST16(header->len) - sizeof(udpHeader);
 
-    // Check the checksum, if it's not zero
-    if(header->checksum != 0)
+    // Check the checksum, if it's not zero (and didn't come over loopback)
+    if((header->checksum != 0) && !NetworkStack::instance().isLoopback(pCard))
     {
         uint16_t checksum = pIp->ipChecksum(from, to, IP_UDP, reinterpret_cast<uintptr_t>(header), BIG_TO_HOST16(header->len));
         if(checksum)
         {
             WARNING("UDP Checksum failed on incoming packet [" << header->checksum << ", and " << checksum << " should be zero]!");
+            NETSTAT_INC(UdpInErrors);
+            NETSTAT_INC(UdpInCsumErrors);
             pCard->badPacket();
             return;
         }
     }
 
     // Either no checksum, or calculation was successful, either way go on to handle it
-    UdpManager::instance().receive(from, to, BIG_TO_HOST16(header->src_port), BIG_TO_HOST16(header->dest_port), payload, payloadSize, pCard);
+    UdpManager::instance().receive(from, to, BIG_TO_HOST16(header->src_port), BIG_TO_HOST16(header->dest_port), payload, payloadSize, pCard, pBuffer);
 }
 
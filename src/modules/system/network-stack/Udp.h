@@ -57,7 +57,7 @@ public:
   }
 
   /** Packet arrival callback */
-  void receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes, IpBase *pIp, Network* pCard);
+  void receive(IpAddress from, IpAddress to, uintptr_t packet, size_t nBytes, IpBase *pIp, Network* pCard, NetworkBuffer *pBuffer = 0);
 
   /** Sends a UDP packet */
   static bool send(IpAddress dest, uint16_t srcPort, uint16_t destPort, size_t nBytes, uintptr_t payload, bool broadcast = false, Network *pCard = 0);
@@ -23,9 +23,65 @@
 #include "NetworkStack.h"
 #include "UdpManager.h"
 #include "RoutingTable.h"
+#include <process/Thread.h>
+#include <process/Scheduler.h>
+#include <utilities/utility.h>
+
+#define RING_MASK (UDPLOG_RING_LINES - 1)
+
+/// How long the sender waits for more lines to fill out a datagram.
+#define UDPLOG_LINGER_USECS 10000
+
+/// Size of the binary header: magic, sequence, dropped and line count.
+#define BINARY_HEADER_SIZE  16
+
+/** Works out a line's severity from the prefix Log gives it ("(WW) "). */
+static Log::SeverityLevel severityOf(const char *str)
+{
+    if(str[0] != '(' || !str[1] || !str[2] || str[3] != ')')
+        return Log::Notice;
+
+    switch(str[1])
+    {
+        case 'D':
+            return Log::Debug;
+        case 'W':
+            return Log::Warning;
+        case 'E':
+            return Log::Error;
+        case 'F':
+            return Log::Fatal;
+        default:
+            return Log::Notice;
+    }
+}
+
+static void writeWord(uint8_t *p, uint32_t word)
+{
+    uint32_t be = HOST_TO_BIG32(word);
+    memcpy(p, &be, sizeof(be));
+}
+
+UdpLogger::UdpLogger() :
+    m_Tail(0), m_Head(0), m_nDropped(0), m_nDroppedTotal(0), m_Wakeup(0),
+    m_bSleeping(false), m_bStop(false), m_pThread(0), m_pEndpoint(0),
+    m_LoggingServer(), m_bBinary(false), m_DatagramSize(0), m_nLines(0),
+    m_Sequence(0)
+{
+    for(size_t i = 0; i < UDPLOG_RING_LINES; ++i)
+        m_Ring[i].sequence = i;
+}
 
 UdpLogger::~UdpLogger()
 {
+    if(m_pThread)
+    {
+        m_bStop = true;
+        m_Wakeup.release();
+        m_pThread->join();
+        m_pThread = 0;
+    }
+
     if(m_pEndpoint)
     {
         UdpManager::instance().returnEndpoint(m_pEndpoint);
@@ -33,22 +89,27 @@ UdpLogger::~UdpLogger()
     }
 }
 
-bool UdpLogger::initialise(IpAddress remote, uint16_t port)
+bool UdpLogger::initialise(IpAddress remote, uint16_t port, bool bBinary)
 {
     if(m_pEndpoint)
         return true;
         
     m_LoggingServer.ip = remote;
     m_LoggingServer.remotePort = port;
+    m_bBinary = bBinary;
     
     m_pEndpoint = static_cast<ConnectionlessEndpoint*>(UdpManager::instance().getEndpoint(remote, 0, port));
     
     if(!m_pEndpoint)
         return false;
+
+    m_pThread = new Thread(Scheduler::instance().getKernelProcess(),
+                           reinterpret_cast<Thread::ThreadStartFunc>(&trampoline),
+                           reinterpret_cast<void*>(this));
     
-    // Will perform an ARP lookup, which will fill the ARP cache. This is done
-    // before the callback is actually installed (after we return) because ARP
-    // writes to the log, which calls the callback (and then hangs on ARP)
+    // The first send does an ARP lookup, so get it going now rather than
+    // when the backlog arrives (after we return). ARP writes to the log too,
+    // but that only adds to the ring now, so it can't recurse into a send.
     callback("UDP logger now active");
     
     return true;
@@ -58,7 +119,213 @@ void UdpLogger::callback(const char *str)
 {
     if(!m_pEndpoint)
         return;
-    
-    m_pEndpoint->send(strlen(str), reinterpret_cast<uintptr_t>(str), m_LoggingServer, false);
+
+    Log::SeverityLevel severity = severityOf(str);
+
+    // Claim a slot. Nothing here blocks: if the ring is too full for this
+    // line, it's dropped and counted instead.
+    size_t tail = m_Tail;
+    Line *pLine = 0;
+    while(true)
+    {
+        size_t used = tail - m_Head;
+        if((severity < Log::Warning) && (used >= UDPLOG_LOW_WATERMARK))
+            break;
+
+        Line &line = m_Ring[tail & RING_MASK];
+        intptr_t diff = static_cast<intptr_t>(line.sequence) - static_cast<intptr_t>(tail);
+        if(!diff)
+        {
+            if(__sync_bool_compare_and_swap(&m_Tail, tail, tail + 1))
+            {
+                pLine = &line;
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            // The sender hasn't got to this slot's last line yet: full.
+            break;
+        }
+
+        tail = m_Tail;
+    }
+
+    if(!pLine)
+    {
+        __sync_fetch_and_add(&m_nDropped, 1);
+        __sync_fetch_and_add(&m_nDroppedTotal, 1);
+        return;
+    }
+
+    size_t length = 0;
+    while(str[length] && (length < UDPLOG_LINE_LENGTH))
+    {
+        pLine->text[length] = str[length];
+        ++length;
+    }
+    pLine->length = length;
+    pLine->severity = severity;
+
+    // Publish the line only once it's all there.
+    __sync_synchronize();
+    pLine->sequence = tail + 1;
+
+    // The sender sets m_bSleeping and then checks for a line; we publish the
+    // line and then check m_bSleeping. Without a full barrier between the
+    // two, the load can pass the store and both sides miss each other.
+    __sync_synchronize();
+    if(m_bSleeping && __sync_bool_compare_and_swap(&m_bSleeping, true, false))
+        m_Wakeup.release();
+}
+
+bool UdpLogger::pop(char *pLine, size_t &length, Log::SeverityLevel &severity)
+{
+    Line &line = m_Ring[m_Head & RING_MASK];
+    if(line.sequence != m_Head + 1)
+        return false;
+
+    length = line.length;
+    severity = line.severity;
+    memcpy(pLine, line.text, length);
+
+    // Hand the slot back for the next pass around the ring.
+    __sync_synchronize();
+    line.sequence = m_Head + UDPLOG_RING_LINES;
+    m_Head = m_Head + 1;
+    return true;
 }
 
+int UdpLogger::trampoline(void *p)
+{
+    UdpLogger *pLogger = reinterpret_cast<UdpLogger*>(p);
+    return pLogger->work();
+}
+
+int UdpLogger::work()
+{
+    char line[UDPLOG_LINE_LENGTH];
+    size_t length = 0;
+    Log::SeverityLevel severity = Log::Notice;
+
+    // Whether the datagram being built has already waited for more lines.
+    bool bLingered = false;
+
+    while(!m_bStop)
+    {
+        if(!pop(line, length, severity))
+        {
+            // A part-filled datagram gets one short wait for company before
+            // it goes, so a burst is sent in as few datagrams as possible
+            // without holding lines back for long.
+            size_t timeout = 0;
+            if(m_nLines && !bLingered)
+            {
+                timeout = UDPLOG_LINGER_USECS;
+                bLingered = true;
+            }
+            else
+            {
+                flush();
+                bLingered = false;
+            }
+
+            m_bSleeping = true;
+            __sync_synchronize();
+            if(m_Ring[m_Head & RING_MASK].sequence != m_Head + 1)
+                m_Wakeup.acquire(1, 0, timeout);
+            m_bSleeping = false;
+            continue;
+        }
+
+        if(!m_nLines)
+            begin();
+        if(!pack(line, length, severity))
+        {
+            flush();
+            bLingered = false;
+            begin();
+            if(!pack(line, length, severity))
+            {
+                // Too long even for a datagram to itself: send what fits, and
+                // count it as dropped so the server knows it was cut short.
+                pack(line, UDPLOG_DATAGRAM_SIZE - m_DatagramSize, severity);
+                __sync_fetch_and_add(&m_nDropped, 1);
+                __sync_fetch_and_add(&m_nDroppedTotal, 1);
+            }
+        }
+    }
+
+    flush();
+    return 0;
+}
+
+void UdpLogger::begin()
+{
+    uint32_t dropped = __sync_lock_test_and_set(&m_nDropped, 0);
+
+    if(m_bBinary)
+    {
+        writeWord(&m_Datagram[0], UDPLOG_MAGIC);
+        writeWord(&m_Datagram[4], m_Sequence);
+        writeWord(&m_Datagram[8], dropped);
+        m_DatagramSize = BINARY_HEADER_SIZE;
+    }
+    else
+    {
+        m_DatagramSize = sprintf(reinterpret_cast<char*>(m_Datagram), "#%u %u\n",
+                                 m_Sequence, dropped);
+    }
+
+    ++m_Sequence;
+    m_nLines = 0;
+}
+
+bool UdpLogger::pack(const char *pLine, size_t length, Log::SeverityLevel severity)
+{
+    if(!m_bBinary)
+    {
+        if(m_DatagramSize + length > UDPLOG_DATAGRAM_SIZE)
+            return false;
+
+        memcpy(&m_Datagram[m_DatagramSize], pLine, length);
+        m_DatagramSize += length;
+        ++m_nLines;
+        return true;
+    }
+
+    // The severity byte stands in for the prefix, and the line ending goes.
+    if((length >= 5) && (pLine[0] == '(') && (pLine[3] == ')'))
+    {
+        pLine += 5;
+        length -= 5;
+    }
+    while(length && ((pLine[length - 1] == '\n') || (pLine[length - 1] == '\r')))
+        --length;
+    if(length > 0xFF)
+        length = 0xFF;
+
+    if(m_DatagramSize + 2 + length > UDPLOG_DATAGRAM_SIZE)
+        return false;
+
+    m_Datagram[m_DatagramSize++] = static_cast<uint8_t>(severity);
+    m_Datagram[m_DatagramSize++] = static_cast<uint8_t>(length);
+    memcpy(&m_Datagram[m_DatagramSize], pLine, length);
+    m_DatagramSize += length;
+    ++m_nLines;
+    return true;
+}
+
+void UdpLogger::flush()
+{
+    if(!m_nLines)
+        return;
+
+    if(m_bBinary)
+        writeWord(&m_Datagram[12], m_nLines);
+
+    m_pEndpoint->send(m_DatagramSize, reinterpret_cast<uintptr_t>(m_Datagram), m_LoggingServer, false);
+
+    m_DatagramSize = 0;
+    m_nLines = 0;
+}
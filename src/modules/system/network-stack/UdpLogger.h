@@ -22,28 +22,126 @@
 #define _NETWORK_UDP_LOGGER_H
 
 #include <processor/types.h>
+#include <process/Semaphore.h>
 #include <network/IpAddress.h>
 #include "ConnectionlessEndpoint.h"
 #include "NetworkStack.h"
 #include "UdpManager.h"
 #include <Log.h>
 
-/** Defines a UDP-based callback for Log entries. */
+class Thread;
+
+/// Lines the logger can hold while they wait to be sent. Must be a power of two.
+#define UDPLOG_RING_LINES     512
+
+/// Longest line kept, severity prefix and line ending included.
+#define UDPLOG_LINE_LENGTH    (LOG_LENGTH + 16)
+
+/// Largest datagram sent, which fits in an Ethernet frame over IPv4 or IPv6.
+#define UDPLOG_DATAGRAM_SIZE  1400
+
+/// Once the ring is this full, Debug and Notice lines are dropped.
+#define UDPLOG_LOW_WATERMARK  ((UDPLOG_RING_LINES * 3) / 4)
+
+/// Magic number at the start of a binary datagram ("PLOG").
+#define UDPLOG_MAGIC          0x504C4F47
+
+/**
+ * Defines a UDP-based callback for Log entries.
+ *
+ * The callback never touches the network: lines are copied into a lock-free
+ * ring, and a sender thread packs as many as will fit into each datagram.
+ * When the ring fills up, Debug and Notice lines are dropped first so that
+ * warnings and errors still get through a burst.
+ *
+ * Every datagram carries a sequence number, so the server can tell when some
+ * were lost, and the number of lines dropped (or cut short, for a line too
+ * long for a datagram) since the last one. In the text
+ * framing the datagram starts with a line "#<sequence> <dropped>" and the log
+ * lines follow as they were written. The binary framing starts with a header
+ * of magic (UDPLOG_MAGIC), sequence, dropped and line count, each a 32-bit
+ * big-endian word, followed by each line as a severity byte, a length byte
+ * and the text, without its severity prefix or line ending.
+ */
 class UdpLogger : public Log::LogCallback
 {
     public:
-        UdpLogger() : m_pEndpoint(0), m_LoggingServer()
-        {}
+        UdpLogger();
         virtual ~UdpLogger();
         
-        bool initialise(IpAddress remote, uint16_t port = 1234);
+        /** \param bBinary Use the compact binary framing, rather than text. */
+        bool initialise(IpAddress remote, uint16_t port = 1234, bool bBinary = false);
         
         void callback(const char *str);
+
+        /** Number of lines dropped because the ring was full, or cut short
+         *  because they didn't fit in a datagram. */
+        size_t getDropped() const
+        {
+            return m_nDroppedTotal;
+        }
     
     private:
+        UdpLogger(const UdpLogger &);
+        UdpLogger &operator = (const UdpLogger &);
+
+        static int trampoline(void *p);
+        int work();
+
+        /** Takes the next line off the ring into pLine (which must be
+         *  UDPLOG_LINE_LENGTH bytes). Returns false if the ring is empty. */
+        bool pop(char *pLine, size_t &length, Log::SeverityLevel &severity);
+
+        /** Appends a line to the datagram being built, in the chosen framing.
+         *  Returns false if it won't fit. */
+        bool pack(const char *pLine, size_t length, Log::SeverityLevel severity);
+
+        /** Starts a new datagram. */
+        void begin();
+
+        /** Sends the datagram being built, if it has any lines in it. */
+        void flush();
+
+        /** A line in the ring. The sequence says whether the slot is free or
+         *  holds a line, and for which pass around the ring. */
+        struct Line
+        {
+            volatile size_t sequence;
+            Log::SeverityLevel severity;
+            size_t length;
+            char text[UDPLOG_LINE_LENGTH];
+        };
+
+        Line m_Ring[UDPLOG_RING_LINES];
+
+        /** Next line to write (for callbacks) and to read (for the sender). */
+        volatile size_t m_Tail;
+        volatile size_t m_Head;
+
+        /** Lines dropped since the last datagram, and in all. */
+        volatile size_t m_nDropped;
+        volatile size_t m_nDroppedTotal;
+
+        /** Released to wake the sender, if it's asleep. */
+        Semaphore m_Wakeup;
+        volatile bool m_bSleeping;
+
+        /** Tells the sender to exit. */
+        volatile bool m_bStop;
+
+        Thread *m_pThread;
+
         ConnectionlessEndpoint *m_pEndpoint;
         
         Endpoint::RemoteEndpoint m_LoggingServer;
+
+        bool m_bBinary;
+
+        /** The datagram being built, for the sender alone. */
+        uint8_t m_Datagram[UDPLOG_DATAGRAM_SIZE];
+        size_t m_DatagramSize;
+        size_t m_nLines;
+        uint32_t m_Sequence;
 };
 
 #endif
@@ -20,12 +20,29 @@
 
 #include "NetManager.h"
 #include "UdpManager.h"
+#include "NetworkStatistics.h"
 #include <Log.h>
 #include <syscallError.h>
 #include <processor/Processor.h>
 
+/// Size of the UDP header in front of each payload.
+#define UDP_HEADER_SIZE 8
+
 UdpManager UdpManager::manager;
 
+UdpEndpoint::~UdpEndpoint()
+{
+  while(m_Count)
+  {
+    releaseSlot(m_pSlots[m_Head]);
+    m_Head = (m_Head + 1) % m_nSlots;
+    --m_Count;
+  }
+
+  delete [] m_pSlots;
+  delete [] m_pSlotData;
+}
+
 void UdpEndpoint::setLocalPort(uint16_t port)
 {
     if(!port)
@@ -35,7 +52,8 @@ void UdpEndpoint::setLocalPort(uint16_t port)
             return;
     }
 
-    UdpManager::instance().bindEndpoint(this, port);
+    if(!UdpManager::instance().bindEndpoint(this, port))
+        return;
 
     Endpoint::setLocalPort(port);
 }
@@ -48,82 +66,67 @@ int UdpEndpoint::send(size_t nBytes, uintptr_t buffer, RemoteEndpoint remoteHost
 
 int UdpEndpoint::recv(uintptr_t buffer, size_t maxSize, bool bBlock, RemoteEndpoint* remoteHost, int nTimeout)
 {
-  // Check for data to be ready. dataReady (acquire) takes one from the Semaphore,
-  // so using dataReady *again* to see if data is available is *wrong* unless
-  // the queue is empty.
-  bool bDataReady = false;
-  while(1)
-  {
-      if(dataReady(bBlock, nTimeout))
-      {
-          if(m_DataQueueSize.acquire())
-          {
-              bDataReady = true;
-              break;
-          }
-      }
-      else if(!bBlock)
-          break;
-  }
+  Segment segment;
+  segment.buffer = buffer;
+  segment.length = maxSize;
 
-  if(bDataReady)
-  {
-    DataBlock* ptr = m_DataQueue.popFront();
-    if(ptr->magic != 0xdeadbeef)
-    {
-      // Bang! We've been overrun, impossible to recover.
-      ERROR("UDP packet information is corrupted - magic is not 0xdeadbeef!");
-      ERROR("The packet cannot be forwarded to the application *or* freed.");
-      delete ptr;
-      return 0;
-    }
-
-    size_t nBytes = maxSize;
-    bool allRead = false;
+  // Blocking reads have always waited for as long as it takes.
+  return recv(&segment, 1, bBlock, remoteHost, 0, false, 0);
+};
 
-    // Only read in this block
-    if(nBytes >= ptr->size)
-    {
-      nBytes = ptr->size;
-      allRead = true;
-    }
+int UdpEndpoint::recv(const Segment *pSegments, size_t nSegments, bool bBlock,
+                      RemoteEndpoint *remoteHost, int nTimeout, bool bPeek,
+                      bool *pTruncated)
+{
+  // Each datagram on the ring has one count on the semaphore, so once we
+  // have one there's definitely a datagram waiting for us.
+  bool bDataReady = m_DataQueueSize.tryAcquire();
+  if(!bDataReady && bBlock)
+    bDataReady = m_DataQueueSize.acquire(1, nTimeout > 0 ? nTimeout : 0);
 
-    // And only past the offset
-    nBytes -= ptr->offset;
+  if(!bDataReady)
+  {
+    // EAGAIN, or EWOULDBLOCK
+    SYSCALL_ERROR(NoMoreProcesses);
+    return -1;
+  }
 
-    memcpy(reinterpret_cast<void*>(buffer), reinterpret_cast<void*>(ptr->ptr + ptr->offset), nBytes);
+  LockGuard<Mutex> guard(m_QueueLock);
 
-    *remoteHost = ptr->remoteHost;
+  Slot &slot = m_pSlots[m_Head];
 
-    // If the entire block has not been read, repush it with the new offset
-    if(!allRead)
-    {
-      ptr->offset = nBytes;
-      m_DataQueue.pushFront(ptr);
-      return nBytes;
-    }
-    // Otherwise we're done - free the block and return
-    else
-    {
-      delete reinterpret_cast<uint8_t*>(ptr->ptr);
-      delete ptr;
-      return nBytes;
-    }
+  size_t nBytes = 0;
+  for(size_t i = 0; (i < nSegments) && (nBytes < slot.size); ++i)
+  {
+    size_t n = slot.size - nBytes;
+    if(n > pSegments[i].length)
+      n = pSegments[i].length;
+    memcpy(reinterpret_cast<void*>(pSegments[i].buffer), slot.pData + nBytes, n);
+    nBytes += n;
   }
 
-  if(!bBlock)
+  if(pTruncated)
+    *pTruncated = nBytes < slot.size;
+  if(remoteHost)
+    *remoteHost = slot.remoteHost;
+
+  if(bPeek)
   {
-    // EAGAIN, or EWOULDBLOCK
-    SYSCALL_ERROR(NoMoreProcesses);
-    return -1;
+    m_DataQueueSize.release();
+    return nBytes;
   }
-  else
-    return 0;
-};
 
-size_t UdpEndpoint::depositPayload(size_t nBytes, uintptr_t payload, RemoteEndpoint remoteHost)
+  // Datagrams are read whole - anything that didn't fit is gone.
+  m_nQueuedBytes -= slot.size;
+  releaseSlot(slot);
+  m_Head = (m_Head + 1) % m_nSlots;
+  --m_Count;
+
+  return nBytes;
+}
+
+size_t UdpEndpoint::depositPayload(size_t nBytes, uintptr_t payload, RemoteEndpoint remoteHost, NetworkBuffer *pBuffer)
 {
-  /// \note Perhaps nBytes should also have an upper limit check?
   if(!nBytes || !payload)
     return 0;
 
@@ -131,17 +134,47 @@ size_t UdpEndpoint::depositPayload(size_t nBytes, uintptr_t payload, RemoteEndpo
   if(!m_bCanRecv)
     return 0;
 
-  // Otherwise, grab the data block and add it to the queue
-  uint8_t* data = new uint8_t[nBytes];
-  memcpy(data, reinterpret_cast<void*>(payload), nBytes);
+  {
+    LockGuard<Mutex> guard(m_QueueLock);
 
-  DataBlock* newBlock = new DataBlock;
-  newBlock->ptr = reinterpret_cast<uintptr_t>(data);
-  newBlock->offset = 0;
-  newBlock->size = nBytes;
-  newBlock->remoteHost = remoteHost;
+    if(!m_pSlots)
+      resizeRing(m_nRcvBuf, 0);
+
+    if((m_Count == m_nSlots) || ((m_nQueuedBytes + nBytes) > m_nRcvBuf))
+    {
+      ++m_nDropped;
+      NETSTAT_INC(UdpInErrors);
+      NETSTAT_INC(UdpRcvbufErrors);
+      return 0;
+    }
+
+    size_t index = (m_Head + m_Count) % m_nSlots;
+    Slot &slot = m_pSlots[index];
+    slot.size = nBytes;
+    slot.pBuffer = 0;
+    slot.pHeap = 0;
+    slot.remoteHost = remoteHost;
+
+    // Small datagrams (nearly all of them) are copied into the slot, so
+    // the received frame can go straight back to the driver. Anything
+    // bigger stays where it is if we can hold on to its buffer.
+    if(nBytes <= UDP_SLOT_SIZE)
+      slot.pData = m_pSlotData + (index * UDP_SLOT_SIZE);
+    else if(pBuffer)
+    {
+      slot.pBuffer = pBuffer->clone();
+      slot.pData = reinterpret_cast<uint8_t*>(payload);
+    }
+    else
+      slot.pData = slot.pHeap = new uint8_t[nBytes];
+
+    if(!slot.pBuffer)
+      memcpy(slot.pData, reinterpret_cast<void*>(payload), nBytes);
+
+    ++m_Count;
+    m_nQueuedBytes += nBytes;
+  }
 
-  m_DataQueue.pushBack(newBlock);
   m_DataQueueSize.release();
 
   // Data has arrived!
@@ -176,47 +209,134 @@ bool UdpEndpoint::dataReady(bool block, uint32_t tmout)
     return bResult;
 }
 
-void UdpManager::receive(IpAddress from, IpAddress to, uint16_t sourcePort, uint16_t destPort, uintptr_t payload, size_t payloadSize, Network* pCard)
+void UdpEndpoint::setReceiveBufferSize(size_t nBytes)
+{
+  if(nBytes < UDP_MIN_RCVBUF)
+    nBytes = UDP_MIN_RCVBUF;
+  else if(nBytes > UDP_MAX_RCVBUF)
+    nBytes = UDP_MAX_RCVBUF;
+
+  LockGuard<Mutex> guard(m_QueueLock);
+
+  m_nRcvBuf = nBytes;
+
+  // Shrinking never drops what's already queued - new datagrams are just
+  // turned away until the queue drains.
+  if(m_pSlots)
+    resizeRing(nBytes, m_Count);
+}
+
+void UdpEndpoint::resizeRing(size_t nBytes, size_t nMinimum)
+{
+  size_t nSlots = (nBytes + UDP_SLOT_SIZE - 1) / UDP_SLOT_SIZE;
+  if(nSlots < nMinimum)
+    nSlots = nMinimum;
+  if(nSlots == m_nSlots)
+    return;
+
+  Slot *pSlots = new Slot[nSlots];
+  uint8_t *pSlotData = new uint8_t[nSlots * UDP_SLOT_SIZE];
+
+  for(size_t i = 0; i < m_Count; ++i)
+  {
+    Slot &slot = pSlots[i];
+    slot = m_pSlots[(m_Head + i) % m_nSlots];
+    if(!(slot.pBuffer || slot.pHeap))
+    {
+      memcpy(pSlotData + (i * UDP_SLOT_SIZE), slot.pData, slot.size);
+      slot.pData = pSlotData + (i * UDP_SLOT_SIZE);
+    }
+  }
+
+  delete [] m_pSlots;
+  delete [] m_pSlotData;
+
+  m_pSlots = pSlots;
+  m_pSlotData = pSlotData;
+  m_nSlots = nSlots;
+  m_Head = 0;
+}
+
+void UdpEndpoint::releaseSlot(Slot &slot)
+{
+  if(slot.pBuffer)
+    slot.pBuffer->release();
+  delete [] slot.pHeap;
+
+  slot.pBuffer = 0;
+  slot.pHeap = 0;
+  slot.pData = 0;
+}
+
+void UdpManager::receive(IpAddress from, IpAddress to, uint16_t sourcePort, uint16_t destPort, uintptr_t payload, size_t payloadSize, Network* pCard, NetworkBuffer *pBuffer)
 {
   if(!pCard)
     return;
 
   // is there an endpoint for this port?
-  ConnectionlessEndpoint* e;
+  UdpEndpoint* e;
   {
     LockGuard<Mutex> guard(m_UdpMutex);
-    e = static_cast<ConnectionlessEndpoint *>(m_Endpoints.lookup(destPort));
+    e = static_cast<UdpEndpoint *>(m_Endpoints.lookup(destPort));
+
+    // Spread a shared port's datagrams by sender, so one sender's
+    // datagrams all reach the same endpoint (and stay in order).
+    if(e && e->m_pNextInGroup)
+    {
+      size_t nGroup = 0;
+      for(UdpEndpoint *p = e; p; p = p->m_pNextInGroup)
+        ++nGroup;
+
+      uint32_t hash = from.getIp() ^ (static_cast<uint32_t>(sourcePort) * 0x9E3779B1);
+      hash ^= hash >> 16;
+      hash *= 0x85EBCA6B;
+      hash ^= hash >> 13;
+
+      for(size_t n = hash % nGroup; n; --n)
+        e = e->m_pNextInGroup;
+    }
   }
 
-  StationInfo cardInfo = pCard->getStationInfo();
-  if(e != 0)
+  if(!e)
   {
-    /** Should we pass on the packet? **/
-    bool passOn = false;
+    NETSTAT_INC(UdpNoPorts);
+    return;
+  }
 
-    // Broadcast, and accepting broadcast?
-    if(to.getIp() == 0xffffffff)
-      passOn = e->acceptAnyAddress();
+  /** Should we pass on the packet? **/
+  StationInfo cardInfo = pCard->getStationInfo();
+  bool passOn = false;
 
-    // Not to us, but accepting any address?
-    else if(to.getIp() != cardInfo.ipv4.getIp())
-      passOn = e->acceptAnyAddress();
+  // Broadcast, and accepting broadcast?
+  if(to.getIp() == 0xffffffff)
+    passOn = e->acceptAnyAddress();
 
-    // To us!
-    else
-      passOn = true;
+  // Not to us, but accepting any address?
+  else if(to.getIp() != cardInfo.ipv4.getIp())
+    passOn = e->acceptAnyAddress();
 
-    if(!passOn)
-      return;
+  // To us!
+  else
+    passOn = true;
 
-    Endpoint::RemoteEndpoint host;
-    host.ip = from;
-    if(sourcePort)
-      host.remotePort = sourcePort;
-    else
-      host.remotePort = destPort;
-    e->depositPayload(payloadSize, payload, host);
-  }
+  if(!passOn)
+    return;
+
+  // Socket filters see the datagram as it arrived, header and all, which
+  // sits just before the payload.
+  size_t nAccept = e->filterPacket(payload - UDP_HEADER_SIZE, payloadSize + UDP_HEADER_SIZE);
+  if(nAccept <= UDP_HEADER_SIZE)
+    return;
+  payloadSize = nAccept - UDP_HEADER_SIZE;
+
+  Endpoint::RemoteEndpoint host;
+  host.ip = from;
+  if(sourcePort)
+    host.remotePort = sourcePort;
+  else
+    host.remotePort = destPort;
+  if(e->depositPayload(payloadSize, payload, host, pBuffer))
+    NETSTAT_INC(UdpInDatagrams);
 }
 
 void UdpManager::returnEndpoint(Endpoint* e)
@@ -224,7 +344,7 @@ void UdpManager::returnEndpoint(Endpoint* e)
   LockGuard<Mutex> guard(m_UdpMutex);
   if(e)
   {
-    m_Endpoints.remove(e->getLocalPort());
+    unbindEndpoint(static_cast<UdpEndpoint *>(e));
     delete e;
   }
 }
@@ -252,6 +372,7 @@ Endpoint* UdpManager::getEndpoint(IpAddress remoteHost, uint16_t localPort, uint
           e->setManager(this);
 
           m_Endpoints.insert(localPort, e);
+          m_PortsAvailable.set(localPort);
       }
 
       return e;
@@ -273,20 +394,93 @@ uint16_t UdpManager::allocatePort()
     return static_cast<uint16_t>(bit & 0xFFFF);
 }
 
-void UdpManager::bindEndpoint(Endpoint *p, size_t localPort)
+bool UdpManager::bindEndpoint(UdpEndpoint *p, size_t localPort)
 {
     LockGuard<Mutex> guard(m_UdpMutex);
 
     // Already allocated?
-    Endpoint *e = m_Endpoints.lookup(localPort);
-    if(e)
+    UdpEndpoint *e = static_cast<UdpEndpoint *>(m_Endpoints.lookup(localPort));
+    if(e == p)
+        return true;
+    if(e && !(e->m_bReusePort && p->m_bReusePort))
     {
         NOTICE("bindEndpoint called with already-used local port");
-        return;
+        return false;
     }
 
-    // Insert.
+    // Leave the port we were on (usually one allocated when the socket was
+    // created).
+    unbindEndpoint(p);
+
     p->setManager(this);
-    m_Endpoints.insert(localPort, p);
+    if(e)
+    {
+        while(e->m_pNextInGroup)
+            e = e->m_pNextInGroup;
+        e->m_pNextInGroup = p;
+    }
+    else
+    {
+        m_Endpoints.insert(localPort, p);
+        m_PortsAvailable.set(localPort);
+    }
+
+    return true;
+}
+
+void UdpManager::unbindEndpoint(UdpEndpoint *p)
+{
+    size_t localPort = p->getLocalPort();
+    UdpEndpoint *e = static_cast<UdpEndpoint *>(m_Endpoints.lookup(localPort));
+    if(!e)
+        return;
+
+    if(e == p)
+    {
+        m_Endpoints.remove(localPort);
+        if(p->m_pNextInGroup)
+            m_Endpoints.insert(localPort, p->m_pNextInGroup);
+        else
+            m_PortsAvailable.clear(localPort);
+    }
+    else
+    {
+        while(e->m_pNextInGroup && (e->m_pNextInGroup != p))
+            e = e->m_pNextInGroup;
+        if(e->m_pNextInGroup == p)
+            e->m_pNextInGroup = p->m_pNextInGroup;
+    }
+
+    p->m_pNextInGroup = 0;
 }
 
+void UdpManager::dumpEndpoints(String &str)
+{
+    LockGuard<Mutex> guard(m_UdpMutex);
+
+    str += "Local Remote Recv-Q Datagrams RcvBuf Drops\n";
+    for(Tree<size_t, Endpoint*>::Iterator it = m_Endpoints.begin();
+        it != m_Endpoints.end();
+        it++)
+    {
+        for(UdpEndpoint *p = reinterpret_cast<UdpEndpoint*>(it.value()); p; p = p->m_pNextInGroup)
+        {
+            LargeStaticString line;
+            line.append(static_cast<size_t>(p->getLocalPort()));
+            line += " ";
+            line += static_cast<const char*>(p->getRemoteIp().toString());
+            line += ":";
+            line.append(static_cast<size_t>(p->getRemotePort()));
+            line += " ";
+            line.append(p->m_nQueuedBytes);
+            line += " ";
+            line.append(p->m_Count);
+            line += " ";
+            line.append(p->m_nRcvBuf);
+            line += " ";
+            line.append(p->m_nDropped);
+            line += "\n";
+            str += static_cast<const char*>(line);
+        }
+    }
+}
@@ -35,6 +35,15 @@
 #include "Endpoint.h"
 #include "Udp.h"
 
+/// Payload bytes each pre-allocated receive slot holds. Bigger datagrams
+/// (reassembled from fragments) are kept in their own buffer instead.
+#define UDP_SLOT_SIZE       1536
+
+/// Default, smallest and largest receive queue (SO_RCVBUF), in bytes.
+#define UDP_DEFAULT_RCVBUF  65536
+#define UDP_MIN_RCVBUF      4096
+#define UDP_MAX_RCVBUF      (4 * 1024 * 1024)
+
 /**
  * The Pedigree network stack - UDP Endpoint
  * \todo This needs to keep track of a LOCAL IP as well
@@ -43,25 +52,41 @@
  */
 class UdpEndpoint : public ConnectionlessEndpoint
 {
+  friend class UdpManager;
+
   public:
 
+    /** Part of a scatter list to receive into. */
+    struct Segment
+    {
+      uintptr_t buffer;
+      size_t length;
+    };
+
     /** Constructors and destructors */
     UdpEndpoint() :
-      ConnectionlessEndpoint(), m_DataQueue(), m_DataQueueSize(0),
-      m_bAcceptAll(false), m_bCanSend(true), m_bCanRecv(true)
+      ConnectionlessEndpoint(), m_pSlots(0), m_pSlotData(0), m_nSlots(0),
+      m_Head(0), m_Count(0), m_nQueuedBytes(0), m_nRcvBuf(UDP_DEFAULT_RCVBUF),
+      m_nDropped(0), m_QueueLock(false), m_DataQueueSize(0),
+      m_bAcceptAll(false), m_bCanSend(true), m_bCanRecv(true),
+      m_bReusePort(false), m_pNextInGroup(0)
     {};
     UdpEndpoint(uint16_t local, uint16_t remote) :
-      ConnectionlessEndpoint(local, remote), m_DataQueue(),
+      ConnectionlessEndpoint(local, remote), m_pSlots(0), m_pSlotData(0),
+      m_nSlots(0), m_Head(0), m_Count(0), m_nQueuedBytes(0),
+      m_nRcvBuf(UDP_DEFAULT_RCVBUF), m_nDropped(0), m_QueueLock(false),
       m_DataQueueSize(0), m_bAcceptAll(false), m_bCanSend(true),
-      m_bCanRecv(true)
+      m_bCanRecv(true), m_bReusePort(false), m_pNextInGroup(0)
     {};
     UdpEndpoint(IpAddress remoteIp, uint16_t local = 0, uint16_t remote = 0) :
-      ConnectionlessEndpoint(remoteIp, local, remote), m_DataQueue(),
+      ConnectionlessEndpoint(remoteIp, local, remote), m_pSlots(0),
+      m_pSlotData(0), m_nSlots(0), m_Head(0), m_Count(0), m_nQueuedBytes(0),
+      m_nRcvBuf(UDP_DEFAULT_RCVBUF), m_nDropped(0), m_QueueLock(false),
       m_DataQueueSize(0), m_bAcceptAll(false), m_bCanSend(true),
-      m_bCanRecv(true)
+      m_bCanRecv(true), m_bReusePort(false), m_pNextInGroup(0)
     {};
 
-    virtual ~UdpEndpoint() {};
+    virtual ~UdpEndpoint();
 
     /** Application interface */
     virtual int state() {return 0xff;} // 0xff signifies UDP
@@ -71,8 +96,19 @@ class UdpEndpoint : public ConnectionlessEndpoint
     virtual inline bool acceptAnyAddress() { return m_bAcceptAll; };
     virtual inline void acceptAnyAddress(bool accept) { m_bAcceptAll = accept; };
 
+    /**
+     * Receives one datagram into a scatter list. Whatever doesn't fit is
+     * discarded, and *pTruncated set.
+     * \param nTimeout Seconds to wait if blocking, or 0 to wait forever.
+     * \param bPeek Leave the datagram on the queue.
+     * \return bytes received, or -1 with the error set.
+     */
+    int recv(const Segment *pSegments, size_t nSegments, bool bBlock,
+             RemoteEndpoint *remoteHost, int nTimeout, bool bPeek,
+             bool *pTruncated);
+
     /** UdpManager functionality - called to deposit data into our local buffer */
-    virtual size_t depositPayload(size_t nBytes, uintptr_t payload, RemoteEndpoint remoteHost);
+    virtual size_t depositPayload(size_t nBytes, uintptr_t payload, RemoteEndpoint remoteHost, NetworkBuffer *pBuffer = 0);
 
     /** Shutdown on a UDP endpoint merely disables via software the ability to send/recv */
     virtual bool shutdown(ShutdownType what)
@@ -88,27 +124,76 @@ class UdpEndpoint : public ConnectionlessEndpoint
 
     virtual void setLocalPort(uint16_t port);
 
-  private:
+    /** Sets the most payload the receive queue holds (SO_RCVBUF). Datagrams
+     *  arriving when it's full are dropped. */
+    void setReceiveBufferSize(size_t nBytes);
+
+    size_t getReceiveBufferSize() const
+    {
+        return m_nRcvBuf;
+    }
+
+    /** Lets other endpoints which also set this bind to the same port
+     *  (SO_REUSEPORT). Datagrams are spread between them by sender, so
+     *  each flow always goes to the same endpoint. Set it before binding. */
+    void setReusePort(bool bReuse)
+    {
+        m_bReusePort = bReuse;
+    }
+
+    bool getReusePort() const
+    {
+        return m_bReusePort;
+    }
 
-    struct DataBlock
+    /** Number of datagrams dropped because the receive queue was full. */
+    size_t getDropped() const
     {
-      DataBlock() :
-        magic(0xdeadbeef), size(0), offset(0), ptr(0), remoteHost()
-      {};
+        return m_nDropped;
+    }
 
-      uint32_t magic; // 0xdeadbeef
+  private:
 
+    /** A received datagram. */
+    struct Slot
+    {
+      /// The payload: in the slot's own storage, in pHeap, or in pBuffer.
+      uint8_t *pData;
       size_t size;
-      size_t offset; // if we only do a partial read, this is filled
-      uintptr_t ptr;
+
+      /// Holds a datagram too big for the slot, if there was a buffer
+      /// to clone - otherwise pHeap holds a copy.
+      NetworkBuffer *pBuffer;
+      uint8_t *pHeap;
 
       RemoteEndpoint remoteHost; // who sent it to us - needed for port info!
     };
 
-    /** Incoming data queue */
-    List<DataBlock*> m_DataQueue;
+    /** Allocates the ring, with enough slots for nBytes (and at least
+     *  nMinimum). Anything already queued moves across. Queue lock must
+     *  be held. */
+    void resizeRing(size_t nBytes, size_t nMinimum);
+
+    /** Frees whatever holds a slot's payload. */
+    static void releaseSlot(Slot &slot);
+
+    /** Ring of received datagrams, allocated on first use. */
+    Slot *m_pSlots;
+    uint8_t *m_pSlotData;
+    size_t m_nSlots;
+    size_t m_Head;
+    size_t m_Count;
 
-    /** Data queue size */
+    /** Payload bytes queued, and the most there may be (SO_RCVBUF). */
+    size_t m_nQueuedBytes;
+    size_t m_nRcvBuf;
+
+    size_t m_nDropped;
+
+    /** Protects the ring. */
+    Mutex m_QueueLock;
+
+    /** Number of datagrams on the ring, for receivers to wait on. */
     Semaphore m_DataQueueSize;
 
     /** Accept any address? */
@@ -119,6 +204,12 @@ class UdpEndpoint : public ConnectionlessEndpoint
 
     /** Can we receive? */
     bool m_bCanRecv;
+
+    /** SO_REUSEPORT set? */
+    bool m_bReusePort;
+
+    /** Next endpoint sharing our port, if any. */
+    UdpEndpoint *m_pNextInGroup;
 };
 
 /**
@@ -151,7 +242,11 @@ public:
   void returnEndpoint(Endpoint* e);
 
   /** A new packet has arrived! */
-  void receive(IpAddress from, IpAddress to, uint16_t sourcePort, uint16_t destPort, uintptr_t payload, size_t payloadSize, Network* pCard);
+  void receive(IpAddress from, IpAddress to, uint16_t sourcePort, uint16_t destPort, uintptr_t payload, size_t payloadSize, Network* pCard, NetworkBuffer *pBuffer = 0);
+
+  /** Appends a line per bound endpoint to str: the local port, remote
+   *  address, what's queued, the queue's limit and the drops. */
+  void dumpEndpoints(String &str);
 
 private:
 
@@ -170,7 +265,12 @@ protected:
 
   uint16_t allocatePort();
 
-  void bindEndpoint(Endpoint *p, size_t localPort);
+  /** Moves p to the given port. Returns false if the port is taken (and
+   *  the port isn't shared by SO_REUSEPORT). */
+  bool bindEndpoint(UdpEndpoint *p, size_t localPort);
+
+  /** Takes p off the port it's bound to. m_UdpMutex must be held. */
+  void unbindEndpoint(UdpEndpoint *p);
 };
 
 #endif
@@ -21,48 +21,85 @@
 #include <Module.h>
 #include <vfs/VFS.h>
 #include <vfs/Filesystem.h>
+#include <vfs/BootTrace.h>
 #include <process/Semaphore.h>
 #include <process/Scheduler.h>
-#include <vfs/MemoryMappedFile.h>
-
-const char *g_FilesToPreload[] = {
-    "root»/applications/winman",
-    "root»/applications/tui",
-    "root»/applications/TUI",
-    "root»/applications/login",
-    "root»/libraries/libc.so",
-    "root»/libraries/libm.so",
-    "root»/libraries/libcairo.so",
-    "root»/libraries/libpixman-1.so",
-    "root»/libraries/libz.so.1",
-    "root»/libraries/libfontconfig.so",
-    "root»/libraries/libfreetype.so",
-    "root»/libraries/libexpat.so",
-    "root»/libraries/libpng15.so",
-    0
-};
-
-Semaphore g_Preloads(0);
-
-int preloadThread(void *p)
-{
-    const char *s = (const char *) p;
+#include <machine/Machine.h>
+#include <utilities/utility.h>
+#include <Atomic.h>
+
+/** Number of threads replaying the trace at once. Enough to keep a queue of
+    requests at the disk without thrashing the heads between files. */
+#define PRELOAD_THREADS     4
+
+/** Largest single read issued per trace entry. */
+#define PRELOAD_CHUNK       0x40000
+
+/** A trace that finds fewer of its ranges than this (percent) no longer
+    matches the boot, and is dropped so the next boot records a new one. */
+#define PRELOAD_MIN_HITS    75
+
+/** Boots a trace is replayed for before it's re-recorded anyway, to pick up
+    changes that don't show up as missing files. */
+#define PRELOAD_MAX_REPLAYS 16
+
+static BootTraceEntry **g_pEntries = 0;
+static size_t g_nEntries = 0;
+static Atomic<size_t> g_NextEntry(0);
+static Atomic<size_t> g_BytesRead(0);
+static Atomic<size_t> g_Hits(0);
 
-    NOTICE("PRELOAD: " << s);
+static Semaphore g_Preloads(0);
 
-    File* pFile = VFS::instance().find(String(s));
-    if(pFile)
+static int preloadThread(void *p)
+{
+    File *pFile = 0;
+    String lastPath;
+
+    while(true)
     {
-        NOTICE("PRELOAD: preloading " << s << "...");
-        size_t sz = 0;
-        while(sz < pFile->getSize())
+        // Entries are already in on-disk order; taking the next one each time
+        // keeps the readers moving across the disk together.
+        size_t n = (g_NextEntry += 1) - 1;
+        if(n >= g_nEntries)
+            break;
+
+        BootTraceEntry *pEntry = g_pEntries[n];
+
+        char *path = new char[pEntry->pathLength + 1];
+        memcpy(path, reinterpret_cast<char *>(pEntry) + sizeof(BootTraceEntry), pEntry->pathLength);
+        path[pEntry->pathLength] = 0;
+
+        // Consecutive entries often refer to the same file.
+        if(!pFile || !(lastPath == path))
         {
-            pFile->read(sz, 0x1000, 0);
-            sz += 0x1000;
+            lastPath = path;
+            pFile = VFS::instance().find(lastPath);
+        }
+        delete [] path;
+
+        if(!pFile)
+            continue;
+
+        if(pEntry->offset < pFile->getSize())
+            g_Hits += 1;
+
+        uint64_t offset = pEntry->offset;
+        uint64_t end = offset + pEntry->length;
+        while(offset < end)
+        {
+            uint64_t sz = end - offset;
+            if(sz > PRELOAD_CHUNK)
+                sz = PRELOAD_CHUNK;
+
+            uint64_t nRead = pFile->read(offset, sz, 0);
+            g_BytesRead += nRead;
+            if(!nRead)
+                break;
+            offset += sz;
         }
     }
 
-    NOTICE("PRELOAD: preload " << s << " has completed.");
     g_Preloads.release();
 
     return 0;
@@ -70,18 +107,93 @@ int preloadThread(void *p)
 
 static bool init()
 {
-    size_t n = 0;
-    const char *s = g_FilesToPreload[n++];
-    do
+    File *pTrace = VFS::instance().find(String(BOOT_TRACE_PATH));
+    if(!pTrace || pTrace->isDirectory() || (pTrace->getSize() < sizeof(BootTraceHeader)))
+    {
+        NOTICE("PRELOAD: no boot trace, this boot will record one.");
+        return false;
+    }
+
+    // We have a trace, so there's no need to record another (and our own
+    // reads would only pollute it).
+    BootTrace::instance().cancel();
+
+    size_t traceSize = pTrace->getSize();
+    uint8_t *pBuffer = new uint8_t[traceSize];
+    if(pTrace->read(0, traceSize, reinterpret_cast<uintptr_t>(pBuffer)) != traceSize)
     {
-        NOTICE("PRELOAD: Queue " << s);
-        Thread *pThread = new Thread(Processor::information().getCurrentThread()->getParent(), preloadThread, const_cast<char*>(s));
+        WARNING("PRELOAD: couldn't read the boot trace.");
+        delete [] pBuffer;
+        return false;
+    }
+
+    BootTraceHeader *pHeader = reinterpret_cast<BootTraceHeader *>(pBuffer);
+    if(pHeader->magic != BOOT_TRACE_MAGIC)
+    {
+        WARNING("PRELOAD: boot trace is corrupt or out of date, the next boot will record a new one.");
+        VFS::instance().remove(String(BOOT_TRACE_PATH));
+        delete [] pBuffer;
+        return false;
+    }
+
+    // Index the entries, stopping at anything that runs off the end. The
+    // count comes from disk, so don't trust it further than the file goes.
+    size_t nEntries = pHeader->nEntries;
+    size_t maxEntries = (traceSize - sizeof(BootTraceHeader)) / sizeof(BootTraceEntry);
+    if(nEntries > maxEntries)
+        nEntries = maxEntries;
+    g_pEntries = new BootTraceEntry*[nEntries];
+    size_t off = sizeof(BootTraceHeader);
+    for(g_nEntries = 0; g_nEntries < nEntries; ++g_nEntries)
+    {
+        if((off + sizeof(BootTraceEntry)) > traceSize)
+            break;
+        BootTraceEntry *pEntry = reinterpret_cast<BootTraceEntry *>(pBuffer + off);
+        if((off + sizeof(BootTraceEntry) + pEntry->pathLength) > traceSize)
+            break;
+
+        g_pEntries[g_nEntries] = pEntry;
+        off += sizeof(BootTraceEntry) + pEntry->pathLength;
+    }
+
+    NOTICE("PRELOAD: replaying " << Dec << g_nEntries << " ranges (recorded boot reached login in " <<
+           pHeader->loginMs << " ms)" << Hex);
+
+    uint64_t start = Machine::instance().getTimer()->getTickCount();
+
+    size_t nThreads = PRELOAD_THREADS;
+    if(nThreads > g_nEntries)
+        nThreads = g_nEntries;
+    for(size_t i = 0; i < nThreads; ++i)
+    {
+        Thread *pThread = new Thread(Processor::information().getCurrentThread()->getParent(), preloadThread, 0);
         pThread->detach();
-        s = g_FilesToPreload[n++];
-    } while(s);
+    }
+
+    if(nThreads)
+        g_Preloads.acquire(nThreads);
+
+    uint64_t elapsed = Machine::instance().getTimer()->getTickCount() - start;
+    NOTICE("PRELOAD: preloaded " << Dec << static_cast<size_t>(g_BytesRead) << " bytes in " << elapsed << " ms." << Hex);
+
+    // Refresh the trace if it's stopped matching the boot, or just got old.
+    size_t nHits = g_Hits;
+    if((nHits * 100) < (g_nEntries * PRELOAD_MIN_HITS) || (pHeader->nReplays + 1) >= PRELOAD_MAX_REPLAYS)
+    {
+        NOTICE("PRELOAD: " << Dec << nHits << "/" << g_nEntries << " ranges found after " <<
+               (pHeader->nReplays + 1) << Hex << " replays, the next boot will record a new trace.");
+        VFS::instance().remove(String(BOOT_TRACE_PATH));
+    }
+    else
+    {
+        pHeader->nReplays++;
+        pTrace->write(0, sizeof(BootTraceHeader), reinterpret_cast<uintptr_t>(pHeader));
+    }
 
-    g_Preloads.acquire(n - 1);
-    NOTICE("PRELOAD: preloaded " << n << " files.");
+    delete [] g_pEntries;
+    delete [] pBuffer;
+    g_pEntries = 0;
+    g_nEntries = 0;
 
     // Trick: return false, which unloads this module (its purpose is complete.)
     return false;
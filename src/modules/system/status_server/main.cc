@@ -26,6 +26,9 @@
 #include <network-stack/TcpManager.h>
 #include <network-stack/RoutingTable.h>
 #include <network-stack/NetworkStack.h>
+#include <network-stack/Dns.h>
+#include <network-stack/NetworkStatistics.h>
+#include <network-stack/UdpManager.h>
 #include <network-stack/ConnectionBasedEndpoint.h>
 #include <vfs/VFS.h>
 #include <vfs/Filesystem.h>
@@ -136,6 +139,7 @@ int clientThread(void *p)
             for (i = 0; i < NetworkStack::instance().getNumDevices(); i++)
             {
                 Network* card = NetworkStack::instance().getDevice(i);
+                card->updateRates();
                 StationInfo info = card->getStationInfo();
 
                 // Interface number
@@ -205,6 +209,12 @@ int clientThread(void *p)
                 s.append(info.nDropped);
                 s += "<br />RX Errors: ";
                 s.append(info.nBad);
+                s += "<br />Interrupts: ";
+                s.append(info.nInterrupts);
+                s += "<br />Packets/sec: ";
+                s.append(info.nPacketsPerSecond);
+                s += "<br />Interrupts/sec: ";
+                s.append(info.nInterruptsPerSecond);
                 response += s;
                 response += "</td>";
 
@@ -212,6 +222,39 @@ int clientThread(void *p)
             }
             response += "</table>";
 
+            response += "<h3>DNS</h3>";
+            response += "<table border='1'><tr><th>Cached names</th><th>Hits</th><th>Negative hits</th><th>Misses</th><th>Coalesced</th><th>Requests</th><th>Timeouts</th></tr>";
+            {
+                Dns::Statistics stats = Dns::instance().getStatistics();
+                LargeStaticString s;
+                s += "<tr><td>";
+                s.append(Dns::instance().getCacheSize());
+                s += "</td><td>";
+                s.append(stats.hits);
+                s += "</td><td>";
+                s.append(stats.negativeHits);
+                s += "</td><td>";
+                s.append(stats.misses);
+                s += "</td><td>";
+                s.append(stats.coalesced);
+                s += "</td><td>";
+                s.append(stats.requests);
+                s += "</td><td>";
+                s.append(stats.timeouts);
+                s += "</td></tr>";
+                response += s;
+            }
+            response += "</table>";
+
+            response += "<h3>Protocol Statistics</h3><pre>";
+            NetworkStatistics::instance().dump(response);
+            response += "</pre>";
+
+            response += "<h3>Sockets</h3><pre>";
+            TcpManager::instance().dumpConnections(response);
+            UdpManager::instance().dumpEndpoints(response);
+            response += "</pre>";
+
             response += "<h3>VFS</h3>";
             response += "<table border='1'><tr><th>VFS Alias</th><th>Disk</th></tr>";
 
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "BootTrace.h"
+#include "VFS.h"
+#include "File.h"
+
+#include <Log.h>
+#include <LockGuard.h>
+#include <machine/Machine.h>
+#include <process/Scheduler.h>
+#include <utilities/utility.h>
+
+/** Gaps of up to this many pages between two recorded ranges of a file are
+    read anyway - one longer sequential read beats two reads and a seek. */
+#define BOOT_TRACE_MAX_GAP  8
+
+/** Disk offsets at or above this sort after everything with a known offset. */
+#define BOOT_TRACE_UNKNOWN  (1ULL << 63)
+
+BootTrace BootTrace::m_Instance;
+
+/** One contiguous range of a file, ready to be written out. */
+struct TraceRun
+{
+    TraceRun(const String &p, uint64_t d, uint64_t o, uint64_t l) :
+        path(p), diskOffset(d), offset(o), length(l)
+    {}
+
+    String path;
+    uint64_t diskOffset;
+    uint64_t offset;
+    uint64_t length;
+};
+
+BootTrace::BootTrace() :
+    m_bRecording(true), m_bLoggedIn(false), m_pRecords(0), m_nRecords(0),
+    m_nRecorders(0), m_Lock(false)
+{
+    m_pRecords = new RawRecord[BOOT_TRACE_RECORDS];
+    memset(m_pRecords, 0, sizeof(RawRecord) * BOOT_TRACE_RECORDS);
+}
+
+BootTrace::~BootTrace()
+{
+    LockGuard<Mutex> guard(m_Lock);
+    stop();
+    discard();
+}
+
+void BootTrace::doRecord(File *pFile, uint64_t location, uint64_t size)
+{
+    if(!size)
+        return;
+
+    // This can be a page fault, so no locks and no allocation: just claim a
+    // slot. The File goes in last, so writeTrace skips half-written slots.
+    __sync_fetch_and_add(&m_nRecorders, 1);
+    if(m_bRecording)
+    {
+        size_t n = __sync_fetch_and_add(&m_nRecords, 1);
+        if(n < BOOT_TRACE_RECORDS)
+        {
+            RawRecord &record = m_pRecords[n];
+            record.location = location;
+            record.size = size;
+            __sync_synchronize();
+            record.pFile = pFile;
+        }
+    }
+    __sync_fetch_and_sub(&m_nRecorders, 1);
+}
+
+void BootTrace::stop()
+{
+    m_bRecording = false;
+    __sync_synchronize();
+    while(m_nRecorders)
+        Scheduler::instance().yield();
+}
+
+void BootTrace::cancel()
+{
+    LockGuard<Mutex> guard(m_Lock);
+    stop();
+    discard();
+}
+
+void BootTrace::loginComplete()
+{
+    bool bWasRecording = false;
+    {
+        LockGuard<Mutex> guard(m_Lock);
+        if(m_bLoggedIn)
+            return;
+        m_bLoggedIn = true;
+
+        bWasRecording = m_bRecording;
+        stop();
+    }
+
+    uint64_t loginMs = Machine::instance().getTimer()->getTickCount();
+    NOTICE("BOOTTRACE: boot to first login took " << Dec << loginMs << Hex << " ms" <<
+           (bWasRecording ? " (recording trace)." : "."));
+
+    if(bWasRecording)
+        writeTrace(loginMs);
+}
+
+void BootTrace::writeTrace(uint64_t loginMs)
+{
+    LockGuard<Mutex> guard(m_Lock);
+
+    size_t pageSz = PhysicalMemoryManager::getPageSize();
+
+    // Gather the recorded ranges into the pages touched in each file.
+    Tree<File*, TracedFile*> files;
+    size_t nRecords = m_nRecords;
+    if(nRecords > BOOT_TRACE_RECORDS)
+    {
+        WARNING("BOOTTRACE: " << Dec << (nRecords - BOOT_TRACE_RECORDS) << Hex <<
+                " ranges didn't fit in the trace.");
+        nRecords = BOOT_TRACE_RECORDS;
+    }
+    for(size_t i = 0; i < nRecords; ++i)
+    {
+        RawRecord &record = m_pRecords[i];
+        if(!record.pFile)
+            continue;
+
+        // Files stay cached by their filesystem while it's mounted, so the
+        // pointer is still good here.
+        TracedFile *pTraced = files.lookup(record.pFile);
+        if(!pTraced)
+        {
+            pTraced = new TracedFile;
+            pTraced->path = record.pFile->getFullPath();
+            files.insert(record.pFile, pTraced);
+        }
+
+        size_t last = (record.location + record.size - 1) / pageSz;
+        for(size_t page = record.location / pageSz; page <= last; ++page)
+            pTraced->pages.set(page);
+    }
+    discard();
+
+    // Build runs of pages for each file and sort them by their location on
+    // disk. Tree iteration is in key order.
+    Tree<uint64_t, TraceRun*> runs;
+    uint64_t nUnknown = 0;
+    size_t nBytes = sizeof(BootTraceHeader);
+    for(Tree<File*, TracedFile*>::Iterator it = files.begin(); it != files.end(); it++)
+    {
+        TracedFile *pTraced = it.value();
+
+        // Look the file up again by path, skipping any file that has been
+        // removed or renamed since it was read.
+        File *pFile = VFS::instance().find(pTraced->path);
+        if(!pFile)
+            continue;
+
+        size_t lastPage = pTraced->pages.getLastSet();
+        size_t page = pTraced->pages.getFirstSet();
+        while(page <= lastPage)
+        {
+            if(!pTraced->pages.test(page))
+            {
+                ++page;
+                continue;
+            }
+
+            // Extend the run, bridging small gaps.
+            size_t end = page + 1;
+            size_t gap = 0;
+            while((end + gap) <= lastPage && gap <= BOOT_TRACE_MAX_GAP)
+            {
+                if(pTraced->pages.test(end + gap))
+                {
+                    end += gap + 1;
+                    gap = 0;
+                }
+                else
+                    ++gap;
+            }
+
+            uint64_t offset = static_cast<uint64_t>(page) * pageSz;
+            uint64_t length = static_cast<uint64_t>(end - page) * pageSz;
+            if(offset >= pFile->getSize())
+                break;
+            if((offset + length) > pFile->getSize())
+                length = pFile->getSize() - offset;
+
+            uint64_t diskOffset = pFile->getDiskOffset(offset);
+            if((diskOffset == ~0ULL) || (diskOffset >= BOOT_TRACE_UNKNOWN) || runs.lookup(diskOffset))
+                diskOffset = BOOT_TRACE_UNKNOWN + nUnknown++;
+
+            runs.insert(diskOffset, new TraceRun(pTraced->path, diskOffset, offset, length));
+            nBytes += sizeof(BootTraceEntry) + pTraced->path.length();
+
+            page = end;
+        }
+    }
+
+    for(Tree<File*, TracedFile*>::Iterator it = files.begin(); it != files.end(); it++)
+        delete it.value();
+    files.clear();
+
+    uint8_t *pBuffer = new uint8_t[nBytes];
+    BootTraceHeader *pHeader = reinterpret_cast<BootTraceHeader *>(pBuffer);
+    pHeader->magic = BOOT_TRACE_MAGIC;
+    pHeader->nEntries = runs.count();
+    pHeader->loginMs = loginMs;
+    pHeader->nReplays = 0;
+
+    size_t off = sizeof(BootTraceHeader);
+    for(Tree<uint64_t, TraceRun*>::Iterator it = runs.begin(); it != runs.end(); it++)
+    {
+        TraceRun *pRun = it.value();
+
+        BootTraceEntry *pEntry = reinterpret_cast<BootTraceEntry *>(pBuffer + off);
+        pEntry->diskOffset = pRun->diskOffset;
+        pEntry->offset = pRun->offset;
+        pEntry->length = pRun->length;
+        pEntry->pathLength = pRun->path.length();
+        off += sizeof(BootTraceEntry);
+
+        memcpy(pBuffer + off, static_cast<const char *>(pRun->path), pEntry->pathLength);
+        off += pEntry->pathLength;
+
+        delete pRun;
+    }
+
+    String tracePath(BOOT_TRACE_PATH);
+    VFS::instance().createFile(tracePath, 0644);
+    File *pTrace = VFS::instance().find(tracePath);
+    if(pTrace && !pTrace->isDirectory())
+    {
+        pTrace->truncate();
+        pTrace->write(0, nBytes, reinterpret_cast<uintptr_t>(pBuffer));
+        NOTICE("BOOTTRACE: wrote " << Dec << runs.count() << Hex << " ranges to " << tracePath << ".");
+    }
+    else
+        WARNING("BOOTTRACE: couldn't create " << tracePath << ", boot trace not saved.");
+
+    runs.clear();
+    delete [] pBuffer;
+}
+
+void BootTrace::discard()
+{
+    delete [] m_pRecords;
+    m_pRecords = 0;
+    m_nRecords = 0;
+}
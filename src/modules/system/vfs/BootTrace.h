@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef BOOT_TRACE_H
+#define BOOT_TRACE_H
+
+#include <processor/types.h>
+#include <process/Mutex.h>
+#include <utilities/String.h>
+#include <utilities/Tree.h>
+#include <utilities/ExtensibleBitmap.h>
+
+class File;
+
+/** Location of the boot trace on the root filesystem. */
+#define BOOT_TRACE_PATH     "root»/config/boottrace"
+
+/** "PBT2" - identifies a boot trace file. */
+#define BOOT_TRACE_MAGIC    0x32544250
+
+/** Most ranges recorded in one boot. Any more are left out of the trace. */
+#define BOOT_TRACE_RECORDS  32768
+
+/** Header at the start of a boot trace file. */
+struct BootTraceHeader
+{
+    uint32_t magic;
+    uint32_t nEntries;
+    /** Boot-to-login time of the boot that recorded the trace. */
+    uint64_t loginMs;
+    /** Number of boots that have replayed the trace. */
+    uint32_t nReplays;
+} __attribute__((packed));
+
+/** One range of one file, in the order it should be read. The path (not
+    NUL-terminated) immediately follows each entry. */
+struct BootTraceEntry
+{
+    uint64_t diskOffset;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t pathLength;
+} __attribute__((packed));
+
+/**
+ * Records which parts of which files are touched between boot and the first
+ * login (through File::read and memory mapped file faults), and writes them
+ * out sorted by position on disk so the next boot can preload them with
+ * sequential reads.
+ *
+ * Recording starts as soon as the VFS is loaded; the preload module cancels
+ * it if a trace already exists (and removes the trace once it's stale, so
+ * the boot after records a new one).
+ */
+class BootTrace
+{
+    public:
+        BootTrace();
+        virtual ~BootTrace();
+
+        static BootTrace &instance()
+        {
+            return m_Instance;
+        }
+
+        /** Notes that the given range of pFile was needed. */
+        void record(File *pFile, uint64_t location, uint64_t size)
+        {
+            if(m_bRecording)
+                doRecord(pFile, location, size);
+        }
+
+        /** Stops recording and throws away anything recorded so far. */
+        void cancel();
+
+        /**
+         * Called on the first successful login: reports the boot-to-login
+         * time and, if we were recording, writes out the trace.
+         */
+        void loginComplete();
+
+        /** Is a recording in progress? */
+        bool isRecording() const
+        {
+            return m_bRecording;
+        }
+
+    private:
+        BootTrace(const BootTrace &);
+        BootTrace &operator = (const BootTrace &);
+
+        /** A range as record() saw it. Page faults record ranges too, so
+            nothing is allocated or looked up until the trace is written. */
+        struct RawRecord
+        {
+            File *pFile;
+            uint64_t location;
+            uint64_t size;
+        };
+
+        /** Pages touched in a single file. */
+        struct TracedFile
+        {
+            TracedFile() : path(), pages()
+            {}
+
+            String path;
+            ExtensibleBitmap pages;
+        };
+
+        void doRecord(File *pFile, uint64_t location, uint64_t size);
+
+        /** Sorts the recording into disk order and writes it out. */
+        void writeTrace(uint64_t loginMs);
+
+        /** Stops recording, and waits for any doRecord() calls still
+            writing a record. Lock must be held. */
+        void stop();
+
+        /** Frees all recorded state. Lock must be held, and recording
+            stopped. */
+        void discard();
+
+        static BootTrace m_Instance;
+
+        volatile bool m_bRecording;
+
+        /** Have we already seen a login? */
+        bool m_bLoggedIn;
+
+        /** Ranges recorded so far; m_nRecords may run past the end, once
+            it's full. */
+        RawRecord *m_pRecords;
+        volatile size_t m_nRecords;
+
+        /** Number of doRecord() calls in progress. */
+        volatile size_t m_nRecorders;
+
+        /** Guards starting and stopping (not record()). */
+        Mutex m_Lock;
+};
+
+#endif
@@ -21,6 +21,7 @@
 #include "File.h"
 #include "Symlink.h"
 #include "Filesystem.h"
+#include "BootTrace.h"
 #include <processor/Processor.h>
 #include <process/Scheduler.h>
 #include <Log.h>
@@ -61,7 +62,8 @@ File::File() :
     m_Name(""), m_AccessedTime(0), m_ModifiedTime(0),
     m_CreationTime(0), m_Inode(0), m_pFilesystem(0), m_Size(0),
     m_pParent(0), m_nWriters(0), m_nReaders(0), m_Uid(0), m_Gid(0),
-    m_Permissions(0), m_DataCache(), m_Lock(), m_MonitorTargets()
+    m_Permissions(0), m_DataCache(), m_Lock(), m_MonitorTargets(),
+    m_WatcherLock(false), m_Watchers(), m_nWatcherRefs(0)
 {
 }
 
@@ -70,7 +72,8 @@ File::File(String name, Time accessedTime, Time modifiedTime, Time creationTime,
     m_Name(name), m_AccessedTime(accessedTime), m_ModifiedTime(modifiedTime),
     m_CreationTime(creationTime), m_Inode(inode), m_pFilesystem(pFs),
     m_Size(size), m_pParent(pParent), m_nWriters(0), m_nReaders(0), m_Uid(0),
-    m_Gid(0), m_Permissions(0), m_DataCache(), m_Lock(), m_MonitorTargets()
+    m_Gid(0), m_Permissions(0), m_DataCache(), m_Lock(), m_MonitorTargets(),
+    m_WatcherLock(false), m_Watchers(), m_nWatcherRefs(0)
 {
 }
 
@@ -93,6 +96,8 @@ uint64_t File::read(uint64_t location, uint64_t size, uintptr_t buffer, bool bCa
         }
     }
 
+    BootTrace::instance().record(this, location, size);
+
     size_t blockSize = getBlockSize();
     
     size_t n = 0;
@@ -317,6 +322,17 @@ void File::dataChanged()
     }
 
     m_MonitorTargets.clear();
+
+    m_WatcherLock.acquire();
+    for (List<FileWatcher*>::Iterator it = m_Watchers.begin();
+         it != m_Watchers.end();
+         it++)
+    {
+        (*it)->fileChanged(this);
+        bAny = true;
+    }
+    m_WatcherLock.release();
+
     m_Lock.release();
 
     // If anything was waiting on a change, wake it up now.
@@ -347,6 +363,56 @@ void File::cullMonitorTargets(Thread *pThread)
     }
 }
 
+void File::addWatcher(FileWatcher *pWatcher)
+{
+    increaseRefCount(false);
+
+    LockGuard<Mutex> guard(m_WatcherLock);
+    m_Watchers.pushBack(pWatcher);
+    m_nWatcherRefs ++;
+}
+
+void File::removeWatcher(FileWatcher *pWatcher)
+{
+    {
+        LockGuard<Mutex> guard(m_WatcherLock);
+
+        // Watchers that were told the File closed are already off the list,
+        // but still hold their reference.
+        for (List<FileWatcher*>::Iterator it = m_Watchers.begin();
+             it != m_Watchers.end();
+             it++)
+        {
+            if (*it == pWatcher)
+            {
+                m_Watchers.erase(it);
+                break;
+            }
+        }
+
+        m_nWatcherRefs --;
+    }
+
+    decreaseRefCount(false);
+}
+
+void File::checkWatchers()
+{
+    LockGuard<Mutex> guard(m_WatcherLock);
+
+    if (!m_nWatcherRefs || (m_nReaders + m_nWriters != m_nWatcherRefs))
+        return;
+
+    for (List<FileWatcher*>::Iterator it = m_Watchers.begin();
+         it != m_Watchers.end();
+         it++)
+    {
+        (*it)->fileClosed(this);
+    }
+
+    m_Watchers.clear();
+}
+
 void File::getFilesystemLabel(HugeStaticString &s)
 {
     s = m_pFilesystem->getVolumeLabel();
@@ -40,6 +40,28 @@
 #define FILE_OW 0200
 #define FILE_OX 0400
 
+class File;
+
+/** Receives a callback every time a File's state changes. Unlike the Events
+    passed to File::monitor, a FileWatcher stays registered until it is
+    explicitly removed.
+    \note The callbacks are made with the File's locks held: they must not
+           call back into the File, and should do as little work as possible. */
+class FileWatcher
+{
+public:
+    virtual ~FileWatcher()
+    {}
+
+    virtual void fileChanged(File *pFile) = 0;
+
+    /** Called once only watchers hold references to the File, ie, the last
+        descriptor for it has been closed. The watcher no longer gets
+        fileChanged calls, but must still be removed with removeWatcher. */
+    virtual void fileClosed(File *pFile)
+    {}
+};
+
 /** A File is a regular file - it is also the superclass of Directory, Symlink
     and Pipe. */
 class File
@@ -175,6 +197,8 @@ public:
             m_nWriters --;
         else
             m_nReaders --;
+
+        checkWatchers();
     }
 
     void setPermissions(uint32_t perms)
@@ -234,6 +258,15 @@ public:
     /** Walks the monitor-target queue, removing all for \p pThread .*/
     void cullMonitorTargets(Thread *pThread);
 
+    /** Registers a persistent watcher, notified on every change. The watcher
+        holds a reference on the File until it is removed, but doesn't keep
+        it open: see FileWatcher::fileClosed. */
+    void addWatcher(FileWatcher *pWatcher);
+
+    /** Removes a watcher previously added with addWatcher, and drops its
+        reference. */
+    void removeWatcher(FileWatcher *pWatcher);
+
     /** Does this File object support the given integer-based command? */
     virtual bool supports(const int command)
     {
@@ -251,6 +284,14 @@ public:
     virtual size_t getBlockSize() const
     {return PhysicalMemoryManager::getPageSize();}
 
+    /** Returns the byte offset on the underlying disk of the block holding
+        the given file location, or ~0 if the filesystem can't tell. Used to
+        put reads into on-disk order (eg, boot preloading). */
+    virtual uint64_t getDiskOffset(uint64_t location)
+    {
+        return ~0ULL;
+    }
+
 protected:
 
     /** Internal function to retrieve an aligned 512byte section of the file. */
@@ -276,6 +317,11 @@ protected:
     /** Internal function to notify all registered MonitorTargets. */
     void dataChanged();
 
+    /** Internal function, called by decreaseRefCount after dropping a
+        reference: once only watchers' references are left, tells each
+        watcher the File has been closed. */
+    void checkWatchers();
+
     /** Internal function to get the filesystem label for this file. */
     void getFilesystemLabel(HugeStaticString &s);
 
@@ -353,6 +399,15 @@ protected:
     };
 
     List<MonitorTarget*> m_MonitorTargets;
+
+    /** Guards m_Watchers and m_nWatcherRefs. Nests inside m_Lock. */
+    Mutex m_WatcherLock;
+
+    List<FileWatcher*> m_Watchers;
+
+    /** References held by watchers (including ones already told the File
+        has closed). */
+    size_t m_nWatcherRefs;
 };
 
 #endif
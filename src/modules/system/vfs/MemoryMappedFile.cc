@@ -18,6 +18,7 @@
  */
 
 #include "MemoryMappedFile.h"
+#include "BootTrace.h"
 
 #include <processor/PhysicalMemoryManager.h>
 #include <process/MemoryPressureManager.h>
@@ -638,6 +639,9 @@ bool MemoryMappedFile::trap(uintptr_t address, bool bWrite)
     size_t mappingOffset = (address - m_Address);
     size_t fileOffset = m_Offset + mappingOffset;
 
+    // Faults on pages already in the file cache never reach File::read.
+    BootTrace::instance().record(m_pBacking, fileOffset, pageSz);
+
     bool bWillEof = (mappingOffset + pageSz) > m_Length;
     bool bShouldCopy = m_bCopyOnWrite && (bWillEof || bWrite);
 
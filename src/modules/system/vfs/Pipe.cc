@@ -232,6 +232,8 @@ void Pipe::decreaseRefCount(bool bIsWriter)
         else
             m_nReaders --;
 
+        checkWatchers();
+
         if (m_nReaders == 0 && m_nWriters == 0)
         {
             // If we're anonymous, die completely.
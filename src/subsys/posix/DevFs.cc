@@ -32,6 +32,22 @@
 #include <utilities/utility.h>
 
 #include <sys/fb.h>
+#include <net/bpf.h>
+
+#include <network-stack/PacketCapture.h>
+#include <network-stack/Bpf.h>
+#include <network-stack/NetworkStatistics.h>
+#include <network-stack/TcpManager.h>
+#include <network-stack/UdpManager.h>
+#include <users/User.h>
+#include <linker/KernelElf.h>
+#include <linker/DynamicLinker.h>
+#include <process/Scheduler.h>
+#include <utilities/demangle.h>
+#include <syscallError.h>
+#include <LockGuard.h>
+
+#include "PosixSubsystem.h"
 
 DevFs DevFs::m_Instance;
 
@@ -103,6 +119,407 @@ uint64_t ZeroFile::write(uint64_t location, uint64_t size, uintptr_t buffer, boo
     return size;
 }
 
+bool CaptureFile::begin()
+{
+    // Captures see everyone's traffic.
+    Process *pProcess = Processor::information().getCurrentThread()->getParent();
+    if(pProcess->getEffectiveUser()->getId() != 0)
+    {
+        SYSCALL_ERROR(PermissionDenied);
+        return false;
+    }
+
+    return PacketCapture::instance().start();
+}
+
+uint64_t CaptureFile::read(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock)
+{
+    if(!begin())
+        return 0;
+
+    return PacketCapture::instance().read(reinterpret_cast<uint8_t*>(buffer), size, bCanBlock);
+}
+
+uint64_t CaptureFile::write(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock)
+{
+    return 0;
+}
+
+void CaptureFile::increaseRefCount(bool bIsWriter)
+{
+    File::increaseRefCount(bIsWriter);
+
+    LockGuard<Mutex> guard(m_OpenLock);
+    ++m_nOpen;
+}
+
+void CaptureFile::decreaseRefCount(bool bIsWriter)
+{
+    File::decreaseRefCount(bIsWriter);
+
+    LockGuard<Mutex> guard(m_OpenLock);
+    if(m_nOpen && !--m_nOpen)
+    {
+        PacketCapture::instance().stop();
+        PacketCapture::instance().setFilter(0);
+    }
+}
+
+int CaptureFile::select(bool bWriting, int timeout)
+{
+    if(bWriting)
+        return 1;
+
+    return PacketCapture::instance().poll(timeout != 0) ? 1 : 0;
+}
+
+bool CaptureFile::supports(const int command)
+{
+    return (command == BIOCSETF) || (command == BIOCGSTATS);
+}
+
+int CaptureFile::command(const int command, void *buffer)
+{
+    if(!begin())
+        return -1;
+
+    switch(command)
+    {
+        case BIOCSETF:
+            {
+                if(!PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(buffer), sizeof(struct bpf_program), PosixSubsystem::SafeRead))
+                {
+                    SYSCALL_ERROR(BadAddress);
+                    return -1;
+                }
+
+                const struct bpf_program *prog = reinterpret_cast<const struct bpf_program *>(buffer);
+                if(!prog->bf_len)
+                {
+                    PacketCapture::instance().setFilter(0);
+                    return 0;
+                }
+
+                size_t nBytes = prog->bf_len * sizeof(struct bpf_insn);
+                if((prog->bf_len > BPF_MAXINSNS) ||
+                   !PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(prog->bf_insns), nBytes, PosixSubsystem::SafeRead))
+                {
+                    SYSCALL_ERROR(InvalidArgument);
+                    return -1;
+                }
+
+                BpfProgram *pProgram = BpfProgram::create(reinterpret_cast<const BpfProgram::Instruction *>(prog->bf_insns), prog->bf_len);
+                if(!pProgram)
+                {
+                    SYSCALL_ERROR(InvalidArgument);
+                    return -1;
+                }
+
+                PacketCapture::instance().setFilter(pProgram);
+                pProgram->release();
+                return 0;
+            }
+
+        case BIOCGSTATS:
+            {
+                if(!PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(buffer), sizeof(struct bpf_stat), PosixSubsystem::SafeWrite))
+                {
+                    SYSCALL_ERROR(BadAddress);
+                    return -1;
+                }
+
+                size_t nCaptured = 0, nDropped = 0;
+                PacketCapture::instance().getStatistics(nCaptured, nDropped);
+
+                struct bpf_stat *stats = reinterpret_cast<struct bpf_stat *>(buffer);
+                stats->bs_recv = nCaptured;
+                stats->bs_drop = nDropped;
+                return 0;
+            }
+
+        default:
+            return -1;
+    }
+}
+
+uint64_t NetStatFile::read(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock)
+{
+    String str;
+    if(m_Contents == Counters)
+        NetworkStatistics::instance().dump(str);
+    else
+    {
+        str += "TCP\n";
+        TcpManager::instance().dumpConnections(str);
+        str += "UDP\n";
+        UdpManager::instance().dumpEndpoints(str);
+    }
+
+    // Readers move through the file by offset, so each read slices its
+    // piece out of the snapshot.
+    if(location >= str.length())
+        return 0;
+    if((location + size) > str.length())
+        size = str.length() - location;
+
+    const char *pStr = str;
+    memcpy(reinterpret_cast<void*>(buffer), pStr + location, size);
+    return size;
+}
+
+uint64_t NetStatFile::write(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock)
+{
+    return 0;
+}
+
+ProfileFile::ProfileFile(String str, size_t inode, Filesystem *pParentFS, File *pParentNode) :
+    File(str, 0, 0, 0, inode, pParentFS, 0, pParentNode), m_Lock(false), m_Offset(0),
+    m_Cpu(0), m_Next(0), m_Pending(), m_PendingOffset(0)
+{
+    memset(m_End, 0, sizeof(m_End));
+    memset(m_Symbols, 0, sizeof(m_Symbols));
+}
+
+uint64_t ProfileFile::read(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock)
+{
+    LockGuard<Mutex> guard(m_Lock);
+
+    // The text is made as it's read, so going backwards means starting
+    // again (and anything else skips ahead).
+    if(!location || (location < m_Offset))
+        rewind();
+
+    char *pBuffer = reinterpret_cast<char*>(buffer);
+    uint64_t nRead = 0;
+    while(nRead < size)
+    {
+        if(m_PendingOffset >= m_Pending.length())
+        {
+            if(!next())
+                break;
+            continue;
+        }
+
+        size_t nBytes = m_Pending.length() - m_PendingOffset;
+        if(m_Offset < location)
+        {
+            if(nBytes > (location - m_Offset))
+                nBytes = location - m_Offset;
+        }
+        else
+        {
+            if(nBytes > (size - nRead))
+                nBytes = size - nRead;
+            const char *pPending = m_Pending;
+            memcpy(pBuffer + nRead, pPending + m_PendingOffset, nBytes);
+            nRead += nBytes;
+        }
+
+        m_PendingOffset += nBytes;
+        m_Offset += nBytes;
+    }
+
+    return nRead;
+}
+
+uint64_t ProfileFile::write(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock)
+{
+    // Samples show what everyone is doing.
+    Process *pProcess = Processor::information().getCurrentThread()->getParent();
+    if(pProcess->getEffectiveUser()->getId() != 0)
+    {
+        SYSCALL_ERROR(PermissionDenied);
+        return 0;
+    }
+
+    NormalStaticString command;
+    const char *pBuffer = reinterpret_cast<const char*>(buffer);
+    for(size_t i = 0; (i < size) && (i < 63); ++i)
+    {
+        if((pBuffer[i] == '\n') || (pBuffer[i] == '\r') || !pBuffer[i])
+            break;
+        command.append(pBuffer[i]);
+    }
+
+    SampleProfiler &profiler = SampleProfiler::instance();
+    if(command == "stop")
+        profiler.stop();
+    else if(command == "clear")
+    {
+        // The rings can't be reset under processors still writing to them.
+        profiler.stop();
+        profiler.clear();
+    }
+    else if((command == "start") || (command.left(6) == "start "))
+    {
+        size_t hz = PROFILE_DEFAULT_HZ;
+        if(command.length() > 6)
+        {
+            int value = command.stripFirst(6).intValue();
+            if(value <= 0)
+            {
+                SYSCALL_ERROR(InvalidArgument);
+                return 0;
+            }
+            hz = value;
+        }
+
+        if(!profiler.start(hz))
+        {
+            // The scheduler timer can't be sped up on this machine.
+            SYSCALL_ERROR(NotSupported);
+            return 0;
+        }
+    }
+    else
+    {
+        SYSCALL_ERROR(InvalidArgument);
+        return 0;
+    }
+
+    return size;
+}
+
+void ProfileFile::rewind()
+{
+    SampleProfiler &profiler = SampleProfiler::instance();
+    for(size_t i = 0; i < PROFILE_CPUS; ++i)
+        m_End[i] = profiler.getCount(i);
+
+    m_Offset = 0;
+    m_Cpu = 0;
+    m_Next = profiler.getFirst(0);
+    m_Pending = "";
+    m_PendingOffset = 0;
+}
+
+bool ProfileFile::next()
+{
+    SampleProfiler &profiler = SampleProfiler::instance();
+    SampleProfiler::Sample sample;
+
+    m_Pending = "";
+    m_PendingOffset = 0;
+
+    while(m_Cpu < PROFILE_CPUS)
+    {
+        // Samples overwritten since the rewind are gone.
+        size_t first = profiler.getFirst(m_Cpu);
+        if(m_Next < first)
+            m_Next = first;
+
+        if(m_Next >= m_End[m_Cpu])
+        {
+            if(++m_Cpu < PROFILE_CPUS)
+                m_Next = profiler.getFirst(m_Cpu);
+            continue;
+        }
+
+        if(profiler.getSample(m_Cpu, m_Next++, sample))
+            break;
+    }
+
+    if(m_Cpu >= PROFILE_CPUS)
+        return false;
+
+    // Copy out what's needed from the sampled process while the process list
+    // is locked, as it can exit (or load and unload libraries) at any time.
+    LargeStaticString description("[unknown]");
+    LargeStaticString names[PROFILE_DEPTH];
+    uintptr_t starts[PROFILE_DEPTH];
+    bool found[PROFILE_DEPTH];
+    memset(starts, 0, sizeof(starts));
+    memset(found, 0, sizeof(found));
+    {
+        Scheduler &scheduler = Scheduler::instance();
+        LockGuard<Spinlock> guard(scheduler.getProcessLock());
+        for(size_t i = 0; i < scheduler.getNumProcesses(); ++i)
+        {
+            Process *pProcess = scheduler.getProcess(i);
+            if(!pProcess || (pProcess->getId() != sample.process))
+                continue;
+
+            description = pProcess->description();
+            DynamicLinker *pLinker = pProcess->getLinker();
+            if(sample.bUser && pLinker)
+            {
+                for(size_t j = 0; j < sample.depth; ++j)
+                    found[j] = pLinker->lookupSymbol(sample.frames[j], names[j], &starts[j]);
+            }
+            break;
+        }
+    }
+
+    // The header line, as perf script has it: command, pid/tid, CPU, time,
+    // period (ns) and event.
+    size_t frequency = profiler.getFrequency();
+    HugeStaticString line;
+    line += description;
+    line += " ";
+    line.append(sample.process);
+    line += "/";
+    line.append(sample.thread);
+    line += " [";
+    line.append(sample.cpu, 10, 3, '0');
+    line += "] ";
+    line.append(sample.timestamp / 1000);
+    line += ".";
+    line.append((sample.timestamp % 1000) * 1000, 10, 6, '0');
+    line += ": ";
+    line.append(1000000000ULL / (frequency ? frequency : PROFILE_DEFAULT_HZ));
+    line += " cpu-clock:\n";
+    m_Pending += static_cast<const char*>(line);
+
+    for(size_t i = 0; i < sample.depth; ++i)
+    {
+        uintptr_t start = starts[i];
+        const char *pName = 0;
+        if(!sample.bUser)
+            pName = lookupKernel(sample.frames[i], start);
+        else if(found[i])
+            pName = names[i];
+        frame(sample.frames[i], sample.bUser, pName, start);
+    }
+    m_Pending += "\n";
+
+    return true;
+}
+
+void ProfileFile::frame(uintptr_t address, bool bUser, const char *pName, uintptr_t start)
+{
+    HugeStaticString line;
+    line += "\t";
+    line.append(address, 16, 16, ' ');
+    line += " ";
+    if(pName)
+    {
+        LargeStaticString name;
+        demangle_full(LargeStaticString(pName), name);
+        line += name;
+        line += "+0x";
+        line.append(address - start, 16);
+    }
+    else
+        line += "[unknown]";
+    line += bUser ? " ([unknown])\n" : " ([kernel.kallsyms])\n";
+    m_Pending += static_cast<const char*>(line);
+}
+
+const char *ProfileFile::lookupKernel(uintptr_t address, uintptr_t &start)
+{
+    // Failed lookups are remembered too, as they're the most expensive.
+    Symbol &symbol = m_Symbols[(address >> 2) % PROFILE_SYMBOL_CACHE];
+    if(!address || (symbol.address != address))
+    {
+        symbol.address = address;
+        symbol.start = 0;
+        symbol.pName = KernelElf::instance().globalLookupSymbol(address, &symbol.start);
+    }
+
+    start = symbol.start;
+    return symbol.pName;
+}
+
 FramebufferFile::FramebufferFile(String str, size_t inode, Filesystem *pParentFS, File *pParentNode) :
     File(str, 0, 0, 0, inode, pParentFS, 0, pParentNode), m_pProvider(0), m_bTextMode(false), m_nDepth(0)
 {
@@ -359,5 +776,19 @@ bool DevFs::initialise(Disk *pDisk)
         delete pTty;
     }
 
+    // Create /dev/pcap for packet capture.
+    CaptureFile *pCapture = new CaptureFile(String("pcap"), ++baseInode, this, m_pRoot);
+    m_pRoot->addEntry(pCapture->getName(), pCapture);
+
+    // Create /dev/netstat and /dev/sockstat for network statistics.
+    NetStatFile *pNetStat = new NetStatFile(String("netstat"), ++baseInode, this, m_pRoot, NetStatFile::Counters);
+    m_pRoot->addEntry(pNetStat->getName(), pNetStat);
+    NetStatFile *pSockStat = new NetStatFile(String("sockstat"), ++baseInode, this, m_pRoot, NetStatFile::Sockets);
+    m_pRoot->addEntry(pSockStat->getName(), pSockStat);
+
+    // Create /dev/profile for the sampling profiler.
+    ProfileFile *pProfile = new ProfileFile(String("profile"), ++baseInode, this, m_pRoot);
+    m_pRoot->addEntry(pProfile->getName(), pProfile);
+
     return true;
 }
@@ -26,6 +26,8 @@
 
 #include <console/TextIO.h>
 
+#include <utilities/SampleProfiler.h>
+
 #include <graphics/Graphics.h>
 #include <graphics/GraphicsService.h>
 
@@ -68,6 +70,118 @@ public:
     uint64_t write(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock = true);
 };
 
+/** /dev/pcap: the network stack's packet capture, as a pcap stream. The
+ *  capture runs from the first read until the last descriptor is closed. */
+class CaptureFile : public File
+{
+public:
+    CaptureFile(String str, size_t inode, Filesystem *pParentFS, File *pParentNode) :
+        File(str, 0, 0, 0, inode, pParentFS, 0, pParentNode), m_nOpen(0), m_OpenLock(false)
+    {}
+    ~CaptureFile()
+    {}
+
+    uint64_t read(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock = true);
+    uint64_t write(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock = true);
+
+    virtual void increaseRefCount(bool bIsWriter);
+    virtual void decreaseRefCount(bool bIsWriter);
+
+    virtual int select(bool bWriting = false, int timeout = 0);
+
+    virtual bool supports(const int command);
+    virtual int command(const int command, void *buffer);
+
+private:
+    /** Checks the caller may capture (only root can), and starts the
+     *  capture if it isn't already running. */
+    bool begin();
+
+    size_t m_nOpen;
+    Mutex m_OpenLock;
+};
+
+/** /dev/netstat and /dev/sockstat: the network stack's protocol counters
+ *  and its sockets, as text. Each read takes a fresh snapshot. */
+class NetStatFile : public File
+{
+public:
+    enum Contents
+    {
+        Counters,
+        Sockets
+    };
+
+    NetStatFile(String str, size_t inode, Filesystem *pParentFS, File *pParentNode, Contents what) :
+        File(str, 0, 0, 0, inode, pParentFS, 0, pParentNode), m_Contents(what)
+    {}
+    ~NetStatFile()
+    {}
+
+    uint64_t read(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock = true);
+    uint64_t write(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock = true);
+
+private:
+    Contents m_Contents;
+};
+
+/// Kernel addresses whose symbols a ProfileFile remembers.
+#define PROFILE_SYMBOL_CACHE 1024
+
+/** /dev/profile: the kernel's sampling profiler. Writing "start [hz]",
+ *  "stop" or "clear" (which stops it too) controls it (only root can);
+ *  reading gives the samples held as "perf script" text, with addresses
+ *  looked up in the kernel, its modules, and each process' program and
+ *  libraries. */
+class ProfileFile : public File
+{
+public:
+    ProfileFile(String str, size_t inode, Filesystem *pParentFS, File *pParentNode);
+    ~ProfileFile()
+    {}
+
+    uint64_t read(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock = true);
+    uint64_t write(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock = true);
+
+private:
+    /** Starts the text over, from the oldest sample held. */
+    void rewind();
+
+    /** Formats the next sample into m_Pending. Returns false once the
+     *  samples that were held at the last rewind have all been done. */
+    bool next();
+
+    /** Adds the line for one of a sample's addresses to m_Pending, given
+     *  the symbol (if any) it was found in and where that starts. */
+    void frame(uintptr_t address, bool bUser, const char *pName, uintptr_t start);
+
+    /** Looks up a kernel or module address, remembering the answer. */
+    const char *lookupKernel(uintptr_t address, uintptr_t &start);
+
+    Mutex m_Lock;
+
+    /** Offset in the text that m_Pending carries on from. */
+    uint64_t m_Offset;
+
+    /** Next sample to format, and where each processor's samples ended
+     *  at the last rewind. */
+    size_t m_Cpu;
+    size_t m_Next;
+    size_t m_End[PROFILE_CPUS];
+
+    /** Text for the current sample, and how much of it has been read. */
+    String m_Pending;
+    size_t m_PendingOffset;
+
+    struct Symbol
+    {
+        uintptr_t address;
+        uintptr_t start;
+        const char *pName;
+    };
+    Symbol m_Symbols[PROFILE_SYMBOL_CACHE];
+};
+
 class FramebufferFile : public File
 {
 public:
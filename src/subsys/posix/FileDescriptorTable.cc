@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "FileDescriptorTable.h"
+#include "PosixSubsystem.h"
+
+#include <LockGuard.h>
+#include <utilities/utility.h>
+#include <utilities/ZombieQueue.h>
+
+#define FD_CLOEXEC  1
+
+class FileDescriptorTable::ZombieTable : public ZombieObject
+{
+    public:
+        ZombieTable(Table *pTable) : m_pTable(pTable)
+        {
+        }
+        virtual ~ZombieTable()
+        {
+            releaseTableMemory(m_pTable);
+        }
+    private:
+        Table *m_pTable;
+};
+
+class FileDescriptorTable::ZombieDescriptor : public ZombieObject
+{
+    public:
+        ZombieDescriptor(FileDescriptor *pFd) : m_pFd(pFd)
+        {
+        }
+        virtual ~ZombieDescriptor()
+        {
+            delete m_pFd;
+        }
+    private:
+        FileDescriptor *m_pFd;
+};
+
+FileDescriptorTable::FileDescriptorTable() :
+    m_pTable(0), m_FirstFreeWord(0), m_Lock(false)
+{
+    m_pTable = newTable(InitialCapacity);
+}
+
+FileDescriptorTable::~FileDescriptorTable()
+{
+    Table *pTable = m_pTable;
+
+    // Only the last process using a table owns its descriptors.
+    if((pTable->nSharers -= 1) == 0)
+        deleteDescriptors(pTable);
+
+    // Our own lookups are over by now, and other sharers hold references.
+    if((pTable->nRefs -= 1) == 0)
+        releaseTableMemory(pTable);
+}
+
+FileDescriptor *FileDescriptorTable::lookupForUpdate(size_t fd)
+{
+    LockGuard<Mutex> guard(m_Lock);
+    unshare();
+    return lookup(fd);
+}
+
+size_t FileDescriptorTable::allocate()
+{
+    LockGuard<Mutex> guard(m_Lock);
+    unshare();
+
+    Table *pTable = m_pTable;
+    size_t nWords = pTable->capacity / BitsPerWord;
+
+    // A whole word at a time: anything that isn't all-ones has a free bit.
+    for(size_t i = m_FirstFreeWord; i < nWords; ++i)
+    {
+        unsigned long word = pTable->pBitmap[i];
+        if(word == ~0UL)
+            continue;
+
+        m_FirstFreeWord = i;
+
+        size_t fd = (i * BitsPerWord) + __builtin_ctzl(~word);
+        pTable->pBitmap[i] |= 1UL << (fd % BitsPerWord);
+        return fd;
+    }
+
+    // Table is full; the first new slot is the lowest free descriptor.
+    size_t fd = pTable->capacity;
+    grow(fd);
+    m_FirstFreeWord = fd / BitsPerWord;
+    m_pTable->pBitmap[m_FirstFreeWord] |= 1;
+    return fd;
+}
+
+void FileDescriptorTable::reserve(size_t fd)
+{
+    LockGuard<Mutex> guard(m_Lock);
+    unshare();
+
+    if(fd >= m_pTable->capacity)
+        grow(fd);
+
+    m_pTable->pBitmap[fd / BitsPerWord] |= 1UL << (fd % BitsPerWord);
+}
+
+void FileDescriptorTable::insert(size_t fd, FileDescriptor *pFd)
+{
+    LockGuard<Mutex> guard(m_Lock);
+    unshare();
+
+    if(fd >= m_pTable->capacity)
+        grow(fd);
+
+    Table *pTable = m_pTable;
+    FileDescriptor *pOld = pTable->pSlots[fd];
+
+    // The descriptor must be fully constructed before lock-free readers can
+    // see it.
+    __sync_synchronize();
+    pTable->pSlots[fd] = pFd;
+    pTable->pBitmap[fd / BitsPerWord] |= 1UL << (fd % BitsPerWord);
+
+    if(pOld && (pOld != pFd))
+        releaseDescriptor(pOld);
+}
+
+void FileDescriptorTable::free(size_t fd)
+{
+    LockGuard<Mutex> guard(m_Lock);
+    if(fd >= m_pTable->capacity)
+        return;
+
+    unshare();
+    freeSlot(fd);
+}
+
+void FileDescriptorTable::freeRange(bool bOnlyCloExec, size_t iFirst, size_t iLast)
+{
+    LockGuard<Mutex> guard(m_Lock);
+    unshare();
+
+    Table *pTable = m_pTable;
+    if(iLast >= pTable->capacity)
+        iLast = pTable->capacity - 1;
+
+    for(size_t i = iFirst; i <= iLast; ++i)
+    {
+        // Skip over empty words entirely.
+        if(!(i % BitsPerWord) && !pTable->pBitmap[i / BitsPerWord])
+        {
+            i += BitsPerWord - 1;
+            continue;
+        }
+
+        FileDescriptor *pFd = pTable->pSlots[i];
+        if(bOnlyCloExec && (!pFd || !(pFd->fdflags & FD_CLOEXEC)))
+            continue;
+
+        freeSlot(i);
+    }
+}
+
+void FileDescriptorTable::clear()
+{
+    LockGuard<Mutex> guard(m_Lock);
+
+    Table *pOld = publish(newTable(InitialCapacity));
+    m_FirstFreeWord = 0;
+
+    if((pOld->nSharers -= 1) == 0)
+        deleteDescriptors(pOld);
+    releaseTable(pOld);
+}
+
+void FileDescriptorTable::share(FileDescriptorTable &other)
+{
+    if(&other == this)
+        return;
+
+    // Always lock the two tables in the same order.
+    Mutex *pFirst = (&m_Lock < &other.m_Lock) ? &m_Lock : &other.m_Lock;
+    Mutex *pSecond = (pFirst == &m_Lock) ? &other.m_Lock : &m_Lock;
+    LockGuard<Mutex> guard1(*pFirst);
+    LockGuard<Mutex> guard2(*pSecond);
+
+    Table *pShared = other.m_pTable;
+    pShared->nSharers += 1;
+    pShared->nRefs += 1;
+
+    Table *pOld = publish(pShared);
+
+    if((pOld->nSharers -= 1) == 0)
+        deleteDescriptors(pOld);
+    releaseTable(pOld);
+
+    m_FirstFreeWord = other.m_FirstFreeWord;
+}
+
+FileDescriptorTable::Table *FileDescriptorTable::newTable(size_t capacity)
+{
+    Table *pTable = new Table;
+    pTable->nSharers = 1;
+    pTable->nRefs = 1;
+    pTable->capacity = capacity;
+    pTable->pSlots = new FileDescriptor*[capacity];
+    pTable->pBitmap = new unsigned long[capacity / BitsPerWord];
+    memset(pTable->pSlots, 0, capacity * sizeof(FileDescriptor*));
+    memset(pTable->pBitmap, 0, (capacity / BitsPerWord) * sizeof(unsigned long));
+    return pTable;
+}
+
+void FileDescriptorTable::releaseTableMemory(Table *pTable)
+{
+    delete [] pTable->pSlots;
+    delete [] pTable->pBitmap;
+    delete pTable;
+}
+
+void FileDescriptorTable::releaseTable(Table *pTable)
+{
+    if((pTable->nRefs -= 1) == 0)
+        ZombieQueue::instance().addObject(new ZombieTable(pTable));
+}
+
+void FileDescriptorTable::releaseDescriptor(FileDescriptor *pFd)
+{
+    ZombieQueue::instance().addObject(new ZombieDescriptor(pFd));
+}
+
+void FileDescriptorTable::unshare()
+{
+    Table *pOld = m_pTable;
+    if(pOld->nSharers == 1)
+        return;
+
+    Table *pNew = newTable(pOld->capacity);
+    memcpy(pNew->pBitmap, pOld->pBitmap, (pOld->capacity / BitsPerWord) * sizeof(unsigned long));
+    for(size_t i = 0; i < pOld->capacity; ++i)
+    {
+        if(pOld->pSlots[i])
+            pNew->pSlots[i] = new FileDescriptor(*pOld->pSlots[i]);
+    }
+
+    publish(pNew);
+
+    // The other sharer(s) may have let go while we were copying.
+    if((pOld->nSharers -= 1) == 0)
+        deleteDescriptors(pOld);
+    releaseTable(pOld);
+}
+
+void FileDescriptorTable::grow(size_t fd)
+{
+    Table *pOld = m_pTable;
+
+    size_t capacity = pOld->capacity;
+    while(capacity <= fd)
+        capacity *= 2;
+
+    Table *pNew = newTable(capacity);
+    memcpy(pNew->pSlots, pOld->pSlots, pOld->capacity * sizeof(FileDescriptor*));
+    memcpy(pNew->pBitmap, pOld->pBitmap, (pOld->capacity / BitsPerWord) * sizeof(unsigned long));
+
+    // The descriptors move to the new table; the old one is no longer live.
+    pOld->nSharers -= 1;
+    publish(pNew);
+    releaseTable(pOld);
+}
+
+FileDescriptorTable::Table *FileDescriptorTable::publish(Table *pNew)
+{
+    Table *pOld = m_pTable;
+
+    __sync_synchronize();
+    m_pTable = pNew;
+
+    return pOld;
+}
+
+void FileDescriptorTable::freeSlot(size_t fd)
+{
+    Table *pTable = m_pTable;
+
+    FileDescriptor *pFd = pTable->pSlots[fd];
+    pTable->pSlots[fd] = 0;
+    pTable->pBitmap[fd / BitsPerWord] &= ~(1UL << (fd % BitsPerWord));
+
+    if((fd / BitsPerWord) < m_FirstFreeWord)
+        m_FirstFreeWord = fd / BitsPerWord;
+
+    if(pFd)
+        releaseDescriptor(pFd);
+}
+
+void FileDescriptorTable::deleteDescriptors(Table *pTable)
+{
+    for(size_t i = 0; i < pTable->capacity; ++i)
+    {
+        if(pTable->pSlots[i])
+        {
+            releaseDescriptor(pTable->pSlots[i]);
+            pTable->pSlots[i] = 0;
+        }
+    }
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef POSIX_FILE_DESCRIPTOR_TABLE_H
+#define POSIX_FILE_DESCRIPTOR_TABLE_H
+
+#include <processor/types.h>
+#include <process/Mutex.h>
+#include <Atomic.h>
+
+class FileDescriptor;
+
+/**
+ * A dense, array-indexed descriptor table.
+ *
+ * Lookups take no locks at all: the current table is published with a
+ * single pointer store. A table replaced by growth or by copy-on-write, and
+ * a FileDescriptor that is closed or replaced, are handed to the
+ * ZombieQueue rather than freed, so a lookup racing with a writer (and the
+ * caller's use of what it found) always dereferences valid memory.
+ *
+ * Writers serialise on a Mutex. After fork() the child shares the parent's
+ * table (and FileDescriptor objects) until either side modifies it, at which
+ * point that side takes private copies of the FileDescriptors. Copies share
+ * the OpenFileDescription, so the file offset stays shared as POSIX asks,
+ * while descriptor flags and locks become per-process. Anything that changes
+ * a FileDescriptor in place must get it with lookupForUpdate.
+ */
+class FileDescriptorTable
+{
+    public:
+        FileDescriptorTable();
+        ~FileDescriptorTable();
+
+        /** Lock-free lookup of a descriptor. */
+        FileDescriptor *lookup(size_t fd) const
+        {
+            Table *pTable = m_pTable;
+            if(fd >= pTable->capacity)
+                return 0;
+            return pTable->pSlots[fd];
+        }
+
+        /** Lookup for callers about to modify the FileDescriptor in place. */
+        FileDescriptor *lookupForUpdate(size_t fd);
+
+        /** Reserves and returns the lowest available descriptor number. */
+        size_t allocate();
+
+        /** Marks the given descriptor number as in use. */
+        void reserve(size_t fd);
+
+        /** Installs pFd at fd, freeing anything that was there already. */
+        void insert(size_t fd, FileDescriptor *pFd);
+
+        /** Frees the descriptor number and releases its FileDescriptor. */
+        void free(size_t fd);
+
+        /** Frees descriptors in [iFirst, iLast] (or only FD_CLOEXEC ones). */
+        void freeRange(bool bOnlyCloExec, size_t iFirst, size_t iLast);
+
+        /** Drops every descriptor (those still shared stay with the sharers). */
+        void clear();
+
+        /** Discards our descriptors and shares pOther's table copy-on-write. */
+        void share(FileDescriptorTable &other);
+
+    private:
+        FileDescriptorTable(const FileDescriptorTable &);
+        FileDescriptorTable &operator = (const FileDescriptorTable &);
+
+        class ZombieTable;
+        class ZombieDescriptor;
+
+        static const size_t BitsPerWord = sizeof(unsigned long) * 8;
+        static const size_t InitialCapacity = 64;
+
+        struct Table
+        {
+            /** Descriptor tables (processes) using this as their live table. */
+            Atomic<size_t> nSharers;
+
+            /** References to this table's memory; the last one frees it.
+             *  Outlives nSharers while a table grows out of this one. */
+            Atomic<size_t> nRefs;
+
+            size_t capacity;
+            FileDescriptor **pSlots;
+            unsigned long *pBitmap;
+        };
+
+        static Table *newTable(size_t capacity);
+        static void releaseTableMemory(Table *pTable);
+
+        /** Drops a reference to a table we've stopped using. The last one
+         *  frees it, via the ZombieQueue as lookups may still be in it. */
+        static void releaseTable(Table *pTable);
+
+        /** Takes a private copy of the table if it is shared. Lock held. */
+        void unshare();
+
+        /** Grows the (private) table to hold at least fd. Lock held. */
+        void grow(size_t fd);
+
+        /** Publishes a new live table, returning the old one, which the
+         *  caller must releaseTable. Lock held. */
+        Table *publish(Table *pNew);
+
+        /** Frees one descriptor slot. Lock held, table private. */
+        void freeSlot(size_t fd);
+
+        /** Frees a FileDescriptor once lookups can no longer be using it. */
+        static void releaseDescriptor(FileDescriptor *pFd);
+
+        /** Releases every FileDescriptor in the given table. */
+        static void deleteDescriptors(Table *pTable);
+
+        Table * volatile m_pTable;
+
+        /** Word index below which every descriptor is known to be in use. */
+        size_t m_FirstFreeWord;
+
+        Mutex m_Lock;
+};
+
+#endif
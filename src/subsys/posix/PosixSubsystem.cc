@@ -33,6 +33,7 @@
 #include <utilities/assert.h>
 
 #include "PosixProcess.h"
+#include "ioring-syscalls.h"
 
 #include <linker/DynamicLinker.h>
 #include <vfs/File.h>
@@ -47,7 +48,6 @@
 #define	FD_CLOEXEC	1
 
 typedef Tree<size_t, PosixSubsystem::SignalHandler*> sigHandlerTree;
-typedef Tree<size_t, FileDescriptor*> FdMap;
 
 RadixTree<LockedFile*> g_PosixGlobalLockedFiles;
 
@@ -55,14 +55,15 @@ ProcessGroupManager ProcessGroupManager::m_Instance;
 
 /// Default constructor
 FileDescriptor::FileDescriptor() :
-    file(0), offset(0), fd(0xFFFFFFFF), fdflags(0), flflags(0),
+    file(0), description(new OpenFileDescription), fd(0xFFFFFFFF), fdflags(0), flflags(0),
     so_domain(0), so_type(0), so_local(0), lockedFile(0)
 {
 }
 
 /// Parameterised constructor
 FileDescriptor::FileDescriptor(File *newFile, uint64_t newOffset, size_t newFd, int fdFlags, int flFlags, LockedFile *lf) :
-    file(newFile), offset(newOffset), fd(newFd), fdflags(fdFlags), flflags(flFlags), lockedFile(lf)
+    file(newFile), description(new OpenFileDescription(newOffset)), fd(newFd), fdflags(fdFlags), flflags(flFlags),
+    so_domain(0), so_type(0), so_local(0), lockedFile(lf)
 {
     if(file)
     {
@@ -73,47 +74,76 @@ FileDescriptor::FileDescriptor(File *newFile, uint64_t newOffset, size_t newFd,
 
 /// Copy constructor
 FileDescriptor::FileDescriptor(FileDescriptor &desc) :
-    file(desc.file), offset(desc.offset), fd(desc.fd), fdflags(desc.fdflags), flflags(desc.flflags), lockedFile(0)
+    file(desc.file), description(desc.description), fd(desc.fd), fdflags(desc.fdflags), flflags(desc.flflags),
+    so_domain(desc.so_domain), so_type(desc.so_type), so_local(desc.so_local),
+    so_localPath(desc.so_localPath), so_remotePath(desc.so_remotePath), lockedFile(0)
 {
+    description->increaseRefCount();
     if(file)
     {
         lockedFile = g_PosixGlobalLockedFiles.lookup(file->getFullPath());
         file->increaseRefCount((flflags & O_RDWR) || (flflags & O_WRONLY));
     }
+    if(so_local && (so_local != file))
+        so_local->increaseRefCount((flflags & O_RDWR) || (flflags & O_WRONLY));
 }
 
 /// Pointer copy constructor
 FileDescriptor::FileDescriptor(FileDescriptor *desc) :
-    file(0), offset(0), fd(0), fdflags(0), flflags(0), lockedFile(0)
+    file(0), description(0), fd(0), fdflags(0), flflags(0), so_domain(0), so_type(0),
+    so_local(0), lockedFile(0)
 {
     if(!desc)
+    {
+        description = new OpenFileDescription;
         return;
+    }
 
     file = desc->file;
-    offset = desc->offset;
+    description = desc->description;
+    description->increaseRefCount();
     fd = desc->fd;
     fdflags = desc->fdflags;
     flflags = desc->flflags;
+    so_domain = desc->so_domain;
+    so_type = desc->so_type;
+    so_local = desc->so_local;
+    so_localPath = desc->so_localPath;
+    so_remotePath = desc->so_remotePath;
     if(file)
     {
         lockedFile = g_PosixGlobalLockedFiles.lookup(file->getFullPath());
         file->increaseRefCount((flflags & O_RDWR) || (flflags & O_WRONLY));
     }
+    if(so_local && (so_local != file))
+        so_local->increaseRefCount((flflags & O_RDWR) || (flflags & O_WRONLY));
 }
 
 /// Assignment operator implementation
 FileDescriptor &FileDescriptor::operator = (FileDescriptor &desc)
 {
     file = desc.file;
-    offset = desc.offset;
+    if(description != desc.description)
+    {
+        desc.description->increaseRefCount();
+        description->decreaseRefCount();
+        description = desc.description;
+    }
     fd = desc.fd;
     fdflags = desc.fdflags;
     flflags = desc.flflags;
+    so_domain = desc.so_domain;
+    so_type = desc.so_type;
+    so_local = desc.so_local;
+    so_localPath = desc.so_localPath;
+    so_remotePath = desc.so_remotePath;
     if(file)
     {
         lockedFile = g_PosixGlobalLockedFiles.lookup(file->getFullPath());
         file->increaseRefCount((flflags & O_RDWR) || (flflags & O_WRONLY));
     }
+    if(so_local && (so_local != file))
+        so_local->increaseRefCount((flflags & O_RDWR) || (flflags & O_WRONLY));
     return *this;
 }
 
@@ -131,11 +161,17 @@ FileDescriptor::~FileDescriptor()
         }
         file->decreaseRefCount((flflags & O_RDWR) || (flflags & O_WRONLY));
     }
+
+    // A socket connected elsewhere still holds its own end.
+    if(so_local && (so_local != file))
+        so_local->decreaseRefCount((flflags & O_RDWR) || (flflags & O_WRONLY));
+
+    description->decreaseRefCount();
 }
 
 PosixSubsystem::PosixSubsystem(PosixSubsystem &s) :
-    Subsystem(s), m_SignalHandlers(), m_SignalHandlersLock(), m_FdMap(), m_NextFd(s.m_NextFd),
-    m_FdLock(), m_FdBitmap(), m_LastFd(0), m_FreeCount(s.m_FreeCount),
+    Subsystem(s), m_SignalHandlers(), m_SignalHandlersLock(), m_FdTable(),
+    m_FreeCount(s.m_FreeCount),
     m_AltSigStack(), m_SyncObjects(), m_Threads()
 {
     while(!m_SignalHandlersLock.acquire());
@@ -161,9 +197,6 @@ PosixSubsystem::~PosixSubsystem()
 {
     assert(--m_FreeCount == 0);
 
-    // Ensure that no descriptor operations are taking place (and then, will take place)
-    while(!m_FdLock.acquire());
-
     // Modifying signal handlers, ensure that they are not in use
     while(!m_SignalHandlersLock.acquire());
 
@@ -185,8 +218,7 @@ PosixSubsystem::~PosixSubsystem()
     m_SignalHandlersLock.release();
 
     // For sanity's sake, destroy any remaining descriptors
-    m_FdLock.release();
-    freeMultipleFds();
+    m_FdTable.clear();
 
     // Remove any POSIX threads that might still be lying around
     for(Tree<size_t, PosixThread *>::Iterator it = m_Threads.begin(); it != m_Threads.end(); it++)
@@ -361,11 +393,19 @@ void PosixSubsystem::exit(int code)
 
         Processor::information().getScheduler().eventHandlerReturned();
     }
+
+    // I/O rings have workers running in this process against its memory.
+    // They have to be stopped before that memory goes.
+    IoRing::processExiting(pProcess);
+
     Processor::setInterrupts(false);
 
     // We're the lowest in the stack, so we can proceed with the exit function.
 
-    delete pProcess->getLinker();
+    // Unhook the linker before it goes, as /dev/profile can be using it.
+    DynamicLinker *pLinker = pProcess->getLinker();
+    pProcess->setLinker(0);
+    delete pLinker;
 
     MemoryMapManager::instance().unmapAll();
 
@@ -591,94 +631,27 @@ void PosixSubsystem::setSignalHandler(size_t sig, SignalHandler* handler)
 
 size_t PosixSubsystem::getFd()
 {
-    // Enter critical section for writing.
-    while(!m_FdLock.acquire());
-
-    // Try to recycle if possible
-    for(size_t i = m_LastFd; i < m_NextFd; i++)
-    {
-        if(!(m_FdBitmap.test(i)))
-        {
-            m_LastFd = i;
-            m_FdBitmap.set(i);
-            m_FdLock.release();
-            return i;
-        }
-    }
-
-    // Otherwise, allocate
-    // m_NextFd will always contain the highest allocated fd
-    m_FdBitmap.set(m_NextFd);
-    size_t ret = m_NextFd++;
-    m_FdLock.release();
-    return ret;
+    return m_FdTable.allocate();
 }
 
 void PosixSubsystem::allocateFd(size_t fdNum)
 {
-    // Enter critical section for writing.
-    while(!m_FdLock.acquire());
-
-    if(fdNum >= m_NextFd)
-        m_NextFd = fdNum + 1;
-    m_FdBitmap.set(fdNum);
-
-    m_FdLock.release();
+    m_FdTable.reserve(fdNum);
 }
 
 void PosixSubsystem::freeFd(size_t fdNum)
 {
-    // Enter critical section for writing.
-    while(!m_FdLock.acquire());
-
-    m_FdBitmap.clear(fdNum);
-
-    FileDescriptor *pFd = m_FdMap.lookup(fdNum);
-    if(pFd)
-    {
-        m_FdMap.remove(fdNum);
-        delete pFd;
-    }
-
-    if(fdNum < m_LastFd)
-        m_LastFd = fdNum;
-
-    m_FdLock.release();
+    m_FdTable.free(fdNum);
 }
 
 bool PosixSubsystem::copyDescriptors(PosixSubsystem *pSubsystem)
 {
     assert(pSubsystem);
 
-    // We're totally resetting our local state, ensure there's no files hanging around.
-    freeMultipleFds();
-
-    // Totally changing everything... Don't allow other functions to meddle.
-    while(!m_FdLock.acquire());
-    while(!pSubsystem->m_FdLock.acquire());
-
-    // Copy each descriptor across from the original subsystem
-    FdMap &map = pSubsystem->m_FdMap;
-    for(FdMap::Iterator it = map.begin(); it != map.end(); it++)
-    {
-        FileDescriptor *pFd = it.value();
-        if(!pFd)
-            continue;
-        size_t newFd = it.key();
-
-        FileDescriptor *pNewFd = new FileDescriptor(*pFd);
-
-        // Perform the same action as addFileDescriptor. We need to duplicate here because
-        // we currently hold the FD lock, which will deadlock if we call any function which
-        // attempts to acquire it.
-        if(newFd >= m_NextFd)
-            m_NextFd = newFd + 1;
-        m_FdBitmap.set(newFd);
-        m_FdMap.insert(newFd, pNewFd);
-    }
-
-    pSubsystem->m_FdLock.release();
-    m_FdLock.release();
+    // Rather than duplicating every descriptor up front, share the table
+    // until one of us changes it. Most forks exec (and close most of the
+    // table) almost immediately.
+    m_FdTable.share(pSubsystem->m_FdTable);
     return true;
 }
 
@@ -686,62 +659,5 @@ void PosixSubsystem::freeMultipleFds(bool bOnlyCloExec, size_t iFirst, size_t iL
 {
     assert(iFirst < iLast);
 
-    while(!m_FdLock.acquire()); // Don't allow any access to the FD data
-
-    // Because removing FDs as we go from the Tree can actually leave the Tree
-    // iterators in a dud state, we'll add all the FDs to remove to this list.
-    List<void*> fdsToRemove;
-
-    // Are all FDs to be freed? Or only a selection?
-    bool bAllToBeFreed = ((iFirst == 0 && iLast == ~0UL) && !bOnlyCloExec);
-    if(bAllToBeFreed)
-        m_LastFd = 0;
-
-    FdMap &map = m_FdMap;
-    for(FdMap::Iterator it = map.begin(); it != map.end(); it++)
-    {
-        size_t Fd = it.key();
-        FileDescriptor *pFd = it.value();
-        if(!pFd)
-            continue;
-
-        if(!(Fd >= iFirst && Fd <= iLast))
-            continue;
-
-        if(bOnlyCloExec)
-        {
-            if(!(pFd->fdflags & FD_CLOEXEC))
-                continue;
-        }
-
-        // Perform the same action as freeFd. We need to duplicate code here because we currently
-        // hold the FD lock, which will deadlock if we call any function which attempts to
-        // acquire it.
-
-        // No longer usable
-        m_FdBitmap.clear(Fd);
-
-        // Add to the list of FDs to remove, iff we won't be cleaning up the entire set
-        if(!bAllToBeFreed)
-            fdsToRemove.pushBack(reinterpret_cast<void*>(Fd));
-
-        // Delete the descriptor itself
-        delete pFd;
-
-        // And reset the "last freed" tracking variable, if this is lower than it already.
-        if(Fd < m_LastFd)
-            m_LastFd = Fd;
-    }
-
-    // Clearing all AND not caring about CLOEXEC FDs? If so, clear the map. Otherwise, only
-    // clear the FDs that are supposed to be cleared.
-    if(bAllToBeFreed)
-        m_FdMap.clear();
-    else
-    {
-        for(List<void*>::Iterator it = fdsToRemove.begin(); it != fdsToRemove.end(); it++)
-            m_FdMap.remove(reinterpret_cast<size_t>(*it));
-    }
-
-    m_FdLock.release();
+    m_FdTable.freeRange(bOnlyCloExec, iFirst, iLast);
 }
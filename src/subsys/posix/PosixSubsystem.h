@@ -31,6 +31,9 @@
 #include <utilities/UnlikelyLock.h>
 #include <utilities/ExtensibleBitmap.h>
 #include <LockGuard.h>
+#include <Atomic.h>
+
+#include "FileDescriptorTable.h"
 
 class File;
 class LockedFile;
@@ -120,6 +123,39 @@ class ProcessGroupManager
 /** Abstraction of a file descriptor, which defines an open file
   * and related flags.
   */
+/** An open file description: the state POSIX shares between every
+ *  descriptor that came from the same open(), whether copied by dup(),
+ *  fork() or SCM_RIGHTS. */
+class OpenFileDescription
+{
+    public:
+        OpenFileDescription(uint64_t newOffset = 0) :
+            offset(newOffset), m_nRefs(1)
+        {
+        }
+
+        void increaseRefCount()
+        {
+            m_nRefs += 1;
+        }
+
+        /// Drops a reference, deleting the description on the last one.
+        void decreaseRefCount()
+        {
+            if((m_nRefs -= 1) == 0)
+                delete this;
+        }
+
+        /// Offset within the file for I/O
+        uint64_t offset;
+
+    private:
+        OpenFileDescription(const OpenFileDescription &);
+        OpenFileDescription &operator = (const OpenFileDescription &);
+
+        Atomic<size_t> m_nRefs;
+};
+
 class FileDescriptor
 {
     public:
@@ -145,8 +181,8 @@ class FileDescriptor
         /// Our open file pointer
         File* file;
 
-        /// Offset within the file for I/O
-        uint64_t offset;
+        /// Shared with copies of this descriptor (including the offset)
+        OpenFileDescription *description;
 
         /// Descriptor number
         size_t fd;
@@ -183,7 +219,7 @@ class PosixSubsystem : public Subsystem
         /** Default constructor */
         PosixSubsystem() :
             Subsystem(Posix), m_SignalHandlers(), m_SignalHandlersLock(),
-            m_FdMap(), m_NextFd(0), m_FdLock(), m_FdBitmap(), m_LastFd(0), m_FreeCount(1),
+            m_FdTable(), m_FreeCount(1),
             m_AltSigStack(), m_SyncObjects(), m_Threads()
         {}
 
@@ -193,7 +229,7 @@ class PosixSubsystem : public Subsystem
         /** Parameterised constructor */
         PosixSubsystem(SubsystemType type) :
             Subsystem(type), m_SignalHandlers(), m_SignalHandlersLock(),
-            m_FdMap(), m_NextFd(0), m_FdLock(), m_FdBitmap(), m_LastFd(0), m_FreeCount(1),
+            m_FdTable(), m_FreeCount(1),
             m_AltSigStack(), m_SyncObjects(), m_Threads()
         {}
 
@@ -342,30 +378,25 @@ class PosixSubsystem : public Subsystem
         /** Gets a pointer to a FileDescriptor object from an fd number */
         FileDescriptor *getFileDescriptor(size_t fd)
         {
-            // Enter the critical section, for reading.
-            while(!m_FdLock.enter());
-
-            FileDescriptor *pFd = m_FdMap.lookup(fd);
-
-            m_FdLock.leave();
+            return m_FdTable.lookup(fd);
+        }
 
-            return pFd;
+        /**
+         * Gets a FileDescriptor which the caller is about to modify in place
+         * (eg, fcntl(F_SETFD)). A table shared with our parent since fork()
+         * is copied first so the change doesn't leak into the other process.
+         */
+        FileDescriptor *getFileDescriptorForUpdate(size_t fd)
+        {
+            return m_FdTable.lookupForUpdate(fd);
         }
 
         /** Inserts a file descriptor */
         void addFileDescriptor(size_t fd, FileDescriptor *pFd)
         {
-            freeFd(fd);
-            allocateFd(fd);
-
-            // Enter critical section for writing.
-            while(!m_FdLock.acquire());
-
-            m_FdMap.insert(fd, pFd);
-
-            m_FdLock.release();
+            m_FdTable.insert(fd, pFd);
         }
-        
+
         /**
          * POSIX Semaphore or Mutex
          *
@@ -516,26 +547,9 @@ class PosixSubsystem : public Subsystem
         UnlikelyLock m_SignalHandlersLock;
 
         /**
-         * The file descriptor map. Maps number to pointers, the type of which is decided
-         * by the subsystem.
-         */
-        Tree<size_t, FileDescriptor*> m_FdMap;
-        /**
-         * The next available file descriptor.
-         */
-        size_t m_NextFd;
-        /**
-         * Lock to guard the next file descriptor while it is being changed.
-         */
-        UnlikelyLock m_FdLock;
-        /**
-         * File descriptors used by this process
-         */
-        ExtensibleBitmap m_FdBitmap;
-        /**
-         * Last known unallocated descriptor
+         * The file descriptor table.
          */
-        size_t m_LastFd;
+        FileDescriptorTable m_FdTable;
         /**
          * Number of times freed
          */
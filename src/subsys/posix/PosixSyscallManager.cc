@@ -34,6 +34,8 @@
 #include "pthread-syscalls.h"
 #include "select-syscalls.h"
 #include "poll-syscalls.h"
+#include "ioring-syscalls.h"
+#include "epoll-syscalls.h"
 
 PosixSyscallManager::PosixSyscallManager()
 {
@@ -154,6 +156,8 @@ uintptr_t PosixSyscallManager::syscall(SyscallState &state)
             return posix_symlink(reinterpret_cast<char*>(p1), reinterpret_cast<char*>(p2));
         case POSIX_GETHOSTBYNAME:
             return posix_gethostbyname(reinterpret_cast<const char*>(p1), reinterpret_cast<void*>(p2), static_cast<int>(p3));
+        case POSIX_SET_DNS_SERVERS:
+            return posix_set_dns_servers(reinterpret_cast<const struct sockaddr_in*>(p1), static_cast<size_t>(p2));
         case POSIX_GETHOSTBYADDR:
             return posix_gethostbyaddr(reinterpret_cast<const void*>(p1), static_cast<unsigned long>(p2), static_cast<int>(p3), reinterpret_cast<void*>(p4));
         case POSIX_FCNTL:
@@ -354,6 +358,20 @@ uintptr_t PosixSyscallManager::syscall(SyscallState &state)
             return posix_msync(reinterpret_cast<void *>(p1), static_cast<size_t>(p2), static_cast<int>(p3));
         case POSIX_GETPEERNAME:
             return posix_getpeername(static_cast<int>(p1), reinterpret_cast<struct sockaddr*>(p2), reinterpret_cast<socklen_t*>(p3));
+        case POSIX_SOCKETPAIR:
+            return posix_socketpair(static_cast<int>(p1), static_cast<int>(p2), static_cast<int>(p3), reinterpret_cast<int*>(p4));
+        case POSIX_SENDMSG:
+            return posix_sendmsg(static_cast<int>(p1), reinterpret_cast<const struct msghdr*>(p2), static_cast<int>(p3));
+        case POSIX_RECVMSG:
+            return posix_recvmsg(static_cast<int>(p1), reinterpret_cast<struct msghdr*>(p2), static_cast<int>(p3));
+        case POSIX_SENDMMSG:
+            return posix_sendmmsg(static_cast<int>(p1), reinterpret_cast<struct mmsghdr*>(p2), static_cast<unsigned int>(p3), static_cast<int>(p4));
+        case POSIX_RECVMMSG:
+            return posix_recvmmsg(static_cast<int>(p1), reinterpret_cast<struct mmsghdr*>(p2), static_cast<unsigned int>(p3), static_cast<int>(p4), reinterpret_cast<struct timespec*>(p5));
+        case POSIX_SETSOCKOPT:
+            return posix_setsockopt(static_cast<int>(p1), static_cast<int>(p2), static_cast<int>(p3), reinterpret_cast<const void*>(p4), static_cast<socklen_t>(p5));
+        case POSIX_GETSOCKOPT:
+            return posix_getsockopt(static_cast<int>(p1), static_cast<int>(p2), static_cast<int>(p3), reinterpret_cast<void*>(p4), reinterpret_cast<socklen_t*>(p5));
         case POSIX_FSYNC:
             return posix_fsync(static_cast<int>(p1));
 
@@ -375,6 +393,18 @@ uintptr_t PosixSyscallManager::syscall(SyscallState &state)
         case POSIX_REALPATH:
             return posix_realpath(reinterpret_cast<const char *>(p1), reinterpret_cast<char *>(p2), static_cast<size_t>(p3));
 
+        case POSIX_IORING_SETUP:
+            return posix_ioring_setup(reinterpret_cast<struct io_ring_params *>(p1));
+        case POSIX_IORING_ENTER:
+            return posix_ioring_enter(static_cast<int>(p1), static_cast<unsigned int>(p2), static_cast<unsigned int>(p3), static_cast<unsigned int>(p4));
+
+        case POSIX_EPOLL_CREATE:
+            return posix_epoll_create(static_cast<int>(p1));
+        case POSIX_EPOLL_CTL:
+            return posix_epoll_ctl(static_cast<int>(p1), static_cast<int>(p2), static_cast<int>(p3), reinterpret_cast<struct epoll_event *>(p4));
+        case POSIX_EPOLL_WAIT:
+            return posix_epoll_wait(static_cast<int>(p1), reinterpret_cast<struct epoll_event *>(p2), static_cast<int>(p3), static_cast<int>(p4));
+
         default: ERROR ("PosixSyscallManager: invalid syscall received: " << Dec << state.getSyscallNumber() << Hex); return 0;
     }
 
@@ -19,93 +19,742 @@
  */
 
 #include "UnixFilesystem.h"
+#include <syscallError.h>
+#include <processor/Processor.h>
+#include <utilities/ZombieQueue.h>
 #include <LockGuard.h>
 
+#include <PosixSubsystem.h>
+
+#include "newlib.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+List<uint8_t*> UnixSocket::m_BufferPool;
+Mutex UnixSocket::m_BufferPoolLock(false);
+
+class ZombieUnixSocket : public ZombieObject
+{
+    public:
+        ZombieUnixSocket(UnixSocket *pSocket) : m_pSocket(pSocket)
+        {
+        }
+        virtual ~ZombieUnixSocket()
+        {
+            delete m_pSocket;
+        }
+    private:
+        UnixSocket *m_pSocket;
+};
+
+/** Closes descriptors that were in flight. Must be called without any
+ *  socket lock held, as closing one may close a socket in turn. */
+static void closeRights(List<FileDescriptor*> &rights)
+{
+    for(List<FileDescriptor*>::Iterator it = rights.begin(); it != rights.end(); it++)
+        delete *it;
+    rights.clear();
+}
+
+static size_t iovLength(const struct iovec *pIov, size_t nIov)
+{
+    size_t nBytes = 0;
+    for(size_t i = 0; i < nIov; i++)
+        nBytes += pIov[i].iov_len;
+    return nBytes;
+}
+
 UnixSocket::UnixSocket(String name, Filesystem *pFs, File *pParent) :
-    File(name, 0, 0, 0, 0, pFs, 0, pParent),
-    m_RingBuffer(MAX_UNIX_DGRAM_BACKLOG)
+    File(name, 0, 0, 0, UNIX_SOCKET_INODE_MAGIC, pFs, 0, pParent),
+    m_Type(Datagram), m_State(Inactive), m_pShared(new Shared), m_pBuffer(0),
+    m_Head(0), m_nUsed(0), m_nRead(0), m_nWritten(0), m_Rights(), m_pPeer(0),
+    m_bPeerClosed(false), m_bShutRead(false), m_bShutWrite(false), m_Pending(),
+    m_Backlog(0)
+{
+}
+
+UnixSocket::UnixSocket(SocketType type) :
+    File(String("unix"), 0, 0, 0, UNIX_SOCKET_INODE_MAGIC, 0, 0, 0),
+    m_Type(type), m_State(Inactive), m_pShared(new Shared), m_pBuffer(0),
+    m_Head(0), m_nUsed(0), m_nRead(0), m_nWritten(0), m_Rights(), m_pPeer(0),
+    m_bPeerClosed(false), m_bShutRead(false), m_bShutWrite(false), m_Pending(),
+    m_Backlog(0)
 {
 }
 
 UnixSocket::~UnixSocket()
 {
+    close();
+
+    Shared *pShared = m_pShared;
+    pShared->lock.acquire();
+    bool bLast = !--pShared->refs;
+    pShared->lock.release();
+
+    if(bLast)
+        delete pShared;
 }
 
-int UnixSocket::select(bool bWriting, int timeout)
+uint8_t *UnixSocket::allocateBuffer()
 {
-    if(timeout)
     {
-        while(!m_RingBuffer.waitFor(bWriting ? RingBufferWait::Writing : RingBufferWait::Reading));
-        return 1;
+        LockGuard<Mutex> guard(m_BufferPoolLock);
+        if(m_BufferPool.count())
+            return m_BufferPool.popFront();
     }
-    else if(bWriting)
+
+    return new uint8_t[UNIX_SOCKET_BUFFER];
+}
+
+void UnixSocket::freeBuffer(uint8_t *pBuffer)
+{
+    if(!pBuffer)
+        return;
+
     {
-        return m_RingBuffer.canWrite();
+        LockGuard<Mutex> guard(m_BufferPoolLock);
+        if(m_BufferPool.count() < UNIX_SOCKET_POOL)
+        {
+            m_BufferPool.pushBack(pBuffer);
+            return;
+        }
     }
-    else
+
+    delete [] pBuffer;
+}
+
+bool UnixSocket::wait()
+{
+    Shared *pShared = m_pShared;
+    pShared->nWaiters++;
+
+    pShared->lock.release();
+    bool bResult = pShared->wakeup.acquire();
+    pShared->lock.acquire();
+
+    return bResult && !Processor::information().getCurrentThread()->wasInterrupted();
+}
+
+void UnixSocket::wakeAll()
+{
+    if(m_pShared->nWaiters)
     {
-        return m_RingBuffer.dataReady();
+        m_pShared->wakeup.release(m_pShared->nWaiters);
+        m_pShared->nWaiters = 0;
     }
 }
 
-uint64_t UnixSocket::read(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock)
+void UnixSocket::joinShared(UnixSocket *pOther)
+{
+    delete m_pShared;
+    m_pShared = pOther->m_pShared;
+    m_pShared->refs++;
+}
+
+void UnixSocket::put(const void *pData, size_t nBytes)
+{
+    const uint8_t *pSource = reinterpret_cast<const uint8_t *>(pData);
+
+    size_t tail = (m_Head + m_nUsed) % UNIX_SOCKET_BUFFER;
+    size_t first = UNIX_SOCKET_BUFFER - tail;
+    if(first > nBytes)
+        first = nBytes;
+
+    memcpy(&m_pBuffer[tail], pSource, first);
+    memcpy(m_pBuffer, pSource + first, nBytes - first);
+
+    m_nUsed += nBytes;
+    m_nWritten += nBytes;
+}
+
+size_t UnixSocket::putIov(const struct iovec *pIov, size_t nIov, size_t &iov, size_t &iovOffset, size_t nBytes)
+{
+    size_t nCopied = 0;
+    while((nCopied < nBytes) && (iov < nIov))
+    {
+        size_t len = pIov[iov].iov_len - iovOffset;
+        if(!len)
+        {
+            iov++;
+            iovOffset = 0;
+            continue;
+        }
+
+        if(len > (nBytes - nCopied))
+            len = nBytes - nCopied;
+
+        put(reinterpret_cast<const uint8_t *>(pIov[iov].iov_base) + iovOffset, len);
+        nCopied += len;
+        iovOffset += len;
+    }
+
+    return nCopied;
+}
+
+void UnixSocket::get(void *pData, size_t nBytes, size_t nSkip) const
+{
+    uint8_t *pDest = reinterpret_cast<uint8_t *>(pData);
+
+    size_t head = (m_Head + nSkip) % UNIX_SOCKET_BUFFER;
+    size_t first = UNIX_SOCKET_BUFFER - head;
+    if(first > nBytes)
+        first = nBytes;
+
+    memcpy(pDest, &m_pBuffer[head], first);
+    memcpy(pDest + first, m_pBuffer, nBytes - first);
+}
+
+size_t UnixSocket::getIov(const struct iovec *pIov, size_t nIov, size_t nBytes, size_t nSkip) const
+{
+    size_t nCopied = 0;
+    for(size_t i = 0; (i < nIov) && (nCopied < nBytes); i++)
+    {
+        size_t len = pIov[i].iov_len;
+        if(len > (nBytes - nCopied))
+            len = nBytes - nCopied;
+
+        get(pIov[i].iov_base, len, nSkip + nCopied);
+        nCopied += len;
+    }
+
+    return nCopied;
+}
+
+void UnixSocket::consume(size_t nBytes)
+{
+    m_Head = (m_Head + nBytes) % UNIX_SOCKET_BUFFER;
+    m_nUsed -= nBytes;
+    m_nRead += nBytes;
+}
+
+void UnixSocket::addRights(List<FileDescriptor*> *pRights)
+{
+    if(!pRights || !pRights->count())
+        return;
+
+    Rights *pEntry = new Rights;
+    pEntry->position = m_nWritten;
+    for(List<FileDescriptor*>::Iterator it = pRights->begin(); it != pRights->end(); it++)
+        pEntry->descriptors.pushBack(*it);
+    pRights->clear();
+
+    m_Rights.pushBack(pEntry);
+}
+
+void UnixSocket::takeRights(uint64_t end, List<FileDescriptor*> &rights)
 {
-    if(bCanBlock)
+    while(m_Rights.count())
     {
-        if(!m_RingBuffer.waitFor(RingBufferWait::Reading))
-            return 0; // Interrupted.
+        Rights *pEntry = *m_Rights.begin();
+        if(pEntry->position >= end)
+            break;
+
+        m_Rights.popFront();
+        for(List<FileDescriptor*>::Iterator it = pEntry->descriptors.begin(); it != pEntry->descriptors.end(); it++)
+            rights.pushBack(*it);
+        delete pEntry;
     }
-    else if(!m_RingBuffer.dataReady())
+}
+
+void UnixSocket::flush(List<FileDescriptor*> &rights)
+{
+    takeRights(~0ULL, rights);
+
+    m_Head = m_nUsed = 0;
+    m_nRead = m_nWritten = 0;
+
+    freeBuffer(m_pBuffer);
+    m_pBuffer = 0;
+}
+
+UnixSocket *UnixSocket::disconnect()
+{
+    UnixSocket *pPeer = m_pPeer;
+    if(pPeer)
     {
-        return 0;
+        pPeer->m_pPeer = 0;
+        pPeer->m_bPeerClosed = true;
+        m_pPeer = 0;
+    }
+
+    wakeAll();
+
+    return pPeer;
+}
+
+void UnixSocket::close()
+{
+    List<FileDescriptor*> rights;
+    List<UnixSocket*> pending;
+    UnixSocket *pPeer = 0;
+    {
+        LockGuard<Mutex> guard(m_pShared->lock);
+
+        pPeer = disconnect();
+        flush(rights);
+
+        for(List<UnixSocket*>::Iterator it = m_Pending.begin(); it != m_Pending.end(); it++)
+            pending.pushBack(*it);
+        m_Pending.clear();
+
+        // A named socket can be used again (by binding to it); an
+        // anonymous one is about to go away.
+        m_State = getFilesystem() ? Inactive : Closed;
+        m_bPeerClosed = m_bShutRead = m_bShutWrite = false;
+        m_Backlog = 0;
+    }
+
+    if(pPeer)
+        pPeer->dataChanged();
+
+    // Connections that were never accepted look closed to their clients.
+    for(List<UnixSocket*>::Iterator it = pending.begin(); it != pending.end(); it++)
+        ZombieQueue::instance().addObject(new ZombieUnixSocket(*it));
+
+    closeRights(rights);
+}
+
+void UnixSocket::increaseRefCount(bool bIsWriter)
+{
+    LockGuard<Mutex> guard(m_Lock);
+    File::increaseRefCount(bIsWriter);
+}
+
+void UnixSocket::decreaseRefCount(bool bIsWriter)
+{
+    {
+        LockGuard<Mutex> guard(m_Lock);
+        if((bIsWriter && !m_nWriters) || (!bIsWriter && !m_nReaders))
+            return;
+
+        File::decreaseRefCount(bIsWriter);
+        if(m_nReaders || m_nWriters)
+            return;
     }
 
-    struct buf *b = m_RingBuffer.read();
-    if(size > b->len)
-        size = b->len;
-    memcpy(reinterpret_cast<void *>(buffer), b->pBuffer, size);
-    if(b->remotePath)
+    if(getFilesystem())
+        close();
+    else
+        ZombieQueue::instance().addObject(new ZombieUnixSocket(this));
+}
+
+int UnixSocket::select(bool bWriting, int timeout)
+{
+    LockGuard<Mutex> guard(m_pShared->lock);
+
+    while(true)
     {
-        if(location)
+        bool bReady = false;
+        if(bWriting)
         {
-            strncpy(reinterpret_cast<char *>(location), b->remotePath, 255);
+            if(m_Type == Datagram)
+                bReady = space() > sizeof(Record);
+            else if(m_pPeer)
+                bReady = m_pPeer->space() > (isMessage() ? sizeof(Record) : 0);
+            else
+                bReady = m_bPeerClosed; // So the write fails straight away.
         }
+        else if(m_State == Listening)
+            bReady = m_Pending.count() != 0;
+        else
+            bReady = m_nUsed || ((m_Type != Datagram) && (m_bPeerClosed || m_bShutRead));
 
-        delete [] b->remotePath;
+        if(bReady)
+            return 1;
+        else if(!timeout || !wait())
+            return 0;
     }
-    delete [] b->pBuffer;
-    delete b;
+}
+
+uint64_t UnixSocket::read(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock)
+{
+    struct iovec iov;
+    iov.iov_base = reinterpret_cast<void *>(buffer);
+    iov.iov_len = size;
+
+    // Only datagrams have a sender; otherwise location is the file offset.
+    char *pSender = (m_Type == Datagram) ? reinterpret_cast<char *>(location) : 0;
 
-    return size;
+    List<FileDescriptor*> rights;
+    ssize_t r = recv(&iov, 1, pSender, &rights, bCanBlock, false, 0);
+    closeRights(rights);
+
+    return (r < 0) ? 0 : r;
 }
 
 uint64_t UnixSocket::write(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock)
 {
-    if(bCanBlock)
+    struct iovec iov;
+    iov.iov_base = reinterpret_cast<void *>(buffer);
+    iov.iov_len = size;
+
+    const char *pSender = (m_Type == Datagram) ? reinterpret_cast<const char *>(location) : 0;
+
+    ssize_t r = send(&iov, 1, pSender, 0, bCanBlock);
+    return (r < 0) ? 0 : r;
+}
+
+ssize_t UnixSocket::send(const struct iovec *pIov, size_t nIov, const char *pSender,
+                         List<FileDescriptor*> *pRights, bool bCanBlock)
+{
+    size_t nBytes = iovLength(pIov, nIov);
+
+    size_t senderLength = 0;
+    if((m_Type == Datagram) && pSender)
     {
-        if(!m_RingBuffer.waitFor(RingBufferWait::Writing))
-            return 0; // Interrupted.
+        senderLength = strlen(pSender);
+        if(senderLength >= UNIX_PATH_MAX)
+            senderLength = UNIX_PATH_MAX - 1;
     }
-    else if(!m_RingBuffer.canWrite())
+
+    // Messages go in whole, so they have to fit in the ring.
+    size_t recordLength = sizeof(Record) + senderLength + nBytes;
+    if(isMessage() && (recordLength > UNIX_SOCKET_BUFFER))
     {
+        SYSCALL_ERROR(MessageTooLong);
+        return -1;
+    }
+
+    if(!isMessage() && !nBytes)
         return 0;
+
+    // Watchers are told about the new data once the lock is dropped: they
+    // can call back into select, which takes the lock.
+    UnixSocket *pNotify = 0;
+
+    size_t iov = 0, iovOffset = 0;
+    size_t nSent = 0;
+
+    m_pShared->lock.acquire();
+    while(true)
+    {
+        UnixSocket *pTarget = this;
+        if(m_Type != Datagram)
+        {
+            pTarget = m_pPeer;
+            if(m_bShutWrite || !pTarget || pTarget->m_bShutRead)
+            {
+                if(nSent)
+                    break;
+
+                if(m_bShutWrite || m_bPeerClosed || pTarget)
+                    SYSCALL_ERROR(BrokenPipe);
+                else
+                    SYSCALL_ERROR(NotConnected);
+                m_pShared->lock.release();
+                return -1;
+            }
+        }
+
+        size_t space = pTarget->space();
+        if(space < (isMessage() ? recordLength : 1))
+        {
+            if(nSent)
+            {
+                // Part of a stream write is already in; without blocking,
+                // that's as far as this call gets.
+                if(!bCanBlock)
+                    break;
+            }
+            else if(!bCanBlock)
+            {
+                SYSCALL_ERROR(NoMoreProcesses);
+                m_pShared->lock.release();
+                return -1;
+            }
+
+            if(!wait())
+            {
+                if(nSent)
+                    break;
+                SYSCALL_ERROR(Interrupted);
+                m_pShared->lock.release();
+                return -1;
+            }
+            continue;
+        }
+
+        if(!pTarget->m_pBuffer)
+            pTarget->m_pBuffer = allocateBuffer();
+
+        if(isMessage())
+        {
+            pTarget->addRights(pRights);
+
+            Record record;
+            record.length = nBytes;
+            record.senderLength = senderLength;
+            record.rsvd = 0;
+            pTarget->put(&record, sizeof(record));
+            pTarget->put(pSender, senderLength);
+            nSent = pTarget->putIov(pIov, nIov, iov, iovOffset, nBytes);
+        }
+        else
+        {
+            // Descriptors go with the first byte of the write.
+            if(!nSent)
+                pTarget->addRights(pRights);
+
+            size_t chunk = nBytes - nSent;
+            if(chunk > space)
+                chunk = space;
+            if(chunk > UNIX_SOCKET_CHUNK)
+                chunk = UNIX_SOCKET_CHUNK;
+            nSent += pTarget->putIov(pIov, nIov, iov, iovOffset, chunk);
+        }
+
+        wakeAll();
+
+        if(nSent >= nBytes)
+        {
+            pNotify = pTarget;
+            break;
+        }
+
+        // Big writes go across a chunk at a time; let the reader at what's
+        // there so far before copying the next one.
+        m_pShared->lock.release();
+        pTarget->dataChanged();
+        m_pShared->lock.acquire();
+    }
+    m_pShared->lock.release();
+
+    if(pNotify)
+        pNotify->dataChanged();
+
+    return nSent;
+}
+
+ssize_t UnixSocket::recv(const struct iovec *pIov, size_t nIov, char *pSender,
+                         List<FileDescriptor*> *pRights, bool bCanBlock, bool bPeek,
+                         int *pFlags)
+{
+    size_t nBytes = iovLength(pIov, nIov);
+
+    List<FileDescriptor*> dropped;
+    if(!pRights)
+        pRights = &dropped;
+
+    ssize_t result = 0;
+    UnixSocket *pNotify = 0;
+    {
+        LockGuard<Mutex> guard(m_pShared->lock);
+
+        while(!m_nUsed)
+        {
+            if(m_Type != Datagram)
+            {
+                if(m_bShutRead || m_bPeerClosed)
+                    return 0;
+                else if(!m_pPeer)
+                {
+                    SYSCALL_ERROR(NotConnected);
+                    return -1;
+                }
+            }
+
+            if(!bCanBlock)
+            {
+                SYSCALL_ERROR(NoMoreProcesses);
+                return -1;
+            }
+            else if(!wait())
+            {
+                SYSCALL_ERROR(Interrupted);
+                return -1;
+            }
+        }
+
+        size_t nConsumed = 0;
+        if(isMessage())
+        {
+            Record record;
+            get(&record, sizeof(record), 0);
+
+            if(pSender)
+            {
+                get(pSender, record.senderLength, sizeof(record));
+                pSender[record.senderLength] = 0;
+            }
+
+            size_t n = record.length;
+            if(n > nBytes)
+            {
+                n = nBytes;
+                if(pFlags)
+                    *pFlags |= MSG_TRUNC;
+            }
+            getIov(pIov, nIov, n, sizeof(record) + record.senderLength);
+
+            // The rest of a truncated message is thrown away.
+            nConsumed = sizeof(record) + record.senderLength + record.length;
+            result = n;
+        }
+        else
+        {
+            // Descriptors stay with the data they were sent with, so a read
+            // stops short of the next lot: either the first lot, if it isn't
+            // at the front yet, or the one after.
+            size_t n = m_nUsed;
+            if(m_Rights.count())
+            {
+                List<Rights*>::Iterator it = m_Rights.begin();
+                uint64_t boundary = (*it)->position;
+                if(boundary <= m_nRead)
+                {
+                    it++;
+                    boundary = (it != m_Rights.end()) ? (*it)->position : m_nWritten;
+                }
+
+                if((boundary - m_nRead) < n)
+                    n = boundary - m_nRead;
+            }
+
+            if(n > nBytes)
+                n = nBytes;
+            getIov(pIov, nIov, n, 0);
+
+            nConsumed = n;
+            result = n;
+        }
+
+        if(!bPeek)
+        {
+            takeRights(m_nRead + nConsumed, *pRights);
+            consume(nConsumed);
+
+            // Writers may have been waiting for room.
+            wakeAll();
+            pNotify = m_pPeer ? m_pPeer : this;
+        }
+    }
+
+    if(pNotify)
+        pNotify->dataChanged();
+
+    closeRights(dropped);
+
+    return result;
+}
+
+bool UnixSocket::listen(size_t backlog)
+{
+    LockGuard<Mutex> guard(m_pShared->lock);
+
+    if((m_Type == Datagram) || (m_State == Connected))
+        return false;
+
+    if(!backlog)
+        backlog = 1;
+    else if(backlog > UNIX_SOCKET_MAX_BACKLOG)
+        backlog = UNIX_SOCKET_MAX_BACKLOG;
+
+    m_Backlog = backlog;
+    m_State = Listening;
+
+    return true;
+}
+
+bool UnixSocket::connect(UnixSocket *pClient)
+{
+    UnixSocket *pServer = new UnixSocket(m_Type);
+
+    {
+        LockGuard<Mutex> guard(m_pShared->lock);
+
+        if((m_State == Listening) && (m_Pending.count() < m_Backlog))
+        {
+            LockGuard<Mutex> clientGuard(pClient->m_pShared->lock);
+
+            if((pClient->m_State == Inactive) && (pClient->m_Type == m_Type))
+            {
+                // The two ends share the client's lock from here on.
+                pServer->joinShared(pClient);
+
+                pServer->m_pPeer = pClient;
+                pClient->m_pPeer = pServer;
+                pServer->m_State = pClient->m_State = Connected;
+
+                m_Pending.pushBack(pServer);
+                pServer = 0;
+
+                wakeAll();
+            }
+        }
     }
 
-    struct buf *b = new struct buf;
-    b->pBuffer = new char[size];
-    memcpy(b->pBuffer, reinterpret_cast<void*>(buffer), size);
-    b->len = size;
-    b->remotePath = 0;
-    if(location)
+    if(pServer)
     {
-        b->remotePath = new char[255];
-        strncpy(b->remotePath, reinterpret_cast<char *>(location), 255);
+        delete pServer;
+        return false;
     }
-    m_RingBuffer.write(b);
 
     dataChanged();
 
-    return size;
+    return true;
+}
+
+UnixSocket *UnixSocket::accept(bool bCanBlock)
+{
+    LockGuard<Mutex> guard(m_pShared->lock);
+
+    while(!m_Pending.count())
+    {
+        if(m_State != Listening)
+        {
+            SYSCALL_ERROR(InvalidArgument);
+            return 0;
+        }
+        else if(!bCanBlock)
+        {
+            SYSCALL_ERROR(NoMoreProcesses);
+            return 0;
+        }
+        else if(!wait())
+        {
+            SYSCALL_ERROR(Interrupted);
+            return 0;
+        }
+    }
+
+    return m_Pending.popFront();
+}
+
+void UnixSocket::pair(UnixSocket *pA, UnixSocket *pB)
+{
+    pB->joinShared(pA);
+
+    pA->m_pPeer = pB;
+    pB->m_pPeer = pA;
+    pA->m_State = pB->m_State = Connected;
+}
+
+void UnixSocket::shutdown(bool bReading, bool bWriting)
+{
+    UnixSocket *pPeer = 0;
+    {
+        LockGuard<Mutex> guard(m_pShared->lock);
+
+        if(bReading)
+            m_bShutRead = true;
+
+        if(bWriting)
+        {
+            m_bShutWrite = true;
+            if(m_pPeer)
+            {
+                m_pPeer->m_bPeerClosed = true;
+                pPeer = m_pPeer;
+            }
+        }
+
+        wakeAll();
+    }
+
+    if(pPeer)
+        pPeer->dataChanged();
+    dataChanged();
 }
 
 UnixDirectory::UnixDirectory(String name, Filesystem *pFs, File *pParent) :
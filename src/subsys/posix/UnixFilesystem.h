@@ -25,9 +25,30 @@
 #include <vfs/File.h>
 #include <vfs/Directory.h>
 
-#include <utilities/RingBuffer.h>
+#include <utilities/List.h>
+#include <process/Mutex.h>
+#include <process/Semaphore.h>
 
-#define MAX_UNIX_DGRAM_BACKLOG   65536
+class FileDescriptor;
+struct iovec;
+
+/// Bytes each UNIX socket can have waiting to be read, headers included.
+#define UNIX_SOCKET_BUFFER       65536
+
+/// Receive buffers kept around for reuse once their sockets are closed.
+#define UNIX_SOCKET_POOL         16
+
+/// Most connections waiting to be accepted on a listening socket.
+#define UNIX_SOCKET_MAX_BACKLOG  128
+
+/// Largest chunk a stream write copies while holding the socket lock, so
+/// big writes go across a page at a time as the reader makes room.
+#define UNIX_SOCKET_CHUNK        4096
+
+/// Most descriptors that can be passed in one message.
+#define UNIX_SOCKET_MAX_RIGHTS   64
+
+#define UNIX_SOCKET_INODE_MAGIC  0xab000000
 
 /**
  * UnixFilesystem: UNIX sockets.
@@ -101,27 +122,252 @@ class UnixFilesystem : public Filesystem
 
 /**
  * A UNIX socket.
+ *
+ * Named sockets live in the UnixFilesystem; the ends of a connection that
+ * aren't bound to a name (and both ends of a socketpair) are anonymous, and
+ * go away when the last descriptor for them is closed.
+ *
+ * Each socket has a receive buffer - a byte ring taken from a small pool -
+ * that writers copy straight into. Datagram and sequenced-packet messages
+ * are stored in the ring behind a small header; stream data is stored as
+ * is. Nothing is allocated per message, except to hold passed descriptors.
+ *
+ * A datagram socket receives whatever is written to it. A connected stream
+ * or sequenced-packet socket sends what's written to it to its peer.
  */
 class UnixSocket : public File
 {
     public:
+        enum SocketType
+        {
+            Streaming,
+            Datagram,
+            SeqPacket
+        };
+
+        enum SocketState
+        {
+            Inactive,
+            Listening,
+            Connected,
+            Closed
+        };
+
+        /** Named socket, created by the filesystem. */
         UnixSocket(String name, Filesystem *pFs, File *pParent);
+
+        /** Anonymous socket. */
+        UnixSocket(SocketType type);
+
         virtual ~UnixSocket();
 
+        /** Is the given File a UNIX socket? */
+        static bool isSocket(File *pFile)
+        {
+            return pFile && ((pFile->getInode() & 0xFF000000) == UNIX_SOCKET_INODE_MAGIC);
+        }
+
+        /** Returns the given File as a UNIX socket, or null if it isn't one. */
+        static UnixSocket *fromFile(File *pFile)
+        {
+            return isSocket(pFile) ? static_cast<UnixSocket *>(pFile) : 0;
+        }
+
+        SocketType getType() const
+        {
+            return m_Type;
+        }
+
+        /** Sets the type of a named socket when it's bound. */
+        void setType(SocketType type)
+        {
+            m_Type = type;
+        }
+
+        SocketState getState() const
+        {
+            return m_State;
+        }
+
+        /** Reads a message (or stream data). location, if set, receives the
+         *  path of a datagram's sender. */
         virtual uint64_t read(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock = true);
+
+        /** Writes a datagram to this socket (location, if set, is the
+         *  sender's path) or stream data to the peer. */
         virtual uint64_t write(uint64_t location, uint64_t size, uintptr_t buffer, bool bCanBlock = true);
 
+        /**
+         * Sends a message. Datagrams go to this socket, anything else goes
+         * to the connected peer.
+         * \param pSender Path of the sending socket, for datagrams.
+         * \param pRights Descriptors to pass with the message. They're taken
+         *                over (and the list emptied) if the send succeeds.
+         * \return bytes sent, or -1 with the error set.
+         */
+        ssize_t send(const struct iovec *pIov, size_t nIov, const char *pSender,
+                     List<FileDescriptor*> *pRights, bool bCanBlock);
+
+        /**
+         * Receives a message, or as much stream data as is available.
+         * \param pSender Receives the sender's path, for datagrams.
+         * \param pRights Receives any descriptors passed with the data.
+         * \param pFlags Receives MSG_TRUNC if a message was truncated.
+         * \return bytes received, 0 at end of stream, or -1 with the error set.
+         */
+        ssize_t recv(const struct iovec *pIov, size_t nIov, char *pSender,
+                     List<FileDescriptor*> *pRights, bool bCanBlock, bool bPeek,
+                     int *pFlags);
+
+        /** Starts accepting connections on a bound stream socket. */
+        bool listen(size_t backlog);
+
+        /** Connects pClient to this (listening) socket, queueing the other
+         *  end of the connection to be accepted. Returns false if refused. */
+        bool connect(UnixSocket *pClient);
+
+        /** Takes the next connection off a listening socket. */
+        UnixSocket *accept(bool bCanBlock);
+
+        /** Connects two anonymous sockets to each other (socketpair). */
+        static void pair(UnixSocket *pA, UnixSocket *pB);
+
+        /** Stops sending and/or receiving on a connected socket. */
+        void shutdown(bool bReading, bool bWriting);
+
         virtual int select(bool bWriting = false, int timeout = 0);
 
+        virtual void increaseRefCount(bool bIsWriter);
+
+        /** The last descriptor going away closes the socket (and frees it,
+         *  if it's anonymous). */
+        virtual void decreaseRefCount(bool bIsWriter);
+
     private:
-        struct buf {
-            char *pBuffer;
-            uint64_t len;
-            char *remotePath; // Path of the socket that dumped data here, if any.
+        UnixSocket(const UnixSocket &);
+        UnixSocket &operator = (const UnixSocket &);
+
+        /** Lock and wakeup shared by the two ends of a connection, so both
+         *  rings are covered by the one lock. Unconnected sockets have one
+         *  to themselves. */
+        struct Shared
+        {
+            Shared() : lock(false), wakeup(0), nWaiters(0), refs(1)
+            {}
+
+            Mutex lock;
+            Semaphore wakeup;
+            size_t nWaiters;
+            size_t refs;
+        };
+
+        /** Header in front of each datagram or sequenced packet. */
+        struct Record
+        {
+            uint32_t length;
+            uint16_t senderLength;
+            uint16_t rsvd;
+        };
+
+        /** Descriptors passed along with data, waiting to be received. */
+        struct Rights
+        {
+            /// Stream position of the data the descriptors came with.
+            uint64_t position;
+            List<FileDescriptor*> descriptors;
         };
 
-        /// \todo stream sockets
-        RingBuffer<struct buf *> m_RingBuffer;
+        /** Has a message-oriented type (so the ring holds Records)? */
+        bool isMessage() const
+        {
+            return m_Type != Streaming;
+        }
+
+        /** Waits for a wakeup. Lock must be held; it's dropped while
+         *  waiting. Returns false if interrupted. */
+        bool wait();
+
+        /** Wakes every thread waiting on either end. Lock must be held. */
+        void wakeAll();
+
+        /** Bytes free in the ring. Lock must be held. */
+        size_t space() const
+        {
+            return UNIX_SOCKET_BUFFER - m_nUsed;
+        }
+
+        /** Copies into the ring, from a buffer or an iovec list. Lock must
+         *  be held, and the space checked. */
+        void put(const void *pData, size_t nBytes);
+        size_t putIov(const struct iovec *pIov, size_t nIov, size_t &iov, size_t &iovOffset, size_t nBytes);
+
+        /** Copies out of the ring, starting nSkip bytes in, without
+         *  consuming anything. Lock must be held. */
+        void get(void *pData, size_t nBytes, size_t nSkip) const;
+        size_t getIov(const struct iovec *pIov, size_t nIov, size_t nBytes, size_t nSkip) const;
+
+        /** Consumes bytes from the ring. Lock must be held. */
+        void consume(size_t nBytes);
+
+        /** Takes the descriptors sent with anything before the given stream
+         *  position. Lock must be held. */
+        void takeRights(uint64_t end, List<FileDescriptor*> &rights);
+
+        /** Queues descriptors with the data about to be written. Lock must
+         *  be held. */
+        void addRights(List<FileDescriptor*> *pRights);
+
+        /** Drops the connection to the peer. Lock must be held.
+         *  \return the former peer, whose watchers the caller must tell
+         *           (with dataChanged) once the lock has been dropped. */
+        UnixSocket *disconnect();
+
+        /** Disconnects, empties the ring and drops pending connections. */
+        void close();
+
+        /** Switches this socket, which no other thread can be using yet, to
+         *  pOther's lock. pOther's lock must be held. */
+        void joinShared(UnixSocket *pOther);
+
+        /** Throws out everything in the ring, returning its descriptors in
+         *  rights to be closed once the lock is dropped. Lock must be held. */
+        void flush(List<FileDescriptor*> &rights);
+
+        static uint8_t *allocateBuffer();
+        static void freeBuffer(uint8_t *pBuffer);
+
+        SocketType m_Type;
+        SocketState m_State;
+
+        Shared *m_pShared;
+
+        /** Receive ring. Allocated the first time anything's written. */
+        uint8_t *m_pBuffer;
+        size_t m_Head;
+        size_t m_nUsed;
+
+        /** Bytes ever consumed from and written to the ring. */
+        uint64_t m_nRead;
+        uint64_t m_nWritten;
+
+        List<Rights*> m_Rights;
+
+        /** Other end of the connection. */
+        UnixSocket *m_pPeer;
+
+        /** Set once the peer has closed or stopped sending. */
+        bool m_bPeerClosed;
+
+        /** Set once this end has stopped reading or writing. */
+        bool m_bShutRead;
+        bool m_bShutWrite;
+
+        /** Connections waiting to be accepted. */
+        List<UnixSocket*> m_Pending;
+        size_t m_Backlog;
+
+        static List<uint8_t*> m_BufferPool;
+        static Mutex m_BufferPoolLock;
 };
 
 /**
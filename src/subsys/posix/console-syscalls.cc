@@ -34,7 +34,6 @@
 #include "file-syscalls.h"
 #include "console-syscalls.h"
 
-typedef Tree<size_t,FileDescriptor*> FdMap;
 
 class PosixTerminalEvent : public Event
 {
@@ -0,0 +1,584 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "epoll-syscalls.h"
+
+#include <syscallError.h>
+#include <processor/Processor.h>
+#include <process/Process.h>
+#include <utilities/ZombieQueue.h>
+#include <LockGuard.h>
+#include <Log.h>
+
+#include <Subsystem.h>
+#include <PosixSubsystem.h>
+
+#define FD_CLOEXEC  1
+
+/** Events we can actually evaluate with File::select. */
+#define EPOLL_POLLABLE (EPOLLIN | EPOLLOUT)
+
+class ZombieEpoll : public ZombieObject
+{
+    public:
+        ZombieEpoll(EpollFile *pEpoll) : m_pEpoll(pEpoll)
+        {
+        }
+        virtual ~ZombieEpoll()
+        {
+            delete m_pEpoll;
+        }
+    private:
+        EpollFile *m_pEpoll;
+};
+
+/** Detaches an item from its File and frees it. */
+static void destroyItem(EpollItem *pItem)
+{
+    pItem->m_pFile->removeWatcher(pItem);
+    delete pItem;
+}
+
+/** Frees an item whose File was closed: that happens with the File's locks
+    held, so removing the watcher there would deadlock. */
+class ZombieEpollItem : public ZombieObject
+{
+    public:
+        ZombieEpollItem(EpollItem *pItem) : m_pItem(pItem)
+        {
+        }
+        virtual ~ZombieEpollItem()
+        {
+            destroyItem(m_pItem);
+        }
+    private:
+        EpollItem *m_pItem;
+};
+
+/** Serialises adding epoll descriptors to other epolls, so two racing adds
+    can't make a loop between them. */
+static Mutex nestLock(false);
+
+EpollItem::EpollItem(EpollFile *pParent, File *pFile, int fd, const struct epoll_event &ev) :
+    m_pParent(pParent), m_pFile(pFile), m_Fd(fd), m_Event(ev), m_bQueued(false),
+    m_bDisabled(false), m_bRemoved(false), m_nUsers(0)
+{
+}
+
+EpollItem::~EpollItem()
+{
+}
+
+void EpollItem::fileChanged(File *pFile)
+{
+    bool bNotify = false;
+    {
+        LockGuard<Mutex> guard(m_pParent->m_ItemLock);
+        if(!m_bDisabled && !m_bRemoved)
+            bNotify = m_pParent->queue(this);
+    }
+
+    if(bNotify)
+        m_pParent->dataChanged();
+}
+
+void EpollItem::fileClosed(File *pFile)
+{
+    bool bDestroy = false;
+    {
+        LockGuard<Mutex> guard(m_pParent->m_ItemLock);
+        if(m_bRemoved)
+            return;
+
+        m_pParent->unlink(this);
+        bDestroy = !m_nUsers;
+    }
+
+    // Otherwise the last wait() polling the item frees it.
+    if(bDestroy)
+        ZombieQueue::instance().addObject(new ZombieEpollItem(this));
+}
+
+uint32_t EpollItem::poll(uint32_t events)
+{
+    uint32_t revents = 0;
+    if((events & EPOLLIN) && m_pFile->select(false, 0))
+        revents |= EPOLLIN;
+    if((events & EPOLLOUT) && m_pFile->select(true, 0))
+        revents |= EPOLLOUT;
+    return revents;
+}
+
+EpollFile::EpollFile() :
+    File(String("epoll"), 0, 0, 0, EPOLL_INODE_MAGIC, 0, 0, 0),
+    m_Items(), m_Ready(), m_nNested(0), m_ItemLock(false), m_ReadySem(0)
+{
+}
+
+EpollFile::~EpollFile()
+{
+    // Nothing can be waiting on us any more, but the watched Files can
+    // still be closing, and so calling into fileClosed.
+    List<EpollItem*> items;
+    {
+        LockGuard<Mutex> guard(m_ItemLock);
+        for(Tree<size_t, EpollItem*>::Iterator it = m_Items.begin(); it != m_Items.end(); it++)
+        {
+            EpollItem *pItem = it.value();
+            pItem->m_bQueued = false;
+            pItem->m_bRemoved = true;
+            items.pushBack(pItem);
+        }
+
+        m_Items.clear();
+        m_Ready.clear();
+    }
+
+    for(List<EpollItem*>::Iterator it = items.begin(); it != items.end(); it++)
+        destroyItem(*it);
+}
+
+bool EpollFile::queue(EpollItem *pItem)
+{
+    if(pItem->m_bQueued)
+        return false;
+
+    bool bWasEmpty = !m_Ready.count();
+
+    pItem->m_bQueued = true;
+    m_Ready.pushBack(pItem);
+    m_ReadySem.release();
+
+    return bWasEmpty;
+}
+
+void EpollFile::dequeue(EpollItem *pItem)
+{
+    if(!pItem->m_bQueued)
+        return;
+
+    for(List<EpollItem*>::Iterator it = m_Ready.begin(); it != m_Ready.end(); it++)
+    {
+        if(*it == pItem)
+        {
+            m_Ready.erase(it);
+            break;
+        }
+    }
+
+    pItem->m_bQueued = false;
+}
+
+void EpollFile::unlink(EpollItem *pItem)
+{
+    m_Items.remove(pItem->m_Fd);
+    dequeue(pItem);
+    pItem->m_bRemoved = true;
+
+    if(isEpoll(pItem->m_pFile))
+        --m_nNested;
+}
+
+void EpollFile::requeue(EpollItem *pItem)
+{
+    uint32_t revents = pItem->poll(pItem->m_Event.events);
+    if(!revents)
+        return;
+
+    bool bNotify = false;
+    {
+        LockGuard<Mutex> guard(m_ItemLock);
+        if(!pItem->m_bDisabled && !pItem->m_bRemoved)
+            bNotify = queue(pItem);
+    }
+
+    if(bNotify)
+        dataChanged();
+}
+
+int EpollFile::add(int fd, File *pFile, const struct epoll_event &ev)
+{
+    // Watching ourselves would recurse on our own lock, and nesting is kept
+    // one level deep (an epoll that holds epolls can't be added to another),
+    // which rules out loops.
+    bool bNested = isEpoll(pFile);
+    if(bNested)
+    {
+        if(pFile == this)
+        {
+            SYSCALL_ERROR(InvalidArgument);
+            return -1;
+        }
+
+        nestLock.acquire();
+        if(static_cast<EpollFile *>(pFile)->m_nNested)
+        {
+            nestLock.release();
+            SYSCALL_ERROR(InvalidArgument);
+            return -1;
+        }
+    }
+
+    EpollItem *pItem = new EpollItem(this, pFile, fd, ev);
+
+    {
+        LockGuard<Mutex> guard(m_ItemLock);
+        if(m_Items.lookup(fd))
+        {
+            if(bNested)
+                nestLock.release();
+
+            delete pItem;
+            SYSCALL_ERROR(FileExists);
+            return -1;
+        }
+
+        m_Items.insert(fd, pItem);
+        if(bNested)
+            ++m_nNested;
+
+        // Keeps the item alive if it's removed before we're done with it.
+        ++pItem->m_nUsers;
+    }
+
+    if(bNested)
+        nestLock.release();
+
+    // Watchers are added outside m_ItemLock: fileChanged runs with the File's
+    // lock held and then takes m_ItemLock, so the reverse order would deadlock.
+    pFile->addWatcher(pItem);
+
+    // Anything that was already ready would otherwise not be reported until
+    // its next state change.
+    requeue(pItem);
+    release(pItem);
+
+    return 0;
+}
+
+int EpollFile::modify(int fd, const struct epoll_event &ev)
+{
+    EpollItem *pItem = 0;
+    {
+        LockGuard<Mutex> guard(m_ItemLock);
+        pItem = m_Items.lookup(fd);
+        if(!pItem)
+        {
+            SYSCALL_ERROR(DoesNotExist);
+            return -1;
+        }
+
+        pItem->m_Event = ev;
+        pItem->m_bDisabled = false;
+
+        // Keeps the item alive until the poll below is done with it.
+        ++pItem->m_nUsers;
+    }
+
+    requeue(pItem);
+    release(pItem);
+
+    return 0;
+}
+
+int EpollFile::remove(int fd)
+{
+    EpollItem *pItem = 0;
+    {
+        LockGuard<Mutex> guard(m_ItemLock);
+        pItem = m_Items.lookup(fd);
+        if(!pItem)
+        {
+            SYSCALL_ERROR(DoesNotExist);
+            return -1;
+        }
+
+        unlink(pItem);
+
+        // A wait() still polling the item frees it when it's done.
+        if(pItem->m_nUsers)
+            return 0;
+    }
+
+    destroyItem(pItem);
+
+    return 0;
+}
+
+void EpollFile::release(EpollItem *pItem)
+{
+    {
+        LockGuard<Mutex> guard(m_ItemLock);
+        if(--pItem->m_nUsers || !pItem->m_bRemoved)
+            return;
+    }
+
+    destroyItem(pItem);
+}
+
+int EpollFile::wait(struct epoll_event *pEvents, int maxEvents, int timeout)
+{
+    size_t timeoutSecs = 0, timeoutUSecs = 0;
+    if(timeout > 0)
+    {
+        timeoutSecs = timeout / 1000;
+        timeoutUSecs = (timeout % 1000) * 1000;
+    }
+
+    EpollItem *pBatch[EPOLL_WAIT_BATCH];
+    uint32_t requested[EPOLL_WAIT_BATCH];
+    uint32_t revents[EPOLL_WAIT_BATCH];
+
+    while(true)
+    {
+        int n = 0;
+
+        // Drain stale wakeups; the ready list itself is authoritative.
+        while(m_ReadySem.tryAcquire());
+
+        // Walk each item that's queued now once. Level-triggered items that
+        // are still ready go back on the end so that a busy descriptor can't
+        // starve the others.
+        size_t nQueued = 0;
+        {
+            LockGuard<Mutex> guard(m_ItemLock);
+            nQueued = m_Ready.count();
+        }
+
+        while(nQueued && (n < maxEvents))
+        {
+            // Take a batch off the ready list. The items are polled without
+            // m_ItemLock held: File::select can take locks (eg, a UNIX
+            // socket's) that are held around File::dataChanged, which takes
+            // m_ItemLock via EpollItem::fileChanged.
+            size_t nBatch = 0;
+            {
+                LockGuard<Mutex> guard(m_ItemLock);
+                while(nQueued && (nBatch < EPOLL_WAIT_BATCH) &&
+                      (n + static_cast<int>(nBatch) < maxEvents) && m_Ready.count())
+                {
+                    EpollItem *pItem = m_Ready.popFront();
+                    pItem->m_bQueued = false;
+                    ++pItem->m_nUsers;
+
+                    pBatch[nBatch] = pItem;
+                    requested[nBatch] = pItem->m_Event.events;
+                    ++nBatch;
+                    --nQueued;
+                }
+            }
+
+            if(!nBatch)
+                break;
+
+            for(size_t i = 0; i < nBatch; ++i)
+                revents[i] = pBatch[i]->poll(requested[i]);
+
+            size_t nDestroy = 0;
+            bool bNotify = false;
+            {
+                LockGuard<Mutex> guard(m_ItemLock);
+                for(size_t i = 0; i < nBatch; ++i)
+                {
+                    EpollItem *pItem = pBatch[i];
+                    --pItem->m_nUsers;
+
+                    // Removed (or closed) while we polled it.
+                    if(pItem->m_bRemoved)
+                    {
+                        if(!pItem->m_nUsers)
+                            pBatch[nDestroy++] = pItem;
+                        continue;
+                    }
+
+                    if(!revents[i] || pItem->m_bDisabled)
+                        continue;
+
+                    pEvents[n].events = revents[i];
+                    pEvents[n].data = pItem->m_Event.data;
+                    ++n;
+
+                    if(pItem->m_Event.events & EPOLLONESHOT)
+                    {
+                        pItem->m_bDisabled = true;
+                        dequeue(pItem);
+                    }
+                    else if(!(pItem->m_Event.events & EPOLLET))
+                        bNotify = queue(pItem) || bNotify;
+                }
+            }
+
+            if(bNotify)
+                dataChanged();
+
+            for(size_t i = 0; i < nDestroy; ++i)
+                destroyItem(pBatch[i]);
+        }
+
+        if(n || !timeout)
+            return n;
+
+        // Nothing ready - sleep until an item is queued.
+        Processor::information().getCurrentThread()->setInterrupted(false);
+        if(!m_ReadySem.acquire(1, timeoutSecs, timeoutUSecs))
+        {
+            if(Processor::information().getCurrentThread()->wasInterrupted())
+                return -1;
+            return 0;
+        }
+
+        // Put the count back for the drain at the top of the loop to eat.
+        m_ReadySem.release();
+    }
+}
+
+int EpollFile::select(bool bWriting, int timeout)
+{
+    if(bWriting)
+        return 0;
+
+    {
+        LockGuard<Mutex> guard(m_ItemLock);
+        if(m_Ready.count())
+            return true;
+    }
+
+    if(timeout && m_ReadySem.acquire(1, timeout))
+    {
+        // Leave the count for wait() to drain.
+        m_ReadySem.release();
+        return true;
+    }
+
+    return false;
+}
+
+void EpollFile::increaseRefCount(bool bIsWriter)
+{
+    LockGuard<Mutex> guard(m_Lock);
+    File::increaseRefCount(bIsWriter);
+}
+
+void EpollFile::decreaseRefCount(bool bIsWriter)
+{
+    {
+        LockGuard<Mutex> guard(m_Lock);
+        File::decreaseRefCount(bIsWriter);
+
+        if(m_nReaders || m_nWriters)
+            return;
+    }
+
+    ZombieQueue::instance().addObject(new ZombieEpoll(this));
+}
+
+/** Looks up the EpollFile behind the given descriptor. */
+static EpollFile *getEpoll(PosixSubsystem *pSubsystem, int epfd)
+{
+    FileDescriptor *pFd = pSubsystem->getFileDescriptor(epfd);
+    if(!pFd)
+    {
+        SYSCALL_ERROR(BadFileDescriptor);
+        return 0;
+    }
+
+    if(!EpollFile::isEpoll(pFd->file))
+    {
+        SYSCALL_ERROR(InvalidArgument);
+        return 0;
+    }
+
+    return static_cast<EpollFile *>(pFd->file);
+}
+
+int posix_epoll_create(int flags)
+{
+    F_NOTICE("epoll_create(" << flags << ")");
+
+    GRAB_POSIX_SUBSYSTEM(-1);
+
+    EpollFile *pEpoll = new EpollFile();
+
+    size_t fd = pSubsystem->getFd();
+    FileDescriptor *pFd = new FileDescriptor(pEpoll, 0, fd, (flags & EPOLL_CLOEXEC) ? FD_CLOEXEC : 0, O_RDONLY);
+    pSubsystem->addFileDescriptor(fd, pFd);
+
+    return static_cast<int>(fd);
+}
+
+int posix_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    F_NOTICE("epoll_ctl(" << epfd << ", " << op << ", " << fd << ")");
+
+    if((op != EPOLL_CTL_DEL) && !PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(event), sizeof(struct epoll_event), PosixSubsystem::SafeRead))
+    {
+        SYSCALL_ERROR(BadAddress);
+        return -1;
+    }
+
+    GRAB_POSIX_SUBSYSTEM(-1);
+
+    EpollFile *pEpoll = getEpoll(pSubsystem, epfd);
+    if(!pEpoll)
+        return -1;
+
+    FileDescriptor *pFd = pSubsystem->getFileDescriptor(fd);
+    if(!pFd)
+    {
+        SYSCALL_ERROR(BadFileDescriptor);
+        return -1;
+    }
+
+    switch(op)
+    {
+        case EPOLL_CTL_ADD:
+            return pEpoll->add(fd, pFd->file, *event);
+        case EPOLL_CTL_MOD:
+            return pEpoll->modify(fd, *event);
+        case EPOLL_CTL_DEL:
+            return pEpoll->remove(fd);
+        default:
+            SYSCALL_ERROR(InvalidArgument);
+            return -1;
+    }
+}
+
+int posix_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    F_NOTICE("epoll_wait(" << epfd << ", " << maxevents << ", " << timeout << ")");
+
+    if((maxevents <= 0) || !PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(events), maxevents * sizeof(struct epoll_event), PosixSubsystem::SafeWrite))
+    {
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    GRAB_POSIX_SUBSYSTEM(-1);
+
+    EpollFile *pEpoll = getEpoll(pSubsystem, epfd);
+    if(!pEpoll)
+        return -1;
+
+    int ret = pEpoll->wait(events, maxevents, timeout);
+    if(ret < 0)
+        SYSCALL_ERROR(Interrupted);
+
+    F_NOTICE("  -> " << ret);
+    return ret;
+}
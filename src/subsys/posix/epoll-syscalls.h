@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef EPOLL_SYSCALLS_H
+#define EPOLL_SYSCALLS_H
+
+#include "file-syscalls.h"
+#include <process/Semaphore.h>
+#include <process/Mutex.h>
+#include <utilities/List.h>
+#include <utilities/Tree.h>
+
+#include <sys/epoll.h>
+
+/** Inode tag identifying an EpollFile (cf. NetManager's 0xab000000 sockets). */
+#define EPOLL_INODE_MAGIC       0xad000000
+
+class EpollFile;
+
+/** Most items EpollFile::wait polls in one go, outside its lock. */
+#define EPOLL_WAIT_BATCH        32
+
+/** One entry in an epoll interest list. The item doesn't keep its File
+ *  open: like Linux, it's dropped once the last descriptor for the File is
+ *  closed. */
+class EpollItem : public FileWatcher
+{
+    public:
+        EpollItem(EpollFile *pParent, File *pFile, int fd, const struct epoll_event &ev);
+        virtual ~EpollItem();
+
+        /** Called by the watched File whenever its state changes. */
+        virtual void fileChanged(File *pFile);
+
+        /** Called when the last reference to the watched File goes. */
+        virtual void fileClosed(File *pFile);
+
+        /** Returns the subset of 'events' that are ready now. Must be called
+         *  without the parent's lock held, as File::select can take locks
+         *  that are held around File::dataChanged. */
+        uint32_t poll(uint32_t events);
+
+        EpollFile *m_pParent;
+        File *m_pFile;
+        int m_Fd;
+        struct epoll_event m_Event;
+
+        /** Is this item on its parent's ready list? */
+        bool m_bQueued;
+
+        /** Oneshot item that has fired and is waiting for EPOLL_CTL_MOD. */
+        bool m_bDisabled;
+
+        /** Taken out of the interest list, but still being polled by a
+         *  wait(); the last of those deletes it. */
+        bool m_bRemoved;
+
+        /** Number of wait()s polling the item outside the parent's lock. */
+        size_t m_nUsers;
+
+    private:
+        EpollItem(const EpollItem &);
+        EpollItem &operator = (const EpollItem &);
+};
+
+/**
+ * A persistent interest list.
+ *
+ * Each registered descriptor gets a FileWatcher that stays attached across
+ * calls to wait(), so wait() costs O(ready) rather than the O(nfds) event
+ * setup and teardown that poll() and select() need on every call.
+ */
+class EpollFile : public File
+{
+    friend class EpollItem;
+
+    public:
+        EpollFile();
+        virtual ~EpollFile();
+
+        /** Is the given File an EpollFile? */
+        static bool isEpoll(File *pFile)
+        {
+            return pFile && ((pFile->getInode() & 0xFF000000) == EPOLL_INODE_MAGIC);
+        }
+
+        int add(int fd, File *pFile, const struct epoll_event &ev);
+        int modify(int fd, const struct epoll_event &ev);
+        int remove(int fd);
+
+        /**
+         * Fills pEvents with up to maxEvents ready descriptors.
+         * \param timeout Milliseconds to wait; negative waits forever.
+         * \return number of events filled in, 0 on timeout, -1 if interrupted.
+         */
+        int wait(struct epoll_event *pEvents, int maxEvents, int timeout);
+
+        /** Readable when items are on the ready list. Readiness changes are
+         *  passed on to monitors and watchers, so an epoll descriptor can be
+         *  waited on with poll, select or another epoll. */
+        virtual int select(bool bWriting = false, int timeout = 0);
+
+        virtual void increaseRefCount(bool bIsWriter);
+        virtual void decreaseRefCount(bool bIsWriter);
+
+    private:
+        EpollFile(const EpollFile &);
+        EpollFile &operator = (const EpollFile &);
+
+        /** Puts an item on the ready list (m_ItemLock must be held).
+         *  \return true if the list was empty, in which case dataChanged()
+         *          must be called once the lock has been dropped. */
+        bool queue(EpollItem *pItem);
+
+        /** Takes an item off the ready list (m_ItemLock must be held). */
+        void dequeue(EpollItem *pItem);
+
+        /** Takes an item out of the interest list and marks it removed
+         *  (m_ItemLock must be held). */
+        void unlink(EpollItem *pItem);
+
+        /** Polls an item (without m_ItemLock held), and queues it if it's
+         *  ready. */
+        void requeue(EpollItem *pItem);
+
+        /** Drops a use of an item taken while m_ItemLock was held, freeing it
+         *  if it was removed in the meantime. */
+        void release(EpollItem *pItem);
+
+        /** Interest list, keyed by descriptor. */
+        Tree<size_t, EpollItem*> m_Items;
+
+        /** Items that have signalled since they were last reported. */
+        List<EpollItem*> m_Ready;
+
+        /** Number of items that are themselves epoll descriptors. */
+        size_t m_nNested;
+
+        /** Guards m_Items, m_Ready, m_nNested and the items' state. */
+        Mutex m_ItemLock;
+
+        /** Released whenever an item is queued. */
+        Semaphore m_ReadySem;
+};
+
+int posix_epoll_create(int flags);
+int posix_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int posix_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
+#endif
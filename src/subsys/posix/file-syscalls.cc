@@ -399,13 +399,13 @@ int posix_read(int fd, char *ptr, int len)
     {
         /// \todo Sanitise input and check it's mapped etc so we don't segfault the kernel
         pThread->setInterrupted(false);
-        nRead = pFd->file->read(pFd->offset, len, len > 0x500000 ? 0 : reinterpret_cast<uintptr_t>(ptr), canBlock);
+        nRead = pFd->file->read(pFd->description->offset, len, len > 0x500000 ? 0 : reinterpret_cast<uintptr_t>(ptr), canBlock);
         if((!nRead) && (pThread->wasInterrupted()))
         {
             SYSCALL_ERROR(Interrupted);
             return -1;
         }
-        pFd->offset += nRead;
+        pFd->description->offset += nRead;
     }
 
     F_NOTICE("    -> " << Dec << nRead << Hex);
@@ -448,8 +448,8 @@ int posix_write(int fd, char *ptr, int len, bool nocheck)
     if (ptr && len)
     {
         /// \todo Sanitise input and check it's mapped etc so we don't segfault the kernel
-        nWritten = pFd->file->write(pFd->offset, len, reinterpret_cast<uintptr_t>(ptr));
-        pFd->offset += nWritten;
+        nWritten = pFd->file->write(pFd->description->offset, len, reinterpret_cast<uintptr_t>(ptr));
+        pFd->description->offset += nWritten;
     }
 
     return static_cast<int>(nWritten);
@@ -480,17 +480,17 @@ off_t posix_lseek(int file, off_t ptr, int dir)
     switch (dir)
     {
     case SEEK_SET:
-        pFd->offset = ptr;
+        pFd->description->offset = ptr;
         break;
     case SEEK_CUR:
-        pFd->offset += ptr;
+        pFd->description->offset += ptr;
         break;
     case SEEK_END:
-        pFd->offset = fileSize + ptr;
+        pFd->description->offset = fileSize + ptr;
         break;
     }
 
-    return static_cast<int>(pFd->offset);
+    return static_cast<int>(pFd->description->offset);
 }
 
 int posix_link(char *old, char *_new)
@@ -1019,7 +1019,7 @@ int posix_opendir(const char *dir, dirent *ent)
 
     FileDescriptor *f = new FileDescriptor;
     f->file = file;
-    f->offset = 0;
+    f->description->offset = 0;
     f->fd = fd;
 
     file = Directory::fromFile(file)->getChild(0);
@@ -1085,7 +1085,7 @@ int posix_readdir(int fd, dirent *ent)
         SYSCALL_ERROR(NotADirectory);
         return -1;
     }
-    File* file = Directory::fromFile(pFd->file)->getChild(pFd->offset);
+    File* file = Directory::fromFile(pFd->file)->getChild(pFd->description->offset);
     if (!file)
     {
         // Normal EOF condition.
@@ -1101,7 +1101,7 @@ int posix_readdir(int fd, dirent *ent)
         ent->d_type = DT_LNK;
     else
         ent->d_type = file->isDirectory() ? DT_DIR : DT_REG;
-    pFd->offset ++;
+    pFd->description->offset ++;
 
     return 0;
 }
@@ -1131,7 +1131,7 @@ void posix_rewinddir(int fd, dirent *ent)
         return;
     }
     FileDescriptor *f = pSubsystem->getFileDescriptor(fd);
-    f->offset = 0;
+    f->description->offset = 0;
     posix_readdir(fd, ent);
 }
 
@@ -1209,6 +1209,8 @@ int posix_ioctl(int fd, int command, void *buf)
 
         case FIONBIO:
         {
+            f = pSubsystem->getFileDescriptorForUpdate(fd);
+
             // set/unset non-blocking
             if (buf)
             {
@@ -1295,8 +1297,10 @@ int posix_dup(int fd)
 
     size_t newFd = pSubsystem->getFd();
 
-    // Copy the descriptor
+    // Copy the descriptor. According to the spec, CLOEXEC is cleared on DUP;
+    // do it before the copy is visible in the table.
     FileDescriptor* f2 = new FileDescriptor(*f);
+    f2->fdflags &= ~FD_CLOEXEC;
     pSubsystem->addFileDescriptor(newFd, f2);
 
     return static_cast<int>(newFd);
@@ -1337,10 +1341,11 @@ int posix_dup2(int fd1, int fd2)
     // might accidentally trigger an EOF condition on a pipe! (if the write refcount
     // drops to zero)...
     FileDescriptor* f2 = new FileDescriptor(*f);
-    pSubsystem->addFileDescriptor(fd2, f2);
 
-    // According to the spec, CLOEXEC is cleared on DUP.
+    // According to the spec, CLOEXEC is cleared on DUP. The copy is ours
+    // alone until it's in the table, so clear it first.
     f2->fdflags &= ~FD_CLOEXEC;
+    pSubsystem->addFileDescriptor(fd2, f2);
 
     return static_cast<int>(fd2);
 }
@@ -1427,10 +1432,10 @@ int posix_fcntl(int fd, int cmd, int num, int* args)
 
                     // Copy the descriptor (addFileDescriptor automatically frees the old one, if needed)
                     FileDescriptor* f2 = new FileDescriptor(*f);
-                    pSubsystem->addFileDescriptor(fd2, f2);
 
                     // According to the spec, CLOEXEC is cleared on DUP.
                     f2->fdflags &= ~FD_CLOEXEC;
+                    pSubsystem->addFileDescriptor(fd2, f2);
 
                     return static_cast<int>(fd2);
                 }
@@ -1441,10 +1446,10 @@ int posix_fcntl(int fd, int cmd, int num, int* args)
 
                 // copy the descriptor
                 FileDescriptor* f2 = new FileDescriptor(*f);
-                pSubsystem->addFileDescriptor(fd2, f2);
 
                 // According to the spec, CLOEXEC is cleared on DUP.
                 f2->fdflags &= ~FD_CLOEXEC;
+                pSubsystem->addFileDescriptor(fd2, f2);
 
                 return static_cast<int>(fd2);
             }
@@ -1454,6 +1459,7 @@ int posix_fcntl(int fd, int cmd, int num, int* args)
         case F_GETFD:
             return f->fdflags;
         case F_SETFD:
+            f = pSubsystem->getFileDescriptorForUpdate(fd);
             f->fdflags = args[0];
             return 0;
         case F_GETFL:
@@ -1461,6 +1467,7 @@ int posix_fcntl(int fd, int cmd, int num, int* args)
             return f->flflags;
         case F_SETFL:
             F_NOTICE("  -> set flags " << args[0]);
+            f = pSubsystem->getFileDescriptorForUpdate(fd);
             f->flflags = args[0] & (O_APPEND | O_NONBLOCK);
             F_NOTICE("  -> new flags " << f->flflags);
             return 0;
@@ -1468,6 +1475,10 @@ int posix_fcntl(int fd, int cmd, int num, int* args)
         case F_SETLK: // Set or clear a record lock (without blocking
         case F_SETLKW: // Set or clear a record lock (with blocking)
 
+            // Record locks belong to this process, not to a fork() sharer.
+            if(cmd != F_GETLK)
+                f = pSubsystem->getFileDescriptorForUpdate(fd);
+
             // Grab the lock information structure
             struct flock *lock = reinterpret_cast<struct flock*>(args[0]);
             if(!lock)
@@ -40,6 +40,8 @@ int h_errno; // required by networking code
 
 #include <sys/resource.h>
 #include <sys/mount.h>
+#include <sys/ioring.h>
+#include <sys/epoll.h>
 
 #include <sys/reent.h>
 
@@ -897,8 +899,7 @@ int getsockname(int sock, struct sockaddr* addr, size_t *addrlen)
 
 int getsockopt(int sock, int level, int optname, void* optvalue, size_t *optlen)
 {
-    STUBBED("getsockopt");
-    return -1;
+    return (long)syscall5(POSIX_GETSOCKOPT, sock, level, optname, (long) optvalue, (long) optlen);
 }
 
 int listen(int sock, int backlog)
@@ -935,14 +936,22 @@ ssize_t recvfrom(int sock, void* buff, size_t bufflen, int flags, struct sockadd
 
 ssize_t recvmsg(int sock, struct msghdr* msg, int flags)
 {
-    STUBBED("recvmsg");
-    return -1;
+    return (ssize_t)syscall3(POSIX_RECVMSG, sock, (long) msg, flags);
 }
 
 ssize_t sendmsg(int sock, const struct msghdr* msg, int flags)
 {
-    STUBBED("sendmsg");
-    return -1;
+    return (ssize_t)syscall3(POSIX_SENDMSG, sock, (long) msg, flags);
+}
+
+int sendmmsg(int sock, struct mmsghdr* msgvec, unsigned int vlen, int flags)
+{
+    return (long)syscall4(POSIX_SENDMMSG, sock, (long) msgvec, vlen, flags);
+}
+
+int recvmmsg(int sock, struct mmsghdr* msgvec, unsigned int vlen, int flags, struct timespec* timeout)
+{
+    return (long)syscall5(POSIX_RECVMMSG, sock, (long) msgvec, vlen, flags, (long) timeout);
 }
 
 ssize_t sendto(int sock, const void* buff, size_t bufflen, int flags, const struct sockaddr* remote_addr, socklen_t addrlen)
@@ -964,8 +973,7 @@ ssize_t sendto(int sock, const void* buff, size_t bufflen, int flags, const stru
 
 int setsockopt(int sock, int level, int optname, const void* optvalue, unsigned long optlen)
 {
-    STUBBED("setsockopt");
-    return 0;
+    return (long)syscall5(POSIX_SETSOCKOPT, sock, level, optname, (long) optvalue, (long) optlen);
 }
 
 int shutdown(int sock, int how)
@@ -981,8 +989,7 @@ int sockatmark(int sock)
 
 int socketpair(int domain, int type, int protocol, int sock_vec[2])
 {
-    STUBBED("socketpair");
-    return -1;
+    return (long)syscall4(POSIX_SOCKETPAIR, domain, type, protocol, (long) sock_vec);
 }
 
 #define INET_ADDR_INVALID   ((in_addr_t)(-1))
@@ -1106,6 +1113,11 @@ struct hostent* gethostbyaddr(const void *addr, unsigned long len, int type)
     return 0;
 }
 
+int set_dns_servers(const struct sockaddr_in *servers, size_t count)
+{
+    return (long)syscall2(POSIX_SET_DNS_SERVERS, (long) servers, count);
+}
+
 struct hostent* gethostbyname(const char *name)
 {
     syslog(LOG_NOTICE, "[%d] gethostbyname(%s)", getpid(), (name ? name : "<invalid>"));
@@ -1492,6 +1504,42 @@ int poll(struct pollfd fds[], unsigned int nfds, int timeout)
     return (long)syscall3(POSIX_POLL, (long)fds, nfds, timeout);
 }
 
+int epoll_create(int size)
+{
+    if(size <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return epoll_create1(0);
+}
+
+int epoll_create1(int flags)
+{
+    return (long)syscall1(POSIX_EPOLL_CREATE, flags);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    return (long)syscall4(POSIX_EPOLL_CTL, epfd, op, fd, (long)event);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    return (long)syscall4(POSIX_EPOLL_WAIT, epfd, (long)events, maxevents, timeout);
+}
+
+int ioring_setup(struct io_ring_params *params)
+{
+    return (long)syscall1(POSIX_IORING_SETUP, (long)params);
+}
+
+int ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (long)syscall4(POSIX_IORING_ENTER, fd, to_submit, min_complete, flags);
+}
+
 #define HOST_NOT_FOUND    1
 #define NO_DATA           2
 #define NO_RECOVERY       3
@@ -0,0 +1,101 @@
+#ifndef _NET_BPF_H
+#define _NET_BPF_H
+
+/* Classic BPF socket filters (SO_ATTACH_FILTER). */
+
+struct bpf_insn
+{
+    unsigned short code;
+    unsigned char jt;
+    unsigned char jf;
+    unsigned int k;
+};
+
+struct bpf_program
+{
+    unsigned short bf_len;
+    struct bpf_insn *bf_insns;
+};
+
+#define BPF_MAXINSNS    4096
+#define BPF_MEMWORDS    16
+
+/* Instruction classes */
+#define BPF_CLASS(code) ((code) & 0x07)
+#define BPF_LD          0x00
+#define BPF_LDX         0x01
+#define BPF_ST          0x02
+#define BPF_STX         0x03
+#define BPF_ALU         0x04
+#define BPF_JMP         0x05
+#define BPF_RET         0x06
+#define BPF_MISC        0x07
+
+/* ld/ldx fields */
+#define BPF_SIZE(code)  ((code) & 0x18)
+#define BPF_W           0x00
+#define BPF_H           0x08
+#define BPF_B           0x10
+#define BPF_MODE(code)  ((code) & 0xe0)
+#define BPF_IMM         0x00
+#define BPF_ABS         0x20
+#define BPF_IND         0x40
+#define BPF_MEM         0x60
+#define BPF_LEN         0x80
+#define BPF_MSH         0xa0
+
+/* alu/jmp fields */
+#define BPF_OP(code)    ((code) & 0xf0)
+#define BPF_ADD         0x00
+#define BPF_SUB         0x10
+#define BPF_MUL         0x20
+#define BPF_DIV         0x30
+#define BPF_OR          0x40
+#define BPF_AND         0x50
+#define BPF_LSH         0x60
+#define BPF_RSH         0x70
+#define BPF_NEG         0x80
+#define BPF_MOD         0x90
+#define BPF_XOR         0xa0
+#define BPF_JA          0x00
+#define BPF_JEQ         0x10
+#define BPF_JGT         0x20
+#define BPF_JGE         0x30
+#define BPF_JSET        0x40
+#define BPF_SRC(code)   ((code) & 0x08)
+#define BPF_K           0x00
+#define BPF_X           0x08
+
+/* ret - BPF_K and BPF_X also apply */
+#define BPF_RVAL(code)  ((code) & 0x18)
+#define BPF_A           0x10
+
+/* misc */
+#define BPF_MISCOP(code) ((code) & 0xf8)
+#define BPF_TAX         0x00
+#define BPF_TXA         0x80
+
+#define BPF_STMT(code, k)           { (unsigned short)(code), 0, 0, k }
+#define BPF_JUMP(code, k, jt, jf)   { (unsigned short)(code), jt, jf, k }
+
+/* ioctls on /dev/pcap, the network stack's packet capture */
+#define BIOCSETF    0x5100  /* Set the capture filter; an empty program clears it */
+#define BIOCGSTATS  0x5101  /* Get a struct bpf_stat */
+
+struct bpf_stat
+{
+    unsigned int bs_recv;   /* Frames captured */
+    unsigned int bs_drop;   /* Frames dropped because the reader fell behind */
+};
+
+/* Pedigree: setsockopt(fd, SOL_NETFILTER, level, &prog, sizeof(prog)) on a
+ * raw socket hooks a program into every packet the system receives at that
+ * level - dropping those it returns zero for - until the socket is closed.
+ * A program with no instructions removes the socket's hooks. Needs root. */
+#define SOL_NETFILTER       256
+
+#define NETFILTER_LINK      1   /* Whole frames, as they arrive */
+#define NETFILTER_NETWORK   2   /* ARP, IPv4 and IPv6 packets */
+#define NETFILTER_TRANSPORT 3   /* TCP, UDP and ICMP segments */
+
+#endif
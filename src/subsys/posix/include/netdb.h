@@ -121,6 +121,10 @@ int              getaddrinfo(const char *nodename, const char *servname, const s
 int              getnameinfo(const struct sockaddr *sa, socklen_t salen, char *node, socklen_t nodelen, char *service,
                              socklen_t servicelen, int flags);
 
+/* Pedigree extension: resolve with the given servers (address and port)
+   rather than each interface's own, until called again with count zero. */
+int              set_dns_servers(const struct sockaddr_in *servers, size_t count);
+
 #ifdef __cplusplus
 }; // extern "C"
 #endif
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _SYS_IORING_H
+#define _SYS_IORING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Asynchronous I/O submission and completion rings.
+ *
+ * ioring_setup() maps a single shared region into the calling process. The
+ * region starts with a struct io_ring_shared header, which gives the offsets
+ * of the submission queue (an array of struct io_sqe) and the completion
+ * queue (an array of struct io_cqe).
+ *
+ * Userspace owns sq_tail and cq_head, the kernel owns sq_head and cq_tail.
+ * Submitting is a matter of filling in sqes[sq_tail & sq_mask], bumping
+ * sq_tail and calling ioring_enter(). Completions can be reaped at any time
+ * by comparing cq_head with cq_tail - no system call is needed for that.
+ */
+
+/* Operations. */
+#define IORING_OP_NOP           0
+#define IORING_OP_READ          1
+#define IORING_OP_WRITE         2
+#define IORING_OP_RECV          3
+#define IORING_OP_SEND          4
+#define IORING_OP_ACCEPT        5
+#define IORING_OP_FSYNC         6
+#define IORING_OP_POLL          7
+
+/* io_sqe.off value for "use and advance the descriptor's file offset". */
+#define IORING_OFF_CURRENT      (~0ULL)
+
+/* ioring_enter() flags. */
+#define IORING_ENTER_GETEVENTS  1
+
+/* Upper bounds for ioring_setup(). */
+#define IORING_MAX_ENTRIES      4096
+#define IORING_MAX_WORKERS      16
+
+struct io_sqe
+{
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t poll_events;   /* IORING_OP_POLL: events to wait for. */
+    int32_t fd;
+    uint64_t off;           /* File offset, or socklen_t* for ACCEPT. */
+    uint64_t addr;          /* Buffer (or sockaddr for ACCEPT). */
+    uint32_t len;
+    uint32_t op_flags;      /* recv/send flags. */
+    uint64_t user_data;     /* Passed through unmodified to the CQE. */
+};
+
+struct io_cqe
+{
+    uint64_t user_data;
+    int32_t res;            /* Result, or -errno on failure. */
+    uint32_t flags;
+};
+
+struct io_ring_shared
+{
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    uint32_t cq_mask;
+    uint32_t cq_entries;
+
+    /* Completions that were lost because the CQ was full. */
+    volatile uint32_t cq_overflow;
+    uint32_t reserved;
+
+    /* Offsets of the SQE and CQE arrays from the start of this structure. */
+    uint32_t sq_off;
+    uint32_t cq_off;
+};
+
+struct io_ring_params
+{
+    uint32_t sq_entries;    /* In: requested entries (rounded to a power of 2). */
+    uint32_t workers;       /* In: worker threads, 0 for the default. */
+    uint32_t flags;
+
+    /* Out: the shared ring mapping. */
+    struct io_ring_shared *ring;
+    size_t ring_size;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int ioring_setup(struct io_ring_params *params);
+int ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -44,6 +44,25 @@ struct cmsghdr
   int           cmsg_type;
 };
 
+#define CMSG_ALIGN(len)     (((len) + sizeof(long) - 1) & ~(sizeof(long) - 1))
+#define CMSG_DATA(cmsg)     ((unsigned char *) (cmsg) + CMSG_ALIGN(sizeof(struct cmsghdr)))
+#define CMSG_SPACE(len)     (CMSG_ALIGN(sizeof(struct cmsghdr)) + CMSG_ALIGN(len))
+#define CMSG_LEN(len)       (CMSG_ALIGN(sizeof(struct cmsghdr)) + (len))
+#define CMSG_FIRSTHDR(mhdr) \
+  ((mhdr)->msg_controllen >= sizeof(struct cmsghdr) ? \
+   (struct cmsghdr *) (mhdr)->msg_control : (struct cmsghdr *) 0)
+#define CMSG_NXTHDR(mhdr, cmsg) \
+  (((unsigned char *) (cmsg) + CMSG_ALIGN((cmsg)->cmsg_len) + sizeof(struct cmsghdr) > \
+    (unsigned char *) (mhdr)->msg_control + (mhdr)->msg_controllen) ? \
+   (struct cmsghdr *) 0 : \
+   (struct cmsghdr *) ((unsigned char *) (cmsg) + CMSG_ALIGN((cmsg)->cmsg_len)))
+
+struct mmsghdr
+{
+  struct msghdr msg_hdr;
+  unsigned int  msg_len;
+};
+
 struct linger
 {
   int l_onoff;
@@ -74,11 +93,13 @@ struct linger
 #define SO_SNDLOWAT     13
 #define SO_SNDTIMEO     14
 #define SO_TYPE         15
-#define SO_MAX          16
+#define SO_REUSEPORT    16
+#define SO_ATTACH_FILTER 17
+#define SO_DETACH_FILTER 18
+#define SO_MAX          19
 
 #define SOMAXCONN     65536
 
-#define MSG_CTRUNC    0
 #define MSG_DONTROUTE 1
 #define MSG_EOR       2
 #define MSG_OOB       4
@@ -86,6 +107,9 @@ struct linger
 #define MSG_PEEK      16
 #define MSG_TRUNC     32
 #define MSG_WAITALL   64
+#define MSG_CTRUNC    128
+#define MSG_DONTWAIT  256
+#define MSG_WAITFORONE 512
 
 #define PF_INET   0
 #define PF_INET6  1
@@ -109,6 +133,8 @@ struct linger
 extern "C" {
 #endif
 
+struct timespec;
+
 int     accept(int, struct sockaddr *, socklen_t *);
 int     bind(int, const struct sockaddr *, socklen_t);
 int     connect(int, const struct sockaddr *, socklen_t);
@@ -119,8 +145,10 @@ int     listen(int, int);
 ssize_t recv(int, void *, size_t, int);
 ssize_t recvfrom(int, void *, size_t, int, struct sockaddr *, socklen_t *);
 ssize_t recvmsg(int, struct msghdr *, int);
+int     recvmmsg(int, struct mmsghdr *, unsigned int, int, struct timespec *);
 ssize_t send(int, const void *, size_t, int);
 ssize_t sendmsg(int, const struct msghdr *, int);
+int     sendmmsg(int, struct mmsghdr *, unsigned int, int);
 ssize_t sendto(int, const void *, size_t, int, const struct sockaddr *,socklen_t);
 int     setsockopt(int, int, int, const void *, socklen_t);
 int     shutdown(int, int);
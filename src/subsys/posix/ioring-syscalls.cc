@@ -0,0 +1,609 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "ioring-syscalls.h"
+#include "file-syscalls.h"
+#include "net-syscalls.h"
+#include "poll-syscalls.h"
+
+#include <syscallError.h>
+#include <processor/Processor.h>
+#include <processor/PhysicalMemoryManager.h>
+#include <process/Process.h>
+#include <process/Thread.h>
+#include <process/Event.h>
+#include <process/eventNumbers.h>
+#include <vfs/MemoryMappedFile.h>
+#include <utilities/ZombieQueue.h>
+#include <utilities/List.h>
+#include <utilities/assert.h>
+#include <LockGuard.h>
+#include <Log.h>
+
+#include <Subsystem.h>
+#include <PosixSubsystem.h>
+
+class ZombieIoRing : public ZombieObject
+{
+    public:
+        ZombieIoRing(IoRing *pRing) : m_pRing(pRing)
+        {
+        }
+        virtual ~ZombieIoRing()
+        {
+            delete m_pRing;
+        }
+    private:
+        IoRing *m_pRing;
+};
+
+/** Handler for IoRingCancelEvent: interrupts whatever the worker is
+    blocked in. */
+static void ioRingCancelHandler(uint8_t *pBuffer)
+{
+    Processor::information().getCurrentThread()->setInterrupted(true);
+}
+
+/** Sent to a ring's workers when it's closed, so that they give up on any
+    blocking operation they're parked in and notice they should exit. */
+class IoRingCancelEvent : public Event
+{
+    public:
+        IoRingCancelEvent() :
+            Event(reinterpret_cast<uintptr_t>(&ioRingCancelHandler), true /* Deletable */)
+        {
+        }
+        virtual ~IoRingCancelEvent()
+        {
+        }
+
+        virtual size_t serialize(uint8_t *pBuffer)
+        {
+            return 0;
+        }
+        static bool unserialize(uint8_t *pBuffer, IoRingCancelEvent &event)
+        {
+            return true;
+        }
+
+        virtual size_t getNumber()
+        {
+            return EventNumbers::Interrupt;
+        }
+};
+
+/** Every ring not yet destroyed, so that a process' rings can be shut down
+    when it exits, wherever their descriptors have ended up. */
+static List<IoRing*> g_IoRings;
+static Mutex g_IoRingsLock(false);
+
+/** Rounds n up to the next power of two. */
+static size_t roundToPowerOfTwo(size_t n)
+{
+    size_t r = 1;
+    while(r < n)
+        r <<= 1;
+    return r;
+}
+
+IoRing::IoRing(size_t nEntries, size_t nWorkers) :
+    File(String("io ring"), 0, 0, 0, IORING_INODE_MAGIC, 0, 0, 0),
+    m_pOwner(0), m_pShared(0), m_SharedSize(0), m_pSqes(0), m_pCqes(0),
+    m_nEntries(nEntries), m_nCqEntries(nEntries * 2), m_SqMask(nEntries - 1),
+    m_CqMask((nEntries * 2) - 1), m_SqHead(0), m_CqTail(0),
+    m_nWorkers(nWorkers), m_pPending(0),
+    m_PendingHead(0), m_PendingTail(0), m_InFlight(0), m_PendingLock(),
+    m_PendingCount(0), m_CompletionLock(false), m_Completions(0),
+    m_SubmitLock(false), m_bStop(false), m_WorkersExited(0)
+{
+    for(size_t i = 0; i < IORING_MAX_WORKERS; ++i)
+        m_pWorkers[i] = 0;
+}
+
+IoRing::~IoRing()
+{
+    delete [] m_pPending;
+}
+
+bool IoRing::initialise()
+{
+    m_pOwner = Processor::information().getCurrentThread()->getParent();
+
+    // Lay out header, SQ and CQ (twice as many CQEs as SQEs, as the SQ can be
+    // refilled while earlier requests are still completing).
+    size_t sqOff = (sizeof(struct io_ring_shared) + 63) & ~63;
+    size_t cqOff = sqOff + (m_nEntries * sizeof(struct io_sqe));
+    size_t total = cqOff + (m_nCqEntries * sizeof(struct io_cqe));
+
+    size_t pageSz = PhysicalMemoryManager::getPageSize();
+    m_SharedSize = (total + pageSz - 1) & ~(pageSz - 1);
+
+    uintptr_t address = 0;
+    MemoryMappedObject *pObject = MemoryMapManager::instance().mapAnon(
+        address, m_SharedSize, MemoryMappedObject::Read | MemoryMappedObject::Write);
+    if(!pObject)
+        return false;
+
+    m_pShared = reinterpret_cast<struct io_ring_shared *>(address);
+    memset(m_pShared, 0, sizeof(struct io_ring_shared));
+    m_pShared->sq_entries = m_nEntries;
+    m_pShared->sq_mask = m_SqMask;
+    m_pShared->cq_entries = m_nCqEntries;
+    m_pShared->cq_mask = m_CqMask;
+    m_pShared->sq_off = sqOff;
+    m_pShared->cq_off = cqOff;
+
+    m_pSqes = reinterpret_cast<struct io_sqe *>(address + sqOff);
+    m_pCqes = reinterpret_cast<struct io_cqe *>(address + cqOff);
+
+    m_pPending = new struct io_sqe[m_nCqEntries];
+
+    {
+        LockGuard<Mutex> guard(g_IoRingsLock);
+        g_IoRings.pushBack(this);
+    }
+
+    // Workers can't exit before m_bStop is set, so nothing else touches the
+    // table yet.
+    for(size_t i = 0; i < m_nWorkers; ++i)
+    {
+        m_pWorkers[i] = new Thread(m_pOwner, workerTrampoline, reinterpret_cast<void *>(this));
+    }
+
+    return true;
+}
+
+void IoRing::processExiting(Process *pProcess)
+{
+    LockGuard<Mutex> guard(g_IoRingsLock);
+    for(List<IoRing*>::Iterator it = g_IoRings.begin(); it != g_IoRings.end(); it++)
+    {
+        if((*it)->m_pOwner == pProcess)
+            (*it)->shutdown();
+    }
+}
+
+size_t IoRing::completionsWaiting() const
+{
+    // The ring goes with its owner; after that nothing ever completes.
+    struct io_ring_shared *pShared = m_pShared;
+    if(!pShared)
+        return 0;
+
+    // Userspace owns cq_head; a bogus one only confuses its own waits.
+    return m_CqTail - pShared->cq_head;
+}
+
+size_t IoRing::submit(size_t nSubmit)
+{
+    LockGuard<Mutex> guard(m_SubmitLock);
+    if(m_bStop)
+        return 0;
+
+    size_t nConsumed = 0;
+    uint32_t head = m_SqHead;
+    uint32_t tail = m_pShared->sq_tail;
+    __sync_synchronize();
+
+    while((head != tail) && (nConsumed < nSubmit))
+    {
+        m_PendingLock.acquire();
+
+        // Never have more requests in flight than we can post completions
+        // for, so that a completion is never lost to a full CQ.
+        if(m_InFlight >= m_nCqEntries)
+        {
+            m_PendingLock.release();
+            break;
+        }
+
+        m_pPending[m_PendingTail] = m_pSqes[head & m_SqMask];
+        m_PendingTail = (m_PendingTail + 1) % m_nCqEntries;
+        ++m_InFlight;
+
+        m_PendingLock.release();
+
+        m_PendingCount.release();
+
+        ++head;
+        ++nConsumed;
+    }
+
+    // Let userspace reuse the slots we've copied out.
+    __sync_synchronize();
+    m_SqHead = head;
+    m_pShared->sq_head = head;
+
+    return nConsumed;
+}
+
+bool IoRing::waitForCompletions(size_t nComplete)
+{
+    // Stale counts accumulate in the semaphore while userspace reaps without
+    // entering the kernel, so drain it before checking the ring itself.
+    while(m_Completions.tryAcquire());
+
+    while(completionsWaiting() < nComplete)
+    {
+        if(m_bStop || !m_Completions.acquire())
+            return false;
+    }
+
+    return true;
+}
+
+int IoRing::select(bool bWriting, int timeout)
+{
+    // Only the owner can see the ring, and only until it's shut down.
+    struct io_ring_shared *pShared = m_pShared;
+    if(!pShared || (Processor::information().getCurrentThread()->getParent() != m_pOwner))
+        return 0;
+
+    if(bWriting)
+        return (pShared->sq_tail - m_SqHead) < m_nEntries;
+
+    if(timeout && !completionsWaiting())
+        waitForCompletions(1);
+
+    return completionsWaiting() > 0;
+}
+
+void IoRing::increaseRefCount(bool bIsWriter)
+{
+    LockGuard<Mutex> guard(m_Lock);
+    File::increaseRefCount(bIsWriter);
+}
+
+void IoRing::decreaseRefCount(bool bIsWriter)
+{
+    {
+        LockGuard<Mutex> guard(m_Lock);
+        File::decreaseRefCount(bIsWriter);
+
+        if(m_nReaders || m_nWriters)
+            return;
+    }
+
+    // Last reference gone. The owner may already have shut us down on its
+    // way out, in which case there's nothing left to stop.
+    {
+        LockGuard<Mutex> guard(g_IoRingsLock);
+        for(List<IoRing*>::Iterator it = g_IoRings.begin(); it != g_IoRings.end(); it++)
+        {
+            if(*it == this)
+            {
+                g_IoRings.erase(it);
+                break;
+            }
+        }
+    }
+
+    shutdown();
+
+    ZombieQueue::instance().addObject(new ZombieIoRing(this));
+}
+
+void IoRing::shutdown()
+{
+    LockGuard<Mutex> guard(m_SubmitLock);
+    if(m_bStop)
+        return;
+
+    m_bStop = true;
+    m_PendingCount.release(m_nWorkers);
+
+    // Workers parked in a blocking operation (eg, recv on an idle socket)
+    // are interrupted out of it. A worker that was between operations when
+    // the interrupt arrived can go on to block again, so keep at it until
+    // they've all gone. Count the workers still there each time, rather
+    // than how many were started.
+    while(liveWorkers())
+    {
+        interruptWorkers();
+        m_WorkersExited.acquire(1, 0, 100000);
+    }
+
+    // Only now that no worker can post a completion is the ring unmapped.
+    // From any other process the mapping goes when the owner exits.
+    if(m_pOwner == Processor::information().getCurrentThread()->getParent())
+        MemoryMapManager::instance().remove(reinterpret_cast<uintptr_t>(m_pShared), m_SharedSize);
+
+    m_pShared = 0;
+    m_pSqes = 0;
+    m_pCqes = 0;
+}
+
+size_t IoRing::liveWorkers()
+{
+    // A worker can end up here itself, if it's the thread that brings the
+    // process down; it can't wait for its own exit.
+    Thread *pThread = Processor::information().getCurrentThread();
+
+    size_t nLive = 0;
+    m_PendingLock.acquire();
+    for(size_t i = 0; i < m_nWorkers; ++i)
+    {
+        if(m_pWorkers[i] && (m_pWorkers[i] != pThread))
+            ++nLive;
+    }
+    m_PendingLock.release();
+    return nLive;
+}
+
+void IoRing::interruptWorkers()
+{
+    m_PendingLock.acquire();
+    for(size_t i = 0; i < m_nWorkers; ++i)
+    {
+        if(m_pWorkers[i])
+            m_pWorkers[i]->sendEvent(new IoRingCancelEvent());
+    }
+    m_PendingLock.release();
+}
+
+int IoRing::workerTrampoline(void *p)
+{
+    IoRing *pRing = reinterpret_cast<IoRing *>(p);
+    return pRing->worker();
+}
+
+int IoRing::worker()
+{
+    while(true)
+    {
+        bool bAcquired = m_PendingCount.acquire();
+        if(m_bStop)
+            break;
+        if(!bAcquired)
+            continue;
+
+        m_PendingLock.acquire();
+        struct io_sqe sqe = m_pPending[m_PendingHead];
+        m_PendingHead = (m_PendingHead + 1) % m_nCqEntries;
+        m_PendingLock.release();
+
+        int32_t res = execute(sqe);
+
+        // Cancelled by close: nobody is left to reap the completion.
+        if(m_bStop)
+            break;
+
+        complete(sqe.user_data, res);
+
+        m_PendingLock.acquire();
+        --m_InFlight;
+        m_PendingLock.release();
+    }
+
+    Thread *pThread = Processor::information().getCurrentThread();
+    m_PendingLock.acquire();
+    for(size_t i = 0; i < m_nWorkers; ++i)
+    {
+        if(m_pWorkers[i] == pThread)
+            m_pWorkers[i] = 0;
+    }
+    m_PendingLock.release();
+
+    m_WorkersExited.release();
+    return 0;
+}
+
+int32_t IoRing::execute(const struct io_sqe &sqe)
+{
+    Thread *pThread = Processor::information().getCurrentThread();
+    pThread->setErrno(0);
+
+    int64_t ret = 0;
+    switch(sqe.opcode)
+    {
+        case IORING_OP_NOP:
+            return 0;
+
+        case IORING_OP_READ:
+        case IORING_OP_WRITE:
+        {
+            bool bWrite = sqe.opcode == IORING_OP_WRITE;
+            char *buf = reinterpret_cast<char *>(sqe.addr);
+            if(sqe.off == IORING_OFF_CURRENT)
+            {
+                ret = bWrite ? posix_write(sqe.fd, buf, sqe.len) : posix_read(sqe.fd, buf, sqe.len);
+                break;
+            }
+
+            // Positioned I/O: leave the descriptor's offset alone.
+            if(!PosixSubsystem::checkAddress(sqe.addr, sqe.len, bWrite ? PosixSubsystem::SafeRead : PosixSubsystem::SafeWrite))
+                return -Error::BadAddress;
+
+            PosixSubsystem *pSubsystem = reinterpret_cast<PosixSubsystem *>(m_pOwner->getSubsystem());
+            FileDescriptor *pFd = pSubsystem->getFileDescriptor(sqe.fd);
+            if(!pFd)
+                return -Error::BadFileDescriptor;
+            if(pFd->file->isDirectory())
+                return -Error::IsADirectory;
+
+            if(bWrite)
+                ret = pFd->file->write(sqe.off, sqe.len, sqe.addr);
+            else
+                ret = pFd->file->read(sqe.off, sqe.len, sqe.addr);
+            return static_cast<int32_t>(ret);
+        }
+
+        case IORING_OP_RECV:
+            ret = posix_recv(sqe.fd, reinterpret_cast<void *>(sqe.addr), sqe.len, sqe.op_flags);
+            break;
+
+        case IORING_OP_SEND:
+            ret = posix_send(sqe.fd, reinterpret_cast<const void *>(sqe.addr), sqe.len, sqe.op_flags);
+            break;
+
+        case IORING_OP_ACCEPT:
+            ret = posix_accept(sqe.fd, reinterpret_cast<struct sockaddr *>(sqe.addr), reinterpret_cast<size_t *>(sqe.off));
+            break;
+
+        case IORING_OP_FSYNC:
+            ret = posix_fsync(sqe.fd);
+            break;
+
+        case IORING_OP_POLL:
+        {
+            struct pollfd pfd;
+            pfd.fd = sqe.fd;
+            pfd.events = sqe.poll_events;
+            pfd.revents = 0;
+            ret = posix_poll(&pfd, 1, -1);
+            if(ret >= 0)
+                ret = pfd.revents;
+            break;
+        }
+
+        default:
+            return -Error::InvalidArgument;
+    }
+
+    if(ret < 0)
+    {
+        size_t err = pThread->getErrno();
+        return err ? -static_cast<int32_t>(err) : -Error::IoError;
+    }
+
+    return static_cast<int32_t>(ret);
+}
+
+void IoRing::complete(uint64_t userData, int32_t res)
+{
+    {
+        LockGuard<Mutex> guard(m_CompletionLock);
+
+        uint32_t tail = m_CqTail;
+        if((tail - m_pShared->cq_head) >= m_nCqEntries)
+        {
+            // Userspace has left completions unreaped for longer than the
+            // in-flight bound allows for - count it rather than overwrite.
+            ++m_pShared->cq_overflow;
+        }
+        else
+        {
+            struct io_cqe *pCqe = &m_pCqes[tail & m_CqMask];
+            pCqe->user_data = userData;
+            pCqe->res = res;
+            pCqe->flags = 0;
+
+            // The CQE must be visible before the new tail.
+            __sync_synchronize();
+            m_CqTail = tail + 1;
+            m_pShared->cq_tail = m_CqTail;
+        }
+    }
+
+    m_Completions.release();
+    dataChanged();
+}
+
+int posix_ioring_setup(struct io_ring_params *params)
+{
+    F_NOTICE("ioring_setup");
+
+    if(!PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(params), sizeof(struct io_ring_params), PosixSubsystem::SafeRead | PosixSubsystem::SafeWrite))
+    {
+        F_NOTICE(" -> invalid address");
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    size_t nEntries = params->sq_entries;
+    if(!nEntries || (nEntries > IORING_MAX_ENTRIES))
+    {
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+    nEntries = roundToPowerOfTwo(nEntries);
+
+    size_t nWorkers = params->workers;
+    if(!nWorkers)
+        nWorkers = IORING_DEFAULT_WORKERS;
+    else if(nWorkers > IORING_MAX_WORKERS)
+        nWorkers = IORING_MAX_WORKERS;
+
+    GRAB_POSIX_SUBSYSTEM(-1);
+
+    IoRing *pRing = new IoRing(nEntries, nWorkers);
+    if(!pRing->initialise())
+    {
+        delete pRing;
+        SYSCALL_ERROR(OutOfMemory);
+        return -1;
+    }
+
+    size_t fd = pSubsystem->getFd();
+    FileDescriptor *pFd = new FileDescriptor(pRing, 0, fd, 0, O_RDWR);
+    pSubsystem->addFileDescriptor(fd, pFd);
+
+    params->sq_entries = nEntries;
+    params->workers = nWorkers;
+    params->ring = pRing->getShared();
+    params->ring_size = pRing->getSharedSize();
+
+    F_NOTICE("  -> " << fd);
+
+    return static_cast<int>(fd);
+}
+
+int posix_ioring_enter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags)
+{
+    F_NOTICE("ioring_enter(" << fd << ", " << toSubmit << ", " << minComplete << ", " << flags << ")");
+
+    GRAB_POSIX_SUBSYSTEM(-1);
+
+    FileDescriptor *pFd = pSubsystem->getFileDescriptor(fd);
+    if(!pFd)
+    {
+        SYSCALL_ERROR(BadFileDescriptor);
+        return -1;
+    }
+
+    if(!IoRing::isIoRing(pFd->file))
+    {
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    IoRing *pRing = static_cast<IoRing *>(pFd->file);
+
+    // The queues are only mapped in the process that set the ring up.
+    if(pRing->getOwner() != Processor::information().getCurrentThread()->getParent())
+    {
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    size_t nSubmitted = 0;
+    if(toSubmit)
+        nSubmitted = pRing->submit(toSubmit);
+
+    if((flags & IORING_ENTER_GETEVENTS) && minComplete)
+    {
+        if(!pRing->waitForCompletions(minComplete) && !nSubmitted)
+        {
+            SYSCALL_ERROR(Interrupted);
+            return -1;
+        }
+    }
+
+    return static_cast<int>(nSubmitted);
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IORING_SYSCALLS_H
+#define IORING_SYSCALLS_H
+
+#include "file-syscalls.h"
+#include <process/Semaphore.h>
+#include <process/Mutex.h>
+#include <Spinlock.h>
+
+#include <sys/ioring.h>
+
+class Process;
+class Thread;
+
+/** Default number of worker threads servicing a ring. */
+#define IORING_DEFAULT_WORKERS  2
+
+/** Inode tag identifying an IoRing (cf. NetManager's 0xab000000 sockets). */
+#define IORING_INODE_MAGIC      0xac000000
+
+/**
+ * An asynchronous I/O ring.
+ *
+ * The ring is a File so that it can live in the descriptor table (and be
+ * passed to poll/select, which report it readable when completions are
+ * waiting). The submission and completion queues live in memory shared with
+ * the owning process; a small pool of kernel threads in that process pulls
+ * submitted requests off a private pending queue and runs them against the
+ * usual POSIX descriptor paths.
+ */
+class IoRing : public File
+{
+    public:
+        IoRing(size_t nEntries, size_t nWorkers);
+        virtual ~IoRing();
+
+        /** Is the given File an IoRing? */
+        static bool isIoRing(File *pFile)
+        {
+            return pFile && ((pFile->getInode() & 0xFF000000) == IORING_INODE_MAGIC);
+        }
+
+        /** Maps the shared ring into the current process and starts workers. */
+        bool initialise();
+
+        /** Stops and joins the workers of every ring pProcess owns, and
+         *  unmaps the rings. Must run before pProcess' address space goes. */
+        static void processExiting(Process *pProcess);
+
+        /** Process whose address space holds the shared ring. */
+        Process *getOwner() const
+        {
+            return m_pOwner;
+        }
+
+        /** Address of the shared ring within the owning process. */
+        struct io_ring_shared *getShared() const
+        {
+            return m_pShared;
+        }
+
+        /** Size of the shared mapping. */
+        size_t getSharedSize() const
+        {
+            return m_SharedSize;
+        }
+
+        /**
+         * Consumes up to nSubmit entries from the submission queue, handing
+         * them to the worker pool.
+         * \return the number of entries consumed.
+         */
+        size_t submit(size_t nSubmit);
+
+        /**
+         * Blocks until at least nComplete completions are waiting in the
+         * completion queue.
+         * \return false if interrupted.
+         */
+        bool waitForCompletions(size_t nComplete);
+
+        /** Readable when completions are waiting, writable when the SQ has room. */
+        virtual int select(bool bWriting = false, int timeout = 0);
+
+        virtual void increaseRefCount(bool bIsWriter);
+        virtual void decreaseRefCount(bool bIsWriter);
+
+    private:
+        IoRing(const IoRing &);
+        IoRing &operator = (const IoRing &);
+
+        static int workerTrampoline(void *p);
+        int worker();
+
+        /** Runs one request against the owning process' descriptors. */
+        int32_t execute(const struct io_sqe &sqe);
+
+        /** Posts a completion into the shared completion queue. */
+        void complete(uint64_t userData, int32_t res);
+
+        /** Number of completions currently unreaped. */
+        size_t completionsWaiting() const;
+
+        /** Interrupts every worker that hasn't exited yet, so any that are
+         *  blocked in an operation give up on it. */
+        void interruptWorkers();
+
+        /** Number of workers, other than the caller, that haven't exited. */
+        size_t liveWorkers();
+
+        /** Stops and joins the workers, then unmaps the ring if we're in the
+         *  owner's address space. Only the first call does anything. */
+        void shutdown();
+
+        /** Owning process; the shared ring is only valid in its address space. */
+        Process *m_pOwner;
+
+        struct io_ring_shared *m_pShared;
+        size_t m_SharedSize;
+        struct io_sqe *m_pSqes;
+        struct io_cqe *m_pCqes;
+
+        /** Queue sizes and masks. The shared header has copies for
+         *  userspace, but those can be overwritten at any time, so the
+         *  kernel only ever uses these. */
+        size_t m_nEntries;
+        size_t m_nCqEntries;
+        uint32_t m_SqMask;
+        uint32_t m_CqMask;
+
+        /** Next SQE to consume, and next CQE to fill. Published to the
+         *  shared header, never read back from it. */
+        uint32_t m_SqHead;
+        uint32_t m_CqTail;
+
+        size_t m_nWorkers;
+
+        /** Kernel-private pending queue, sized so in-flight <= CQ capacity. */
+        struct io_sqe *m_pPending;
+        size_t m_PendingHead;
+        size_t m_PendingTail;
+        size_t m_InFlight;
+        Spinlock m_PendingLock;
+        Semaphore m_PendingCount;
+
+        /** Serialises producers of the completion queue. */
+        Mutex m_CompletionLock;
+        Semaphore m_Completions;
+
+        /** Serialises submitters (enter from several threads), and
+         *  submission against shutdown. */
+        Mutex m_SubmitLock;
+
+        volatile bool m_bStop;
+        Semaphore m_WorkersExited;
+
+        /** Workers still running (null once each exits). Guarded by
+         *  m_PendingLock. */
+        Thread *m_pWorkers[IORING_MAX_WORKERS];
+};
+
+int posix_ioring_setup(struct io_ring_params *params);
+int posix_ioring_enter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags);
+
+#endif
@@ -30,17 +30,187 @@
 #include <network-stack/RoutingTable.h>
 #include <network-stack/Dns.h>
 #include <network-stack/Tcp.h>
+#include <network-stack/TcpManager.h>
 #include <network-stack/UdpManager.h>
+#include <network-stack/Filter.h>
+#include <network-stack/Bpf.h>
+#include <users/User.h>
 
 #include <Subsystem.h>
 #include <PosixSubsystem.h>
 
 #include "file-syscalls.h"
 #include "net-syscalls.h"
+#include "UnixFilesystem.h"
 
 #include <sys/un.h>
 
 #include "newlib.h"
+#include <sys/uio.h>
+#include <net/bpf.h>
+
+/// Most iovecs a sendmsg or recvmsg may pass.
+#define MAX_MSG_IOV 1024
+
+/** Maps a socket() type to the matching UNIX socket type. */
+static UnixSocket::SocketType unixSocketType(int type)
+{
+    if (type == SOCK_STREAM)
+        return UnixSocket::Streaming;
+    else if (type == SOCK_SEQPACKET)
+        return UnixSocket::SeqPacket;
+    return UnixSocket::Datagram;
+}
+
+/** Points a descriptor at a File, taking the reference a descriptor holds. */
+static void holdFile(FileDescriptor *f, File *pFile)
+{
+    pFile->increaseRefCount((f->flflags & O_RDWR) || (f->flflags & O_WRONLY));
+    f->file = pFile;
+}
+
+/** Connects a UNIX socket: datagram sockets just remember where to send,
+ *  anything else connects to a listening socket. */
+static int unixConnect(FileDescriptor *f, const struct sockaddr *address)
+{
+    if(address->sa_family != AF_UNIX)
+    {
+        // EAFNOSUPPORT
+        return -1;
+    }
+
+    const struct sockaddr_un *un = reinterpret_cast<const struct sockaddr_un *>(address);
+    String pathname(un->sun_path);
+
+    File *pFile = VFS::instance().find(pathname);
+    if(!pFile)
+    {
+        SYSCALL_ERROR(DoesNotExist);
+        return -1;
+    }
+
+    UnixSocket *pRemote = UnixSocket::fromFile(pFile);
+    if(!pRemote)
+    {
+        SYSCALL_ERROR(ConnectionRefused);
+        return -1;
+    }
+
+    if(f->so_type == SOCK_DGRAM)
+    {
+        if(pRemote->getType() != UnixSocket::Datagram)
+        {
+            SYSCALL_ERROR(ProtocolWrongType);
+            return -1;
+        }
+
+        // Let go of whatever we were connected to before.
+        if(f->file && (f->file != f->so_local))
+            f->file->decreaseRefCount((f->flflags & O_RDWR) || (f->flflags & O_WRONLY));
+        holdFile(f, pRemote);
+
+        f->so_remotePath = pathname;
+        return 0;
+    }
+
+    if(pRemote->getType() != unixSocketType(f->so_type))
+    {
+        SYSCALL_ERROR(ProtocolWrongType);
+        return -1;
+    }
+
+    UnixSocket *pLocal = UnixSocket::fromFile(f->so_local);
+    if(pLocal && (pLocal->getState() != UnixSocket::Inactive))
+    {
+        SYSCALL_ERROR(IsConnected);
+        return -1;
+    }
+
+    // An unbound socket connects from an anonymous one.
+    if(!pLocal)
+    {
+        pLocal = new UnixSocket(unixSocketType(f->so_type));
+        holdFile(f, pLocal);
+        f->so_local = pLocal;
+    }
+
+    if(!pRemote->connect(pLocal))
+    {
+        SYSCALL_ERROR(ConnectionRefused);
+        return -1;
+    }
+
+    f->so_remotePath = pathname;
+    return 0;
+}
+
+/** Sends on a UNIX socket - to pTarget if given (sendto on a datagram
+ *  socket), otherwise to whatever the socket is connected to. */
+static ssize_t unixSend(FileDescriptor *f, const struct iovec *pIov, size_t nIov,
+                        UnixSocket *pTarget, List<FileDescriptor*> *pRights, int flags)
+{
+    UnixSocket *pSocket = pTarget;
+    if(!pSocket)
+        pSocket = UnixSocket::fromFile(f->file);
+    if(!pSocket)
+    {
+        SYSCALL_ERROR(NotConnected);
+        return -1;
+    }
+
+    if((f->so_type == SOCK_DGRAM) != (pSocket->getType() == UnixSocket::Datagram))
+    {
+        SYSCALL_ERROR(ProtocolWrongType);
+        return -1;
+    }
+
+    const char *pSender = 0;
+    if(f->so_localPath.length())
+        pSender = static_cast<const char *>(f->so_localPath);
+
+    bool bCanBlock = !(f->flflags & O_NONBLOCK) && !(flags & MSG_DONTWAIT);
+    return pSocket->send(pIov, nIov, pSender, pRights, bCanBlock);
+}
+
+/** Receives on a UNIX socket. pSender, if set, must have room for
+ *  UNIX_PATH_MAX bytes. */
+static ssize_t unixRecv(FileDescriptor *f, const struct iovec *pIov, size_t nIov,
+                        char *pSender, List<FileDescriptor*> *pRights, int flags,
+                        int *pFlags)
+{
+    UnixSocket *pSocket = UnixSocket::fromFile(f->so_local);
+    if(!pSocket)
+    {
+        SYSCALL_ERROR(NotConnected);
+        return -1;
+    }
+
+    bool bCanBlock = !(f->flflags & O_NONBLOCK) && !(flags & MSG_DONTWAIT);
+    return pSocket->recv(pIov, nIov, pSender, pRights, bCanBlock, flags & MSG_PEEK, pFlags);
+}
+
+/** Checks the iovecs of a sendmsg or recvmsg are all accessible. */
+static bool checkIov(const struct msghdr *msg, size_t type)
+{
+    if((msg->msg_iovlen < 0) || (msg->msg_iovlen > MAX_MSG_IOV))
+        return false;
+    if(!msg->msg_iovlen)
+        return true;
+
+    if(!PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(msg->msg_iov),
+                                     msg->msg_iovlen * sizeof(struct iovec),
+                                     PosixSubsystem::SafeRead))
+        return false;
+
+    for(int i = 0; i < msg->msg_iovlen; ++i)
+    {
+        if(!PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(msg->msg_iov[i].iov_base),
+                                         msg->msg_iov[i].iov_len, type))
+            return false;
+    }
+
+    return true;
+}
 
 int posix_socket(int domain, int type, int protocol)
 {
@@ -81,12 +251,13 @@ int posix_socket(int domain, int type, int protocol)
     }
     else if (domain == AF_UNIX)
     {
-        if (type != SOCK_DGRAM)
+        if ((type != SOCK_DGRAM) && (type != SOCK_STREAM) && (type != SOCK_SEQPACKET))
         {
             SYSCALL_ERROR(InvalidArgument);
             valid = false;
         }
 
+        // The socket itself comes from bind() or connect().
         file = 0;
     }
     else
@@ -100,7 +271,7 @@ int posix_socket(int domain, int type, int protocol)
 
     FileDescriptor *f = new FileDescriptor;
     f->file = file;
-    f->offset = 0;
+    f->description->offset = 0;
     f->fd = fd;
     f->so_domain = domain;
     f->so_type = type;
@@ -130,33 +301,10 @@ int posix_connect(int sock, struct sockaddr* address, size_t addrlen)
     }
 
     FileDescriptor *f = pSubsystem->getFileDescriptor(sock);
-    if (!f || !f->file || (f->so_domain == AF_UNIX))
+    if (f && (f->so_domain == AF_UNIX))
+        return unixConnect(f, address);
+    if (!f || !f->file)
     {
-        if(f && ((!f->file) || (f->file == f->so_local)) && (f->so_domain == AF_UNIX))
-        {
-            if(address->sa_family != AF_UNIX)
-            {
-                // EAFNOSUPPORT
-                return -1;
-            }
-
-            // Valid state. But no socket, so do the magic here.
-            struct sockaddr_un *un = (struct sockaddr_un *) address;
-            String pathname(un->sun_path);
-
-            /// \todo Handle things that aren't actually UNIX sockets...
-            f->file = VFS::instance().find(pathname);
-            if(!f->file)
-            {
-                SYSCALL_ERROR(DoesNotExist);
-                return -1;
-            }
-
-            f->so_remotePath = pathname;
-
-            return 0;
-        }
-
         SYSCALL_ERROR(BadFileDescriptor);
         return -1;
     }
@@ -272,14 +420,17 @@ ssize_t posix_send(int sock, const void* buff, size_t bufflen, int flags)
     }
 
     FileDescriptor *f = pSubsystem->getFileDescriptor(sock);
-    if (!f || !f->file)
+    if (f && (f->so_domain == AF_UNIX))
     {
-        SYSCALL_ERROR(BadFileDescriptor);
-        return -1;
+        struct iovec iov;
+        iov.iov_base = const_cast<void *>(buff);
+        iov.iov_len = bufflen;
+        return unixSend(f, &iov, 1, 0, 0, flags);
     }
-    else if(f->so_domain == AF_UNIX)
+    else if (!f || !f->file)
     {
-        return f->file->write(reinterpret_cast<uintptr_t>(static_cast<const char *>(f->so_localPath)), bufflen, reinterpret_cast<uintptr_t>(buff), (f->flflags & O_NONBLOCK) == 0);
+        SYSCALL_ERROR(BadFileDescriptor);
+        return -1;
     }
 
     Socket *s = static_cast<Socket *>(f->file);
@@ -331,7 +482,7 @@ ssize_t posix_sendto(void* callInfo)
     int sock = tmp->sock;
     const void* buff = tmp->buff;
     size_t bufflen = tmp->bufflen;
-    //int flags = tmp->flags;
+    int flags = tmp->flags;
     const sockaddr* address = tmp->remote_addr;
     //size_t* addrlen = tmp->addrlen;
 
@@ -344,21 +495,23 @@ ssize_t posix_sendto(void* callInfo)
     }
 
     FileDescriptor *f = pSubsystem->getFileDescriptor(sock);
-    if (!f || !f->file)
+    if (f && (f->so_domain == AF_UNIX))
     {
-        SYSCALL_ERROR(BadFileDescriptor);
-        return -1;
-    }
+        struct iovec iov;
+        iov.iov_base = const_cast<void *>(buff);
+        iov.iov_len = bufflen;
 
-    if(f->so_domain != address->sa_family)
-    {
-        // EAFNOSUPPORT
-        return -1;
-    }
+        // Connected sockets ignore the address.
+        if((f->so_type != SOCK_DGRAM) || !address)
+            return unixSend(f, &iov, 1, 0, 0, flags);
 
-    if(f->so_domain == AF_UNIX)
-    {
-        struct sockaddr_un *un = (struct sockaddr_un *) address;
+        if(address->sa_family != AF_UNIX)
+        {
+            // EAFNOSUPPORT
+            return -1;
+        }
+
+        const struct sockaddr_un *un = reinterpret_cast<const struct sockaddr_un *>(address);
         File *pFile = VFS::instance().find(String(un->sun_path));
         if(!pFile)
         {
@@ -366,7 +519,25 @@ ssize_t posix_sendto(void* callInfo)
             return -1;
         }
 
-        return pFile->write(reinterpret_cast<uintptr_t>(static_cast<const char *>(f->so_localPath)), bufflen, reinterpret_cast<uintptr_t>(buff), (f->flflags & O_NONBLOCK) == 0);
+        UnixSocket *pTarget = UnixSocket::fromFile(pFile);
+        if(!pTarget)
+        {
+            SYSCALL_ERROR(ConnectionRefused);
+            return -1;
+        }
+
+        return unixSend(f, &iov, 1, pTarget, 0, flags);
+    }
+    else if (!f || !f->file)
+    {
+        SYSCALL_ERROR(BadFileDescriptor);
+        return -1;
+    }
+
+    if(f->so_domain != address->sa_family)
+    {
+        // EAFNOSUPPORT
+        return -1;
     }
 
     Socket *s = static_cast<Socket *>(f->file);
@@ -416,14 +587,17 @@ ssize_t posix_recv(int sock, void* buff, size_t bufflen, int flags)
     }
 
     FileDescriptor *f = pSubsystem->getFileDescriptor(sock);
-    if (!f || !f->file)
+    if (f && (f->so_domain == AF_UNIX))
     {
-        SYSCALL_ERROR(BadFileDescriptor);
-        return -1;
+        struct iovec iov;
+        iov.iov_base = buff;
+        iov.iov_len = bufflen;
+        return unixRecv(f, &iov, 1, 0, 0, flags, 0);
     }
-    else if(f->so_domain == AF_UNIX)
+    else if (!f || !f->file)
     {
-        return f->so_local->read(0, bufflen, reinterpret_cast<uintptr_t>(buff), (f->flflags & O_NONBLOCK) == 0);
+        SYSCALL_ERROR(BadFileDescriptor);
+        return -1;
     }
     Socket *s = static_cast<Socket *>(f->file);
 
@@ -474,27 +648,34 @@ ssize_t posix_recvfrom(void* callInfo)
     }
 
     FileDescriptor *f = pSubsystem->getFileDescriptor(sock);
-    if (!f || !f->file)
-    {
-        SYSCALL_ERROR(BadFileDescriptor);
-        return -1;
-    }
-
-    if(f->so_domain == AF_UNIX)
+    if (f && (f->so_domain == AF_UNIX))
     {
-        File *pFile = f->so_local;
-        struct sockaddr_un *un = (struct sockaddr_un *) address;
-        un->sun_family = AF_UNIX;
+        struct iovec iov;
+        iov.iov_base = buff;
+        iov.iov_len = bufflen;
 
-        ssize_t r = pFile->read(reinterpret_cast<uintptr_t>(un->sun_path), bufflen, reinterpret_cast<uintptr_t>(buff), (f->flflags & O_NONBLOCK) == 0);
+        struct sockaddr_un *un = reinterpret_cast<struct sockaddr_un *>(address);
+        char *pSender = 0;
+        if(un && (f->so_type == SOCK_DGRAM))
+        {
+            un->sun_path[0] = 0;
+            pSender = un->sun_path;
+        }
 
-        if(r > 0)
+        ssize_t r = unixRecv(f, &iov, 1, pSender, 0, flags, 0);
+        if((r >= 0) && un && addrlen)
         {
+            un->sun_family = AF_UNIX;
             *addrlen = sizeof(struct sockaddr_un);
         }
 
         return r;
     }
+    else if (!f || !f->file)
+    {
+        SYSCALL_ERROR(BadFileDescriptor);
+        return -1;
+    }
 
     Socket *s = static_cast<Socket *>(f->file);
 
@@ -574,14 +755,18 @@ int posix_bind(int sock, const struct sockaddr *address, size_t addrlen)
             }
 
             // bind() then connect().
-            f->so_local = f->file = VFS::instance().find(pathname);
-            if(!f->file)
+            UnixSocket *pSocket = UnixSocket::fromFile(VFS::instance().find(pathname));
+            if(!pSocket)
             {
                 // Which error do we use here?
                 SYSCALL_ERROR(DoesNotExist);
                 return -1;
             }
 
+            pSocket->setType(unixSocketType(f->so_type));
+            holdFile(f, pSocket);
+            f->so_local = pSocket;
+
             f->so_localPath = pathname;
 
             return 0;
@@ -629,6 +814,23 @@ int posix_listen(int sock, int backlog)
         SYSCALL_ERROR(BadFileDescriptor);
         return -1;
     }
+    if(f->so_domain == AF_UNIX)
+    {
+        if(f->so_type == SOCK_DGRAM)
+        {
+            SYSCALL_ERROR(OperationNotSupported);
+            return -1;
+        }
+
+        UnixSocket *pSocket = UnixSocket::fromFile(f->so_local);
+        if(!pSocket || !pSocket->listen(backlog > 0 ? backlog : 0))
+        {
+            SYSCALL_ERROR(InvalidArgument);
+            return -1;
+        }
+
+        return 0;
+    }
     if(f->so_type != SOCK_STREAM)
     {
         SYSCALL_ERROR(InvalidArgument);
@@ -656,7 +858,7 @@ int posix_listen(int sock, int backlog)
         }
     }
 
-    ce->listen();
+    ce->listen(backlog > 0 ? backlog : 0);
 
     return 0;
 }
@@ -682,9 +884,46 @@ int posix_accept(int sock, struct sockaddr* address, size_t* addrlen)
     }
 
     FileDescriptor *f = pSubsystem->getFileDescriptor(sock);
-    Socket *s1 = static_cast<Socket *>(f->file);
-    if (!s1)
+    if (!f || !f->file)
+    {
+        SYSCALL_ERROR(BadFileDescriptor);
         return -1;
+    }
+
+    if (f->so_domain == AF_UNIX)
+    {
+        UnixSocket *pListener = UnixSocket::fromFile(f->so_local);
+        if (!pListener || (pListener->getState() != UnixSocket::Listening))
+        {
+            SYSCALL_ERROR(InvalidArgument);
+            return -1;
+        }
+
+        UnixSocket *pSocket = pListener->accept((f->flflags & O_NONBLOCK) == 0);
+        if (!pSocket)
+            return -1;
+
+        size_t fd = pSubsystem->getFd();
+        FileDescriptor *desc = new FileDescriptor(pSocket, 0, fd, 0, O_RDWR);
+        desc->so_domain = AF_UNIX;
+        desc->so_type = f->so_type;
+        desc->so_local = pSocket;
+        desc->so_localPath = f->so_localPath;
+        pSubsystem->addFileDescriptor(fd, desc);
+
+        // Connecting sockets are usually unnamed.
+        if (address && addrlen)
+        {
+            struct sockaddr_un *un = reinterpret_cast<struct sockaddr_un *>(address);
+            un->sun_family = AF_UNIX;
+            un->sun_path[0] = 0;
+            *addrlen = sizeof(sa_family_t);
+        }
+
+        return static_cast<int> (fd);
+    }
+
+    Socket *s1 = static_cast<Socket *>(f->file);
 
     Socket *s = static_cast<Socket *>(NetManager::instance().accept(s1));
     if (!s)
@@ -723,6 +962,46 @@ int posix_gethostbyaddr(const void* addr, size_t len, int type, void* ent)
     return -1;
 }
 
+int posix_set_dns_servers(const struct sockaddr_in *servers, size_t count)
+{
+    N_NOTICE("set_dns_servers(" << Dec << count << Hex << ")");
+
+    if (count > DNS_MAX_SERVERS)
+    {
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    if (count && !PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(servers), count * sizeof(struct sockaddr_in), PosixSubsystem::SafeRead))
+    {
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    // This changes every process' lookups.
+    if (Processor::information().getCurrentThread()->getParent()->getUser()->getId())
+    {
+        SYSCALL_ERROR(NotEnoughPermissions);
+        return -1;
+    }
+
+    Endpoint::RemoteEndpoint hosts[DNS_MAX_SERVERS];
+    for (size_t i = 0; i < count; i++)
+    {
+        if (servers[i].sin_family != AF_INET)
+        {
+            SYSCALL_ERROR(InvalidArgument);
+            return -1;
+        }
+
+        hosts[i].ip.setIp(servers[i].sin_addr.s_addr);
+        hosts[i].remotePort = BIG_TO_HOST16(servers[i].sin_port);
+    }
+
+    Dns::instance().setServers(hosts, count);
+    return 0;
+}
+
 int posix_gethostbyname(const char* name, void* hostinfo, int offset)
 {
     /// \todo Sanity check pointers
@@ -832,6 +1111,13 @@ int posix_gethostbyname(const char* name, void* hostinfo, int offset)
             if(!(*it))
                 continue;
 
+            // A hostent only has room for one address family.
+            if((*it)->getType() != IpAddress::IPv4)
+            {
+                delete *it;
+                continue;
+            }
+
             // Copy the IP across
             uint32_t ip = (*it)->getIp();
             char* ipBlock = reinterpret_cast<char*>(userBlock);
@@ -868,13 +1154,32 @@ int posix_shutdown(int socket, int how)
     }
 
     FileDescriptor *f = pSubsystem->getFileDescriptor(socket);
-    Socket *s = static_cast<Socket *>(f->file);
-    if (!s)
+    if (!f || !f->file)
     {
         SYSCALL_ERROR(BadFileDescriptor);
         return -1;
     }
 
+    if (f->so_domain == AF_UNIX)
+    {
+        UnixSocket *pSocket = UnixSocket::fromFile(f->so_local);
+        if (!pSocket || (pSocket->getState() != UnixSocket::Connected))
+        {
+            SYSCALL_ERROR(NotConnected);
+            return -1;
+        }
+        if ((how != SHUT_RD) && (how != SHUT_WR) && (how != SHUT_RDWR))
+        {
+            SYSCALL_ERROR(InvalidArgument);
+            return -1;
+        }
+
+        pSocket->shutdown(how != SHUT_WR, how != SHUT_RD);
+        return 0;
+    }
+
+    Socket *s = static_cast<Socket *>(f->file);
+
     Endpoint *e = s->getEndpoint();
     Endpoint::ShutdownType howType;
     if(how == SHUT_RD)
@@ -943,3 +1248,779 @@ int posix_getpeername(int socket, struct sockaddr *address, socklen_t *address_l
 
     return 0;
 }
+
+int posix_socketpair(int domain, int type, int protocol, int sv[2])
+{
+    if(!PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(sv), sizeof(int) * 2, PosixSubsystem::SafeWrite))
+    {
+        N_NOTICE("socketpair -> invalid address");
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    N_NOTICE("posix_socketpair(" << domain << ", " << type << ", " << protocol << ")");
+
+    Process *pProcess = Processor::information().getCurrentThread()->getParent();
+    PosixSubsystem *pSubsystem = reinterpret_cast<PosixSubsystem*>(pProcess->getSubsystem());
+    if (!pSubsystem)
+    {
+        ERROR("No subsystem for one or both of the processes!");
+        return -1;
+    }
+
+    if (domain != AF_UNIX)
+    {
+        SYSCALL_ERROR(OperationNotSupported);
+        return -1;
+    }
+
+    /// \todo Datagram pairs - datagram sockets are addressed by name here.
+    if ((type != SOCK_STREAM) && (type != SOCK_SEQPACKET))
+    {
+        SYSCALL_ERROR(OperationNotSupported);
+        return -1;
+    }
+
+    UnixSocket *pSockets[2];
+    pSockets[0] = new UnixSocket(unixSocketType(type));
+    pSockets[1] = new UnixSocket(unixSocketType(type));
+    UnixSocket::pair(pSockets[0], pSockets[1]);
+
+    for (size_t i = 0; i < 2; ++i)
+    {
+        size_t fd = pSubsystem->getFd();
+        FileDescriptor *f = new FileDescriptor(pSockets[i], 0, fd, 0, O_RDWR);
+        f->so_domain = domain;
+        f->so_type = type;
+        f->so_local = pSockets[i];
+        pSubsystem->addFileDescriptor(fd, f);
+
+        sv[i] = static_cast<int> (fd);
+    }
+
+    return 0;
+}
+
+/** Sends a UNIX socket message, with any descriptors it carries. */
+static ssize_t unixSendmsg(PosixSubsystem *pSubsystem, FileDescriptor *f, const struct msghdr *msg, int flags)
+{
+    UnixSocket *pTarget = 0;
+    if (msg->msg_name && (f->so_type == SOCK_DGRAM))
+    {
+        const struct sockaddr_un *un = reinterpret_cast<const struct sockaddr_un *>(msg->msg_name);
+        if ((msg->msg_namelen < sizeof(sa_family_t)) || (un->sun_family != AF_UNIX))
+        {
+            SYSCALL_ERROR(InvalidArgument);
+            return -1;
+        }
+
+        File *pFile = VFS::instance().find(String(un->sun_path));
+        if (!pFile)
+        {
+            SYSCALL_ERROR(DoesNotExist);
+            return -1;
+        }
+
+        pTarget = UnixSocket::fromFile(pFile);
+        if (!pTarget)
+        {
+            SYSCALL_ERROR(ConnectionRefused);
+            return -1;
+        }
+    }
+
+    // Copy each descriptor being passed. The copies hold their own
+    // references, so the sender can close its descriptors straight away.
+    List<FileDescriptor*> rights;
+    Error::PosixError error = Error::NoError;
+    if (msg->msg_control)
+    {
+        for (struct cmsghdr *pHeader = CMSG_FIRSTHDR(msg);
+             pHeader && !error;
+             pHeader = CMSG_NXTHDR(msg, pHeader))
+        {
+            // CMSG_NXTHDR only bounds where the next header starts, so make
+            // sure this one's data is within what checkAddress validated.
+            size_t offset = reinterpret_cast<uintptr_t>(pHeader) - reinterpret_cast<uintptr_t>(msg->msg_control);
+            if ((pHeader->cmsg_len < CMSG_LEN(0)) ||
+                (pHeader->cmsg_len > msg->msg_controllen - offset))
+            {
+                error = Error::InvalidArgument;
+                break;
+            }
+            if ((pHeader->cmsg_level != SOL_SOCKET) || (pHeader->cmsg_type != SCM_RIGHTS))
+                continue;
+
+            size_t nFds = (pHeader->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int *pFds = reinterpret_cast<const int *>(CMSG_DATA(pHeader));
+            for (size_t i = 0; i < nFds; ++i)
+            {
+                FileDescriptor *pFd = pSubsystem->getFileDescriptor(pFds[i]);
+                if (!pFd)
+                {
+                    error = Error::BadFileDescriptor;
+                    break;
+                }
+                if (rights.count() >= UNIX_SOCKET_MAX_RIGHTS)
+                {
+                    error = Error::InvalidArgument;
+                    break;
+                }
+
+                rights.pushBack(new FileDescriptor(pFd));
+            }
+        }
+    }
+
+    ssize_t r = -1;
+    if (error)
+        Processor::information().getCurrentThread()->setErrno(error);
+    else
+        r = unixSend(f, msg->msg_iov, msg->msg_iovlen, pTarget, &rights, flags);
+
+    // Anything the socket didn't take wasn't sent.
+    while (rights.count())
+        delete rights.popFront();
+
+    return r;
+}
+
+/** Receives a UNIX socket message, installing any descriptors it carries. */
+static ssize_t unixRecvmsg(PosixSubsystem *pSubsystem, FileDescriptor *f, struct msghdr *msg, int flags)
+{
+    char sender[UNIX_PATH_MAX];
+    sender[0] = 0;
+
+    List<FileDescriptor*> rights;
+    int msgFlags = 0;
+    ssize_t r = unixRecv(f, msg->msg_iov, msg->msg_iovlen,
+                         (f->so_type == SOCK_DGRAM) ? sender : 0,
+                         (flags & MSG_PEEK) ? 0 : &rights, flags, &msgFlags);
+    if (r < 0)
+        return r;
+
+    if (msg->msg_name)
+    {
+        struct sockaddr_un un;
+        un.sun_family = AF_UNIX;
+        strncpy(un.sun_path, sender, UNIX_PATH_MAX);
+
+        size_t length = sizeof(sa_family_t) + strlen(sender) + 1;
+        if (length > msg->msg_namelen)
+            length = msg->msg_namelen;
+        memcpy(msg->msg_name, &un, length);
+        msg->msg_namelen = length;
+    }
+
+    // Install the descriptors that came with the data, as many as there's
+    // room to report. The rest are closed.
+    size_t nFds = 0;
+    size_t nRoom = 0;
+    if (msg->msg_control && (msg->msg_controllen >= CMSG_LEN(sizeof(int))))
+        nRoom = (msg->msg_controllen - CMSG_LEN(0)) / sizeof(int);
+
+    struct cmsghdr *pHeader = reinterpret_cast<struct cmsghdr *>(msg->msg_control);
+    while (rights.count())
+    {
+        FileDescriptor *pFd = rights.popFront();
+        if (nFds >= nRoom)
+        {
+            delete pFd;
+            msgFlags |= MSG_CTRUNC;
+            continue;
+        }
+
+        size_t fd = pSubsystem->getFd();
+        pFd->fd = fd;
+        pFd->fdflags = 0;
+        pSubsystem->addFileDescriptor(fd, pFd);
+
+        reinterpret_cast<int *>(CMSG_DATA(pHeader))[nFds++] = static_cast<int> (fd);
+    }
+
+    if (nFds)
+    {
+        pHeader->cmsg_len = CMSG_LEN(nFds * sizeof(int));
+        pHeader->cmsg_level = SOL_SOCKET;
+        pHeader->cmsg_type = SCM_RIGHTS;
+
+        size_t length = CMSG_SPACE(nFds * sizeof(int));
+        if (length > msg->msg_controllen)
+            length = msg->msg_controllen;
+        msg->msg_controllen = length;
+    }
+    else
+        msg->msg_controllen = 0;
+
+    msg->msg_flags = msgFlags;
+    return r;
+}
+
+/** Returns the UDP endpoint behind a descriptor, or null (with the error
+ *  set) if it isn't a UDP socket. */
+static UdpEndpoint *udpEndpoint(FileDescriptor *f)
+{
+    Socket *s = static_cast<Socket *>(f->file);
+    if (!s || (f->so_domain != AF_INET) || (s->getProtocol() != NETMAN_TYPE_UDP))
+    {
+        /// \todo sendmsg and recvmsg on TCP and raw sockets.
+        SYSCALL_ERROR(OperationNotSupported);
+        return 0;
+    }
+
+    return static_cast<UdpEndpoint *>(s->getEndpoint());
+}
+
+/** Sends a UDP datagram, to msg_name or the connected address. */
+static ssize_t udpSendmsg(FileDescriptor *f, const struct msghdr *msg)
+{
+    UdpEndpoint *pEndpoint = udpEndpoint(f);
+    if (!pEndpoint)
+        return -1;
+
+    Endpoint::RemoteEndpoint remoteHost;
+    if (msg->msg_name)
+    {
+        const struct sockaddr_in *sin = reinterpret_cast<const struct sockaddr_in *>(msg->msg_name);
+        if ((msg->msg_namelen < sizeof(struct sockaddr_in)) || (sin->sin_family != AF_INET))
+        {
+            SYSCALL_ERROR(InvalidArgument);
+            return -1;
+        }
+
+        remoteHost.remotePort = BIG_TO_HOST16(sin->sin_port);
+        remoteHost.ip.setIp(sin->sin_addr.s_addr);
+    }
+    else if (pEndpoint->getRemoteIp().getIp())
+    {
+        remoteHost.remotePort = pEndpoint->getRemotePort();
+        remoteHost.ip = pEndpoint->getRemoteIp();
+    }
+    else
+    {
+        SYSCALL_ERROR(NotConnected);
+        return -1;
+    }
+
+    // Nearly every datagram comes from one buffer; others are gathered up.
+    if (msg->msg_iovlen == 1)
+        return pEndpoint->send(msg->msg_iov[0].iov_len, reinterpret_cast<uintptr_t>(msg->msg_iov[0].iov_base), remoteHost, false);
+
+    size_t nBytes = 0;
+    for (int i = 0; i < msg->msg_iovlen; ++i)
+        nBytes += msg->msg_iov[i].iov_len;
+    if (nBytes > 0xFFFF)
+    {
+        SYSCALL_ERROR(MessageTooLong);
+        return -1;
+    }
+
+    uint8_t *pGather = new uint8_t[nBytes];
+    size_t offset = 0;
+    for (int i = 0; i < msg->msg_iovlen; ++i)
+    {
+        memcpy(pGather + offset, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+        offset += msg->msg_iov[i].iov_len;
+    }
+
+    ssize_t r = pEndpoint->send(nBytes, reinterpret_cast<uintptr_t>(pGather), remoteHost, false);
+    delete [] pGather;
+    return r;
+}
+
+/** Receives a UDP datagram straight into the caller's iovecs. */
+static ssize_t udpRecvmsg(FileDescriptor *f, struct msghdr *msg, int flags, int nTimeout)
+{
+    UdpEndpoint *pEndpoint = udpEndpoint(f);
+    if (!pEndpoint)
+        return -1;
+
+    UdpEndpoint::Segment segments[8];
+    UdpEndpoint::Segment *pSegments = segments;
+    if (msg->msg_iovlen > 8)
+        pSegments = new UdpEndpoint::Segment[msg->msg_iovlen];
+    for (int i = 0; i < msg->msg_iovlen; ++i)
+    {
+        pSegments[i].buffer = reinterpret_cast<uintptr_t>(msg->msg_iov[i].iov_base);
+        pSegments[i].length = msg->msg_iov[i].iov_len;
+    }
+
+    Endpoint::RemoteEndpoint remoteHost;
+    bool bTruncated = false;
+    bool bCanBlock = !(f->flflags & O_NONBLOCK) && !(flags & MSG_DONTWAIT);
+    int r = pEndpoint->recv(pSegments, msg->msg_iovlen, bCanBlock, &remoteHost,
+                            nTimeout, flags & MSG_PEEK, &bTruncated);
+
+    if (pSegments != segments)
+        delete [] pSegments;
+    if (r < 0)
+        return r;
+
+    if (msg->msg_name)
+    {
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = HOST_TO_BIG16(remoteHost.remotePort);
+        sin.sin_addr.s_addr = remoteHost.ip.getIp();
+
+        size_t length = sizeof(sin);
+        if (length > msg->msg_namelen)
+            length = msg->msg_namelen;
+        memcpy(msg->msg_name, &sin, length);
+        msg->msg_namelen = sizeof(sin);
+    }
+
+    msg->msg_controllen = 0;
+    msg->msg_flags = bTruncated ? MSG_TRUNC : 0;
+    return r;
+}
+
+/** Checks the buffers a message header points to. */
+static bool checkMsghdr(const struct msghdr *msg, size_t type)
+{
+    return checkIov(msg, type) &&
+        (!msg->msg_name || PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(msg->msg_name), msg->msg_namelen, type)) &&
+        (!msg->msg_control || PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(msg->msg_control), msg->msg_controllen, type));
+}
+
+static ssize_t doSendmsg(PosixSubsystem *pSubsystem, FileDescriptor *f, const struct msghdr *msg, int flags)
+{
+    if (!checkMsghdr(msg, PosixSubsystem::SafeRead))
+    {
+        N_NOTICE("sendmsg -> invalid address");
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    if (f->so_domain == AF_UNIX)
+        return unixSendmsg(pSubsystem, f, msg, flags);
+    return udpSendmsg(f, msg);
+}
+
+/** \param nTimeout Seconds to wait for a datagram, or 0 for no limit. */
+static ssize_t doRecvmsg(PosixSubsystem *pSubsystem, FileDescriptor *f, struct msghdr *msg, int flags, int nTimeout)
+{
+    if (!checkMsghdr(msg, PosixSubsystem::SafeWrite))
+    {
+        N_NOTICE("recvmsg -> invalid address");
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    if (f->so_domain == AF_UNIX)
+        return unixRecvmsg(pSubsystem, f, msg, flags);
+    return udpRecvmsg(f, msg, flags, nTimeout);
+}
+
+ssize_t posix_sendmsg(int sock, const struct msghdr *msg, int flags)
+{
+    if(!PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(msg), sizeof(struct msghdr), PosixSubsystem::SafeRead))
+    {
+        N_NOTICE("sendmsg -> invalid address");
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    N_NOTICE("posix_sendmsg");
+
+    Process *pProcess = Processor::information().getCurrentThread()->getParent();
+    PosixSubsystem *pSubsystem = reinterpret_cast<PosixSubsystem*>(pProcess->getSubsystem());
+    if (!pSubsystem)
+    {
+        ERROR("No subsystem for one or both of the processes!");
+        return -1;
+    }
+
+    FileDescriptor *f = pSubsystem->getFileDescriptor(sock);
+    if (!f)
+    {
+        SYSCALL_ERROR(BadFileDescriptor);
+        return -1;
+    }
+
+    return doSendmsg(pSubsystem, f, msg, flags);
+}
+
+ssize_t posix_recvmsg(int sock, struct msghdr *msg, int flags)
+{
+    if(!PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(msg), sizeof(struct msghdr), PosixSubsystem::SafeWrite))
+    {
+        N_NOTICE("recvmsg -> invalid address");
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    N_NOTICE("posix_recvmsg");
+
+    Process *pProcess = Processor::information().getCurrentThread()->getParent();
+    PosixSubsystem *pSubsystem = reinterpret_cast<PosixSubsystem*>(pProcess->getSubsystem());
+    if (!pSubsystem)
+    {
+        ERROR("No subsystem for one or both of the processes!");
+        return -1;
+    }
+
+    FileDescriptor *f = pSubsystem->getFileDescriptor(sock);
+    if (!f)
+    {
+        SYSCALL_ERROR(BadFileDescriptor);
+        return -1;
+    }
+
+    return doRecvmsg(pSubsystem, f, msg, flags, 0);
+}
+
+int posix_sendmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    if (vlen > MAX_MSG_IOV)
+        vlen = MAX_MSG_IOV;
+    if(!PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(msgvec), vlen * sizeof(struct mmsghdr), PosixSubsystem::SafeRead | PosixSubsystem::SafeWrite))
+    {
+        N_NOTICE("sendmmsg -> invalid address");
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    N_NOTICE("posix_sendmmsg(" << sock << ", " << vlen << ")");
+
+    Process *pProcess = Processor::information().getCurrentThread()->getParent();
+    PosixSubsystem *pSubsystem = reinterpret_cast<PosixSubsystem*>(pProcess->getSubsystem());
+    if (!pSubsystem)
+    {
+        ERROR("No subsystem for one or both of the processes!");
+        return -1;
+    }
+
+    FileDescriptor *f = pSubsystem->getFileDescriptor(sock);
+    if (!f)
+    {
+        SYSCALL_ERROR(BadFileDescriptor);
+        return -1;
+    }
+
+    // Stop at the first failure, but report what went before it.
+    unsigned int n = 0;
+    for (; n < vlen; ++n)
+    {
+        ssize_t r = doSendmsg(pSubsystem, f, &msgvec[n].msg_hdr, flags);
+        if (r < 0)
+            break;
+        msgvec[n].msg_len = r;
+    }
+
+    return n ? static_cast<int>(n) : -1;
+}
+
+int posix_recvmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout)
+{
+    if (vlen > MAX_MSG_IOV)
+        vlen = MAX_MSG_IOV;
+    if(!(PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(msgvec), vlen * sizeof(struct mmsghdr), PosixSubsystem::SafeRead | PosixSubsystem::SafeWrite) &&
+        (!timeout || PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(timeout), sizeof(struct timespec), PosixSubsystem::SafeRead))))
+    {
+        N_NOTICE("recvmmsg -> invalid address");
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    N_NOTICE("posix_recvmmsg(" << sock << ", " << vlen << ")");
+
+    Process *pProcess = Processor::information().getCurrentThread()->getParent();
+    PosixSubsystem *pSubsystem = reinterpret_cast<PosixSubsystem*>(pProcess->getSubsystem());
+    if (!pSubsystem)
+    {
+        ERROR("No subsystem for one or both of the processes!");
+        return -1;
+    }
+
+    FileDescriptor *f = pSubsystem->getFileDescriptor(sock);
+    if (!f)
+    {
+        SYSCALL_ERROR(BadFileDescriptor);
+        return -1;
+    }
+
+    // The timeout only limits the wait for the first message. Waits are
+    // in whole seconds, so round up; a zero timeout just polls.
+    int nTimeout = 0;
+    if (timeout)
+    {
+        nTimeout = timeout->tv_sec + (timeout->tv_nsec ? 1 : 0);
+        if (!nTimeout)
+            flags |= MSG_DONTWAIT;
+    }
+
+    unsigned int n = 0;
+    for (; n < vlen; ++n)
+    {
+        ssize_t r = doRecvmsg(pSubsystem, f, &msgvec[n].msg_hdr, flags, nTimeout);
+        if (r < 0)
+            break;
+        msgvec[n].msg_len = r;
+
+        // End of a stream.
+        if (!r && (f->so_type != SOCK_DGRAM))
+        {
+            ++n;
+            break;
+        }
+
+        // Having got one, take whatever else is already queued, but don't
+        // wait for more.
+        flags |= MSG_DONTWAIT;
+    }
+
+    return n ? static_cast<int>(n) : -1;
+}
+
+/** Copies in and verifies a struct bpf_program from setsockopt. */
+static BpfProgram *copyFilter(const void *optvalue, socklen_t optlen)
+{
+    if (optlen < sizeof(struct bpf_program))
+    {
+        SYSCALL_ERROR(InvalidArgument);
+        return 0;
+    }
+
+    const struct bpf_program *prog = reinterpret_cast<const struct bpf_program *>(optvalue);
+    size_t nBytes = prog->bf_len * sizeof(struct bpf_insn);
+    if (!prog->bf_len || (prog->bf_len > BPF_MAXINSNS) ||
+        !PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(prog->bf_insns), nBytes, PosixSubsystem::SafeRead))
+    {
+        SYSCALL_ERROR(InvalidArgument);
+        return 0;
+    }
+
+    BpfProgram *pProgram = BpfProgram::create(reinterpret_cast<const BpfProgram::Instruction *>(prog->bf_insns), prog->bf_len);
+    if (!pProgram)
+    {
+        N_NOTICE("setsockopt -> filter failed verification");
+        SYSCALL_ERROR(InvalidArgument);
+    }
+    return pProgram;
+}
+
+/** SO_ATTACH_FILTER, SO_DETACH_FILTER and SOL_NETFILTER hooks. */
+static int setFilter(Socket *s, int level, int optname, const void *optvalue, socklen_t optlen)
+{
+    int protocol = s ? s->getProtocol() : -1;
+
+    if (level == SOL_NETFILTER)
+    {
+        // Hooks see every packet the system receives.
+        Process *pProcess = Processor::information().getCurrentThread()->getParent();
+        if (pProcess->getEffectiveUser()->getId() != 0)
+        {
+            SYSCALL_ERROR(NotEnoughPermissions);
+            return -1;
+        }
+
+        if ((protocol != NETMAN_TYPE_RAW) || (optname < 1) || (optname > 3))
+        {
+            SYSCALL_ERROR(ProtocolNotAvailable);
+            return -1;
+        }
+
+        // An empty program takes this socket's hooks out.
+        if ((optlen >= sizeof(struct bpf_program)) &&
+            !reinterpret_cast<const struct bpf_program *>(optvalue)->bf_len)
+        {
+            NetworkFilter::instance().removeOwner(s->getEndpoint());
+            return 0;
+        }
+
+        BpfProgram *pProgram = copyFilter(optvalue, optlen);
+        if (!pProgram)
+            return -1;
+
+        size_t id = NetworkFilter::instance().installProgram(optname, pProgram, s->getEndpoint());
+        pProgram->release();
+        if (id == static_cast<size_t>(-1))
+        {
+            SYSCALL_ERROR(OutOfMemory);
+            return -1;
+        }
+        return 0;
+    }
+
+    if ((protocol != NETMAN_TYPE_UDP) && (protocol != NETMAN_TYPE_RAW) &&
+        (protocol != NETMAN_TYPE_TCP))
+    {
+        SYSCALL_ERROR(ProtocolNotAvailable);
+        return -1;
+    }
+
+    if (optname == SO_DETACH_FILTER)
+    {
+        s->getEndpoint()->setFilter(0);
+        return 0;
+    }
+
+    BpfProgram *pProgram = copyFilter(optvalue, optlen);
+    if (!pProgram)
+        return -1;
+
+    s->getEndpoint()->setFilter(pProgram);
+    pProgram->release();
+    return 0;
+}
+
+int posix_setsockopt(int sock, int level, int optname, const void *optvalue, socklen_t optlen)
+{
+    if(!PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(optvalue), optlen, PosixSubsystem::SafeRead))
+    {
+        N_NOTICE("setsockopt -> invalid address");
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    N_NOTICE("posix_setsockopt(" << sock << ", " << level << ", " << optname << ")");
+
+    Process *pProcess = Processor::information().getCurrentThread()->getParent();
+    PosixSubsystem *pSubsystem = reinterpret_cast<PosixSubsystem*>(pProcess->getSubsystem());
+    if (!pSubsystem)
+    {
+        ERROR("No subsystem for one or both of the processes!");
+        return -1;
+    }
+
+    FileDescriptor *f = pSubsystem->getFileDescriptor(sock);
+    if (!f)
+    {
+        SYSCALL_ERROR(BadFileDescriptor);
+        return -1;
+    }
+
+    Socket *s = 0;
+    if ((f->so_domain == AF_INET) && f->file)
+        s = static_cast<Socket *>(f->file);
+    int protocol = s ? s->getProtocol() : -1;
+
+    // Filters take a struct bpf_program rather than an int.
+    if ((level == SOL_NETFILTER) ||
+        ((level == SOL_SOCKET) && ((optname == SO_ATTACH_FILTER) || (optname == SO_DETACH_FILTER))))
+        return setFilter(s, level, optname, optvalue, optlen);
+
+    /// \todo Options at the IP and TCP levels.
+    if (level != SOL_SOCKET)
+    {
+        SYSCALL_ERROR(ProtocolNotAvailable);
+        return -1;
+    }
+
+    if (optlen < sizeof(int))
+    {
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+    int value = *reinterpret_cast<const int *>(optvalue);
+
+    switch (optname)
+    {
+        case SO_RCVBUF:
+            if (protocol == NETMAN_TYPE_UDP)
+                static_cast<UdpEndpoint *>(s->getEndpoint())->setReceiveBufferSize(value);
+            /// \todo Other sockets have fixed buffers for now.
+            return 0;
+
+        case SO_REUSEPORT:
+            if (protocol != NETMAN_TYPE_UDP)
+                break;
+            static_cast<UdpEndpoint *>(s->getEndpoint())->setReusePort(value != 0);
+            return 0;
+
+        case SO_REUSEADDR:
+            // Ports aren't held after a socket closes, so there's nothing
+            // to allow.
+            return 0;
+
+        case SO_KEEPALIVE:
+            if (protocol != NETMAN_TYPE_TCP)
+                break;
+            TcpManager::instance().setKeepalive(static_cast<TcpEndpoint *>(s->getEndpoint())->getConnId(), value != 0);
+            return 0;
+
+        default:
+            break;
+    }
+
+    SYSCALL_ERROR(ProtocolNotAvailable);
+    return -1;
+}
+
+int posix_getsockopt(int sock, int level, int optname, void *optvalue, socklen_t *optlen)
+{
+    if(!(PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(optlen), sizeof(socklen_t), PosixSubsystem::SafeRead | PosixSubsystem::SafeWrite) &&
+        PosixSubsystem::checkAddress(reinterpret_cast<uintptr_t>(optvalue), *optlen, PosixSubsystem::SafeWrite)))
+    {
+        N_NOTICE("getsockopt -> invalid address");
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    N_NOTICE("posix_getsockopt(" << sock << ", " << level << ", " << optname << ")");
+
+    Process *pProcess = Processor::information().getCurrentThread()->getParent();
+    PosixSubsystem *pSubsystem = reinterpret_cast<PosixSubsystem*>(pProcess->getSubsystem());
+    if (!pSubsystem)
+    {
+        ERROR("No subsystem for one or both of the processes!");
+        return -1;
+    }
+
+    FileDescriptor *f = pSubsystem->getFileDescriptor(sock);
+    if (!f)
+    {
+        SYSCALL_ERROR(BadFileDescriptor);
+        return -1;
+    }
+
+    if (level != SOL_SOCKET)
+    {
+        SYSCALL_ERROR(ProtocolNotAvailable);
+        return -1;
+    }
+
+    if (*optlen < sizeof(int))
+    {
+        SYSCALL_ERROR(InvalidArgument);
+        return -1;
+    }
+
+    Socket *s = 0;
+    if ((f->so_domain == AF_INET) && f->file)
+        s = static_cast<Socket *>(f->file);
+    UdpEndpoint *pUdp = 0;
+    if (s && (s->getProtocol() == NETMAN_TYPE_UDP))
+        pUdp = static_cast<UdpEndpoint *>(s->getEndpoint());
+
+    int value = 0;
+    switch (optname)
+    {
+        case SO_TYPE:
+            value = f->so_type;
+            break;
+
+        case SO_ERROR:
+            /// \todo Pending errors (eg, from a non-blocking connect).
+            value = 0;
+            break;
+
+        case SO_RCVBUF:
+            value = pUdp ? pUdp->getReceiveBufferSize() : UDP_DEFAULT_RCVBUF;
+            break;
+
+        case SO_REUSEPORT:
+            value = pUdp ? pUdp->getReusePort() : 0;
+            break;
+
+        default:
+            SYSCALL_ERROR(ProtocolNotAvailable);
+            return -1;
+    }
+
+    *reinterpret_cast<int *>(optvalue) = value;
+    *optlen = sizeof(int);
+    return 0;
+}
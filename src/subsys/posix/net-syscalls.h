@@ -43,9 +43,19 @@ int posix_accept(int sock, struct sockaddr* address, size_t* addrlen);
 
 int posix_gethostbyaddr(const void* addr, size_t len, int type, void* ent);
 int posix_gethostbyname(const char* name, void* hostinfo, int offset);
+int posix_set_dns_servers(const struct sockaddr_in *servers, size_t count);
 
 int posix_shutdown(int socket, int how);
 
 int posix_getpeername(int socket, struct sockaddr *address, socklen_t *address_len);
 
+int posix_socketpair(int domain, int type, int protocol, int sv[2]);
+ssize_t posix_sendmsg(int sock, const struct msghdr *msg, int flags);
+ssize_t posix_recvmsg(int sock, struct msghdr *msg, int flags);
+int posix_sendmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int posix_recvmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
+
+int posix_setsockopt(int sock, int level, int optname, const void *optvalue, socklen_t optlen);
+int posix_getsockopt(int sock, int level, int optname, void *optvalue, socklen_t *optlen);
+
 #endif
@@ -32,7 +32,6 @@
 #include <processor/Processor.h>
 #include <process/Process.h>
 
-typedef Tree<size_t,FileDescriptor*> FdMap;
 
 int posix_pipe(int filedes[2])
 {
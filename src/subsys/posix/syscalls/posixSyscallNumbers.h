@@ -187,6 +187,23 @@
 
 #define POSIX_REALPATH          126
 
+#define POSIX_IORING_SETUP      127
+#define POSIX_IORING_ENTER      128
+
+#define POSIX_EPOLL_CREATE      129
+#define POSIX_EPOLL_CTL         130
+#define POSIX_EPOLL_WAIT        131
+
+#define POSIX_SOCKETPAIR        132
+#define POSIX_SENDMSG           133
+#define POSIX_RECVMSG           134
+#define POSIX_SETSOCKOPT        135
+#define POSIX_GETSOCKOPT        136
+#define POSIX_SENDMMSG          137
+#define POSIX_RECVMMSG          138
+
+#define POSIX_SET_DNS_SERVERS   139
+
 #define POSIX_PTSNAME           200
 #define POSIX_TTYNAME           201
 #define POSIX_TCSETPGRP         202
@@ -37,6 +37,7 @@
 #include <vfs/File.h>
 #include <vfs/Symlink.h>
 #include <vfs/VFS.h>
+#include <vfs/BootTrace.h>
 #include <panic.h>
 #include <processor/PhysicalMemoryManager.h>
 #include <processor/StackFrame.h>
@@ -1082,7 +1083,11 @@ int pedigree_login(int uid, const char *password)
     if (!pUser) return -1;
 
     if (pUser->login(String(password)))
+    {
+        // First login marks the end of boot for boot tracing.
+        BootTrace::instance().loginComplete();
         return 0;
+    }
     else
         return -1;
 }
@@ -27,19 +27,21 @@
 #include <utilities/StaticString.h>
 #include <panic.h>
 
+class Semaphore;
+
 /** @addtogroup kernel
  * @{ */
 
 #define SHOW_FILE_IN_LOGS 0
 
 #if SHOW_FILE_IN_LOGS
-#define FILE_LOG(level) \
+#define FILE_LOG() \
   do \
   { \
-    Log::instance() << level << __FILE__ << ":" << Dec << __LINE__ << Hex << " " << __FUNCTION__ << " -- "; \
+    Log::instance() << __FILE__ << ":" << Dec << __LINE__ << Hex << " " << __FUNCTION__ << " -- "; \
   } while(0)
 #else
-#define FILE_LOG(level)
+#define FILE_LOG()
 #endif
 
 /** Add a debug item to the log */
@@ -47,20 +49,13 @@
 #define DEBUG_LOG(text) \
   do \
   { \
-    Log::instance().m_Lock.acquire(); \
-    FILE_LOG(Log::Debug); \
-    Log::instance() << Log::Debug << text << Flush; \
-    Log::instance().m_Lock.release(); \
+    Log::instance() << Log::Debug; \
+    FILE_LOG(); \
+    Log::instance() << text << Flush; \
   } \
   while (0)
 
-#define DEBUG_LOG_NOLOCK(text) \
-  do \
-  { \
-    FILE_LOG(Log::Debug); \
-    Log::instance() << Log::Debug << text << Flush; \
-  } \
-  while (0)
+#define DEBUG_LOG_NOLOCK(text) DEBUG_LOG(text)
 #else
 #define DEBUG_LOG(text)
 #define DEBUG_LOG_NOLOCK(text)
@@ -70,62 +65,40 @@
 #define NOTICE(text) \
   do \
   { \
-    Log::instance().m_Lock.acquire(); \
-    FILE_LOG(Log::Notice); \
-    Log::instance() << Log::Notice << text << Flush; \
-    Log::instance().m_Lock.release(); \
+    Log::instance() << Log::Notice; \
+    FILE_LOG(); \
+    Log::instance() << text << Flush; \
   } \
   while (0)
 
-/// \note You use this in the wrong way, you die.
-#define NOTICE_NOLOCK(text) \
-  do \
-  { \
-    FILE_LOG(Log::Notice); \
-    Log::instance() << Log::Notice << text << Flush; \
-  } \
-  while (0)
+/// \note Logging no longer takes a lock, so this is the same as NOTICE.
+#define NOTICE_NOLOCK(text) NOTICE(text)
 
 /** Add a warning message to the log */
 #define WARNING(text) \
   do \
   { \
-    Log::instance().m_Lock.acquire(); \
-    FILE_LOG(Log::Warning); \
-    Log::instance() << Log::Warning << text << Flush; \
-    Log::instance().m_Lock.release(); \
+    Log::instance() << Log::Warning; \
+    FILE_LOG(); \
+    Log::instance() << text << Flush; \
   } \
   while (0)
 
-/// \note You use this in the wrong way, you die.
-#define WARNING_NOLOCK(text) \
-  do \
-  { \
-    FILE_LOG(Log::Warning); \
-    Log::instance() << Log::Warning << text << Flush; \
-  } \
-  while (0)
+/// \note Logging no longer takes a lock, so this is the same as WARNING.
+#define WARNING_NOLOCK(text) WARNING(text)
 
 /** Add a error message to the log */
 #define ERROR(text) \
   do \
   { \
-    Log::instance().m_Lock.acquire(); \
-    FILE_LOG(Log::Error); \
-    Log::instance() << Log::Error << text << Flush; \
-    Log::instance().m_Lock.release(); \
-  } \
-  while (0)
-
-/// \note You use this in the wrong way, you die.
-#define ERROR_NOLOCK(text) \
-  do \
-  { \
-    FILE_LOG(Log::Error); \
-    Log::instance() << Log::Error << text << Flush; \
+    Log::instance() << Log::Error; \
+    FILE_LOG(); \
+    Log::instance() << text << Flush; \
   } \
   while (0)
 
+/// \note Logging no longer takes a lock, so this is the same as ERROR.
+#define ERROR_NOLOCK(text) ERROR(text)
 
 /** Add a fatal message to the log
  *  The panic is just in case the debugger isn't active, or the user returns
@@ -134,38 +107,39 @@
 #define FATAL(text) \
   do \
   { \
-    Log::instance().m_Lock.acquire(); \
-    FILE_LOG(Log::Fatal); \
-    Log::instance() << Log::Fatal << text << Flush; \
+    Log::instance() << Log::Fatal; \
+    FILE_LOG(); \
+    Log::instance() << text << Flush; \
     const char *panicstr = static_cast<const char*>(Log::instance().getLatestEntry().str); \
-    Log::instance().m_Lock.release(); \
     Processor::breakpoint(); \
     panic(panicstr); \
   } \
   while (0)
 
-/// \note You use this in the wrong way, you die.
-#define FATAL_NOLOCK(text) \
-  do \
-  { \
-    FILE_LOG(Log::Fatal); \
-    Log::instance() << Log::Fatal << text << Flush; \
-    Processor::breakpoint(); \
-    panic(static_cast<const char*>(Log::instance().getLatestEntry().str)); \
-  } \
-  while (0)
+/// \note Logging no longer takes a lock, so this is the same as FATAL.
+#define FATAL_NOLOCK(text) FATAL(text)
 
-/** The maximum length of an individual static log entry. */
+/** The maximum length of an individual log entry, once formatted. */
 #define LOG_LENGTH  128
-/** The maximum number of static entries in the log. */
+/** Bytes of (unformatted) arguments an entry can hold. */
+#define LOG_RECORD_DATA 136
+/** The maximum number of entries in the log. */
 #ifdef HUGE_STATIC_LOG
 // 2MB static log buffer
-#define LOG_ENTRIES ((1<<21)/sizeof(LogEntry))
+#define LOG_ENTRIES ((1<<21)/sizeof(LogRecord))
 #else
 // 64K static log buffer
-#define LOG_ENTRIES ((1<<16)/sizeof(LogEntry))
+#define LOG_ENTRIES ((1<<16)/sizeof(LogRecord))
 #endif
 
+/** Processors with their own staging buffers. Any others take turns with
+ *  one more, shared buffer. */
+#define LOG_CPUS    MAX_PROCESSORS
+
+/** Entries a processor can be part way through at once - for when a fault
+ *  or NMI handler logs while an entry is being built. */
+#define LOG_NESTING 4
+
 /** Radix for Log's integer output */
 enum NumberType
 {
@@ -196,7 +170,16 @@ extern BootProgressUpdateFn g_BootProgressUpdate;
  *\brief the kernel's log
  *\note You should use the NOTICE, WARNING, ERROR and FATAL macros to write something
  *      into the log. Direct access to the log should only be needed to retrieve
- *      the entries from the log (within the debugger's log viewer for example). */
+ *      the entries from the log (within the debugger's log viewer for example).
+ *
+ * Writing to the log takes no locks and does no formatting. Each processor
+ * builds its entry in a buffer of its own, as a list of arguments in binary
+ * (numbers are kept as numbers, with their type and radix), and Flush copies
+ * it into a slot of the shared ring, claimed with a single atomic increment.
+ * Entries are only turned into text when something reads them: the debugger,
+ * or the drain thread that passes them to the output callbacks (the serial
+ * port, for one) in the background. Until that thread is running, and for
+ * errors, entries are written out straight away as they always were. */
 class Log
 {
 public:
@@ -222,10 +205,6 @@ public:
     Fatal
   };
 
-  /** The lock
-   *\note this should only be acquired by the NOTICE, WARNING, ERROR and FATAL macros */
-  Spinlock m_Lock;
-
   /** Retrieves the static Log instance.
    *\return instance of the log class */
   inline static Log &instance()
@@ -237,12 +216,20 @@ public:
    /** Initialises the default Log callback (to a serial port) */
   void initialise2();
 
+  /** Starts the thread that writes entries out to the callbacks. Until this
+   *  is called, they are written out as they are logged. */
+  void initialise3();
+
   /** Installs an output callback */
   void installCallback(LogCallback *pCallback, bool bSkipBacklog=false);
 
   /** Removes an output callback */
   void removeCallback(LogCallback *pCallback);
 
+  /** Writes out every entry the callbacks haven't seen yet. Returns without
+   *  doing anything if another context is already doing so. */
+  void drain();
+
   /** Adds an entry to the log.
    *\param[in] str the null-terminated ASCII string that should be added */
   Log &operator<< (const char *str);
@@ -269,13 +256,13 @@ public:
   /** Get the number of static entries in the log.
    *\return the number of static entries in the log */
   inline size_t getStaticEntryCount() const
-    {return m_StaticEntries;}
+    {return (m_Next < LOG_ENTRIES) ? m_Next : LOG_ENTRIES;}
   /** Get the number of dynamic entries in the log
    *\return the number of dynamic entries in the log */
   inline size_t getDynamicEntryCount() const
     {return 0;}
 
-  /** Stores an entry in the log.
+  /** A log entry, formatted.
    *\param[in] T type of the log's text */
   struct LogEntry
   {
@@ -291,22 +278,43 @@ public:
     StaticString<LOG_LENGTH> str;
   };
 
+  /** A log entry as it's kept in the ring, before formatting. */
+  struct LogRecord
+  {
+    /** One more than the entry's position in the log once the record is
+     *  complete, and zero while it's being written. */
+    volatile size_t sequence;
+    /** The time (since boot) that this log entry was added, in ticks. */
+    unsigned int timestamp;
+    /** The severity level of this entry. */
+    SeverityLevel type;
+    /** Bytes of data used. */
+    size_t length;
+    /** The arguments, each a tag byte followed by its value. */
+    uint8_t data[LOG_RECORD_DATA];
+  };
+
   /** Type of a static log entry (no memory-management involved) */
   typedef LogEntry StaticLogEntry;
   typedef LogEntry DynamicLogEntry;
 
-  /** Returns the n'th static log entry, counting from the start. */
-  inline const StaticLogEntry &getStaticEntry(size_t n) const
-    {return m_StaticLog[(m_StaticEntryStart+n) % LOG_ENTRIES];}
+  /** Returns the n'th static log entry, counting from the start. If it was
+   *  overwritten while it was being read, its text is empty. */
+  inline StaticLogEntry getStaticEntry(size_t n) const
+  {
+    LogEntry entry;
+    format(m_Next - getStaticEntryCount() + n, entry);
+    return entry;
+  }
   /** Returns the (n - getStaticEntryCount())'th dynamic log entry */
-  inline const DynamicLogEntry &getDynamicEntry(size_t n) const
-    {return m_StaticLog[0];}
+  inline DynamicLogEntry getDynamicEntry(size_t n) const
+    {return LogEntry();}
 
   bool echoToSerial()
     {return m_EchoToSerial;}
 
-  inline const LogEntry &getLatestEntry() const
-    {return m_StaticLog[m_StaticEntries - 1];}
+  /** Returns the last entry this processor logged. */
+  const LogEntry &getLatestEntry();
 
 private:
   /** Default constructor - does nothing. */
@@ -320,20 +328,104 @@ private:
    *\note NOT implemented */
   Log &operator = (const Log &);
 
-  /** Static buffer of log messages. */
-  StaticLogEntry m_StaticLog[LOG_ENTRIES];
-  /** Dynamic buffer of log messages */
-//  Vector<DynamicLogEntry*> m_DynamicLog;
-  /** Number of entries in the static log */
-  size_t m_StaticEntries;
+  /** An entry being built. */
+  struct Staging
+  {
+    /** Interrupt state to restore once the entry is flushed. */
+    bool bInterrupts;
+    unsigned int timestamp;
+    SeverityLevel type;
+    size_t length;
+    uint8_t data[LOG_RECORD_DATA];
+  };
+
+  /** A processor's state. Only that processor touches it, with interrupts
+   *  disabled, so it needs no lock. */
+  struct PerCpu
+  {
+    /** Entries being built, innermost last. */
+    Staging staging[LOG_NESTING];
+    size_t depth;
+
+    /** The number type mode that we are in. */
+    NumberType numberType;
+
+    /** Position of the last entry flushed, and room to format it. */
+    size_t latest;
+    LogEntry latestEntry;
+  };
+
+  /** The calling processor's state. Interrupts must be disabled, and a
+   *  processor using m_Shared must have claimed it. */
+  PerCpu &cpu();
+
+  /** The calling processor's state, if it has an entry open. */
+  PerCpu *openCpu();
+
+  /** The calling processor's state, waiting for m_Shared if it has to use
+   *  it. Interrupts must be disabled. Processors can claim it again while
+   *  they hold it (for nested entries). */
+  PerCpu &claimCpu();
+
+  /** Lets other processors have m_Shared again if the calling processor
+   *  claimed it and has no entries open. */
+  void releaseCpu(PerCpu &c);
+
+  /** The entry being built on this processor, after starting a Notice if
+   *  there isn't one. Null if entries are nested too deeply to keep. */
+  Staging *staging();
+
+  /** Appends arguments to the entry being built. */
+  void appendString(const char *str, size_t length);
+  void appendNumber(uint8_t type, uint64_t value);
+
+  /** Formats the entry at the given position. Returns false (and leaves an
+   *  empty entry) if it isn't there - not yet complete, or overwritten. */
+  bool format(size_t position, LogEntry &entry) const;
+
+  /** Builds the line passed to callbacks for an entry. */
+  static void decorate(const LogEntry &entry, HugeStaticString &str);
+
+  /** Passes every entry up to m_Next to the callbacks. The caller must own
+   *  m_bDraining. Returns false if it stopped at an entry being written. */
+  bool drainOwned();
+
+  /** Takes m_bDraining, spinning until it's free. */
+  void acquireDrain();
+
+  /** Body of the drain thread: drains whenever Flush wakes it. */
+  static int drainThread(void *);
+
+  /** The ring of entries. */
+  LogRecord m_Ring[LOG_ENTRIES];
+
+  /** Position the next entry will be written to; the number ever logged. */
+  volatile size_t m_Next;
+
+  /** Position of the next entry to pass to the callbacks. */
+  size_t m_Drained;
+
+  /** Set while a context is passing entries to the callbacks (or changing
+   *  the list of them). */
+  volatile bool m_bDraining;
+
+  /** Whether the drain thread is running. */
+  bool m_bDrainThread;
+
+  /** Set while the drain thread is (about to be) waiting on m_pDrainSem,
+   *  cleared by whichever Flush wakes it. */
+  volatile bool m_bDrainWaiting;
+
+  /** The drain thread waits on this for entries to write out. */
+  Semaphore *m_pDrainSem;
 
-  size_t m_StaticEntryStart, m_StaticEntryEnd;
+  PerCpu m_Cpus[LOG_CPUS];
 
-  /** Temporary buffer which gets filled by calls to operator<<, and flushed by << Flush. */
-  StaticLogEntry m_Buffer;
+  /** State for processors without their own, used by one at a time. */
+  PerCpu m_Shared;
 
-  /** The number type mode that we are in. */
-  NumberType m_NumberType;
+  /** One more than the ID of the processor using m_Shared, or zero. */
+  volatile size_t m_SharedOwner;
 
   /** If we should output to serial */
   bool m_EchoToSerial;
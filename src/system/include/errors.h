@@ -56,10 +56,17 @@ namespace Error
     NameTooLong          =91,
     LoopExists           =92,
     OperationNotSupported=95,
+    ConnectionReset      =104,
+    ProtocolWrongType    =107,
+    NotASocket           =108,
+    ProtocolNotAvailable =109,
+    ConnectionRefused    =111,
     TimedOut             =116,
     InProgress           =119,
     Already              =120,
+    MessageTooLong       =122,
     IsConnected          =127,
+    NotConnected         =128,
     NotSupported         =134,
     Unimplemented        =88
   };
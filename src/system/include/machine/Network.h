@@ -32,6 +32,8 @@ extern BootIO bootIO;
 #include <network/IpAddress.h>
 #include <network/MacAddress.h>
 #include <network/NetworkBlockTimeout.h>
+#include <network/NetworkBuffer.h>
+#include <network/Checksum.h>
 
 /** Station information - basically information about this station, per NIC */
 class StationInfo
@@ -43,13 +45,16 @@ class StationInfo
     StationInfo() :
       ipv4(), ipv6(0), nIpv6Addresses(0), subnetMask(), broadcast(0xFFFFFFFF),
       gateway(), gatewayIpv6(IpAddress::IPv6), dnsServers(0), nDnsServers(0),
-      mac(), nPackets(0), nDropped(0), nBad(0)
+      mac(), nPackets(0), nDropped(0), nBad(0), nInterrupts(0),
+      nPacketsPerSecond(0), nInterruptsPerSecond(0)
     {};
     StationInfo(const StationInfo& info) :
       ipv4(info.ipv4), ipv6(info.ipv6), nIpv6Addresses(info.nIpv6Addresses), subnetMask(info.subnetMask),
       broadcast(info.broadcast), gateway(info.gateway), gatewayIpv6(info.gatewayIpv6),
       dnsServers(info.dnsServers), nDnsServers(info.nDnsServers), mac(info.mac),
-      nPackets(info.nPackets), nDropped(info.nDropped), nBad(info.nBad)
+      nPackets(info.nPackets), nDropped(info.nDropped), nBad(info.nBad),
+      nInterrupts(info.nInterrupts), nPacketsPerSecond(info.nPacketsPerSecond),
+      nInterruptsPerSecond(info.nInterruptsPerSecond)
     {};
     virtual ~StationInfo() {};
 
@@ -70,6 +75,10 @@ class StationInfo
     size_t nPackets;    /// Number of packets passed through the interface
     size_t nDropped;    /// Number of packets dropped by the filter
     size_t nBad;        /// Number of packets dropped because they were invalid
+    size_t nInterrupts; /// Number of interrupts the device has raised
+
+    size_t nPacketsPerSecond;     /// Packet rate over the last second or so
+    size_t nInterruptsPerSecond;  /// Interrupt rate over the last second or so
 
     StationInfo& operator = (const StationInfo& info)
     {
@@ -78,18 +87,35 @@ class StationInfo
     }
 };
 
+/// Most frames a device passes up in one poll before other devices get a turn.
+#define NETWORK_POLL_BUDGET 64
+
 /**
  * A network device (sends/receives packets on a network)
+ *
+ * Drivers can have receive interrupts mitigated by polling (along the lines
+ * of Linux's NAPI), so that a flood of packets can't keep the machine in
+ * interrupt handlers: the driver calls enablePolling() once the card is set
+ * up. When a receive interrupt comes in its handler masks further receive
+ * interrupts on the card and calls schedulePoll(). A kernel thread then calls
+ * poll() with a budget, and the driver passes up at most that many frames. If
+ * it runs out of frames first the card is idle, and enableRxInterrupts() is
+ * called - the card must interrupt straight away if frames have arrived since
+ * the last poll. Otherwise the device is polled again once any others waiting
+ * have had a turn.
  */
 class Network : public Device
 {
+  friend class NetworkPoller;
 public:
-  Network() : m_StationInfo()
+  Network() : m_StationInfo(), m_bPollScheduled(false), m_pNextPoll(0),
+    m_RateStart(0), m_RatePackets(0), m_RateInterrupts(0)
   {
     m_SpecificType = "Generic Network Device";
   }
   Network(Network *pDev) :
-    Device(pDev), m_StationInfo()
+    Device(pDev), m_StationInfo(), m_bPollScheduled(false), m_pNextPoll(0),
+    m_RateStart(0), m_RatePackets(0), m_RateInterrupts(0)
   {
   }
   virtual ~Network()
@@ -116,6 +142,23 @@ public:
    * \param buffer A buffer with the packet to send */
   virtual bool send(size_t nBytes, uintptr_t buffer) = 0;
 
+  /** Sends a packet held in a NetworkBuffer. The caller keeps its reference,
+   *  so a driver that needs the packet after returning must clone() it.
+   *  The default gathers the packet into one piece for send() above.
+   * \param pBuffer The packet to send, which may be fragmented. */
+  virtual bool sendBuffer(NetworkBuffer *pBuffer);
+
+  /** Can the device split up TCP packets too big for the link itself (TCP
+   *  segmentation offload)? If so, sendBuffer() is given such packets
+   *  whole: getSegmentSize() is the payload for each segment, the IP header
+   *  is the one for the first, and the TCP checksum field holds the sum of
+   *  the pseudo-header without its length. Otherwise the stack splits them
+   *  up before they get to the driver. */
+  virtual bool canSegment()
+  {
+    return false;
+  }
+
   /** Sets station information (such as IP addresses)
    * \param info The information to set as the station info */
   virtual bool setStationInfo(StationInfo info)
@@ -151,7 +194,8 @@ public:
                                     uint8_t o = 0, uint8_t p = 0
   );
 
-  /** Calculates a checksum */
+  /** Calculates an Internet checksum over one buffer. See Checksum for
+   *  building one up from several pieces. */
   static uint16_t calculateChecksum(uintptr_t buffer, size_t nBytes);
 
   /** Packet statistics */
@@ -161,6 +205,14 @@ public:
   virtual void gotPacket()
   {
     m_StationInfo.nPackets++;
+    updateRates();
+  }
+
+  /// Called by drivers for each interrupt the device raises
+  virtual void gotInterrupt()
+  {
+    m_StationInfo.nInterrupts++;
+    updateRates();
   }
 
   /// Called when a packet is dropped by the system
@@ -176,9 +228,46 @@ public:
     m_StationInfo.nBad++;
   }
 
+  /// Recalculates the packet and interrupt rates, if a second has passed
+  /// since they were last worked out. They're otherwise only updated as
+  /// packets and interrupts come in, so call this before reading them.
+  void updateRates();
+
 protected:
+  /** Starts the poll thread, if it isn't running yet. Called by drivers that
+   *  implement poll() and enableRxInterrupts(), before they enable receive
+   *  interrupts on the card. */
+  void enablePolling();
+
+  /** Queues a poll of this device. Called from interrupt handlers, with the
+   *  card's receive interrupts masked. */
+  void schedulePoll();
+
+  /** Passes up to budget received frames to the stack, and returns the
+   *  number passed up (or dropped). */
+  virtual size_t poll(size_t budget)
+  {
+    return 0;
+  }
+
+  /** Unmasks the card's receive interrupts after a poll found it idle. */
+  virtual void enableRxInterrupts()
+  {
+  }
+
   StationInfo m_StationInfo;
 
+private:
+  /** Is a poll of this device queued (or running)? */
+  volatile bool m_bPollScheduled;
+
+  /** Next device waiting to be polled. */
+  Network *m_pNextPoll;
+
+  /** When the current rate window started (ms), and the counts then. */
+  uint64_t m_RateStart;
+  size_t m_RatePackets;
+  size_t m_RateInterrupts;
 };
 
 #endif
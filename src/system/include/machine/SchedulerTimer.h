@@ -33,6 +33,13 @@ class SchedulerTimer
   public:
     virtual bool registerHandler(TimerHandler *handler) = 0;
 
+    /** Speeds the timer up to interrupt about 'hz' times a second for the
+     *  SampleProfiler, which gets every interrupt while the scheduler still
+     *  gets ticks at its usual rate. Zero puts the timer back to normal.
+     *\return the frequency the timer runs at, or zero if it can't do this */
+    virtual size_t setSampleRate(size_t hz)
+      {return 0;}
+
   protected:
     /** The default constructor */
     inline SchedulerTimer(){}
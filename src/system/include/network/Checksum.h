@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef NETWORK_CHECKSUM_H
+#define NETWORK_CHECKSUM_H
+
+#include <processor/types.h>
+
+class NetworkBuffer;
+
+/**
+ * Incremental Internet checksum (RFC 1071).
+ *
+ * Data can be added in any number of pieces of any length - a pseudo-header
+ * on the stack, then a protocol header, then each fragment of a
+ * NetworkBuffer - and the result is the same as checksumming it all laid out
+ * in one buffer, without ever copying it into one.
+ *
+ * The sum is taken 32 bits at a time into a 64-bit accumulator and only
+ * folded down to 16 bits at the end, which is several times quicker than
+ * adding up 16-bit words.
+ */
+class Checksum
+{
+    public:
+        Checksum() : m_Sum(0), m_bOdd(false)
+        {}
+
+        /** Adds nBytes at pData, following on from whatever came before. */
+        void add(const void *pData, size_t nBytes);
+
+        /** Adds another partial checksum, as if its data followed ours. */
+        void add(const Checksum &other);
+
+        /** Adds nBytes of a NetworkBuffer (across fragments) from offset. */
+        void add(const NetworkBuffer *pBuffer, size_t offset, size_t nBytes);
+
+        /**
+         * Copies nBytes from pSrc to pDest, adding them to the checksum on the
+         * way. Touching the data once rather than twice is worth it wherever
+         * a packet is being copied anyway, such as a payload going into or
+         * coming out of a socket.
+         */
+        void copyAndAdd(void *pDest, const void *pSrc, size_t nBytes);
+
+        /** The finished checksum, ready to go into a header. A packet whose
+         *  checksum field is included gives zero if it's correct. */
+        uint16_t finish() const
+        {
+            return static_cast<uint16_t>(~fold());
+        }
+
+        /** The sum so far, folded into 16 bits but not complemented. */
+        uint16_t fold() const;
+
+        /** Checksums a single buffer in one go. */
+        static uint16_t calculate(const void *pData, size_t nBytes)
+        {
+            Checksum sum;
+            sum.add(pData, nBytes);
+            return sum.finish();
+        }
+
+    private:
+        /** Sums native 16-bit words of nBytes at pData, as though pData were
+         *  at an even offset in the packet. The result isn't folded. */
+        static uint64_t sum(const uint8_t *pData, size_t nBytes);
+
+        /** As sum(), also copying the data to pDest. */
+        static uint64_t copyAndSum(uint8_t *pDest, const uint8_t *pSrc, size_t nBytes);
+
+        /** Adds a piece summed by sum() or copyAndSum(). */
+        void addPiece(uint64_t pieceSum, size_t nBytes);
+
+        /** Folds a 64-bit sum down to 16 bits. */
+        static uint16_t fold(uint64_t sum);
+
+        uint64_t m_Sum;
+
+        /** Has an odd number of bytes been added so far? If so, the next byte
+         *  is the second half of a 16-bit word. */
+        bool m_bOdd;
+};
+
+#endif
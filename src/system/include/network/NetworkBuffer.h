@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef NETWORK_BUFFER_H
+#define NETWORK_BUFFER_H
+
+#include <processor/types.h>
+#include <Atomic.h>
+
+/** Space reserved in front of a packet for headers to be prepended in place:
+    enough for TCP with options, IPv6, Ethernet and a driver framing header. */
+#define NETWORK_BUFFER_HEADROOM     128
+
+/**
+ * A packet, or part of one, on its way through the network stack.
+ *
+ * The bytes live in reference counted storage with free space on either side
+ * of the packet data. Headers are added with push() into the headroom in
+ * front of the data rather than by moving the payload, and stripped with
+ * pull(). clone() gives a second NetworkBuffer on the same storage without
+ * copying, so (for example) a received frame can be handed to an endpoint's
+ * queue as-is.
+ *
+ * Further buffers can be chained on as fragments, for packets that are
+ * gathered from more than one place. Most code only needs isLinear() and
+ * linearise().
+ *
+ * Each NetworkBuffer belongs to exactly one holder, which must release() it
+ * once done; the storage goes back to its owner when the last buffer using it
+ * is released. Storage shared with a clone is copied before it's written by
+ * push() or put(), so clones never see each other's changes.
+ */
+class NetworkBuffer
+{
+    public:
+        /** Returns storage to whoever provided it (eg, a MemoryPool). */
+        typedef void (*ReleaseFunction)(uint8_t *pBase, void *pParam);
+
+        /** Allocates a buffer on the heap able to hold nBytes after the given
+         *  headroom. The returned buffer is empty - use put() to fill it. */
+        static NetworkBuffer *allocate(size_t nBytes, size_t headroom = NETWORK_BUFFER_HEADROOM);
+
+        /**
+         * Wraps existing memory. pRelease (if not null) is called with pBase
+         * and pParam when the last reference goes away; otherwise the memory
+         * stays with the caller, and must outlive the buffer and any clones.
+         * \param capacity Total size of the memory at pBase.
+         * \param headroom Offset of the (empty) packet data within pBase.
+         */
+        static NetworkBuffer *wrap(uint8_t *pBase, size_t capacity, size_t headroom,
+                                   ReleaseFunction pRelease = 0, void *pParam = 0);
+
+        /** Releases this buffer and every fragment chained to it. */
+        void release();
+
+        /** Gives another buffer on the same storage (and clones of each
+         *  fragment) without copying the data. */
+        NetworkBuffer *clone();
+
+        /** Start of the packet data in this fragment. */
+        inline uint8_t *getData() const
+        {
+            return m_pData;
+        }
+
+        /** getData(), for the interfaces which still take a uintptr_t. */
+        inline uintptr_t getBuffer() const
+        {
+            return reinterpret_cast<uintptr_t>(m_pData);
+        }
+
+        /** Length of the packet data in this fragment. */
+        inline size_t getLength() const
+        {
+            return m_Length;
+        }
+
+        /** Length of the packet data in this fragment and all those after. */
+        size_t getTotalLength() const;
+
+        /** Free space in front of the data. */
+        inline size_t getHeadroom() const
+        {
+            return m_pData - m_pStorage->pBase;
+        }
+
+        /** Free space after the data. */
+        inline size_t getTailroom() const
+        {
+            return (m_pStorage->pBase + m_pStorage->capacity) - (m_pData + m_Length);
+        }
+
+        /** Is the storage also used by another buffer? */
+        inline bool isShared() const
+        {
+            return m_pStorage->refs > 1;
+        }
+
+        /**
+         * Adds nBytes to the front of the data, for a header.
+         * \return the new start of the data, or null if the buffer couldn't
+         *         be grown.
+         */
+        uint8_t *push(size_t nBytes);
+
+        /** Removes nBytes from the front of the data.
+         *  \return the new start of the data, or null if it's too short. */
+        uint8_t *pull(size_t nBytes);
+
+        /** Adds nBytes to the end of the data.
+         *  \return where the new bytes go, or null if the buffer couldn't
+         *          be grown. */
+        uint8_t *put(size_t nBytes);
+
+        /** Cuts the packet (including any fragments) down to nBytes. */
+        void trim(size_t nBytes);
+
+        /** Chains pFragment (and its own fragments) onto the end of the
+         *  packet. This buffer takes over the caller's reference. */
+        void append(NetworkBuffer *pFragment);
+
+        /** The fragment after this one, if any. */
+        inline NetworkBuffer *getNextFragment() const
+        {
+            return m_pNext;
+        }
+
+        /** Is all of the packet in this one fragment? */
+        inline bool isLinear() const
+        {
+            return m_pNext == 0;
+        }
+
+        /** Gathers all fragments into this one, so the whole packet is at
+         *  getData(). Returns false if memory couldn't be found for it. */
+        bool linearise();
+
+        /** Copies up to nBytes of the packet, starting offset bytes in, across
+         *  fragment boundaries. Returns the number of bytes copied. */
+        size_t copyOut(size_t offset, void *pDest, size_t nBytes) const;
+
+        /** For a TCP packet too big for the link (one being sent with
+         *  segmentation offload, or several received segments coalesced),
+         *  the payload each segment on the wire carries. Zero otherwise. */
+        inline size_t getSegmentSize() const
+        {
+            return m_SegmentSize;
+        }
+
+        inline void setSegmentSize(size_t nBytes)
+        {
+            m_SegmentSize = nBytes;
+        }
+
+        /** Has the transport checksum already been checked (by the card, or
+         *  when segments were coalesced)? If so it needn't be again, and may
+         *  no longer be valid for the packet as it now stands. */
+        inline bool isChecksumValid() const
+        {
+            return m_bChecksumValid;
+        }
+
+        inline void setChecksumValid(bool bValid)
+        {
+            m_bChecksumValid = bValid;
+        }
+
+    private:
+        /** Memory holding the packet, shared between clones. */
+        struct Storage
+        {
+            Storage() :
+                refs(1), pBase(0), capacity(0), pRelease(0), pParam(0), bHeap(false)
+            {}
+
+            Atomic<size_t> refs;
+            uint8_t *pBase;
+            size_t capacity;
+            ReleaseFunction pRelease;
+            void *pParam;
+            /** Was pBase allocated by us with new[]? */
+            bool bHeap;
+        };
+
+        NetworkBuffer(Storage *pStorage, uint8_t *pData, size_t nBytes);
+        ~NetworkBuffer();
+
+        NetworkBuffer(const NetworkBuffer &);
+        NetworkBuffer &operator = (const NetworkBuffer &);
+
+        /** Creates heap storage for capacity bytes. */
+        static Storage *allocateStorage(size_t capacity);
+
+        /** Drops a reference on the storage, freeing it if it was the last. */
+        static void releaseStorage(Storage *pStorage);
+
+        /** Moves this fragment's data into new private storage with at least
+         *  the given room on either side. */
+        bool reallocate(size_t headroom, size_t tailroom);
+
+        Storage *m_pStorage;
+        uint8_t *m_pData;
+        size_t m_Length;
+
+        NetworkBuffer *m_pNext;
+
+        size_t m_SegmentSize;
+        bool m_bChecksumValid;
+};
+
+#endif
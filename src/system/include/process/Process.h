@@ -227,10 +227,10 @@ public:
         m_pEffectiveGroup = pGroup;
     }
 
-    void setLinker(DynamicLinker *pDl)
-    {
-        m_pDynamicLinker = pDl;
-    }
+    /** Sets the process' linker. Other processes only look at it with the
+     *  Scheduler's process lock held, so once this returns the old linker
+     *  can be deleted. */
+    void setLinker(DynamicLinker *pDl);
     DynamicLinker *getLinker()
     {
         return m_pDynamicLinker;
@@ -28,6 +28,7 @@
 #include <machine/TimerHandler.h>
 #include <process/Mutex.h>
 #include <process/Process.h>
+#include <Spinlock.h>
 #include <Atomic.h>
 
 class Thread;
@@ -77,6 +78,14 @@ public:
     /** Returns the n'th process currently in operation. */
     Process *getProcess(size_t n);
 
+    /** Lock over the process list. While it's held no listed Process can be
+     *  destroyed, or have its linker replaced (see Process::setLinker), so
+     *  it's what to hold while looking at another process. */
+    Spinlock &getProcessLock()
+    {
+        return m_ProcessLock;
+    }
+
     void threadStatusChanged(Thread *pThread);
 
     Process *getKernelProcess() const
@@ -107,6 +116,9 @@ private:
     /** The next available process ID. */
     Atomic<size_t> m_NextPid;
 
+    /** Guards m_Processes against being changed. */
+    Spinlock m_ProcessLock;
+
     /** Map of processor->thread mappings, for load-balance accounting. */
     Tree<PerProcessorScheduler*, List<Thread*>*> m_PTMap;
 
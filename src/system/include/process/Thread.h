@@ -221,7 +221,7 @@ public:
     void *getKernelStack();
 
     /** Returns the Thread's ID. */
-    size_t getId()
+    size_t getId() __attribute__((no_instrument_function))
     {return m_Id;}
 
     /** Returns the last error that occurred (errno). */
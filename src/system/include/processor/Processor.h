@@ -261,16 +261,21 @@ class Processor
     /** Get the ProcessorId of this processor
      *\return the ProcessorId of this processor */
     #if !defined(MULTIPROCESSOR)
-      inline static ProcessorId id();
+      inline static ProcessorId id() __attribute__((no_instrument_function));
     #else
-      static ProcessorId id();
+      static ProcessorId id() __attribute__((no_instrument_function));
     #endif
+    /** Get the number of processors in the system */
+    static size_t getCount()
+    {
+      return m_nProcessors;
+    }
     /** Get the ProcessorInformation structure of this processor
      *\return the ProcessorInformation structure of this processor */
     #if !defined(MULTIPROCESSOR)
-      static inline ProcessorInformation &information();
+      static inline ProcessorInformation &information() __attribute__((no_instrument_function));
     #else
-      static ProcessorInformation &information();
+      static ProcessorInformation &information() __attribute__((no_instrument_function));
     #endif
 
     #ifdef PPC_COMMON
@@ -103,6 +103,14 @@ typedef PROCESSOR_SPECIFIC_NAME(size_t) size_t;
   #error PAGE_SIZE not defined
 #endif
 
+/** Processors that per-processor state (log staging, trace and profile
+ *  buffers and the like) is kept for. Any others share, or go without. */
+#if defined(MULTIPROCESSOR)
+  #define MAX_PROCESSORS 16
+#else
+  #define MAX_PROCESSORS 1
+#endif
+
 /** @} */
 
 #undef PROCESSOR_SPECIFIC_NAME
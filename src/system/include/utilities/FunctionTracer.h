@@ -0,0 +1,135 @@
+/*
+ * 
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef KERNEL_UTILITIES_FUNCTIONTRACER_H
+#define KERNEL_UTILITIES_FUNCTIONTRACER_H
+
+#include <processor/types.h>
+
+/** @addtogroup kernelutilities
+ * @{ */
+
+/// Processors with a ring of their own. Any others share the last one.
+#define FTRACE_CPUS     MAX_PROCESSORS
+
+/// Events each processor's ring holds before it wraps around.
+#define FTRACE_RECORDS  8192
+
+/// Most distinct functions named in a dump; others are left as addresses.
+#define FTRACE_SYMBOLS  4096
+
+/** Records function entries and exits for kernels built with
+ *  -finstrument-functions (the function_tracing build option).
+ *
+ *  Each event goes into a ring for the processor it happened on, which
+ *  keeps only the most recent FTRACE_RECORDS events. Tracing is off until
+ *  it's switched on (the debugger's "ftrace" command does that), and the
+ *  rings are dumped in binary to the second serial line, with the names of
+ *  the functions in them looked up through KernelElf. scripts/functiontrace.py
+ *  turns a dump into folded stacks for flame graphs, or Chrome trace JSON.
+ *
+ *  The dump is a series of fields, each starting with a type byte:
+ *   'H': magic (FTRACE_MAGIC), version and pointer size (uint32_t each),
+ *        then the timestamp and tick count (ms) from when tracing was
+ *        switched on and when the dump was made (uint64_t each), so
+ *        timestamps can be converted to time.
+ *   'S': an address (pointer-sized), a uint16_t length and a symbol name.
+ *   'C': a processor and a count of events (uint32_t each), then that many
+ *        events, oldest first: timestamp (uint64_t), function and call site
+ *        (pointer-sized), thread (uint32_t), processor (uint16_t) and type
+ *        (uint8_t, 'E' or 'X') plus a padding byte.
+ *   'Z': the end of the dump.
+ *  Everything is in the machine's byte order. */
+class FunctionTracer
+{
+  public:
+    enum EventType
+    {
+      Entry = 'E',
+      Exit = 'X'
+    };
+
+    /** An event, as it's kept in a ring. */
+    struct Record
+    {
+      uint64_t timestamp;
+      uintptr_t function;
+      uintptr_t callSite;
+      uint32_t thread;
+      uint16_t cpu;
+      uint8_t type;
+      uint8_t pad;
+    };
+
+    __attribute__((no_instrument_function))
+    inline static FunctionTracer &instance()
+    {
+      return m_Instance;
+    }
+
+    /** Is tracing built in to this kernel? */
+    static bool isAvailable();
+
+    /** Starts recording events. Returns false if tracing isn't built in. */
+    bool enable();
+
+    /** Stops recording events. What's been recorded is kept. */
+    void disable();
+
+    bool isEnabled() const
+    {
+      return m_bEnabled;
+    }
+
+    /** Throws away everything recorded. Tracing must be disabled. */
+    void clear();
+
+    /** Number of events recorded on a processor (including those since
+     *  overwritten). */
+    size_t getCount(size_t cpu) const;
+
+    /** Writes the rings out to the second serial line. Tracing must be
+     *  disabled. Returns false if there's no second serial line. */
+    bool dump();
+
+    /** Called by the instrumentation hooks. */
+    void record(EventType type, void *function, void *callSite)
+      __attribute__((no_instrument_function));
+
+  private:
+    FunctionTracer();
+    FunctionTracer(const FunctionTracer &);
+    FunctionTracer &operator = (const FunctionTracer &);
+
+    volatile bool m_bEnabled;
+
+    /** Timestamp and tick count when tracing was last switched on. */
+    uint64_t m_StartTimestamp;
+    uint64_t m_StartTicks;
+
+    static FunctionTracer m_Instance;
+};
+
+/// Magic number at the start of a dump ("PFTR").
+#define FTRACE_MAGIC    0x50465452
+
+/** @} */
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef KERNEL_UTILITIES_LZ4_H
+#define KERNEL_UTILITIES_LZ4_H
+
+#include <processor/types.h>
+
+/** @addtogroup kernelutilities
+ * @{ */
+
+/**
+ * Decoder for the LZ4 frame format (as written by the lz4 command line tool).
+ *
+ * Blocks are decoded one at a time straight into the output buffer, so the
+ * only memory needed is the output itself. Checksums are skipped rather than
+ * verified; every read and write is bounds checked instead.
+ */
+class Lz4Frame
+{
+    public:
+        /** Does the given buffer start with an LZ4 frame? */
+        static bool isFrame(const uint8_t *pIn, size_t inLen);
+
+        /**
+         * Returns the size of the decompressed data. This is read from the
+         * frame header if present, otherwise the frame is walked (without
+         * writing anything) to find out.
+         * \return the size, or ~0 if the frame is malformed.
+         */
+        static size_t getDecompressedSize(const uint8_t *pIn, size_t inLen);
+
+        /**
+         * Decompresses a frame.
+         * \param pOut Output buffer, or null to only count the output size.
+         * \return bytes produced, or ~0 if the frame is malformed or doesn't
+         *         fit in outLen bytes.
+         */
+        static size_t decompress(const uint8_t *pIn, size_t inLen, uint8_t *pOut, size_t outLen);
+
+    private:
+        Lz4Frame();
+
+        /** Decodes a single compressed block. Returns bytes written or ~0. */
+        static size_t decompressBlock(const uint8_t *pIn, size_t inLen,
+                                      uint8_t *pOutBase, size_t outOffset, size_t outLen);
+};
+
+/** @} */
+
+#endif
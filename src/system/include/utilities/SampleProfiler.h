@@ -0,0 +1,130 @@
+/*
+ * 
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef KERNEL_UTILITIES_SAMPLEPROFILER_H
+#define KERNEL_UTILITIES_SAMPLEPROFILER_H
+
+#include <processor/types.h>
+#include <processor/state.h>
+
+/** @addtogroup kernelutilities
+ * @{ */
+
+/// Processors with a buffer of their own. Any others share the last one.
+#define PROFILE_CPUS        MAX_PROCESSORS
+
+/// Samples each processor's buffer holds before it wraps around.
+#define PROFILE_SAMPLES     4096
+
+/// Addresses kept for each sample: where it was taken, and the return
+/// addresses of the frames above it.
+#define PROFILE_DEPTH       8
+
+/// Sampling frequency (Hz) when none is given.
+#define PROFILE_DEFAULT_HZ  1000
+
+/** A statistical profiler. While it's running, the scheduler timer is sped
+ *  up (see SchedulerTimer::setSampleRate) and every tick records where the
+ *  processor was - the instruction pointer and a short call stack found by
+ *  following frame pointers - along with the thread and process, in a
+ *  buffer for that processor. Samples are taken in user code as well as in
+ *  the kernel.
+ *
+ *  Each buffer keeps the most recent PROFILE_SAMPLES samples. They can be
+ *  read out while the profiler is running; a sample that's overwritten
+ *  while it's being copied is skipped. /dev/profile turns them into text
+ *  in the format of "perf script", so the usual tools (stackcollapse-perf.pl
+ *  and friends) work on it directly. */
+class SampleProfiler
+{
+  public:
+    /** A sample, as it's kept in a buffer. */
+    struct Sample
+    {
+      /** Tick count (ms) when it was taken. */
+      uint64_t timestamp;
+      /** frames[0] is the instruction pointer, the rest return addresses. */
+      uintptr_t frames[PROFILE_DEPTH];
+      uint32_t thread;
+      uint32_t process;
+      uint16_t cpu;
+      uint8_t depth;
+      /** Taken in user mode, so the addresses are in the process' space. */
+      uint8_t bUser;
+    };
+
+    inline static SampleProfiler &instance()
+    {
+      return m_Instance;
+    }
+
+    /** Starts taking samples about 'hz' times a second on each processor
+     *  (clearing the buffers first), or changes the frequency if it's
+     *  already running. Returns false if the scheduler timer can't be used
+     *  for sampling. */
+    bool start(size_t hz = PROFILE_DEFAULT_HZ);
+
+    /** Stops taking samples. What's been taken is kept. */
+    void stop();
+
+    bool isRunning() const
+    {
+      return m_bRunning;
+    }
+
+    /** The frequency the timer actually runs at while sampling, which is
+     *  the requested one rounded to a multiple of the scheduler's. */
+    size_t getFrequency() const
+    {
+      return m_Frequency;
+    }
+
+    /** Throws away every sample. */
+    void clear();
+
+    /** Number of samples ever taken on a processor (including those since
+     *  overwritten). Samples still held are numbered from
+     *  getFirst(cpu) up to (but not including) this. */
+    size_t getCount(size_t cpu) const;
+
+    /** Number of the oldest sample still held for a processor. */
+    size_t getFirst(size_t cpu) const;
+
+    /** Copies out sample n of a processor. Returns false if it's been
+     *  overwritten (or hasn't been taken yet). */
+    bool getSample(size_t cpu, size_t n, Sample &sample) const;
+
+    /** Called by the scheduler timer, from its interrupt handler. */
+    void sample(InterruptState &state);
+
+  private:
+    SampleProfiler();
+    SampleProfiler(const SampleProfiler &);
+    SampleProfiler &operator = (const SampleProfiler &);
+
+    volatile bool m_bRunning;
+    size_t m_Frequency;
+
+    static SampleProfiler m_Instance;
+};
+
+/** @} */
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef KERNEL_UTILITIES_TIMERWHEEL_H
+#define KERNEL_UTILITIES_TIMERWHEEL_H
+
+#include <processor/types.h>
+#include <Spinlock.h>
+
+/** @addtogroup kernelutilities
+ * @{ */
+
+/// Slots in each level of a TimerWheel, as a power of two.
+#define TIMERWHEEL_SLOT_BITS  6
+#define TIMERWHEEL_SLOTS      (1 << TIMERWHEEL_SLOT_BITS)
+
+/// Levels in a TimerWheel. With 10ms ticks the last level reaches out to
+/// about 46 hours; anything further away is clamped to that.
+#define TIMERWHEEL_LEVELS     4
+
+/** A hierarchical timing wheel, for subsystems that keep large numbers of
+ *  timeouts that are mostly cancelled or pushed back before they fire
+ *  (network protocols, for example).
+ *
+ *  Scheduling and cancelling are O(1). Timers due within the first level's
+ *  range sit in a slot for their exact tick; later ones sit in a coarser slot
+ *  on a higher level, and cascade down a level each time the level below
+ *  wraps around. The owner calls tick() from a TimerHandler, and everything
+ *  that has expired since the last call is run as one batch, so the cost of a
+ *  tick doesn't depend on how many timers are waiting.
+ *
+ *  Callbacks run from tick() - in interrupt context if that's where tick()
+ *  is called from - without the wheel's lock held, so they can reschedule or
+ *  cancel timers, including their own. */
+class TimerWheel
+{
+  public:
+    /** A timer. Subclass and implement expired(). */
+    class Entry
+    {
+        friend class TimerWheel;
+      public:
+        Entry() : m_pPrev(0), m_pNext(0), m_pSlot(0), m_Expires(0)
+        {}
+        virtual ~Entry()
+        {}
+
+        /** Called when the timer expires. It's no longer pending by then. */
+        virtual void expired() = 0;
+
+        /** Is the timer scheduled (or expired, but yet to run)? */
+        bool isPending() const
+        {
+            return m_pSlot != 0;
+        }
+
+      private:
+        Entry(const Entry &);
+        Entry &operator = (const Entry &);
+
+        Entry *m_pPrev;
+        Entry *m_pNext;
+
+        /** The list the entry is on, or null if it isn't pending. */
+        Entry **m_pSlot;
+
+        /** The tick the entry is due on. */
+        uint64_t m_Expires;
+    };
+
+    /** \param tickLength Granularity of the wheel, in milliseconds. */
+    TimerWheel(uint32_t tickLength = 10);
+    ~TimerWheel();
+
+    /** Schedules pEntry to expire in (at least) the given number of
+     *  milliseconds, moving it if it's already pending. */
+    void schedule(Entry *pEntry, uint64_t milliseconds);
+
+    /** Stops pEntry from expiring. Returns true if it was pending.
+     *  \note The callback may still be running on another CPU when this
+     *        returns - use cancelAndWait before freeing the entry. */
+    bool cancel(Entry *pEntry);
+
+    /** Stops pEntry from expiring, and waits for its callback to finish if
+     *  it's running on another CPU. Must not be called from the callback. */
+    void cancelAndWait(Entry *pEntry);
+
+    /** Advances the wheel and runs the callbacks of everything that expired.
+     *  \param delta Nanoseconds since the last call. */
+    void tick(uint64_t delta);
+
+    /** Number of pending timers. */
+    size_t count() const
+    {
+        return m_nEntries;
+    }
+
+  private:
+    TimerWheel(const TimerWheel &);
+    TimerWheel &operator = (const TimerWheel &);
+
+    /** Puts pEntry in the slot for its expiry tick. Lock must be held. */
+    void add(Entry *pEntry);
+
+    /** Takes pEntry off whichever list it's on. Lock must be held. */
+    void remove(Entry *pEntry);
+
+    /** Pushes pEntry onto the front of a list. Lock must be held. */
+    static void link(Entry **pSlot, Entry *pEntry);
+
+    /** Redistributes one slot of a level into the levels below it, and
+     *  returns the slot's index. Lock must be held. */
+    size_t cascade(size_t level);
+
+    /** Length of a tick in nanoseconds. */
+    uint64_t m_TickLength;
+
+    /** Nanoseconds since the wheel last advanced. */
+    uint64_t m_Nanoseconds;
+
+    /** The next tick to process. */
+    uint64_t m_Now;
+
+    Entry *m_pSlots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+
+    /** Entries that have expired and are waiting for their callbacks. */
+    Entry *m_pExpired;
+
+    /** Entry whose callback is running, if any. */
+    Entry * volatile m_pRunning;
+
+    size_t m_nEntries;
+
+    Spinlock m_Lock;
+};
+
+/** @} */
+
+#endif
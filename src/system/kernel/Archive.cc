@@ -22,11 +22,12 @@
 #include <processor/PhysicalMemoryManager.h>
 #include <processor/VirtualAddressSpace.h>
 #include <utilities/StaticString.h>
+#include <utilities/Lz4.h>
 #include <panic.h>
 #include <Log.h>
 
 Archive::Archive(uint8_t *pPhys, size_t sSize) :
-  m_Region("Archive")
+  m_Region("Archive"), m_Size(sSize), m_pEntries(0), m_nEntries(0)
 {
 
   if ((reinterpret_cast<physical_uintptr_t>(pPhys) & (PhysicalMemoryManager::getPageSize() - 1)) != 0)
@@ -40,62 +41,115 @@ Archive::Archive(uint8_t *pPhys, size_t sSize) :
       == false)
   {
     ERROR("Archive: allocateRegion failed.");
+    return;
+  }
+
+  // Index the archive once, rather than walking the headers from the start
+  // every time a member is requested.
+  size_t nFiles = 0;
+  for (File *pFile = getFirst(); pFile; pFile = getNext(pFile))
+    nFiles++;
+
+  m_pEntries = new Entry[nFiles];
+  for (File *pFile = getFirst(); pFile; pFile = getNext(pFile))
+  {
+    Entry *pEntry = &m_pEntries[m_nEntries++];
+    pEntry->pHeader = pFile;
+    pEntry->storedSize = getHeaderSize(pFile);
+    pEntry->size = pEntry->storedSize;
+    pEntry->bCompressed = false;
+    pEntry->pData = adjust_pointer(reinterpret_cast<uint8_t*>(pFile), 512);
+
+    if (Lz4Frame::isFrame(pEntry->pData, pEntry->storedSize))
+    {
+      size_t size = Lz4Frame::getDecompressedSize(pEntry->pData, pEntry->storedSize);
+      if (size == static_cast<size_t>(~0))
+        ERROR("Archive: " << pFile->name << " is a malformed LZ4 frame.");
+      else
+      {
+        pEntry->size = size;
+        pEntry->bCompressed = true;
+      }
+    }
   }
 }
 
 Archive::~Archive()
 {
+  for (size_t i = 0; i < m_nEntries; i++)
+  {
+    // Only decompressed members were allocated - the rest point into m_Region.
+    if (m_pEntries[i].bCompressed && m_pEntries[i].pData)
+      delete [] m_pEntries[i].pData;
+  }
+  delete [] m_pEntries;
+
   m_Region.free();
 }
 
 size_t Archive::getNumFiles()
 {
-  size_t i = 0;
-  File *pFile = getFirst();
-  while (pFile != 0)
-  {
-    i++;
-    pFile = getNext(pFile);
-  }
-  return i;
+  return m_nEntries;
 }
 
 size_t Archive::getFileSize(size_t n)
 {
-  File *pFile = get(n);
-  NormalStaticString str(pFile->size);
-  return str.intValue(8); // Octal
+  return m_pEntries[n].size;
 }
 
 char *Archive::getFileName(size_t n)
 {
-  return get(n)->name;
+  return m_pEntries[n].pHeader->name;
 }
 
 uintptr_t *Archive::getFile(size_t n)
 {
-  return reinterpret_cast<uintptr_t*>(reinterpret_cast<uintptr_t>(get(n)) + 512);
+  Entry *pEntry = &m_pEntries[n];
+  if (!pEntry->bCompressed)
+    return reinterpret_cast<uintptr_t*>(pEntry->pData);
+
+  if (!pEntry->pData)
+  {
+    uint8_t *pCompressed = adjust_pointer(reinterpret_cast<uint8_t*>(pEntry->pHeader), 512);
+    uint8_t *pData = new uint8_t[pEntry->size];
+    if (Lz4Frame::decompress(pCompressed, pEntry->storedSize, pData, pEntry->size) != pEntry->size)
+    {
+      ERROR("Archive: failed to decompress " << pEntry->pHeader->name << ".");
+      delete [] pData;
+      return 0;
+    }
+
+    pEntry->pData = pData;
+  }
+
+  return reinterpret_cast<uintptr_t*>(pEntry->pData);
 }
 
 Archive::File *Archive::getFirst()
 {
-  return reinterpret_cast<File*> (m_Region.virtualAddress());
+  File *pFile = reinterpret_cast<File*> (m_Region.virtualAddress());
+  if (!pFile || m_Size < 512 || pFile->name[0] == '\0')
+    return 0;
+  return pFile;
 }
 
 Archive::File *Archive::getNext(File *pFile)
 {
-  NormalStaticString str(pFile->size);
-  size_t size = str.intValue(8); // Octal.
+  size_t size = getHeaderSize(pFile);
   size_t nBlocks = (size + 511) / 512;
   pFile = adjust_pointer(pFile, 512 * (nBlocks + 1));
+
+  // Don't walk off the end of an archive without end-of-archive blocks.
+  uintptr_t offset = reinterpret_cast<uintptr_t>(pFile) - reinterpret_cast<uintptr_t>(m_Region.virtualAddress());
+  if ((offset + 512) > m_Size)
+    return 0;
+
   if (pFile->name[0] == '\0')return 0;
   return pFile;
 }
 
-Archive::File *Archive::get(size_t n)
+size_t Archive::getHeaderSize(File *pFile)
 {
-  File *pFile = getFirst();
-  for (size_t i = 0;i < n;i++)
-    pFile = getNext(pFile);
-  return pFile;
+  NormalStaticString str(pFile->size);
+  return str.intValue(8); // Octal.
 }
@@ -23,9 +23,14 @@
 
 #include <processor/types.h>
 #include <processor/MemoryRegion.h>
+#include <utilities/utility.h>
 
 /**
  * This class provides functions for extracting an archive file as made by UNIX Tar.
+ *
+ * The headers are walked once, on construction, to build an index of members.
+ * Members may individually be LZ4 frames, in which case
+ * they are decompressed the first time they are requested.
  */
 class Archive
 {
@@ -34,7 +39,7 @@ public:
   /** Constructor; takes the physical address of a Tar archive. */
   Archive(uint8_t *pPhys, size_t sSize);
   /** Destructor; returns the physical memory used during construction to the
-   *  physical memory pool. */
+   *  physical memory pool, and frees any decompressed members. */
   ~Archive();
 
   /** Returns the number of files in the archive. */
@@ -53,6 +58,9 @@ public:
   uintptr_t *getFile(size_t n);
 
 private:
+  Archive(const Archive &);
+  Archive &operator = (const Archive &);
+
   struct File
   {
     char name[100];         // Filename.
@@ -66,11 +74,30 @@ private:
     char linkname[100];     // Linked-to file name.
   };
 
+  /** An indexed member. */
+  struct Entry
+  {
+    File *pHeader;
+    /** Size of the member as stored in the archive. */
+    size_t storedSize;
+    /** Size once decompressed (equal to storedSize if not compressed). */
+    size_t size;
+    bool bCompressed;
+    /** Decompressed contents, allocated on first use. */
+    uint8_t *pData;
+  };
+
   File *getFirst();
   File *getNext(File *pFile);
-  File *get(size_t n);
+
+  /** Parses the octal size field of a header. */
+  static size_t getHeaderSize(File *pFile);
 
   MemoryRegion m_Region;
+  size_t m_Size;
+
+  Entry *m_pEntries;
+  size_t m_nEntries;
 };
 
 #endif
@@ -26,6 +26,10 @@
 #include <utilities/utility.h>
 #include <processor/Processor.h>
 #include <LockGuard.h>
+#ifdef THREADS
+#include <process/Thread.h>
+#include <process/Semaphore.h>
+#endif
 
 extern BootstrapStruct_t *g_pBootstrapInfo;
 
@@ -60,19 +64,59 @@ class SerialLogger : public Log::LogCallback
 
 static SerialLogger g_SerialCallback;
 
+/** Tags for the arguments of an entry. The low nibble is the type, and for
+ *  numbers the high nibble is the NumberType to format it in. */
+enum LogTag
+{
+    TagString = 0,
+    TagChar,
+    TagUnsignedChar,
+    TagShort,
+    TagUnsignedShort,
+    TagInt,
+    TagUnsignedInt,
+    TagLong,
+    TagUnsignedLong,
+    TagLongLong,
+    TagUnsignedLongLong
+};
+
+static inline uint8_t tagOf(char) {return TagChar;}
+static inline uint8_t tagOf(unsigned char) {return TagUnsignedChar;}
+static inline uint8_t tagOf(short) {return TagShort;}
+static inline uint8_t tagOf(unsigned short) {return TagUnsignedShort;}
+static inline uint8_t tagOf(int) {return TagInt;}
+static inline uint8_t tagOf(unsigned int) {return TagUnsignedInt;}
+static inline uint8_t tagOf(long) {return TagLong;}
+static inline uint8_t tagOf(unsigned long) {return TagUnsignedLong;}
+static inline uint8_t tagOf(long long) {return TagLongLong;}
+static inline uint8_t tagOf(unsigned long long) {return TagUnsignedLongLong;}
+
 Log::Log () :
-    m_Lock(),
-    m_StaticEntries(0),
-    m_StaticEntryStart(0),
-    m_StaticEntryEnd(0),
-    m_Buffer(),
-    m_NumberType(Dec),
+    m_Next(0),
+    m_Drained(0),
+    m_bDraining(false),
+    m_bDrainThread(false),
+    m_bDrainWaiting(false),
+    m_pDrainSem(0),
+    m_SharedOwner(0),
     #ifdef DONT_LOG_TO_SERIAL
     m_EchoToSerial(false)
     #else
     m_EchoToSerial(true)
     #endif
 {
+    for (size_t i = 0; i < LOG_ENTRIES; i++)
+        m_Ring[i].sequence = 0;
+    for (size_t i = 0; i < LOG_CPUS; i++)
+    {
+        m_Cpus[i].depth = 0;
+        m_Cpus[i].numberType = Dec;
+        m_Cpus[i].latest = 0;
+    }
+    m_Shared.depth = 0;
+    m_Shared.numberType = Dec;
+    m_Shared.latest = 0;
 }
 
 Log::~Log ()
@@ -112,66 +156,76 @@ void Log::initialise2()
         installCallback(&g_SerialCallback, false);
 }
 
-void Log::installCallback(LogCallback *pCallback, bool bSkipBacklog)
+#ifdef THREADS
+int Log::drainThread(void *)
 {
+    Log &log = Log::instance();
+    while(true)
     {
-        LockGuard<Spinlock> guard(m_Lock);
-        m_OutputCallbacks.pushBack(pCallback);
+        log.drain();
+
+        // Flush wakes us once it sees this. Look again afterwards, in case
+        // an entry came in before it could have.
+        log.m_bDrainWaiting = true;
+        __sync_synchronize();
+        if(log.m_Drained != log.m_Next)
+        {
+            log.m_bDrainWaiting = false;
+            continue;
+        }
+
+        log.m_pDrainSem->acquire();
     }
 
-    // Some callbacks want to skip a (potentially) massive backlog
-    if(bSkipBacklog)
-        return;
+    return 0;
+}
+#endif
+
+void Log::initialise3()
+{
+#ifdef THREADS
+    m_pDrainSem = new Semaphore(0);
 
-    // Call the callback for the existing, flushed, log entries
-    size_t entry = m_StaticEntryStart;
-    while(1)
+    Thread *pThread = new Thread(Processor::information().getCurrentThread()->getParent(), &drainThread, 0, 0);
+    pThread->detach();
+
+    m_bDrainThread = true;
+#endif
+}
+
+void Log::installCallback(LogCallback *pCallback, bool bSkipBacklog)
+{
+    acquireDrain();
+
+    m_OutputCallbacks.pushBack(pCallback);
+
+    // Some callbacks want to skip a (potentially) massive backlog. Entries
+    // the other callbacks haven't seen yet aren't backlog, and will reach
+    // this one when they're drained.
+    if(!bSkipBacklog)
     {
-        if(entry == m_StaticEntryEnd)
-            break;
-        else
+        size_t entry = (m_Drained > LOG_ENTRIES) ? (m_Drained - LOG_ENTRIES) : 0;
+        for(; entry != m_Drained; entry++)
         {
+            LogEntry logEntry;
+            if(!format(entry, logEntry))
+                continue;
+
             HugeStaticString str;
-            switch(m_StaticLog[entry].type)
-            {
-                case Debug:
-                    str = "(DD) ";
-                    break;
-                case Notice:
-                    str = "(NN) ";
-                    break;
-                case Warning:
-                    str = "(WW) ";
-                    break;
-                case Error:
-                    str = "(EE) ";
-                    break;
-                case Fatal:
-                    str = "(FF) ";
-                    break;
-                default:
-                    str = "(XX) ";
-                    break;
-            }
-            str += m_StaticLog[entry].str;
-#ifndef SERIAL_IS_FILE
-            str += "\r\n"; // Handle carriage return
-#else
-            str += "\n";
-#endif
+            decorate(logEntry, str);
 
             /// \note This could send a massive batch of log entries on the
             ///       callback. If the callback isn't designed to handle big
             ///       buffers this may fail.
             pCallback->callback(str);
         }
-
-        entry = (entry + 1) % LOG_ENTRIES;
     }
+
+    m_bDraining = false;
 }
 void Log::removeCallback(LogCallback *pCallback)
 {
-    LockGuard<Spinlock> guard(m_Lock);
+    acquireDrain();
     for(List<LogCallback*>::Iterator it = m_OutputCallbacks.begin();
         it != m_OutputCallbacks.end();
         it++)
@@ -179,20 +233,331 @@ void Log::removeCallback(LogCallback *pCallback)
         if(*it == pCallback)
         {
             m_OutputCallbacks.erase(it);
+            break;
+        }
+    }
+    m_bDraining = false;
+}
+
+void Log::acquireDrain()
+{
+    while(!__sync_bool_compare_and_swap(&m_bDraining, false, true))
+        Processor::pause();
+}
+
+void Log::drain()
+{
+    while(true)
+    {
+        if(!__sync_bool_compare_and_swap(&m_bDraining, false, true))
             return;
+
+        bool bComplete = drainOwned();
+
+        m_bDraining = false;
+        __sync_synchronize();
+
+        // Whoever flushed an entry while we were busy left it to us.
+        if(!bComplete || (m_Drained == m_Next))
+            return;
+    }
+}
+
+bool Log::drainOwned()
+{
+    size_t nLost = 0;
+    bool bComplete = true;
+
+    while(m_Drained != m_Next)
+    {
+        size_t next = m_Next;
+        if((next - m_Drained) > LOG_ENTRIES)
+        {
+            nLost += next - LOG_ENTRIES - m_Drained;
+            m_Drained = next - LOG_ENTRIES;
+        }
+
+        LogEntry entry;
+        if(!format(m_Drained, entry))
+        {
+            // Overwritten just now, so it'll be counted as lost next time
+            // around, or it's still being written and we'll be back for it.
+            if((m_Next - m_Drained) > LOG_ENTRIES)
+                continue;
+            bComplete = false;
+            break;
+        }
+        ++m_Drained;
+
+        HugeStaticString str;
+        if(nLost)
+        {
+            str = "(WW) Log: ";
+            str.append(nLost);
+            str += " entries were overwritten before they could be written out";
+#ifndef SERIAL_IS_FILE
+            str += "\r\n";
+#else
+            str += "\n";
+#endif
+            for(List<LogCallback*>::Iterator it = m_OutputCallbacks.begin();
+                it != m_OutputCallbacks.end();
+                ++it)
+            {
+                if(*it)
+                    (*it)->callback(static_cast<const char*>(str));
+            }
+            nLost = 0;
+        }
+
+        decorate(entry, str);
+        for(List<LogCallback*>::Iterator it = m_OutputCallbacks.begin();
+            it != m_OutputCallbacks.end();
+            ++it)
+        {
+            if(*it)
+                (*it)->callback(static_cast<const char*>(str));
+        }
+    }
+
+    return bComplete;
+}
+
+void Log::decorate(const LogEntry &entry, HugeStaticString &str)
+{
+    switch(entry.type)
+    {
+        case Debug:
+            str = "(DD) ";
+            break;
+        case Notice:
+            str = "(NN) ";
+            break;
+        case Warning:
+            str = "(WW) ";
+            break;
+        case Error:
+            str = "(EE) ";
+            break;
+        case Fatal:
+            str = "(FF) ";
+            break;
+        default:
+            str = "(XX) ";
+            break;
+    }
+    str += entry.str;
+#ifndef SERIAL_IS_FILE
+    str += "\r\n"; // Handle carriage return
+#else
+    str += "\n";
+#endif
+}
+
+bool Log::format(size_t position, LogEntry &entry) const
+{
+    const LogRecord &slot = m_Ring[position % LOG_ENTRIES];
+    if(slot.sequence != position + 1)
+        return false;
+
+    // Don't let the copy be done before the check.
+    __sync_synchronize();
+
+    // Take a copy, and make sure it wasn't being overwritten while we did.
+    uint8_t data[LOG_RECORD_DATA];
+    size_t length = slot.length;
+    if(length > LOG_RECORD_DATA)
+        length = LOG_RECORD_DATA;
+    memcpy(data, slot.data, length);
+    unsigned int timestamp = slot.timestamp;
+    SeverityLevel type = slot.type;
+
+    __sync_synchronize();
+    if(slot.sequence != position + 1)
+        return false;
+
+    entry.timestamp = timestamp;
+    entry.type = type;
+
+    size_t i = 0;
+    while(i < length)
+    {
+        uint8_t tag = data[i++];
+
+        if((tag & 0xF) == TagString)
+        {
+            if(i >= length)
+                break;
+            size_t nBytes = data[i++];
+            if((i + nBytes) > length)
+                break;
+
+            char str[256];
+            memcpy(str, &data[i], nBytes);
+            str[nBytes] = '\0';
+            entry.str.append(str);
+            i += nBytes;
+            continue;
+        }
+
+        if((i + sizeof(uint64_t)) > length)
+            break;
+        uint64_t value;
+        memcpy(&value, &data[i], sizeof(value));
+        i += sizeof(value);
+
+        size_t radix = 10;
+        if((tag >> 4) == Hex)
+        {
+            radix = 16;
+            entry.str.append("0x");
+        }
+        else if((tag >> 4) == Oct)
+        {
+            radix = 8;
+            entry.str.append("0");
+        }
+
+        switch(tag & 0xF)
+        {
+            case TagChar:
+                entry.str.append(static_cast<char>(value), radix);
+                break;
+            case TagUnsignedChar:
+                entry.str.append(static_cast<unsigned char>(value), radix);
+                break;
+            case TagShort:
+                entry.str.append(static_cast<short>(value), radix);
+                break;
+            case TagUnsignedShort:
+                entry.str.append(static_cast<unsigned short>(value), radix);
+                break;
+            case TagInt:
+                entry.str.append(static_cast<int>(value), radix);
+                break;
+            case TagUnsignedInt:
+                entry.str.append(static_cast<unsigned int>(value), radix);
+                break;
+            case TagLong:
+                entry.str.append(static_cast<long>(value), radix);
+                break;
+            case TagUnsignedLong:
+                entry.str.append(static_cast<unsigned long>(value), radix);
+                break;
+#ifndef MIPS32
+            case TagLongLong:
+                entry.str.append(static_cast<long long>(value), radix);
+                break;
+            case TagUnsignedLongLong:
+                entry.str.append(static_cast<unsigned long long>(value), radix);
+                break;
+#endif
+            default:
+                break;
         }
     }
+
+    return true;
+}
+
+Log::PerCpu &Log::cpu()
+{
+    size_t id = Processor::id();
+    return (id < LOG_CPUS) ? m_Cpus[id] : m_Shared;
+}
+
+Log::PerCpu *Log::openCpu()
+{
+    // An entry keeps interrupts off until it's flushed, so with them on
+    // there's nothing open on this processor.
+    if(Processor::getInterrupts())
+        return 0;
+
+    size_t id = Processor::id();
+    if((id >= LOG_CPUS) && (m_SharedOwner != (id + 1)))
+        return 0;
+
+    PerCpu &c = cpu();
+    return c.depth ? &c : 0;
+}
+
+Log::PerCpu &Log::claimCpu()
+{
+    size_t id = Processor::id();
+    if(id < LOG_CPUS)
+        return m_Cpus[id];
+
+    if(m_SharedOwner != (id + 1))
+    {
+        while(!__sync_bool_compare_and_swap(&m_SharedOwner, 0, id + 1))
+            Processor::pause();
+    }
+    return m_Shared;
+}
+
+void Log::releaseCpu(PerCpu &c)
+{
+    if((&c != &m_Shared) || c.depth)
+        return;
+
+    __sync_synchronize();
+    m_SharedOwner = 0;
+}
+
+Log::Staging *Log::staging()
+{
+    if(!openCpu())
+        *this << Notice;
+
+    PerCpu &c = cpu();
+    if(c.depth > LOG_NESTING)
+        return 0;
+    return &c.staging[c.depth - 1];
+}
+
+void Log::appendString(const char *str, size_t length)
+{
+    Staging *pStaging = staging();
+    if(!pStaging)
+        return;
+
+    size_t room = LOG_RECORD_DATA - pStaging->length;
+    if(room < 3)
+        return;
+    if(length > (room - 2))
+        length = room - 2;
+    if(length > 0xFF)
+        length = 0xFF;
+
+    pStaging->data[pStaging->length++] = TagString;
+    pStaging->data[pStaging->length++] = static_cast<uint8_t>(length);
+    memcpy(&pStaging->data[pStaging->length], str, length);
+    pStaging->length += length;
+}
+
+void Log::appendNumber(uint8_t type, uint64_t value)
+{
+    Staging *pStaging = staging();
+    if(!pStaging)
+        return;
+
+    if((pStaging->length + 1 + sizeof(value)) > LOG_RECORD_DATA)
+        return;
+
+    pStaging->data[pStaging->length++] = type | (cpu().numberType << 4);
+    memcpy(&pStaging->data[pStaging->length], &value, sizeof(value));
+    pStaging->length += sizeof(value);
 }
 
 Log &Log::operator<< (const char *str)
 {
-    m_Buffer.str.append(str);
+    appendString(str, strlen(str));
     return *this;
 }
 
 Log &Log::operator<< (String str)
 {
-    m_Buffer.str.append(str);
+    appendString(static_cast<const char*>(str), str.length());
     return *this;
 }
 
@@ -207,18 +572,8 @@ Log &Log::operator<< (bool b)
 template<class T>
 Log &Log::operator << (T n)
 {
-    size_t radix = 10;
-    if (m_NumberType == Hex)
-    {
-        radix = 16;
-        m_Buffer.str.append("0x");
-    }
-    else if (m_NumberType == Oct)
-    {
-        radix = 8;
-        m_Buffer.str.append("0");
-    }
-    m_Buffer.str.append(n, radix);
+    // Formatting waits until the entry is read.
+    appendNumber(tagOf(n), static_cast<uint64_t>(n));
     return *this;
 }
 
@@ -242,85 +597,116 @@ template Log &Log::operator << (unsigned long long);
 Log &Log::operator<< (Modifier type)
 {
     // Flush the buffer.
-    if (type == Flush)
+    if (type != Flush)
+        return *this;
+
+    PerCpu *pCpu = openCpu();
+    if (!pCpu)
+        return *this;
+    PerCpu &c = *pCpu;
+
+    // Too deeply nested to have been kept. Interrupts were off before it
+    // started, so there's nothing to restore.
+    if (c.depth > LOG_NESTING)
     {
-        if (m_StaticEntries >= LOG_ENTRIES)
-        {
-            m_StaticEntryStart = (m_StaticEntryStart+1) % LOG_ENTRIES;
-        }
-        else
-            m_StaticEntries ++;
+        --c.depth;
+        releaseCpu(c);
+        return *this;
+    }
 
-        m_StaticLog[m_StaticEntryEnd] = m_Buffer;
-        m_StaticEntryEnd = (m_StaticEntryEnd+1) % LOG_ENTRIES;
+    Staging &s = c.staging[c.depth - 1];
 
-        if(m_OutputCallbacks.count())
-        {
-            // We have output callbacks installed. Build the string we'll pass
-            // to each callback *now* and then send it.
-            HugeStaticString str;
-            switch(m_Buffer.type)
-            {
-                case Debug:
-                    str = "(DD) ";
-                    break;
-                case Notice:
-                    str = "(NN) ";
-                    break;
-                case Warning:
-                    str = "(WW) ";
-                    break;
-                case Error:
-                    str = "(EE) ";
-                    break;
-                case Fatal:
-                    str = "(FF) ";
-                    break;
-                default:
-                    str = "(XX) ";
-                    break;
-            }
-            str += m_Buffer.str;
-#ifndef SERIAL_IS_FILE
-            str += "\r\n"; // Handle carriage return
-#else
-            str += "\n";
-#endif
+    size_t position = __sync_fetch_and_add(&m_Next, 1);
+    LogRecord &slot = m_Ring[position % LOG_ENTRIES];
 
-            for(List<LogCallback*>::Iterator it = m_OutputCallbacks.begin();
-                it != m_OutputCallbacks.end();
-                ++it)
-            {
-                if(*it)
-                    (*it)->callback(static_cast<const char*>(str));
-            }
-        }
-    }
+    slot.sequence = 0;
+    __sync_synchronize();
+    slot.timestamp = s.timestamp;
+    slot.type = s.type;
+    slot.length = s.length;
+    memcpy(slot.data, s.data, s.length);
+    __sync_synchronize();
+    slot.sequence = position + 1;
+
+    c.latest = position;
+    --c.depth;
+
+    bool bOutermost = !c.depth;
+    SeverityLevel level = s.type;
+    bool bInterrupts = s.bInterrupts;
+    releaseCpu(c);
+    if (bInterrupts)
+        Processor::setInterrupts(true);
+
+    // Write it out now if there's no thread to do it, if it's an error (the
+    // machine may not live long enough for the thread to get to it), or if
+    // the callbacks have fallen so far behind that entries are about to be
+    // overwritten before they see them.
+    if (bOutermost &&
+        (!m_bDrainThread || (level >= Error) || ((m_Next - m_Drained) > (LOG_ENTRIES / 2))))
+        drain();
+#ifdef THREADS
+    else if (m_bDrainWaiting && (m_Drained != m_Next) &&
+             __sync_bool_compare_and_swap(&m_bDrainWaiting, true, false))
+        m_pDrainSem->release();
+#endif
 
     return *this;
 }
 
 Log &Log::operator<< (NumberType type)
 {
-    m_NumberType = type;
+    bool bInterrupts = Processor::getInterrupts();
+    Processor::setInterrupts(false);
+    PerCpu &c = claimCpu();
+    c.numberType = type;
+    releaseCpu(c);
+    if (bInterrupts)
+        Processor::setInterrupts(true);
     return *this;
 }
 
 Log &Log::operator<< (SeverityLevel level)
 {
-    // Zero the buffer.
-    m_Buffer.str.clear();
-    m_Buffer.type = level;
+    // The entry is built in this processor's own buffer, so nothing else
+    // may run here until it's flushed.
+    bool bInterrupts = Processor::getInterrupts();
+    Processor::setInterrupts(false);
+
+    PerCpu &c = claimCpu();
+    ++c.depth;
+    if (c.depth > LOG_NESTING)
+        return *this;
+
+    Staging &s = c.staging[c.depth - 1];
+    s.bInterrupts = bInterrupts;
+    s.type = level;
+    s.length = 0;
 
     Machine &machine = Machine::instance();
     if (machine.isInitialised() == true &&
         machine.getTimer() != 0)
     {
         Timer &timer = *machine.getTimer();
-        m_Buffer.timestamp = timer.getTickCount();
+        s.timestamp = timer.getTickCount();
     }
     else
-        m_Buffer.timestamp = 0;
+        s.timestamp = 0;
 
     return *this;
 }
+
+const Log::LogEntry &Log::getLatestEntry()
+{
+    bool bInterrupts = Processor::getInterrupts();
+    Processor::setInterrupts(false);
+
+    PerCpu &c = claimCpu();
+    c.latestEntry = LogEntry();
+    format(c.latest, c.latestEntry);
+    releaseCpu(c);
+
+    if (bInterrupts)
+        Processor::setInterrupts(true);
+    return c.latestEntry;
+}
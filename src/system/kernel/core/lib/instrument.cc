@@ -18,49 +18,262 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <utilities/FunctionTracer.h>
 #include <machine/Machine.h>
+#include <machine/Timer.h>
+#include <machine/Serial.h>
+#include <processor/Processor.h>
+#include <linker/KernelElf.h>
 #include <utilities/StaticString.h>
+#include <utilities/demangle.h>
+#include <utilities/utility.h>
+#ifdef THREADS
+#include <process/Thread.h>
+#endif
 
 extern "C" void __cyg_profile_func_enter (void *func_address, void *call_site)
   __attribute__((no_instrument_function));
 extern "C" void __cyg_profile_func_exit (void *func_address, void *call_site)
   __attribute__((no_instrument_function));
 
+extern "C" void __cyg_profile_func_enter (void *func_address, void *call_site)
+{
+    FunctionTracer::instance().record(FunctionTracer::Entry, func_address, call_site);
+}
+
+extern "C" void __cyg_profile_func_exit (void *func_address, void *call_site)
+{
+    FunctionTracer::instance().record(FunctionTracer::Exit, func_address, call_site);
+}
+
+FunctionTracer FunctionTracer::m_Instance;
+
+#ifdef FUNCTION_TRACING
+
+struct FunctionTraceRing
+{
+    /** Events ever recorded; the next goes at head % FTRACE_RECORDS. */
+    volatile size_t head;
+    /** Set while a hook on this ring's processor is recording, so that
+     *  an interrupt coming in meanwhile is left out rather than nesting. */
+    volatile uint8_t busy;
+    FunctionTracer::Record records[FTRACE_RECORDS];
+};
+
+static FunctionTraceRing g_FunctionTraceRings[FTRACE_CPUS];
+
+/** Functions already named in the dump being written (open addressing). */
+static uintptr_t g_FunctionTraceSymbols[FTRACE_SYMBOLS];
+
+#endif
+
+static inline uint64_t traceTimestamp() __attribute__((no_instrument_function, always_inline));
+static inline uint64_t traceTimestamp()
+{
 #ifdef X86_COMMON
-#define OUT(c) asm volatile ("outb %%al, %%dx" :: "d"(0x2f8), "a"(c))
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return (static_cast<uint64_t>(hi) << 32) | lo;
+#else
+    Timer *pTimer = Machine::instance().getTimer();
+    return pTimer ? pTimer->getTickCount() : 0;
+#endif
+}
+
+static uint64_t traceTicks()
+{
+    Machine &machine = Machine::instance();
+    if (!machine.isInitialised() || !machine.getTimer())
+        return 0;
+    return machine.getTimer()->getTickCount();
+}
+
+FunctionTracer::FunctionTracer() :
+    m_bEnabled(false), m_StartTimestamp(0), m_StartTicks(0)
+{
+}
+
+bool FunctionTracer::isAvailable()
+{
+#ifdef FUNCTION_TRACING
+    return true;
 #else
-#define OUT(C)
+    return false;
 #endif
+}
 
-extern "C" void __cyg_profile_func_enter (void *func_address, void *call_site)
+bool FunctionTracer::enable()
 {
-    uint32_t _func_address = reinterpret_cast<uintptr_t>(func_address)&0xFFFFFFFF;
-    uint32_t _call_site = reinterpret_cast<uintptr_t>(call_site)&0xFFFFFFFF;
-
-//    register int eflags;
-//    asm volatile ("pushf; pop %0; cli" : "=r" (eflags));
-    OUT('E');
-    OUT('0' + ((_func_address>>(32-4))&0xF));
-    OUT('0' + ((_func_address>>(32-8))&0xF));
-    OUT('0' + ((_func_address>>(32-12))&0xF));
-    OUT('0' + ((_func_address>>(32-16))&0xF));
-    OUT('0' + ((_func_address>>(32-20))&0xF));
-    OUT('0' + ((_func_address>>(32-24))&0xF));
-    OUT('0' + ((_func_address>>(32-28))&0xF));
-    OUT('0' + ((_func_address>>(32-32))&0xF));
-    OUT(' ');
-    OUT('0' + ((_call_site>>(32-4))&0xF));
-    OUT('0' + ((_call_site>>(32-8))&0xF));
-    OUT('0' + ((_call_site>>(32-12))&0xF));
-    OUT('0' + ((_call_site>>(32-16))&0xF));
-    OUT('0' + ((_call_site>>(32-20))&0xF));
-    OUT('0' + ((_call_site>>(32-24))&0xF));
-    OUT('0' + ((_call_site>>(32-28))&0xF));
-    OUT('0' + ((_call_site>>(32-32))&0xF));
-    OUT('\n');
-//    asm volatile("push %0; popf" ::"r" (eflags));
+#ifdef FUNCTION_TRACING
+    m_StartTimestamp = traceTimestamp();
+    m_StartTicks = traceTicks();
+    __sync_synchronize();
+    m_bEnabled = true;
+    return true;
+#else
+    return false;
+#endif
 }
 
-extern "C" void __cyg_profile_func_exit (void *func_address, void *call_site)
+void FunctionTracer::disable()
+{
+    m_bEnabled = false;
+    __sync_synchronize();
+}
+
+void FunctionTracer::clear()
+{
+#ifdef FUNCTION_TRACING
+    for (size_t i = 0; i < FTRACE_CPUS; i++)
+        g_FunctionTraceRings[i].head = 0;
+#endif
+}
+
+size_t FunctionTracer::getCount(size_t cpu) const
+{
+#ifdef FUNCTION_TRACING
+    if (cpu < FTRACE_CPUS)
+        return g_FunctionTraceRings[cpu].head;
+#endif
+    return 0;
+}
+
+void FunctionTracer::record(EventType type, void *function, void *callSite)
+{
+#ifdef FUNCTION_TRACING
+    if (!m_bEnabled)
+        return;
+
+    // Processor::id() and the thread lookup aren't instrumented (see the
+    // kernel's SConscript), so nothing here calls back into the hooks.
+    size_t cpu = Processor::id();
+    FunctionTraceRing &ring = g_FunctionTraceRings[(cpu < FTRACE_CPUS) ? cpu : (FTRACE_CPUS - 1)];
+    if (__sync_lock_test_and_set(&ring.busy, 1))
+        return;
+
+    uint64_t timestamp = traceTimestamp();
+
+    uint32_t thread = 0;
+#ifdef THREADS
+    Thread *pThread = Processor::information().getCurrentThread();
+    if (pThread)
+        thread = pThread->getId();
+#endif
+
+    size_t n = __sync_fetch_and_add(&ring.head, 1);
+    Record &r = ring.records[n % FTRACE_RECORDS];
+    r.timestamp = timestamp;
+    r.function = reinterpret_cast<uintptr_t>(function);
+    r.callSite = reinterpret_cast<uintptr_t>(callSite);
+    r.thread = thread;
+    r.cpu = cpu;
+    r.type = type;
+    r.pad = 0;
+
+    __sync_lock_release(&ring.busy);
+#endif
+}
+
+#ifdef FUNCTION_TRACING
+static void traceWrite(Serial *pSerial, const void *p, size_t nBytes)
+{
+    const char *pBytes = reinterpret_cast<const char*>(p);
+    for (size_t i = 0; i < nBytes; i++)
+        pSerial->write(pBytes[i]);
+}
+
+template<class T>
+static void traceWrite(Serial *pSerial, T value)
 {
+    traceWrite(pSerial, &value, sizeof(value));
+}
+
+/** Writes an 'S' field for a function, unless it's been named already. */
+static void traceSymbol(Serial *pSerial, uintptr_t function, size_t &nSymbols)
+{
+    size_t slot = (function >> 2) % FTRACE_SYMBOLS;
+    while (g_FunctionTraceSymbols[slot])
+    {
+        if (g_FunctionTraceSymbols[slot] == function)
+            return;
+        slot = (slot + 1) % FTRACE_SYMBOLS;
+    }
+
+    // Keep the table sparse enough for probing to stay short; anything past
+    // this is left for the host to look up by address.
+    if (nSymbols >= ((FTRACE_SYMBOLS * 3) / 4))
+        return;
+    g_FunctionTraceSymbols[slot] = function;
+    ++nSymbols;
+
+    const char *pSymbol = KernelElf::instance().globalLookupSymbol(function);
+    if (!pSymbol)
+        return;
+
+    LargeStaticString name;
+    demangle_full(LargeStaticString(pSymbol), name);
+
+    traceWrite<char>(pSerial, 'S');
+    traceWrite<uintptr_t>(pSerial, function);
+    traceWrite<uint16_t>(pSerial, name.length());
+    traceWrite(pSerial, static_cast<const char*>(name), name.length());
+}
+#endif
+
+bool FunctionTracer::dump()
+{
+#ifdef FUNCTION_TRACING
+    if (Machine::instance().getNumSerial() < 2)
+        return false;
+    Serial *pSerial = Machine::instance().getSerial(1);
+    if (!pSerial)
+        return false;
+
+    traceWrite<char>(pSerial, 'H');
+    traceWrite<uint32_t>(pSerial, FTRACE_MAGIC);
+    traceWrite<uint32_t>(pSerial, 1);
+    traceWrite<uint32_t>(pSerial, sizeof(uintptr_t));
+    traceWrite<uint64_t>(pSerial, m_StartTimestamp);
+    traceWrite<uint64_t>(pSerial, m_StartTicks);
+    traceWrite<uint64_t>(pSerial, traceTimestamp());
+    traceWrite<uint64_t>(pSerial, traceTicks());
+
+    memset(g_FunctionTraceSymbols, 0, sizeof(g_FunctionTraceSymbols));
+    size_t nSymbols = 0;
+    for (size_t cpu = 0; cpu < FTRACE_CPUS; cpu++)
+    {
+        FunctionTraceRing &ring = g_FunctionTraceRings[cpu];
+        size_t count = (ring.head < FTRACE_RECORDS) ? ring.head : FTRACE_RECORDS;
+        for (size_t i = ring.head - count; i < ring.head; i++)
+            traceSymbol(pSerial, ring.records[i % FTRACE_RECORDS].function, nSymbols);
+    }
+
+    for (size_t cpu = 0; cpu < FTRACE_CPUS; cpu++)
+    {
+        FunctionTraceRing &ring = g_FunctionTraceRings[cpu];
+        if (!ring.head)
+            continue;
+        size_t count = (ring.head < FTRACE_RECORDS) ? ring.head : FTRACE_RECORDS;
+
+        traceWrite<char>(pSerial, 'C');
+        traceWrite<uint32_t>(pSerial, cpu);
+        traceWrite<uint32_t>(pSerial, count);
+        for (size_t i = ring.head - count; i < ring.head; i++)
+        {
+            Record &r = ring.records[i % FTRACE_RECORDS];
+            traceWrite<uint64_t>(pSerial, r.timestamp);
+            traceWrite<uintptr_t>(pSerial, r.function);
+            traceWrite<uintptr_t>(pSerial, r.callSite);
+            traceWrite<uint32_t>(pSerial, r.thread);
+            traceWrite<uint16_t>(pSerial, r.cpu);
+            traceWrite<uint8_t>(pSerial, r.type);
+            traceWrite<uint8_t>(pSerial, 0);
+        }
+    }
+
+    traceWrite<char>(pSerial, 'Z');
+    return true;
+#else
+    return false;
+#endif
 }
@@ -381,6 +381,9 @@ extern "C" void _main(BootstrapStruct_t &bsInf)
   ZombieQueue::instance().initialise();
 #endif
 
+  // Hand writing the log out over to a thread of its own.
+  Log::instance().initialise3();
+
   /// \todo Seed random number generator.
 
 #if defined(THREADS)
@@ -148,6 +148,12 @@ void Process::removeThread(Thread *pThread)
   }
 }
 
+void Process::setLinker(DynamicLinker *pDl)
+{
+  LockGuard<Spinlock> guard(Scheduler::instance().getProcessLock());
+  m_pDynamicLinker = pDl;
+}
+
 size_t Process::getNumThreads()
 {
   LockGuard<Spinlock> guard(m_Lock);
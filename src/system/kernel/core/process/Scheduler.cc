@@ -24,6 +24,7 @@
 #include <process/Thread.h>
 #include <process/RoundRobin.h>
 #include <process/initialiseMultitasking.h>
+#include <LockGuard.h>
 #include <processor/Processor.h>
 #include <processor/StackFrame.h>
 #include <processor/KernelCoreSyscallManager.h>
@@ -40,7 +41,7 @@
 Scheduler Scheduler::m_Instance;
 
 Scheduler::Scheduler() :
-    m_Processes(), m_NextPid(0), m_PTMap(), m_TPMap(), m_pKernelProcess(0)
+    m_Processes(), m_NextPid(0), m_ProcessLock(false), m_PTMap(), m_TPMap(), m_pKernelProcess(0)
 {
 }
 
@@ -97,12 +98,14 @@ bool Scheduler::threadInSchedule(Thread *pThread)
 
 size_t Scheduler::addProcess(Process *pProcess)
 {
+  LockGuard<Spinlock> guard(m_ProcessLock);
   m_Processes.pushBack(pProcess);
   return (m_NextPid += 1);
 }
 
 void Scheduler::removeProcess(Process *pProcess)
 {
+  LockGuard<Spinlock> guard(m_ProcessLock);
   for(List<Process*>::Iterator it = m_Processes.begin();
       it != m_Processes.end();
       it++)
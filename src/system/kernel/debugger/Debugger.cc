@@ -45,6 +45,8 @@
 #include <HelpCommand.h>
 #include <LocksCommand.h>
 #include <MappingCommand.h>
+#include <FunctionTraceCommand.h>
+#include <ProfileCommand.h>
 #include <process/Thread.h>
 #include <process/initialiseMultitasking.h>
 #include <machine/Machine.h>
@@ -105,6 +107,7 @@ void Debugger::initialise()
 void Debugger::start(InterruptState &state, LargeStaticString &description)
 {
   Log::instance() << " << Flushing log content >>" << Flush;
+  Log::instance().drain();
   static String graphicsService("graphics");
   
   // Drop out of whatever graphics mode we were in
@@ -193,6 +196,8 @@ void Debugger::start(InterruptState &state, LargeStaticString &description)
   static LookupCommand lookup;
   static HelpCommand help;
   static MappingCommand mapping;
+  static FunctionTraceCommand functionTrace;
+  static ProfileCommand profile;
 
 #if defined(THREADS)
   static ThreadsCommand threads;
@@ -201,9 +206,9 @@ void Debugger::start(InterruptState &state, LargeStaticString &description)
 #endif
 
 #if defined(THREADS)
-  size_t nCommands = 21;
+  size_t nCommands = 23;
 #else
-  size_t nCommands = 20;
+  size_t nCommands = 22;
 #endif
   DebuggerCommand *pCommands[] = {&syscallTracer,
                                   &disassembler,
@@ -227,7 +232,9 @@ void Debugger::start(InterruptState &state, LargeStaticString &description)
                                   &lookup,
                                   &help,
                                   &g_LocksCommand,
-                                  &mapping};
+                                  &mapping,
+                                  &functionTrace,
+                                  &profile};
 
   // Are we going to jump directly into the tracer? In which case bypass device detection.
   int n = g_Trace.execTrace();
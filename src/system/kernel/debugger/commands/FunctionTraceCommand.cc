@@ -0,0 +1,95 @@
+/*
+ * 
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "FunctionTraceCommand.h"
+#include <utilities/FunctionTracer.h>
+#include <processor/Processor.h>
+
+FunctionTraceCommand::FunctionTraceCommand()
+ : DebuggerCommand()
+{
+}
+
+FunctionTraceCommand::~FunctionTraceCommand()
+{
+}
+
+void FunctionTraceCommand::autocomplete(const HugeStaticString &input, HugeStaticString &output)
+{
+  output = "[on|off|clear|dump]";
+}
+
+bool FunctionTraceCommand::execute(const HugeStaticString &input, HugeStaticString &output, InterruptState &state, DebuggerIO *pScreen)
+{
+  FunctionTracer &tracer = FunctionTracer::instance();
+
+  if (!FunctionTracer::isAvailable())
+  {
+    output = "Function tracing is not built in to this kernel (build with function_tracing=1).\n";
+    return true;
+  }
+
+  if (input == "on")
+  {
+    tracer.enable();
+    output = "Function tracing enabled.\n";
+  }
+  else if (input == "off")
+  {
+    tracer.disable();
+    output = "Function tracing disabled.\n";
+  }
+  else if (input == "clear")
+  {
+    tracer.disable();
+    tracer.clear();
+    output = "Function trace cleared (tracing is now disabled).\n";
+  }
+  else if (input == "dump")
+  {
+    // The dump mustn't be recording itself.
+    tracer.disable();
+    if (tracer.dump())
+      output = "Function trace written to the second serial line (tracing is now disabled).\n";
+    else
+      output = "No second serial line to write the function trace to.\n";
+  }
+  else
+  {
+    output = "Function tracing is ";
+    output += tracer.isEnabled() ? "enabled" : "disabled";
+    output += ".\n";
+    for (size_t i = 0; i < FTRACE_CPUS; i++)
+    {
+      size_t count = tracer.getCount(i);
+      if (!count)
+        continue;
+      output += "CPU ";
+      output.append(i);
+      output += ": ";
+      output.append(count);
+      output += " events (";
+      output.append((count < FTRACE_RECORDS) ? count : FTRACE_RECORDS);
+      output += " kept)\n";
+    }
+  }
+
+  return true;
+}
@@ -0,0 +1,105 @@
+/*
+ * 
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "ProfileCommand.h"
+#include <utilities/SampleProfiler.h>
+#include <processor/Processor.h>
+
+ProfileCommand::ProfileCommand()
+ : DebuggerCommand()
+{
+}
+
+ProfileCommand::~ProfileCommand()
+{
+}
+
+void ProfileCommand::autocomplete(const HugeStaticString &input, HugeStaticString &output)
+{
+  output = "[on [hz]|off|clear]";
+}
+
+bool ProfileCommand::execute(const HugeStaticString &input, HugeStaticString &output, InterruptState &state, DebuggerIO *pScreen)
+{
+  SampleProfiler &profiler = SampleProfiler::instance();
+
+  if (input == "on" || input.left(3) == "on ")
+  {
+    size_t hz = PROFILE_DEFAULT_HZ;
+    if (input.length() > 3)
+    {
+      HugeStaticString frequency(input);
+      int value = frequency.stripFirst(3).intValue();
+      if (value <= 0)
+      {
+        output = "Usage: profile on [hz]\n";
+        return true;
+      }
+      hz = value;
+    }
+
+    if (profiler.start(hz))
+    {
+      output = "Profiling at ";
+      output.append(profiler.getFrequency());
+      output += " Hz. Samples can be read from /dev/profile.\n";
+    }
+    else
+      output = "The scheduler timer can't be used for profiling on this machine.\n";
+  }
+  else if (input == "off")
+  {
+    profiler.stop();
+    output = "Profiling stopped.\n";
+  }
+  else if (input == "clear")
+  {
+    profiler.stop();
+    profiler.clear();
+    output = "Samples cleared (profiling is now stopped).\n";
+  }
+  else
+  {
+    if (profiler.isRunning())
+    {
+      output = "Profiling at ";
+      output.append(profiler.getFrequency());
+      output += " Hz.\n";
+    }
+    else
+      output = "Profiling is stopped.\n";
+
+    for (size_t i = 0; i < PROFILE_CPUS; i++)
+    {
+      size_t count = profiler.getCount(i);
+      if (!count)
+        continue;
+      output += "CPU ";
+      output.append(i);
+      output += ": ";
+      output.append(count);
+      output += " samples (";
+      output.append((count < PROFILE_SAMPLES) ? count : PROFILE_SAMPLES);
+      output += " kept)\n";
+    }
+  }
+
+  return true;
+}
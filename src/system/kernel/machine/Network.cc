@@ -19,11 +19,212 @@
  */
 
 #include <machine/Network.h>
+#include <machine/Machine.h>
 #include <processor/IoPort.h>
 #include <processor/MemoryMappedIo.h>
 #include <processor/PhysicalMemoryManager.h>
+#include <process/Thread.h>
+#include <process/Scheduler.h>
+#include <process/Semaphore.h>
+#include <Spinlock.h>
 #include <Log.h>
 
+/** Runs the polls network devices schedule from their interrupt handlers,
+ *  round robin, on a thread of its own. */
+class NetworkPoller
+{
+  public:
+    NetworkPoller() :
+      m_pHead(0), m_pTail(0), m_Lock(), m_Wakeup(0), m_bSleeping(false), m_bStarted(false)
+    {}
+
+    static NetworkPoller &instance()
+    {
+      return m_Instance;
+    }
+
+    /** Starts the thread, if it hasn't been already. */
+    void initialise();
+
+    /** Queues a poll of pCard, if one isn't queued already. */
+    void schedule(Network *pCard);
+
+  private:
+    static int trampoline(void *p);
+    int work();
+
+    /** Polls pCard once, and either queues it again or hands it back to
+     *  interrupts. */
+    void pollOnce(Network *pCard);
+
+    /** Adds pCard to the end of the queue. m_Lock must be held. */
+    void append(Network *pCard);
+
+    static NetworkPoller m_Instance;
+
+    Network *m_pHead;
+    Network *m_pTail;
+    Spinlock m_Lock;
+
+    Semaphore m_Wakeup;
+    bool m_bSleeping;
+
+    /** Has the thread been started? */
+    bool m_bStarted;
+};
+
+NetworkPoller NetworkPoller::m_Instance;
+
+void NetworkPoller::initialise()
+{
+#ifdef THREADS
+  m_Lock.acquire();
+  bool bStart = !m_bStarted;
+  m_bStarted = true;
+  m_Lock.release();
+
+  if(!bStart)
+    return;
+
+  Thread *pThread = new Thread(Scheduler::instance().getKernelProcess(),
+                               reinterpret_cast<Thread::ThreadStartFunc>(&trampoline),
+                               reinterpret_cast<void*>(this));
+  pThread->detach();
+#endif
+}
+
+void NetworkPoller::schedule(Network *pCard)
+{
+  m_Lock.acquire();
+
+  if(pCard->m_bPollScheduled)
+  {
+    m_Lock.release();
+    return;
+  }
+  pCard->m_bPollScheduled = true;
+  append(pCard);
+
+  bool bWake = m_bSleeping;
+  m_bSleeping = false;
+
+  m_Lock.release();
+
+#ifdef THREADS
+  if(bWake)
+    m_Wakeup.release();
+#else
+  // Nowhere else to do it.
+  while(pCard->m_bPollScheduled)
+  {
+    m_Lock.acquire();
+    Network *pNext = m_pHead;
+    m_pHead = pNext->m_pNextPoll;
+    if(!m_pHead)
+      m_pTail = 0;
+    pNext->m_pNextPoll = 0;
+    m_Lock.release();
+
+    pollOnce(pNext);
+  }
+#endif
+}
+
+void NetworkPoller::append(Network *pCard)
+{
+  pCard->m_pNextPoll = 0;
+  if(m_pTail)
+    m_pTail->m_pNextPoll = pCard;
+  else
+    m_pHead = pCard;
+  m_pTail = pCard;
+}
+
+void NetworkPoller::pollOnce(Network *pCard)
+{
+  size_t nFrames = pCard->poll(NETWORK_POLL_BUDGET);
+
+  m_Lock.acquire();
+  if(nFrames >= NETWORK_POLL_BUDGET)
+  {
+    // Still busy - back of the queue, so other cards get a look in.
+    append(pCard);
+    m_Lock.release();
+    return;
+  }
+
+  // Idle. The flag has to be clear before interrupts are back on, so the
+  // next interrupt can schedule another poll.
+  pCard->m_bPollScheduled = false;
+  m_Lock.release();
+
+  pCard->enableRxInterrupts();
+  pCard->updateRates();
+}
+
+int NetworkPoller::trampoline(void *p)
+{
+  NetworkPoller *pPoller = reinterpret_cast<NetworkPoller*>(p);
+  return pPoller->work();
+}
+
+int NetworkPoller::work()
+{
+  while(true)
+  {
+    m_Lock.acquire();
+
+    Network *pCard = m_pHead;
+    if(!pCard)
+    {
+      m_bSleeping = true;
+      m_Lock.release();
+      m_Wakeup.acquire();
+      continue;
+    }
+
+    m_pHead = pCard->m_pNextPoll;
+    if(!m_pHead)
+      m_pTail = 0;
+    pCard->m_pNextPoll = 0;
+
+    m_Lock.release();
+
+    pollOnce(pCard);
+  }
+
+  return 0;
+}
+
+void Network::enablePolling()
+{
+  NetworkPoller::instance().initialise();
+}
+
+void Network::schedulePoll()
+{
+  NetworkPoller::instance().schedule(this);
+}
+
+void Network::updateRates()
+{
+  Timer *t = Machine::instance().getTimer();
+  if(!t)
+    return;
+
+  uint64_t now = t->getTickCount();
+  uint64_t elapsed = now - m_RateStart;
+  if(elapsed < 1000)
+    return;
+
+  m_StationInfo.nPacketsPerSecond = ((m_StationInfo.nPackets - m_RatePackets) * 1000ULL) / elapsed;
+  m_StationInfo.nInterruptsPerSecond = ((m_StationInfo.nInterrupts - m_RateInterrupts) * 1000ULL) / elapsed;
+
+  m_RateStart = now;
+  m_RatePackets = m_StationInfo.nPackets;
+  m_RateInterrupts = m_StationInfo.nInterrupts;
+}
+
 uint32_t Network::convertToIpv4(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
 {
   return a | (b << 8) | (c << 16) | (d << 24);
@@ -54,25 +255,24 @@ IpAddress Network::convertToIpv6(
     return temp;
 }
 
-uint16_t Network::calculateChecksum(uintptr_t buffer, size_t nBytes)
+bool Network::sendBuffer(NetworkBuffer *pBuffer)
 {
-  uint32_t sum = 0;
-  uint16_t* data = reinterpret_cast<uint16_t*>(buffer);
+  if(!pBuffer)
+    return false;
 
-  while(nBytes > 1)
-  {
-    sum += *data++;
-    nBytes -= sizeof( uint16_t );
-  }
+  if(pBuffer->isLinear())
+    return send(pBuffer->getLength(), pBuffer->getBuffer());
 
-  // odd bytes
-  if(nBytes > 0)
-    sum += (*data++) & 0xFF;
+  size_t nBytes = pBuffer->getTotalLength();
+  uint8_t *pPacket = new uint8_t[nBytes];
+  pBuffer->copyOut(0, pPacket, nBytes);
+  bool bResult = send(nBytes, reinterpret_cast<uintptr_t>(pPacket));
+  delete [] pPacket;
 
-  // fold to 16 bits
-  while( sum >> 16 )
-    sum = ( sum & 0xFFFF ) + ( sum >> 16 );
+  return bResult;
+}
 
-  uint16_t ret = static_cast<uint16_t>(~sum);
-  return ret;
+uint16_t Network::calculateChecksum(uintptr_t buffer, size_t nBytes)
+{
+  return Checksum::calculate(reinterpret_cast<const void*>(buffer), nBytes);
 }
@@ -27,6 +27,7 @@
 #include <processor/PhysicalMemoryManager.h>
 #include <machine/Machine.h>
 #include <processor/InterruptManager.h>
+#include <utilities/SampleProfiler.h>
 
 #define LAPIC_REG_ID                                    0x0020
 #define LAPIC_REG_VERSION                               0x0030
@@ -59,6 +60,10 @@
     For 10ms delay, divide that by 100... */
 #define INITIAL_COUNT_VALUE (78125*40)
 
+/** Scheduler ticks per second to go by until the real rate has been
+    measured - the rate the PIT is run at. */
+#define ASSUMED_TICK_RATE 100
+
 bool LocalApic::initialise(uint64_t physicalAddress)
 {
   // Detect local APIC presence
@@ -179,10 +184,34 @@ void LocalApic::interrupt(size_t nInterruptNumber, InterruptState &state)
 {
   if (nInterruptNumber == TIMER_VECTOR)
   {
+    bool bTick = true;
+    size_t cpu = Processor::id();
+    if (cpu < LAPIC_TIMER_CPUS)
+    {
+      size_t multiplier = m_Multiplier;
+      if (UNLIKELY(m_CpuMultiplier[cpu] != multiplier))
+      {
+        // The initial-count register is per-processor, so each one has to
+        // change its own.
+        m_IoSpace.write32(INITIAL_COUNT_VALUE / multiplier, LAPIC_REG_INITIAL_COUNT);
+        m_CpuMultiplier[cpu] = multiplier;
+        m_CpuTicks[cpu] = 0;
+      }
+      if (multiplier > 1)
+        bTick = (++m_CpuTicks[cpu] % multiplier) == 0;
+    }
+
+    // Before the scheduler gets a chance to switch away from what was
+    // interrupted.
+    if (m_bSampling)
+      SampleProfiler::instance().sample(state);
+
     // TODO: Delta is wrong.
-    if (LIKELY(m_Handler != 0))
+    if (LIKELY(m_Handler != 0) && bTick)
     {
       // NOTICE("Timer " << Processor::id());
+      if (cpu == 0)
+        measure();
       m_Handler->timer (0, state);
     }
     ack();
@@ -196,6 +225,51 @@ void LocalApic::interrupt(size_t nInterruptNumber, InterruptState &state)
   }
 }
 
+size_t LocalApic::setSampleRate(size_t hz)
+{
+  if (!hz)
+  {
+    m_bSampling = false;
+    m_Multiplier = 1;
+    return 0;
+  }
+
+  size_t tickRate = m_TickRate ? m_TickRate : ASSUMED_TICK_RATE;
+  size_t multiplier = (hz + (tickRate / 2)) / tickRate;
+  if (multiplier < 1)
+    multiplier = 1;
+  else if (multiplier > LAPIC_MAX_TIMER_MULTIPLIER)
+    multiplier = LAPIC_MAX_TIMER_MULTIPLIER;
+
+  m_Multiplier = multiplier;
+  m_bSampling = true;
+  return tickRate * multiplier;
+}
+
+void LocalApic::measure()
+{
+  Timer *pTimer = Machine::instance().getTimer();
+  if (!pTimer)
+    return;
+
+  uint64_t now = pTimer->getTickCount();
+  if (!m_MeasureStart)
+  {
+    m_MeasureStart = now;
+    m_MeasureTicks = 0;
+    return;
+  }
+
+  ++m_MeasureTicks;
+  uint64_t elapsed = now - m_MeasureStart;
+  if (elapsed >= 1000)
+  {
+    m_TickRate = ((m_MeasureTicks * 1000ULL) + (elapsed / 2)) / elapsed;
+    m_MeasureStart = now;
+    m_MeasureTicks = 0;
+  }
+}
+
 void LocalApic::ack()
 {
   // Send EOI.
@@ -35,6 +35,13 @@
 #define SPURIOUS_VECTOR                                 0xFD
 #define TIMER_VECTOR                                    0xFE
 
+/// Processors whose timers can be sped up for profiling. Any others keep
+/// their timer as it is (and are sampled at the scheduler's rate).
+#define LAPIC_TIMER_CPUS                                MAX_PROCESSORS
+
+/// Most the timer can be sped up by for profiling.
+#define LAPIC_MAX_TIMER_MULTIPLIER                      100
+
 /** @addtogroup kernelmachinex86common
  * @{ */
 
@@ -46,7 +53,15 @@ class LocalApic : public SchedulerTimer,
   public:
     /** The default constructor */
     inline LocalApic()
-      : m_IoSpace("Local APIC"), m_Handler(0) {}
+      : m_IoSpace("Local APIC"), m_Handler(0), m_TickRate(0), m_MeasureStart(0),
+        m_MeasureTicks(0), m_Multiplier(1), m_bSampling(false)
+    {
+      for (size_t i = 0; i < LAPIC_TIMER_CPUS; i++)
+      {
+        m_CpuMultiplier[i] = 1;
+        m_CpuTicks[i] = 0;
+      }
+    }
     /** The destructor */
     inline virtual ~LocalApic(){}
 
@@ -94,7 +109,7 @@ class LocalApic : public SchedulerTimer,
 
     /** Get the Local APIC Id for this processor
      *\return the Local APIC Id of this processor */
-    uint8_t getId();
+    uint8_t getId() __attribute__((no_instrument_function));
 
     //
     // SchedulerTimer interface
@@ -102,6 +117,8 @@ class LocalApic : public SchedulerTimer,
     virtual bool registerHandler(TimerHandler *handler)
       {m_Handler = handler; return false;}
 
+    virtual size_t setSampleRate(size_t hz);
+
     void ack();
 
   private:
@@ -126,8 +143,29 @@ class LocalApic : public SchedulerTimer,
     /** The local APIC memory-mapped I/O space */
     MemoryMappedIo m_IoSpace;
 
+    /** Keeps m_TickRate up to date. Called on each scheduler tick. */
+    void measure();
+
     /** The scheduler. */
     TimerHandler *m_Handler;
+
+    /** Scheduler ticks per second, as measured against the system timer on
+     *  the first processor (zero until a second has been measured). */
+    volatile size_t m_TickRate;
+    uint64_t m_MeasureStart;
+    size_t m_MeasureTicks;
+
+    /** Timer interrupts per scheduler tick: more than one while profiling.
+     *  Each processor notices a change on its next interrupt and
+     *  reprograms its own timer. */
+    volatile size_t m_Multiplier;
+    /** Pass timer interrupts to the SampleProfiler? */
+    volatile bool m_bSampling;
+
+    /** The multiplier each processor's timer is set up for, and its
+     *  interrupts since its last scheduler tick. */
+    size_t m_CpuMultiplier[LAPIC_TIMER_CPUS];
+    size_t m_CpuTicks[LAPIC_TIMER_CPUS];
 };
 
 /** @} */
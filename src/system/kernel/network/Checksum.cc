@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <network/Checksum.h>
+#include <network/NetworkBuffer.h>
+#include <utilities/utility.h>
+
+// The ones' complement sum is the same whichever byte order the words are
+// read in, as long as the result is stored back the same way (RFC 1071). So
+// everything here works on native words, and a piece that starts at an odd
+// offset in the packet just has its sum byte-swapped.
+
+static inline uint16_t swap16(uint16_t x)
+{
+    return static_cast<uint16_t>((x << 8) | (x >> 8));
+}
+
+/** The native 16-bit word holding a and b, in that order in memory. */
+static inline uint16_t makeWord(uint8_t a, uint8_t b)
+{
+    union
+    {
+        uint8_t bytes[2];
+        uint16_t word;
+    } u;
+    u.bytes[0] = a;
+    u.bytes[1] = b;
+    return u.word;
+}
+
+uint16_t Checksum::fold(uint64_t sum)
+{
+    // Adding 2^32 (or 2^16) is the same as adding 1 modulo 0xFFFF, so the
+    // carries can be folded back in at either width.
+    sum = (sum & 0xFFFFFFFFULL) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFFULL) + (sum >> 32);
+    while(sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return static_cast<uint16_t>(sum);
+}
+
+uint16_t Checksum::fold() const
+{
+    return fold(m_Sum);
+}
+
+uint64_t Checksum::sum(const uint8_t *pData, size_t nBytes)
+{
+    if(!nBytes)
+        return 0;
+
+    // An odd address can't be read a word at a time (on all targets). Take
+    // the first byte on its own: the rest then starts at an odd offset in
+    // this piece, and is summed as the swap of its even-offset sum.
+    if(reinterpret_cast<uintptr_t>(pData) & 1)
+    {
+        uint64_t rest = makeWord(0, pData[0]) + sum(pData + 1, nBytes - 1);
+        return swap16(fold(rest));
+    }
+
+    uint64_t total = 0;
+    if((reinterpret_cast<uintptr_t>(pData) & 2) && (nBytes >= 2))
+    {
+        total += *reinterpret_cast<const uint16_t *>(pData);
+        pData += 2;
+        nBytes -= 2;
+    }
+
+    const uint32_t *pWords = reinterpret_cast<const uint32_t *>(pData);
+    while(nBytes >= 32)
+    {
+        total += pWords[0];
+        total += pWords[1];
+        total += pWords[2];
+        total += pWords[3];
+        total += pWords[4];
+        total += pWords[5];
+        total += pWords[6];
+        total += pWords[7];
+        pWords += 8;
+        nBytes -= 32;
+    }
+    while(nBytes >= 4)
+    {
+        total += *pWords++;
+        nBytes -= 4;
+    }
+
+    pData = reinterpret_cast<const uint8_t *>(pWords);
+    if(nBytes >= 2)
+    {
+        total += *reinterpret_cast<const uint16_t *>(pData);
+        pData += 2;
+        nBytes -= 2;
+    }
+
+    // A trailing byte is the first half of a word padded with zero.
+    if(nBytes)
+        total += makeWord(pData[0], 0);
+
+    return total;
+}
+
+uint64_t Checksum::copyAndSum(uint8_t *pDest, const uint8_t *pSrc, size_t nBytes)
+{
+    // Copying word by word needs both sides to line up the same way. When
+    // they don't, two passes is the best we can do.
+    if(((reinterpret_cast<uintptr_t>(pDest) ^ reinterpret_cast<uintptr_t>(pSrc)) & 3) ||
+       (reinterpret_cast<uintptr_t>(pSrc) & 1))
+    {
+        memcpy(pDest, pSrc, nBytes);
+        return sum(pSrc, nBytes);
+    }
+
+    uint64_t total = 0;
+    if((reinterpret_cast<uintptr_t>(pSrc) & 2) && (nBytes >= 2))
+    {
+        uint16_t word = *reinterpret_cast<const uint16_t *>(pSrc);
+        *reinterpret_cast<uint16_t *>(pDest) = word;
+        total += word;
+        pSrc += 2;
+        pDest += 2;
+        nBytes -= 2;
+    }
+
+    const uint32_t *pIn = reinterpret_cast<const uint32_t *>(pSrc);
+    uint32_t *pOut = reinterpret_cast<uint32_t *>(pDest);
+    while(nBytes >= 16)
+    {
+        uint32_t a = pIn[0], b = pIn[1], c = pIn[2], d = pIn[3];
+        pOut[0] = a;
+        pOut[1] = b;
+        pOut[2] = c;
+        pOut[3] = d;
+        total += a;
+        total += b;
+        total += c;
+        total += d;
+        pIn += 4;
+        pOut += 4;
+        nBytes -= 16;
+    }
+    while(nBytes >= 4)
+    {
+        uint32_t a = *pIn++;
+        *pOut++ = a;
+        total += a;
+        nBytes -= 4;
+    }
+
+    pSrc = reinterpret_cast<const uint8_t *>(pIn);
+    pDest = reinterpret_cast<uint8_t *>(pOut);
+    if(nBytes >= 2)
+    {
+        uint16_t word = *reinterpret_cast<const uint16_t *>(pSrc);
+        *reinterpret_cast<uint16_t *>(pDest) = word;
+        total += word;
+        pSrc += 2;
+        pDest += 2;
+        nBytes -= 2;
+    }
+
+    if(nBytes)
+    {
+        *pDest = *pSrc;
+        total += makeWord(*pSrc, 0);
+    }
+
+    return total;
+}
+
+void Checksum::addPiece(uint64_t pieceSum, size_t nBytes)
+{
+    if(m_bOdd)
+        pieceSum = swap16(fold(pieceSum));
+    m_Sum += pieceSum;
+
+    // Keep the accumulator well clear of overflowing.
+    if(m_Sum >> 62)
+        m_Sum = fold(m_Sum);
+
+    if(nBytes & 1)
+        m_bOdd = !m_bOdd;
+}
+
+void Checksum::add(const void *pData, size_t nBytes)
+{
+    addPiece(sum(reinterpret_cast<const uint8_t *>(pData), nBytes), nBytes);
+}
+
+void Checksum::add(const Checksum &other)
+{
+    addPiece(other.m_Sum, other.m_bOdd ? 1 : 0);
+}
+
+void Checksum::add(const NetworkBuffer *pBuffer, size_t offset, size_t nBytes)
+{
+    for(; pBuffer && nBytes; pBuffer = pBuffer->getNextFragment())
+    {
+        size_t length = pBuffer->getLength();
+        if(offset >= length)
+        {
+            offset -= length;
+            continue;
+        }
+
+        size_t n = length - offset;
+        if(n > nBytes)
+            n = nBytes;
+
+        add(pBuffer->getData() + offset, n);
+        nBytes -= n;
+        offset = 0;
+    }
+}
+
+void Checksum::copyAndAdd(void *pDest, const void *pSrc, size_t nBytes)
+{
+    addPiece(copyAndSum(reinterpret_cast<uint8_t *>(pDest), reinterpret_cast<const uint8_t *>(pSrc), nBytes), nBytes);
+}
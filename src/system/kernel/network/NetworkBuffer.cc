@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <network/NetworkBuffer.h>
+#include <utilities/utility.h>
+
+NetworkBuffer::NetworkBuffer(Storage *pStorage, uint8_t *pData, size_t nBytes) :
+    m_pStorage(pStorage), m_pData(pData), m_Length(nBytes), m_pNext(0),
+    m_SegmentSize(0), m_bChecksumValid(false)
+{
+}
+
+NetworkBuffer::~NetworkBuffer()
+{
+}
+
+NetworkBuffer::Storage *NetworkBuffer::allocateStorage(size_t capacity)
+{
+    Storage *pStorage = new Storage;
+    pStorage->pBase = new uint8_t[capacity];
+    pStorage->capacity = capacity;
+    pStorage->bHeap = true;
+    return pStorage;
+}
+
+void NetworkBuffer::releaseStorage(Storage *pStorage)
+{
+    if((pStorage->refs -= 1) != 0)
+        return;
+
+    if(pStorage->pRelease)
+        pStorage->pRelease(pStorage->pBase, pStorage->pParam);
+    else if(pStorage->bHeap)
+        delete [] pStorage->pBase;
+
+    delete pStorage;
+}
+
+NetworkBuffer *NetworkBuffer::allocate(size_t nBytes, size_t headroom)
+{
+    Storage *pStorage = allocateStorage(headroom + nBytes);
+    return new NetworkBuffer(pStorage, pStorage->pBase + headroom, 0);
+}
+
+NetworkBuffer *NetworkBuffer::wrap(uint8_t *pBase, size_t capacity, size_t headroom,
+                                   ReleaseFunction pRelease, void *pParam)
+{
+    if(!pBase || (headroom > capacity))
+        return 0;
+
+    Storage *pStorage = new Storage;
+    pStorage->pBase = pBase;
+    pStorage->capacity = capacity;
+    pStorage->pRelease = pRelease;
+    pStorage->pParam = pParam;
+
+    return new NetworkBuffer(pStorage, pBase + headroom, 0);
+}
+
+void NetworkBuffer::release()
+{
+    NetworkBuffer *pBuffer = this;
+    while(pBuffer)
+    {
+        NetworkBuffer *pNext = pBuffer->m_pNext;
+        releaseStorage(pBuffer->m_pStorage);
+        delete pBuffer;
+        pBuffer = pNext;
+    }
+}
+
+NetworkBuffer *NetworkBuffer::clone()
+{
+    NetworkBuffer *pHead = 0;
+    NetworkBuffer *pTail = 0;
+    for(NetworkBuffer *pBuffer = this; pBuffer; pBuffer = pBuffer->m_pNext)
+    {
+        pBuffer->m_pStorage->refs += 1;
+        NetworkBuffer *pClone = new NetworkBuffer(pBuffer->m_pStorage, pBuffer->m_pData, pBuffer->m_Length);
+
+        if(pTail)
+            pTail->m_pNext = pClone;
+        else
+            pHead = pClone;
+        pTail = pClone;
+    }
+
+    pHead->m_SegmentSize = m_SegmentSize;
+    pHead->m_bChecksumValid = m_bChecksumValid;
+    return pHead;
+}
+
+size_t NetworkBuffer::getTotalLength() const
+{
+    size_t nBytes = 0;
+    for(const NetworkBuffer *pBuffer = this; pBuffer; pBuffer = pBuffer->m_pNext)
+        nBytes += pBuffer->m_Length;
+    return nBytes;
+}
+
+bool NetworkBuffer::reallocate(size_t headroom, size_t tailroom)
+{
+    Storage *pStorage = allocateStorage(headroom + m_Length + tailroom);
+    if(!pStorage->pBase)
+    {
+        delete pStorage;
+        return false;
+    }
+
+    uint8_t *pData = pStorage->pBase + headroom;
+    memcpy(pData, m_pData, m_Length);
+
+    releaseStorage(m_pStorage);
+    m_pStorage = pStorage;
+    m_pData = pData;
+    return true;
+}
+
+uint8_t *NetworkBuffer::push(size_t nBytes)
+{
+    if(isShared() || (getHeadroom() < nBytes))
+    {
+        size_t headroom = getHeadroom();
+        if(headroom < nBytes)
+            headroom = nBytes + NETWORK_BUFFER_HEADROOM;
+        if(!reallocate(headroom, getTailroom()))
+            return 0;
+    }
+
+    m_pData -= nBytes;
+    m_Length += nBytes;
+    return m_pData;
+}
+
+uint8_t *NetworkBuffer::pull(size_t nBytes)
+{
+    if(nBytes > m_Length)
+        return 0;
+
+    m_pData += nBytes;
+    m_Length -= nBytes;
+    return m_pData;
+}
+
+uint8_t *NetworkBuffer::put(size_t nBytes)
+{
+    if(isShared() || (getTailroom() < nBytes))
+    {
+        size_t tailroom = getTailroom();
+        if(tailroom < nBytes)
+            tailroom = nBytes;
+        if(!reallocate(getHeadroom(), tailroom))
+            return 0;
+    }
+
+    uint8_t *pTail = m_pData + m_Length;
+    m_Length += nBytes;
+    return pTail;
+}
+
+void NetworkBuffer::trim(size_t nBytes)
+{
+    NetworkBuffer *pBuffer = this;
+    while(pBuffer->m_Length < nBytes)
+    {
+        nBytes -= pBuffer->m_Length;
+        if(!pBuffer->m_pNext)
+            return;
+        pBuffer = pBuffer->m_pNext;
+    }
+
+    pBuffer->m_Length = nBytes;
+    if(pBuffer->m_pNext)
+    {
+        pBuffer->m_pNext->release();
+        pBuffer->m_pNext = 0;
+    }
+}
+
+void NetworkBuffer::append(NetworkBuffer *pFragment)
+{
+    if(!pFragment)
+        return;
+
+    NetworkBuffer *pTail = this;
+    while(pTail->m_pNext)
+        pTail = pTail->m_pNext;
+    pTail->m_pNext = pFragment;
+}
+
+bool NetworkBuffer::linearise()
+{
+    if(isLinear())
+        return true;
+
+    size_t nBytes = getTotalLength();
+    if((nBytes - m_Length) <= getTailroom() && !isShared())
+    {
+        // Everything fits after the first fragment's data already.
+        copyOut(m_Length, m_pData + m_Length, nBytes - m_Length);
+    }
+    else
+    {
+        Storage *pStorage = allocateStorage(getHeadroom() + nBytes);
+        if(!pStorage->pBase)
+        {
+            delete pStorage;
+            return false;
+        }
+
+        uint8_t *pData = pStorage->pBase + getHeadroom();
+        copyOut(0, pData, nBytes);
+
+        releaseStorage(m_pStorage);
+        m_pStorage = pStorage;
+        m_pData = pData;
+    }
+
+    m_Length = nBytes;
+    m_pNext->release();
+    m_pNext = 0;
+    return true;
+}
+
+size_t NetworkBuffer::copyOut(size_t offset, void *pDest, size_t nBytes) const
+{
+    uint8_t *pOut = reinterpret_cast<uint8_t *>(pDest);
+    size_t nCopied = 0;
+    for(const NetworkBuffer *pBuffer = this; pBuffer && (nCopied < nBytes); pBuffer = pBuffer->m_pNext)
+    {
+        if(offset >= pBuffer->m_Length)
+        {
+            offset -= pBuffer->m_Length;
+            continue;
+        }
+
+        size_t n = pBuffer->m_Length - offset;
+        if(n > (nBytes - nCopied))
+            n = nBytes - nCopied;
+
+        memcpy(pOut + nCopied, pBuffer->m_pData + offset, n);
+        nCopied += n;
+        offset = 0;
+    }
+
+    return nCopied;
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <utilities/Lz4.h>
+#include <utilities/utility.h>
+
+#define LZ4_FRAME_MAGIC         0x184D2204
+
+#define LZ4_FLG_VERSION_SHIFT   6
+#define LZ4_FLG_BLOCK_CHECKSUM  0x10
+#define LZ4_FLG_CONTENT_SIZE    0x08
+#define LZ4_FLG_DICT_ID         0x01
+
+#define LZ4_BLOCK_UNCOMPRESSED  0x80000000
+
+#define LZ4_MIN_MATCH           4
+
+#define LZ4_ERROR               (~static_cast<size_t>(0))
+
+// Frames are little-endian regardless of the host, and fields aren't aligned.
+static uint32_t readLe32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static uint64_t readLe64(const uint8_t *p)
+{
+    return readLe32(p) | (static_cast<uint64_t>(readLe32(p + 4)) << 32);
+}
+
+bool Lz4Frame::isFrame(const uint8_t *pIn, size_t inLen)
+{
+    return (inLen >= 4) && (readLe32(pIn) == LZ4_FRAME_MAGIC);
+}
+
+size_t Lz4Frame::getDecompressedSize(const uint8_t *pIn, size_t inLen)
+{
+    if(!isFrame(pIn, inLen) || (inLen < 7))
+        return LZ4_ERROR;
+
+    uint8_t flg = pIn[4];
+    if((flg & LZ4_FLG_CONTENT_SIZE) && (inLen >= 14))
+        return readLe64(&pIn[6]);
+
+    // No size in the header: walk the frame without writing anything.
+    return decompress(pIn, inLen, 0, LZ4_ERROR);
+}
+
+size_t Lz4Frame::decompress(const uint8_t *pIn, size_t inLen, uint8_t *pOut, size_t outLen)
+{
+    if(!isFrame(pIn, inLen) || (inLen < 7))
+        return LZ4_ERROR;
+
+    uint8_t flg = pIn[4];
+    if((flg >> LZ4_FLG_VERSION_SHIFT) != 1)
+        return LZ4_ERROR;
+
+    // Dictionaries would have to be supplied externally, which we can't do.
+    if(flg & LZ4_FLG_DICT_ID)
+        return LZ4_ERROR;
+
+    // Magic, FLG, BD, optional content size, header checksum.
+    size_t ip = 6;
+    if(flg & LZ4_FLG_CONTENT_SIZE)
+        ip += 8;
+    ip += 1;
+
+    size_t op = 0;
+    while(true)
+    {
+        if((ip > inLen) || ((inLen - ip) < 4))
+            return LZ4_ERROR;
+
+        uint32_t blockSize = readLe32(&pIn[ip]);
+        ip += 4;
+
+        // EndMark. A content checksum may follow, which we don't check.
+        if(!blockSize)
+            break;
+
+        bool bRaw = blockSize & LZ4_BLOCK_UNCOMPRESSED;
+        blockSize &= ~LZ4_BLOCK_UNCOMPRESSED;
+        if(blockSize > (inLen - ip))
+            return LZ4_ERROR;
+
+        if(bRaw)
+        {
+            if(blockSize > (outLen - op))
+                return LZ4_ERROR;
+            if(pOut)
+                memcpy(pOut + op, &pIn[ip], blockSize);
+            op += blockSize;
+        }
+        else
+        {
+            // Linked blocks may refer back into earlier blocks, which works
+            // because every block lands in the same contiguous output.
+            size_t n = decompressBlock(&pIn[ip], blockSize, pOut, op, outLen);
+            if(n == LZ4_ERROR)
+                return LZ4_ERROR;
+            op += n;
+        }
+
+        ip += blockSize;
+        if(flg & LZ4_FLG_BLOCK_CHECKSUM)
+            ip += 4;
+    }
+
+    return op;
+}
+
+size_t Lz4Frame::decompressBlock(const uint8_t *pIn, size_t inLen,
+                                 uint8_t *pOutBase, size_t outOffset, size_t outLen)
+{
+    size_t ip = 0;
+    size_t op = outOffset;
+
+    while(ip < inLen)
+    {
+        uint8_t token = pIn[ip++];
+
+        // Literals.
+        size_t litLen = token >> 4;
+        if(litLen == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if(ip >= inLen)
+                    return LZ4_ERROR;
+                b = pIn[ip++];
+                litLen += b;
+            } while(b == 255);
+        }
+
+        if((litLen > (inLen - ip)) || (litLen > (outLen - op)))
+            return LZ4_ERROR;
+        if(pOutBase)
+            memcpy(pOutBase + op, &pIn[ip], litLen);
+        ip += litLen;
+        op += litLen;
+
+        // The last sequence of a block is literals only.
+        if(ip == inLen)
+            break;
+
+        // Match.
+        if((inLen - ip) < 2)
+            return LZ4_ERROR;
+        size_t offset = pIn[ip] | (pIn[ip + 1] << 8);
+        ip += 2;
+        if(!offset || (offset > op))
+            return LZ4_ERROR;
+
+        size_t matchLen = token & 0xF;
+        if(matchLen == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if(ip >= inLen)
+                    return LZ4_ERROR;
+                b = pIn[ip++];
+                matchLen += b;
+            } while(b == 255);
+        }
+        matchLen += LZ4_MIN_MATCH;
+
+        if(matchLen > (outLen - op))
+            return LZ4_ERROR;
+
+        if(pOutBase)
+        {
+            // A match overlapping its own output (offset < length) encodes a
+            // repeating run and has to be copied a byte at a time.
+            uint8_t *pDest = pOutBase + op;
+            const uint8_t *pSrc = pDest - offset;
+            if(offset >= matchLen)
+                memcpy(pDest, pSrc, matchLen);
+            else
+            {
+                for(size_t i = 0; i < matchLen; ++i)
+                    pDest[i] = pSrc[i];
+            }
+        }
+        op += matchLen;
+    }
+
+    return op - outOffset;
+}
@@ -0,0 +1,198 @@
+/*
+ * 
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <utilities/SampleProfiler.h>
+#include <machine/Machine.h>
+#include <machine/Timer.h>
+#include <machine/SchedulerTimer.h>
+#include <processor/Processor.h>
+#include <processor/VirtualAddressSpace.h>
+#ifdef THREADS
+#include <process/Thread.h>
+#include <process/Process.h>
+#endif
+
+/// Furthest apart two frames on the same stack are expected to be. The
+/// walk stops at anything further, which is where the chain goes off the
+/// stack (or into another one - a syscall's kernel frames don't lead back
+/// into the user stack, but the user's frame pointer can look like they do).
+#define PROFILE_MAX_FRAME   0x10000
+
+struct ProfileSlot
+{
+    /** n + 1 while the slot holds sample n, zero while it's being written. */
+    volatile size_t sequence;
+    SampleProfiler::Sample sample;
+};
+
+struct ProfileRing
+{
+    /** Samples ever taken; the next goes at head % PROFILE_SAMPLES. */
+    volatile size_t head;
+    ProfileSlot slots[PROFILE_SAMPLES];
+};
+
+static ProfileRing g_ProfileRings[PROFILE_CPUS];
+
+SampleProfiler SampleProfiler::m_Instance;
+
+SampleProfiler::SampleProfiler() :
+    m_bRunning(false), m_Frequency(0)
+{
+}
+
+bool SampleProfiler::start(size_t hz)
+{
+    SchedulerTimer *pTimer = Machine::instance().getSchedulerTimer();
+    if (!pTimer)
+        return false;
+
+    if (!m_bRunning)
+        clear();
+
+    m_bRunning = true;
+    size_t frequency = pTimer->setSampleRate(hz ? hz : PROFILE_DEFAULT_HZ);
+    if (!frequency)
+    {
+        m_bRunning = false;
+        return false;
+    }
+
+    m_Frequency = frequency;
+    return true;
+}
+
+void SampleProfiler::stop()
+{
+    m_bRunning = false;
+
+    SchedulerTimer *pTimer = Machine::instance().getSchedulerTimer();
+    if (pTimer)
+        pTimer->setSampleRate(0);
+}
+
+void SampleProfiler::clear()
+{
+    for (size_t i = 0; i < PROFILE_CPUS; i++)
+    {
+        ProfileRing &ring = g_ProfileRings[i];
+        ring.head = 0;
+        for (size_t j = 0; j < PROFILE_SAMPLES; j++)
+            ring.slots[j].sequence = 0;
+    }
+    __sync_synchronize();
+}
+
+size_t SampleProfiler::getCount(size_t cpu) const
+{
+    if (cpu >= PROFILE_CPUS)
+        return 0;
+    return g_ProfileRings[cpu].head;
+}
+
+size_t SampleProfiler::getFirst(size_t cpu) const
+{
+    size_t count = getCount(cpu);
+    return (count < PROFILE_SAMPLES) ? 0 : (count - PROFILE_SAMPLES);
+}
+
+bool SampleProfiler::getSample(size_t cpu, size_t n, Sample &sample) const
+{
+    if (cpu >= PROFILE_CPUS)
+        return false;
+
+    const ProfileSlot &slot = g_ProfileRings[cpu].slots[n % PROFILE_SAMPLES];
+    if (slot.sequence != (n + 1))
+        return false;
+    __sync_synchronize();
+
+    sample = slot.sample;
+
+    // If it's been taken over in the meantime, the copy may be torn.
+    __sync_synchronize();
+    return slot.sequence == (n + 1);
+}
+
+/** Follows the frame pointer chain up from 'base', filling in return
+ *  addresses. Returns how many were found. */
+static size_t walkFrames(uintptr_t base, uintptr_t *pFrames, size_t nFrames)
+{
+    // isMapped takes the address space's lock, but that's always held with
+    // interrupts off, so it can't be what the timer interrupted.
+    VirtualAddressSpace &va = Processor::information().getVirtualAddressSpace();
+
+    size_t n = 0;
+    while ((n < nFrames) && base && !(base & (sizeof(uintptr_t) - 1)))
+    {
+        if (!va.isMapped(reinterpret_cast<void*>(base)) ||
+            !va.isMapped(reinterpret_cast<void*>(base + sizeof(uintptr_t))))
+            break;
+
+        uintptr_t *pFrame = reinterpret_cast<uintptr_t*>(base);
+        uintptr_t returnAddress = pFrame[1];
+        if (!returnAddress)
+            break;
+        pFrames[n++] = returnAddress;
+
+        // Callers' frames are further up the stack.
+        uintptr_t next = pFrame[0];
+        if ((next <= base) || ((next - base) > PROFILE_MAX_FRAME))
+            break;
+        base = next;
+    }
+
+    return n;
+}
+
+void SampleProfiler::sample(InterruptState &state)
+{
+    if (!m_bRunning)
+        return;
+
+    size_t cpu = Processor::id();
+    ProfileRing &ring = g_ProfileRings[(cpu < PROFILE_CPUS) ? cpu : (PROFILE_CPUS - 1)];
+    size_t n = __sync_fetch_and_add(&ring.head, 1);
+    ProfileSlot &slot = ring.slots[n % PROFILE_SAMPLES];
+
+    slot.sequence = 0;
+    __sync_synchronize();
+
+    Sample &s = slot.sample;
+    Timer *pTimer = Machine::instance().getTimer();
+    s.timestamp = pTimer ? pTimer->getTickCount() : 0;
+    s.thread = 0;
+    s.process = 0;
+#ifdef THREADS
+    Thread *pThread = Processor::information().getCurrentThread();
+    if (pThread)
+    {
+        s.thread = pThread->getId();
+        if (pThread->getParent())
+            s.process = pThread->getParent()->getId();
+    }
+#endif
+    s.cpu = cpu;
+    s.bUser = !state.kernelMode();
+    s.frames[0] = state.getInstructionPointer();
+    s.depth = 1 + walkFrames(state.getBasePointer(), &s.frames[1], PROFILE_DEPTH - 1);
+
+    __sync_synchronize();
+    slot.sequence = n + 1;
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <utilities/TimerWheel.h>
+#include <processor/Processor.h>
+
+#define SLOT_MASK (TIMERWHEEL_SLOTS - 1)
+
+/// Furthest ahead (in ticks) the last level can hold.
+#define MAX_TICKS ((1ULL << (TIMERWHEEL_SLOT_BITS * TIMERWHEEL_LEVELS)) - 1)
+
+TimerWheel::TimerWheel(uint32_t tickLength) :
+    m_TickLength(static_cast<uint64_t>(tickLength ? tickLength : 1) * 1000000ULL),
+    m_Nanoseconds(0), m_Now(0), m_pExpired(0), m_pRunning(0), m_nEntries(0),
+    m_Lock()
+{
+    for (size_t level = 0; level < TIMERWHEEL_LEVELS; ++level)
+        for (size_t slot = 0; slot < TIMERWHEEL_SLOTS; ++slot)
+            m_pSlots[level][slot] = 0;
+}
+
+TimerWheel::~TimerWheel()
+{
+}
+
+void TimerWheel::schedule(Entry *pEntry, uint64_t milliseconds)
+{
+    uint64_t tickLength = m_TickLength / 1000000ULL;
+    uint64_t ticks = (milliseconds + tickLength - 1) / tickLength;
+
+    m_Lock.acquire();
+
+    if (pEntry->isPending())
+        remove(pEntry);
+    else
+        ++m_nEntries;
+
+    // m_Now is processed on the very next tick, which could be any moment,
+    // so count from the one after to make sure at least 'milliseconds' pass.
+    pEntry->m_Expires = m_Now + (ticks ? ticks : 1);
+    add(pEntry);
+
+    m_Lock.release();
+}
+
+bool TimerWheel::cancel(Entry *pEntry)
+{
+    m_Lock.acquire();
+
+    bool bPending = pEntry->isPending();
+    if (bPending)
+    {
+        remove(pEntry);
+        --m_nEntries;
+    }
+
+    m_Lock.release();
+    return bPending;
+}
+
+void TimerWheel::cancelAndWait(Entry *pEntry)
+{
+    cancel(pEntry);
+
+    // The callback runs without the lock held, so it may have been picked
+    // off the expired list just before we got to it.
+    while (m_pRunning == pEntry)
+        Processor::pause();
+}
+
+void TimerWheel::tick(uint64_t delta)
+{
+    m_Lock.acquire();
+
+    m_Nanoseconds += delta;
+    while (m_Nanoseconds >= m_TickLength)
+    {
+        m_Nanoseconds -= m_TickLength;
+
+        // Each time a level wraps around, the next slot of the level above
+        // is due to be spread out over it.
+        size_t index = m_Now & SLOT_MASK;
+        if (!index)
+        {
+            for (size_t level = 1; level < TIMERWHEEL_LEVELS; ++level)
+            {
+                if (cascade(level))
+                    break;
+            }
+        }
+
+        ++m_Now;
+
+        Entry **pSlot = &m_pSlots[0][index];
+        while (*pSlot)
+        {
+            Entry *pEntry = *pSlot;
+            remove(pEntry);
+            link(&m_pExpired, pEntry);
+        }
+    }
+
+    // Run the batch. The lock is dropped for each callback so it can
+    // schedule and cancel timers (its own included) as it likes.
+    while (m_pExpired)
+    {
+        Entry *pEntry = m_pExpired;
+        remove(pEntry);
+        --m_nEntries;
+
+        m_pRunning = pEntry;
+        m_Lock.release();
+
+        pEntry->expired();
+
+        m_Lock.acquire();
+        m_pRunning = 0;
+    }
+
+    m_Lock.release();
+}
+
+void TimerWheel::add(Entry *pEntry)
+{
+    uint64_t expires = pEntry->m_Expires;
+    Entry **pSlot = 0;
+
+    if (expires < m_Now)
+    {
+        // Already overdue - goes out on the next tick.
+        pSlot = &m_pSlots[0][m_Now & SLOT_MASK];
+    }
+    else
+    {
+        uint64_t delta = expires - m_Now;
+        if (delta > MAX_TICKS)
+        {
+            expires = m_Now + MAX_TICKS;
+            pEntry->m_Expires = expires;
+            delta = MAX_TICKS;
+        }
+
+        size_t level = 0;
+        while ((level < (TIMERWHEEL_LEVELS - 1)) &&
+               (delta >= (1ULL << (TIMERWHEEL_SLOT_BITS * (level + 1)))))
+            ++level;
+
+        pSlot = &m_pSlots[level][(expires >> (TIMERWHEEL_SLOT_BITS * level)) & SLOT_MASK];
+    }
+
+    link(pSlot, pEntry);
+}
+
+void TimerWheel::remove(Entry *pEntry)
+{
+    if (pEntry->m_pPrev)
+        pEntry->m_pPrev->m_pNext = pEntry->m_pNext;
+    else
+        *pEntry->m_pSlot = pEntry->m_pNext;
+    if (pEntry->m_pNext)
+        pEntry->m_pNext->m_pPrev = pEntry->m_pPrev;
+
+    pEntry->m_pPrev = pEntry->m_pNext = 0;
+    pEntry->m_pSlot = 0;
+}
+
+void TimerWheel::link(Entry **pSlot, Entry *pEntry)
+{
+    pEntry->m_pPrev = 0;
+    pEntry->m_pNext = *pSlot;
+    if (*pSlot)
+        (*pSlot)->m_pPrev = pEntry;
+    *pSlot = pEntry;
+    pEntry->m_pSlot = pSlot;
+}
+
+size_t TimerWheel::cascade(size_t level)
+{
+    size_t index = (m_Now >> (TIMERWHEEL_SLOT_BITS * level)) & SLOT_MASK;
+
+    // Detach the whole slot first: entries can land back in this very slot
+    // if they're clamped, and shouldn't be seen twice.
+    Entry *pList = m_pSlots[level][index];
+    m_pSlots[level][index] = 0;
+
+    while (pList)
+    {
+        Entry *pEntry = pList;
+        pList = pEntry->m_pNext;
+        pEntry->m_pPrev = pEntry->m_pNext = 0;
+        add(pEntry);
+    }
+
+    return index;
+}
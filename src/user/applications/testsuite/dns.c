@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+extern void fail();
+
+// Stub servers on loopback: A never answers, B answers everything.
+#define STUB_PORT_A     5301
+#define STUB_PORT_B     5302
+
+// Questions each stub has been asked so far.
+static int asked_a = 0;
+static int asked_b = 0;
+
+// The stub tells us about each question it gets through this pipe.
+static int stub_pipe = -1;
+
+static void put16(unsigned char *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    put16(p, v >> 16);
+    put16(p + 2, v & 0xFFFF);
+}
+
+// Writes a resource record for the question's name (by pointer).
+static size_t put_record(unsigned char *p, uint16_t type, uint32_t ttl, const unsigned char *data, uint16_t len)
+{
+    put16(p, 0xC00C);
+    put16(p + 2, type);
+    put16(p + 4, 1);
+    put32(p + 6, ttl);
+    put16(p + 10, len);
+    memcpy(p + 12, data, len);
+    return 12 + len;
+}
+
+// Builds B's reply to a query, returning its length (0 for no reply).
+static size_t stub_answer(unsigned char *msg, size_t len)
+{
+    // Header, then the question: labels, type and class.
+    size_t q = 12;
+    while(q < len && msg[q])
+        q += msg[q] + 1;
+    if((q + 5) > len)
+        return 0;
+
+    uint16_t type = (msg[q + 1] << 8) | msg[q + 2];
+    size_t end = q + 5;
+    const char *label = (const char *) &msg[13];
+
+    unsigned char rcode = 0;
+    uint16_t nAnswers = 0, nAuthority = 0;
+    size_t off = end;
+
+    if(!strncmp(label, "nx-", 3))
+    {
+        // No such name; the SOA says how long to remember that for.
+        static const unsigned char soa[] = {
+            0, 0,                   /* mname, rname: the root */
+            0, 0, 0, 1,             /* serial */
+            0, 0, 0x0E, 0x10,       /* refresh */
+            0, 0, 0x0E, 0x10,       /* retry */
+            0, 0, 0x0E, 0x10,       /* expire */
+            0, 0, 0, 60,            /* minimum */
+        };
+        rcode = 3;
+        off += put_record(&msg[off], 6, 60, soa, sizeof(soa));
+        nAuthority = 1;
+    }
+    else if(type == 1)
+    {
+        unsigned char addr[4] = {10, 1, 2, 3};
+        uint32_t ttl = 60;
+
+        // Short-lived, to watch it expire.
+        if(!strncmp(label, "hit-", 4))
+            ttl = 1;
+
+        // Slow, so a second lookup has time to find this one in flight.
+        if(!strncmp(label, "slow-", 5))
+        {
+            addr[3] = 4;
+            usleep(1000000);
+        }
+
+        off += put_record(&msg[off], 1, ttl, addr, sizeof(addr));
+        nAnswers = 1;
+    }
+
+    // Anything else (AAAA) exists but has no records.
+    put16(&msg[2], 0x8180 | rcode);
+    put16(&msg[6], nAnswers);
+    put16(&msg[8], nAuthority);
+    put16(&msg[10], 0);
+    return off;
+}
+
+static void stub_server(int sock_a, int sock_b, int report, pid_t parent)
+{
+    unsigned char msg[512];
+
+    while(1)
+    {
+        // Don't outlive the test if it fails part way.
+        if(kill(parent, 0) < 0)
+            return;
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(sock_a, &fds);
+        FD_SET(sock_b, &fds);
+        int maxfd = sock_a > sock_b ? sock_a : sock_b;
+        struct timeval tv = {1, 0};
+        if(select(maxfd + 1, &fds, 0, 0, &tv) <= 0)
+            continue;
+
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+
+        if(FD_ISSET(sock_a, &fds))
+        {
+            recvfrom(sock_a, msg, sizeof(msg), 0, (struct sockaddr *) &from, &fromlen);
+            write(report, "a", 1);
+        }
+
+        if(FD_ISSET(sock_b, &fds))
+        {
+            fromlen = sizeof(from);
+            ssize_t n = recvfrom(sock_b, msg, sizeof(msg), 0, (struct sockaddr *) &from, &fromlen);
+            if(n < 12)
+                continue;
+            write(report, "b", 1);
+
+            size_t len = stub_answer(msg, n);
+            if(len)
+                sendto(sock_b, msg, len, 0, (struct sockaddr *) &from, fromlen);
+        }
+    }
+}
+
+static int stub_socket(uint16_t port)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock < 0)
+        return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// Catches up on what the stubs have been asked.
+static void count_questions()
+{
+    while(1)
+    {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(stub_pipe, &fds);
+        struct timeval tv = {0, 0};
+        if(select(stub_pipe + 1, &fds, 0, 0, &tv) <= 0)
+            break;
+
+        char c;
+        if(read(stub_pipe, &c, 1) != 1)
+            break;
+        if(c == 'a')
+            ++asked_a;
+        else
+            ++asked_b;
+    }
+}
+
+static void use_servers(int both)
+{
+    struct sockaddr_in servers[2];
+    memset(servers, 0, sizeof(servers));
+    servers[0].sin_family = servers[1].sin_family = AF_INET;
+    servers[0].sin_addr.s_addr = servers[1].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    servers[0].sin_port = htons(both ? STUB_PORT_A : STUB_PORT_B);
+    servers[1].sin_port = htons(STUB_PORT_B);
+    if(set_dns_servers(servers, both ? 2 : 1) < 0)
+        fail();
+}
+
+// Looks name up, checking the last byte of the address if it's found.
+static int lookup(const char *name, int last)
+{
+    struct hostent *h = gethostbyname(name);
+    if(!h)
+        return 0;
+    if(((unsigned char *) h->h_addr)[3] != last)
+        fail();
+    return 1;
+}
+
+static void status(const char *s)
+{
+    printf("%s", s);
+    fflush(stdout);
+}
+
+void test_dns()
+{
+    char name[64];
+    int before;
+
+    printf("Testing the DNS resolver...\n");
+
+    // Names are unique to this run, as the cache outlives us.
+    int id = getpid();
+
+    int sock_a = stub_socket(STUB_PORT_A);
+    int sock_b = stub_socket(STUB_PORT_B);
+    int fds[2];
+    if(sock_a < 0 || sock_b < 0 || pipe(fds) < 0)
+        fail();
+
+    pid_t parent = getpid();
+    pid_t stub = fork();
+    if(stub == 0)
+    {
+        close(fds[0]);
+        stub_server(sock_a, sock_b, fds[1], parent);
+        _exit(0);
+    }
+    close(fds[1]);
+    close(sock_a);
+    close(sock_b);
+    stub_pipe = fds[0];
+
+    struct sockaddr_in none;
+    if(set_dns_servers(&none, 0) < 0)
+    {
+        printf("Can't point the resolver at a local server (not root?), skipping.\n");
+        kill(stub, SIGTERM);
+        waitpid(stub, 0, 0);
+        close(stub_pipe);
+        return;
+    }
+
+    use_servers(0);
+
+    // Answered, then cached, then gone once the TTL is up.
+    status("Positive answer and expiry... ");
+    sprintf(name, "hit-%d.test", id);
+    if(!lookup(name, 3))
+        fail();
+    count_questions();
+    before = asked_b;
+    if(!before || !lookup(name, 3))
+        fail();
+    count_questions();
+    if(asked_b != before)
+        fail();
+    sleep(2);
+    if(!lookup(name, 3))
+        fail();
+    count_questions();
+    if(asked_b == before)
+        fail();
+    status("OK\n");
+
+    // NXDOMAIN is remembered for the SOA's TTL.
+    status("Negative caching... ");
+    sprintf(name, "nx-%d.test", id);
+    if(lookup(name, 0))
+        fail();
+    count_questions();
+    before = asked_b;
+    if(!before || lookup(name, 0))
+        fail();
+    count_questions();
+    if(asked_b != before)
+        fail();
+    status("OK\n");
+
+    // Two lookups of the same name at once share one query.
+    status("Coalescing... ");
+    sprintf(name, "slow-%d.test", id);
+    count_questions();
+    before = asked_b;
+    pid_t other = fork();
+    if(other == 0)
+        _exit(lookup(name, 4) ? 0 : 1);
+    usleep(200000);
+    int ok = lookup(name, 4);
+    int rc = -1;
+    waitpid(other, &rc, 0);
+    if(!ok || !WIFEXITED(rc) || WEXITSTATUS(rc))
+        fail();
+    count_questions();
+    // One lookup asks for A and AAAA.
+    if((asked_b - before) != 2)
+        fail();
+    status("OK\n");
+
+    // A server that never answers is given up on for the next.
+    status("Failover... ");
+    use_servers(1);
+    sprintf(name, "failover-%d.test", id);
+    count_questions();
+    int before_a = asked_a;
+    before = asked_b;
+    if(!lookup(name, 3))
+        fail();
+    count_questions();
+    if(asked_a == before_a || asked_b == before)
+        fail();
+    status("OK\n");
+
+    set_dns_servers(&none, 0);
+    kill(stub, SIGTERM);
+    waitpid(stub, 0, 0);
+    close(stub_pipe);
+
+    printf("DNS resolver test was successful!\n");
+}
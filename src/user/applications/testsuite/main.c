@@ -22,6 +22,9 @@
 #include <setjmp.h>
 
 extern void test_mprotect();
+extern void test_dns();
+extern void test_unix_sockets();
+extern void test_udp();
 
 static jmp_buf buf;
 
@@ -42,6 +45,9 @@ int main(int argc, char *argv[])
 
     // Add calls to test functions here...
     test_mprotect();
+    test_dns();
+    test_unix_sockets();
+    test_udp();
 
     printf("Tests complete!\n");
     return 0;
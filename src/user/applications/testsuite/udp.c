@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+extern void fail();
+
+#define PORT_BATCH      5311
+#define PORT_RCVBUF     5312
+#define PORT_REUSE      5313
+
+#define FLOOD_COUNT     32
+#define REUSE_SENDERS   16
+
+static void status(const char *s)
+{
+    printf("%s", s);
+    fflush(stdout);
+}
+
+static void loopback(struct sockaddr_in *addr, uint16_t port)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+static int udp_socket(uint16_t port, int reuse)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock < 0)
+        fail();
+
+    if(reuse && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+        fail();
+
+    if(port)
+    {
+        struct sockaddr_in addr;
+        loopback(&addr, port);
+        if(bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            fail();
+    }
+
+    return sock;
+}
+
+// Drops the kernel has counted against the endpoint on the given port, from
+// the UDP half of /dev/sockstat.
+static int endpoint_drops(uint16_t port)
+{
+    static char buf[8192];
+    int fd = open("/dev/sockstat", O_RDONLY);
+    if(fd < 0)
+        fail();
+
+    size_t len = 0;
+    ssize_t n;
+    while(len < (sizeof(buf) - 1) && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+        len += n;
+    buf[len] = 0;
+    close(fd);
+
+    char *line = strstr(buf, "UDP\n");
+    if(!line)
+        fail();
+
+    while((line = strchr(line, '\n')))
+    {
+        ++line;
+
+        unsigned int local, queued, count, rcvbuf, drops;
+        char remote[64];
+        if(sscanf(line, "%u %63s %u %u %u %u", &local, remote, &queued, &count, &rcvbuf, &drops) != 6)
+            continue;
+        if(local == port)
+            return drops;
+    }
+
+    fail();
+    return -1;
+}
+
+void test_udp()
+{
+    char buf[2048];
+    struct sockaddr_in addr;
+
+    printf("Testing UDP batching and queues...\n");
+
+    // Several datagrams in one sendmmsg, taken back in one recvmmsg.
+    status("sendmmsg/recvmmsg... ");
+    int rx = udp_socket(PORT_BATCH, 0);
+    int tx = udp_socket(0, 0);
+    loopback(&addr, PORT_BATCH);
+
+    static const char *msgs[3] = {"first", "second datagram", "3"};
+    struct iovec iov[4];
+    struct mmsghdr hdrs[4];
+    memset(hdrs, 0, sizeof(hdrs));
+    for(int i = 0; i < 3; ++i)
+    {
+        iov[i].iov_base = (void *) msgs[i];
+        iov[i].iov_len = strlen(msgs[i]);
+        hdrs[i].msg_hdr.msg_iov = &iov[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+        hdrs[i].msg_hdr.msg_name = &addr;
+        hdrs[i].msg_hdr.msg_namelen = sizeof(addr);
+    }
+    if(sendmmsg(tx, hdrs, 3, 0) != 3)
+        fail();
+
+    // Loopback delivery is asynchronous; recvmmsg only waits for the first.
+    usleep(200000);
+
+    char rxbuf[4][64];
+    struct sockaddr_in from[4];
+    memset(hdrs, 0, sizeof(hdrs));
+    for(int i = 0; i < 4; ++i)
+    {
+        iov[i].iov_base = rxbuf[i];
+        iov[i].iov_len = sizeof(rxbuf[i]);
+        hdrs[i].msg_hdr.msg_iov = &iov[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+        hdrs[i].msg_hdr.msg_name = &from[i];
+        hdrs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+    }
+    struct timespec timeout = {1, 0};
+    if(recvmmsg(rx, hdrs, 4, MSG_WAITFORONE, &timeout) != 3)
+        fail();
+    for(int i = 0; i < 3; ++i)
+    {
+        if(hdrs[i].msg_len != strlen(msgs[i]) || memcmp(rxbuf[i], msgs[i], hdrs[i].msg_len))
+            fail();
+        if(from[i].sin_addr.s_addr != htonl(INADDR_LOOPBACK))
+            fail();
+    }
+    close(rx);
+    status("OK\n");
+
+    // Flood a small queue: what doesn't fit is dropped and counted.
+    status("SO_RCVBUF drop accounting... ");
+    rx = udp_socket(PORT_RCVBUF, 0);
+    int size = 4096;
+    socklen_t optlen = sizeof(size);
+    if(setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+        fail();
+    size = 0;
+    if(getsockopt(rx, SOL_SOCKET, SO_RCVBUF, &size, &optlen) < 0 || size != 4096)
+        fail();
+
+    loopback(&addr, PORT_RCVBUF);
+    memset(buf, 'D', 1000);
+    for(int i = 0; i < FLOOD_COUNT; ++i)
+    {
+        if(sendto(tx, buf, 1000, 0, (struct sockaddr *) &addr, sizeof(addr)) != 1000)
+            fail();
+    }
+    usleep(200000);
+
+    int received = 0;
+    while(recv(rx, buf, sizeof(buf), MSG_DONTWAIT) == 1000)
+        ++received;
+    int drops = endpoint_drops(PORT_RCVBUF);
+    if(!received || !drops || (received + drops) > FLOOD_COUNT)
+        fail();
+    close(rx);
+    status("OK\n");
+
+    // Sockets sharing a port split the senders between them, and each
+    // sender's datagrams all go to the same socket.
+    status("SO_REUSEPORT... ");
+    int rxs[2];
+    rxs[0] = udp_socket(PORT_REUSE, 1);
+    rxs[1] = udp_socket(PORT_REUSE, 1);
+
+    int reuse = 0;
+    optlen = sizeof(reuse);
+    if(getsockopt(rxs[1], SOL_SOCKET, SO_REUSEPORT, &reuse, &optlen) < 0 || !reuse)
+        fail();
+
+    loopback(&addr, PORT_REUSE);
+    int senders[REUSE_SENDERS];
+    for(int i = 0; i < REUSE_SENDERS; ++i)
+    {
+        senders[i] = udp_socket(0, 0);
+        for(int j = 0; j < 2; ++j)
+        {
+            unsigned char id = i;
+            if(sendto(senders[i], &id, 1, 0, (struct sockaddr *) &addr, sizeof(addr)) != 1)
+                fail();
+        }
+    }
+    usleep(200000);
+
+    int owner[REUSE_SENDERS];
+    int got[2] = {0, 0};
+    for(int i = 0; i < REUSE_SENDERS; ++i)
+        owner[i] = -1;
+    for(int r = 0; r < 2; ++r)
+    {
+        unsigned char id;
+        while(recv(rxs[r], &id, 1, MSG_DONTWAIT) == 1)
+        {
+            if(id >= REUSE_SENDERS)
+                fail();
+            if(owner[id] == -1)
+                owner[id] = r;
+            else if(owner[id] != r)
+                fail();
+            ++got[r];
+        }
+    }
+    if(!got[0] || !got[1] || (got[0] + got[1]) != (REUSE_SENDERS * 2))
+        fail();
+
+    for(int i = 0; i < REUSE_SENDERS; ++i)
+        close(senders[i]);
+    close(rxs[0]);
+    close(rxs[1]);
+    close(tx);
+    status("OK\n");
+
+    printf("UDP test was successful!\n");
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2008-2014, Pedigree Developers
+ *
+ * Please see the CONTRIB file in the root of the source tree for a full
+ * list of contributors.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+extern void fail();
+
+static void status(const char *s)
+{
+    printf("%s", s);
+    fflush(stdout);
+}
+
+// Reads exactly len bytes from a stream, however it's split up.
+static void read_all(int fd, char *buf, size_t len)
+{
+    while(len)
+    {
+        ssize_t n = read(fd, buf, len);
+        if(n <= 0)
+            fail();
+        buf += n;
+        len -= n;
+    }
+}
+
+// Sends one byte with the given descriptors attached.
+static void send_fds(int sock, int *fds, int nfds)
+{
+    char cbuf[CMSG_SPACE(sizeof(int) * 2)];
+    char c = 'F';
+    struct iovec iov = {&c, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+    if(sendmsg(sock, &msg, 0) != 1)
+        fail();
+}
+
+// Receives one byte, with room for up to nfds descriptors. Returns how many
+// came, and the message flags.
+static int recv_fds(int sock, int *fds, int nfds, int *flags)
+{
+    char cbuf[CMSG_SPACE(sizeof(int) * 2)];
+    char c = 0;
+    struct iovec iov = {&c, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_LEN(sizeof(int) * nfds);
+
+    if(recvmsg(sock, &msg, 0) != 1 || c != 'F')
+        fail();
+    *flags = msg.msg_flags;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(!cmsg)
+        return 0;
+    if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        fail();
+
+    int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+    return n;
+}
+
+void test_unix_sockets()
+{
+    char buf[64];
+    int sv[2];
+
+    printf("Testing UNIX sockets...\n");
+
+    // A stream has no boundaries, and ends when the other side closes.
+    status("socketpair(SOCK_STREAM)... ");
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        fail();
+    if(write(sv[0], "abc", 3) != 3 || write(sv[0], "defg", 4) != 4)
+        fail();
+    read_all(sv[1], buf, 7);
+    if(memcmp(buf, "abcdefg", 7))
+        fail();
+    if(write(sv[1], "back", 4) != 4)
+        fail();
+    read_all(sv[0], buf, 4);
+    if(memcmp(buf, "back", 4))
+        fail();
+    close(sv[0]);
+    if(read(sv[1], buf, sizeof(buf)) != 0)
+        fail();
+    close(sv[1]);
+    status("OK\n");
+
+    // Records keep their boundaries.
+    status("socketpair(SOCK_SEQPACKET)... ");
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+        fail();
+    if(send(sv[0], "one", 3, 0) != 3 || send(sv[0], "three", 5, 0) != 5)
+        fail();
+    if(recv(sv[1], buf, sizeof(buf), 0) != 3 || memcmp(buf, "one", 3))
+        fail();
+    if(recv(sv[1], buf, sizeof(buf), 0) != 5 || memcmp(buf, "three", 5))
+        fail();
+    close(sv[0]);
+    close(sv[1]);
+    status("OK\n");
+
+    // Connecting to a listening socket by name.
+    const int types[2] = {SOCK_STREAM, SOCK_SEQPACKET};
+    for(int i = 0; i < 2; ++i)
+    {
+        status(types[i] == SOCK_STREAM ? "listen/accept (SOCK_STREAM)... " :
+                                         "listen/accept (SOCK_SEQPACKET)... ");
+
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        sprintf(addr.sun_path, "unix»/testsuite-%d-%d.sock", getpid(), i);
+
+        int server = socket(AF_UNIX, types[i], 0);
+        if(server < 0)
+            fail();
+        if(bind(server, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            fail();
+        if(listen(server, 4) < 0)
+            fail();
+
+        int client = socket(AF_UNIX, types[i], 0);
+        if(client < 0)
+            fail();
+        if(connect(client, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            fail();
+
+        int conn = accept(server, 0, 0);
+        if(conn < 0)
+            fail();
+
+        if(send(client, "ping", 4, 0) != 4)
+            fail();
+        read_all(conn, buf, 4);
+        if(memcmp(buf, "ping", 4))
+            fail();
+        if(send(conn, "pong", 4, 0) != 4)
+            fail();
+        read_all(client, buf, 4);
+        if(memcmp(buf, "pong", 4))
+            fail();
+
+        close(conn);
+        close(client);
+        close(server);
+        unlink(addr.sun_path);
+        status("OK\n");
+    }
+
+    // A passed descriptor refers to the same pipe as the original.
+    status("SCM_RIGHTS... ");
+    int p[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 || pipe(p) < 0)
+        fail();
+    send_fds(sv[0], &p[0], 1);
+    close(p[0]);
+
+    int fds[2], flags = 0;
+    if(recv_fds(sv[1], fds, 1, &flags) != 1 || (flags & MSG_CTRUNC))
+        fail();
+    if(write(p[1], "pipe", 4) != 4)
+        fail();
+    read_all(fds[0], buf, 4);
+    if(memcmp(buf, "pipe", 4))
+        fail();
+    close(fds[0]);
+    close(p[1]);
+    status("OK\n");
+
+    // Descriptors that don't fit are closed, and the caller is told.
+    status("SCM_RIGHTS with MSG_CTRUNC... ");
+    if(pipe(p) < 0)
+        fail();
+    send_fds(sv[0], p, 2);
+    close(p[0]);
+
+    if(recv_fds(sv[1], fds, 1, &flags) != 1 || !(flags & MSG_CTRUNC))
+        fail();
+
+    // The dropped write end must really be gone: with ours closed too, the
+    // pipe reports end-of-file.
+    close(p[1]);
+    if(read(fds[0], buf, sizeof(buf)) != 0)
+        fail();
+    close(fds[0]);
+    close(sv[0]);
+    close(sv[1]);
+    status("OK\n");
+
+    printf("UNIX socket test was successful!\n");
+}